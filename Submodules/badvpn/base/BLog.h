@@ -29,6 +29,18 @@
  * @section DESCRIPTION
  * 
  * A global object for logging.
+ * 
+ * Messages are normally formatted and passed to the backend by the thread
+ * logging them, under a global mutex. With {@link BLog_StartAsync}, each thread
+ * instead appends a binary record of the message to a buffer of its own, and a
+ * background thread formats the records and passes them to the backend.
+ * The record refers to the format strings by pointer, so in that mode they must
+ * remain valid until the message is written out, as string literals do. Strings
+ * passed as %s arguments and to BLog_AppendBytes are copied into the record,
+ * and may be freed as soon as the logging call returns.
+ * 
+ * Messages at levels above BLOG_MAX_LEVEL are compiled out. Building with
+ * BADVPN_BLOG_MAX_LEVEL defined lowers it from BLOG_DEBUG.
  */
 
 #ifndef BADVPN_BLOG_H
@@ -50,8 +62,17 @@
 #define BLOG_INFO 4
 #define BLOG_DEBUG 5
 
-#define BLog(...) BLog_LogToChannel(BLOG_CURRENT_CHANNEL, __VA_ARGS__)
-#define BContextLog(context, ...) BLog_ContextLog((context), BLOG_CURRENT_CHANNEL, __VA_ARGS__)
+#ifdef BADVPN_BLOG_MAX_LEVEL
+#define BLOG_MAX_LEVEL BADVPN_BLOG_MAX_LEVEL
+#else
+#define BLOG_MAX_LEVEL BLOG_DEBUG
+#endif
+
+// evaluates expr only if messages at level are compiled in
+#define BLOG_IF_COMPILED(level, expr) ((level) <= BLOG_MAX_LEVEL ? (void)(expr) : (void)0)
+
+#define BLog(level, ...) BLOG_IF_COMPILED((level), BLog_LogToChannel(BLOG_CURRENT_CHANNEL, (level), __VA_ARGS__))
+#define BContextLog(context, level, ...) BLOG_IF_COMPILED((level), BLog_ContextLog((context), BLOG_CURRENT_CHANNEL, (level), __VA_ARGS__))
 #define BLOG_CCCC(context) BLog_MakeChannelContext((context), BLOG_CURRENT_CHANNEL)
 
 typedef void (*_BLog_log_func) (int channel, int level, const char *msg);
@@ -70,6 +91,7 @@ struct _BLog_global {
     _BLog_log_func log_func;
     _BLog_free_func free_func;
     BMutex mutex;
+    int async;
 #ifndef NDEBUG
     int logging;
 #endif
@@ -118,6 +140,14 @@ static void BLog_ChannelContextLog (BLogChannelContext ccontext, int level, cons
 void BLog_InitStdout (void);
 void BLog_InitStderr (void);
 
+#if BADVPN_THREAD_SAFE
+// implemented in BLog_async.c
+void _BLogAsync_Begin (void);
+void _BLogAsync_AppendVarArg (const char *fmt, va_list vl);
+void _BLogAsync_AppendBytes (const char *data, size_t len);
+void _BLogAsync_Finish (int channel, int level);
+#endif
+
 int BLogGlobal_GetChannelByName (const char *channel_name)
 {
     int i;
@@ -143,6 +173,7 @@ void BLog_Init (_BLog_log_func log_func, _BLog_free_func free_func)
     
     blog_global.log_func = log_func;
     blog_global.free_func = free_func;
+    blog_global.async = 0;
 #ifndef NDEBUG
     blog_global.logging = 0;
 #endif
@@ -183,13 +214,20 @@ int BLog_WouldLog (int channel, int level)
     ASSERT(channel >= 0 && channel < BLOG_NUM_CHANNELS)
     ASSERT(level >= BLOG_ERROR && level <= BLOG_DEBUG)
     
-    return (level <= blog_global.channels[channel].loglevel);
+    return (level <= BLOG_MAX_LEVEL && level <= blog_global.channels[channel].loglevel);
 }
 
 void BLog_Begin (void)
 {
     ASSERT(blog_global.initialized)
     
+#if BADVPN_THREAD_SAFE
+    if (blog_global.async) {
+        _BLogAsync_Begin();
+        return;
+    }
+#endif
+    
     BMutex_Lock(&blog_global.mutex);
     
 #ifndef NDEBUG
@@ -201,6 +239,14 @@ void BLog_Begin (void)
 void BLog_AppendVarArg (const char *fmt, va_list vl)
 {
     ASSERT(blog_global.initialized)
+    
+#if BADVPN_THREAD_SAFE
+    if (blog_global.async) {
+        _BLogAsync_AppendVarArg(fmt, vl);
+        return;
+    }
+#endif
+    
 #ifndef NDEBUG
     ASSERT(blog_global.logging)
 #endif
@@ -219,9 +265,6 @@ void BLog_AppendVarArg (const char *fmt, va_list vl)
 void BLog_Append (const char *fmt, ...)
 {
     ASSERT(blog_global.initialized)
-#ifndef NDEBUG
-    ASSERT(blog_global.logging)
-#endif
     
     va_list vl;
     va_start(vl, fmt);
@@ -232,6 +275,14 @@ void BLog_Append (const char *fmt, ...)
 void BLog_AppendBytes (const char *data, size_t len)
 {
     ASSERT(blog_global.initialized)
+    
+#if BADVPN_THREAD_SAFE
+    if (blog_global.async) {
+        _BLogAsync_AppendBytes(data, len);
+        return;
+    }
+#endif
+    
 #ifndef NDEBUG
     ASSERT(blog_global.logging)
 #endif
@@ -249,13 +300,20 @@ void BLog_AppendBytes (const char *data, size_t len)
 void BLog_Finish (int channel, int level)
 {
     ASSERT(blog_global.initialized)
-#ifndef NDEBUG
-    ASSERT(blog_global.logging)
-#endif
     ASSERT(channel >= 0 && channel < BLOG_NUM_CHANNELS)
     ASSERT(level >= BLOG_ERROR && level <= BLOG_DEBUG)
     ASSERT(BLog_WouldLog(channel, level))
     
+#if BADVPN_THREAD_SAFE
+    if (blog_global.async) {
+        _BLogAsync_Finish(channel, level);
+        return;
+    }
+#endif
+    
+#ifndef NDEBUG
+    ASSERT(blog_global.logging)
+#endif
     ASSERT(blog_global.logbuf_pos >= 0)
     ASSERT(blog_global.logbuf_pos < sizeof(blog_global.logbuf))
     ASSERT(blog_global.logbuf[blog_global.logbuf_pos] == '\0')
@@ -0,0 +1,994 @@
+/**
+ * @file BLog_async.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <misc/debug.h>
+#include <misc/balign.h>
+
+#include "BLog_async.h"
+
+#include <generated/blog_channel_BLog.h>
+
+#ifndef BADVPN_PLUGIN
+
+// messages are limited to this much text, like in synchronous mode
+#define MESSAGE_MAX (sizeof(blog_global.logbuf) - 1)
+
+// maximum size of a record body
+#define RECORD_MAX 4096
+
+// alignment of records in the buffers
+#define RECORD_ALIGN 8
+
+// smallest buffer size
+#define BUFFER_MIN (4 * (sizeof(struct record_header) + RECORD_MAX))
+
+// maximum length of a rewritten conversion specification
+#define SPEC_MAX 48
+
+// record body items
+#define ITEM_FORMAT 1
+#define ITEM_BYTES 2
+
+// conversion argument types
+#define ARG_NONE 0
+#define ARG_CHAR 1
+#define ARG_SIGNED 2
+#define ARG_UNSIGNED 3
+#define ARG_DOUBLE 4
+#define ARG_LONG_DOUBLE 5
+#define ARG_POINTER 6
+#define ARG_STRING 7
+
+// length modifiers
+#define LEN_NONE 0
+#define LEN_HH 1
+#define LEN_H 2
+#define LEN_L 3
+#define LEN_LL 4
+#define LEN_J 5
+#define LEN_Z 6
+#define LEN_T 7
+#define LEN_BIG_L 8
+
+struct record_header {
+    // size of the record including the header, aligned to RECORD_ALIGN
+    uint16_t size;
+    // size of the body
+    uint16_t body_len;
+    uint16_t channel;
+    // zero means the rest of the buffer is unused
+    uint8_t level;
+    uint8_t unused;
+};
+
+struct spec {
+    const char *end;
+    const char *flags;
+    int flags_len;
+    const char *width;
+    int width_len;
+    int width_star;
+    int has_prec;
+    const char *prec;
+    int prec_len;
+    int prec_star;
+    int length;
+    char conv;
+    int arg;
+};
+
+struct ring {
+    struct ring *next;
+    uint8_t *buf;
+    size_t size;
+    
+    // written by the logging thread
+    size_t head;
+    uint64_t dropped;
+    int building;
+    int body_full;
+    size_t body_len;
+    uint8_t body[RECORD_MAX];
+    
+    // written by the writer thread
+    size_t tail;
+    uint64_t dropped_reported;
+};
+
+struct reader {
+    const uint8_t *pos;
+    const uint8_t *end;
+};
+
+struct output {
+    char *buf;
+    size_t len;
+};
+
+static struct {
+    size_t buffer_size;
+    struct ring *rings;
+    uint64_t unbuffered_dropped;
+    uint64_t unbuffered_dropped_reported;
+    _BLog_free_func free_func;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int sleeping;
+    int stop;
+} async_global;
+
+static __thread struct ring *thread_ring;
+
+static int parse_spec (const char *p, struct spec *s)
+{
+    ASSERT(*p == '%')
+    p++;
+    
+    s->flags = p;
+    while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0') {
+        p++;
+    }
+    s->flags_len = p - s->flags;
+    
+    s->width = p;
+    s->width_star = (*p == '*');
+    if (s->width_star) {
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    s->width_len = p - s->width;
+    
+    // positional arguments
+    if (*p == '$') {
+        return 0;
+    }
+    
+    s->has_prec = (*p == '.');
+    s->prec_star = 0;
+    s->prec = p;
+    s->prec_len = 0;
+    if (s->has_prec) {
+        p++;
+        s->prec = p;
+        s->prec_star = (*p == '*');
+        if (s->prec_star) {
+            p++;
+        } else {
+            while (*p >= '0' && *p <= '9') {
+                p++;
+            }
+        }
+        s->prec_len = p - s->prec;
+    }
+    
+    switch (*p) {
+        case 'h':
+            p++;
+            s->length = (*p == 'h' ? (p++, LEN_HH) : LEN_H);
+            break;
+        case 'l':
+            p++;
+            s->length = (*p == 'l' ? (p++, LEN_LL) : LEN_L);
+            break;
+        case 'j':
+            p++;
+            s->length = LEN_J;
+            break;
+        case 'z':
+            p++;
+            s->length = LEN_Z;
+            break;
+        case 't':
+            p++;
+            s->length = LEN_T;
+            break;
+        case 'L':
+            p++;
+            s->length = LEN_BIG_L;
+            break;
+        default:
+            s->length = LEN_NONE;
+            break;
+    }
+    
+    s->conv = *p;
+    
+    switch (s->conv) {
+        case '%':
+            s->arg = ARG_NONE;
+            break;
+        case 'c':
+            s->arg = ARG_CHAR;
+            break;
+        case 'd':
+        case 'i':
+            s->arg = ARG_SIGNED;
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            s->arg = ARG_UNSIGNED;
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            s->arg = (s->length == LEN_BIG_L ? ARG_LONG_DOUBLE : ARG_DOUBLE);
+            break;
+        case 'p':
+            s->arg = ARG_POINTER;
+            break;
+        case 's':
+            s->arg = ARG_STRING;
+            break;
+        default:
+            return 0;
+    }
+    
+    // wide characters and strings
+    if ((s->arg == ARG_CHAR || s->arg == ARG_STRING) && s->length != LEN_NONE) {
+        return 0;
+    }
+    
+    // leave room for the rewritten specification
+    if (s->flags_len + s->width_len + s->prec_len > SPEC_MAX - 16) {
+        return 0;
+    }
+    
+    s->end = p + 1;
+    return 1;
+}
+
+static int body_put (struct ring *r, const void *data, size_t len)
+{
+    if (len > RECORD_MAX - r->body_len) {
+        return 0;
+    }
+    
+    memcpy(r->body + r->body_len, data, len);
+    r->body_len += len;
+    
+    return 1;
+}
+
+static int body_put_bytes (struct ring *r, const char *data, size_t len)
+{
+    uint8_t item = ITEM_BYTES;
+    uint16_t len16 = (len > UINT16_MAX ? UINT16_MAX : len);
+    
+    return (body_put(r, &item, sizeof(item)) && body_put(r, &len16, sizeof(len16)) && body_put(r, data, len16));
+}
+
+static int capture_arg (struct ring *r, const struct spec *s, int prec, va_list *vl)
+{
+    switch (s->arg) {
+        case ARG_NONE:
+            return 1;
+        
+        case ARG_CHAR: {
+            int v = va_arg(*vl, int);
+            return body_put(r, &v, sizeof(v));
+        } break;
+        
+        case ARG_SIGNED: {
+            long long int v;
+            switch (s->length) {
+                case LEN_HH: v = (signed char)va_arg(*vl, int); break;
+                case LEN_H: v = (short int)va_arg(*vl, int); break;
+                case LEN_L: v = va_arg(*vl, long int); break;
+                case LEN_LL: v = va_arg(*vl, long long int); break;
+                case LEN_J: v = va_arg(*vl, intmax_t); break;
+                case LEN_Z: v = va_arg(*vl, ssize_t); break;
+                case LEN_T: v = va_arg(*vl, ptrdiff_t); break;
+                default: v = va_arg(*vl, int); break;
+            }
+            return body_put(r, &v, sizeof(v));
+        } break;
+        
+        case ARG_UNSIGNED: {
+            unsigned long long int v;
+            switch (s->length) {
+                case LEN_HH: v = (unsigned char)va_arg(*vl, unsigned int); break;
+                case LEN_H: v = (unsigned short int)va_arg(*vl, unsigned int); break;
+                case LEN_L: v = va_arg(*vl, unsigned long int); break;
+                case LEN_LL: v = va_arg(*vl, unsigned long long int); break;
+                case LEN_J: v = va_arg(*vl, uintmax_t); break;
+                case LEN_Z: v = va_arg(*vl, size_t); break;
+                case LEN_T: v = (size_t)va_arg(*vl, ptrdiff_t); break;
+                default: v = va_arg(*vl, unsigned int); break;
+            }
+            return body_put(r, &v, sizeof(v));
+        } break;
+        
+        case ARG_DOUBLE: {
+            double v = va_arg(*vl, double);
+            return body_put(r, &v, sizeof(v));
+        } break;
+        
+        case ARG_LONG_DOUBLE: {
+            long double v = va_arg(*vl, long double);
+            return body_put(r, &v, sizeof(v));
+        } break;
+        
+        case ARG_POINTER: {
+            void *v = va_arg(*vl, void *);
+            return body_put(r, &v, sizeof(v));
+        } break;
+        
+        case ARG_STRING: {
+            const char *str = va_arg(*vl, const char *);
+            if (!str) {
+                str = "(null)";
+            }
+            
+            // the string only needs to be terminated if there is no precision
+            size_t len = (prec >= 0 ? strnlen(str, prec) : strlen(str));
+            if (len > MESSAGE_MAX) {
+                len = MESSAGE_MAX;
+            }
+            
+            uint16_t len16 = len;
+            return (body_put(r, &len16, sizeof(len16)) && body_put(r, str, len));
+        } break;
+        
+        default:
+            ASSERT(0)
+            return 0;
+    }
+}
+
+static int capture_format (struct ring *r, const char *fmt, va_list *vl)
+{
+    uint8_t item = ITEM_FORMAT;
+    if (!body_put(r, &item, sizeof(item)) || !body_put(r, &fmt, sizeof(fmt))) {
+        return 0;
+    }
+    
+    for (const char *p = fmt; *p; p++) {
+        if (*p != '%') {
+            continue;
+        }
+        
+        struct spec s;
+        if (!parse_spec(p, &s)) {
+            return -1;
+        }
+        p = s.end - 1;
+        
+        if (s.width_star) {
+            int width = va_arg(*vl, int);
+            if (!body_put(r, &width, sizeof(width))) {
+                return 0;
+            }
+        }
+        
+        int prec = -1;
+        if (s.has_prec) {
+            if (s.prec_star) {
+                prec = va_arg(*vl, int);
+                if (!body_put(r, &prec, sizeof(prec))) {
+                    return 0;
+                }
+            } else {
+                prec = atoi(s.prec);
+            }
+        }
+        
+        if (!capture_arg(r, &s, prec, vl)) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+static struct ring * create_ring (void)
+{
+    struct ring *r = malloc(sizeof(*r));
+    if (!r) {
+        goto fail0;
+    }
+    
+    r->size = async_global.buffer_size;
+    if (!(r->buf = malloc(r->size))) {
+        goto fail1;
+    }
+    
+    r->head = 0;
+    r->dropped = 0;
+    r->building = 0;
+    r->tail = 0;
+    r->dropped_reported = 0;
+    
+    // make the buffer visible to the writer
+    r->next = __atomic_load_n(&async_global.rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&async_global.rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    
+    return r;
+    
+fail1:
+    free(r);
+fail0:
+    return NULL;
+}
+
+static void wakeup_writer (void)
+{
+    // the new head must be visible before we look whether the writer is asleep,
+    // pairs with the fence in writer_thread
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    
+    // only the first message after the writer went to sleep wakes it up
+    if (!__atomic_load_n(&async_global.sleeping, __ATOMIC_RELAXED) ||
+        !__atomic_exchange_n(&async_global.sleeping, 0, __ATOMIC_RELAXED)
+    ) {
+        return;
+    }
+    
+    pthread_mutex_lock(&async_global.mutex);
+    pthread_cond_signal(&async_global.cond);
+    pthread_mutex_unlock(&async_global.mutex);
+}
+
+static void output_bytes (struct output *out, const char *data, size_t len)
+{
+    size_t avail = MESSAGE_MAX - out->len;
+    if (len > avail) {
+        len = avail;
+    }
+    
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+static void output_printf (struct output *out, const char *fmt, ...)
+{
+    va_list vl;
+    va_start(vl, fmt);
+    int w = vsnprintf(out->buf + out->len, MESSAGE_MAX + 1 - out->len, fmt, vl);
+    va_end(vl);
+    
+    if (w > 0) {
+        out->len += (w > MESSAGE_MAX - out->len ? MESSAGE_MAX - out->len : w);
+    }
+}
+
+static void read_value (struct reader *rd, void *out, size_t len)
+{
+    ASSERT(len <= rd->end - rd->pos)
+    
+    memcpy(out, rd->pos, len);
+    rd->pos += len;
+}
+
+static void format_arg (struct reader *rd, const struct spec *s, struct output *out)
+{
+    // rebuild the specification with * replaced by the recorded values,
+    // and integers of any length widened to long long
+    char fmt[SPEC_MAX];
+    int len = 0;
+    
+    fmt[len++] = '%';
+    memcpy(fmt + len, s->flags, s->flags_len);
+    len += s->flags_len;
+    
+    if (s->width_star) {
+        int width;
+        read_value(rd, &width, sizeof(width));
+        len += sprintf(fmt + len, "%d", width);
+    } else {
+        memcpy(fmt + len, s->width, s->width_len);
+        len += s->width_len;
+    }
+    
+    if (s->has_prec) {
+        if (s->prec_star) {
+            int prec;
+            read_value(rd, &prec, sizeof(prec));
+            if (prec >= 0) {
+                len += sprintf(fmt + len, ".%d", prec);
+            }
+        } else {
+            fmt[len++] = '.';
+            memcpy(fmt + len, s->prec, s->prec_len);
+            len += s->prec_len;
+        }
+    }
+    
+    switch (s->arg) {
+        case ARG_SIGNED:
+        case ARG_UNSIGNED:
+            fmt[len++] = 'l';
+            fmt[len++] = 'l';
+            break;
+        case ARG_LONG_DOUBLE:
+            fmt[len++] = 'L';
+            break;
+    }
+    
+    fmt[len++] = s->conv;
+    fmt[len] = '\0';
+    
+    switch (s->arg) {
+        case ARG_NONE:
+            output_bytes(out, "%", 1);
+            break;
+        
+        case ARG_CHAR: {
+            int v;
+            read_value(rd, &v, sizeof(v));
+            output_printf(out, fmt, v);
+        } break;
+        
+        case ARG_SIGNED: {
+            long long int v;
+            read_value(rd, &v, sizeof(v));
+            output_printf(out, fmt, v);
+        } break;
+        
+        case ARG_UNSIGNED: {
+            unsigned long long int v;
+            read_value(rd, &v, sizeof(v));
+            output_printf(out, fmt, v);
+        } break;
+        
+        case ARG_DOUBLE: {
+            double v;
+            read_value(rd, &v, sizeof(v));
+            output_printf(out, fmt, v);
+        } break;
+        
+        case ARG_LONG_DOUBLE: {
+            long double v;
+            read_value(rd, &v, sizeof(v));
+            output_printf(out, fmt, v);
+        } break;
+        
+        case ARG_POINTER: {
+            void *v;
+            read_value(rd, &v, sizeof(v));
+            output_printf(out, fmt, v);
+        } break;
+        
+        case ARG_STRING: {
+            uint16_t str_len;
+            read_value(rd, &str_len, sizeof(str_len));
+            ASSERT(str_len <= rd->end - rd->pos)
+            
+            char str[MESSAGE_MAX + 1];
+            read_value(rd, str, str_len);
+            str[str_len] = '\0';
+            output_printf(out, fmt, str);
+        } break;
+    }
+}
+
+static void format_item (struct reader *rd, struct output *out)
+{
+    uint8_t item;
+    read_value(rd, &item, sizeof(item));
+    
+    switch (item) {
+        case ITEM_FORMAT: {
+            const char *fmt;
+            read_value(rd, &fmt, sizeof(fmt));
+            
+            const char *p = fmt;
+            while (*p) {
+                // copy text up to the next conversion
+                const char *next = strchr(p, '%');
+                if (!next) {
+                    output_bytes(out, p, strlen(p));
+                    break;
+                }
+                output_bytes(out, p, next - p);
+                
+                struct spec s;
+                ASSERT_EXECUTE(parse_spec(next, &s))
+                
+                format_arg(rd, &s, out);
+                p = s.end;
+            }
+        } break;
+        
+        case ITEM_BYTES: {
+            uint16_t len;
+            read_value(rd, &len, sizeof(len));
+            ASSERT(len <= rd->end - rd->pos)
+            
+            output_bytes(out, (const char *)rd->pos, len);
+            rd->pos += len;
+        } break;
+        
+        default:
+            ASSERT(0)
+    }
+}
+
+static void write_record (const struct record_header *header, const uint8_t *body)
+{
+    char buf[MESSAGE_MAX + 1];
+    struct output out = {buf, 0};
+    
+    struct reader rd = {body, body + header->body_len};
+    while (rd.pos < rd.end) {
+        format_item(&rd, &out);
+    }
+    
+    buf[out.len] = '\0';
+    
+    blog_global.log_func(header->channel, header->level, buf);
+}
+
+static void report_dropped (uint64_t count)
+{
+    // not BLog_WouldLog, BLog_Free has already marked BLog freed when we're stopping
+    if (BLOG_WARNING > blog_global.channels[BLOG_CURRENT_CHANNEL].loglevel) {
+        return;
+    }
+    
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%llu messages dropped", (unsigned long long)count);
+    
+    blog_global.log_func(BLOG_CURRENT_CHANNEL, BLOG_WARNING, buf);
+}
+
+static int drain_ring (struct ring *r)
+{
+    size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    size_t tail = r->tail;
+    int did = (tail != head);
+    
+    while (tail != head) {
+        size_t offset = tail & (r->size - 1);
+        
+        struct record_header header;
+        memcpy(&header, r->buf + offset, sizeof(header));
+        
+        if (header.level == 0) {
+            tail += r->size - offset;
+        } else {
+            write_record(&header, r->buf + offset + sizeof(header));
+            tail += header.size;
+        }
+        
+        // give the space back right away
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+    
+    uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    if (dropped != r->dropped_reported) {
+        report_dropped(dropped - r->dropped_reported);
+        r->dropped_reported = dropped;
+    }
+    
+    return did;
+}
+
+static int drain (void)
+{
+    int did = 0;
+    
+    for (struct ring *r = __atomic_load_n(&async_global.rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        did |= drain_ring(r);
+    }
+    
+    uint64_t dropped = __atomic_load_n(&async_global.unbuffered_dropped, __ATOMIC_RELAXED);
+    if (dropped != async_global.unbuffered_dropped_reported) {
+        report_dropped(dropped - async_global.unbuffered_dropped_reported);
+        async_global.unbuffered_dropped_reported = dropped;
+    }
+    
+    return did;
+}
+
+static void * writer_thread (void *unused)
+{
+    while (1) {
+        if (drain()) {
+            continue;
+        }
+        
+        // tell loggers to wake us up, then look once more in case a message
+        // was finished before they could see that
+        __atomic_store_n(&async_global.sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        
+        if (drain()) {
+            __atomic_store_n(&async_global.sleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        
+        pthread_mutex_lock(&async_global.mutex);
+        
+        while (__atomic_load_n(&async_global.sleeping, __ATOMIC_RELAXED) && !async_global.stop) {
+            pthread_cond_wait(&async_global.cond, &async_global.mutex);
+        }
+        
+        int stop = async_global.stop;
+        
+        pthread_mutex_unlock(&async_global.mutex);
+        
+        if (stop) {
+            // write out what was logged before stopping
+            drain();
+            break;
+        }
+    }
+    
+    return NULL;
+}
+
+static void async_free (void)
+{
+    // stop the writer, which writes out all queued messages first
+    pthread_mutex_lock(&async_global.mutex);
+    async_global.stop = 1;
+    pthread_cond_signal(&async_global.cond);
+    pthread_mutex_unlock(&async_global.mutex);
+    
+    int res = pthread_join(async_global.thread, NULL);
+    B_USE(res)
+    ASSERT(res == 0)
+    
+    blog_global.async = 0;
+    thread_ring = NULL;
+    
+    // free buffers
+    struct ring *r = async_global.rings;
+    while (r) {
+        struct ring *next = r->next;
+        free(r->buf);
+        free(r);
+        r = next;
+    }
+    
+    pthread_cond_destroy(&async_global.cond);
+    pthread_mutex_destroy(&async_global.mutex);
+    
+    // free the backend
+    async_global.free_func();
+}
+
+int BLog_StartAsync (size_t buffer_size)
+{
+    ASSERT(blog_global.initialized)
+    ASSERT(!blog_global.async)
+    
+#if !BADVPN_THREAD_SAFE
+    // BLog only hands messages to the writer when built thread-safe
+    goto fail0;
+#endif
+    
+    // round the buffer size up to a power of two
+    size_t size = 1;
+    while (size < BUFFER_MIN || size < buffer_size) {
+        if (size > SIZE_MAX / 2) {
+            goto fail0;
+        }
+        size *= 2;
+    }
+    
+    async_global.buffer_size = size;
+    async_global.rings = NULL;
+    async_global.unbuffered_dropped = 0;
+    async_global.unbuffered_dropped_reported = 0;
+    async_global.sleeping = 0;
+    async_global.stop = 0;
+    
+    if (pthread_mutex_init(&async_global.mutex, NULL) != 0) {
+        goto fail0;
+    }
+    
+    if (pthread_cond_init(&async_global.cond, NULL) != 0) {
+        goto fail1;
+    }
+    
+    // start the writer with all signals blocked, so that they keep going
+    // to the threads which handle them
+    sigset_t all_signals;
+    sigset_t old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    int res = pthread_create(&async_global.thread, NULL, writer_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (res != 0) {
+        goto fail2;
+    }
+    
+    // stop the writer before freeing the backend
+    async_global.free_func = blog_global.free_func;
+    blog_global.free_func = async_free;
+    
+    blog_global.async = 1;
+    
+    return 1;
+    
+fail2:
+    pthread_cond_destroy(&async_global.cond);
+fail1:
+    pthread_mutex_destroy(&async_global.mutex);
+fail0:
+    return 0;
+}
+
+uint64_t BLog_AsyncDropped (void)
+{
+    ASSERT(blog_global.async)
+    
+    uint64_t dropped = __atomic_load_n(&async_global.unbuffered_dropped, __ATOMIC_RELAXED);
+    
+    for (struct ring *r = __atomic_load_n(&async_global.rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+    
+    return dropped;
+}
+
+void _BLogAsync_Begin (void)
+{
+    ASSERT(blog_global.async)
+    
+    struct ring *r = thread_ring;
+    
+    if (!r) {
+        // first message from this thread
+        if (!(r = create_ring())) {
+            return;
+        }
+        thread_ring = r;
+    }
+    
+    ASSERT(!r->building)
+    
+    r->building = 1;
+    r->body_full = 0;
+    r->body_len = 0;
+}
+
+void _BLogAsync_AppendVarArg (const char *fmt, va_list vl)
+{
+    ASSERT(blog_global.async)
+    
+    struct ring *r = thread_ring;
+    if (!r || r->body_full) {
+        return;
+    }
+    ASSERT(r->building)
+    
+    size_t item_start = r->body_len;
+    
+    va_list vl_capture;
+    va_copy(vl_capture, vl);
+    int res = capture_format(r, fmt, &vl_capture);
+    va_end(vl_capture);
+    
+    if (res < 0) {
+        // format this part now, the writer can't reproduce it
+        r->body_len = item_start;
+        char buf[MESSAGE_MAX + 1];
+        int w = vsnprintf(buf, sizeof(buf), fmt, vl);
+        if (w > 0 && !body_put_bytes(r, buf, (w > MESSAGE_MAX ? MESSAGE_MAX : w))) {
+            res = 0;
+        }
+    }
+    
+    if (res == 0) {
+        // out of space, ignore this and further parts like synchronous mode
+        // truncates the message
+        r->body_len = item_start;
+        r->body_full = 1;
+    }
+}
+
+void _BLogAsync_AppendBytes (const char *data, size_t len)
+{
+    ASSERT(blog_global.async)
+    
+    struct ring *r = thread_ring;
+    if (!r || r->body_full) {
+        return;
+    }
+    ASSERT(r->building)
+    
+    size_t item_start = r->body_len;
+    
+    if (!body_put_bytes(r, data, (len > MESSAGE_MAX ? MESSAGE_MAX : len))) {
+        r->body_len = item_start;
+        r->body_full = 1;
+    }
+}
+
+void _BLogAsync_Finish (int channel, int level)
+{
+    ASSERT(blog_global.async)
+    
+    struct ring *r = thread_ring;
+    if (!r) {
+        __atomic_add_fetch(&async_global.unbuffered_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    ASSERT(r->building)
+    
+    r->building = 0;
+    
+    size_t size = balign_up(sizeof(struct record_header) + r->body_len, RECORD_ALIGN);
+    size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    size_t offset = r->head & (r->size - 1);
+    
+    // records are contiguous; skip the end of the buffer if it doesn't fit there
+    size_t skip = (size > r->size - offset ? r->size - offset : 0);
+    
+    if (skip + size > r->size - (r->head - tail)) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    struct record_header header;
+    
+    if (skip > 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(r->buf + offset, &header, sizeof(header));
+        offset = 0;
+    }
+    
+    header.size = size;
+    header.body_len = r->body_len;
+    header.channel = channel;
+    header.level = level;
+    header.unused = 0;
+    memcpy(r->buf + offset, &header, sizeof(header));
+    memcpy(r->buf + offset + sizeof(header), r->body, r->body_len);
+    
+    size_t head = r->head + skip + size;
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+    
+    wakeup_writer();
+}
+
+#endif
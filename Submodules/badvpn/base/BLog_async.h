@@ -0,0 +1,82 @@
+/**
+ * @file BLog_async.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * 
+ * @section DESCRIPTION
+ * 
+ * Asynchronous BLog operation.
+ */
+
+#ifndef BADVPN_BLOG_ASYNC_H
+#define BADVPN_BLOG_ASYNC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+
+// default size of the per-thread buffer of queued messages, in bytes
+#define BLOG_ASYNC_DEFAULT_BUFFER_SIZE 262144
+
+/**
+ * Makes BLog pass messages to the backend from a background thread.
+ * 
+ * From then on, each thread logging a message appends a binary record of it to a
+ * buffer of its own. The record holds the format strings with the values of
+ * their arguments, and a copy of any strings they refer to.
+ * The background thread formats the records and passes them to the backend
+ * chosen with BLog_Init*. When it has nothing left to write it goes to sleep,
+ * and the next message logged wakes it up by signalling a condition variable,
+ * which takes a mutex and may make a system call. Messages logged while it is
+ * still writing only append to the buffer.
+ * Messages from the same thread are passed in the order they were logged.
+ * 
+ * If a thread's buffer is full, its messages are dropped and counted, and the
+ * background thread logs how many were dropped.
+ * Format strings must remain valid until the messages are written out; string
+ * literals are fine. A part of a message using a conversion that cannot be
+ * recorded (e.g. %n, %m or positional arguments) is formatted when it is logged.
+ * 
+ * Fails if BadVPN is built with BADVPN_THREAD_SAFE=0.
+ * Must be called after BLog_Init* and before any other thread logs. {@link BLog_Free}
+ * writes out all queued messages and stops the background thread.
+ * 
+ * @param buffer_size size of each thread's buffer in bytes. It is rounded up to
+ *                    a power of two, and to at least a few maximum-size messages.
+ * @return 1 on success, 0 on failure
+ */
+int BLog_StartAsync (size_t buffer_size) WARN_UNUSED;
+
+/**
+ * Returns the number of messages dropped so far because a thread's buffer was full.
+ * Must only be called after {@link BLog_StartAsync}.
+ */
+uint64_t BLog_AsyncDropped (void);
+
+#endif
@@ -0,0 +1,274 @@
+/**
+ * @file BMetrics.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#ifdef BADVPN_USE_WINAPI
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include <misc/debug.h>
+
+#include "BMetrics.h"
+
+#ifndef BADVPN_PLUGIN
+
+struct thread_values {
+    struct thread_values *next;
+    uint64_t values[BMETRICS_MAX_SLOTS];
+};
+
+static struct {
+    int lock;
+    BMetric *metrics[BMETRICS_MAX_METRICS];
+    int num_metrics;
+    int num_slots;
+    struct thread_values *threads;
+} bmetrics_global;
+
+BMETRICS_THREAD_LOCAL uint64_t *_bmetrics_thread_values;
+
+static void lock (void)
+{
+#if BADVPN_THREAD_SAFE
+    while (__atomic_exchange_n(&bmetrics_global.lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&bmetrics_global.lock, __ATOMIC_RELAXED));
+    }
+#endif
+}
+
+static void unlock (void)
+{
+#if BADVPN_THREAD_SAFE
+    __atomic_store_n(&bmetrics_global.lock, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+static int num_slots (BMetric *m)
+{
+    switch (m->type) {
+        case BMETRIC_TYPE_COUNTER:
+        case BMETRIC_TYPE_GAUGE:
+            return 1;
+        case BMETRIC_TYPE_HISTOGRAM:
+            // buckets, +Inf bucket, sum
+            return m->num_bounds + 2;
+        default:
+            ASSERT(0)
+            return 0;
+    }
+}
+
+static uint64_t load_value (uint64_t *p)
+{
+#if BADVPN_THREAD_SAFE
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+#else
+    return *p;
+#endif
+}
+
+static uint64_t sum_slot (int slot)
+{
+    uint64_t sum = 0;
+    for (struct thread_values *t = bmetrics_global.threads; t; t = t->next) {
+        sum += load_value(&t->values[slot]);
+    }
+    return sum;
+}
+
+static int append_scaled (ExpString *out, uint64_t v, uint64_t scale)
+{
+    char buf[48];
+    if (scale == 1) {
+        sprintf(buf, "%" PRIu64, v);
+    } else {
+        sprintf(buf, "%.9g", (double)v / scale);
+    }
+    return ExpString_Append(out, buf);
+}
+
+static int print_metric (ExpString *out, BMetric *m, const uint64_t *sums)
+{
+    const char *type_str = (m->type == BMETRIC_TYPE_COUNTER ? "counter" : m->type == BMETRIC_TYPE_GAUGE ? "gauge" : "histogram");
+    
+    if (!ExpString_Append(out, "# HELP ") || !ExpString_Append(out, m->name) || !ExpString_AppendChar(out, ' ') ||
+        !ExpString_Append(out, m->help) || !ExpString_Append(out, "\n# TYPE ") || !ExpString_Append(out, m->name) ||
+        !ExpString_AppendChar(out, ' ') || !ExpString_Append(out, type_str) || !ExpString_AppendChar(out, '\n')
+    ) {
+        return 0;
+    }
+    
+    char buf[48];
+    
+    switch (m->type) {
+        case BMETRIC_TYPE_COUNTER: {
+            sprintf(buf, " %" PRIu64 "\n", sums[m->slot]);
+            if (!ExpString_Append(out, m->name) || !ExpString_Append(out, buf)) {
+                return 0;
+            }
+        } break;
+        
+        case BMETRIC_TYPE_GAUGE: {
+            sprintf(buf, " %" PRId64 "\n", (int64_t)sums[m->slot]);
+            if (!ExpString_Append(out, m->name) || !ExpString_Append(out, buf)) {
+                return 0;
+            }
+        } break;
+        
+        case BMETRIC_TYPE_HISTOGRAM: {
+            uint64_t count = 0;
+            for (int i = 0; i <= m->num_bounds; i++) {
+                count += sums[m->slot + i];
+                if (!ExpString_Append(out, m->name) || !ExpString_Append(out, "_bucket{le=\"")) {
+                    return 0;
+                }
+                if (i < m->num_bounds) {
+                    if (!append_scaled(out, m->bounds[i], m->scale)) {
+                        return 0;
+                    }
+                } else {
+                    if (!ExpString_Append(out, "+Inf")) {
+                        return 0;
+                    }
+                }
+                sprintf(buf, "\"} %" PRIu64 "\n", count);
+                if (!ExpString_Append(out, buf)) {
+                    return 0;
+                }
+            }
+            
+            if (!ExpString_Append(out, m->name) || !ExpString_Append(out, "_sum ") ||
+                !append_scaled(out, sums[m->slot + m->num_bounds + 1], m->scale) ||
+                !ExpString_Append(out, "\n") || !ExpString_Append(out, m->name)
+            ) {
+                return 0;
+            }
+            sprintf(buf, "_count %" PRIu64 "\n", count);
+            if (!ExpString_Append(out, buf)) {
+                return 0;
+            }
+        } break;
+        
+        default: ASSERT(0);
+    }
+    
+    return 1;
+}
+
+uint64_t * _BMetrics_Values (BMetric *m)
+{
+    uint64_t *values = NULL;
+    
+    lock();
+    
+    // register metric
+    if (m->slot < 0) {
+        int num = num_slots(m);
+        if (bmetrics_global.num_metrics == BMETRICS_MAX_METRICS || num > BMETRICS_MAX_SLOTS - bmetrics_global.num_slots) {
+            goto out;
+        }
+        
+        bmetrics_global.metrics[bmetrics_global.num_metrics++] = m;
+#if BADVPN_THREAD_SAFE
+        __atomic_store_n(&m->slot, bmetrics_global.num_slots, __ATOMIC_RELEASE);
+#else
+        m->slot = bmetrics_global.num_slots;
+#endif
+        bmetrics_global.num_slots += num;
+    }
+    
+    // register thread
+    if (!_bmetrics_thread_values) {
+        struct thread_values *t = calloc(1, sizeof(*t));
+        if (!t) {
+            goto out;
+        }
+        
+        // values are never freed since other threads may print them
+        t->next = bmetrics_global.threads;
+        bmetrics_global.threads = t;
+        _bmetrics_thread_values = t->values;
+    }
+    
+    values = _bmetrics_thread_values + m->slot;
+    
+out:
+    unlock();
+    return values;
+}
+
+uint64_t BMetrics_Now (void)
+{
+#ifdef BADVPN_USE_WINAPI
+    LARGE_INTEGER count;
+    LARGE_INTEGER freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)((double)count.QuadPart * 1000000000.0 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+int BMetrics_Print (ExpString *out)
+{
+    BMetric *metrics[BMETRICS_MAX_METRICS];
+    uint64_t sums[BMETRICS_MAX_SLOTS];
+    
+    // only collect the values under the lock, so that threads registering
+    // don't wait for the text to be allocated
+    lock();
+    
+    int num_metrics = bmetrics_global.num_metrics;
+    memcpy(metrics, bmetrics_global.metrics, num_metrics * sizeof(metrics[0]));
+    
+    for (int i = 0; i < bmetrics_global.num_slots; i++) {
+        sums[i] = sum_slot(i);
+    }
+    
+    unlock();
+    
+    for (int i = 0; i < num_metrics; i++) {
+        if (!print_metric(out, metrics[i], sums)) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+#endif
@@ -0,0 +1,210 @@
+/**
+ * @file BMetrics.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * 
+ * @section DESCRIPTION
+ * 
+ * Process-wide registry of counters, gauges and histograms.
+ * 
+ * Metrics are statically initialized {@link BMetric} objects which register
+ * themselves the first time they are updated, so that any module can define and
+ * update metrics without the program having to know about them.
+ * Each thread updates values of its own, without locking; the values of all
+ * threads are added up when the metrics are printed.
+ */
+
+#ifndef BADVPN_BMETRICS_H
+#define BADVPN_BMETRICS_H
+
+#if !defined(BADVPN_THREAD_SAFE) || (BADVPN_THREAD_SAFE != 0 && BADVPN_THREAD_SAFE != 1)
+#error BADVPN_THREAD_SAFE is not defined or incorrect
+#endif
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/array_length.h>
+#include <misc/expstring.h>
+
+// maximum number of registered metrics
+#define BMETRICS_MAX_METRICS 64
+
+// maximum number of values of all registered metrics
+#define BMETRICS_MAX_SLOTS 512
+
+#define BMETRIC_TYPE_COUNTER 1
+#define BMETRIC_TYPE_GAUGE 2
+#define BMETRIC_TYPE_HISTOGRAM 3
+
+typedef struct {
+    const char *name;
+    const char *help;
+    int type;
+    const uint64_t *bounds;
+    int num_bounds;
+    uint64_t scale;
+    int slot;
+} BMetric;
+
+/**
+ * Initializer for a counter, a value that only increases.
+ * 
+ * @param name metric name, e.g. "badvpn_tun2socks_device_read_packets_total"
+ * @param help one-line description
+ */
+#define BMETRIC_COUNTER_INIT(name, help) {(name), (help), BMETRIC_TYPE_COUNTER, NULL, 0, 1, -1}
+
+/**
+ * Initializer for a gauge, a value that is increased and decreased.
+ * 
+ * @param name metric name
+ * @param help one-line description
+ */
+#define BMETRIC_GAUGE_INIT(name, help) {(name), (help), BMETRIC_TYPE_GAUGE, NULL, 0, 1, -1}
+
+/**
+ * Initializer for a histogram, counting observed values in buckets.
+ * 
+ * @param name metric name
+ * @param help one-line description
+ * @param bounds static array of increasing bucket upper bounds, inclusive
+ * @param scale observed values are divided by this when printed, e.g. 1000000000
+ *              to observe nanoseconds and print seconds
+ */
+#define BMETRIC_HISTOGRAM_INIT(name, help, bounds, scale) {(name), (help), BMETRIC_TYPE_HISTOGRAM, (bounds), B_ARRAY_LENGTH(bounds), (scale), -1}
+
+#if BADVPN_THREAD_SAFE
+#define BMETRICS_THREAD_LOCAL __thread
+#define BMETRICS_LOAD_SLOT(m) __atomic_load_n(&(m)->slot, __ATOMIC_ACQUIRE)
+#define BMETRICS_STORE_VALUE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#else
+#define BMETRICS_THREAD_LOCAL
+#define BMETRICS_LOAD_SLOT(m) ((m)->slot)
+#define BMETRICS_STORE_VALUE(p, v) (*(p) = (v))
+#endif
+
+extern BMETRICS_THREAD_LOCAL uint64_t *_bmetrics_thread_values;
+
+uint64_t * _BMetrics_Values (BMetric *m);
+
+/**
+ * Adds to a counter or gauge.
+ * 
+ * @param m the metric
+ * @param v amount to add
+ */
+static void BMetric_Add (BMetric *m, uint64_t v);
+
+/**
+ * Subtracts from a gauge.
+ * 
+ * @param m the metric
+ * @param v amount to subtract
+ */
+static void BMetric_Sub (BMetric *m, uint64_t v);
+
+/**
+ * Records a value in a histogram.
+ * 
+ * @param m the metric
+ * @param v observed value, in units of 1/scale
+ */
+static void BMetric_Observe (BMetric *m, uint64_t v);
+
+/**
+ * Returns the time on a monotonic clock in nanoseconds, for measuring durations
+ * to observe in histograms.
+ */
+uint64_t BMetrics_Now (void);
+
+/**
+ * Appends the values of all registered metrics in the Prometheus text exposition
+ * format.
+ * 
+ * @param out string to append to
+ * @return 1 on success, 0 on allocation failure
+ */
+int BMetrics_Print (ExpString *out) WARN_UNUSED;
+
+static uint64_t * BMetric__values (BMetric *m)
+{
+    int slot = BMETRICS_LOAD_SLOT(m);
+    
+    if (!_bmetrics_thread_values || slot < 0) {
+        // register metric or thread; may fail if out of slots or memory
+        return _BMetrics_Values(m);
+    }
+    
+    return _bmetrics_thread_values + slot;
+}
+
+void BMetric_Add (BMetric *m, uint64_t v)
+{
+    ASSERT(m->type == BMETRIC_TYPE_COUNTER || m->type == BMETRIC_TYPE_GAUGE)
+    
+    uint64_t *values = BMetric__values(m);
+    if (!values) {
+        return;
+    }
+    
+    BMETRICS_STORE_VALUE(&values[0], values[0] + v);
+}
+
+void BMetric_Sub (BMetric *m, uint64_t v)
+{
+    ASSERT(m->type == BMETRIC_TYPE_GAUGE)
+    
+    uint64_t *values = BMetric__values(m);
+    if (!values) {
+        return;
+    }
+    
+    // gauges are added up modulo 2^64 and printed as signed
+    BMETRICS_STORE_VALUE(&values[0], values[0] - v);
+}
+
+void BMetric_Observe (BMetric *m, uint64_t v)
+{
+    ASSERT(m->type == BMETRIC_TYPE_HISTOGRAM)
+    
+    uint64_t *values = BMetric__values(m);
+    if (!values) {
+        return;
+    }
+    
+    // find bucket; the one after the bounds is +Inf
+    int i = 0;
+    while (i < m->num_bounds && v > m->bounds[i]) {
+        i++;
+    }
+    
+    BMETRICS_STORE_VALUE(&values[i], values[i] + 1);
+    BMETRICS_STORE_VALUE(&values[m->num_bounds + 1], values[m->num_bounds + 1] + v);
+}
+
+#endif
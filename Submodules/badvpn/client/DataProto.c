@@ -433,7 +433,7 @@ int DataProtoFlow_Init (DataProtoFlow *o, DataProtoSource *source, peerid_t sour
     }
     
     // init route buffer
-    if (!RouteBuffer_Init(&b->rbuf, DATAPROTO_MAX_OVERHEAD + source->frame_mtu, buf_out, num_packets)) {
+    if (!RouteBuffer_Init(&b->rbuf, PacketRouter_GetSource(&source->router), buf_out, num_packets)) {
         BLog(BLOG_ERROR, "RouteBuffer_Init failed");
         goto fail1;
     }
@@ -491,26 +491,27 @@ void DataProtoFlow_Route (DataProtoFlow *o, int more)
     ASSERT(more == 0 || more == 1)
     struct DataProtoFlow_buffer *b = o->b;
     
-    // write header. Don't set flags, it will be set in notifier_handler.
+    // build header. Don't set flags, it will be set in notifier_handler.
+    uint8_t header_buf[DATAPROTO_MAX_OVERHEAD];
     struct dataproto_header header;
     struct dataproto_peer_id id;
+    header.flags = 0;
     header.from_id = htol16(o->source_id);
     header.num_peer_ids = htol16(1);
     id.id = htol16(o->dest_id);
-    memcpy(o->source->current_buf, &header, sizeof(header));
-    memcpy(o->source->current_buf + sizeof(header), &id, sizeof(id));
-    
-    // route
-    uint8_t *next_buf;
-    if (!PacketRouter_Route(&o->source->router, DATAPROTO_MAX_OVERHEAD + o->source->current_recv_len, &b->rbuf,
-                            &next_buf, DATAPROTO_MAX_OVERHEAD, (more ? o->source->current_recv_len : 0)
-    )) {
+    memcpy(header_buf, &header, sizeof(header));
+    memcpy(header_buf + sizeof(header), &id, sizeof(id));
+    
+    // don't allow further routing if more==0
+    if (!more) {
+        o->source->current_buf = NULL;
+    }
+    
+    // route; the frame is shared by all flows it's routed to
+    if (!PacketRouter_Route(&o->source->router, DATAPROTO_MAX_OVERHEAD + o->source->current_recv_len, &b->rbuf, header_buf)) {
         BLog(BLOG_NOTICE, "buffer full: %d->%d", (int)o->source_id, (int)o->dest_id);
         return;
     }
-    
-    // remember next buffer, or don't allow further routing if more==0
-    o->source->current_buf = (more ? next_buf : NULL);
 }
 
 void DataProtoFlow_Attach (DataProtoFlow *o, DataProtoSink *sink)
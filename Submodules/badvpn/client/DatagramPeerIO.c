@@ -27,6 +27,9 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <misc/minmax.h>
+#include <base/BMetrics.h>
+
 #include <client/DatagramPeerIO.h>
 
 #include <generated/blog_channel_DatagramPeerIO.h>
@@ -35,6 +38,26 @@
 #define DATAGRAMPEERIO_MODE_CONNECT 1
 #define DATAGRAMPEERIO_MODE_BIND 2
 
+// smallest datagrams adaptive fragmentation will send
+#define DATAGRAMPEERIO_MIN_DGRAM_LEN 548
+
+// how often to adjust sending to path MTU and loss (ms)
+#define DATAGRAMPEERIO_TUNE_INTERVAL 1000
+
+// minimum number of frames to estimate loss from
+#define DATAGRAMPEERIO_TUNE_MIN_FRAMES 32
+
+// frame loss (per mille) above which datagrams are made smaller,
+// and below which they are allowed to grow
+#define DATAGRAMPEERIO_LOSS_HIGH 50
+#define DATAGRAMPEERIO_LOSS_LOW 10
+
+static const uint64_t metric_dgram_len_bounds[] = {548, 1024, 1232, 1280, 1380, 1420, 1440, 1452, 1472, 8972};
+static const uint64_t metric_loss_bounds[] = {0, 1, 5, 10, 20, 50, 100, 200, 500};
+static BMetric metric_path_dgram_len = BMETRIC_HISTOGRAM_INIT("badvpn_datagrampeerio_path_datagram_bytes", "Largest datagram the path MTU allows, observed for each adaptive peer once per second.", metric_dgram_len_bounds, 1);
+static BMetric metric_send_dgram_len = BMETRIC_HISTOGRAM_INIT("badvpn_datagrampeerio_send_datagram_bytes", "Largest datagram sent, after adapting to path MTU and loss, observed for each adaptive peer once per second.", metric_dgram_len_bounds, 1);
+static BMetric metric_loss = BMETRIC_HISTOGRAM_INIT("badvpn_datagrampeerio_frame_loss_ratio", "Frame loss from an adaptive peer, observed each time it is estimated.", metric_loss_bounds, 1000);
+
 #define PeerLog(_o, ...) BLog_LogViaFunc((_o)->logfunc, (_o)->user, BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 
 static void init_io (DatagramPeerIO *o);
@@ -42,6 +65,11 @@ static void free_io (DatagramPeerIO *o);
 static void dgram_handler (DatagramPeerIO *o, int event);
 static void reset_mode (DatagramPeerIO *o);
 static void recv_decoder_notifier_handler (DatagramPeerIO *o, uint8_t *data, int data_len);
+static void start_adaptive (DatagramPeerIO *o, int family);
+static void apply_send_params (DatagramPeerIO *o);
+static void update_path_mtu (DatagramPeerIO *o);
+static void dgram_too_big_handler (DatagramPeerIO *o, int data_len);
+static void tune_timer_handler (DatagramPeerIO *o);
 
 void init_io (DatagramPeerIO *o)
 {
@@ -60,6 +88,11 @@ void init_io (DatagramPeerIO *o)
 
 void free_io (DatagramPeerIO *o)
 {
+    // stop tuning
+    if (o->adaptive) {
+        BReactor_RemoveTimer(o->reactor, &o->tune_timer);
+    }
+    
     // disconnect sink
     PacketPassConnector_DisconnectOutput(&o->send_connector);
     
@@ -131,6 +164,128 @@ void recv_decoder_notifier_handler (DatagramPeerIO *o, uint8_t *data, int data_l
     BDatagram_SetSendAddrs(&o->dgram, addr, local_addr);
 }
 
+void start_adaptive (DatagramPeerIO *o, int family)
+{
+    ASSERT(o->adaptive)
+    
+    // remember IP and UDP header size for converting path MTU to datagram size
+    o->ip_overhead = (family == BADDR_TYPE_IPV6 ? 40 : 20) + 8;
+    
+    // enable path MTU discovery
+    if (!BDatagram_EnablePathMTUDiscovery(&o->dgram, (BDatagram_handler_too_big)dgram_too_big_handler)) {
+        PeerLog(o, BLOG_WARNING, "BDatagram_EnablePathMTUDiscovery failed, adapting to loss only");
+    }
+    
+    // start with full datagrams and latency
+    o->pmtu_dgram_len = o->effective_socket_mtu;
+    o->loss_dgram_len = o->effective_socket_mtu;
+    o->loss_latency = o->max_latency;
+    o->loss_permille = 0;
+    FragmentProtoAssembler_GetCounters(&o->recv_assembler, &o->last_frames_sent, &o->last_frames_complete);
+    apply_send_params(o);
+    
+    // start tuning
+    BReactor_SetTimer(o->reactor, &o->tune_timer);
+}
+
+void apply_send_params (DatagramPeerIO *o)
+{
+    ASSERT(o->adaptive)
+    
+    int dgram_len = bmin_int(o->pmtu_dgram_len, o->loss_dgram_len);
+    
+    if (dgram_len == o->send_dgram_len && o->loss_latency == o->send_latency) {
+        return;
+    }
+    
+    o->send_dgram_len = dgram_len;
+    o->send_latency = o->loss_latency;
+    
+    int output_limit = spproto_payload_mtu_for_carrier_mtu(o->sp_params, o->send_dgram_len);
+    ASSERT(output_limit > (int)sizeof(struct fragmentproto_chunk_header))
+    ASSERT(output_limit <= o->spproto_payload_mtu)
+    
+    FragmentProtoDisassembler_SetOutputLimit(&o->send_disassembler, output_limit);
+    FragmentProtoDisassembler_SetLatency(&o->send_disassembler, o->send_latency);
+    
+    PeerLog(o, BLOG_INFO, "sending datagrams up to %d bytes (path %d), latency %d ms, frame loss %d.%d%%",
+            o->send_dgram_len, o->pmtu_dgram_len, (int)o->send_latency, o->loss_permille / 10, o->loss_permille % 10);
+}
+
+void update_path_mtu (DatagramPeerIO *o)
+{
+    ASSERT(o->adaptive)
+    
+    int mtu = BDatagram_GetPathMTU(&o->dgram);
+    if (mtu < 0) {
+        return;
+    }
+    
+    o->pmtu_dgram_len = bmax_int(o->min_dgram_len, bmin_int(o->effective_socket_mtu, mtu - o->ip_overhead));
+}
+
+void dgram_too_big_handler (DatagramPeerIO *o, int data_len)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->adaptive)
+    ASSERT(o->mode == DATAGRAMPEERIO_MODE_CONNECT || o->mode == DATAGRAMPEERIO_MODE_BIND)
+    
+    PeerLog(o, BLOG_INFO, "datagram of %d bytes exceeds path MTU", data_len);
+    
+    update_path_mtu(o);
+    
+    // if the system didn't tell us a smaller path MTU, back off
+    if (o->pmtu_dgram_len >= data_len) {
+        o->pmtu_dgram_len = bmax_int(o->min_dgram_len, data_len - data_len / 8);
+    }
+    
+    apply_send_params(o);
+}
+
+void tune_timer_handler (DatagramPeerIO *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->adaptive)
+    ASSERT(o->mode == DATAGRAMPEERIO_MODE_CONNECT || o->mode == DATAGRAMPEERIO_MODE_BIND)
+    
+    // path MTU may have changed either way
+    update_path_mtu(o);
+    
+    // estimate loss, once enough frames are seen
+    uint64_t frames_sent;
+    uint64_t frames_complete;
+    FragmentProtoAssembler_GetCounters(&o->recv_assembler, &frames_sent, &frames_complete);
+    uint64_t num_sent = frames_sent - o->last_frames_sent;
+    uint64_t num_complete = frames_complete - o->last_frames_complete;
+    
+    if (num_sent >= DATAGRAMPEERIO_TUNE_MIN_FRAMES) {
+        o->loss_permille = (num_complete >= num_sent ? 0 : (int)((num_sent - num_complete) * 1000 / num_sent));
+        o->last_frames_sent = frames_sent;
+        o->last_frames_complete = frames_complete;
+        
+        BMetric_Observe(&metric_loss, o->loss_permille);
+        
+        if (o->loss_permille > DATAGRAMPEERIO_LOSS_HIGH) {
+            // lossy: smaller datagrams, don't wait to fill them
+            o->loss_dgram_len = bmax_int(o->min_dgram_len, o->loss_dgram_len - o->loss_dgram_len / 4);
+            o->loss_latency = (o->max_latency > 0 ? 0 : o->max_latency);
+        }
+        else if (o->loss_permille < DATAGRAMPEERIO_LOSS_LOW) {
+            // good: grow back to full datagrams
+            o->loss_dgram_len += (o->effective_socket_mtu - o->loss_dgram_len + 1) / 2;
+            o->loss_latency = o->max_latency;
+        }
+    }
+    
+    apply_send_params(o);
+    
+    BMetric_Observe(&metric_path_dgram_len, o->pmtu_dgram_len);
+    BMetric_Observe(&metric_send_dgram_len, o->send_dgram_len);
+    
+    // restart timer
+    BReactor_SetTimer(o->reactor, &o->tune_timer);
+}
+
 int DatagramPeerIO_Init (
     DatagramPeerIO *o,
     BReactor *reactor,
@@ -138,6 +293,7 @@ int DatagramPeerIO_Init (
     int socket_mtu,
     struct spproto_security_params sp_params,
     btime_t latency,
+    int adaptive,
     int num_frames,
     PacketPassInterface *recv_userif,
     int otp_warning_count,
@@ -166,9 +322,11 @@ int DatagramPeerIO_Init (
     o->user = user;
     o->logfunc = logfunc;
     o->handler_error = handler_error;
+    o->adaptive = adaptive;
+    o->max_latency = latency;
     
     // check num frames (for FragmentProtoAssembler)
-    if (num_frames >= FPA_MAX_TIME) {
+    if (num_frames > FPA_MAX_FRAMES) {
         PeerLog(o, BLOG_ERROR, "num_frames is too big");
         goto fail0;
     }
@@ -191,10 +349,18 @@ int DatagramPeerIO_Init (
         goto fail0;
     }
     
+    // calculate smallest datagram size adaptive fragmentation will use
+    o->min_dgram_len = bmin_int(DATAGRAMPEERIO_MIN_DGRAM_LEN, o->effective_socket_mtu);
+    int min_spproto_payload_mtu = spproto_payload_mtu_for_carrier_mtu(o->sp_params, o->min_dgram_len);
+    if (min_spproto_payload_mtu <= (int)sizeof(struct fragmentproto_chunk_header)) {
+        o->min_dgram_len = o->effective_socket_mtu;
+        min_spproto_payload_mtu = o->spproto_payload_mtu;
+    }
+    
     // init receiving
     
-    // init assembler
-    if (!FragmentProtoAssembler_Init(&o->recv_assembler, o->spproto_payload_mtu, recv_userif, num_frames, fragmentproto_max_chunks_for_frame(o->spproto_payload_mtu, o->payload_mtu),
+    // init assembler; accept as many chunks as a peer using the smallest datagrams sends
+    if (!FragmentProtoAssembler_Init(&o->recv_assembler, o->spproto_payload_mtu, recv_userif, num_frames, fragmentproto_max_chunks_for_frame(min_spproto_payload_mtu, o->payload_mtu),
                                      BReactor_PendingGroup(o->reactor), o->user, o->logfunc
     )) {
         PeerLog(o, BLOG_ERROR, "FragmentProtoAssembler_Init failed");
@@ -241,6 +407,12 @@ int DatagramPeerIO_Init (
         goto fail4;
     }
     
+    // init tune timer
+    if (o->adaptive) {
+        BTimer_Init(&o->tune_timer, DATAGRAMPEERIO_TUNE_INTERVAL, (BTimer_handler)tune_timer_handler, o);
+        o->send_dgram_len = -1;
+    }
+    
     // set mode
     o->mode = DATAGRAMPEERIO_MODE_NONE;
     
@@ -318,6 +490,11 @@ int DatagramPeerIO_Connect (DatagramPeerIO *o, BAddr addr)
     // init I/O
     init_io(o);
     
+    // start adaptive fragmentation
+    if (o->adaptive) {
+        start_adaptive(o, addr.type);
+    }
+    
     // set mode
     o->mode = DATAGRAMPEERIO_MODE_CONNECT;
     
@@ -350,6 +527,11 @@ int DatagramPeerIO_Bind (DatagramPeerIO *o, BAddr addr)
     // init I/O
     init_io(o);
     
+    // start adaptive fragmentation
+    if (o->adaptive) {
+        start_adaptive(o, addr.type);
+    }
+    
     // set recv notifier handler
     PacketPassNotifier_SetHandler(&o->recv_notifier, (PacketPassNotifier_handler_notify)recv_decoder_notifier_handler, o);
     
@@ -364,13 +546,13 @@ fail0:
     return 0;
 }
 
-void DatagramPeerIO_SetEncryptionKey (DatagramPeerIO *o, uint8_t *encryption_key)
+void DatagramPeerIO_SetEncryptionKey (DatagramPeerIO *o, uint8_t *encryption_key, int nonce_side)
 {
     ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
     DebugObject_Access(&o->d_obj);
     
     // set sending key
-    SPProtoEncoder_SetEncryptionKey(&o->send_encoder, encryption_key);
+    SPProtoEncoder_SetEncryptionKey(&o->send_encoder, encryption_key, nonce_side);
     
     // set receiving key
     SPProtoDecoder_SetEncryptionKey(&o->recv_decoder, encryption_key);
@@ -95,6 +95,13 @@ typedef void (*DatagramPeerIO_handler_otp_ready) (void *user);
  *                 Datagrams are being received on the socket. Datagrams are not being
  *                 sent initially. When a datagram is received, its source address is
  *                 used as a destination address for sending datagrams.
+ *
+ * If adaptive fragmentation is enabled, the don't-fragment flag is set on sent datagrams
+ * and the size of sent datagrams is limited to the path MTU known to the system.
+ * Additionally, frame loss is estimated from what the peer sends us (assuming the
+ * path is equally lossy in both directions). On lossy paths, datagrams are made
+ * smaller and sent without waiting for more data; on good paths they grow back
+ * to the path MTU and are filled for up to the configured latency.
  */
 typedef struct {
     DebugObject d_obj;
@@ -106,6 +113,21 @@ typedef struct {
     DatagramPeerIO_handler_error handler_error;
     int spproto_payload_mtu;
     int effective_socket_mtu;
+    int adaptive;
+    btime_t max_latency;
+    int min_dgram_len;
+    
+    // adaptive fragmentation
+    int ip_overhead;
+    int pmtu_dgram_len;
+    int loss_dgram_len;
+    btime_t loss_latency;
+    int loss_permille;
+    uint64_t last_frames_sent;
+    uint64_t last_frames_complete;
+    int send_dgram_len;
+    btime_t send_latency;
+    BTimer tune_timer;
     
     // sending base
     FragmentProtoDisassembler send_disassembler;
@@ -142,7 +164,9 @@ typedef struct {
  *                   send a FragmentProto chunk with one byte of data over SPProto, i.e. the following has to hold:
  *                   spproto_payload_mtu_for_carrier_mtu(sp_params, socket_mtu) > sizeof(struct fragmentproto_chunk_header)
  * @param sp_params SPProto security parameters
- * @param latency latency parameter to {@link FragmentProtoDisassembler_Init}.
+ * @param latency latency parameter to {@link FragmentProtoDisassembler_Init}. With adaptive
+ *                fragmentation, this is the maximum latency.
+ * @param adaptive whether to use adaptive fragmentation (see {@link DatagramPeerIO})
  * @param num_frames num_frames parameter to {@link FragmentProtoAssembler_Init}. Must be >0.
  * @param recv_userif interface to pass received packets to the user. Its MTU must be >=payload_mtu.
  * @param otp_warning_count If using OTPs, after how many encoded packets to call the handler.
@@ -162,6 +186,7 @@ int DatagramPeerIO_Init (
     int socket_mtu,
     struct spproto_security_params sp_params,
     btime_t latency,
+    int adaptive,
     int num_frames,
     PacketPassInterface *recv_userif,
     int otp_warning_count,
@@ -219,8 +244,9 @@ int DatagramPeerIO_Bind (DatagramPeerIO *o, BAddr addr) WARN_UNUSED;
  *
  * @param o the object
  * @param encryption_key key to use
+ * @param nonce_side 0 or 1, different on the two peers; see {@link SPProtoEncoder_SetEncryptionKey}
  */
-void DatagramPeerIO_SetEncryptionKey (DatagramPeerIO *o, uint8_t *encryption_key);
+void DatagramPeerIO_SetEncryptionKey (DatagramPeerIO *o, uint8_t *encryption_key, int nonce_side);
 
 /**
  * Removed the encryption key to use for sending and receiving.
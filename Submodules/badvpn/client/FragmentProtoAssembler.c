@@ -30,9 +30,9 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <misc/offset.h>
 #include <misc/byteorder.h>
 #include <misc/balloc.h>
+#include <misc/balign.h>
 
 #include "FragmentProtoAssembler.h"
 
@@ -40,115 +40,136 @@
 
 #define PeerLog(_o, ...) BLog_LogViaFunc((_o)->logfunc, (_o)->user, BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 
-#include "FragmentProtoAssembler_tree.h"
-#include <structure/SAvl_impl.h>
+#define RANGE_NONE 0
+#define RANGE_PARTIAL 1
+#define RANGE_ALL 2
 
-static void free_frame (FragmentProtoAssembler *o, struct FragmentProtoAssembler_frame *frame)
+static int bitmap_check_range (const uint64_t *bitmap, int start, int end)
 {
-    // remove from used list
-    LinkedList1_Remove(&o->frames_used, &frame->list_node);
-    // remove from used tree
-    FPAFramesTree_Remove(&o->frames_used_tree, 0, frame);
+    ASSERT(start >= 0)
+    ASSERT(end >= start)
     
-    // append to free list
-    LinkedList1_Append(&o->frames_free, &frame->list_node);
-}
-
-static void free_oldest_frame (FragmentProtoAssembler *o)
-{
-    ASSERT(!LinkedList1_IsEmpty(&o->frames_used))
+    if (start == end) {
+        return RANGE_NONE;
+    }
     
-    // obtain oldest frame (first on the list)
-    LinkedList1Node *list_node = LinkedList1_GetFirst(&o->frames_used);
-    ASSERT(list_node)
-    struct FragmentProtoAssembler_frame *frame = UPPER_OBJECT(list_node, struct FragmentProtoAssembler_frame, list_node);
+    int first = start / 64;
+    int last = (end - 1) / 64;
+    uint64_t first_mask = UINT64_MAX << (start % 64);
+    uint64_t last_mask = UINT64_MAX >> (63 - (end - 1) % 64);
     
-    // free frame
-    free_frame(o, frame);
+    if (first == last) {
+        uint64_t mask = first_mask & last_mask;
+        uint64_t bits = bitmap[first] & mask;
+        return (bits == 0 ? RANGE_NONE : bits == mask ? RANGE_ALL : RANGE_PARTIAL);
+    }
+    
+    // collect the union and intersection of the range's bits
+    uint64_t any = bitmap[first] & first_mask;
+    uint64_t all = bitmap[first] | ~first_mask;
+    for (int w = first + 1; w < last; w++) {
+        any |= bitmap[w];
+        all &= bitmap[w];
+    }
+    any |= bitmap[last] & last_mask;
+    all &= bitmap[last] | ~last_mask;
+    
+    return (any == 0 ? RANGE_NONE : all == UINT64_MAX ? RANGE_ALL : RANGE_PARTIAL);
 }
 
-static struct FragmentProtoAssembler_frame * allocate_new_frame (FragmentProtoAssembler *o, fragmentproto_frameid id)
+static void bitmap_set_range (uint64_t *bitmap, int start, int end)
 {
-    ASSERT(!FPAFramesTree_LookupExact(&o->frames_used_tree, 0, id))
+    ASSERT(start >= 0)
+    ASSERT(end >= start)
     
-    // if there are no free entries, free the oldest used one
-    if (LinkedList1_IsEmpty(&o->frames_free)) {
-        PeerLog(o, BLOG_INFO, "freeing used frame");
-        free_oldest_frame(o);
+    if (start == end) {
+        return;
     }
     
-    // obtain frame entry
-    LinkedList1Node *list_node = LinkedList1_GetFirst(&o->frames_free);
-    ASSERT(list_node)
-    struct FragmentProtoAssembler_frame *frame = UPPER_OBJECT(list_node, struct FragmentProtoAssembler_frame, list_node);
+    int first = start / 64;
+    int last = (end - 1) / 64;
+    uint64_t first_mask = UINT64_MAX << (start % 64);
+    uint64_t last_mask = UINT64_MAX >> (63 - (end - 1) % 64);
     
-    // remove from free list
-    LinkedList1_Remove(&o->frames_free, &frame->list_node);
-    
-    // initialize values
-    frame->id = id;
-    frame->time = o->time;
-    frame->num_chunks = 0;
-    frame->sum = 0;
-    frame->length = -1;
-    frame->length_so_far = 0;
-    
-    // append to used list
-    LinkedList1_Append(&o->frames_used, &frame->list_node);
-    // insert to used tree
-    int res = FPAFramesTree_Insert(&o->frames_used_tree, 0, frame, NULL);
-    ASSERT_EXECUTE(res)
+    if (first == last) {
+        bitmap[first] |= first_mask & last_mask;
+        return;
+    }
     
-    return frame;
-}
-
-static int chunks_overlap (int c1_start, int c1_len, int c2_start, int c2_len)
-{
-    return (c1_start + c1_len > c2_start && c2_start + c2_len > c1_start);
+    bitmap[first] |= first_mask;
+    for (int w = first + 1; w < last; w++) {
+        bitmap[w] = UINT64_MAX;
+    }
+    bitmap[last] |= last_mask;
 }
 
 static int frame_is_timed_out (FragmentProtoAssembler *o, struct FragmentProtoAssembler_frame *frame)
 {
+    ASSERT(frame->used)
     ASSERT(frame->time <= o->time)
     
     return (o->time - frame->time > o->time_tolerance);
 }
 
-static void reduce_times (FragmentProtoAssembler *o)
+static int frame_id_is_older (fragmentproto_frameid id, fragmentproto_frameid than_id)
 {
-    // find the frame with minimal time, removing timed out frames
-    struct FragmentProtoAssembler_frame *minframe = NULL;
-    LinkedList1Node *list_node = LinkedList1_GetFirst(&o->frames_used);
-    while (list_node) {
-        LinkedList1Node *next = LinkedList1Node_Next(list_node);
-        struct FragmentProtoAssembler_frame *frame = UPPER_OBJECT(list_node, struct FragmentProtoAssembler_frame, list_node);
-        if (frame_is_timed_out(o, frame)) {
-            PeerLog(o, BLOG_INFO, "freeing timed out frame (while reducing times)");
-            free_frame(o, frame);
-        } else {
-            if (!minframe || frame->time < minframe->time) {
-                minframe = frame;
-            }
-        }
-        list_node = next;
-    }
+    // IDs are ascending with wraparound
+    fragmentproto_frameid diff = than_id - id;
     
-    if (!minframe) {
-        // have no frames, set packet time to zero
-        o->time = 0;
+    return (diff != 0 && diff <= (fragmentproto_frameid)-1 / 2);
+}
+
+static void count_frame_id (FragmentProtoAssembler *o, fragmentproto_frameid frame_id)
+{
+    if (!o->have_newest_id) {
+        o->have_newest_id = 1;
+        o->newest_id = frame_id;
+        o->num_frames_sent++;
         return;
     }
     
-    uint32_t min_time = minframe->time;
+    // frames between the newest one and this one were sent too
+    if (frame_id_is_older(o->newest_id, frame_id)) {
+        o->num_frames_sent += (fragmentproto_frameid)(frame_id - o->newest_id);
+        o->newest_id = frame_id;
+    }
+}
+
+static struct FragmentProtoAssembler_frame * lookup_frame (FragmentProtoAssembler *o, fragmentproto_frameid frame_id)
+{
+    // the frame can only be in one slot
+    struct FragmentProtoAssembler_frame *frame = &o->frames_entries[frame_id & o->ring_mask];
     
-    // subtract minimal time from all frames
-    for (list_node = LinkedList1_GetFirst(&o->frames_used); list_node; list_node = LinkedList1Node_Next(list_node)) {
-        struct FragmentProtoAssembler_frame *frame = UPPER_OBJECT(list_node, struct FragmentProtoAssembler_frame, list_node);
-        frame->time -= min_time;
+    if (frame->used) {
+        if (frame_is_timed_out(o, frame)) {
+            PeerLog(o, BLOG_INFO, "freeing timed out frame");
+            frame->used = 0;
+        }
+        else if (frame->id == frame_id) {
+            return frame;
+        }
+        else if (frame_id_is_older(frame_id, frame->id)) {
+            // the frame was already evicted by a newer one
+            PeerLog(o, BLOG_INFO, "chunk for old frame");
+            return NULL;
+        }
+        else {
+            PeerLog(o, BLOG_INFO, "freeing used frame");
+            frame->used = 0;
+        }
     }
     
-    // subtract minimal time from packet time
-    o->time -= min_time;
+    // start a new frame in the slot
+    frame->used = 1;
+    frame->id = frame_id;
+    frame->time = o->time;
+    frame->num_chunks = 0;
+    frame->sum = 0;
+    frame->length = -1;
+    frame->length_so_far = 0;
+    memset(frame->bitmap, 0, o->bitmap_words * sizeof(frame->bitmap[0]));
+    
+    return frame;
 }
 
 static int process_chunk (FragmentProtoAssembler *o, fragmentproto_frameid frame_id, int chunk_start, int chunk_len, int is_last, uint8_t *payload)
@@ -176,31 +197,27 @@ static int process_chunk (FragmentProtoAssembler *o, fragmentproto_frameid frame
     ASSERT(chunk_end >= 0)
     ASSERT(chunk_end <= o->output_mtu)
     
-    // lookup frame
-    struct FragmentProtoAssembler_frame *frame = FPAFramesTree_LookupExact(&o->frames_used_tree, 0, frame_id);
+    // count frames sent by peer
+    count_frame_id(o, frame_id);
+    
+    // lookup frame, or start a new one
+    struct FragmentProtoAssembler_frame *frame = lookup_frame(o, frame_id);
     if (!frame) {
-        // frame not found, add a new one
-        frame = allocate_new_frame(o, frame_id);
-    } else {
-        // have existing frame with that ID
-        // check frame time
-        if (frame_is_timed_out(o, frame)) {
-            // frame is timed out, remove it and use a new one
-            PeerLog(o, BLOG_INFO, "freeing timed out frame (while processing chunk)");
-            free_frame(o, frame);
-            frame = allocate_new_frame(o, frame_id);
-        }
+        return 0;
     }
     
     ASSERT(frame->num_chunks < o->num_chunks)
     
-    // check if the chunk overlaps with any existing chunks
-    for (int i = 0; i < frame->num_chunks; i++) {
-        struct FragmentProtoAssembler_chunk *chunk = &frame->chunks[i];
-        if (chunks_overlap(chunk->start, chunk->len, chunk_start, chunk_len)) {
-            PeerLog(o, BLOG_INFO, "chunk overlaps with existing chunk");
-            goto fail_frame;
-        }
+    // check if we already have any of the chunk's data
+    int have = bitmap_check_range(frame->bitmap, chunk_start, chunk_end);
+    if (have == RANGE_ALL && (!is_last || frame->length == chunk_end)) {
+        // the link duplicated a packet, ignore the chunk
+        PeerLog(o, BLOG_DEBUG, "duplicate chunk");
+        return 0;
+    }
+    if (have != RANGE_NONE) {
+        PeerLog(o, BLOG_INFO, "chunk overlaps with existing chunk");
+        goto fail_frame;
     }
     
     if (is_last) {
@@ -230,13 +247,11 @@ static int process_chunk (FragmentProtoAssembler *o, fragmentproto_frameid frame
     // update frame time
     frame->time = o->time;
     
-    // add chunk entry
-    struct FragmentProtoAssembler_chunk *chunk = &frame->chunks[frame->num_chunks];
-    chunk->start = chunk_start;
-    chunk->len = chunk_len;
+    // count chunk
     frame->num_chunks++;
     
-    // update sum
+    // mark data received
+    bitmap_set_range(frame->bitmap, chunk_start, chunk_end);
     frame->sum += chunk_len;
     
     // update length
@@ -269,8 +284,11 @@ static int process_chunk (FragmentProtoAssembler *o, fragmentproto_frameid frame
     
     PeerLog(o, BLOG_DEBUG, "frame complete");
     
-    // free frame entry
-    free_frame(o, frame);
+    o->num_frames_complete++;
+    
+    // free frame entry; the buffer stays intact until the output is done
+    // since no more input is processed until then
+    frame->used = 0;
     
     // send frame
     PacketPassInterface_Sender_Send(o->output, frame->buffer, frame->length);
@@ -278,7 +296,7 @@ static int process_chunk (FragmentProtoAssembler *o, fragmentproto_frameid frame
     return 1;
     
 fail_frame:
-    free_frame(o, frame);
+    frame->used = 0;
     return 0;
 }
 
@@ -323,20 +341,8 @@ static void process_input (FragmentProtoAssembler *o)
         }
     }
     
-    // increment packet time
-    if (o->time == FPA_MAX_TIME) {
-        reduce_times(o);
-        if (!LinkedList1_IsEmpty(&o->frames_used)) {
-            ASSERT(o->time < FPA_MAX_TIME) // If there was a frame with zero time, it was removed because
-                                           // time_tolerance < FPA_MAX_TIME. So something >0 was subtracted.
-            o->time++;
-        } else {
-            // it was set to zero by reduce_times
-            ASSERT(o->time == 0)
-        }
-    } else {
-        o->time++;
-    }
+    // increment packet time; it's 64-bit so it never wraps
+    o->time++;
     
     // set no input packet
     o->in_len = -1;
@@ -371,7 +377,7 @@ int FragmentProtoAssembler_Init (FragmentProtoAssembler *o, int input_mtu, Packe
 {
     ASSERT(input_mtu >= 0)
     ASSERT(num_frames > 0)
-    ASSERT(num_frames < FPA_MAX_TIME) // needed so we can always subtract times when packet time is maximum
+    ASSERT(num_frames <= FPA_MAX_FRAMES)
     ASSERT(num_chunks > 0)
     
     // init arguments
@@ -395,48 +401,56 @@ int FragmentProtoAssembler_Init (FragmentProtoAssembler *o, int input_mtu, Packe
     // set time tolerance to num_frames
     o->time_tolerance = num_frames;
     
+    // number of slots is num_frames rounded up to a power of two
+    int num_slots = 1;
+    while (num_slots < num_frames) {
+        num_slots *= 2;
+    }
+    o->ring_mask = num_slots - 1;
+    
+    // one bit for every byte of a frame
+    o->bitmap_words = bdivide_up(o->output_mtu, 64);
+    
     // allocate frames
-    if (!(o->frames_entries = (struct FragmentProtoAssembler_frame *)BAllocArray(num_frames, sizeof(o->frames_entries[0])))) {
+    if (!(o->frames_entries = (struct FragmentProtoAssembler_frame *)BAllocArray(num_slots, sizeof(o->frames_entries[0])))) {
         goto fail1;
     }
     
-    // allocate chunks
-    if (!(o->frames_chunks = (struct FragmentProtoAssembler_chunk *)BAllocArray2(num_frames, o->num_chunks, sizeof(o->frames_chunks[0])))) {
+    // allocate bitmaps
+    if (!(o->frames_bitmap = (uint64_t *)BAllocArray2(num_slots, o->bitmap_words, sizeof(o->frames_bitmap[0])))) {
         goto fail2;
     }
     
     // allocate buffers
-    if (!(o->frames_buffer = (uint8_t *)BAllocArray(num_frames, o->output_mtu))) {
+    if (!(o->frames_buffer = (uint8_t *)BAllocArray(num_slots, o->output_mtu))) {
         goto fail3;
     }
     
-    // init frame lists
-    LinkedList1_Init(&o->frames_free);
-    LinkedList1_Init(&o->frames_used);
-    
     // initialize frame entries
-    for (int i = 0; i < num_frames; i++) {
+    for (int i = 0; i < num_slots; i++) {
         struct FragmentProtoAssembler_frame *frame = &o->frames_entries[i];
-        // set chunks array pointer
-        frame->chunks = o->frames_chunks + (size_t)i * o->num_chunks;
+        // set bitmap pointer
+        frame->bitmap = o->frames_bitmap + (size_t)i * o->bitmap_words;
         // set buffer pointer
         frame->buffer = o->frames_buffer + (size_t)i * o->output_mtu;
-        // add to free list
-        LinkedList1_Append(&o->frames_free, &frame->list_node);
+        // set unused
+        frame->used = 0;
     }
     
-    // init tree
-    FPAFramesTree_Init(&o->frames_used_tree);
-    
     // have no input packet
     o->in_len = -1;
     
+    // init counters
+    o->have_newest_id = 0;
+    o->num_frames_sent = 0;
+    o->num_frames_complete = 0;
+    
     DebugObject_Init(&o->d_obj);
     
     return 1;
     
 fail3:
-    BFree(o->frames_chunks);
+    BFree(o->frames_bitmap);
 fail2:
     BFree(o->frames_entries);
 fail1:
@@ -451,8 +465,8 @@ void FragmentProtoAssembler_Free (FragmentProtoAssembler *o)
     // free buffers
     BFree(o->frames_buffer);
     
-    // free chunks
-    BFree(o->frames_chunks);
+    // free bitmaps
+    BFree(o->frames_bitmap);
     
     // free frames
     BFree(o->frames_entries);
@@ -467,3 +481,11 @@ PacketPassInterface * FragmentProtoAssembler_GetInput (FragmentProtoAssembler *o
     
     return &o->input;
 }
+
+void FragmentProtoAssembler_GetCounters (FragmentProtoAssembler *o, uint64_t *out_sent, uint64_t *out_complete)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    *out_sent = o->num_frames_sent;
+    *out_complete = o->num_frames_complete;
+}
@@ -29,6 +29,11 @@
  * @section DESCRIPTION
  * 
  * Object which decodes packets according to FragmentProto.
+ * 
+ * Frames being assembled are kept in a ring of slots indexed directly by the
+ * low bits of the frame ID. Received parts of a frame are tracked with a bitmap
+ * with one bit per byte, so that overlaps and duplicates are detected without
+ * looking at other chunks.
  */
 
 #ifndef BADVPN_CLIENT_FRAGMENTPROTOASSEMBLER_H
@@ -38,35 +43,22 @@
 
 #include <protocol/fragmentproto.h>
 #include <misc/debug.h>
-#include <misc/compare.h>
 #include <base/DebugObject.h>
 #include <base/BLog.h>
-#include <structure/LinkedList1.h>
-#include <structure/SAvl.h>
 #include <flow/PacketPassInterface.h>
 
-#define FPA_MAX_TIME UINT32_MAX
-
-struct FragmentProtoAssembler_frame;
-
-#include "FragmentProtoAssembler_tree.h"
-#include <structure/SAvl_decl.h>
-
-struct FragmentProtoAssembler_chunk {
-    int start;
-    int len;
-};
+// maximum num_frames; frames must be comparable by ID within the ring
+#define FPA_MAX_FRAMES 32768
 
 struct FragmentProtoAssembler_frame {
-    LinkedList1Node list_node; // node in free or used list
-    struct FragmentProtoAssembler_chunk *chunks; // array of chunks, up to num_chunks
     uint8_t *buffer; // buffer with frame data, size output_mtu
+    uint64_t *bitmap; // bitmap of received bytes, output_mtu bits
+    int used; // whether the slot holds a frame
     // everything below only defined when frame entry is used
     fragmentproto_frameid id; // frame identifier
-    uint32_t time; // packet time when the last chunk was received
-    FPAFramesTreeNode tree_node; // node fields in tree for searching frames by id
-    int num_chunks; // number of valid chunks
-    int sum; // sum of all chunks' lengths
+    uint64_t time; // packet time when the last chunk was received
+    int num_chunks; // number of accepted chunks
+    int sum; // number of received bytes
     int length; // length of the frame, or -1 if not yet known
     int length_so_far; // if length=-1, current data set's upper bound
 };
@@ -84,14 +76,17 @@ typedef struct {
     PacketPassInterface *output;
     int output_mtu;
     int num_chunks;
-    uint32_t time;
+    uint64_t time;
     int time_tolerance;
+    int ring_mask;
+    int bitmap_words;
+    int have_newest_id;
+    fragmentproto_frameid newest_id;
+    uint64_t num_frames_sent;
+    uint64_t num_frames_complete;
     struct FragmentProtoAssembler_frame *frames_entries;
-    struct FragmentProtoAssembler_chunk *frames_chunks;
+    uint64_t *frames_bitmap;
     uint8_t *frames_buffer;
-    LinkedList1 frames_free;
-    LinkedList1 frames_used;
-    FPAFramesTree frames_used_tree;
     int in_len;
     uint8_t *in;
     int in_pos;
@@ -105,9 +100,10 @@ typedef struct {
  * @param o the object
  * @param input_mtu maximum input packet size. Must be >=0.
  * @param output output interface
- * @param num_frames number of frames we can hold. Must be >0 and < FPA_MAX_TIME.
+ * @param num_frames number of frames we can hold. Must be >0 and <=FPA_MAX_FRAMES.
  *  To make the assembler tolerate out-of-order input of degree D, set to D+2.
  *  Here, D is the minimum size of a hypothetical buffer needed to order the input.
+ *  It is rounded up to a power of two to get the number of slots.
  * @param num_chunks maximum number of chunks a frame can come in. Must be >0.
  * @param pg pending group
  * @param user argument to handlers
@@ -131,4 +127,15 @@ void FragmentProtoAssembler_Free (FragmentProtoAssembler *o);
  */
 PacketPassInterface * FragmentProtoAssembler_GetInput (FragmentProtoAssembler *o);
 
+/**
+ * Returns counters which can be used to estimate frame loss.
+ * The number of frames the peer has sent is estimated from the highest frame ID
+ * seen so far, so frames of which no chunk arrived are included.
+ *
+ * @param o the object
+ * @param out_sent returns the estimated number of frames sent by the peer
+ * @param out_complete returns the number of frames reassembled
+ */
+void FragmentProtoAssembler_GetCounters (FragmentProtoAssembler *o, uint64_t *out_sent, uint64_t *out_complete);
+
 #endif
@@ -39,7 +39,7 @@
 static void write_chunks (FragmentProtoDisassembler *o)
 {
     #define IN_AVAIL (o->in_len - o->in_used)
-    #define OUT_AVAIL ((o->output_mtu - o->out_used) - (int)sizeof(struct fragmentproto_chunk_header))
+    #define OUT_AVAIL ((o->out_limit - o->out_used) - (int)sizeof(struct fragmentproto_chunk_header))
     
     ASSERT(o->in_len >= 0)
     ASSERT(o->out)
@@ -87,16 +87,14 @@ static void write_chunks (FragmentProtoDisassembler *o)
         o->out = NULL;
         
         // stop timer (if it's running)
-        if (o->latency >= 0) {
-            BReactor_RemoveTimer(o->reactor, &o->timer);
-        }
+        BReactor_RemoveTimer(o->reactor, &o->timer);
         
         // finish output
         PacketRecvInterface_Done(&o->output, o->out_used);
     } else {
         // start timer if we have output and it's not running (output was empty before)
         if (!BTimer_IsRunning(&o->timer)) {
-            BReactor_SetTimer(o->reactor, &o->timer);
+            BReactor_SetTimerAfter(o->reactor, &o->timer, o->latency);
         }
     }
 }
@@ -139,6 +137,7 @@ static void output_handler_recv (FragmentProtoDisassembler *o, uint8_t *data)
     // set output packet
     o->out = data;
     o->out_used = 0;
+    o->out_limit = o->output_limit;
     
     // if there is no input, wait for it
     if (o->in_len < 0) {
@@ -150,7 +149,6 @@ static void output_handler_recv (FragmentProtoDisassembler *o, uint8_t *data)
 
 static void timer_handler (FragmentProtoDisassembler *o)
 {
-    ASSERT(o->latency >= 0)
     ASSERT(o->out)
     ASSERT(o->in_len == -1)
     
@@ -174,6 +172,9 @@ void FragmentProtoDisassembler_Init (FragmentProtoDisassembler *o, BReactor *rea
     o->chunk_mtu = chunk_mtu;
     o->latency = latency;
     
+    // no output limit below MTU
+    o->output_limit = o->output_mtu;
+    
     // init input
     PacketPassInterface_Init(&o->input, input_mtu, (PacketPassInterface_handler_send)input_handler_send, o, BReactor_PendingGroup(reactor));
     PacketPassInterface_EnableCancel(&o->input, (PacketPassInterface_handler_requestcancel)input_handler_requestcancel);
@@ -182,9 +183,7 @@ void FragmentProtoDisassembler_Init (FragmentProtoDisassembler *o, BReactor *rea
     PacketRecvInterface_Init(&o->output, o->output_mtu, (PacketRecvInterface_handler_recv)output_handler_recv, o, BReactor_PendingGroup(reactor));
     
     // init timer
-    if (o->latency >= 0) {
-        BTimer_Init(&o->timer, o->latency, (BTimer_handler)timer_handler, o);
-    }
+    BTimer_Init(&o->timer, 0, (BTimer_handler)timer_handler, o);
     
     // have no input packet
     o->in_len = -1;
@@ -203,9 +202,7 @@ void FragmentProtoDisassembler_Free (FragmentProtoDisassembler *o)
     DebugObject_Free(&o->d_obj);
 
     // free timer
-    if (o->latency >= 0) {
-        BReactor_RemoveTimer(o->reactor, &o->timer);
-    }
+    BReactor_RemoveTimer(o->reactor, &o->timer);
     
     // free output
     PacketRecvInterface_Free(&o->output);
@@ -227,3 +224,22 @@ PacketRecvInterface * FragmentProtoDisassembler_GetOutput (FragmentProtoDisassem
     
     return &o->output;
 }
+
+void FragmentProtoDisassembler_SetOutputLimit (FragmentProtoDisassembler *o, int output_limit)
+{
+    ASSERT(output_limit > (int)sizeof(struct fragmentproto_chunk_header))
+    ASSERT(output_limit <= o->output_mtu)
+    DebugObject_Access(&o->d_obj);
+    
+    // takes effect with the next output packet
+    o->output_limit = output_limit;
+}
+
+void FragmentProtoDisassembler_SetLatency (FragmentProtoDisassembler *o, btime_t latency)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    // takes effect when the timer is next started; a pending
+    // output packet is still sent when the running timer expires
+    o->latency = latency;
+}
@@ -54,6 +54,7 @@
 typedef struct {
     BReactor *reactor;
     int output_mtu;
+    int output_limit;
     int chunk_mtu;
     btime_t latency;
     PacketPassInterface input;
@@ -64,6 +65,7 @@ typedef struct {
     int in_used;
     uint8_t *out;
     int out_used;
+    int out_limit;
     fragmentproto_frameid frame_id;
     DebugObject d_obj;
 } FragmentProtoDisassembler;
@@ -106,4 +108,23 @@ PacketPassInterface * FragmentProtoDisassembler_GetInput (FragmentProtoDisassemb
  */
 PacketRecvInterface * FragmentProtoDisassembler_GetOutput (FragmentProtoDisassembler *o);
 
+/**
+ * Limits the size of output packets below the output MTU.
+ * Takes effect with the next output packet.
+ *
+ * @param o the object
+ * @param output_limit maximum output packet size. Must be >sizeof(struct fragmentproto_chunk_header)
+ *                     and <=output_mtu.
+ */
+void FragmentProtoDisassembler_SetOutputLimit (FragmentProtoDisassembler *o, int output_limit);
+
+/**
+ * Changes the latency.
+ * Takes effect with the next output packet which has to wait for more data.
+ *
+ * @param o the object
+ * @param latency latency as in {@link FragmentProtoDisassembler_Init}
+ */
+void FragmentProtoDisassembler_SetLatency (FragmentProtoDisassembler *o, btime_t latency);
+
 #endif
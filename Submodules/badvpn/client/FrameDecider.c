@@ -29,6 +29,7 @@
 
 #include <string.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include <misc/debug.h>
 #include <misc/offset.h>
@@ -51,27 +52,176 @@
 
 #define PeerLog(_o, ...) BLog_LogViaFunc((_o)->logfunc, (_o)->user, BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 
-static int compare_macs (const uint8_t *mac1, const uint8_t *mac2)
+#define HASH_KEY_USED ((uint64_t)1 << 63)
+#define HASH_MIN_SLOTS 16
+
+#include "FrameDecider_groups_tree.h"
+#include <structure/SAvl_impl.h>
+
+static void hash_init (FDHashTable *t)
 {
-    int c = memcmp(mac1, mac2, 6);
-    return B_COMPARE(c, 0);
+    t->slots = NULL;
+    t->num_slots = 0;
+    t->num_entries = 0;
+    t->bits = 0;
 }
 
-#include "FrameDecider_macs_tree.h"
-#include <structure/SAvl_impl.h>
+static void hash_free (FDHashTable *t)
+{
+    ASSERT(t->num_entries == 0)
+    
+    if (t->slots) {
+        BFree(t->slots);
+    }
+}
 
-#include "FrameDecider_groups_tree.h"
-#include <structure/SAvl_impl.h>
+static size_t hash_home (FDHashTable *t, uint64_t key)
+{
+    ASSERT(t->num_slots > 0)
+    
+    // Fibonacci hashing; the top bits of the product are well mixed
+    return (size_t)((key * UINT64_C(0x9E3779B97F4A7C15)) >> (64 - t->bits));
+}
 
-#include "FrameDecider_multicast_tree.h"
-#include <structure/SAvl_impl.h>
+static void hash_put (FDHashTable *t, uint64_t key, void *value)
+{
+    size_t mask = t->num_slots - 1;
+    size_t i = hash_home(t, key);
+    while (t->slots[i].key) {
+        ASSERT(t->slots[i].key != key)
+        i = (i + 1) & mask;
+    }
+    t->slots[i].key = key;
+    t->slots[i].value = value;
+}
+
+static int hash_reserve (FDHashTable *t, size_t max_entries)
+{
+    ASSERT(max_entries >= t->num_entries)
+    
+    // keep the load factor at or below one half
+    if (max_entries > SIZE_MAX / 4) {
+        return 0;
+    }
+    int bits = 0;
+    while (((size_t)1 << bits) < HASH_MIN_SLOTS || ((size_t)1 << bits) < 2 * max_entries) {
+        bits++;
+    }
+    if (bits <= t->bits) {
+        return 1;
+    }
+    
+    // allocate new slots
+    size_t num_slots = (size_t)1 << bits;
+    struct _FrameDecider_hash_slot *slots = (struct _FrameDecider_hash_slot *)BAllocArray(num_slots, sizeof(slots[0]));
+    if (!slots) {
+        return 0;
+    }
+    for (size_t i = 0; i < num_slots; i++) {
+        slots[i].key = 0;
+    }
+    
+    struct _FrameDecider_hash_slot *old_slots = t->slots;
+    size_t old_num_slots = t->num_slots;
+    
+    t->slots = slots;
+    t->num_slots = num_slots;
+    t->bits = bits;
+    
+    // move entries
+    for (size_t i = 0; i < old_num_slots; i++) {
+        if (old_slots[i].key) {
+            hash_put(t, old_slots[i].key, old_slots[i].value);
+        }
+    }
+    
+    if (old_slots) {
+        BFree(old_slots);
+    }
+    
+    return 1;
+}
+
+static void * hash_lookup (FDHashTable *t, uint64_t key)
+{
+    ASSERT(key & HASH_KEY_USED)
+    
+    if (t->num_entries == 0) {
+        return NULL;
+    }
+    
+    size_t mask = t->num_slots - 1;
+    for (size_t i = hash_home(t, key); t->slots[i].key; i = (i + 1) & mask) {
+        if (t->slots[i].key == key) {
+            return t->slots[i].value;
+        }
+    }
+    
+    return NULL;
+}
+
+static void hash_insert (FDHashTable *t, uint64_t key, void *value)
+{
+    ASSERT(key & HASH_KEY_USED)
+    ASSERT(2 * (t->num_entries + 1) <= t->num_slots)
+    
+    hash_put(t, key, value);
+    t->num_entries++;
+}
+
+static void hash_remove (FDHashTable *t, uint64_t key)
+{
+    ASSERT(key & HASH_KEY_USED)
+    ASSERT(t->num_entries > 0)
+    
+    size_t mask = t->num_slots - 1;
+    
+    // find entry
+    size_t i = hash_home(t, key);
+    while (t->slots[i].key != key) {
+        ASSERT(t->slots[i].key)
+        i = (i + 1) & mask;
+    }
+    
+    // Shift following entries back into the hole, as long as that doesn't move
+    // them before their home slot, so that no tombstones are needed.
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (!t->slots[j].key) {
+            break;
+        }
+        size_t home = hash_home(t, t->slots[j].key);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+    t->slots[i].key = 0;
+    
+    t->num_entries--;
+}
+
+static uint64_t mac_key (const uint8_t *mac)
+{
+    uint64_t key = 0;
+    for (int i = 0; i < 6; i++) {
+        key = (key << 8) | mac[i];
+    }
+    return key | HASH_KEY_USED;
+}
+
+static uint64_t sig_key (uint32_t sig)
+{
+    return (uint64_t)sig | HASH_KEY_USED;
+}
 
 static void add_mac_to_peer (FrameDeciderPeer *o, uint8_t *mac)
 {
     FrameDecider *d = o->d;
     
-    // locate entry in tree
-    struct _FrameDecider_mac_entry *e_entry = FDMacsTree_LookupExact(&d->macs_tree, 0, mac);
+    // locate entry in table
+    struct _FrameDecider_mac_entry *e_entry = (struct _FrameDecider_mac_entry *)hash_lookup(&d->macs_table, mac_key(mac));
     if (e_entry) {
         if (e_entry->peer == o) {
             // this is our MAC; only move it to the end of the used list
@@ -81,7 +231,7 @@ static void add_mac_to_peer (FrameDeciderPeer *o, uint8_t *mac)
         }
         
         // some other peer has that MAC; disassociate it
-        FDMacsTree_Remove(&d->macs_tree, 0, e_entry);
+        hash_remove(&d->macs_table, mac_key(e_entry->mac));
         LinkedList1_Remove(&e_entry->peer->mac_entries_used, &e_entry->list_node);
         LinkedList1_Append(&e_entry->peer->mac_entries_free, &e_entry->list_node);
     }
@@ -102,7 +252,7 @@ static void add_mac_to_peer (FrameDeciderPeer *o, uint8_t *mac)
         ASSERT(entry->peer == o)
         
         // remove from used
-        FDMacsTree_Remove(&d->macs_tree, 0, entry);
+        hash_remove(&d->macs_table, mac_key(entry->mac));
         LinkedList1_Remove(&o->mac_entries_used, &entry->list_node);
     }
     
@@ -113,8 +263,7 @@ static void add_mac_to_peer (FrameDeciderPeer *o, uint8_t *mac)
     
     // add to used
     LinkedList1_Append(&o->mac_entries_used, &entry->list_node);
-    int res = FDMacsTree_Insert(&d->macs_tree, 0, entry, NULL);
-    ASSERT_EXECUTE(res)
+    hash_insert(&d->macs_table, mac_key(entry->mac), entry);
 }
 
 static uint32_t compute_sig_for_group (uint32_t group)
@@ -130,12 +279,87 @@ static uint32_t compute_sig_for_mac (uint8_t *mac)
     return sig;
 }
 
+static void release_fanout (FrameDecider *d, FrameDeciderPeer **fanout)
+{
+    if (!fanout) {
+        return;
+    }
+    
+    // if a decision is going through it, free it when the decision is finished
+    if (d->decide_state == DECIDE_STATE_MULTICAST && d->decide_fanout == fanout) {
+        d->decide_fanout_orphaned = 1;
+        return;
+    }
+    
+    BFree(fanout);
+}
+
+static int build_fanout (FrameDecider *d, struct _FrameDecider_group_entry *master)
+{
+    ASSERT(master->is_master)
+    ASSERT(d->decide_state != DECIDE_STATE_MULTICAST)
+    
+    if (master->master.fanout_valid) {
+        return 1;
+    }
+    
+    // count group entries with this sig
+    int count = 0;
+    LinkedList3Iterator it;
+    LinkedList3Iterator_Init(&it, LinkedList3Node_First(&master->sig_list_node), 1);
+    while (LinkedList3Iterator_Next(&it)) {
+        count++;
+    }
+    
+    // reallocate fanout
+    if (master->master.fanout) {
+        BFree(master->master.fanout);
+    }
+    if (!(master->master.fanout = (FrameDeciderPeer **)BAllocArray(count, sizeof(master->master.fanout[0])))) {
+        return 0;
+    }
+    
+    // collect peers, each once even if it has more groups with this sig
+    int num = 0;
+    LinkedList3Node *sig_list_node;
+    LinkedList3Iterator_Init(&it, LinkedList3Node_First(&master->sig_list_node), 1);
+    while (sig_list_node = LinkedList3Iterator_Next(&it)) {
+        struct _FrameDecider_group_entry *group_entry = UPPER_OBJECT(sig_list_node, struct _FrameDecider_group_entry, sig_list_node);
+        if (!group_entry->peer->fanout_marked) {
+            group_entry->peer->fanout_marked = 1;
+            master->master.fanout[num++] = group_entry->peer;
+        }
+    }
+    
+    // clear marks
+    for (int i = 0; i < num; i++) {
+        master->master.fanout[i]->fanout_marked = 0;
+    }
+    
+    master->master.fanout_num = num;
+    master->master.fanout_valid = 1;
+    
+    return 1;
+}
+
+static void finish_multicast_decide (FrameDecider *d)
+{
+    ASSERT(d->decide_state == DECIDE_STATE_MULTICAST)
+    
+    // free fanout if its sig went away during the decision
+    if (d->decide_fanout_orphaned) {
+        BFree(d->decide_fanout);
+    }
+    
+    d->decide_state = DECIDE_STATE_NONE;
+}
+
 static void add_to_multicast (FrameDecider *d, struct _FrameDecider_group_entry *group_entry)
 {
     // compute sig
     uint32_t sig = compute_sig_for_group(group_entry->group);
     
-    struct _FrameDecider_group_entry *master = FDMulticastTree_LookupExact(&d->multicast_tree, 0, sig);
+    struct _FrameDecider_group_entry *master = (struct _FrameDecider_group_entry *)hash_lookup(&d->multicast_table, sig_key(sig));
     if (master) {
         // use existing master
         ASSERT(master->is_master)
@@ -145,6 +369,9 @@ static void add_to_multicast (FrameDecider *d, struct _FrameDecider_group_entry
         
         // insert to list
         LinkedList3Node_InitAfter(&group_entry->sig_list_node, &master->sig_list_node);
+        
+        // fanout has to be rebuilt
+        master->master.fanout_valid = 0;
     } else {
         // make this entry master
         
@@ -154,9 +381,12 @@ static void add_to_multicast (FrameDecider *d, struct _FrameDecider_group_entry
         // set sig
         group_entry->master.sig = sig;
         
-        // insert to multicast tree
-        int res = FDMulticastTree_Insert(&d->multicast_tree, 0, group_entry, NULL);
-        ASSERT_EXECUTE(res)
+        // have no fanout yet
+        group_entry->master.fanout_valid = 0;
+        group_entry->master.fanout = NULL;
+        
+        // insert to multicast table
+        hash_insert(&d->multicast_table, sig_key(sig), group_entry);
         
         // init list node
         LinkedList3Node_InitLonely(&group_entry->sig_list_node);
@@ -169,8 +399,8 @@ static void remove_from_multicast (FrameDecider *d, struct _FrameDecider_group_e
     uint32_t sig = compute_sig_for_group(group_entry->group);
     
     if (group_entry->is_master) {
-        // remove master from multicast tree
-        FDMulticastTree_Remove(&d->multicast_tree, 0, group_entry);
+        // remove master from multicast table
+        hash_remove(&d->multicast_table, sig_key(sig));
         
         if (!LinkedList3Node_IsLonely(&group_entry->sig_list_node)) {
             // at least one more group entry for this sig; make another entry the master
@@ -186,10 +416,23 @@ static void remove_from_multicast (FrameDecider *d, struct _FrameDecider_group_e
             // set sig
             newmaster->master.sig = sig;
             
-            // insert to multicast tree
-            int res = FDMulticastTree_Insert(&d->multicast_tree, 0, newmaster, NULL);
-            ASSERT_EXECUTE(res)
+            // take over fanout, which has to be rebuilt
+            newmaster->master.fanout_valid = 0;
+            newmaster->master.fanout = group_entry->master.fanout;
+            newmaster->master.fanout_num = group_entry->master.fanout_num;
+            
+            // insert to multicast table
+            hash_insert(&d->multicast_table, sig_key(sig), newmaster);
+        } else {
+            // no more group entries for this sig; free fanout
+            release_fanout(d, group_entry->master.fanout);
         }
+    } else {
+        // fanout of the master has to be rebuilt
+        struct _FrameDecider_group_entry *master = (struct _FrameDecider_group_entry *)hash_lookup(&d->multicast_table, sig_key(sig));
+        ASSERT(master)
+        ASSERT(master->is_master)
+        master->master.fanout_valid = 0;
     }
     
     // free linked list node
@@ -285,8 +528,8 @@ static void lower_group_timers_to_lmqt (FrameDecider *d, uint32_t group)
     // compute sig
     uint32_t sig = compute_sig_for_group(group);
     
-    // look up the sig in multicast tree
-    struct _FrameDecider_group_entry *master = FDMulticastTree_LookupExact(&d->multicast_tree, 0, sig);
+    // look up the sig in multicast table
+    struct _FrameDecider_group_entry *master = (struct _FrameDecider_group_entry *)hash_lookup(&d->multicast_table, sig_key(sig));
     if (!master) {
         return;
     }
@@ -335,11 +578,14 @@ void FrameDecider_Init (FrameDecider *o, int max_peer_macs, int max_peer_groups,
     // init peers list
     LinkedList1_Init(&o->peers_list);
     
-    // init MAC tree
-    FDMacsTree_Init(&o->macs_tree);
+    // have no peers
+    o->num_peers = 0;
+    
+    // init MAC table
+    hash_init(&o->macs_table);
     
-    // init multicast tree
-    FDMulticastTree_Init(&o->multicast_tree);
+    // init multicast table
+    hash_init(&o->multicast_table);
     
     // init decide state
     o->decide_state = DECIDE_STATE_NONE;
@@ -352,10 +598,22 @@ void FrameDecider_Init (FrameDecider *o, int max_peer_macs, int max_peer_groups,
 
 void FrameDecider_Free (FrameDecider *o)
 {
-    ASSERT(FDMulticastTree_IsEmpty(&o->multicast_tree))
-    ASSERT(FDMacsTree_IsEmpty(&o->macs_tree))
+    ASSERT(o->multicast_table.num_entries == 0)
+    ASSERT(o->macs_table.num_entries == 0)
     ASSERT(LinkedList1_IsEmpty(&o->peers_list))
+    ASSERT(o->num_peers == 0)
     DebugObject_Free(&o->d_obj);
+    
+    // finish decision
+    if (o->decide_state == DECIDE_STATE_MULTICAST) {
+        finish_multicast_decide(o);
+    }
+    
+    // free multicast table
+    hash_free(&o->multicast_table);
+    
+    // free MAC table
+    hash_free(&o->macs_table);
 }
 
 void FrameDecider_AnalyzeAndDecide (FrameDecider *o, const uint8_t *frame, int frame_len)
@@ -372,8 +630,8 @@ void FrameDecider_AnalyzeAndDecide (FrameDecider *o, const uint8_t *frame, int f
         case DECIDE_STATE_FLOOD:
             break;
         case DECIDE_STATE_MULTICAST:
-            LinkedList3Iterator_Free(&o->decide_multicast_it);
-            return;
+            finish_multicast_decide(o);
+            break;
         default:
             ASSERT(0);
     }
@@ -483,20 +741,31 @@ out:;
         // extract group's sig from destination MAC
         uint32_t sig = compute_sig_for_mac(eh.dest);
         
-        // look up the sig in multicast tree
-        struct _FrameDecider_group_entry *master = FDMulticastTree_LookupExact(&o->multicast_tree, 0, sig);
+        // look up the sig in multicast table
+        struct _FrameDecider_group_entry *master = (struct _FrameDecider_group_entry *)hash_lookup(&o->multicast_table, sig_key(sig));
         if (master) {
             ASSERT(master->is_master)
             
+            // update list of peers if group membership changed
+            if (!build_fanout(o, master)) {
+                BLog(BLOG_ERROR, "decide: failed to allocate multicast fanout, flooding");
+                o->decide_state = DECIDE_STATE_FLOOD;
+                o->decide_flood_current = LinkedList1_GetFirst(&o->peers_list);
+                return;
+            }
+            
             o->decide_state = DECIDE_STATE_MULTICAST;
-            LinkedList3Iterator_Init(&o->decide_multicast_it, LinkedList3Node_First(&master->sig_list_node), 1);
+            o->decide_fanout = master->master.fanout;
+            o->decide_fanout_num = master->master.fanout_num;
+            o->decide_fanout_pos = 0;
+            o->decide_fanout_orphaned = 0;
         }
         
         return;
     }
     
     // look for MAC entry
-    struct _FrameDecider_mac_entry *entry = FDMacsTree_LookupExact(&o->macs_tree, 0, eh.dest);
+    struct _FrameDecider_mac_entry *entry = (struct _FrameDecider_mac_entry *)hash_lookup(&o->macs_table, mac_key(eh.dest));
     if (entry) {
         o->decide_state = DECIDE_STATE_UNICAST;
         o->decide_unicast_peer = entry->peer;
@@ -539,14 +808,18 @@ FrameDeciderPeer * FrameDecider_NextDestination (FrameDecider *o)
         } break;
         
         case DECIDE_STATE_MULTICAST: {
-            LinkedList3Node *list_node = LinkedList3Iterator_Next(&o->decide_multicast_it);
-            if (!list_node) {
-                o->decide_state = DECIDE_STATE_NONE;
-                return NULL;
+            while (o->decide_fanout_pos < o->decide_fanout_num) {
+                FrameDeciderPeer *peer = o->decide_fanout[o->decide_fanout_pos++];
+                
+                // skip peers which were freed during the decision
+                if (peer) {
+                    return peer;
+                }
             }
-            struct _FrameDecider_group_entry *group_entry = UPPER_OBJECT(list_node, struct _FrameDecider_group_entry, sig_list_node);
             
-            return group_entry->peer;
+            finish_multicast_decide(o);
+            
+            return NULL;
         } break;
         
         default:
@@ -562,6 +835,17 @@ int FrameDeciderPeer_Init (FrameDeciderPeer *o, FrameDecider *d, void *user, BLo
     o->user = user;
     o->logfunc = logfunc;
     
+    // reserve space for our MAC entries and groups in the tables
+    size_t max_peers = (size_t)d->num_peers + 1;
+    if (d->max_peer_macs > SIZE_MAX / max_peers || !hash_reserve(&d->macs_table, max_peers * d->max_peer_macs)) {
+        PeerLog(o, BLOG_ERROR, "failed to reserve MAC table");
+        goto fail0;
+    }
+    if (d->max_peer_groups > SIZE_MAX / max_peers || !hash_reserve(&d->multicast_table, max_peers * d->max_peer_groups)) {
+        PeerLog(o, BLOG_ERROR, "failed to reserve multicast table");
+        goto fail0;
+    }
+    
     // allocate MAC entries
     if (!(o->mac_entries = (struct _FrameDecider_mac_entry *)BAllocArray(d->max_peer_macs, sizeof(struct _FrameDecider_mac_entry)))) {
         PeerLog(o, BLOG_ERROR, "failed to allocate MAC entries");
@@ -576,6 +860,7 @@ int FrameDeciderPeer_Init (FrameDeciderPeer *o, FrameDecider *d, void *user, BLo
     
     // insert to peers list
     LinkedList1_Append(&d->peers_list, &o->list_node);
+    d->num_peers++;
     
     // init MAC entry lists
     LinkedList1_Init(&o->mac_entries_free);
@@ -613,6 +898,9 @@ int FrameDeciderPeer_Init (FrameDeciderPeer *o, FrameDecider *d, void *user, BLo
     // initialize groups tree
     FDGroupsTree_Init(&o->groups_tree);
     
+    // not being collected into a fanout
+    o->fanout_marked = 0;
+    
     DebugObject_Init(&o->d_obj);
     
     return 1;
@@ -647,12 +935,21 @@ void FrameDeciderPeer_Free (FrameDeciderPeer *o)
         BReactor_RemoveTimer(d->reactor, &entry->timer);
     }
     
-    // remove used MAC entries from tree
+    // remove decide multicast references
+    if (d->decide_state == DECIDE_STATE_MULTICAST) {
+        for (int i = d->decide_fanout_pos; i < d->decide_fanout_num; i++) {
+            if (d->decide_fanout[i] == o) {
+                d->decide_fanout[i] = NULL;
+            }
+        }
+    }
+    
+    // remove used MAC entries from table
     for (node = LinkedList1_GetFirst(&o->mac_entries_used); node; node = LinkedList1Node_Next(node)) {
         struct _FrameDecider_mac_entry *entry = UPPER_OBJECT(node, struct _FrameDecider_mac_entry, list_node);
         
-        // remove from tree
-        FDMacsTree_Remove(&d->macs_tree, 0, entry);
+        // remove from table
+        hash_remove(&d->macs_table, mac_key(entry->mac));
     }
     
     // remove from peers list
@@ -660,6 +957,7 @@ void FrameDeciderPeer_Free (FrameDeciderPeer *o)
         d->decide_flood_current = LinkedList1Node_Next(d->decide_flood_current);
     }
     LinkedList1_Remove(&d->peers_list, &o->list_node);
+    d->num_peers--;
     
     // free group entries
     BFree(o->group_entries);
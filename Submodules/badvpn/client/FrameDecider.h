@@ -36,6 +36,7 @@
 #define BADVPN_CLIENT_FRAMEDECIDER_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include <structure/LinkedList1.h>
 #include <structure/LinkedList3.h>
@@ -48,23 +49,36 @@ struct _FrameDeciderPeer;
 struct _FrameDecider_mac_entry;
 struct _FrameDecider_group_entry;
 
-typedef const uint8_t *FDMacsTree_key;
-
-#include "FrameDecider_macs_tree.h"
-#include <structure/SAvl_decl.h>
-
 #include "FrameDecider_groups_tree.h"
 #include <structure/SAvl_decl.h>
 
-#include "FrameDecider_multicast_tree.h"
-#include <structure/SAvl_decl.h>
+/**
+ * Slot in a {@link FDHashTable}.
+ */
+struct _FrameDecider_hash_slot {
+    uint64_t key; // 0 if the slot is empty
+    void *value;
+};
+
+/**
+ * Open addressing hash table with linear probing, used to look up MAC entries
+ * and multicast masters. The slots are kept compact so that a lookup usually
+ * touches a single cache line. Space is reserved in advance with every
+ * {@link FrameDeciderPeer} for all entries the peer may add, so that
+ * insertion never fails; at most half the slots are ever used.
+ */
+typedef struct {
+    struct _FrameDecider_hash_slot *slots;
+    size_t num_slots; // zero or a power of two
+    size_t num_entries;
+    int bits; // log2 of num_slots
+} FDHashTable;
 
 struct _FrameDecider_mac_entry {
     struct _FrameDeciderPeer *peer;
     LinkedList1Node list_node; // node in FrameDeciderPeer.mac_entries_free or FrameDeciderPeer.mac_entries_used
     // defined when used:
-    uint8_t mac[6];
-    FDMacsTreeNode tree_node; // node in FrameDecider.macs_tree, indexed by mac
+    uint8_t mac[6]; // also indexed in FrameDecider.macs_table
 };
 
 struct _FrameDecider_group_entry {
@@ -81,8 +95,10 @@ struct _FrameDecider_group_entry {
     int is_master;
     // defined when used and we are master:
     struct {
-        uint32_t sig; // last 23 bits of group address
-        FDMulticastTreeNode tree_node; // node in FrameDecider.multicast_tree, indexed by sig
+        uint32_t sig; // last 23 bits of group address, indexed in FrameDecider.multicast_table
+        int fanout_valid; // whether fanout reflects the list of group entries with this sig
+        struct _FrameDeciderPeer **fanout; // distinct peers with this sig, or NULL
+        int fanout_num;
     } master;
 };
 
@@ -96,12 +112,16 @@ typedef struct {
     btime_t igmp_last_member_query_time;
     BReactor *reactor;
     LinkedList1 peers_list;
-    FDMacsTree macs_tree;
-    FDMulticastTree multicast_tree;
+    int num_peers;
+    FDHashTable macs_table;
+    FDHashTable multicast_table;
     int decide_state;
     LinkedList1Node *decide_flood_current;
     struct _FrameDeciderPeer *decide_unicast_peer;
-    LinkedList3Iterator decide_multicast_it;
+    struct _FrameDeciderPeer **decide_fanout;
+    int decide_fanout_num;
+    int decide_fanout_pos;
+    int decide_fanout_orphaned;
     DebugObject d_obj;
 } FrameDecider;
 
@@ -120,6 +140,7 @@ typedef struct _FrameDeciderPeer {
     LinkedList1 group_entries_free;
     LinkedList1 group_entries_used;
     FDGroupsTree groups_tree;
+    int fanout_marked;
     DebugObject d_obj;
 } FrameDeciderPeer;
 
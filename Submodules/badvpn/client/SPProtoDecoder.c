@@ -30,8 +30,11 @@
 #include <string.h>
 
 #include <misc/balign.h>
+#include <misc/balloc.h>
+#include <misc/minmax.h>
 #include <misc/byteorder.h>
 #include <security/BHash.h>
+#include <base/BMetrics.h>
 
 #include "SPProtoDecoder.h"
 
@@ -39,15 +42,32 @@
 
 #define PeerLog(_o, ...) BLog_LogViaFunc((_o)->logfunc, (_o)->user, BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 
-static void decode_work_func (SPProtoDecoder *o)
+static const uint64_t metric_decode_time_bounds[] = {250, 500, 1000, 2000, 4000, 8000, 16000, 32000, 64000, 128000};
+static BMetric metric_decode_time = BMETRIC_HISTOGRAM_INIT("badvpn_spproto_decode_packet_seconds", "Time spent decoding a packet, averaged over its burst.", metric_decode_time_bounds, 1000000000);
+
+static void decode_packet (SPProtoDecoder *o, struct SPProtoDecoder_slot *s, BEncryption *encryptor);
+static void decode_work_func (struct SPProtoDecoder_slot *s);
+static void decode_work_handler (struct SPProtoDecoder_slot *s);
+static void maybe_decode (SPProtoDecoder *o);
+static void decode_job_handler (SPProtoDecoder *o);
+static struct SPProtoDecoder_slot * get_slot (SPProtoDecoder *o, int i);
+static void release_slot (SPProtoDecoder *o);
+static void maybe_output (SPProtoDecoder *o);
+static void input_handler_send (SPProtoDecoder *o, uint8_t *data, int data_len);
+static void output_handler_done (SPProtoDecoder *o);
+static void maybe_stop_work_and_ignore (SPProtoDecoder *o);
+static void free_encryptors (SPProtoDecoder *o);
+
+static void decode_packet (SPProtoDecoder *o, struct SPProtoDecoder_slot *s, BEncryption *encryptor)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->in_len <= o->input_mtu)
+    ASSERT(s->state == SPPROTODECODER_SLOT_STATE_DECODING)
+    ASSERT(s->in_len >= 0)
+    ASSERT(s->in_len <= o->input_mtu)
     
-    uint8_t *in = o->in;
-    int in_len = o->in_len;
+    uint8_t *in = s->in;
+    int in_len = s->in_len;
     
-    o->tw_out_len = -1;
+    s->tw_out_len = -1;
     
     uint8_t *plaintext;
     int plaintext_len;
@@ -56,7 +76,32 @@ static void decode_work_func (SPProtoDecoder *o)
     if (!SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
         plaintext = in;
         plaintext_len = in_len;
-    } else {
+    }
+    else if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        int nonce_len = SPPROTO_AEAD_NONCE_LEN(o->sp_params);
+        int tag_len = SPPROTO_AEAD_TAG_LEN(o->sp_params);
+        
+        // input must have a nonce and a tag
+        if (in_len < nonce_len + tag_len) {
+            PeerLog(o, BLOG_WARNING, "packet does not have a nonce and tag");
+            return;
+        }
+        
+        // check if we have encryption key
+        if (!o->have_encryption_key) {
+            PeerLog(o, BLOG_WARNING, "have no encryption key");
+            return;
+        }
+        
+        // decrypt in place and verify
+        plaintext = in + nonce_len;
+        plaintext_len = in_len - nonce_len - tag_len;
+        if (!BEncryption_Open(encryptor, in, plaintext, plaintext, plaintext_len, plaintext + plaintext_len)) {
+            PeerLog(o, BLOG_WARNING, "packet failed authentication");
+            return;
+        }
+    }
+    else {
         // input must be a multiple of blocks size
         if (in_len % o->enc_block_size != 0) {
             PeerLog(o, BLOG_WARNING, "packet size not a multiple of block size");
@@ -82,8 +127,8 @@ static void decode_work_func (SPProtoDecoder *o)
         // decrypt
         uint8_t *ciphertext = in + o->enc_block_size;
         int ciphertext_len = in_len - o->enc_block_size;
-        plaintext = o->buf;
-        BEncryption_Decrypt(&o->encryptor, ciphertext, plaintext, ciphertext_len, iv);
+        plaintext = s->buf;
+        BEncryption_Decrypt(encryptor, ciphertext, plaintext, ciphertext_len, iv);
         
         // read padding
         if (ciphertext_len < o->enc_block_size) {
@@ -125,60 +170,198 @@ static void decode_work_func (SPProtoDecoder *o)
         // remember seed and OTP (can't check from here)
         struct spproto_otpdata header_otpd;
         memcpy(&header_otpd, header + SPPROTO_HEADER_OTPDATA_OFF(o->sp_params), sizeof(header_otpd));
-        o->tw_out_seed_id = ltoh16(header_otpd.seed_id);
-        o->tw_out_otp = header_otpd.otp;
+        s->tw_out_seed_id = ltoh16(header_otpd.seed_id);
+        s->tw_out_otp = header_otpd.otp;
     }
     
-    // check hash
-    if (SPPROTO_HAVE_HASH(o->sp_params)) {
-        uint8_t *header_hash = header + SPPROTO_HEADER_HASH_OFF(o->sp_params);
-        // read hash
-        uint8_t hash[BHASH_MAX_SIZE];
-        memcpy(hash, header_hash, o->hash_size);
-        // zero hash in packet
-        memset(header_hash, 0, o->hash_size);
-        // calculate hash
-        uint8_t hash_calc[BHASH_MAX_SIZE];
-        BHash_calculate(o->sp_params.hash_mode, plaintext, plaintext_len, hash_calc);
-        // set hash field to its original value
-        memcpy(header_hash, hash, o->hash_size);
-        // compare hashes
-        if (memcmp(hash, hash_calc, o->hash_size)) {
-            PeerLog(o, BLOG_WARNING, "packet has wrong hash");
-            return;
+    // return packet; the hash is checked for the whole burst
+    s->tw_out = plaintext + SPPROTO_HEADER_LEN(o->sp_params);
+    s->tw_out_len = plaintext_len - SPPROTO_HEADER_LEN(o->sp_params);
+}
+
+static void decode_work_func (struct SPProtoDecoder_slot *s)
+{
+    SPProtoDecoder *o = s->o;
+    ASSERT(s->burst_num > 0)
+    
+    uint64_t start_time = BMetrics_Now();
+    
+    struct SPProtoDecoder_slot *valid[SPPROTODECODER_MAX_BURST];
+    uint8_t *plaintexts[SPPROTODECODER_MAX_BURST];
+    int plaintext_lens[SPPROTODECODER_MAX_BURST];
+    int num = 0;
+    
+    // decrypt and check packets
+    for (int i = 0; i < s->burst_num; i++) {
+        struct SPProtoDecoder_slot *bs = s->burst[i];
+        decode_packet(o, bs, &s->encryptor);
+        if (bs->tw_out_len >= 0) {
+            valid[num] = bs;
+            plaintexts[num] = bs->tw_out - SPPROTO_HEADER_LEN(o->sp_params);
+            plaintext_lens[num] = SPPROTO_HEADER_LEN(o->sp_params) + bs->tw_out_len;
+            num++;
+        }
+    }
+    
+    // check hashes
+    if (SPPROTO_HAVE_HASH(o->sp_params) && num > 0) {
+        uint8_t hashes[SPPROTODECODER_MAX_BURST][BHASH_MAX_SIZE];
+        uint8_t hashes_calc[SPPROTODECODER_MAX_BURST][BHASH_MAX_SIZE];
+        uint8_t *hash_calc_ptrs[SPPROTODECODER_MAX_BURST];
+        
+        for (int i = 0; i < num; i++) {
+            uint8_t *header_hash = plaintexts[i] + SPPROTO_HEADER_HASH_OFF(o->sp_params);
+            // read hash
+            memcpy(hashes[i], header_hash, o->hash_size);
+            // zero hash in packet
+            memset(header_hash, 0, o->hash_size);
+            hash_calc_ptrs[i] = hashes_calc[i];
+        }
+        
+        // calculate hashes
+        BHash_calculate_burst(o->sp_params.hash_mode, num, plaintexts, plaintext_lens, hash_calc_ptrs);
+        
+        for (int i = 0; i < num; i++) {
+            // set hash field to its original value
+            memcpy(plaintexts[i] + SPPROTO_HEADER_HASH_OFF(o->sp_params), hashes[i], o->hash_size);
+            // compare hashes
+            if (memcmp(hashes[i], hashes_calc[i], o->hash_size)) {
+                PeerLog(o, BLOG_WARNING, "packet has wrong hash");
+                valid[i]->tw_out_len = -1;
+            }
         }
     }
     
-    // return packet
-    o->tw_out = plaintext + SPPROTO_HEADER_LEN(o->sp_params);
-    o->tw_out_len = plaintext_len - SPPROTO_HEADER_LEN(o->sp_params);
+    // observe time per packet, once for each packet
+    uint64_t packet_time = (BMetrics_Now() - start_time) / s->burst_num;
+    for (int i = 0; i < s->burst_num; i++) {
+        BMetric_Observe(&metric_decode_time, packet_time);
+    }
 }
 
-static void decode_work_handler (SPProtoDecoder *o)
+static void decode_work_handler (struct SPProtoDecoder_slot *s)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->tw_have)
+    SPProtoDecoder *o = s->o;
+    ASSERT(s->burst_num > 0)
     DebugObject_Access(&o->d_obj);
     
     // free work
-    BThreadWork_Free(&o->tw);
-    o->tw_have = 0;
+    BThreadWork_Free(&s->tw);
     
-    // check OTP
-    if (SPPROTO_HAVE_OTP(o->sp_params) && o->tw_out_len >= 0) {
-        if (!OTPChecker_CheckOTP(&o->otpchecker, o->tw_out_seed_id, o->tw_out_otp)) {
-            PeerLog(o, BLOG_WARNING, "packet has wrong OTP");
-            o->tw_out_len = -1;
+    // packets are decoded
+    for (int i = 0; i < s->burst_num; i++) {
+        ASSERT(s->burst[i]->state == SPPROTODECODER_SLOT_STATE_DECODING)
+        s->burst[i]->state = SPPROTODECODER_SLOT_STATE_DONE;
+    }
+    s->burst_num = 0;
+    
+    // output them if they're next
+    maybe_output(o);
+}
+
+static void maybe_decode (SPProtoDecoder *o)
+{
+    // packets are being collected for a burst; no need for the job
+    BPending_Unset(&o->decode_job);
+    
+    if (o->num_received == 0) {
+        return;
+    }
+    
+    // with threads, spread the packets over them
+    int num_threads = BThreadWorkDispatcher_NumThreads(o->twd);
+    int burst_size = SPPROTODECODER_MAX_BURST;
+    if (num_threads > 0) {
+        burst_size = bmax_int(1, bmin_int(burst_size, (o->num_received + num_threads - 1) / num_threads));
+    }
+    
+    struct SPProtoDecoder_slot *burst[SPPROTODECODER_MAX_BURST];
+    int burst_num = 0;
+    
+    for (int i = 0; i < o->slots_used; i++) {
+        struct SPProtoDecoder_slot *s = get_slot(o, i);
+        if (s->state != SPPROTODECODER_SLOT_STATE_RECEIVED) {
+            continue;
+        }
+        
+        s->state = SPPROTODECODER_SLOT_STATE_DECODING;
+        s->burst_num = 0;
+        burst[burst_num++] = s;
+        o->num_received--;
+        
+        if (burst_num == burst_size || o->num_received == 0) {
+            // the first slot owns the work for the burst
+            struct SPProtoDecoder_slot *bs = burst[0];
+            bs->burst_num = burst_num;
+            memcpy(bs->burst, burst, burst_num * sizeof(burst[0]));
+            burst_num = 0;
+            
+            // start decoding
+            BThreadWork_Init(&bs->tw, o->twd, (BThreadWork_handler_done)decode_work_handler, bs, (BThreadWork_work_func)decode_work_func, bs);
         }
     }
     
-    if (o->tw_out_len < 0) {
-        // cannot decode, finish input packet
+    ASSERT(o->num_received == 0)
+    ASSERT(burst_num == 0)
+}
+
+static void decode_job_handler (SPProtoDecoder *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    // sender has no more packets right now; decode what we have
+    maybe_decode(o);
+}
+
+static struct SPProtoDecoder_slot * get_slot (SPProtoDecoder *o, int i)
+{
+    ASSERT(i >= 0)
+    ASSERT(i < o->num_slots)
+    
+    return &o->slots[(o->slots_start + i) % o->num_slots];
+}
+
+static void release_slot (SPProtoDecoder *o)
+{
+    ASSERT(o->slots_used > 0)
+    
+    struct SPProtoDecoder_slot *s = get_slot(o, 0);
+    s->state = SPPROTODECODER_SLOT_STATE_FREE;
+    o->slots_start = (o->slots_start + 1) % o->num_slots;
+    o->slots_used--;
+    
+    // accept input packet waiting for a slot
+    if (o->in_blocked) {
+        o->in_blocked = 0;
         PacketPassInterface_Done(&o->input);
-        o->in_len = -1;
-    } else {
-        // submit decoded packet to output
-        PacketPassInterface_Sender_Send(o->output, o->tw_out, o->tw_out_len);
+    }
+}
+
+static void maybe_output (SPProtoDecoder *o)
+{
+    while (o->slots_used > 0) {
+        struct SPProtoDecoder_slot *s = get_slot(o, 0);
+        if (s->state != SPPROTODECODER_SLOT_STATE_DONE) {
+            return;
+        }
+        
+        // check OTP
+        if (SPPROTO_HAVE_OTP(o->sp_params) && s->tw_out_len >= 0) {
+            if (!OTPChecker_CheckOTP(&o->otpchecker, s->tw_out_seed_id, s->tw_out_otp)) {
+                PeerLog(o, BLOG_WARNING, "packet has wrong OTP");
+                s->tw_out_len = -1;
+            }
+        }
+        
+        if (s->tw_out_len >= 0) {
+            // submit decoded packet to output
+            s->state = SPPROTODECODER_SLOT_STATE_SENDING;
+            PacketPassInterface_Sender_Send(o->output, s->tw_out, s->tw_out_len);
+            return;
+        }
+        
+        // cannot decode, drop packet
+        release_slot(o);
     }
 }
 
@@ -186,43 +369,93 @@ static void input_handler_send (SPProtoDecoder *o, uint8_t *data, int data_len)
 {
     ASSERT(data_len >= 0)
     ASSERT(data_len <= o->input_mtu)
-    ASSERT(o->in_len == -1)
-    ASSERT(!o->tw_have)
+    ASSERT(o->slots_used < o->num_slots)
+    ASSERT(!o->in_blocked)
     DebugObject_Access(&o->d_obj);
     
-    // remember input
-    o->in = data;
-    o->in_len = data_len;
+    // copy input to the next free slot
+    struct SPProtoDecoder_slot *s = get_slot(o, o->slots_used);
+    ASSERT(s->state == SPPROTODECODER_SLOT_STATE_FREE)
+    memcpy(s->in, data, data_len);
+    s->in_len = data_len;
+    s->state = SPPROTODECODER_SLOT_STATE_RECEIVED;
+    o->slots_used++;
+    o->num_received++;
+    
+    // If there's space for more, accept the packet and collect more for the burst.
+    // The job is set before accepting so that any packets the sender has ready
+    // right away arrive before it runs.
+    if (o->slots_used < o->num_slots && o->num_received < SPPROTODECODER_MAX_BURST) {
+        BPending_Set(&o->decode_job);
+        PacketPassInterface_Done(&o->input);
+        return;
+    }
     
     // start decoding
-    BThreadWork_Init(&o->tw, o->twd, (BThreadWork_handler_done)decode_work_handler, o, (BThreadWork_work_func)decode_work_func, o);
-    o->tw_have = 1;
+    maybe_decode(o);
+    
+    // accept next packet if there's a slot for it
+    if (o->slots_used < o->num_slots) {
+        PacketPassInterface_Done(&o->input);
+    } else {
+        o->in_blocked = 1;
+    }
 }
 
 static void output_handler_done (SPProtoDecoder *o)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(!o->tw_have)
+    ASSERT(o->slots_used > 0)
+    ASSERT(get_slot(o, 0)->state == SPPROTODECODER_SLOT_STATE_SENDING)
     DebugObject_Access(&o->d_obj);
     
-    // finish input packet
-    PacketPassInterface_Done(&o->input);
-    o->in_len = -1;
+    // release slot
+    release_slot(o);
+    
+    // output next packet
+    maybe_output(o);
 }
 
 static void maybe_stop_work_and_ignore (SPProtoDecoder *o)
 {
-    ASSERT(!(o->tw_have) || o->in_len >= 0)
+    // free works first, since they reference other slots in their bursts
+    for (int i = 0; i < o->slots_used; i++) {
+        struct SPProtoDecoder_slot *s = get_slot(o, i);
+        if (s->state == SPPROTODECODER_SLOT_STATE_DECODING && s->burst_num > 0) {
+            BThreadWork_Free(&s->tw);
+            s->burst_num = 0;
+        }
+    }
     
-    if (o->tw_have) {
-        // free work
-        BThreadWork_Free(&o->tw);
-        o->tw_have = 0;
+    for (int i = 0; i < o->slots_used; i++) {
+        struct SPProtoDecoder_slot *s = get_slot(o, i);
         
-        // ignore packet, receive next one
-        PacketPassInterface_Done(&o->input);
-        o->in_len = -1;
+        // the packet being sent is already decoded
+        if (s->state == SPPROTODECODER_SLOT_STATE_SENDING) {
+            continue;
+        }
+        
+        // ignore packet
+        s->state = SPPROTODECODER_SLOT_STATE_DONE;
+        s->tw_out_len = -1;
     }
+    
+    // no more packets waiting for a burst
+    o->num_received = 0;
+    BPending_Unset(&o->decode_job);
+    
+    // release ignored packets
+    maybe_output(o);
+}
+
+static void free_encryptors (SPProtoDecoder *o)
+{
+    ASSERT(o->have_encryption_key)
+    
+    for (int i = 0; i < o->num_slots; i++) {
+        BEncryption_Free(&o->slots[i].encryptor);
+    }
+    
+    o->have_encryption_key = 0;
 }
 
 int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct spproto_security_params sp_params, int num_otp_seeds, BPendingGroup *pg, BThreadWorkDispatcher *twd, void *user, BLog_logfunc logfunc)
@@ -258,12 +491,30 @@ int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct
     // calculate input MTU
     o->input_mtu = spproto_carrier_mtu_for_payload_mtu(o->sp_params, o->output_mtu);
     
-    // allocate plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        int buf_size = balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->output_mtu + 1), o->enc_block_size);
-        if (!(o->buf = (uint8_t *)malloc(buf_size))) {
-            goto fail0;
+    // keep two bursts per thread in flight so threads don't wait for
+    // the event loop
+    o->num_slots = bmin_int(SPPROTODECODER_MAX_BURST * bmax_int(1, 2 * BThreadWorkDispatcher_NumThreads(o->twd)), SPPROTODECODER_MAX_SLOTS);
+    
+    // allocate slots
+    if (!(o->slots = (struct SPProtoDecoder_slot *)BAllocArray(o->num_slots, sizeof(o->slots[0])))) {
+        goto fail0;
+    }
+    
+    // allocate slot input buffers, plus plaintext buffers for block ciphers
+    int buf_size = 0;
+    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && !SPPROTO_HAVE_AEAD(o->sp_params)) {
+        buf_size = balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->output_mtu + 1), o->enc_block_size);
+    }
+    int i;
+    for (i = 0; i < o->num_slots; i++) {
+        struct SPProtoDecoder_slot *s = &o->slots[i];
+        s->o = o;
+        s->state = SPPROTODECODER_SLOT_STATE_FREE;
+        s->burst_num = 0;
+        if (!(s->in = (uint8_t *)BAlloc(o->input_mtu + buf_size))) {
+            goto fail1;
         }
+        s->buf = s->in + o->input_mtu;
     }
     
     // init input
@@ -272,7 +523,7 @@ int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct
     // init OTP checker
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
         if (!OTPChecker_Init(&o->otpchecker, o->sp_params.otp_num, o->sp_params.otp_mode, num_otp_seeds, o->twd)) {
-            goto fail1;
+            goto fail2;
         }
     }
     
@@ -281,21 +532,26 @@ int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct
         o->have_encryption_key = 0;
     }
     
-    // have no input packet
-    o->in_len = -1;
+    // have no slots in use
+    o->slots_start = 0;
+    o->slots_used = 0;
+    o->num_received = 0;
+    o->in_blocked = 0;
     
-    // have no work
-    o->tw_have = 0;
+    // init decode job
+    BPending_Init(&o->decode_job, pg, (BPending_handler)decode_job_handler, o);
     
     DebugObject_Init(&o->d_obj);
     
     return 1;
     
-fail1:
+fail2:
     PacketPassInterface_Free(&o->input);
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        free(o->buf);
+fail1:
+    while (i-- > 0) {
+        BFree(o->slots[i].in);
     }
+    BFree(o->slots);
 fail0:
     return 0;
 }
@@ -304,14 +560,20 @@ void SPProtoDecoder_Free (SPProtoDecoder *o)
 {
     DebugObject_Free(&o->d_obj);
     
-    // free work
-    if (o->tw_have) {
-        BThreadWork_Free(&o->tw);
+    // free works
+    for (int i = 0; i < o->slots_used; i++) {
+        struct SPProtoDecoder_slot *s = get_slot(o, i);
+        if (s->state == SPPROTODECODER_SLOT_STATE_DECODING && s->burst_num > 0) {
+            BThreadWork_Free(&s->tw);
+        }
     }
     
-    // free encryptor
+    // free decode job
+    BPending_Free(&o->decode_job);
+    
+    // free encryptors
     if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+        free_encryptors(o);
     }
     
     // free OTP checker
@@ -322,10 +584,11 @@ void SPProtoDecoder_Free (SPProtoDecoder *o)
     // free input
     PacketPassInterface_Free(&o->input);
     
-    // free plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        free(o->buf);
+    // free slots
+    for (int i = 0; i < o->num_slots; i++) {
+        BFree(o->slots[i].in);
     }
+    BFree(o->slots);
 }
 
 PacketPassInterface * SPProtoDecoder_GetInput (SPProtoDecoder *o)
@@ -343,16 +606,27 @@ void SPProtoDecoder_SetEncryptionKey (SPProtoDecoder *o, uint8_t *encryption_key
     // stop existing work
     maybe_stop_work_and_ignore(o);
     
-    // free encryptor
+    // free encryptors
     if (o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+        free_encryptors(o);
     }
     
-    // init encryptor
-    BEncryption_Init(&o->encryptor, BENCRYPTION_MODE_DECRYPT, o->sp_params.encryption_mode, encryption_key);
-    
-    // have encryption key
-    o->have_encryption_key = 1;
+    // init encryptors, one per slot as in SPProtoEncoder.
+    // If this fails we stay without a key.
+    int i;
+    for (i = 0; i < o->num_slots; i++) {
+        if (!BEncryption_Init(&o->slots[i].encryptor, BENCRYPTION_MODE_DECRYPT, o->sp_params.encryption_mode, encryption_key)) {
+            PeerLog(o, BLOG_ERROR, "BEncryption_Init failed");
+            break;
+        }
+    }
+    if (i < o->num_slots) {
+        while (i-- > 0) {
+            BEncryption_Free(&o->slots[i].encryptor);
+        }
+    } else {
+        o->have_encryption_key = 1;
+    }
 }
 
 void SPProtoDecoder_RemoveEncryptionKey (SPProtoDecoder *o)
@@ -363,12 +637,9 @@ void SPProtoDecoder_RemoveEncryptionKey (SPProtoDecoder *o)
     // stop existing work
     maybe_stop_work_and_ignore(o);
     
+    // free encryptors
     if (o->have_encryption_key) {
-        // free encryptor
-        BEncryption_Free(&o->encryptor);
-        
-        // have no encryption key
-        o->have_encryption_key = 0;
+        free_encryptors(o);
     }
 }
 
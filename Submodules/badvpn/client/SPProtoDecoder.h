@@ -41,6 +41,7 @@
 #include <base/BLog.h>
 #include <protocol/spproto.h>
 #include <security/BEncryption.h>
+#include <security/BHash.h>
 #include <security/OTPChecker.h>
 #include <flow/PacketPassInterface.h>
 
@@ -51,12 +52,49 @@
  */
 typedef void (*SPProtoDecoder_otp_handler) (void *user);
 
+/**
+ * Maximum number of packets being decoded at the same time.
+ */
+#define SPPROTODECODER_MAX_SLOTS 32
+
+/**
+ * Maximum number of packets decoded together in one burst.
+ * Must not be larger than BHASH_MAX_BURST.
+ */
+#define SPPROTODECODER_MAX_BURST 8
+
+#define SPPROTODECODER_SLOT_STATE_FREE 0
+#define SPPROTODECODER_SLOT_STATE_RECEIVED 1
+#define SPPROTODECODER_SLOT_STATE_DECODING 2
+#define SPPROTODECODER_SLOT_STATE_DONE 3
+#define SPPROTODECODER_SLOT_STATE_SENDING 4
+
+struct SPProtoDecoder_slot {
+    struct SPProtoDecoder_s *o;
+    int state;
+    uint8_t *in;
+    uint8_t *buf;
+    int in_len;
+    BEncryption encryptor;
+    BThreadWork tw;
+    int burst_num;
+    struct SPProtoDecoder_slot *burst[SPPROTODECODER_MAX_BURST];
+    uint16_t tw_out_seed_id;
+    otp_t tw_out_otp;
+    uint8_t *tw_out;
+    int tw_out_len;
+};
+
 /**
  * Object which decodes packets according to SPProto.
  * Input is with {@link PacketPassInterface}.
  * Output is with {@link PacketPassInterface}.
+ * 
+ * Input packets are copied and accepted right away as long as there is space,
+ * and decoded in bursts. When the thread work dispatcher uses threads, bursts
+ * are decoded in parallel. Packets are output in the order they were received.
  */
-typedef struct {
+typedef struct SPProtoDecoder_s {
     PacketPassInterface *output;
     struct spproto_security_params sp_params;
     BThreadWorkDispatcher *twd;
@@ -67,19 +105,16 @@ typedef struct {
     int enc_block_size;
     int enc_key_size;
     int input_mtu;
-    uint8_t *buf;
     PacketPassInterface input;
     OTPChecker otpchecker;
     int have_encryption_key;
-    BEncryption encryptor;
-    uint8_t *in;
-    int in_len;
-    int tw_have;
-    BThreadWork tw;
-    uint16_t tw_out_seed_id;
-    otp_t tw_out_otp;
-    uint8_t *tw_out;
-    int tw_out_len;
+    int num_slots;
+    struct SPProtoDecoder_slot *slots;
+    int slots_start;
+    int slots_used;
+    int num_received;
+    int in_blocked;
+    BPending decode_job;
     DebugObject d_obj;
 } SPProtoDecoder;
 
@@ -26,188 +26,389 @@
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
-
 #include <string.h>
 #include <stdlib.h>
 
 #include <misc/balign.h>
+#include <misc/balloc.h>
+#include <misc/minmax.h>
 #include <misc/offset.h>
 #include <misc/byteorder.h>
 #include <security/BRandom.h>
 #include <security/BHash.h>
+#include <base/BMetrics.h>
 
 #include "SPProtoEncoder.h"
 
+static const uint64_t metric_encode_time_bounds[] = {250, 500, 1000, 2000, 4000, 8000, 16000, 32000, 64000, 128000};
+static BMetric metric_encode_time = BMETRIC_HISTOGRAM_INIT("badvpn_spproto_encode_packet_seconds", "Time spent encoding a packet, averaged over its burst.", metric_encode_time_bounds, 1000000000);
+
+static struct SPProtoEncoder_slot * get_slot (SPProtoEncoder *o, int i);
+static uint8_t * plaintext_location (SPProtoEncoder *o, struct SPProtoEncoder_slot *s);
 static int can_encode (SPProtoEncoder *o);
-static void encode_packet (SPProtoEncoder *o);
-static void encode_work_func (SPProtoEncoder *o);
-static void encode_work_handler (SPProtoEncoder *o);
+static void encode_burst (SPProtoEncoder *o, struct SPProtoEncoder_slot **slots, int num);
+static void encode_work_func (struct SPProtoEncoder_slot *s);
+static void encode_work_handler (struct SPProtoEncoder_slot *s);
 static void maybe_encode (SPProtoEncoder *o);
+static void encode_job_handler (SPProtoEncoder *o);
+static void maybe_receive (SPProtoEncoder *o);
+static void maybe_output (SPProtoEncoder *o);
 static void output_handler_recv (SPProtoEncoder *o, uint8_t *data);
 static void input_handler_done (SPProtoEncoder *o, int data_len);
 static void handler_job_hander (SPProtoEncoder *o);
 static void otpgenerator_handler (SPProtoEncoder *o);
 static void maybe_stop_work (SPProtoEncoder *o);
+static void free_encryptors (SPProtoEncoder *o);
 
-static int can_encode (SPProtoEncoder *o)
+static struct SPProtoEncoder_slot * get_slot (SPProtoEncoder *o, int i)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(!o->tw_have)
+    ASSERT(i >= 0)
+    ASSERT(i < o->num_slots)
     
+    return &o->slots[(o->slots_start + i) % o->num_slots];
+}
+
+static uint8_t * plaintext_location (SPProtoEncoder *o, struct SPProtoEncoder_slot *s)
+{
+    // block ciphers need padding, so they encrypt from a separate buffer;
+    // AEAD ciphers encrypt in place after the nonce
+    if (!SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
+        return s->out;
+    }
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        return s->out + SPPROTO_AEAD_NONCE_LEN(o->sp_params);
+    }
+    return s->buf;
+}
+
+static int can_encode (SPProtoEncoder *o)
+{
     return (
         (!SPPROTO_HAVE_OTP(o->sp_params) || OTPGenerator_GetPosition(&o->otpgen) < o->sp_params.otp_num) &&
         (!SPPROTO_HAVE_ENCRYPTION(o->sp_params) || o->have_encryption_key)
     );
 }
 
-static void encode_packet (SPProtoEncoder *o)
+static void encode_burst (SPProtoEncoder *o, struct SPProtoEncoder_slot **slots, int num)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(!o->tw_have)
-    ASSERT(can_encode(o))
+    ASSERT(num > 0)
+    ASSERT(num <= SPPROTOENCODER_MAX_BURST)
     
-    // generate OTP, remember seed ID
-    if (SPPROTO_HAVE_OTP(o->sp_params)) {
-        o->tw_seed_id = o->otpgen_seed_id;
-        o->tw_otp = OTPGenerator_GetOTP(&o->otpgen);
+    for (int i = 0; i < num; i++) {
+        struct SPProtoEncoder_slot *s = slots[i];
+        ASSERT(s->state == SPPROTOENCODER_SLOT_STATE_READY)
+        ASSERT(can_encode(o))
+        
+        // generate OTP, remember seed ID
+        if (SPPROTO_HAVE_OTP(o->sp_params)) {
+            s->tw_seed_id = o->otpgen_seed_id;
+            s->tw_otp = OTPGenerator_GetOTP(&o->otpgen);
+        }
+        
+        // take packet counter for the nonce
+        if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+            s->tw_nonce_counter = o->nonce_counter++;
+        }
+        
+        // schedule OTP warning handler
+        if (SPPROTO_HAVE_OTP(o->sp_params) && OTPGenerator_GetPosition(&o->otpgen) == o->otp_warning_count) {
+            BPending_Set(&o->handler_job);
+        }
+        
+        s->state = SPPROTOENCODER_SLOT_STATE_ENCODING;
+        s->burst_num = 0;
+        o->num_ready--;
     }
     
-    // start work
-    BThreadWork_Init(&o->tw, o->twd, (BThreadWork_handler_done)encode_work_handler, o, (BThreadWork_work_func)encode_work_func, o);
-    o->tw_have = 1;
+    // the first slot owns the work for the burst
+    struct SPProtoEncoder_slot *s = slots[0];
+    s->burst_num = num;
+    memcpy(s->burst, slots, num * sizeof(slots[0]));
     
-    // schedule OTP warning handler
-    if (SPPROTO_HAVE_OTP(o->sp_params) && OTPGenerator_GetPosition(&o->otpgen) == o->otp_warning_count) {
-        BPending_Set(&o->handler_job);
-    }
+    // start work
+    BThreadWork_Init(&s->tw, o->twd, (BThreadWork_handler_done)encode_work_handler, s, (BThreadWork_work_func)encode_work_func, s);
 }
 
-static void encode_work_func (SPProtoEncoder *o)
+static void encode_work_func (struct SPProtoEncoder_slot *s)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
+    SPProtoEncoder *o = s->o;
+    ASSERT(s->burst_num > 0)
     ASSERT(!SPPROTO_HAVE_ENCRYPTION(o->sp_params) || o->have_encryption_key)
     
-    ASSERT(o->in_len <= o->input_mtu)
-    
-    // determine plaintext location
-    uint8_t *plaintext = (SPPROTO_HAVE_ENCRYPTION(o->sp_params) ? o->buf : o->out);
+    uint64_t start_time = BMetrics_Now();
     
-    // plaintext begins with header
-    uint8_t *header = plaintext;
+    int num = s->burst_num;
+    uint8_t *plaintexts[SPPROTOENCODER_MAX_BURST];
+    int plaintext_lens[SPPROTOENCODER_MAX_BURST];
     
-    // plaintext is header + payload
-    int plaintext_len = SPPROTO_HEADER_LEN(o->sp_params) + o->in_len;
-    
-    // write OTP
-    if (SPPROTO_HAVE_OTP(o->sp_params)) {
-        struct spproto_otpdata header_otpd;
-        header_otpd.seed_id = htol16(o->tw_seed_id);
-        header_otpd.otp = o->tw_otp;
-        memcpy(header + SPPROTO_HEADER_OTPDATA_OFF(o->sp_params), &header_otpd, sizeof(header_otpd));
+    for (int i = 0; i < num; i++) {
+        struct SPProtoEncoder_slot *bs = s->burst[i];
+        ASSERT(bs->state == SPPROTOENCODER_SLOT_STATE_ENCODING)
+        ASSERT(bs->in_len <= o->input_mtu)
+        
+        // determine plaintext location; it begins with the header
+        uint8_t *header = plaintexts[i] = plaintext_location(o, bs);
+        
+        // plaintext is header + payload
+        plaintext_lens[i] = SPPROTO_HEADER_LEN(o->sp_params) + bs->in_len;
+        
+        // write OTP
+        if (SPPROTO_HAVE_OTP(o->sp_params)) {
+            struct spproto_otpdata header_otpd;
+            header_otpd.seed_id = htol16(bs->tw_seed_id);
+            header_otpd.otp = bs->tw_otp;
+            memcpy(header + SPPROTO_HEADER_OTPDATA_OFF(o->sp_params), &header_otpd, sizeof(header_otpd));
+        }
+        
+        // zero hash field
+        if (SPPROTO_HAVE_HASH(o->sp_params)) {
+            memset(header + SPPROTO_HEADER_HASH_OFF(o->sp_params), 0, o->hash_size);
+        }
     }
     
-    // write hash
+    // write hashes
     if (SPPROTO_HAVE_HASH(o->sp_params)) {
-        uint8_t *header_hash = header + SPPROTO_HEADER_HASH_OFF(o->sp_params);
-        // zero hash field
-        memset(header_hash, 0, o->hash_size);
-        // calculate hash
-        uint8_t hash[BHASH_MAX_SIZE];
-        BHash_calculate(o->sp_params.hash_mode, plaintext, plaintext_len, hash);
-        // set hash field
-        memcpy(header_hash, hash, o->hash_size);
+        uint8_t hashes[SPPROTOENCODER_MAX_BURST][BHASH_MAX_SIZE];
+        uint8_t *hash_ptrs[SPPROTOENCODER_MAX_BURST];
+        for (int i = 0; i < num; i++) {
+            hash_ptrs[i] = hashes[i];
+        }
+        
+        // calculate hashes
+        BHash_calculate_burst(o->sp_params.hash_mode, num, plaintexts, plaintext_lens, hash_ptrs);
+        
+        // set hash fields
+        for (int i = 0; i < num; i++) {
+            memcpy(plaintexts[i] + SPPROTO_HEADER_HASH_OFF(o->sp_params), hashes[i], o->hash_size);
+        }
     }
     
-    int out_len;
-    
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        // encrypting pad(header + payload)
-        int cyphertext_len = balign_up((plaintext_len + 1), o->enc_block_size);
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        int nonce_len = SPPROTO_AEAD_NONCE_LEN(o->sp_params);
+        int salt_len = SPPROTO_AEAD_NONCE_SALT_LEN(o->sp_params);
         
-        // write padding
-        plaintext[plaintext_len] = 1;
-        for (int i = plaintext_len + 1; i < cyphertext_len; i++) {
-            plaintext[i] = 0;
+        for (int i = 0; i < num; i++) {
+            struct SPProtoEncoder_slot *bs = s->burst[i];
+            
+            // write nonce: salt, then packet counter
+            uint64_t counter = hton64(bs->tw_nonce_counter);
+            memcpy(bs->out, o->nonce_salt, salt_len);
+            memcpy(bs->out + salt_len, &counter, sizeof(counter));
+            
+            // encrypt header + payload in place, append tag
+            BEncryption_Seal(&s->encryptor, bs->out, plaintexts[i], plaintexts[i], plaintext_lens[i], plaintexts[i] + plaintext_lens[i]);
+            bs->tw_out_len = nonce_len + plaintext_lens[i] + SPPROTO_AEAD_TAG_LEN(o->sp_params);
         }
+    }
+    else if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
+        uint8_t ivs[SPPROTOENCODER_MAX_BURST][BENCRYPTION_MAX_BLOCK_SIZE];
+        uint8_t *iv_ptrs[SPPROTOENCODER_MAX_BURST];
+        uint8_t *cyphertexts[SPPROTOENCODER_MAX_BURST];
+        int cyphertext_lens[SPPROTOENCODER_MAX_BURST];
         
-        // generate IV
-        BRandom_randomize(o->out, o->enc_block_size);
-        
-        // copy IV because BEncryption_Encrypt changes the IV
-        uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
-        memcpy(iv, o->out, o->enc_block_size);
+        for (int i = 0; i < num; i++) {
+            struct SPProtoEncoder_slot *bs = s->burst[i];
+            uint8_t *plaintext = plaintexts[i];
+            int plaintext_len = plaintext_lens[i];
+            
+            // encrypting pad(header + payload)
+            int cyphertext_len = balign_up((plaintext_len + 1), o->enc_block_size);
+            
+            // write padding
+            plaintext[plaintext_len] = 1;
+            for (int j = plaintext_len + 1; j < cyphertext_len; j++) {
+                plaintext[j] = 0;
+            }
+            
+            // generate IV
+            BRandom_randomize(bs->out, o->enc_block_size);
+            
+            // copy IV because BEncryption_EncryptBurst changes the IV
+            memcpy(ivs[i], bs->out, o->enc_block_size);
+            iv_ptrs[i] = ivs[i];
+            
+            cyphertexts[i] = bs->out + o->enc_block_size;
+            cyphertext_lens[i] = cyphertext_len;
+            bs->tw_out_len = o->enc_block_size + cyphertext_len;
+        }
         
         // encrypt
-        BEncryption_Encrypt(&o->encryptor, plaintext, o->out + o->enc_block_size, cyphertext_len, iv);
-        out_len = o->enc_block_size + cyphertext_len;
+        BEncryption_EncryptBurst(&s->encryptor, num, plaintexts, cyphertexts, cyphertext_lens, iv_ptrs);
     } else {
-        out_len = plaintext_len;
+        for (int i = 0; i < num; i++) {
+            s->burst[i]->tw_out_len = plaintext_lens[i];
+        }
     }
     
-    // remember length
-    o->tw_out_len = out_len;
+    // observe time per packet, once for each packet
+    uint64_t packet_time = (BMetrics_Now() - start_time) / num;
+    for (int i = 0; i < num; i++) {
+        BMetric_Observe(&metric_encode_time, packet_time);
+    }
 }
 
-static void encode_work_handler (SPProtoEncoder *o)
+static void encode_work_handler (struct SPProtoEncoder_slot *s)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(o->tw_have)
+    SPProtoEncoder *o = s->o;
+    ASSERT(s->burst_num > 0)
+    DebugObject_Access(&o->d_obj);
     
     // free work
-    BThreadWork_Free(&o->tw);
-    o->tw_have = 0;
+    BThreadWork_Free(&s->tw);
     
-    // finish packet
-    o->in_len = -1;
-    o->out_have = 0;
-    PacketRecvInterface_Done(&o->output, o->tw_out_len);
+    // packets are ready for output
+    for (int i = 0; i < s->burst_num; i++) {
+        ASSERT(s->burst[i]->state == SPPROTOENCODER_SLOT_STATE_ENCODING)
+        s->burst[i]->state = SPPROTOENCODER_SLOT_STATE_DONE;
+    }
+    s->burst_num = 0;
+    
+    // output them if they're next
+    maybe_output(o);
 }
 
 static void maybe_encode (SPProtoEncoder *o)
 {
-    if (o->in_len >= 0 && o->out_have && !o->tw_have && can_encode(o)) {
-        encode_packet(o);
+    // packets are being collected for a burst; no need for the job
+    BPending_Unset(&o->encode_job);
+    
+    // collect read packets in order, as many as we can encode
+    struct SPProtoEncoder_slot *ready[SPPROTOENCODER_MAX_SLOTS];
+    int num_ready = 0;
+    int can_num = (SPPROTO_HAVE_OTP(o->sp_params) ? o->sp_params.otp_num - OTPGenerator_GetPosition(&o->otpgen) : o->num_slots);
+    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && !o->have_encryption_key) {
+        can_num = 0;
+    }
+    for (int i = 0; i < o->slots_used && num_ready < can_num; i++) {
+        struct SPProtoEncoder_slot *s = get_slot(o, i);
+        if (s->state == SPPROTOENCODER_SLOT_STATE_READY) {
+            ready[num_ready++] = s;
+        }
+    }
+    
+    if (num_ready == 0) {
+        return;
+    }
+    
+    // with threads, spread the packets over them
+    int num_threads = BThreadWorkDispatcher_NumThreads(o->twd);
+    int burst_size = SPPROTOENCODER_MAX_BURST;
+    if (num_threads > 0) {
+        burst_size = bmax_int(1, bmin_int(burst_size, (num_ready + num_threads - 1) / num_threads));
+    }
+    
+    // encode in bursts
+    for (int i = 0; i < num_ready; i += burst_size) {
+        encode_burst(o, ready + i, bmin_int(burst_size, num_ready - i));
+    }
+}
+
+static void encode_job_handler (SPProtoEncoder *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    // input has no more packets right now; encode what we have
+    maybe_encode(o);
+}
+
+static void maybe_receive (SPProtoEncoder *o)
+{
+    if (o->receiving || o->slots_used == o->num_slots) {
+        return;
+    }
+    
+    // read into the next free slot
+    struct SPProtoEncoder_slot *s = get_slot(o, o->slots_used);
+    ASSERT(s->state == SPPROTOENCODER_SLOT_STATE_FREE)
+    s->state = SPPROTOENCODER_SLOT_STATE_RECEIVING;
+    
+    // if the packet will be output next, encode it right into the output
+    // packet instead of copying it there later
+    s->out = ((o->slots_used == 0 && o->out_have) ? o->out : s->own_out);
+    o->slots_used++;
+    o->receiving = 1;
+    
+    // schedule receive
+    PacketRecvInterface_Receiver_Recv(o->input, plaintext_location(o, s) + SPPROTO_HEADER_LEN(o->sp_params));
+}
+
+static void maybe_output (SPProtoEncoder *o)
+{
+    while (o->slots_used > 0) {
+        struct SPProtoEncoder_slot *s = get_slot(o, 0);
+        
+        if (s->state == SPPROTOENCODER_SLOT_STATE_DONE) {
+            // wait for output to be wanted
+            if (!o->out_have) {
+                return;
+            }
+            
+            // copy packet to output, unless it was encoded there
+            if (s->out != o->out) {
+                memcpy(o->out, s->out, s->tw_out_len);
+            }
+            o->out_have = 0;
+            PacketRecvInterface_Done(&o->output, s->tw_out_len);
+        }
+        else if (s->state != SPPROTOENCODER_SLOT_STATE_DROPPED) {
+            return;
+        }
+        
+        // release slot
+        s->state = SPPROTOENCODER_SLOT_STATE_FREE;
+        o->slots_start = (o->slots_start + 1) % o->num_slots;
+        o->slots_used--;
+        
+        // reuse the slot
+        maybe_receive(o);
     }
 }
 
 static void output_handler_recv (SPProtoEncoder *o, uint8_t *data)
 {
-    ASSERT(o->in_len == -1)
     ASSERT(!o->out_have)
-    ASSERT(!o->tw_have)
     DebugObject_Access(&o->d_obj);
     
     // remember output packet
     o->out_have = 1;
     o->out = data;
     
-    // determine plaintext location
-    uint8_t *plaintext = (SPPROTO_HAVE_ENCRYPTION(o->sp_params) ? o->buf : o->out);
+    // output finished packet, if any
+    maybe_output(o);
     
-    // schedule receive
-    PacketRecvInterface_Receiver_Recv(o->input, plaintext + SPPROTO_HEADER_LEN(o->sp_params));
+    // start reading if we aren't
+    maybe_receive(o);
 }
 
 static void input_handler_done (SPProtoEncoder *o, int data_len)
 {
     ASSERT(data_len >= 0)
     ASSERT(data_len <= o->input_mtu)
-    ASSERT(o->in_len == -1)
-    ASSERT(o->out_have)
-    ASSERT(!o->tw_have)
+    ASSERT(o->receiving)
     DebugObject_Access(&o->d_obj);
     
     // remember input packet
-    o->in_len = data_len;
+    struct SPProtoEncoder_slot *s = get_slot(o, o->slots_used - 1);
+    ASSERT(s->state == SPPROTOENCODER_SLOT_STATE_RECEIVING)
+    s->state = SPPROTOENCODER_SLOT_STATE_READY;
+    s->in_len = data_len;
+    o->receiving = 0;
+    o->num_ready++;
+    
+    // If there's space for more packets, read ahead. The encode job is set
+    // before the input's jobs, so if the input has more packets right away,
+    // they are read before it runs and encoded in the same burst.
+    if (o->slots_used < o->num_slots && o->num_ready < SPPROTOENCODER_MAX_BURST) {
+        BPending_Set(&o->encode_job);
+        maybe_receive(o);
+        return;
+    }
     
     // encode if possible
-    if (can_encode(o)) {
-        encode_packet(o);
-    }
+    maybe_encode(o);
+    
+    // read ahead
+    maybe_receive(o);
 }
 
 static void handler_job_hander (SPProtoEncoder *o)
@@ -235,11 +436,41 @@ static void otpgenerator_handler (SPProtoEncoder *o)
 
 static void maybe_stop_work (SPProtoEncoder *o)
 {
-    // stop existing work
-    if (o->tw_have) {
-        BThreadWork_Free(&o->tw);
-        o->tw_have = 0;
+    // stop existing works
+    for (int i = 0; i < o->slots_used; i++) {
+        struct SPProtoEncoder_slot *s = get_slot(o, i);
+        if (s->state == SPPROTOENCODER_SLOT_STATE_ENCODING && s->burst_num > 0) {
+            BThreadWork_Free(&s->tw);
+            s->burst_num = 0;
+        }
+    }
+    
+    for (int i = 0; i < o->slots_used; i++) {
+        struct SPProtoEncoder_slot *s = get_slot(o, i);
+        if (s->state != SPPROTOENCODER_SLOT_STATE_ENCODING) {
+            continue;
+        }
+        
+        // AEAD ciphers encrypt in place, so the plaintext may be gone;
+        // drop such packets, encode others again with the new key
+        if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+            s->state = SPPROTOENCODER_SLOT_STATE_DROPPED;
+        } else {
+            s->state = SPPROTOENCODER_SLOT_STATE_READY;
+            o->num_ready++;
+        }
+    }
+}
+
+static void free_encryptors (SPProtoEncoder *o)
+{
+    ASSERT(o->have_encryption_key)
+    
+    for (int i = 0; i < o->num_slots; i++) {
+        BEncryption_Free(&o->slots[i].encryptor);
     }
+    
+    o->have_encryption_key = 0;
 }
 
 int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct spproto_security_params sp_params, int otp_warning_count, BPendingGroup *pg, BThreadWorkDispatcher *twd)
@@ -292,33 +523,60 @@ int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct s
     // init input
     PacketRecvInterface_Receiver_Init(o->input, (PacketRecvInterface_handler_done)input_handler_done, o);
     
-    // have no input in buffer
-    o->in_len = -1;
-    
     // init output
     PacketRecvInterface_Init(&o->output, o->output_mtu, (PacketRecvInterface_handler_recv)output_handler_recv, o, pg);
     
     // have no output available
     o->out_have = 0;
     
-    // allocate plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        int buf_size = balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->input_mtu + 1), o->enc_block_size);
-        if (!(o->buf = (uint8_t *)malloc(buf_size))) {
-            goto fail1;
+    // have space for a burst, or with threads, two bursts per thread so
+    // threads don't wait for the event loop
+    int num_threads = BThreadWorkDispatcher_NumThreads(o->twd);
+    o->num_slots = bmin_int(SPPROTOENCODER_MAX_BURST * bmax_int(1, 2 * num_threads), SPPROTOENCODER_MAX_SLOTS);
+    
+    // allocate slots
+    if (!(o->slots = (struct SPProtoEncoder_slot *)BAllocArray(o->num_slots, sizeof(o->slots[0])))) {
+        goto fail1;
+    }
+    
+    // allocate slot buffers, plus plaintext buffers for block ciphers
+    int buf_size = 0;
+    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && !SPPROTO_HAVE_AEAD(o->sp_params)) {
+        buf_size = balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->input_mtu + 1), o->enc_block_size);
+    }
+    int i;
+    for (i = 0; i < o->num_slots; i++) {
+        struct SPProtoEncoder_slot *s = &o->slots[i];
+        s->o = o;
+        s->state = SPPROTOENCODER_SLOT_STATE_FREE;
+        s->burst_num = 0;
+        if (!(s->own_out = (uint8_t *)BAlloc(o->output_mtu + buf_size))) {
+            goto fail2;
         }
+        s->buf = s->own_out + o->output_mtu;
     }
     
+    // have no slots in use
+    o->slots_start = 0;
+    o->slots_used = 0;
+    o->num_ready = 0;
+    o->receiving = 0;
+    
     // init handler job
     BPending_Init(&o->handler_job, pg, (BPending_handler)handler_job_hander, o);
     
-    // have no work
-    o->tw_have = 0;
+    // init encode job
+    BPending_Init(&o->encode_job, pg, (BPending_handler)encode_job_handler, o);
     
     DebugObject_Init(&o->d_obj);
     
     return 1;
     
+fail2:
+    while (i-- > 0) {
+        BFree(o->slots[i].own_out);
+    }
+    BFree(o->slots);
 fail1:
     PacketRecvInterface_Free(&o->output);
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
@@ -332,27 +590,34 @@ void SPProtoEncoder_Free (SPProtoEncoder *o)
 {
     DebugObject_Free(&o->d_obj);
     
-    // free work
-    if (o->tw_have) {
-        BThreadWork_Free(&o->tw);
+    // free works
+    for (int i = 0; i < o->slots_used; i++) {
+        struct SPProtoEncoder_slot *s = get_slot(o, i);
+        if (s->state == SPPROTOENCODER_SLOT_STATE_ENCODING && s->burst_num > 0) {
+            BThreadWork_Free(&s->tw);
+        }
     }
     
+    // free encode job
+    BPending_Free(&o->encode_job);
+    
     // free handler job
     BPending_Free(&o->handler_job);
     
-    // free plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        free(o->buf);
+    // free encryptors
+    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && o->have_encryption_key) {
+        free_encryptors(o);
+    }
+    
+    // free slots
+    for (int i = 0; i < o->num_slots; i++) {
+        BFree(o->slots[i].own_out);
     }
+    BFree(o->slots);
     
     // free output
     PacketRecvInterface_Free(&o->output);
     
-    // free encryptor
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
-    }
-    
     // free otp generator
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
         OTPGenerator_Free(&o->otpgen);
@@ -366,27 +631,50 @@ PacketRecvInterface * SPProtoEncoder_GetOutput (SPProtoEncoder *o)
     return &o->output;
 }
 
-void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key)
+void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key, int nonce_side)
 {
     ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(nonce_side == 0 || nonce_side == 1)
     DebugObject_Access(&o->d_obj);
     
     // stop existing work
     maybe_stop_work(o);
     
-    // free encryptor
+    // free encryptors
     if (o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+        free_encryptors(o);
     }
     
-    // init encryptor
-    BEncryption_Init(&o->encryptor, BENCRYPTION_MODE_ENCRYPT, o->sp_params.encryption_mode, encryption_key);
+    // init encryptors; each slot has its own since an AEAD cipher context
+    // can't be used from several threads at once.
+    // If this fails we stay without a key.
+    int i;
+    for (i = 0; i < o->num_slots; i++) {
+        if (!BEncryption_Init(&o->slots[i].encryptor, BENCRYPTION_MODE_ENCRYPT, o->sp_params.encryption_mode, encryption_key)) {
+            break;
+        }
+    }
+    if (i < o->num_slots) {
+        while (i-- > 0) {
+            BEncryption_Free(&o->slots[i].encryptor);
+        }
+    } else {
+        o->have_encryption_key = 1;
+    }
     
-    // have encryption key
-    o->have_encryption_key = 1;
+    // start nonces with a new salt, with its top bit telling the side;
+    // the 64-bit counter can't run out, so the key never needs replacing
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        int salt_len = SPPROTO_AEAD_NONCE_SALT_LEN(o->sp_params);
+        ASSERT(salt_len > 0)
+        BRandom_randomize(o->nonce_salt, salt_len);
+        o->nonce_salt[0] = (o->nonce_salt[0] & 0x7F) | (nonce_side << 7);
+        o->nonce_counter = 0;
+    }
     
     // possibly continue I/O
     maybe_encode(o);
+    maybe_output(o);
 }
 
 void SPProtoEncoder_RemoveEncryptionKey (SPProtoEncoder *o)
@@ -397,13 +685,13 @@ void SPProtoEncoder_RemoveEncryptionKey (SPProtoEncoder *o)
     // stop existing work
     maybe_stop_work(o);
     
+    // free encryptors
     if (o->have_encryption_key) {
-        // free encryptor
-        BEncryption_Free(&o->encryptor);
-        
-        // have no encryption key
-        o->have_encryption_key = 0;
+        free_encryptors(o);
     }
+    
+    // release dropped packets
+    maybe_output(o);
 }
 
 void SPProtoEncoder_SetOTPSeed (SPProtoEncoder *o, uint16_t seed_id, uint8_t *key, uint8_t *iv)
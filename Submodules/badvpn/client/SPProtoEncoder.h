@@ -40,6 +40,7 @@
 #include <protocol/spproto.h>
 #include <base/DebugObject.h>
 #include <security/BEncryption.h>
+#include <security/BHash.h>
 #include <security/OTPGenerator.h>
 #include <flow/PacketRecvInterface.h>
 #include <threadwork/BThreadWork.h>
@@ -52,13 +53,52 @@
  */
 typedef void (*SPProtoEncoder_handler) (void *user);
 
+/**
+ * Maximum number of packets being encoded at the same time.
+ */
+#define SPPROTOENCODER_MAX_SLOTS 32
+
+/**
+ * Maximum number of packets encoded together in one burst.
+ * Must not be larger than BENCRYPTION_MAX_BURST and BHASH_MAX_BURST.
+ */
+#define SPPROTOENCODER_MAX_BURST 8
+
+#define SPPROTOENCODER_SLOT_STATE_FREE 0
+#define SPPROTOENCODER_SLOT_STATE_RECEIVING 1
+#define SPPROTOENCODER_SLOT_STATE_READY 2
+#define SPPROTOENCODER_SLOT_STATE_ENCODING 3
+#define SPPROTOENCODER_SLOT_STATE_DONE 4
+#define SPPROTOENCODER_SLOT_STATE_DROPPED 5
+
+struct SPProtoEncoder_slot {
+    struct SPProtoEncoder_s *o;
+    int state;
+    uint8_t *own_out;
+    uint8_t *out;
+    uint8_t *buf;
+    int in_len;
+    BEncryption encryptor;
+    BThreadWork tw;
+    int burst_num;
+    struct SPProtoEncoder_slot *burst[SPPROTOENCODER_MAX_BURST];
+    uint16_t tw_seed_id;
+    otp_t tw_otp;
+    uint64_t tw_nonce_counter;
+    int tw_out_len;
+};
+
 /**
  * Object which encodes packets according to SPProto.
  *
  * Input is with {@link PacketRecvInterface}.
  * Output is with {@link PacketRecvInterface}.
+ * 
+ * Input packets are read ahead as long as the input provides them right away,
+ * and encoded in bursts. When the thread work dispatcher uses threads, bursts
+ * are encoded in parallel. Packets are output in the order they were read.
  */
-typedef struct {
+typedef struct SPProtoEncoder_s {
     PacketRecvInterface *input;
     struct spproto_security_params sp_params;
     int otp_warning_count;
@@ -72,20 +112,21 @@ typedef struct {
     uint16_t otpgen_seed_id;
     uint16_t otpgen_pending_seed_id;
     int have_encryption_key;
-    BEncryption encryptor;
+    uint8_t nonce_salt[BENCRYPTION_MAX_NONCE_SIZE];
+    uint64_t nonce_counter;
     int input_mtu;
     int output_mtu;
-    int in_len;
     PacketRecvInterface output;
     int out_have;
     uint8_t *out;
-    uint8_t *buf;
     BPending handler_job;
-    int tw_have;
-    BThreadWork tw;
-    uint16_t tw_seed_id;
-    otp_t tw_otp;
-    int tw_out_len;
+    BPending encode_job;
+    int num_slots;
+    struct SPProtoEncoder_slot *slots;
+    int slots_start;
+    int slots_used;
+    int num_ready;
+    int receiving;
     DebugObject d_obj;
 } SPProtoEncoder;
 
@@ -130,8 +171,10 @@ PacketRecvInterface * SPProtoEncoder_GetOutput (SPProtoEncoder *o);
  *
  * @param o the object
  * @param encryption_key key to use
+ * @param nonce_side 0 or 1. With an AEAD cipher, the two peers using the same key
+ *                   must pass different values, so that their nonces are distinct.
  */
-void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key);
+void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key, int nonce_side);
 
 /**
  * Removes an encryption key if one is configured.
@@ -47,6 +47,7 @@
 #include <structure/LinkedList1.h>
 #include <base/DebugObject.h>
 #include <base/BLog.h>
+#include <base/BMetrics.h>
 #include <security/BSecurity.h>
 #include <security/BRandom.h>
 #include <system/BSignal.h>
@@ -60,6 +61,8 @@
 
 #ifndef BADVPN_USE_WINAPI
 #include <base/BLog_syslog.h>
+#include <base/BLog_async.h>
+#include <system/BMetricsServer.h>
 #endif
 
 #include <client/client.h>
@@ -90,12 +93,14 @@ struct {
     #ifndef BADVPN_USE_WINAPI
     char *logger_syslog_facility;
     char *logger_syslog_ident;
+    int logger_async;
     #endif
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
     int threads;
     int use_threads_for_ssl_handshake;
     int use_threads_for_ssl_data;
+    int use_ktls_for_ssl_data;
     int ssl;
     char *nssdb;
     char *client_cert_name;
@@ -113,6 +118,7 @@ struct {
     int otp_num;
     int otp_num_warn;
     int fragmentation_latency;
+    int adaptive_fragmentation;
     int peer_ssl;
     int peer_tcp_socket_sndbuf;
     int send_buffer_size;
@@ -123,6 +129,9 @@ struct {
     int igmp_last_member_query_time;
     int allow_peer_talk_without_ssl;
     int max_peers;
+    #ifndef BADVPN_USE_WINAPI
+    char *metrics_socket;
+    #endif
 } options;
 
 // bind addresses
@@ -155,6 +164,11 @@ char server_name[256];
 // reactor
 BReactor ss;
 
+#ifndef BADVPN_USE_WINAPI
+// metrics server, if enabled
+BMetricsServer metrics_server;
+#endif
+
 // thread work dispatcher
 BThreadWorkDispatcher twd;
 
@@ -181,6 +195,8 @@ int data_mtu;
 LinkedList1 peers;
 int num_peers;
 
+static BMetric metric_peers = BMETRIC_GAUGE_INIT("badvpn_client_peers", "Peers known from the server.");
+
 // frame decider
 FrameDecider frame_decider;
 
@@ -419,6 +435,13 @@ int main (int argc, char *argv[])
         }
     }
     
+    #ifndef BADVPN_USE_WINAPI
+    // pass messages to the logger from a background thread
+    if (options.logger_async && !BLog_StartAsync(BLOG_ASYNC_DEFAULT_BUFFER_SIZE)) {
+        BLog(BLOG_WARNING, "BLog_StartAsync failed, logging synchronously");
+    }
+    #endif
+    
     BLog(BLOG_NOTICE, "initializing "GLOBAL_PRODUCT_NAME" "PROGRAM_NAME" "GLOBAL_VERSION);
     
     if (options.ssl) {
@@ -487,10 +510,18 @@ int main (int argc, char *argv[])
         goto fail2;
     }
     
+    #ifndef BADVPN_USE_WINAPI
+    // init metrics server
+    if (options.metrics_socket && !BMetricsServer_Init(&metrics_server, options.metrics_socket, &ss)) {
+        BLog(BLOG_ERROR, "BMetricsServer_Init failed");
+        goto fail3;
+    }
+    #endif
+    
     // init thread work dispatcher
     if (!BThreadWorkDispatcher_Init(&twd, &ss, options.threads)) {
         BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init failed");
-        goto fail3;
+        goto fail3a;
     }
     
     // init BSecurity
@@ -618,6 +649,12 @@ fail8:
 fail4:
     // NOTE: BThreadWorkDispatcher must be freed before NSPR and stuff
     BThreadWorkDispatcher_Free(&twd);
+fail3a:
+    #ifndef BADVPN_USE_WINAPI
+    if (options.metrics_socket) {
+        BMetricsServer_Free(&metrics_server);
+    }
+    #endif
 fail3:
     BSignal_Finish();
 fail2:
@@ -664,12 +701,17 @@ void print_help (const char *name)
         "            [--syslog-facility <string>]\n"
         "            [--syslog-ident <string>]\n"
         "        )\n"
+        "        [--logger-async]\n"
         #endif
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
+        #ifndef BADVPN_USE_WINAPI
+        "        [--metrics-socket <path>]\n"
+        #endif
         "        [--threads <integer>]\n"
         "        [--use-threads-for-ssl-handshake]\n"
         "        [--use-threads-for-ssl-data]\n"
+        "        [--use-ktls-for-ssl-data]\n"
         "        [--ssl --nssdb <string> --client-cert-name <string>]\n"
         "        [--server-name <string>]\n"
         "        --server-addr <addr>\n"
@@ -682,10 +724,11 @@ void print_help (const char *name)
         "        ] ...\n"
         "        --transport-mode <udp/tcp>\n"
         "        (transport-mode=udp?\n"
-        "            --encryption-mode <blowfish/aes/none>\n"
+        "            --encryption-mode <blowfish/aes/aes-gcm/chacha20-poly1305/none>\n"
         "            --hash-mode <md5/sha1/none>\n"
         "            [--otp <blowfish/aes> <num> <num-warn>]\n"
         "            [--fragmentation-latency <milliseconds>]\n"
+        "            [--adaptive-fragmentation]\n"
         "        )\n"
         "        (transport-mode=tcp?\n"
         "            (ssl? [--peer-ssl])\n"
@@ -721,6 +764,8 @@ int parse_arguments (int argc, char *argv[])
     #ifndef BADVPN_USE_WINAPI
     options.logger_syslog_facility = "daemon";
     options.logger_syslog_ident = argv[0];
+    options.logger_async = 0;
+    options.metrics_socket = NULL;
     #endif
     options.loglevel = -1;
     for (int i = 0; i < BLOG_NUM_CHANNELS; i++) {
@@ -729,6 +774,7 @@ int parse_arguments (int argc, char *argv[])
     options.threads = 0;
     options.use_threads_for_ssl_handshake = 0;
     options.use_threads_for_ssl_data = 0;
+    options.use_ktls_for_ssl_data = 0;
     options.ssl = 0;
     options.nssdb = NULL;
     options.client_cert_name = NULL;
@@ -742,6 +788,7 @@ int parse_arguments (int argc, char *argv[])
     options.hash_mode = -1;
     options.otp_mode = SPPROTO_OTP_MODE_NONE;
     options.fragmentation_latency = PEER_DEFAULT_UDP_FRAGMENTATION_LATENCY;
+    options.adaptive_fragmentation = 0;
     options.peer_ssl = 0;
     options.peer_tcp_socket_sndbuf = -1;
     options.send_buffer_size = PEER_DEFAULT_SEND_BUFFER_SIZE;
@@ -801,6 +848,17 @@ int parse_arguments (int argc, char *argv[])
             options.logger_syslog_ident = argv[i + 1];
             i++;
         }
+        else if (!strcmp(arg, "--logger-async")) {
+            options.logger_async = 1;
+        }
+        else if (!strcmp(arg, "--metrics-socket")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.metrics_socket = argv[i + 1];
+            i++;
+        }
         #endif
         else if (!strcmp(arg, "--loglevel")) {
             if (1 >= argc - i) {
@@ -845,6 +903,9 @@ int parse_arguments (int argc, char *argv[])
         else if (!strcmp(arg, "--use-threads-for-ssl-data")) {
             options.use_threads_for_ssl_data = 1;
         }
+        else if (!strcmp(arg, "--use-ktls-for-ssl-data")) {
+            options.use_ktls_for_ssl_data = 1;
+        }
         else if (!strcmp(arg, "--ssl")) {
             options.ssl = 1;
         }
@@ -986,6 +1047,14 @@ int parse_arguments (int argc, char *argv[])
             else if (!strcmp(arg2, "aes")) {
                 options.encryption_mode = BENCRYPTION_CIPHER_AES;
             }
+            else if (!strcmp(arg2, "aes-gcm")) {
+                options.encryption_mode = BENCRYPTION_CIPHER_AES_GCM;
+            }
+            #ifdef BENCRYPTION_HAVE_CHACHA20_POLY1305
+            else if (!strcmp(arg2, "chacha20-poly1305")) {
+                options.encryption_mode = BENCRYPTION_CIPHER_CHACHA20_POLY1305;
+            }
+            #endif
             else {
                 fprintf(stderr, "%s: wrong argument\n", arg);
                 return 0;
@@ -1051,6 +1120,9 @@ int parse_arguments (int argc, char *argv[])
             have_fragmentation_latency = 1;
             i++;
         }
+        else if (!strcmp(arg, "--adaptive-fragmentation")) {
+            options.adaptive_fragmentation = 1;
+        }
         else if (!strcmp(arg, "--peer-ssl")) {
             options.peer_ssl = 1;
         }
@@ -1185,6 +1257,11 @@ int parse_arguments (int argc, char *argv[])
         return 0;
     }
     
+    if (!(!(options.encryption_mode > 0 && BEncryption_cipher_is_aead(options.encryption_mode)) || options.hash_mode == SPPROTO_HASH_MODE_NONE)) {
+        fprintf(stderr, "False: AEAD --encryption-mode => --hash-mode none\n");
+        return 0;
+    }
+    
     if (!(!(options.otp_mode != SPPROTO_OTP_MODE_NONE) || (options.transport_mode == TRANSPORT_MODE_UDP))) {
         fprintf(stderr, "False: --otp => UDP\n");
         return 0;
@@ -1195,6 +1272,11 @@ int parse_arguments (int argc, char *argv[])
         return 0;
     }
     
+    if (!(!options.adaptive_fragmentation || (options.transport_mode == TRANSPORT_MODE_UDP))) {
+        fprintf(stderr, "False: --adaptive-fragmentation => UDP\n");
+        return 0;
+    }
+    
     if (!(!options.peer_ssl || (options.ssl && options.transport_mode == TRANSPORT_MODE_TCP))) {
         fprintf(stderr, "False: --peer-ssl => (--ssl && TCP)\n");
         return 0;
@@ -1311,6 +1393,9 @@ int ssl_flags (void)
     if (options.use_threads_for_ssl_data) {
         flags |= BSSLCONNECTION_FLAG_THREADWORK_IO;
     }
+    if (options.use_ktls_for_ssl_data) {
+        flags |= BSSLCONNECTION_FLAG_KTLS;
+    }
     return flags;
 }
 
@@ -1473,6 +1558,7 @@ void peer_add (peerid_t id, int flags, const uint8_t *cert, int cert_len)
     // add to peers list
     LinkedList1_Append(&peers, &peer->list_node);
     num_peers++;
+    BMetric_Add(&metric_peers, 1);
     
     switch (chat_ssl_mode) {
         case PEERCHAT_SSL_NONE:
@@ -1521,6 +1607,7 @@ void peer_remove (struct peer_data *peer, int exiting)
     // remove from peers list
     LinkedList1_Remove(&peers, &peer->list_node);
     num_peers--;
+    BMetric_Sub(&metric_peers, 1);
     
     // free reset timer
     BReactor_RemoveTimer(&ss, &peer->reset_timer);
@@ -1621,7 +1708,7 @@ int peer_init_link (struct peer_data *peer)
         // init DatagramPeerIO
         if (!DatagramPeerIO_Init(
             &peer->pio.udp.pio, &ss, data_mtu, CLIENT_UDP_MTU, sp_params,
-            options.fragmentation_latency, PEER_UDP_ASSEMBLER_NUM_FRAMES, recv_if,
+            options.fragmentation_latency, options.adaptive_fragmentation, PEER_UDP_ASSEMBLER_NUM_FRAMES, recv_if,
             options.otp_num_warn, &twd, peer,
             (BLog_logfunc)peer_logfunc,
             (DatagramPeerIO_handler_error)peer_udp_pio_handler_error,
@@ -2378,7 +2465,7 @@ void peer_bind_one_address (struct peer_data *peer, int addr_index, int *cont)
         // generate and set encryption key
         if (SPPROTO_HAVE_ENCRYPTION(sp_params)) {
             BRandom_randomize(key, BEncryption_cipher_key_size(sp_params.encryption_mode));
-            DatagramPeerIO_SetEncryptionKey(&peer->pio.udp.pio, key);
+            DatagramPeerIO_SetEncryptionKey(&peer->pio.udp.pio, key, 1);
         }
         
         // schedule sending OTP seed
@@ -2422,7 +2509,7 @@ void peer_connect (struct peer_data *peer, BAddr addr, uint8_t* encryption_key,
         
         // set encryption key
         if (SPPROTO_HAVE_ENCRYPTION(sp_params)) {
-            DatagramPeerIO_SetEncryptionKey(&peer->pio.udp.pio, encryption_key);
+            DatagramPeerIO_SetEncryptionKey(&peer->pio.udp.pio, encryption_key, 0);
         }
         
         // generate and send a send seed
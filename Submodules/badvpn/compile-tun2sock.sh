@@ -49,6 +49,7 @@ base/BLog_syslog.c
 system/BReactor_badvpn.c
 system/BSignal.c
 system/BConnection_unix.c
+system/BMetricsServer.c
 system/BTime.c
 system/BUnixSignal.c
 system/BNetwork.c
@@ -78,6 +79,7 @@ lwip/src/core/netif.c
 lwip/src/core/def.c
 lwip/src/core/mem.c
 lwip/src/core/tcp_in.c
+lwip/src/core/tcp_hash.c
 lwip/src/core/stats.c
 lwip/src/core/inet_chksum.c
 lwip/src/core/ipv4/icmp.c
@@ -93,9 +95,12 @@ lwip/custom/sys.c
 tun2socks/tun2socks.c
 base/DebugObject.c
 base/BLog.c
+base/BLog_async.c
 base/BPending.c
+base/BMetrics.c
 flowextra/PacketPassInactivityMonitor.c
 tun2socks/SocksUdpGwClient.c
+tun2socks/PbufPool.c
 udpgw_client/UdpGwClient.c
 "
 
@@ -109,4 +114,4 @@ for f in $SOURCES; do
     OBJS=( "${OBJS[@]}" "${obj}" )
 done
 
-"${CC}" ${LDFLAGS} "${OBJS[@]}" -o tun2socks -lrt
+"${CC}" ${LDFLAGS} "${OBJS[@]}" -o tun2socks -lrt -lpthread
@@ -38,7 +38,7 @@ fi
 
 CFLAGS="${CFLAGS} -std=gnu99"
 INCLUDES=( "-I${SRCDIR}" )
-DEFS=( -DBADVPN_THREAD_SAFE=0 -DBADVPN_LINUX -DBADVPN_BREACTOR_BADVPN -D_GNU_SOURCE )
+DEFS=( -DBADVPN_THREAD_SAFE=1 -DBADVPN_LINUX -DBADVPN_BREACTOR_BADVPN -D_GNU_SOURCE )
 
 [[ $KERNEL = "2.4" ]] && DEFS=( "${DEFS[@]}" -DBADVPN_USE_SELFPIPE -DBADVPN_USE_POLL ) || DEFS=( "${DEFS[@]}" -DBADVPN_USE_SIGNALFD -DBADVPN_USE_EPOLL )
 
@@ -49,7 +49,9 @@ base/BLog_syslog.c
 system/BReactor_badvpn.c
 system/BSignal.c
 system/BConnection_unix.c
+system/BMetricsServer.c
 system/BDatagram_unix.c
+system/BThreadSignal.c
 system/BTime.c
 system/BUnixSignal.c
 system/BNetwork.c
@@ -67,7 +69,9 @@ flow/PacketProtoEncoder.c
 flow/PacketProtoDecoder.c
 base/DebugObject.c
 base/BLog.c
+base/BLog_async.c
 base/BPending.c
+base/BMetrics.c
 udpgw/udpgw.c
 "
 
@@ -81,4 +85,4 @@ for f in $SOURCES; do
     OBJS=( "${OBJS[@]}" "${obj}" )
 done
 
-"${CC}" ${LDFLAGS} "${OBJS[@]}" -o udpgw -lrt
+"${CC}" ${LDFLAGS} "${OBJS[@]}" -o udpgw -lrt -lpthread
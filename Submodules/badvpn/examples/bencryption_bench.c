@@ -36,26 +36,42 @@
 #include <misc/balloc.h>
 #include <security/BRandom.h>
 #include <security/BEncryption.h>
+#include <system/BTime.h>
 #include <base/DebugObject.h>
 
 static void usage (char *name)
 {
     printf(
-        "Usage: %s <enc/dec> <ciper> <num_blocks> <num_ops>\n"
-        "    <cipher> is one of (blowfish, aes).\n",
-        name
+        "Usage: %s <enc/dec> <ciper> <num_blocks> <num_ops> [burst_size]\n"
+        "    <cipher> is one of (blowfish, aes).\n"
+        "    Runs num_ops operations on units of num_blocks blocks one by one,\n"
+        "    then in bursts of burst_size units (default %d), and reports the\n"
+        "    throughput of each.\n",
+        name, BENCRYPTION_MAX_BURST
     );
     
     exit(1);
 }
 
+static void report (const char *what, int unit_size, int num_ops, btime_t time)
+{
+    double gbits = (double)unit_size * num_ops * 8 / 1000000000.0;
+    
+    if (time <= 0) {
+        printf("%s: too fast to measure, increase num_ops\n", what);
+        return;
+    }
+    
+    printf("%s: %d ms, %.3f Gbit/s\n", what, (int)time, gbits / ((double)time / 1000));
+}
+
 int main (int argc, char **argv)
 {
     if (argc <= 0) {
         return 1;
     }
     
-    if (argc != 5) {
+    if (argc != 5 && argc != 6) {
         usage(argv[0]);
     }
     
@@ -66,6 +82,7 @@ int main (int argc, char **argv)
     int cipher = 0; // silence warning
     int num_blocks = atoi(argv[3]);
     int num_ops = atoi(argv[4]);
+    int burst_size = (argc > 5 ? atoi(argv[5]) : BENCRYPTION_MAX_BURST);
     
     if (!strcmp(mode_str, "enc")) {
         mode = BENCRYPTION_MODE_ENCRYPT;
@@ -87,18 +104,20 @@ int main (int argc, char **argv)
         usage(argv[0]);
     }
     
-    if (num_blocks < 0 || num_ops < 0) {
+    if (num_blocks < 0 || num_ops < 0 || burst_size < 1 || burst_size > BENCRYPTION_MAX_BURST) {
         usage(argv[0]);
     }
     
+    BTime_Init();
+    
     int key_size = BEncryption_cipher_key_size(cipher);
     int block_size = BEncryption_cipher_block_size(cipher);
     
     uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
     BRandom_randomize(key, key_size);
     
-    uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
-    BRandom_randomize(iv, block_size);
+    uint8_t ivs[BENCRYPTION_MAX_BURST][BENCRYPTION_MAX_BLOCK_SIZE];
+    BRandom_randomize((uint8_t *)ivs, sizeof(ivs));
     
     if (num_blocks > INT_MAX / block_size) {
         printf("too much");
@@ -106,36 +125,85 @@ int main (int argc, char **argv)
     }
     int unit_size = num_blocks * block_size;
     
-    printf("unit size %d\n", unit_size);
+    printf("unit size %d, burst size %d\n", unit_size, burst_size);
     
-    uint8_t *buf1 = (uint8_t *)BAlloc(unit_size);
+    // a pair of buffers for every unit in a burst
+    uint8_t *buf1 = (uint8_t *)BAllocArray(burst_size, unit_size);
     if (!buf1) {
         printf("BAlloc failed");
         goto fail0;
     }
     
-    uint8_t *buf2 = (uint8_t *)BAlloc(unit_size);
+    uint8_t *buf2 = (uint8_t *)BAllocArray(burst_size, unit_size);
     if (!buf2) {
         printf("BAlloc failed");
         goto fail1;
     }
     
     BEncryption enc;
-    BEncryption_Init(&enc, mode, cipher, key);
+    if (!BEncryption_Init(&enc, mode, cipher, key)) {
+        printf("BEncryption_Init failed");
+        goto fail2;
+    }
+    
+    BRandom_randomize(buf1, burst_size * unit_size);
+    
+    // one by one
     
     uint8_t *in = buf1;
     uint8_t *out = buf2;
-    BRandom_randomize(in, unit_size);
+    
+    btime_t start = btime_gettime();
     
     for (int i = 0; i < num_ops; i++) {
-        BEncryption_Encrypt(&enc, in, out, unit_size, iv);
+        if (mode == BENCRYPTION_MODE_ENCRYPT) {
+            BEncryption_Encrypt(&enc, in, out, unit_size, ivs[0]);
+        } else {
+            BEncryption_Decrypt(&enc, in, out, unit_size, ivs[0]);
+        }
         
         uint8_t *t = in;
         in = out;
         out = t;
     }
     
+    report("single", unit_size, num_ops, btime_gettime() - start);
+    
+    // in bursts
+    
+    uint8_t *ins[BENCRYPTION_MAX_BURST];
+    uint8_t *outs[BENCRYPTION_MAX_BURST];
+    uint8_t *iv_ptrs[BENCRYPTION_MAX_BURST];
+    int lens[BENCRYPTION_MAX_BURST];
+    for (int j = 0; j < burst_size; j++) {
+        ins[j] = buf1 + j * unit_size;
+        outs[j] = buf2 + j * unit_size;
+        iv_ptrs[j] = ivs[j];
+        lens[j] = unit_size;
+    }
+    
+    int num_bursts = num_ops / burst_size;
+    
+    start = btime_gettime();
+    
+    for (int i = 0; i < num_bursts; i++) {
+        if (mode == BENCRYPTION_MODE_ENCRYPT) {
+            BEncryption_EncryptBurst(&enc, burst_size, ins, outs, lens, iv_ptrs);
+        } else {
+            BEncryption_DecryptBurst(&enc, burst_size, ins, outs, lens, iv_ptrs);
+        }
+        
+        for (int j = 0; j < burst_size; j++) {
+            uint8_t *t = ins[j];
+            ins[j] = outs[j];
+            outs[j] = t;
+        }
+    }
+    
+    report("burst", unit_size, num_bursts * burst_size, btime_gettime() - start);
+    
     BEncryption_Free(&enc);
+fail2:
     BFree(buf2);
 fail1:
     BFree(buf1);
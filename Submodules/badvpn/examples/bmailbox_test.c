@@ -0,0 +1,240 @@
+/**
+ * @file bthreadwork_test.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Stress test for {@link BMailbox} with many producer threads. Each thread
+ * posts its messages in short bursts, so that the mailbox keeps going from
+ * empty to busy while others are posting. All messages must be received
+ * exactly once, and each thread's messages in the order they were posted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+#include <misc/offset.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BTime.h>
+#include <system/BReactor.h>
+#include <system/BMailbox.h>
+
+// how long receiving may take before we consider it stalled
+#define TEST_TIMEOUT 30000
+
+// maximum number of messages a thread posts before yielding
+#define BURST_SIZE 16
+
+struct message {
+    BMailboxNode node;
+    int thread;
+    int seq;
+};
+
+struct producer {
+    int index;
+    pthread_t thread;
+    struct message *messages;
+    int next_seq;
+};
+
+static BReactor reactor;
+static BMailbox mailbox;
+static BTimer timeout_timer;
+static int num_threads;
+static int num_messages;
+static struct producer *producers;
+static int num_received;
+
+static void usage (char *name)
+{
+    printf(
+        "Usage: %s <num_threads> <num_messages>\n"
+        "    Posts num_messages messages from each of num_threads threads.\n",
+        name
+    );
+    
+    exit(1);
+}
+
+static void * producer_thread (void *arg)
+{
+    struct producer *p = (struct producer *)arg;
+    
+    unsigned int seed = p->index;
+    
+    for (int i = 0; i < num_messages; i++) {
+        struct message *m = &p->messages[i];
+        m->thread = p->index;
+        m->seq = i;
+        BMailbox_Thread_Post(&mailbox, &m->node);
+        
+        // let the others and the receiver in now and then
+        if (rand_r(&seed) % BURST_SIZE == 0) {
+            sched_yield();
+        }
+    }
+    
+    return NULL;
+}
+
+static void mailbox_handler (void *user, BMailboxNode *node)
+{
+    struct message *m = UPPER_OBJECT(node, struct message, node);
+    
+    if (m->thread < 0 || m->thread >= num_threads) {
+        printf("message from unknown thread %d\n", m->thread);
+        BReactor_Quit(&reactor, 1);
+        return;
+    }
+    
+    struct producer *p = &producers[m->thread];
+    
+    if (m != &p->messages[m->seq] || m->seq != p->next_seq) {
+        printf("thread %d: expected message %d, got %d\n", m->thread, p->next_seq, m->seq);
+        BReactor_Quit(&reactor, 1);
+        return;
+    }
+    
+    p->next_seq++;
+    num_received++;
+    
+    if (num_received == num_threads * num_messages) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+}
+
+static void timeout_handler (void *user)
+{
+    printf("stalled, %d of %d messages received\n", num_received, num_threads * num_messages);
+    BReactor_Quit(&reactor, 1);
+}
+
+int main (int argc, char **argv)
+{
+    int ret = 1;
+    
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 3) {
+        usage(argv[0]);
+    }
+    
+    num_threads = atoi(argv[1]);
+    num_messages = atoi(argv[2]);
+    
+    if (num_threads <= 0 || num_messages <= 0) {
+        usage(argv[0]);
+    }
+    
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    if (!BReactor_Init(&reactor)) {
+        DEBUG("BReactor_Init failed");
+        goto fail0;
+    }
+    
+    if (!BMailbox_Init(&mailbox, &reactor, mailbox_handler, NULL)) {
+        DEBUG("BMailbox_Init failed");
+        goto fail1;
+    }
+    
+    if (!(producers = (struct producer *)BAllocArray(num_threads, sizeof(producers[0])))) {
+        DEBUG("BAllocArray failed");
+        goto fail2;
+    }
+    
+    int num_inited = 0;
+    
+    for (int i = 0; i < num_threads; i++) {
+        struct producer *p = &producers[i];
+        p->index = i;
+        p->next_seq = 0;
+        if (!(p->messages = (struct message *)BAllocArray(num_messages, sizeof(p->messages[0])))) {
+            DEBUG("BAllocArray failed");
+            goto fail3;
+        }
+        num_inited++;
+    }
+    
+    BTimer_Init(&timeout_timer, TEST_TIMEOUT, timeout_handler, NULL);
+    BReactor_SetTimer(&reactor, &timeout_timer);
+    
+    num_received = 0;
+    
+    int num_started = 0;
+    
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&producers[i].thread, NULL, producer_thread, &producers[i]) != 0) {
+            DEBUG("pthread_create failed");
+            break;
+        }
+        num_started++;
+    }
+    
+    if (num_started == num_threads) {
+        ret = BReactor_Exec(&reactor);
+    }
+    
+    for (int i = 0; i < num_started; i++) {
+        pthread_join(producers[i].thread, NULL);
+    }
+    
+    BReactor_RemoveTimer(&reactor, &timeout_timer);
+    
+    // nothing may be left after everything was received
+    if (ret == 0 && BMailbox_Get(&mailbox)) {
+        printf("message left in mailbox\n");
+        ret = 1;
+    }
+    
+    printf("%s\n", (ret == 0 ? "all messages received" : "FAILED"));
+    
+fail3:
+    while (num_inited-- > 0) {
+        BFree(producers[num_inited].messages);
+    }
+    BFree(producers);
+fail2:
+    BMailbox_Free(&mailbox);
+fail1:
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
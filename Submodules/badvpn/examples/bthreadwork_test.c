@@ -0,0 +1,345 @@
+/**
+ * @file bthreadwork_test.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Stress test for the {@link BThreadWorkDispatcher} queues. In each round,
+ * all threads are held busy by blocker works while more works are posted
+ * than the queues can hold, so some overflow. Some or all of the queued works
+ * are then cancelled, and all blockers but one are released. The remaining
+ * works must all complete, exactly once, while the last blocker still holds
+ * its thread, so works in that thread's queue must be stolen. Cancelled
+ * works must never run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BTime.h>
+#include <system/BReactor.h>
+#include <threadwork/BThreadWork.h>
+
+// how long a round may take before we consider it stalled
+#define ROUND_TIMEOUT 10000
+
+struct work {
+    int index;
+    BThreadWork tw;
+    int active;
+    int cancelled;
+    int runs;
+    int value;
+};
+
+static BReactor reactor;
+static BThreadWorkDispatcher twd;
+static BTimer timeout_timer;
+static int num_threads;
+static int num_overflow;
+static int num_rounds;
+static int num_works;
+static struct work *blockers;
+static struct work *works;
+static int num_blocked;
+static int *release;
+static int round_num;
+static int num_expected;
+static int num_done;
+static int num_blockers_done;
+static int failed;
+
+static void usage (char *name)
+{
+    printf(
+        "Usage: %s <num_threads> <num_overflow> <num_rounds>\n"
+        "    Runs num_rounds rounds with num_threads threads, each posting\n"
+        "    num_overflow works more than the queues can hold.\n",
+        name
+    );
+    
+    exit(1);
+}
+
+static void fail (const char *msg, int index)
+{
+    printf("round %d: %s (work %d)\n", round_num, msg, index);
+    failed = 1;
+}
+
+static void blocker_func (struct work *w)
+{
+    __atomic_add_fetch(&num_blocked, 1, __ATOMIC_SEQ_CST);
+    
+    // hold the thread until released
+    while (!__atomic_load_n(&release[w->index], __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void work_func (struct work *w)
+{
+    __atomic_add_fetch(&w->runs, 1, __ATOMIC_RELAXED);
+    w->value = w->index * 3;
+}
+
+static void start_round (void);
+
+static void finish_round (void)
+{
+    // check the works
+    for (int i = 0; i < num_works; i++) {
+        struct work *w = &works[i];
+        if (w->cancelled && w->runs != 0) {
+            fail("cancelled work ran", i);
+        }
+        if (!w->cancelled && w->runs != 1) {
+            fail("work didn't run exactly once", i);
+        }
+    }
+    
+    if (failed) {
+        BReactor_Quit(&reactor, 1);
+        return;
+    }
+    
+    printf("round %d: %d works done, %d cancelled\n", round_num, num_done, num_works - num_expected);
+    
+    round_num++;
+    
+    if (round_num == num_rounds) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    start_round();
+}
+
+static void blocker_handler_done (struct work *w)
+{
+    BThreadWork_Free(&w->tw);
+    w->active = 0;
+    
+    num_blockers_done++;
+    
+    if (num_blockers_done == num_threads && num_done == num_expected) {
+        finish_round();
+        return;
+    }
+}
+
+static void work_handler_done (struct work *w)
+{
+    ASSERT(w->active)
+    ASSERT(!w->cancelled)
+    
+    if (w->value != w->index * 3) {
+        fail("wrong result", w->index);
+    }
+    
+    BThreadWork_Free(&w->tw);
+    w->active = 0;
+    
+    num_done++;
+    
+    if (num_done < num_expected) {
+        return;
+    }
+    
+    // with more than one thread, the first blocker is still holding its
+    // thread, so the works in its queue were stolen by the others;
+    // release it now
+    __atomic_store_n(&release[0], 1, __ATOMIC_RELEASE);
+    
+    if (num_blockers_done == num_threads) {
+        finish_round();
+        return;
+    }
+}
+
+static void timeout_handler (void *user)
+{
+    printf("round %d: stalled, %d of %d works done\n", round_num, num_done, num_expected);
+    BReactor_Quit(&reactor, 1);
+}
+
+static void start_round (void)
+{
+    num_blocked = 0;
+    num_done = 0;
+    num_blockers_done = 0;
+    
+    BReactor_SetTimer(&reactor, &timeout_timer);
+    
+    // occupy all threads
+    for (int i = 0; i < num_threads; i++) {
+        struct work *w = &blockers[i];
+        release[i] = 0;
+        w->index = i;
+        w->active = 1;
+        BThreadWork_Init(&w->tw, &twd, (BThreadWork_handler_done)blocker_handler_done, w, (BThreadWork_work_func)blocker_func, w);
+    }
+    while (__atomic_load_n(&num_blocked, __ATOMIC_SEQ_CST) < num_threads) {
+        sched_yield();
+    }
+    
+    // fill the queues, and overflow them
+    for (int i = 0; i < num_works; i++) {
+        struct work *w = &works[i];
+        w->index = i;
+        w->active = 1;
+        w->cancelled = 0;
+        w->runs = 0;
+        w->value = -1;
+        BThreadWork_Init(&w->tw, &twd, (BThreadWork_handler_done)work_handler_done, w, (BThreadWork_work_func)work_func, w);
+    }
+    
+    // cancel queued works: all of them in even rounds, so that only skipping
+    // the cancelled cells makes room for the overflowed works, every other
+    // one in odd rounds
+    num_expected = num_works;
+    for (int i = 0; i < num_works - num_overflow; i++) {
+        if (round_num % 2 == 1 && i % 2 == 0) {
+            continue;
+        }
+        struct work *w = &works[i];
+        BThreadWork_Free(&w->tw);
+        w->active = 0;
+        w->cancelled = 1;
+        num_expected--;
+    }
+    
+    // release all blockers except the first
+    for (int i = 1; i < num_threads; i++) {
+        __atomic_store_n(&release[i], 1, __ATOMIC_RELEASE);
+    }
+    
+    // with one thread, release it too, nobody could steal; likewise if
+    // there's nothing left to steal
+    if (num_threads == 1 || num_expected == 0) {
+        __atomic_store_n(&release[0], 1, __ATOMIC_RELEASE);
+    }
+}
+
+int main (int argc, char **argv)
+{
+    int ret = 1;
+    
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 4) {
+        usage(argv[0]);
+    }
+    
+    num_threads = atoi(argv[1]);
+    num_overflow = atoi(argv[2]);
+    num_rounds = atoi(argv[3]);
+    
+    if (num_threads <= 0 || num_threads > BTHREADWORK_MAX_THREADS || num_overflow < 0 || num_rounds <= 0) {
+        usage(argv[0]);
+    }
+    
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    if (!BReactor_Init(&reactor)) {
+        DEBUG("BReactor_Init failed");
+        goto fail0;
+    }
+    
+    if (!BThreadWorkDispatcher_Init(&twd, &reactor, num_threads)) {
+        DEBUG("BThreadWorkDispatcher_Init failed");
+        goto fail1;
+    }
+    
+    if (BThreadWorkDispatcher_NumThreads(&twd) != num_threads) {
+        printf("dispatcher doesn't use %d threads\n", num_threads);
+        goto fail2;
+    }
+    
+    num_works = num_threads * BTHREADWORK_QUEUE_SIZE + num_overflow;
+    
+    if (!(blockers = (struct work *)BAllocArray(num_threads, sizeof(blockers[0])))) {
+        DEBUG("BAllocArray failed");
+        goto fail2;
+    }
+    if (!(release = (int *)BAllocArray(num_threads, sizeof(release[0])))) {
+        DEBUG("BAllocArray failed");
+        goto fail3;
+    }
+    if (!(works = (struct work *)BAllocArray(num_works, sizeof(works[0])))) {
+        DEBUG("BAllocArray failed");
+        goto fail4;
+    }
+    
+    BTimer_Init(&timeout_timer, ROUND_TIMEOUT, timeout_handler, NULL);
+    
+    round_num = 0;
+    failed = 0;
+    start_round();
+    
+    ret = BReactor_Exec(&reactor);
+    
+    BReactor_RemoveTimer(&reactor, &timeout_timer);
+    
+    // on failure, let the threads go and wait for the works
+    for (int i = 0; i < num_threads; i++) {
+        __atomic_store_n(&release[i], 1, __ATOMIC_RELEASE);
+        if (blockers[i].active) {
+            BThreadWork_Free(&blockers[i].tw);
+        }
+    }
+    for (int i = 0; i < num_works; i++) {
+        if (works[i].active) {
+            BThreadWork_Free(&works[i].tw);
+        }
+    }
+    
+    printf("%s\n", (ret == 0 ? "all rounds passed" : "FAILED"));
+    
+    BFree(works);
+fail4:
+    BFree(release);
+fail3:
+    BFree(blockers);
+fail2:
+    BThreadWorkDispatcher_Free(&twd);
+fail1:
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
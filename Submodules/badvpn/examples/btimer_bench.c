@@ -0,0 +1,173 @@
+/**
+ * @file btimer_example.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Compares the timer stores of {@link BReactor}. It keeps a number of timers
+ * running and restarts random ones, as connection inactivity timers would be,
+ * then lets them all expire over a short interval and checks that none
+ * expired early.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <misc/balloc.h>
+#include <misc/offset.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BTime.h>
+#include <system/BReactor.h>
+
+// restarted timers are set to expire this far in the future (ms)
+#define RESTART_MIN 1000
+#define RESTART_RANGE 60000
+
+// in the expire phase, timers expire within this interval (ms)
+#define EXPIRE_RANGE 200
+
+struct timer {
+    BSmallTimer timer;
+    btime_t time;
+};
+
+static BReactor reactor;
+static int num_timers;
+static int num_expired;
+static int num_early;
+
+static void usage (char *name)
+{
+    printf(
+        "Usage: %s <tree/wheel> <num_timers> <num_ops>\n",
+        name
+    );
+    
+    exit(1);
+}
+
+static void timer_handler (BSmallTimer *bt)
+{
+    struct timer *t = UPPER_OBJECT(bt, struct timer, timer);
+    
+    if (btime_gettime() < t->time) {
+        num_early++;
+    }
+    
+    num_expired++;
+    if (num_expired == num_timers) {
+        BReactor_Quit(&reactor, 0);
+    }
+}
+
+static void start_timer (struct timer *t, btime_t time)
+{
+    t->time = time;
+    BReactor_SetSmallTimer(&reactor, &t->timer, BTIMER_SET_ABSOLUTE, time);
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 4) {
+        usage(argv[0]);
+    }
+    
+    char *store_str = argv[1];
+    num_timers = atoi(argv[2]);
+    int num_ops = atoi(argv[3]);
+    
+    if ((strcmp(store_str, "tree") && strcmp(store_str, "wheel")) || num_timers <= 0 || num_ops < 0) {
+        usage(argv[0]);
+    }
+    
+    // BReactor picks its timer store from the environment
+    if (setenv("BADVPN_REACTOR_TIMERS", store_str, 1) < 0) {
+        printf("setenv failed\n");
+        goto fail0;
+    }
+    
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    if (!BReactor_Init(&reactor)) {
+        printf("BReactor_Init failed\n");
+        goto fail1;
+    }
+    
+    struct timer *timers = (struct timer *)BAllocArray(num_timers, sizeof(timers[0]));
+    if (!timers) {
+        printf("BAllocArray failed\n");
+        goto fail2;
+    }
+    
+    srandom(1);
+    
+    btime_t now = btime_gettime();
+    
+    // start all timers
+    for (int i = 0; i < num_timers; i++) {
+        BSmallTimer_Init(&timers[i].timer, timer_handler);
+        start_timer(&timers[i], now + RESTART_MIN + random() % RESTART_RANGE);
+    }
+    
+    // restart random timers
+    btime_t start = btime_gettime();
+    for (int i = 0; i < num_ops; i++) {
+        struct timer *t = &timers[random() % num_timers];
+        start_timer(t, now + RESTART_MIN + random() % RESTART_RANGE);
+    }
+    btime_t restart_time = btime_gettime() - start;
+    
+    // make them all expire soon
+    start = btime_gettime();
+    for (int i = 0; i < num_timers; i++) {
+        start_timer(&timers[i], start + random() % EXPIRE_RANGE);
+    }
+    
+    BReactor_Exec(&reactor);
+    btime_t expire_time = btime_gettime() - start;
+    
+    printf("%s: %d restarts in %d ms, %d timers expired in %d ms (%d early)\n",
+           store_str, num_ops, (int)restart_time, num_expired, (int)expire_time, num_early);
+    
+    BFree(timers);
+fail2:
+    BReactor_Free(&reactor);
+fail1:
+    BLog_Free();
+fail0:
+    DebugObjectGlobal_Finish();
+    
+    return 0;
+}
@@ -0,0 +1,417 @@
+/**
+ * @file bthreadwork_test.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Test for the gather mode of {@link PacketPassFairQueue}. A number of flows
+ * each send a sequence of self-describing packets of random sizes through the
+ * queue to a stream sink, which accepts a random part of each send, often
+ * ending in the middle of a packet. Sends are completed, and flows send their
+ * next packet, either right away or from a later event; events are delivered
+ * in random order when there are no jobs left, as the reactor would. The sink
+ * parses the stream back into packets, which must be intact, and in order
+ * within each flow. It runs once with a sink which supports vectored sends and
+ * once with one which doesn't; with the former, the test only passes if some
+ * sends did carry several packets and some were completed partially.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+#include <misc/byteorder.h>
+#include <base/BLog.h>
+#include <base/BPending.h>
+#include <base/DebugObject.h>
+#include <flow/PacketPassInterface.h>
+#include <flow/StreamPassInterface.h>
+#include <flow/PacketPassFairQueue.h>
+
+// packet header: flow (1 byte), sequence number (4 bytes) and payload length (2 bytes)
+#define HEADER_LEN 7
+#define MAX_PAYLOAD 200
+#define MTU (HEADER_LEN + MAX_PAYLOAD)
+
+#define MAX_FLOWS 256
+
+struct flow {
+    PacketPassFairQueueFlow qflow;
+    int index;
+    int seq;
+    int busy;
+    int send_pending;
+    uint8_t packet[MTU];
+};
+
+struct sink {
+    StreamPassInterface input;
+    int done_pending;
+    int done_len;
+    uint8_t header[HEADER_LEN];
+    int pos;
+    int flow;
+    int seq;
+    int payload_len;
+    int *next_seq;
+    int num_packets;
+    int num_multi;
+    int num_partial;
+};
+
+static BPendingGroup pg;
+static int num_flows;
+static int num_packets;
+static int max_packets;
+static PacketPassFairQueue queue;
+static struct flow *flows;
+static struct sink sink;
+static int failed;
+
+static void usage (char *name)
+{
+    printf(
+        "Usage: %s <num_flows> <num_packets> <max_packets>\n"
+        "    Sends num_packets packets from each of num_flows flows (at most %d),\n"
+        "    gathering up to max_packets packets into one send.\n",
+        name, MAX_FLOWS
+    );
+    
+    exit(1);
+}
+
+static int payload_len (int flow, int seq)
+{
+    uint32_t x = ((uint32_t)flow * 40503u + (uint32_t)seq) * 2654435761u;
+    return (x >> 8) % (MAX_PAYLOAD + 1);
+}
+
+static uint8_t payload_byte (int flow, int seq, int pos)
+{
+    return (uint8_t)(flow * 13 + seq * 31 + pos * 7);
+}
+
+static void flow_send (struct flow *o)
+{
+    ASSERT(!o->busy)
+    ASSERT(o->seq < num_packets)
+    
+    int len = payload_len(o->index, o->seq);
+    
+    o->packet[0] = o->index;
+    uint32_t seq = htol32(o->seq);
+    memcpy(o->packet + 1, &seq, 4);
+    uint16_t len16 = htol16(len);
+    memcpy(o->packet + 5, &len16, 2);
+    for (int i = 0; i < len; i++) {
+        o->packet[HEADER_LEN + i] = payload_byte(o->index, o->seq, i);
+    }
+    
+    o->busy = 1;
+    PacketPassInterface_Sender_Send(PacketPassFairQueueFlow_GetInput(&o->qflow), o->packet, HEADER_LEN + len);
+}
+
+static void flow_handler_done (struct flow *o)
+{
+    ASSERT(o->busy)
+    
+    o->busy = 0;
+    o->seq++;
+    
+    if (o->seq == num_packets) {
+        return;
+    }
+    
+    // send the next packet, now or from a later event
+    if (rand() % 2) {
+        flow_send(o);
+    } else {
+        o->send_pending = 1;
+    }
+}
+
+static void sink_parse (struct sink *o, const uint8_t *data, int len)
+{
+    for (int i = 0; i < len && !failed; i++) {
+        // collect the header
+        if (o->pos < HEADER_LEN) {
+            o->header[o->pos++] = data[i];
+            if (o->pos < HEADER_LEN) {
+                continue;
+            }
+            
+            uint32_t seq;
+            uint16_t len16;
+            memcpy(&seq, o->header + 1, 4);
+            memcpy(&len16, o->header + 5, 2);
+            o->flow = o->header[0];
+            o->seq = ltoh32(seq);
+            o->payload_len = ltoh16(len16);
+            
+            if (o->flow >= num_flows || o->seq != o->next_seq[o->flow] || o->payload_len != payload_len(o->flow, o->seq)) {
+                printf("bad packet: flow %d seq %d length %d\n", o->flow, o->seq, o->payload_len);
+                failed = 1;
+                return;
+            }
+        } else {
+            int payload_pos = o->pos - HEADER_LEN;
+            if (data[i] != payload_byte(o->flow, o->seq, payload_pos)) {
+                printf("flow %d seq %d: wrong byte at %d\n", o->flow, o->seq, payload_pos);
+                failed = 1;
+                return;
+            }
+            o->pos++;
+        }
+        
+        // packet complete
+        if (o->pos == HEADER_LEN + o->payload_len) {
+            o->next_seq[o->flow]++;
+            o->num_packets++;
+            o->pos = 0;
+        }
+    }
+}
+
+static void sink_complete (struct sink *o, int len)
+{
+    // complete now or from a later event
+    if (rand() % 2) {
+        StreamPassInterface_Done(&o->input, len);
+    } else {
+        o->done_len = len;
+        o->done_pending = 1;
+    }
+}
+
+static int deliver_event (void)
+{
+    // pick one of the pending events at random
+    int num_events = sink.done_pending;
+    for (int i = 0; i < num_flows; i++) {
+        num_events += flows[i].send_pending;
+    }
+    
+    if (num_events == 0) {
+        return 0;
+    }
+    
+    int event = rand() % num_events;
+    
+    if (sink.done_pending) {
+        if (event == 0) {
+            sink.done_pending = 0;
+            StreamPassInterface_Done(&sink.input, sink.done_len);
+            return 1;
+        }
+        event--;
+    }
+    
+    for (int i = 0; i < num_flows; i++) {
+        if (flows[i].send_pending) {
+            if (event == 0) {
+                flows[i].send_pending = 0;
+                flow_send(&flows[i]);
+                return 1;
+            }
+            event--;
+        }
+    }
+    
+    ASSERT(0)
+    return 0;
+}
+
+static void sink_handler_sendv (struct sink *o, const StreamPassInterface_segment *segs, int num_segs)
+{
+    ASSERT(num_segs > 0)
+    ASSERT(num_segs <= max_packets)
+    
+    int total = 0;
+    for (int i = 0; i < num_segs; i++) {
+        total += segs[i].data_len;
+    }
+    
+    // accept a random amount, which may end in the middle of any segment
+    int amount = 1 + rand() % total;
+    
+    int left = amount;
+    for (int i = 0; left > 0; i++) {
+        int seg_amount = (left < segs[i].data_len ? left : segs[i].data_len);
+        sink_parse(o, segs[i].data, seg_amount);
+        left -= seg_amount;
+    }
+    
+    if (num_segs > 1) {
+        o->num_multi++;
+    }
+    if (amount < total) {
+        o->num_partial++;
+    }
+    
+    sink_complete(o, amount);
+}
+
+static void sink_handler_send (struct sink *o, uint8_t *data, int data_len)
+{
+    ASSERT(data_len > 0)
+    
+    int amount = 1 + rand() % data_len;
+    sink_parse(o, data, amount);
+    
+    if (amount < data_len) {
+        o->num_partial++;
+    }
+    
+    sink_complete(o, amount);
+}
+
+static int run (int sendv)
+{
+    int ret = 0;
+    
+    failed = 0;
+    
+    // init sink
+    StreamPassInterface_Init(&sink.input, (StreamPassInterface_handler_send)sink_handler_send, &sink, &pg);
+    if (sendv) {
+        StreamPassInterface_EnableSendv(&sink.input, (StreamPassInterface_handler_sendv)sink_handler_sendv);
+    }
+    sink.done_pending = 0;
+    sink.pos = 0;
+    sink.num_packets = 0;
+    sink.num_multi = 0;
+    sink.num_partial = 0;
+    for (int i = 0; i < num_flows; i++) {
+        sink.next_seq[i] = 0;
+    }
+    
+    // init queue
+    if (!PacketPassFairQueue_InitGather(&queue, &sink.input, MTU, max_packets, &pg, 1)) {
+        printf("PacketPassFairQueue_InitGather failed\n");
+        goto fail0;
+    }
+    
+    // init flows and start sending
+    for (int i = 0; i < num_flows; i++) {
+        struct flow *o = &flows[i];
+        PacketPassFairQueueFlow_Init(&o->qflow, &queue);
+        PacketPassInterface_Sender_Init(PacketPassFairQueueFlow_GetInput(&o->qflow), (PacketPassInterface_handler_done)flow_handler_done, o);
+        o->index = i;
+        o->seq = 0;
+        o->busy = 0;
+        o->send_pending = 1;
+    }
+    
+    // run jobs, and when there are none, deliver an event, until nothing is left to do
+    while (!failed) {
+        if (BPendingGroup_HasJobs(&pg)) {
+            BPendingGroup_ExecuteJob(&pg);
+            continue;
+        }
+        if (!deliver_event()) {
+            break;
+        }
+    }
+    
+    if (!failed && (sink.num_packets != num_flows * num_packets || sink.pos != 0)) {
+        printf("received %d of %d packets\n", sink.num_packets, num_flows * num_packets);
+        failed = 1;
+    }
+    
+    // make sure the interesting paths were taken
+    if (sendv && max_packets > 1 && num_flows > 1 && (sink.num_multi == 0 || sink.num_partial == 0)) {
+        failed = 1;
+    }
+    
+    printf("%s sink: %d packets, %d multi-packet sends, %d partial completions: %s\n",
+           (sendv ? "vectored" : "single-buffer"), sink.num_packets, sink.num_multi, sink.num_partial, (failed ? "FAILED" : "ok"));
+    
+    ret = !failed;
+    
+    // free flows; after a failure they may still be busy, which the queue
+    // only allows while it's being freed
+    PacketPassFairQueue_PrepareFree(&queue);
+    for (int i = 0; i < num_flows; i++) {
+        PacketPassFairQueueFlow_Free(&flows[i].qflow);
+    }
+    
+    PacketPassFairQueue_Free(&queue);
+fail0:
+    StreamPassInterface_Free(&sink.input);
+    return ret;
+}
+
+int main (int argc, char **argv)
+{
+    int ret = 1;
+    
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 4) {
+        usage(argv[0]);
+    }
+    
+    num_flows = atoi(argv[1]);
+    num_packets = atoi(argv[2]);
+    max_packets = atoi(argv[3]);
+    
+    if (num_flows <= 0 || num_flows > MAX_FLOWS || num_packets <= 0 || max_packets <= 0) {
+        usage(argv[0]);
+    }
+    
+    BLog_InitStdout();
+    
+    BPendingGroup_Init(&pg);
+    
+    if (!(flows = (struct flow *)BAllocArray(num_flows, sizeof(flows[0])))) {
+        printf("BAllocArray failed\n");
+        goto fail0;
+    }
+    
+    if (!(sink.next_seq = (int *)BAllocArray(num_flows, sizeof(sink.next_seq[0])))) {
+        printf("BAllocArray failed\n");
+        goto fail1;
+    }
+    
+    if (run(0) && run(1)) {
+        ret = 0;
+    }
+    
+    BFree(sink.next_seq);
+fail1:
+    BFree(flows);
+fail0:
+    BPendingGroup_Free(&pg);
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
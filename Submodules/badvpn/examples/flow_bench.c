@@ -0,0 +1,607 @@
+/**
+ * @file flow_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Runs synthetic pipelines of the flow components, fed by
+ * {@link FastPacketSource} and drained by a sink which completes every
+ * packet immediately, and reports packets per second, nanoseconds per
+ * packet and, where it can be counted, heap allocations per packet.
+ * Results are written as CSV, one line per benchmark.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <misc/balloc.h>
+#include <misc/byteorder.h>
+#include <misc/minmax.h>
+#include <protocol/packetproto.h>
+#include <base/BLog.h>
+#include <base/BPending.h>
+#include <base/BMetrics.h>
+#include <base/DebugObject.h>
+#include <flow/PacketPassInterface.h>
+#include <flow/StreamRecvInterface.h>
+#include <flow/PacketCopier.h>
+#include <flow/PacketBuffer.h>
+#include <flow/SinglePacketBuffer.h>
+#include <flow/PacketPassFairQueue.h>
+#include <flow/PacketPassPriorityQueue.h>
+#include <flow/PacketProtoEncoder.h>
+#include <flow/PacketProtoDecoder.h>
+#include <flow/PacketRouter.h>
+#include <flow/RouteBuffer.h>
+
+#include <examples/FastPacketSource.h>
+
+// number of flows feeding the queues
+#define NUM_FLOWS 4
+// capacity of PacketBuffer, in packets
+#define BUFFER_PACKETS 64
+// capacity of each RouteBuffer, in packets
+#define ROUTE_BUFFER_PACKETS 64
+// number of encoded packets in the replayed decoder input stream
+#define STREAM_PACKETS 64
+// decoder ring buffer size, as a multiple of the encoded packet size
+#define RING_PACKETS 16
+
+struct sink {
+    PacketPassInterface input;
+    uint64_t num_packets;
+};
+
+struct stream_source {
+    StreamRecvInterface output;
+    uint8_t *data;
+    int data_len;
+    int pos;
+};
+
+static BPendingGroup pg;
+static uint64_t num_packets;
+static int packet_size;
+static uint8_t *packet;
+static FILE *out;
+
+#ifdef FLOW_BENCH_COUNT_ALLOCS
+
+// the executable is linked with --wrap for these, so that every allocation
+// made by the flow code goes through the counters below
+
+static uint64_t num_allocs;
+
+void * __real_malloc (size_t size);
+void * __real_calloc (size_t nmemb, size_t size);
+void * __real_realloc (void *ptr, size_t size);
+
+void * __wrap_malloc (size_t size)
+{
+    num_allocs++;
+    return __real_malloc(size);
+}
+
+void * __wrap_calloc (size_t nmemb, size_t size)
+{
+    num_allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void * __wrap_realloc (void *ptr, size_t size)
+{
+    num_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+#endif
+
+static void usage (char *name)
+{
+    printf(
+        "Usage: %s <num_packets> <packet_size> [output_file]\n"
+        "    Pushes num_packets packets of packet_size bytes through each\n"
+        "    pipeline and writes the results as CSV to output_file, or to\n"
+        "    standard output.\n",
+        name
+    );
+    
+    exit(1);
+}
+
+static void sink_input_handler_send (struct sink *s, uint8_t *data, int data_len)
+{
+    s->num_packets++;
+    
+    PacketPassInterface_Done(&s->input);
+}
+
+static void sink_init (struct sink *s, int mtu)
+{
+    PacketPassInterface_Init(&s->input, mtu, (PacketPassInterface_handler_send)sink_input_handler_send, s, &pg);
+    s->num_packets = 0;
+}
+
+static void sink_free (struct sink *s)
+{
+    PacketPassInterface_Free(&s->input);
+}
+
+static int stream_source_copy (struct stream_source *s, uint8_t *data, int data_len)
+{
+    int len = bmin_int(data_len, s->data_len - s->pos);
+    memcpy(data, s->data + s->pos, len);
+    
+    s->pos += len;
+    if (s->pos == s->data_len) {
+        s->pos = 0;
+    }
+    
+    return len;
+}
+
+static void stream_source_output_handler_recv (struct stream_source *s, uint8_t *data, int data_len)
+{
+    StreamRecvInterface_Done(&s->output, stream_source_copy(s, data, data_len));
+}
+
+static void stream_source_output_handler_recv2 (struct stream_source *s, uint8_t *data, int data_len, uint8_t *data2, int data2_len)
+{
+    int len = stream_source_copy(s, data, data_len);
+    if (len == data_len) {
+        len += stream_source_copy(s, data2, data2_len);
+    }
+    
+    StreamRecvInterface_Done(&s->output, len);
+}
+
+static int stream_source_init (struct stream_source *s)
+{
+    // pregenerate a stream of encoded packets, which is replayed
+    int enc_len = PACKETPROTO_ENCLEN(packet_size);
+    s->data_len = STREAM_PACKETS * enc_len;
+    if (!(s->data = (uint8_t *)BAlloc(s->data_len))) {
+        return 0;
+    }
+    
+    for (int i = 0; i < STREAM_PACKETS; i++) {
+        struct packetproto_header header;
+        header.len = htol16(packet_size);
+        memcpy(s->data + i * enc_len, &header, sizeof(header));
+        memcpy(s->data + i * enc_len + sizeof(header), packet, packet_size);
+    }
+    
+    s->pos = 0;
+    
+    StreamRecvInterface_Init(&s->output, (StreamRecvInterface_handler_recv)stream_source_output_handler_recv, s, &pg);
+    StreamRecvInterface_EnableRecv2(&s->output, (StreamRecvInterface_handler_recv2)stream_source_output_handler_recv2);
+    
+    return 1;
+}
+
+static void stream_source_free (struct stream_source *s)
+{
+    StreamRecvInterface_Free(&s->output);
+    BFree(s->data);
+}
+
+static void decoder_handler_error (void *user)
+{
+    fprintf(stderr, "PacketProtoDecoder error\n");
+    abort();
+}
+
+static void measure (const char *name, struct sink *s)
+{
+    #ifdef FLOW_BENCH_COUNT_ALLOCS
+    uint64_t start_allocs = num_allocs;
+    #endif
+    
+    uint64_t start = BMetrics_Now();
+    
+    while (s->num_packets < num_packets && BPendingGroup_HasJobs(&pg)) {
+        BPendingGroup_ExecuteJob(&pg);
+    }
+    
+    uint64_t time = BMetrics_Now() - start;
+    
+    uint64_t packets = s->num_packets;
+    double ns_per_packet = (packets > 0 ? (double)time / packets : 0);
+    double packets_per_second = (time > 0 ? (double)packets * 1000000000 / time : 0);
+    
+    fprintf(out, "%s,%d,%" PRIu64 ",%" PRIu64 ",%.1f,%.0f,", name, packet_size, packets, time, ns_per_packet, packets_per_second);
+    
+    #ifdef FLOW_BENCH_COUNT_ALLOCS
+    fprintf(out, "%.3f", (packets > 0 ? (double)(num_allocs - start_allocs) / packets : 0));
+    #endif
+    
+    fprintf(out, "\n");
+    fflush(out);
+}
+
+static int bench_direct (void)
+{
+    struct sink sink;
+    sink_init(&sink, packet_size);
+    
+    FastPacketSource source;
+    FastPacketSource_Init(&source, &sink.input, packet, packet_size, &pg);
+    
+    measure("direct", &sink);
+    
+    FastPacketSource_Free(&source);
+    sink_free(&sink);
+    
+    return 1;
+}
+
+static int bench_fairqueue (void)
+{
+    struct sink sink;
+    sink_init(&sink, packet_size);
+    
+    PacketPassFairQueue queue;
+    if (!PacketPassFairQueue_Init(&queue, &sink.input, &pg, 0, 1)) {
+        sink_free(&sink);
+        return 0;
+    }
+    
+    PacketPassFairQueueFlow flows[NUM_FLOWS];
+    FastPacketSource sources[NUM_FLOWS];
+    for (int i = 0; i < NUM_FLOWS; i++) {
+        PacketPassFairQueueFlow_Init(&flows[i], &queue);
+        FastPacketSource_Init(&sources[i], PacketPassFairQueueFlow_GetInput(&flows[i]), packet, packet_size, &pg);
+    }
+    
+    measure("PacketPassFairQueue", &sink);
+    
+    PacketPassFairQueue_PrepareFree(&queue);
+    for (int i = 0; i < NUM_FLOWS; i++) {
+        FastPacketSource_Free(&sources[i]);
+        PacketPassFairQueueFlow_Free(&flows[i]);
+    }
+    PacketPassFairQueue_Free(&queue);
+    sink_free(&sink);
+    
+    return 1;
+}
+
+static int bench_priorityqueue (void)
+{
+    struct sink sink;
+    sink_init(&sink, packet_size);
+    
+    PacketPassPriorityQueue queue;
+    PacketPassPriorityQueue_Init(&queue, &sink.input, &pg, 0);
+    
+    PacketPassPriorityQueueFlow flows[NUM_FLOWS];
+    FastPacketSource sources[NUM_FLOWS];
+    for (int i = 0; i < NUM_FLOWS; i++) {
+        PacketPassPriorityQueueFlow_Init(&flows[i], &queue, i);
+        FastPacketSource_Init(&sources[i], PacketPassPriorityQueueFlow_GetInput(&flows[i]), packet, packet_size, &pg);
+    }
+    
+    measure("PacketPassPriorityQueue", &sink);
+    
+    PacketPassPriorityQueue_PrepareFree(&queue);
+    for (int i = 0; i < NUM_FLOWS; i++) {
+        FastPacketSource_Free(&sources[i]);
+        PacketPassPriorityQueueFlow_Free(&flows[i]);
+    }
+    PacketPassPriorityQueue_Free(&queue);
+    sink_free(&sink);
+    
+    return 1;
+}
+
+static int bench_packetbuffer (void)
+{
+    struct sink sink;
+    sink_init(&sink, packet_size);
+    
+    PacketCopier copier;
+    PacketCopier_Init(&copier, packet_size, &pg);
+    
+    PacketBuffer buffer;
+    if (!PacketBuffer_Init(&buffer, PacketCopier_GetOutput(&copier), &sink.input, BUFFER_PACKETS, &pg)) {
+        PacketCopier_Free(&copier);
+        sink_free(&sink);
+        return 0;
+    }
+    
+    FastPacketSource source;
+    FastPacketSource_Init(&source, PacketCopier_GetInput(&copier), packet, packet_size, &pg);
+    
+    measure("PacketBuffer", &sink);
+    
+    FastPacketSource_Free(&source);
+    PacketBuffer_Free(&buffer);
+    PacketCopier_Free(&copier);
+    sink_free(&sink);
+    
+    return 1;
+}
+
+static int bench_singlepacketbuffer (void)
+{
+    struct sink sink;
+    sink_init(&sink, packet_size);
+    
+    PacketCopier copier;
+    PacketCopier_Init(&copier, packet_size, &pg);
+    
+    SinglePacketBuffer buffer;
+    if (!SinglePacketBuffer_Init(&buffer, PacketCopier_GetOutput(&copier), &sink.input, &pg)) {
+        PacketCopier_Free(&copier);
+        sink_free(&sink);
+        return 0;
+    }
+    
+    FastPacketSource source;
+    FastPacketSource_Init(&source, PacketCopier_GetInput(&copier), packet, packet_size, &pg);
+    
+    measure("SinglePacketBuffer", &sink);
+    
+    FastPacketSource_Free(&source);
+    SinglePacketBuffer_Free(&buffer);
+    PacketCopier_Free(&copier);
+    sink_free(&sink);
+    
+    return 1;
+}
+
+static int bench_encoder (void)
+{
+    struct sink sink;
+    sink_init(&sink, PACKETPROTO_ENCLEN(packet_size));
+    
+    PacketCopier copier;
+    PacketCopier_Init(&copier, packet_size, &pg);
+    
+    PacketProtoEncoder encoder;
+    PacketProtoEncoder_Init(&encoder, PacketCopier_GetOutput(&copier), &pg);
+    
+    SinglePacketBuffer buffer;
+    if (!SinglePacketBuffer_Init(&buffer, PacketProtoEncoder_GetOutput(&encoder), &sink.input, &pg)) {
+        PacketProtoEncoder_Free(&encoder);
+        PacketCopier_Free(&copier);
+        sink_free(&sink);
+        return 0;
+    }
+    
+    FastPacketSource source;
+    FastPacketSource_Init(&source, PacketCopier_GetInput(&copier), packet, packet_size, &pg);
+    
+    measure("PacketProtoEncoder", &sink);
+    
+    FastPacketSource_Free(&source);
+    SinglePacketBuffer_Free(&buffer);
+    PacketProtoEncoder_Free(&encoder);
+    PacketCopier_Free(&copier);
+    sink_free(&sink);
+    
+    return 1;
+}
+
+static int bench_decoder_common (int ring)
+{
+    struct sink sink;
+    sink_init(&sink, packet_size);
+    
+    struct stream_source source;
+    if (!stream_source_init(&source)) {
+        goto fail0;
+    }
+    
+    PacketProtoDecoder decoder;
+    if (ring) {
+        if (!PacketProtoDecoder_InitRing(&decoder, &source.output, &sink.input, &pg, RING_PACKETS * PACKETPROTO_ENCLEN(packet_size), NULL, decoder_handler_error)) {
+            goto fail1;
+        }
+    } else {
+        if (!PacketProtoDecoder_Init(&decoder, &source.output, &sink.input, &pg, NULL, decoder_handler_error)) {
+            goto fail1;
+        }
+    }
+    
+    measure((ring ? "PacketProtoDecoder_ring" : "PacketProtoDecoder"), &sink);
+    
+    PacketProtoDecoder_Free(&decoder);
+    stream_source_free(&source);
+    sink_free(&sink);
+    
+    return 1;
+    
+fail1:
+    stream_source_free(&source);
+fail0:
+    sink_free(&sink);
+    return 0;
+}
+
+static int bench_decoder (void)
+{
+    return bench_decoder_common(0);
+}
+
+static int bench_decoder_ring (void)
+{
+    return bench_decoder_common(1);
+}
+
+struct router_bench {
+    PacketRouter router;
+    RouteBuffer buffers[2];
+};
+
+static void router_handler (struct router_bench *o, uint8_t *buf, int recv_len)
+{
+    // route every packet to both buffers, with a one byte header
+    for (int i = 0; i < 2; i++) {
+        uint8_t header = i;
+        if (!PacketRouter_Route(&o->router, 1 + recv_len, &o->buffers[i], &header)) {
+            // the sinks take packets right away, so the buffers never fill up
+            fprintf(stderr, "PacketRouter_Route failed\n");
+            abort();
+        }
+    }
+}
+
+static int bench_router (void)
+{
+    struct router_bench o;
+    int mtu = 1 + packet_size;
+    
+    struct sink sinks[2];
+    sink_init(&sinks[0], mtu);
+    sink_init(&sinks[1], mtu);
+    
+    PacketCopier copier;
+    PacketCopier_Init(&copier, packet_size, &pg);
+    
+    if (!PacketRouter_Init(&o.router, mtu, 1, PacketCopier_GetOutput(&copier), (PacketRouter_handler)router_handler, &o, &pg)) {
+        goto fail0;
+    }
+    
+    if (!RouteBuffer_Init(&o.buffers[0], PacketRouter_GetSource(&o.router), &sinks[0].input, ROUTE_BUFFER_PACKETS)) {
+        goto fail1;
+    }
+    
+    if (!RouteBuffer_Init(&o.buffers[1], PacketRouter_GetSource(&o.router), &sinks[1].input, ROUTE_BUFFER_PACKETS)) {
+        goto fail2;
+    }
+    
+    FastPacketSource source;
+    FastPacketSource_Init(&source, PacketCopier_GetInput(&copier), packet, packet_size, &pg);
+    
+    measure("PacketRouter_RouteBuffer", &sinks[0]);
+    
+    FastPacketSource_Free(&source);
+    RouteBuffer_Free(&o.buffers[1]);
+    RouteBuffer_Free(&o.buffers[0]);
+    PacketRouter_Free(&o.router);
+    PacketCopier_Free(&copier);
+    sink_free(&sinks[1]);
+    sink_free(&sinks[0]);
+    
+    return 1;
+    
+fail2:
+    RouteBuffer_Free(&o.buffers[0]);
+fail1:
+    PacketRouter_Free(&o.router);
+fail0:
+    PacketCopier_Free(&copier);
+    sink_free(&sinks[1]);
+    sink_free(&sinks[0]);
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int (*func) (void);
+} benchmarks[] = {
+    {"direct", bench_direct},
+    {"PacketPassFairQueue", bench_fairqueue},
+    {"PacketPassPriorityQueue", bench_priorityqueue},
+    {"PacketBuffer", bench_packetbuffer},
+    {"SinglePacketBuffer", bench_singlepacketbuffer},
+    {"PacketProtoEncoder", bench_encoder},
+    {"PacketProtoDecoder", bench_decoder},
+    {"PacketProtoDecoder_ring", bench_decoder_ring},
+    {"PacketRouter_RouteBuffer", bench_router}
+};
+
+int main (int argc, char **argv)
+{
+    int ret = 1;
+    
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 3 && argc != 4) {
+        usage(argv[0]);
+    }
+    
+    num_packets = strtoull(argv[1], NULL, 10);
+    packet_size = atoi(argv[2]);
+    
+    if (num_packets == 0 || packet_size <= 0 || packet_size > PACKETPROTO_MAXPAYLOAD) {
+        usage(argv[0]);
+    }
+    
+    if (argc == 4) {
+        if (!(out = fopen(argv[3], "w"))) {
+            printf("failed to open %s\n", argv[3]);
+            goto fail0;
+        }
+    } else {
+        out = stdout;
+    }
+    
+    BLog_InitStdout();
+    
+    BPendingGroup_Init(&pg);
+    
+    if (!(packet = (uint8_t *)BAlloc(packet_size))) {
+        printf("BAlloc failed\n");
+        goto fail1;
+    }
+    for (int i = 0; i < packet_size; i++) {
+        packet[i] = (uint8_t)(i * 7);
+    }
+    
+    fprintf(out, "benchmark,packet_size,packets,time_ns,ns_per_packet,packets_per_second,allocs_per_packet\n");
+    
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        if (!benchmarks[i].func()) {
+            printf("%s: init failed\n", benchmarks[i].name);
+            goto fail2;
+        }
+        
+        ASSERT(!BPendingGroup_HasJobs(&pg))
+    }
+    
+    ret = 0;
+    
+fail2:
+    BFree(packet);
+fail1:
+    BPendingGroup_Free(&pg);
+    BLog_Free();
+    if (out != stdout) {
+        fclose(out);
+    }
+fail0:
+    DebugObjectGlobal_Finish();
+    
+    return ret;
+}
@@ -0,0 +1,267 @@
+/**
+ * @file fragmentproto_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Feeds {@link FragmentProtoAssembler} with chunks of fixed size frames,
+ * reordered within a window and randomly duplicated, as they would arrive
+ * over a lossy UDP link, and reports the throughput and how many frames
+ * were reassembled intact.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/balloc.h>
+#include <misc/balign.h>
+#include <misc/byteorder.h>
+#include <misc/minmax.h>
+#include <protocol/fragmentproto.h>
+#include <base/BLog.h>
+#include <base/BPending.h>
+#include <base/DebugObject.h>
+#include <system/BTime.h>
+#include <flow/PacketPassInterface.h>
+#include <client/FragmentProtoAssembler.h>
+
+// number of frames in the pregenerated packet schedule, which is replayed
+#define CYCLE_FRAMES 1024
+
+struct sched_packet {
+    int frame; // frame index within the cycle
+    int chunk; // chunk index within the frame
+    int seq; // position in the original order
+    int pos; // position after delaying
+};
+
+static BPendingGroup pg;
+static PacketPassInterface output;
+static uint8_t *pattern;
+static int frame_size;
+static int num_output;
+static int num_bad;
+
+static void usage (char *name)
+{
+    printf(
+        "Usage: %s <frame_size> <chunk_size> <window> <dup_percent> <num_frames>\n"
+        "    Sends num_frames frames in chunks of chunk_size bytes. Packets are\n"
+        "    delayed by a random number of packets less than window, and\n"
+        "    dup_percent percent of them are sent twice.\n",
+        name
+    );
+    
+    exit(1);
+}
+
+static int compare_packets (const void *v1, const void *v2)
+{
+    const struct sched_packet *p1 = (const struct sched_packet *)v1;
+    const struct sched_packet *p2 = (const struct sched_packet *)v2;
+    
+    if (p1->pos != p2->pos) {
+        return (p1->pos < p2->pos ? -1 : 1);
+    }
+    
+    return (p1->seq < p2->seq ? -1 : p1->seq > p2->seq);
+}
+
+static void output_handler_send (void *user, uint8_t *data, int data_len)
+{
+    // first bytes of a frame are its number, the rest is the pattern
+    if (data_len != frame_size || memcmp(data + 4, pattern + 4, frame_size - 4)) {
+        num_bad++;
+    }
+    
+    num_output++;
+    
+    PacketPassInterface_Done(&output);
+}
+
+static void input_handler_done (void *user)
+{
+}
+
+static void logfunc (void *user)
+{
+}
+
+static int build_packet (uint8_t *buf, uint32_t frame, int chunk, int chunk_size)
+{
+    int start = chunk * chunk_size;
+    int len = bmin_int(chunk_size, frame_size - start);
+    
+    struct fragmentproto_chunk_header header;
+    header.frame_id = htol16((fragmentproto_frameid)frame);
+    header.chunk_start = htol16(start);
+    header.chunk_len = htol16(len);
+    header.is_last = htol8(start + len == frame_size);
+    memcpy(buf, &header, sizeof(header));
+    
+    memcpy(buf + sizeof(header), pattern + start, len);
+    if (start == 0) {
+        memcpy(buf + sizeof(header), &frame, 4);
+    }
+    
+    return sizeof(header) + len;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 6) {
+        usage(argv[0]);
+    }
+    
+    frame_size = atoi(argv[1]);
+    int chunk_size = atoi(argv[2]);
+    int window = atoi(argv[3]);
+    int dup_percent = atoi(argv[4]);
+    int num_frames = atoi(argv[5]);
+    
+    if (frame_size < 4 || frame_size > UINT16_MAX || chunk_size <= 0 || window <= 0 || dup_percent < 0 || dup_percent > 100 || num_frames < 0) {
+        usage(argv[0]);
+    }
+    
+    int chunks_per_frame = bdivide_up(frame_size, chunk_size);
+    
+    // tolerate reordering by the window (see FragmentProtoAssembler_Init)
+    if (window > FPA_MAX_FRAMES - 2) {
+        printf("window too big\n");
+        goto fail0;
+    }
+    
+    BLog_InitStdout();
+    BLog_SetChannelLoglevel(BLOG_CHANNEL_FragmentProtoAssembler, BLOG_ERROR);
+    
+    BTime_Init();
+    
+    BPendingGroup_Init(&pg);
+    
+    if (!(pattern = (uint8_t *)BAlloc(frame_size))) {
+        printf("BAlloc failed\n");
+        goto fail1;
+    }
+    for (int i = 0; i < frame_size; i++) {
+        pattern[i] = (uint8_t)(i * 7);
+    }
+    
+    // pregenerate the order of packets, with duplicates
+    int max_sched = 2 * CYCLE_FRAMES * chunks_per_frame;
+    struct sched_packet *sched = (struct sched_packet *)BAllocArray(max_sched, sizeof(sched[0]));
+    if (!sched) {
+        printf("BAllocArray failed\n");
+        goto fail2;
+    }
+    
+    srandom(1);
+    
+    int num_sched = 0;
+    for (int f = 0; f < CYCLE_FRAMES; f++) {
+        for (int c = 0; c < chunks_per_frame; c++) {
+            for (int copies = 1 + (random() % 100 < dup_percent); copies > 0; copies--) {
+                struct sched_packet *p = &sched[num_sched];
+                p->frame = f;
+                p->chunk = c;
+                p->seq = num_sched;
+                p->pos = num_sched + random() % window;
+                num_sched++;
+            }
+        }
+    }
+    
+    qsort(sched, num_sched, sizeof(sched[0]), compare_packets);
+    
+    PacketPassInterface_Init(&output, frame_size, output_handler_send, NULL, &pg);
+    
+    FragmentProtoAssembler assembler;
+    int input_mtu = sizeof(struct fragmentproto_chunk_header) + chunk_size;
+    if (!FragmentProtoAssembler_Init(&assembler, input_mtu, &output, window + 2, chunks_per_frame + 1, &pg, NULL, logfunc)) {
+        printf("FragmentProtoAssembler_Init failed\n");
+        goto fail3;
+    }
+    
+    PacketPassInterface *input = FragmentProtoAssembler_GetInput(&assembler);
+    PacketPassInterface_Sender_Init(input, input_handler_done, NULL);
+    
+    uint8_t *buf = (uint8_t *)BAlloc(input_mtu);
+    if (!buf) {
+        printf("BAlloc failed\n");
+        goto fail4;
+    }
+    
+    int num_packets = 0;
+    
+    btime_t start = btime_gettime();
+    
+    for (int base = 0; base < num_frames; base += CYCLE_FRAMES) {
+        for (int i = 0; i < num_sched; i++) {
+            if (base + sched[i].frame >= num_frames) {
+                continue;
+            }
+            
+            int len = build_packet(buf, base + sched[i].frame, sched[i].chunk, chunk_size);
+            PacketPassInterface_Sender_Send(input, buf, len);
+            num_packets++;
+            
+            while (BPendingGroup_HasJobs(&pg)) {
+                BPendingGroup_ExecuteJob(&pg);
+            }
+        }
+    }
+    
+    btime_t time = btime_gettime() - start;
+    
+    printf("%d packets, %d frames: %d reassembled (%d bad) in %d ms",
+           num_packets, num_frames, num_output, num_bad, (int)time);
+    if (time > 0) {
+        printf(", %.1f ns/packet", (double)time * 1000000 / num_packets);
+    }
+    printf("\n");
+    
+    BFree(buf);
+fail4:
+    FragmentProtoAssembler_Free(&assembler);
+fail3:
+    PacketPassInterface_Free(&output);
+    BFree(sched);
+fail2:
+    BFree(pattern);
+fail1:
+    BPendingGroup_Free(&pg);
+    BLog_Free();
+fail0:
+    DebugObjectGlobal_Finish();
+    
+    return 0;
+}
@@ -0,0 +1,302 @@
+/**
+ * @file bthreadwork_test.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Test for the ring mode of {@link PacketProtoDecoder}. A PacketProto stream
+ * of packets with random sizes and known contents is fed to the decoder in
+ * random chunks, once by an input which supports two-buffer receives and once
+ * by one which doesn't. Input and output complete operations either right
+ * away or from a job. Every packet must come out once, in order and intact,
+ * and with the two-buffer input, the test only passes if some receives did
+ * fill both segments and some payloads did wrap around the end of the buffer
+ * (use more packets or a smaller buffer if they didn't).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/byteorder.h>
+#include <misc/minmax.h>
+#include <protocol/packetproto.h>
+#include <base/BLog.h>
+#include <base/BPending.h>
+#include <base/DebugObject.h>
+#include <flow/PacketPassInterface.h>
+#include <flow/StreamRecvInterface.h>
+#include <flow/PacketProtoDecoder.h>
+
+struct source {
+    StreamRecvInterface output;
+    BPending done_job;
+    int done_len;
+    int packet;
+    int packet_len;
+    int pos;
+    int num_recv2;
+};
+
+struct sink {
+    PacketPassInterface input;
+    BPending done_job;
+    int packet;
+    int num_wrapped;
+};
+
+static BPendingGroup pg;
+static int num_packets;
+static int mtu;
+static int buf_size;
+static PacketProtoDecoder decoder;
+static struct source source;
+static struct sink sink;
+static int failed;
+
+static void usage (char *name)
+{
+    printf(
+        "Usage: %s <num_packets> <mtu> <buf_size>\n"
+        "    Decodes num_packets packets of up to mtu bytes through a ring of buf_size bytes.\n",
+        name
+    );
+    
+    exit(1);
+}
+
+static int packet_len (int packet)
+{
+    // mostly small packets, some of maximum size
+    uint32_t x = (uint32_t)packet * 2654435761u;
+    return ((x >> 8) % 4 == 0 ? mtu : (x >> 12) % (mtu + 1));
+}
+
+static uint8_t packet_byte (int packet, int pos)
+{
+    return (uint8_t)(packet * 31 + pos * 7);
+}
+
+static void error_handler (void *user)
+{
+    printf("decoder reported an error\n");
+    failed = 1;
+}
+
+static int source_fill (struct source *o, uint8_t *data, int data_len)
+{
+    int len = 0;
+    
+    while (len < data_len && o->packet < num_packets) {
+        // encoded packet is the header followed by the payload
+        struct packetproto_header header;
+        header.len = htol16(o->packet_len);
+        
+        if (o->pos < sizeof(header)) {
+            data[len++] = ((uint8_t *)&header)[o->pos];
+        } else {
+            data[len++] = packet_byte(o->packet, o->pos - sizeof(header));
+        }
+        
+        o->pos++;
+        
+        if (o->pos == sizeof(header) + o->packet_len) {
+            o->packet++;
+            o->packet_len = packet_len(o->packet);
+            o->pos = 0;
+        }
+    }
+    
+    return len;
+}
+
+static void source_done_job_handler (struct source *o)
+{
+    StreamRecvInterface_Done(&o->output, o->done_len);
+}
+
+static void source_handler_recv2 (struct source *o, uint8_t *data, int data_len, uint8_t *data2, int data2_len)
+{
+    ASSERT(data_len > 0)
+    ASSERT(data2_len >= 0)
+    
+    // nothing more to give
+    if (o->packet == num_packets) {
+        return;
+    }
+    
+    // give a random amount, filling the first buffer before the second
+    int amount = 1 + rand() % (data_len + data2_len);
+    int len = source_fill(o, data, bmin_int(amount, data_len));
+    if (amount > data_len && len == data_len) {
+        len += source_fill(o, data2, amount - data_len);
+        o->num_recv2++;
+    }
+    
+    if (rand() % 2) {
+        StreamRecvInterface_Done(&o->output, len);
+    } else {
+        o->done_len = len;
+        BPending_Set(&o->done_job);
+    }
+}
+
+static void source_handler_recv (struct source *o, uint8_t *data, int data_len)
+{
+    source_handler_recv2(o, data, data_len, NULL, 0);
+}
+
+static void sink_done_job_handler (struct sink *o)
+{
+    PacketPassInterface_Done(&o->input);
+}
+
+static void sink_handler_send (struct sink *o, uint8_t *data, int data_len)
+{
+    int expected_len = packet_len(o->packet);
+    
+    if (data_len != expected_len) {
+        printf("packet %d: length %d, expected %d\n", o->packet, data_len, expected_len);
+        failed = 1;
+        return;
+    }
+    
+    for (int i = 0; i < data_len; i++) {
+        if (data[i] != packet_byte(o->packet, i)) {
+            printf("packet %d: wrong byte at %d\n", o->packet, i);
+            failed = 1;
+            return;
+        }
+    }
+    
+    // the payload was made contiguous after the end of the buffer
+    if (data + data_len > decoder.buf + decoder.buf_size) {
+        o->num_wrapped++;
+    }
+    
+    o->packet++;
+    
+    if (rand() % 2) {
+        PacketPassInterface_Done(&o->input);
+    } else {
+        BPending_Set(&o->done_job);
+    }
+}
+
+static int run (int recv2)
+{
+    int ret = 0;
+    
+    failed = 0;
+    
+    // init source
+    StreamRecvInterface_Init(&source.output, (StreamRecvInterface_handler_recv)source_handler_recv, &source, &pg);
+    if (recv2) {
+        StreamRecvInterface_EnableRecv2(&source.output, (StreamRecvInterface_handler_recv2)source_handler_recv2);
+    }
+    BPending_Init(&source.done_job, &pg, (BPending_handler)source_done_job_handler, &source);
+    source.packet = 0;
+    source.packet_len = packet_len(0);
+    source.pos = 0;
+    source.num_recv2 = 0;
+    
+    // init sink
+    PacketPassInterface_Init(&sink.input, mtu, (PacketPassInterface_handler_send)sink_handler_send, &sink, &pg);
+    BPending_Init(&sink.done_job, &pg, (BPending_handler)sink_done_job_handler, &sink);
+    sink.packet = 0;
+    sink.num_wrapped = 0;
+    
+    // init decoder
+    if (!PacketProtoDecoder_InitRing(&decoder, &source.output, &sink.input, &pg, buf_size, NULL, error_handler)) {
+        printf("PacketProtoDecoder_InitRing failed\n");
+        goto fail0;
+    }
+    
+    // run until the stream is consumed and nothing is left to do
+    while (!failed && BPendingGroup_HasJobs(&pg)) {
+        BPendingGroup_ExecuteJob(&pg);
+    }
+    
+    if (!failed && sink.packet != num_packets) {
+        printf("received %d of %d packets\n", sink.packet, num_packets);
+        failed = 1;
+    }
+    
+    // make sure the interesting paths were taken
+    if (recv2 && (source.num_recv2 == 0 || (mtu > 0 && sink.num_wrapped == 0))) {
+        failed = 1;
+    }
+    
+    printf("%s input: %d packets, %d two-buffer receives, %d wrapped payloads: %s\n",
+           (recv2 ? "two-buffer" : "one-buffer"), sink.packet, source.num_recv2, sink.num_wrapped, (failed ? "FAILED" : "ok"));
+    
+    ret = !failed;
+    
+    PacketProtoDecoder_Free(&decoder);
+fail0:
+    BPending_Free(&sink.done_job);
+    PacketPassInterface_Free(&sink.input);
+    BPending_Free(&source.done_job);
+    StreamRecvInterface_Free(&source.output);
+    return ret;
+}
+
+int main (int argc, char **argv)
+{
+    int ret = 1;
+    
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 4) {
+        usage(argv[0]);
+    }
+    
+    num_packets = atoi(argv[1]);
+    mtu = atoi(argv[2]);
+    buf_size = atoi(argv[3]);
+    
+    if (num_packets <= 0 || mtu < 0 || mtu > PACKETPROTO_MAXPAYLOAD || buf_size < 0) {
+        usage(argv[0]);
+    }
+    
+    BLog_InitStdout();
+    
+    BPendingGroup_Init(&pg);
+    
+    if (run(0) && run(1)) {
+        ret = 0;
+    }
+    
+    BPendingGroup_Free(&pg);
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
@@ -0,0 +1,170 @@
+/**
+ * @file predicate_eval_test.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Evaluates a fixed set of predicates and checks the results. The cases
+ * mostly put a call with an error where evaluation jumps over it, followed by
+ * more calls, so that a wrong stack depth for the error shows up as an
+ * assertion failure or a memory error in the calls after it.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <misc/array_length.h>
+#include <predicate/BPredicate.h>
+#include <base/BLog.h>
+
+struct test_case {
+    const char *predicate;
+    int result;
+};
+
+static const struct test_case cases[] = {
+    {"hello()", 1},
+    {"conj(hello(), neg(hello()))", 0},
+    {"strcmp(\"a\", \"a\") AND NOT strcmp(\"a\", \"b\")", 1},
+    {"nosuch()", -1},
+    {"error()", -1},
+    {"true OR nosuch()", 1},
+    {"false OR nosuch()", -1},
+    {"conj(hello(), nosuch())", -1},
+    {"(false AND nosuch()) OR conj(conj(hello(), hello()), conj(hello(), conj(hello(), hello())))", 1},
+    {"(false AND conj(hello(), nosuch())) OR conj(conj(hello(), hello()), conj(hello(), conj(hello(), hello())))", 1},
+    {"(false AND conj(hello())) OR conj(conj(hello(), hello()), conj(hello(), conj(hello(), hello())))", 1},
+    {"(false AND conj(hello(), hello(), hello())) OR conj(conj(hello(), hello()), conj(hello(), conj(hello(), hello())))", 1},
+    {"(false AND neg(\"x\")) OR conj(conj(hello(), hello()), conj(hello(), conj(hello(), hello())))", 1},
+    {"(false AND strcmp(hello(), \"x\")) OR conj(conj(hello(), hello()), conj(hello(), conj(hello(), hello())))", 1},
+    {"NOT (true OR conj(nosuch(), hello())) OR conj(hello(), conj(hello(), conj(hello(), hello())))", 1},
+    {"conj(true OR conj(hello(), nosuch()), conj(hello(), conj(hello(), hello())))", 1},
+};
+
+static int func_hello (void *user, void **args)
+{
+    return 1;
+}
+
+static int func_neg (void *user, void **args)
+{
+    int arg = *((int *)args[0]);
+    
+    return !arg;
+}
+
+static int func_conj (void *user, void **args)
+{
+    int arg1 = *((int *)args[0]);
+    int arg2 = *((int *)args[1]);
+    
+    return (arg1 && arg2);
+}
+
+static int func_strcmp (void *user, void **args)
+{
+    char *arg1 = (char *)args[0];
+    char *arg2 = (char *)args[1];
+    
+    return (!strcmp(arg1, arg2));
+}
+
+static int func_error (void *user, void **args)
+{
+    return -1;
+}
+
+static int eval (const char *str)
+{
+    BPredicate pr;
+    if (!BPredicate_Init(&pr, (char *)str)) {
+        fprintf(stderr, "BPredicate_Init failed: %s\n", str);
+        return -2;
+    }
+    
+    BPredicateFunction f_hello;
+    BPredicateFunction_Init(&f_hello, &pr, "hello", NULL, 0, func_hello, NULL);
+    int arr1[] = {PREDICATE_TYPE_BOOL};
+    BPredicateFunction f_neg;
+    BPredicateFunction_Init(&f_neg, &pr, "neg", arr1, 1, func_neg, NULL);
+    int arr2[] = {PREDICATE_TYPE_BOOL, PREDICATE_TYPE_BOOL};
+    BPredicateFunction f_conj;
+    BPredicateFunction_Init(&f_conj, &pr, "conj", arr2, 2, func_conj, NULL);
+    int arr3[] = {PREDICATE_TYPE_STRING, PREDICATE_TYPE_STRING};
+    BPredicateFunction f_strcmp;
+    BPredicateFunction_Init(&f_strcmp, &pr, "strcmp", arr3, 2, func_strcmp, NULL);
+    BPredicateFunction f_error;
+    BPredicateFunction_Init(&f_error, &pr, "error", NULL, 0, func_error, NULL);
+    
+    // evaluate twice, the second time with the code compiled by the first
+    int result = BPredicate_Eval(&pr);
+    if (BPredicate_Eval(&pr) != result) {
+        fprintf(stderr, "second evaluation differs: %s\n", str);
+        result = -2;
+    }
+    
+    BPredicateFunction_Free(&f_hello);
+    BPredicateFunction_Free(&f_neg);
+    BPredicateFunction_Free(&f_conj);
+    BPredicateFunction_Free(&f_strcmp);
+    BPredicateFunction_Free(&f_error);
+    
+    BPredicate_Free(&pr);
+    
+    return result;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc != 1) {
+        fprintf(stderr, "Usage: %s\n", (argc > 0 ? argv[0] : ""));
+        return 1;
+    }
+    
+    // init logger
+    BLog_InitStdout();
+    
+    int failed = 0;
+    
+    for (size_t i = 0; i < B_ARRAY_LENGTH(cases); i++) {
+        int result = eval(cases[i].predicate);
+        if (result != cases[i].result) {
+            fprintf(stderr, "wrong result %d, expected %d: %s\n", result, cases[i].result, cases[i].predicate);
+            failed = 1;
+        }
+    }
+    
+    BLog_Free();
+    
+    if (failed) {
+        return 1;
+    }
+    
+    printf("%zu predicates ok\n", B_ARRAY_LENGTH(cases));
+    
+    return 0;
+}
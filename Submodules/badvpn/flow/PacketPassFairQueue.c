@@ -33,6 +33,8 @@
 #include <misc/offset.h>
 #include <misc/minmax.h>
 #include <misc/compare.h>
+#include <misc/balloc.h>
+#include <base/BMetrics.h>
 
 #include <flow/PacketPassFairQueue.h>
 
@@ -49,12 +51,27 @@ static int compare_flows (PacketPassFairQueueFlow *f1, PacketPassFairQueueFlow *
 #include "PacketPassFairQueue_tree.h"
 #include <structure/SAvl_impl.h>
 
+static BMetric metric_queued = BMETRIC_GAUGE_INIT("badvpn_fairqueue_queued_packets", "Packets waiting in fair queues for their turn to be sent.");
+
+static int get_mtu (PacketPassFairQueue *m)
+{
+    if (m->gather_output) {
+        return m->gather_mtu;
+    }
+    
+    return PacketPassInterface_GetMTU(m->output);
+}
+
 static uint64_t get_current_time (PacketPassFairQueue *m)
 {
     if (m->sending_flow) {
         return m->sending_flow->time;
     }
     
+    if (m->gather_first < m->gather_num) {
+        return m->gather_flows[m->gather_first]->time;
+    }
+    
     uint64_t time = 0; // to remove warning
     int have = 0;
     
@@ -115,6 +132,98 @@ static void increment_sent_flow (PacketPassFairQueueFlow *flow, uint64_t amount)
     flow->time += amount;
 }
 
+static void gather_continue (PacketPassFairQueue *m)
+{
+    ASSERT(m->gather_output)
+    ASSERT(m->gather_first < m->gather_num)
+    ASSERT(!m->sending_flow)
+    ASSERT(!m->previous_flow)
+    ASSERT(!BPending_IsSet(&m->schedule_job))
+    ASSERT(!m->freeing)
+    
+    PacketPassFairQueueFlow *flow = m->gather_flows[m->gather_first];
+    ASSERT(flow->is_gathered)
+    ASSERT(m->gather_sent >= 0)
+    
+    // finish the first packet if it has been sent
+    if (m->gather_sent >= flow->queued.data_len) {
+        m->gather_sent -= flow->queued.data_len;
+        m->gather_first++;
+        flow->is_gathered = 0;
+        
+        // update flow time by packet size
+        increment_sent_flow(flow, (uint64_t)m->packet_weight + flow->queued.data_len);
+        
+        // if this was the last packet, the next send can be scheduled
+        if (m->gather_first == m->gather_num) {
+            ASSERT(m->gather_sent == 0)
+            m->gather_num = 0;
+            m->gather_first = 0;
+        }
+        
+        // continue with the remaining packets, or schedule, from a job
+        BPending_Set(&m->schedule_job);
+        
+        // finish flow packet
+        PacketPassInterface_Done(&flow->input);
+        
+        // call busy handler if set
+        if (flow->handler_busy) {
+            // handler is one-shot, unset it before calling
+            PacketPassFairQueue_handler_busy handler = flow->handler_busy;
+            flow->handler_busy = NULL;
+            
+            // call handler
+            handler(flow->user);
+            return;
+        }
+        return;
+    }
+    
+    // send the rest of the packets, skipping any empty ones
+    int num_segs = 0;
+    for (int i = m->gather_first; i < m->gather_num; i++) {
+        PacketPassFairQueueFlow *gflow = m->gather_flows[i];
+        int offset = (i == m->gather_first ? m->gather_sent : 0);
+        if (gflow->queued.data_len > offset) {
+            m->gather_segs[num_segs].data = gflow->queued.data + offset;
+            m->gather_segs[num_segs].data_len = gflow->queued.data_len - offset;
+            num_segs++;
+        }
+    }
+    ASSERT(num_segs > 0)
+    
+    StreamPassInterface_Sender_Sendv(m->gather_output, m->gather_segs, num_segs);
+}
+
+static void schedule_gather (PacketPassFairQueue *m)
+{
+    ASSERT(m->gather_output)
+    ASSERT(m->gather_num == 0)
+    ASSERT(!PacketPassFairQueue__Tree_IsEmpty(&m->queued_tree))
+    
+    // take the first queued flows; each flow has at most one packet queued,
+    // so this is the order they would be sent in one by one
+    do {
+        PacketPassFairQueueFlow *qflow = PacketPassFairQueue__Tree_GetFirst(&m->queued_tree, 0);
+        ASSERT(qflow->is_queued)
+        
+        // remove flow from queue
+        PacketPassFairQueue__Tree_Remove(&m->queued_tree, 0, qflow);
+        BMetric_Sub(&metric_queued, 1);
+        qflow->is_queued = 0;
+        
+        // add to send
+        qflow->is_gathered = 1;
+        m->gather_flows[m->gather_num++] = qflow;
+    } while (m->gather_num < m->gather_max && !PacketPassFairQueue__Tree_IsEmpty(&m->queued_tree));
+    
+    m->gather_first = 0;
+    m->gather_sent = 0;
+    
+    gather_continue(m);
+}
+
 static void schedule (PacketPassFairQueue *m)
 {
     ASSERT(!m->sending_flow)
@@ -122,12 +231,18 @@ static void schedule (PacketPassFairQueue *m)
     ASSERT(!m->freeing)
     ASSERT(!PacketPassFairQueue__Tree_IsEmpty(&m->queued_tree))
     
+    if (m->gather_output) {
+        schedule_gather(m);
+        return;
+    }
+    
     // get first queued flow
     PacketPassFairQueueFlow *qflow = PacketPassFairQueue__Tree_GetFirst(&m->queued_tree, 0);
     ASSERT(qflow->is_queued)
     
     // remove flow from queue
     PacketPassFairQueue__Tree_Remove(&m->queued_tree, 0, qflow);
+    BMetric_Sub(&metric_queued, 1);
     qflow->is_queued = 0;
     
     // schedule send
@@ -145,6 +260,12 @@ static void schedule_job_handler (PacketPassFairQueue *m)
     // remove previous flow
     m->previous_flow = NULL;
     
+    // in gather mode, continue with the current send
+    if (m->gather_num > 0) {
+        gather_continue(m);
+        return;
+    }
+    
     if (!PacketPassFairQueue__Tree_IsEmpty(&m->queued_tree)) {
         schedule(m);
     }
@@ -156,6 +277,7 @@ static void input_handler_send (PacketPassFairQueueFlow *flow, uint8_t *data, in
     
     ASSERT(flow != m->sending_flow)
     ASSERT(!flow->is_queued)
+    ASSERT(!flow->is_gathered)
     ASSERT(!m->freeing)
     DebugObject_Access(&flow->d_obj);
     
@@ -173,6 +295,16 @@ static void input_handler_send (PacketPassFairQueueFlow *flow, uint8_t *data, in
     int res = PacketPassFairQueue__Tree_Insert(&m->queued_tree, 0, flow, NULL);
     ASSERT_EXECUTE(res)
     flow->is_queued = 1;
+    BMetric_Add(&metric_queued, 1);
+    
+    // in gather mode, schedule from a job, so that other flows
+    // sending in the meantime get into the same send
+    if (m->gather_output) {
+        if (m->gather_num == 0 && !BPending_IsSet(&m->schedule_job)) {
+            BPending_Set(&m->schedule_job);
+        }
+        return;
+    }
     
     if (!m->sending_flow && !BPending_IsSet(&m->schedule_job)) {
         schedule(m);
@@ -216,29 +348,36 @@ static void output_handler_done (PacketPassFairQueue *m)
     }
 }
 
-int PacketPassFairQueue_Init (PacketPassFairQueue *m, PacketPassInterface *output, BPendingGroup *pg, int use_cancel, int packet_weight)
+static void gather_output_handler_done (PacketPassFairQueue *m, int data_len)
 {
-    ASSERT(packet_weight > 0)
-    ASSERT(use_cancel == 0 || use_cancel == 1)
-    ASSERT(!use_cancel || PacketPassInterface_HasCancel(output))
+    ASSERT(m->gather_first < m->gather_num)
+    ASSERT(data_len > 0)
+    ASSERT(!BPending_IsSet(&m->schedule_job))
+    ASSERT(!m->freeing)
+    DebugObject_Access(&m->d_obj);
+    
+    // update number of bytes sent
+    m->gather_sent += data_len;
     
+    // finish sent packets, or send the rest
+    gather_continue(m);
+}
+
+static int init_common (PacketPassFairQueue *m, int mtu, BPendingGroup *pg, int use_cancel, int packet_weight)
+{
     // init arguments
-    m->output = output;
     m->pg = pg;
     m->use_cancel = use_cancel;
     m->packet_weight = packet_weight;
     
     // make sure that (output MTU + packet_weight <= FAIRQUEUE_MAX_TIME)
     if (!(
-        (PacketPassInterface_GetMTU(output) <= FAIRQUEUE_MAX_TIME) &&
-        (packet_weight <= FAIRQUEUE_MAX_TIME - PacketPassInterface_GetMTU(output))
+        (mtu <= FAIRQUEUE_MAX_TIME) &&
+        (packet_weight <= FAIRQUEUE_MAX_TIME - mtu)
     )) {
-        goto fail0;
+        return 0;
     }
     
-    // init output
-    PacketPassInterface_Sender_Init(m->output, (PacketPassInterface_handler_done)output_handler_done, m);
-    
     // not sending
     m->sending_flow = NULL;
     
@@ -257,10 +396,77 @@ int PacketPassFairQueue_Init (PacketPassFairQueue *m, PacketPassInterface *outpu
     // init schedule job
     BPending_Init(&m->schedule_job, m->pg, (BPending_handler)schedule_job_handler, m);
     
+    // not gathering
+    m->gather_num = 0;
+    m->gather_first = 0;
+    
+    return 1;
+}
+
+int PacketPassFairQueue_Init (PacketPassFairQueue *m, PacketPassInterface *output, BPendingGroup *pg, int use_cancel, int packet_weight)
+{
+    ASSERT(packet_weight > 0)
+    ASSERT(use_cancel == 0 || use_cancel == 1)
+    ASSERT(!use_cancel || PacketPassInterface_HasCancel(output))
+    
+    // init arguments
+    m->output = output;
+    m->gather_output = NULL;
+    
+    // init common
+    if (!init_common(m, PacketPassInterface_GetMTU(output), pg, use_cancel, packet_weight)) {
+        goto fail0;
+    }
+    
+    // init output
+    PacketPassInterface_Sender_Init(m->output, (PacketPassInterface_handler_done)output_handler_done, m);
+    
+    DebugObject_Init(&m->d_obj);
+    DebugCounter_Init(&m->d_ctr);
+    return 1;
+    
+fail0:
+    return 0;
+}
+
+int PacketPassFairQueue_InitGather (PacketPassFairQueue *m, StreamPassInterface *output, int mtu, int max_packets, BPendingGroup *pg, int packet_weight)
+{
+    ASSERT(mtu >= 0)
+    ASSERT(max_packets > 0)
+    ASSERT(packet_weight > 0)
+    
+    // init arguments
+    m->output = NULL;
+    m->gather_output = output;
+    m->gather_mtu = mtu;
+    
+    // without vectored sends, there is nothing to gather
+    m->gather_max = (StreamPassInterface_HasSendv(output) ? max_packets : 1);
+    
+    // allocate send arrays
+    if (!(m->gather_flows = (PacketPassFairQueueFlow **)BAllocArray(m->gather_max, sizeof(m->gather_flows[0])))) {
+        goto fail0;
+    }
+    if (!(m->gather_segs = (StreamPassInterface_segment *)BAllocArray(m->gather_max, sizeof(m->gather_segs[0])))) {
+        goto fail1;
+    }
+    
+    // init common
+    if (!init_common(m, mtu, pg, 0, packet_weight)) {
+        goto fail2;
+    }
+    
+    // init output
+    StreamPassInterface_Sender_Init(m->gather_output, (StreamPassInterface_handler_done)gather_output_handler_done, m);
+    
     DebugObject_Init(&m->d_obj);
     DebugCounter_Init(&m->d_ctr);
     return 1;
     
+fail2:
+    BFree(m->gather_segs);
+fail1:
+    BFree(m->gather_flows);
 fail0:
     return 0;
 }
@@ -276,6 +482,12 @@ void PacketPassFairQueue_Free (PacketPassFairQueue *m)
     
     // free schedule job
     BPending_Free(&m->schedule_job);
+    
+    // free send arrays
+    if (m->gather_output) {
+        BFree(m->gather_segs);
+        BFree(m->gather_flows);
+    }
 }
 
 void PacketPassFairQueue_PrepareFree (PacketPassFairQueue *m)
@@ -290,7 +502,7 @@ int PacketPassFairQueue_GetMTU (PacketPassFairQueue *m)
 {
     DebugObject_Access(&m->d_obj);
     
-    return PacketPassInterface_GetMTU(m->output);
+    return get_mtu(m);
 }
 
 void PacketPassFairQueueFlow_Init (PacketPassFairQueueFlow *flow, PacketPassFairQueue *m)
@@ -305,7 +517,7 @@ void PacketPassFairQueueFlow_Init (PacketPassFairQueueFlow *flow, PacketPassFair
     flow->handler_busy = NULL;
     
     // init input
-    PacketPassInterface_Init(&flow->input, PacketPassInterface_GetMTU(flow->m->output), (PacketPassInterface_handler_send)input_handler_send, flow, m->pg);
+    PacketPassInterface_Init(&flow->input, get_mtu(flow->m), (PacketPassInterface_handler_send)input_handler_send, flow, m->pg);
     
     // set time
     flow->time = 0;
@@ -316,6 +528,9 @@ void PacketPassFairQueueFlow_Init (PacketPassFairQueueFlow *flow, PacketPassFair
     // is not queued
     flow->is_queued = 0;
     
+    // is not being sent in gather mode
+    flow->is_gathered = 0;
+    
     DebugObject_Init(&flow->d_obj);
     DebugCounter_Increment(&m->d_ctr);
 }
@@ -325,6 +540,7 @@ void PacketPassFairQueueFlow_Free (PacketPassFairQueueFlow *flow)
     PacketPassFairQueue *m = flow->m;
     
     ASSERT(m->freeing || flow != m->sending_flow)
+    ASSERT(m->freeing || !flow->is_gathered)
     DebugCounter_Decrement(&m->d_ctr);
     DebugObject_Free(&flow->d_obj);
     
@@ -341,6 +557,7 @@ void PacketPassFairQueueFlow_Free (PacketPassFairQueueFlow *flow)
     // remove from queue
     if (flow->is_queued) {
         PacketPassFairQueue__Tree_Remove(&m->queued_tree, 0, flow);
+        BMetric_Sub(&metric_queued, 1);
     }
     
     // remove from flows list
@@ -356,6 +573,7 @@ void PacketPassFairQueueFlow_AssertFree (PacketPassFairQueueFlow *flow)
     B_USE(m)
     
     ASSERT(m->freeing || flow != m->sending_flow)
+    ASSERT(m->freeing || !flow->is_gathered)
     DebugObject_Access(&flow->d_obj);
 }
 
@@ -366,7 +584,7 @@ int PacketPassFairQueueFlow_IsBusy (PacketPassFairQueueFlow *flow)
     ASSERT(!m->freeing)
     DebugObject_Access(&flow->d_obj);
     
-    return (flow == m->sending_flow);
+    return (flow == m->sending_flow || flow->is_gathered);
 }
 
 void PacketPassFairQueueFlow_RequestCancel (PacketPassFairQueueFlow *flow)
@@ -388,7 +606,7 @@ void PacketPassFairQueueFlow_SetBusyHandler (PacketPassFairQueueFlow *flow, Pack
     PacketPassFairQueue *m = flow->m;
     B_USE(m)
     
-    ASSERT(flow == m->sending_flow)
+    ASSERT(flow == m->sending_flow || flow->is_gathered)
     ASSERT(!m->freeing)
     DebugObject_Access(&flow->d_obj);
     
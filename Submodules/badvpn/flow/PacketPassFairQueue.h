@@ -29,6 +29,11 @@
  * @section DESCRIPTION
  * 
  * Fair queue using {@link PacketPassInterface}.
+ * 
+ * In gather mode (see {@link PacketPassFairQueue_InitGather}), the queue writes
+ * packets to a {@link StreamPassInterface} itself, taking the place of a
+ * {@link PacketStreamSender}, and passes the queued packets of a number of flows
+ * to the output with one vectored send, without copying.
  */
 
 #ifndef BADVPN_FLOW_PACKETPASSFAIRQUEUE_H
@@ -43,6 +48,7 @@
 #include <base/DebugObject.h>
 #include <base/BPending.h>
 #include <flow/PacketPassInterface.h>
+#include <flow/StreamPassInterface.h>
 
 // reduce this to test time overflow handling
 #define FAIRQUEUE_MAX_TIME UINT64_MAX
@@ -62,6 +68,7 @@ typedef struct PacketPassFairQueueFlow_s {
     uint64_t time;
     LinkedList1Node list_node;
     int is_queued;
+    int is_gathered;
     struct {
         PacketPassFairQueue__TreeNode tree_node;
         uint8_t *data;
@@ -85,6 +92,14 @@ typedef struct PacketPassFairQueue_s {
     LinkedList1 flows_list;
     int freeing;
     BPending schedule_job;
+    StreamPassInterface *gather_output;
+    int gather_mtu;
+    int gather_max;
+    struct PacketPassFairQueueFlow_s **gather_flows;
+    StreamPassInterface_segment *gather_segs;
+    int gather_num;
+    int gather_first;
+    int gather_sent;
     DebugObject d_obj;
     DebugCounter d_ctr;
 } PacketPassFairQueue;
@@ -103,6 +118,28 @@ typedef struct PacketPassFairQueue_s {
  */
 int PacketPassFairQueue_Init (PacketPassFairQueue *m, PacketPassInterface *output, BPendingGroup *pg, int use_cancel, int packet_weight) WARN_UNUSED;
 
+/**
+ * Initializes the queue in gather mode.
+ * The queue sends packets to a stream, as {@link PacketStreamSender} would.
+ * When the output is free, the packets of up to max_packets queued flows
+ * are taken, in the order they would be sent one by one, and passed to
+ * the output with {@link StreamPassInterface_Sender_Sendv}. Flows are
+ * finished one by one as their packets have been sent completely, so
+ * several flows may be busy at once.
+ * Cancel functionality is not available in gather mode.
+ *
+ * @param m the object
+ * @param output output interface. If it doesn't support sending from multiple buffers,
+ *               packets are sent one at a time.
+ * @param mtu maximum packet size. Must be >=0.
+ * @param max_packets maximum number of packets in a single send. Must be >0.
+ * @param pg pending group
+ * @param packet_weight additional weight a packet bears. Must be >0, to keep
+ *                      the queue fair for zero size packets.
+ * @return 1 on success, 0 on failure (because MTU is too large or out of memory)
+ */
+int PacketPassFairQueue_InitGather (PacketPassFairQueue *m, StreamPassInterface *output, int mtu, int max_packets, BPendingGroup *pg, int packet_weight) WARN_UNUSED;
+
 /**
  * Frees the queue.
  * All flows must have been freed.
@@ -160,7 +197,8 @@ void PacketPassFairQueueFlow_AssertFree (PacketPassFairQueueFlow *flow);
 
 /**
  * Determines if the flow is busy. If the flow is considered busy, it must not
- * be freed. At any given time, at most one flow will be indicated as busy.
+ * be freed. At any given time, at most one flow will be indicated as busy,
+ * except in gather mode, where all flows in the current send are busy.
  * Queue must not be in freeing state.
  * Must not be called from queue calls to output.
  *
@@ -40,8 +40,13 @@
 #include <generated/blog_channel_PacketProtoDecoder.h>
 
 static void process_data (PacketProtoDecoder *enc);
+static int ring_pos (PacketProtoDecoder *enc, int offset);
+static void ring_start_recv (PacketProtoDecoder *enc);
+static int ring_read_header (PacketProtoDecoder *enc);
+static void ring_process_data (PacketProtoDecoder *enc);
 static void input_handler_done (PacketProtoDecoder *enc, int data_len);
 static void output_handler_done (PacketProtoDecoder *enc);
+static int init_common (PacketProtoDecoder *enc, StreamRecvInterface *input, PacketPassInterface *output, int ring, int buf_size, void *user, PacketProtoDecoder_handler_error handler_error);
 
 void process_data (PacketProtoDecoder *enc)
 {
@@ -104,12 +109,145 @@ void process_data (PacketProtoDecoder *enc)
     }
 }
 
+static int ring_pos (PacketProtoDecoder *enc, int offset)
+{
+    ASSERT(offset >= 0)
+    ASSERT(offset <= enc->buf_size)
+    
+    int pos = enc->buf_start + offset;
+    if (pos >= enc->buf_size) {
+        pos -= enc->buf_size;
+    }
+    
+    return pos;
+}
+
+static void ring_start_recv (PacketProtoDecoder *enc)
+{
+    ASSERT(enc->ring)
+    ASSERT(!enc->ring_recv_busy)
+    
+    int avail = enc->buf_size - enc->ring_held - enc->buf_used;
+    if (avail == 0) {
+        return;
+    }
+    
+    // receive into the free space, which may wrap around the end of the buffer
+    int pos = ring_pos(enc, enc->buf_used);
+    int len = bmin_int(avail, enc->buf_size - pos);
+    StreamRecvInterface_Receiver_Recv2(enc->input, enc->buf + pos, len, enc->buf, avail - len);
+    
+    enc->ring_recv_busy = 1;
+}
+
+static int ring_read_header (PacketProtoDecoder *enc)
+{
+    ASSERT(enc->ring)
+    ASSERT(enc->buf_used >= sizeof(struct packetproto_header))
+    
+    struct packetproto_header header;
+    
+    // the header may wrap around the end of the buffer
+    int first = enc->buf_size - enc->buf_start;
+    if (first >= sizeof(header)) {
+        memcpy(&header, enc->buf + enc->buf_start, sizeof(header));
+    } else {
+        memcpy(&header, enc->buf + enc->buf_start, first);
+        memcpy((uint8_t *)&header + first, enc->buf, sizeof(header) - first);
+    }
+    
+    return ltoh16(header.len);
+}
+
+void ring_process_data (PacketProtoDecoder *enc)
+{
+    ASSERT(enc->ring)
+    ASSERT(enc->ring_held == 0)
+    
+    int data_len;
+    
+    // check if header was received
+    if (enc->buf_used < sizeof(struct packetproto_header)) {
+        goto need_more;
+    }
+    data_len = ring_read_header(enc);
+    
+    // check data length
+    if (data_len > enc->output_mtu) {
+        BLog(BLOG_NOTICE, "error: packet too large");
+        
+        // drop buffered data; anything being received will start a new stream
+        enc->buf_start = ring_pos(enc, enc->buf_used);
+        enc->buf_used = 0;
+        
+        if (!enc->ring_recv_busy) {
+            ring_start_recv(enc);
+        }
+        
+        // report error
+        enc->handler_error(enc->user);
+        return;
+    }
+    
+    // check if whole packet was received
+    int packet_len = sizeof(struct packetproto_header) + data_len;
+    if (enc->buf_used < packet_len) {
+        goto need_more;
+    }
+    
+    // if the payload wraps around the end of the buffer, copy the wrapped part
+    // to the extra space after the end to make the payload contiguous
+    int data_pos = ring_pos(enc, sizeof(struct packetproto_header));
+    if (data_len > enc->buf_size - data_pos) {
+        memcpy(enc->buf + enc->buf_size, enc->buf, data_len - (enc->buf_size - data_pos));
+    }
+    
+    // update buffer, keeping the packet's space until the output is done with it
+    enc->buf_start = ring_pos(enc, packet_len);
+    enc->buf_used -= packet_len;
+    enc->ring_held = packet_len;
+    
+    // If this is the last complete packet, receive more data while it's being
+    // passed on. This isn't done earlier so that the receive gets all the space
+    // released by the preceding packets.
+    if (!enc->ring_recv_busy) {
+        int next_len = (enc->buf_used >= sizeof(struct packetproto_header) ? ring_read_header(enc) : -1);
+        if (next_len < 0 || (next_len <= enc->output_mtu && enc->buf_used < sizeof(struct packetproto_header) + next_len)) {
+            ring_start_recv(enc);
+        }
+    }
+    
+    // submit packet
+    PacketPassInterface_Sender_Send(enc->output, enc->buf + data_pos, data_len);
+    return;
+    
+need_more:
+    if (!enc->ring_recv_busy) {
+        ring_start_recv(enc);
+    }
+}
+
 static void input_handler_done (PacketProtoDecoder *enc, int data_len)
 {
     ASSERT(data_len > 0)
-    ASSERT(data_len <= enc->buf_size - (enc->buf_start + enc->buf_used))
+    ASSERT(enc->ring || data_len <= enc->buf_size - (enc->buf_start + enc->buf_used))
+    ASSERT(!enc->ring || enc->ring_recv_busy)
+    ASSERT(!enc->ring || data_len <= enc->buf_size - enc->ring_held - enc->buf_used)
     DebugObject_Access(&enc->d_obj);
     
+    if (enc->ring) {
+        // update buffer
+        enc->buf_used += data_len;
+        enc->ring_recv_busy = 0;
+        
+        // process data, unless a packet is being passed on; in that case
+        // we continue when it's done
+        if (enc->ring_held == 0) {
+            ring_process_data(enc);
+        }
+        return;
+    }
+    
     // update buffer
     enc->buf_used += data_len;
     
@@ -122,12 +260,29 @@ void output_handler_done (PacketProtoDecoder *enc)
 {
     DebugObject_Access(&enc->d_obj);
     
+    if (enc->ring) {
+        ASSERT(enc->ring_held > 0)
+        
+        // release the packet's space
+        enc->ring_held = 0;
+        
+        // with nothing buffered, start from the beginning so that
+        // the following packets don't wrap around
+        if (!enc->ring_recv_busy && enc->buf_used == 0) {
+            enc->buf_start = 0;
+        }
+        
+        // process next packet
+        ring_process_data(enc);
+        return;
+    }
+    
     // process data
     process_data(enc);
     return;
 }
 
-int PacketProtoDecoder_Init (PacketProtoDecoder *enc, StreamRecvInterface *input, PacketPassInterface *output, BPendingGroup *pg, void *user, PacketProtoDecoder_handler_error handler_error)
+int init_common (PacketProtoDecoder *enc, StreamRecvInterface *input, PacketPassInterface *output, int ring, int buf_size, void *user, PacketProtoDecoder_handler_error handler_error)
 {
     // init arguments
     enc->input = input;
@@ -145,17 +300,25 @@ int PacketProtoDecoder_Init (PacketProtoDecoder *enc, StreamRecvInterface *input
     enc->output_mtu = bmin_int(PacketPassInterface_GetMTU(enc->output), PACKETPROTO_MAXPAYLOAD);
     
     // init buffer state
-    enc->buf_size = PACKETPROTO_ENCLEN(enc->output_mtu);
+    enc->buf_size = bmax_int(buf_size, PACKETPROTO_ENCLEN(enc->output_mtu));
     enc->buf_start = 0;
     enc->buf_used = 0;
+    enc->ring = ring;
+    enc->ring_held = 0;
+    enc->ring_recv_busy = 0;
     
-    // allocate buffer
-    if (!(enc->buf = (uint8_t *)malloc(enc->buf_size))) {
+    // allocate buffer; in ring mode, with extra space after the end
+    // for the wrapped part of a packet
+    if (!(enc->buf = (uint8_t *)malloc(enc->buf_size + (ring ? enc->output_mtu : 0)))) {
         goto fail0;
     }
     
     // start receiving
-    StreamRecvInterface_Receiver_Recv(enc->input, enc->buf, enc->buf_size);
+    if (ring) {
+        ring_start_recv(enc);
+    } else {
+        StreamRecvInterface_Receiver_Recv(enc->input, enc->buf, enc->buf_size);
+    }
     
     DebugObject_Init(&enc->d_obj);
     
@@ -165,6 +328,16 @@ fail0:
     return 0;
 }
 
+int PacketProtoDecoder_Init (PacketProtoDecoder *enc, StreamRecvInterface *input, PacketPassInterface *output, BPendingGroup *pg, void *user, PacketProtoDecoder_handler_error handler_error)
+{
+    return init_common(enc, input, output, 0, 0, user, handler_error);
+}
+
+int PacketProtoDecoder_InitRing (PacketProtoDecoder *enc, StreamRecvInterface *input, PacketPassInterface *output, BPendingGroup *pg, int buf_size, void *user, PacketProtoDecoder_handler_error handler_error)
+{
+    return init_common(enc, input, output, 1, buf_size, user, handler_error);
+}
+
 void PacketProtoDecoder_Free (PacketProtoDecoder *enc)
 {
     DebugObject_Free(&enc->d_obj);
@@ -177,6 +350,12 @@ void PacketProtoDecoder_Reset (PacketProtoDecoder *enc)
 {
     DebugObject_Access(&enc->d_obj);
     
+    if (enc->ring) {
+        enc->buf_start = ring_pos(enc, enc->buf_used);
+        enc->buf_used = 0;
+        return;
+    }
+    
     enc->buf_start += enc->buf_used;
     enc->buf_used = 0;
 }
@@ -29,6 +29,14 @@
  * @section DESCRIPTION
  * 
  * Object which decodes a stream according to PacketProto.
+ * 
+ * In ring mode (see {@link PacketProtoDecoder_InitRing}), the buffer is used
+ * circularly. Input is received into all free space at once (both segments,
+ * if the free space wraps around and the input supports it), and a receive
+ * is kept outstanding while decoded packets are being passed to the output,
+ * so that all packets from one read go out back to back. Packets are never
+ * moved within the buffer; only the part of a packet's payload which wraps
+ * around the end of the buffer is copied, to make it contiguous.
  */
 
 #ifndef BADVPN_FLOW_PACKETPROTODECODER_H
@@ -60,6 +68,9 @@ typedef struct {
     int buf_start;
     int buf_used;
     uint8_t *buf;
+    int ring;
+    int ring_held;
+    int ring_recv_busy;
     DebugObject d_obj;
 } PacketProtoDecoder;
 
@@ -77,6 +88,23 @@ typedef struct {
  */
 int PacketProtoDecoder_Init (PacketProtoDecoder *enc, StreamRecvInterface *input, PacketPassInterface *output, BPendingGroup *pg, void *user, PacketProtoDecoder_handler_error handler_error) WARN_UNUSED;
 
+/**
+ * Initializes the object in ring mode.
+ * Like {@link PacketProtoDecoder_Init}, but with a circular buffer of the given size.
+ *
+ * @param enc the object
+ * @param input input interface. The decoder will accept packets with payload size up to its MTU
+ *              (but the payload can never be more than PACKETPROTO_MAXPAYLOAD).
+ * @param output output interface
+ * @param pg pending group
+ * @param buf_size size of the circular buffer. If it is less than the encoded size of a packet
+ *                 of maximum size, that size is used instead.
+ * @param user argument to handlers
+ * @param handler_error error handler
+ * @return 1 on success, 0 on failure
+ */
+int PacketProtoDecoder_InitRing (PacketProtoDecoder *enc, StreamRecvInterface *input, PacketPassInterface *output, BPendingGroup *pg, int buf_size, void *user, PacketProtoDecoder_handler_error handler_error) WARN_UNUSED;
+
 /**
  * Frees the object.
  *
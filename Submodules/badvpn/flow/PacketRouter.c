@@ -48,6 +48,9 @@ static void next_job_handler (PacketRouter *o)
 {
     DebugObject_Access(&o->d_obj);
     
+    // routing is finished; buffers are done with the packet or hold on to it
+    RouteBufferSource_Finish(&o->rbs);
+    
     // receive
     PacketRecvInterface_Receiver_Recv(o->input, RouteBufferSource_Pointer(&o->rbs) + o->recv_offset);
 }
@@ -70,7 +73,7 @@ int PacketRouter_Init (PacketRouter *o, int mtu, int recv_offset, PacketRecvInte
     PacketRecvInterface_Receiver_Init(o->input, (PacketRecvInterface_handler_done)input_handler_done, o);
     
     // init RouteBufferSource
-    if (!RouteBufferSource_Init(&o->rbs, mtu)) {
+    if (!RouteBufferSource_Init(&o->rbs, mtu, recv_offset)) {
         goto fail0;
     }
     
@@ -99,27 +102,14 @@ void PacketRouter_Free (PacketRouter *o)
     RouteBufferSource_Free(&o->rbs);
 }
 
-int PacketRouter_Route (PacketRouter *o, int len, RouteBuffer *output, uint8_t **next_buf, int copy_offset, int copy_len)
+int PacketRouter_Route (PacketRouter *o, int len, RouteBuffer *output, const uint8_t *header)
 {
-    ASSERT(len >= 0)
+    ASSERT(len >= o->recv_offset)
     ASSERT(len <= o->mtu)
-    ASSERT(RouteBuffer_GetMTU(output) == o->mtu)
-    ASSERT(copy_offset >= 0)
-    ASSERT(copy_offset <= o->mtu)
-    ASSERT(copy_len >= 0)
-    ASSERT(copy_len <= o->mtu - copy_offset)
     ASSERT(BPending_IsSet(&o->next_job))
     DebugObject_Access(&o->d_obj);
     
-    if (!RouteBufferSource_Route(&o->rbs, len, output, copy_offset, copy_len)) {
-        return 0;
-    }
-    
-    if (next_buf) {
-        *next_buf = RouteBufferSource_Pointer(&o->rbs);
-    }
-    
-    return 1;
+    return RouteBufferSource_Route(&o->rbs, len, output, header);
 }
 
 void PacketRouter_AssertRoute (PacketRouter *o)
@@ -127,3 +117,10 @@ void PacketRouter_AssertRoute (PacketRouter *o)
     ASSERT(BPending_IsSet(&o->next_job))
     DebugObject_Access(&o->d_obj);
 }
+
+RouteBufferSource * PacketRouter_GetSource (PacketRouter *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return &o->rbs;
+}
@@ -45,9 +45,9 @@
  * to one or more buffers using {@link PacketRouter_Route}.
  * 
  * @param user as in {@link PacketRouter_Init}
- * @param buf the buffer for the packet. May be modified by the user.
- *            Will have space for mtu bytes. Only valid in the job context of
- *            this handler, until {@link PacketRouter_Route} is called successfully.
+ * @param buf the buffer for the packet. Will have space for mtu bytes. The data after
+ *            the first recv_offset bytes may be modified by the user until the packet is
+ *            first routed. Only valid in the job context of this handler.
  * @param recv_len length of the input packet (located at recv_offset bytes offset)
  */
 typedef void (*PacketRouter_handler) (void *user, uint8_t *buf, int recv_len);
@@ -57,7 +57,8 @@ typedef void (*PacketRouter_handler) (void *user, uint8_t *buf, int recv_len);
  * {@link PacketRecvInterface} input.
  * 
  * Packets are routed by calling {@link PacketRouter_Route} (possibly multiple times)
- * from the job context of the {@link PacketRouter_handler} handler.
+ * from the job context of the {@link PacketRouter_handler} handler. A packet routed
+ * to multiple buffers is stored only once (see {@link RouteBufferSource}).
  */
 typedef struct {
     int mtu;
@@ -77,8 +78,8 @@ typedef struct {
  * @param mtu maximum packet size. Must be >=0. It will only be possible to route packets to
  *            {@link RouteBuffer}'s with the same MTU.
  * @param recv_offset offset from the beginning for receiving input packets.
- *                    Must be >=0 and <=mtu. The leading space should be initialized
- *                    by the user before routing a packet.
+ *                    Must be >=0 and <=mtu. The leading space is filled with the header
+ *                    given to {@link PacketRouter_Route} for each buffer.
  * @param input input interface. Its MTU must be <= mtu - recv_offset.
  * @param handler handler called when a packet is received to allow the user to route it
  * @param user value passed to handler
@@ -97,24 +98,18 @@ void PacketRouter_Free (PacketRouter *o);
 /**
  * Routes the current packet to the given buffer.
  * Must be called from the job context of the {@link PacketRouter_handler} handler.
- * On success, copies part of the current packet to next one (regardless if next_buf
- * is provided or not; if not, copies before receiving another packet).
+ * The packet is not copied; it can be routed to more buffers.
  * 
  * @param o the object
  * @param len total packet length (e.g. recv_offset + (recv_len from handler)).
- *            Must be >=0 and <=mtu.
- * @param output buffer to route to. Its MTU must be the same as of this object.
- * @param next_buf if not NULL, on success, will be set to the address of a new current
- *                 packet that can be routed. The pointer will be valid in the job context of
- *                 the calling handler, until this function is called successfully again
- *                 (as for the original pointer provided by the handler).
- * @param copy_offset Offset from the beginning for copying to the next packet.
- *                    Must be >=0 and <=mtu.
- * @param copy_len Number of bytes to copy from the old current
- *                 packet to the next one. Must be >=0 and <= mtu - copy_offset.
+ *            Must be >=recv_offset and <=mtu, and the same for all buffers.
+ * @param output buffer to route to. Must have been initialized with the source
+ *               returned by {@link PacketRouter_GetSource}.
+ * @param header header to send in front of the packet from this buffer,
+ *               recv_offset bytes. Copied.
  * @return 1 on success, 0 on failure (buffer full)
  */
-int PacketRouter_Route (PacketRouter *o, int len, RouteBuffer *output, uint8_t **next_buf, int copy_offset, int copy_len);
+int PacketRouter_Route (PacketRouter *o, int len, RouteBuffer *output, const uint8_t *header);
 
 /**
  * Asserts that {@link PacketRouter_Route} can be called.
@@ -123,4 +118,13 @@ int PacketRouter_Route (PacketRouter *o, int len, RouteBuffer *output, uint8_t *
  */
 void PacketRouter_AssertRoute (PacketRouter *o);
 
+/**
+ * Returns the source which {@link RouteBuffer}'s that packets are routed to
+ * must be initialized with.
+ * 
+ * @param o the object
+ * @return source
+ */
+RouteBufferSource * PacketRouter_GetSource (PacketRouter *o);
+
 #endif
@@ -30,11 +30,34 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include <misc/offset.h>
+#include <misc/balign.h>
+#include <misc/balloc.h>
 
 #include <flow/RouteBuffer.h>
 
+#define STATE_IDLE 1
+#define STATE_WAITING 2
+#define STATE_SENDING 3
+
+struct RouteBuffer_entry {
+    LinkedList1Node node; // node in RouteBuffer.entries_free or RouteBuffer.entries_used
+    struct RouteBuffer_packet *p;
+    // followed by the header
+};
+
+static uint8_t * packet_data (struct RouteBuffer_packet *p)
+{
+    return (uint8_t *)(p + 1);
+}
+
+static uint8_t * entry_header (struct RouteBuffer_entry *e)
+{
+    return (uint8_t *)(e + 1);
+}
+
 static struct RouteBuffer_packet * alloc_packet (int mtu)
 {
     if (mtu > SIZE_MAX - sizeof(struct RouteBuffer_packet)) {
@@ -50,104 +73,292 @@ static struct RouteBuffer_packet * alloc_packet (int mtu)
     return p;
 }
 
-static int alloc_free_packet (RouteBuffer *o)
+static void init_packet (struct RouteBuffer_packet *p)
 {
-    struct RouteBuffer_packet *p = alloc_packet(o->mtu);
-    if (!p) {
+    p->refcnt = 0;
+    p->sending = NULL;
+    LinkedList1_Init(&p->waiters);
+}
+
+static void source_unreserve (RouteBufferSource *o, int num)
+{
+    ASSERT(num >= 0)
+    ASSERT(num <= o->max_packets - 1)
+    
+    o->max_packets -= num;
+    
+    // free excess packets; packets in use are freed when released
+    while (o->num_packets > o->max_packets && !LinkedList1_IsEmpty(&o->packets_free)) {
+        struct RouteBuffer_packet *p = UPPER_OBJECT(LinkedList1_GetLast(&o->packets_free), struct RouteBuffer_packet, node);
+        LinkedList1_Remove(&o->packets_free, &p->node);
+        free(p);
+        o->num_packets--;
+    }
+}
+
+static int source_reserve (RouteBufferSource *o, int num)
+{
+    ASSERT(num >= 0)
+    
+    if (num > INT_MAX - o->max_packets) {
         return 0;
     }
     
-    // add to free packets list
-    LinkedList1_Append(&o->packets_free, &p->node);
+    o->max_packets += num;
+    
+    // allocate packets
+    while (o->num_packets < o->max_packets) {
+        struct RouteBuffer_packet *p = alloc_packet(o->mtu);
+        if (!p) {
+            source_unreserve(o, num);
+            return 0;
+        }
+        LinkedList1_Append(&o->packets_free, &p->node);
+        o->num_packets++;
+    }
     
     return 1;
 }
 
-static void free_free_packets (RouteBuffer *o)
+static struct RouteBuffer_packet * source_take_packet (RouteBufferSource *o)
 {
-    while (!LinkedList1_IsEmpty(&o->packets_free)) {
-        // get packet
-        struct RouteBuffer_packet *p = UPPER_OBJECT(LinkedList1_GetLast(&o->packets_free), struct RouteBuffer_packet, node);
-        
-        // remove from free packets list
-        LinkedList1_Remove(&o->packets_free, &p->node);
-        
-        // free memory
-        free(p);
+    // There is always a free packet. Each entry references at most one packet, plus
+    // there is the current packet, and we only need a new packet when the current
+    // packet is referenced, or when copying a packet referenced by two entries.
+    ASSERT(!LinkedList1_IsEmpty(&o->packets_free))
+    
+    struct RouteBuffer_packet *p = UPPER_OBJECT(LinkedList1_GetFirst(&o->packets_free), struct RouteBuffer_packet, node);
+    LinkedList1_Remove(&o->packets_free, &p->node);
+    init_packet(p);
+    
+    return p;
+}
+
+static void remove_waiter (RouteBuffer *o, struct RouteBuffer_packet *p)
+{
+    ASSERT(o->state == STATE_WAITING)
+    ASSERT(o->source)
+    
+    LinkedList1_Remove(&p->waiters, &o->waiting_node);
+    if (LinkedList1_IsEmpty(&p->waiters)) {
+        LinkedList1_Remove(&o->source->packets_waited, &p->node);
     }
+    
+    o->state = STATE_IDLE;
 }
 
-static void release_used_packet (RouteBuffer *o)
+static void release_packet (RouteBuffer *o, struct RouteBuffer_packet *p)
 {
-    ASSERT(!LinkedList1_IsEmpty(&o->packets_used))
+    ASSERT(p->refcnt > 0)
+    
+    if (--p->refcnt > 0) {
+        return;
+    }
+    
+    ASSERT(!p->sending)
+    ASSERT(LinkedList1_IsEmpty(&p->waiters))
+    
+    // source is gone, nobody else will use the packet
+    if (!o->source) {
+        free(p);
+        return;
+    }
+    
+    RouteBufferSource *source = o->source;
     
-    // get packet
-    struct RouteBuffer_packet *p = UPPER_OBJECT(LinkedList1_GetFirst(&o->packets_used), struct RouteBuffer_packet, node);
+    // the current packet stays with the source
+    if (p == source->current_packet) {
+        return;
+    }
     
-    // remove from used packets list
-    LinkedList1_Remove(&o->packets_used, &p->node);
+    // free excess packet
+    if (source->num_packets > source->max_packets) {
+        free(p);
+        source->num_packets--;
+        return;
+    }
     
-    // add to free packets list
-    LinkedList1_Append(&o->packets_free, &p->node);
+    // return to pool
+    LinkedList1_Append(&source->packets_free, &p->node);
 }
 
-static void send_used_packet (RouteBuffer *o)
+static void send_directly (RouteBuffer *o)
 {
-    ASSERT(!LinkedList1_IsEmpty(&o->packets_used))
+    ASSERT(o->state == STATE_IDLE)
+    ASSERT(!LinkedList1_IsEmpty(&o->entries_used))
+    
+    struct RouteBuffer_entry *e = UPPER_OBJECT(LinkedList1_GetFirst(&o->entries_used), struct RouteBuffer_entry, node);
+    struct RouteBuffer_packet *p = e->p;
+    ASSERT(!p->sending)
     
-    // get packet
-    struct RouteBuffer_packet *p = UPPER_OBJECT(LinkedList1_GetFirst(&o->packets_used), struct RouteBuffer_packet, node);
+    // write our header in front of the data
+    memcpy(packet_data(p), entry_header(e), o->header_len);
+    p->sending = e;
     
     // send
-    PacketPassInterface_Sender_Send(o->output, (uint8_t *)(p + 1), p->len);
+    o->state = STATE_SENDING;
+    PacketPassInterface_Sender_Send(o->output, packet_data(p), p->len);
+}
+
+static void release_entry (RouteBuffer *o, struct RouteBuffer_entry *e)
+{
+    struct RouteBuffer_packet *p = e->p;
+    
+    // move entry to free list
+    LinkedList1_Remove(&o->entries_used, &e->node);
+    LinkedList1_Append(&o->entries_free, &e->node);
+    
+    if (p->sending == e) {
+        p->sending = NULL;
+        
+        // let a waiting buffer send directly from the packet
+        if (!LinkedList1_IsEmpty(&p->waiters)) {
+            RouteBuffer *w = UPPER_OBJECT(LinkedList1_GetFirst(&p->waiters), RouteBuffer, waiting_node);
+            remove_waiter(w, p);
+            send_directly(w);
+        }
+    }
+    
+    // release packet
+    release_packet(o, p);
+}
+
+static void start_sending (RouteBuffer *o)
+{
+    ASSERT(o->state == STATE_IDLE)
+    
+    while (!LinkedList1_IsEmpty(&o->entries_used)) {
+        struct RouteBuffer_entry *e = UPPER_OBJECT(LinkedList1_GetFirst(&o->entries_used), struct RouteBuffer_entry, node);
+        struct RouteBuffer_packet *p = e->p;
+        
+        // send directly if no other buffer is
+        if (!p->sending) {
+            send_directly(o);
+            return;
+        }
+        
+        // While the packet is being routed, the other buffer is likely to finish soon;
+        // wait for it, so that we don't have to copy.
+        if (o->source && o->source->routing) {
+            if (LinkedList1_IsEmpty(&p->waiters)) {
+                LinkedList1_Append(&o->source->packets_waited, &p->node);
+            }
+            LinkedList1_Append(&p->waiters, &o->waiting_node);
+            o->state = STATE_WAITING;
+            return;
+        }
+        
+        // get a packet for a private copy
+        struct RouteBuffer_packet *np;
+        if (o->source) {
+            np = source_take_packet(o->source);
+        } else {
+            if (!(np = alloc_packet(o->mtu))) {
+                // can't copy, drop packet
+                release_entry(o, e);
+                continue;
+            }
+            init_packet(np);
+        }
+        
+        // copy data
+        memcpy(packet_data(np) + o->header_len, packet_data(p) + o->header_len, p->len - o->header_len);
+        np->len = p->len;
+        np->refcnt = 1;
+        
+        // replace packet in entry
+        e->p = np;
+        release_packet(o, p);
+        
+        send_directly(o);
+        return;
+    }
 }
 
 static void output_handler_done (RouteBuffer *o)
 {
-    ASSERT(!LinkedList1_IsEmpty(&o->packets_used))
+    ASSERT(o->state == STATE_SENDING)
+    ASSERT(!LinkedList1_IsEmpty(&o->entries_used))
     DebugObject_Access(&o->d_obj);
     
-    // release packet
-    release_used_packet(o);
+    struct RouteBuffer_entry *e = UPPER_OBJECT(LinkedList1_GetFirst(&o->entries_used), struct RouteBuffer_entry, node);
+    ASSERT(e->p->sending == e)
+    
+    o->state = STATE_IDLE;
+    
+    // release entry
+    release_entry(o, e);
     
     // send next packet if there is one
-    if (!LinkedList1_IsEmpty(&o->packets_used)) {
-        send_used_packet(o);
+    start_sending(o);
+}
+
+static void flush_waiters (RouteBufferSource *o)
+{
+    ASSERT(!o->routing)
+    
+    while (!LinkedList1_IsEmpty(&o->packets_waited)) {
+        struct RouteBuffer_packet *p = UPPER_OBJECT(LinkedList1_GetFirst(&o->packets_waited), struct RouteBuffer_packet, node);
+        ASSERT(!LinkedList1_IsEmpty(&p->waiters))
+        
+        RouteBuffer *w = UPPER_OBJECT(LinkedList1_GetFirst(&p->waiters), RouteBuffer, waiting_node);
+        remove_waiter(w, p);
+        
+        // will send a copy since we're not routing
+        start_sending(w);
     }
 }
 
-int RouteBuffer_Init (RouteBuffer *o, int mtu, PacketPassInterface *output, int buf_size)
+int RouteBuffer_Init (RouteBuffer *o, RouteBufferSource *source, PacketPassInterface *output, int buf_size)
 {
-    ASSERT(mtu >= 0)
-    ASSERT(PacketPassInterface_GetMTU(output) >= mtu)
+    DebugObject_Access(&source->d_obj);
+    ASSERT(PacketPassInterface_GetMTU(output) >= source->mtu)
     ASSERT(buf_size > 0)
     
     // init arguments
-    o->mtu = mtu;
+    o->source = source;
     o->output = output;
+    o->buf_size = buf_size;
+    
+    // remember MTU and header length in case the source goes away
+    o->mtu = source->mtu;
+    o->header_len = source->header_len;
     
     // init output
     PacketPassInterface_Sender_Init(o->output, (PacketPassInterface_handler_done)output_handler_done, o);
     
-    // init free packets list
-    LinkedList1_Init(&o->packets_free);
-    
-    // init used packets list
-    LinkedList1_Init(&o->packets_used);
+    // allocate entries
+    o->entry_size = balign_up(sizeof(struct RouteBuffer_entry) + o->header_len, sizeof(void *));
+    if (!(o->entries = (uint8_t *)BAllocArray(buf_size, o->entry_size))) {
+        goto fail0;
+    }
     
-    // allocate packets
+    // init entry lists
+    LinkedList1_Init(&o->entries_free);
+    LinkedList1_Init(&o->entries_used);
     for (int i = 0; i < buf_size; i++) {
-        if (!alloc_free_packet(o)) {
-            goto fail1;
-        }
+        struct RouteBuffer_entry *e = (struct RouteBuffer_entry *)(o->entries + (size_t)i * o->entry_size);
+        LinkedList1_Append(&o->entries_free, &e->node);
     }
     
+    // reserve packets in source
+    if (!source_reserve(source, buf_size)) {
+        goto fail1;
+    }
+    
+    // insert to source's buffers list
+    LinkedList1_Append(&source->buffers, &o->list_node);
+    
+    // set not sending
+    o->state = STATE_IDLE;
+    
     DebugObject_Init(&o->d_obj);
     
     return 1;
     
 fail1:
-    free_free_packets(o);
+    BFree(o->entries);
+fail0:
     return 0;
 }
 
@@ -155,33 +366,56 @@ void RouteBuffer_Free (RouteBuffer *o)
 {
     DebugObject_Free(&o->d_obj);
     
-    // release packets so they can be freed
-    while (!LinkedList1_IsEmpty(&o->packets_used)) {
-        release_used_packet(o);
+    // stop waiting
+    if (o->state == STATE_WAITING) {
+        struct RouteBuffer_entry *e = UPPER_OBJECT(LinkedList1_GetFirst(&o->entries_used), struct RouteBuffer_entry, node);
+        remove_waiter(o, e->p);
     }
     
-    // free packets
-    free_free_packets(o);
-}
-
-int RouteBuffer_GetMTU (RouteBuffer *o)
-{
-    DebugObject_Access(&o->d_obj);
+    // release entries
+    while (!LinkedList1_IsEmpty(&o->entries_used)) {
+        release_entry(o, UPPER_OBJECT(LinkedList1_GetFirst(&o->entries_used), struct RouteBuffer_entry, node));
+    }
+    
+    if (o->source) {
+        // remove from source's buffers list
+        LinkedList1_Remove(&o->source->buffers, &o->list_node);
+        
+        // release reserved packets
+        source_unreserve(o->source, o->buf_size);
+    }
     
-    return o->mtu;
+    // free entries
+    BFree(o->entries);
 }
 
-int RouteBufferSource_Init (RouteBufferSource *o, int mtu)
+int RouteBufferSource_Init (RouteBufferSource *o, int mtu, int header_len)
 {
     ASSERT(mtu >= 0)
+    ASSERT(header_len >= 0)
+    ASSERT(header_len <= mtu)
     
     // init arguments
     o->mtu = mtu;
+    o->header_len = header_len;
     
     // allocate current packet
     if (!(o->current_packet = alloc_packet(o->mtu))) {
         goto fail0;
     }
+    init_packet(o->current_packet);
+    
+    // have only the current packet
+    o->num_packets = 1;
+    o->max_packets = 1;
+    
+    // init lists
+    LinkedList1_Init(&o->packets_free);
+    LinkedList1_Init(&o->packets_waited);
+    LinkedList1_Init(&o->buffers);
+    
+    // not routing
+    o->routing = 0;
     
     DebugObject_Init(&o->d_obj);
     
@@ -195,62 +429,89 @@ void RouteBufferSource_Free (RouteBufferSource *o)
 {
     DebugObject_Free(&o->d_obj);
     
-    // free current packet
-    free(o->current_packet);
+    // buffers waiting for packets send copies
+    o->routing = 0;
+    flush_waiters(o);
+    
+    // detach buffers; they free their packets themselves from now on
+    while (!LinkedList1_IsEmpty(&o->buffers)) {
+        RouteBuffer *b = UPPER_OBJECT(LinkedList1_GetFirst(&o->buffers), RouteBuffer, list_node);
+        LinkedList1_Remove(&o->buffers, &b->list_node);
+        b->source = NULL;
+    }
+    
+    // free current packet, unless buffers still reference it
+    if (o->current_packet->refcnt == 0) {
+        free(o->current_packet);
+    }
+    
+    // free free packets
+    while (!LinkedList1_IsEmpty(&o->packets_free)) {
+        struct RouteBuffer_packet *p = UPPER_OBJECT(LinkedList1_GetFirst(&o->packets_free), struct RouteBuffer_packet, node);
+        LinkedList1_Remove(&o->packets_free, &p->node);
+        free(p);
+    }
 }
 
 uint8_t * RouteBufferSource_Pointer (RouteBufferSource *o)
 {
     DebugObject_Access(&o->d_obj);
     
-    return (uint8_t *)(o->current_packet + 1);
+    return packet_data(o->current_packet);
 }
 
-int RouteBufferSource_Route (RouteBufferSource *o, int len, RouteBuffer *b, int copy_offset, int copy_len)
+int RouteBufferSource_Route (RouteBufferSource *o, int len, RouteBuffer *b, const uint8_t *header)
 {
-    ASSERT(len >= 0)
+    ASSERT(len >= o->header_len)
     ASSERT(len <= o->mtu)
-    ASSERT(b->mtu == o->mtu)
-    ASSERT(copy_offset >= 0)
-    ASSERT(copy_offset <= o->mtu)
-    ASSERT(copy_len >= 0)
-    ASSERT(copy_len <= o->mtu - copy_offset)
+    ASSERT(b->source == o)
+    ASSERT(!o->routing || o->current_packet->len == len)
     DebugObject_Access(&b->d_obj);
     DebugObject_Access(&o->d_obj);
     
     // check if there's space in the buffer
-    if (LinkedList1_IsEmpty(&b->packets_free)) {
+    if (LinkedList1_IsEmpty(&b->entries_free)) {
         return 0;
     }
     
-    int was_empty = LinkedList1_IsEmpty(&b->packets_used);
-    
     struct RouteBuffer_packet *p = o->current_packet;
     
     // set packet length
     p->len = len;
     
-    // append packet to used packets list
-    LinkedList1_Append(&b->packets_used, &p->node);
-    
-    // get a free packet
-    struct RouteBuffer_packet *np = UPPER_OBJECT(LinkedList1_GetLast(&b->packets_free), struct RouteBuffer_packet, node);
+    // we're routing the current packet
+    o->routing = 1;
     
-    // remove it from free packets list
-    LinkedList1_Remove(&b->packets_free, &np->node);
+    // get a free entry
+    struct RouteBuffer_entry *e = UPPER_OBJECT(LinkedList1_GetFirst(&b->entries_free), struct RouteBuffer_entry, node);
+    LinkedList1_Remove(&b->entries_free, &e->node);
     
-    // make it the current packet
-    o->current_packet = np;
+    // reference packet and remember header
+    e->p = p;
+    p->refcnt++;
+    memcpy(entry_header(e), header, o->header_len);
     
-    // copy packet
-    if (copy_len > 0) {
-        memcpy((uint8_t *)(np + 1) + copy_offset, (uint8_t *)(p + 1) + copy_offset, copy_len);
-    }
+    // append to used entries list
+    LinkedList1_Append(&b->entries_used, &e->node);
     
     // start sending if required
-    if (was_empty) {
-        send_used_packet(b);
+    if (b->state == STATE_IDLE && LinkedList1_GetFirst(&b->entries_used) == &e->node) {
+        start_sending(b);
     }
     
     return 1;
 }
+
+void RouteBufferSource_Finish (RouteBufferSource *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    // buffers still waiting for packets send copies
+    o->routing = 0;
+    flush_waiters(o);
+    
+    // the current packet can't be reused if buffers reference it
+    if (o->current_packet->refcnt > 0) {
+        o->current_packet = source_take_packet(o);
+    }
+}
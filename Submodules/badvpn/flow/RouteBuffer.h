@@ -34,77 +34,106 @@
 #ifndef BADVPN_FLOW_ROUTEBUFFER_H
 #define BADVPN_FLOW_ROUTEBUFFER_H
 
+#include <stdint.h>
+
 #include <misc/debug.h>
 #include <structure/LinkedList1.h>
 #include <base/DebugObject.h>
 #include <flow/PacketPassInterface.h>
 
+struct RouteBuffer_entry;
+
+/**
+ * Packet owned by a {@link RouteBufferSource}, shared by all {@link RouteBuffer}'s
+ * it was routed to.
+ */
 struct RouteBuffer_packet {
-    LinkedList1Node node;
+    LinkedList1Node node; // node in RouteBufferSource.packets_free or RouteBufferSource.packets_waited
+    int refcnt; // number of RouteBuffer entries referencing the packet
     int len;
+    struct RouteBuffer_entry *sending; // entry being sent directly from the packet, or NULL
+    LinkedList1 waiters; // RouteBuffer's waiting to send directly from the packet
 };
 
 /**
- * Packet buffer for zero-copy packet routing.
+ * Source of packets for {@link RouteBuffer}'s.
  * 
- * Packets are buffered using {@link RouteBufferSource} objects.
+ * A packet is received once and can be routed to any number of buffers without
+ * copying; each buffer only stores a reference to the packet and its own header.
+ * When a buffer sends the packet, it writes its header in front of the data and
+ * sends directly from the shared packet. Only one buffer can do that at a time;
+ * while the packet is still being routed, other buffers wait for it to be released,
+ * otherwise they send a private copy.
+ * 
+ * The source keeps a pool of packets large enough for the packets of all its buffers,
+ * so routing and copying never need to allocate memory.
  */
 typedef struct {
     int mtu;
-    PacketPassInterface *output;
+    int header_len;
+    int num_packets;
+    int max_packets;
     LinkedList1 packets_free;
-    LinkedList1 packets_used;
+    LinkedList1 packets_waited;
+    LinkedList1 buffers;
+    struct RouteBuffer_packet *current_packet;
+    int routing;
     DebugObject d_obj;
-} RouteBuffer;
+} RouteBufferSource;
 
 /**
- * Object through which packets are buffered into {@link RouteBuffer} objects.
+ * Packet buffer for zero-copy packet routing.
  * 
- * A packet is routed by calling {@link RouteBufferSource_Pointer}, writing it to
- * the returned address, then calling {@link RouteBufferSource_Route}.
+ * Packets are buffered using {@link RouteBufferSource} objects.
  */
 typedef struct {
+    RouteBufferSource *source;
+    PacketPassInterface *output;
+    int buf_size;
     int mtu;
-    struct RouteBuffer_packet *current_packet;
+    int header_len;
+    int entry_size;
+    uint8_t *entries;
+    LinkedList1 entries_free;
+    LinkedList1 entries_used;
+    int state;
+    LinkedList1Node list_node; // node in RouteBufferSource.buffers
+    LinkedList1Node waiting_node; // node in RouteBuffer_packet.waiters when waiting
     DebugObject d_obj;
-} RouteBufferSource;
+} RouteBuffer;
 
 /**
  * Initializes the object.
  * 
  * @param o the object
- * @param mtu maximum packet size. Must be >=0. It will only be possible to route packets to this buffer
- *            from {@link RouteBufferSource}.s with the same MTU.
- * @param output output interface. Its MTU must be >=mtu.
+ * @param source source the buffer will receive packets from. The buffer may outlive
+ *               the source.
+ * @param output output interface. Its MTU must be >= MTU of the source.
  * @param buf_size size of the buffer in number of packet. Must be >0.
  * @return 1 on success, 0 on failure
  */
-int RouteBuffer_Init (RouteBuffer *o, int mtu, PacketPassInterface *output, int buf_size) WARN_UNUSED;
+int RouteBuffer_Init (RouteBuffer *o, RouteBufferSource *source, PacketPassInterface *output, int buf_size) WARN_UNUSED;
 
 /**
  * Frees the object.
  */
 void RouteBuffer_Free (RouteBuffer *o);
 
-/**
- * Retuns the buffer's MTU (mtu argument to {@link RouteBuffer_Init}).
- * 
- * @return MTU
- */
-int RouteBuffer_GetMTU (RouteBuffer *o);
-
 /**
  * Initializes the object.
  * 
  * @param o the object
- * @param mtu maximum packet size. Must be >=0. The object will only be able to route packets
- *            to {@link RouteBuffer}'s with the same MTU.
+ * @param mtu maximum packet size. Must be >=0.
+ * @param header_len length of the per-buffer header at the beginning of packets.
+ *                   Must be >=0 and <=mtu.
  * @return 1 on success, 0 on failure
  */
-int RouteBufferSource_Init (RouteBufferSource *o, int mtu) WARN_UNUSED;
+int RouteBufferSource_Init (RouteBufferSource *o, int mtu, int header_len) WARN_UNUSED;
 
 /**
  * Frees the object.
+ * Any {@link RouteBuffer}'s still using the source will keep working, with
+ * their packets freed as they are sent.
  * 
  * @param o the object
  */
@@ -112,8 +141,9 @@ void RouteBufferSource_Free (RouteBufferSource *o);
 
 /**
  * Returns a pointer to the current packet.
- * The pointed to memory area will have space for MTU bytes.
- * The pointer is only valid until {@link RouteBufferSource_Route} succeeds.
+ * The pointed to memory area will have space for MTU bytes. The first header_len
+ * bytes are overwritten by buffers when sending, and must not be used.
+ * The pointer is only valid until {@link RouteBufferSource_Finish} is called.
  * 
  * @param o the object
  * @return pointer to the current packet
@@ -122,18 +152,26 @@ uint8_t * RouteBufferSource_Pointer (RouteBufferSource *o);
 
 /**
  * Routes the current packet to a given buffer.
- * On success, this invalidates the pointer previously returned from
- * {@link RouteBufferSource_Pointer}.
+ * The current packet remains the same and can be routed to more buffers.
+ * 
+ * @param o the object
+ * @param len length of the packet, including the header. Must be >=header_len and
+ *            <=MTU. Must be the same for all buffers the current packet is routed to.
+ * @param b buffer to route to. Must have been initialized with this source.
+ * @param header header for this buffer, header_len bytes. Copied.
+ * @return 1 on success, 0 on failure (buffer full)
+ */
+int RouteBufferSource_Route (RouteBufferSource *o, int len, RouteBuffer *b, const uint8_t *header);
+
+/**
+ * Finishes routing the current packet, making another packet the current packet
+ * if needed. Buffers which are still waiting to send the packet directly stop
+ * waiting and send copies instead.
+ * Must be called after the current packet has been routed, and before writing
+ * the next packet.
  * 
  * @param o the object
- * @param len length of the packet. Must be >=0 and <=MTU.
- * @param b buffer to route to. Its MTU must equal this object's MTU.
- * @param copy_offset Offset from the beginning for copying. Must be >=0 and
- *                    <=mtu.
- * @param copy_len Number of bytes to copy from the old current packet to the new one.
- *                 Must be >=0 and <= mtu - copy_offset.
- * @return 1 on success, 0 on failure
  */
-int RouteBufferSource_Route (RouteBufferSource *o, int len, RouteBuffer *b, int copy_offset, int copy_len);
+void RouteBufferSource_Finish (RouteBufferSource *o);
 
 #endif
@@ -34,6 +34,14 @@
  * {@link StreamRecvInterface} if names and its external semantics are disregarded.
  * If you modify this file, you should probably modify {@link StreamRecvInterface}
  * too.
+ * 
+ * A provider may additionally support sending from a list of buffers at once
+ * (see {@link StreamPassInterface_EnableSendv}), which lets senders pass a number
+ * of queued packets with one write. Unlike the two-buffer receive of
+ * {@link StreamRecvInterface}, the list may be of any length; the provider may
+ * choose to send only from some of the first buffers. If the provider doesn't
+ * support it, {@link StreamPassInterface_Sender_Sendv} sends from the first buffer
+ * only. Either way, the amount reported by Done covers the buffers in order.
  */
 
 #ifndef BADVPN_FLOW_STREAMPASSINTERFACE_H
@@ -41,6 +49,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <limits.h>
 
 #include <misc/debug.h>
 #include <base/DebugObject.h>
@@ -53,11 +62,19 @@
 
 typedef void (*StreamPassInterface_handler_send) (void *user, uint8_t *data, int data_len);
 
+typedef struct {
+    uint8_t *data;
+    int data_len;
+} StreamPassInterface_segment;
+
+typedef void (*StreamPassInterface_handler_sendv) (void *user, const StreamPassInterface_segment *segs, int num_segs);
+
 typedef void (*StreamPassInterface_handler_done) (void *user, int data_len);
 
 typedef struct {
     // provider data
     StreamPassInterface_handler_send handler_operation;
+    StreamPassInterface_handler_sendv handler_operation_v;
     void *user_provider;
     
     // user data
@@ -68,6 +85,8 @@ typedef struct {
     BPending job_operation;
     uint8_t *job_operation_data;
     int job_operation_len;
+    const StreamPassInterface_segment *job_operation_segs;
+    int job_operation_num_segs;
     
     // done job
     BPending job_done;
@@ -83,12 +102,18 @@ static void StreamPassInterface_Init (StreamPassInterface *i, StreamPassInterfac
 
 static void StreamPassInterface_Free (StreamPassInterface *i);
 
+static void StreamPassInterface_EnableSendv (StreamPassInterface *i, StreamPassInterface_handler_sendv handler_operation_v);
+
 static void StreamPassInterface_Done (StreamPassInterface *i, int data_len);
 
 static void StreamPassInterface_Sender_Init (StreamPassInterface *i, StreamPassInterface_handler_done handler_done, void *user);
 
 static void StreamPassInterface_Sender_Send (StreamPassInterface *i, uint8_t *data, int data_len);
 
+static void StreamPassInterface_Sender_Sendv (StreamPassInterface *i, const StreamPassInterface_segment *segs, int num_segs);
+
+static int StreamPassInterface_HasSendv (StreamPassInterface *i);
+
 void _StreamPassInterface_job_operation (StreamPassInterface *i);
 void _StreamPassInterface_job_done (StreamPassInterface *i);
 
@@ -96,6 +121,7 @@ void StreamPassInterface_Init (StreamPassInterface *i, StreamPassInterface_handl
 {
     // init arguments
     i->handler_operation = handler_operation;
+    i->handler_operation_v = NULL;
     i->user_provider = user;
     
     // set no user
@@ -120,6 +146,15 @@ void StreamPassInterface_Free (StreamPassInterface *i)
     BPending_Free(&i->job_operation);
 }
 
+void StreamPassInterface_EnableSendv (StreamPassInterface *i, StreamPassInterface_handler_sendv handler_operation_v)
+{
+    ASSERT(!i->handler_operation_v)
+    ASSERT(i->state == SPI_STATE_NONE)
+    ASSERT(handler_operation_v)
+    
+    i->handler_operation_v = handler_operation_v;
+}
+
 void StreamPassInterface_Done (StreamPassInterface *i, int data_len)
 {
     ASSERT(i->state == SPI_STATE_BUSY)
@@ -156,10 +191,51 @@ void StreamPassInterface_Sender_Send (StreamPassInterface *i, uint8_t *data, int
     // schedule operation
     i->job_operation_data = data;
     i->job_operation_len = data_len;
+    i->job_operation_num_segs = 0;
     BPending_Set(&i->job_operation);
     
     // set state
     i->state = SPI_STATE_OPERATION_PENDING;
 }
 
+void StreamPassInterface_Sender_Sendv (StreamPassInterface *i, const StreamPassInterface_segment *segs, int num_segs)
+{
+    ASSERT(num_segs > 0)
+    ASSERT(segs)
+    ASSERT(i->state == SPI_STATE_NONE)
+    ASSERT(i->handler_done)
+    DebugObject_Access(&i->d_obj);
+    
+    // if the provider can't send from multiple buffers, send the first one only
+    if (!i->handler_operation_v) {
+        StreamPassInterface_Sender_Send(i, segs[0].data, segs[0].data_len);
+        return;
+    }
+    
+    // compute total length
+    int total = 0;
+    for (int j = 0; j < num_segs; j++) {
+        ASSERT(segs[j].data_len > 0)
+        ASSERT(segs[j].data)
+        ASSERT(segs[j].data_len <= INT_MAX - total)
+        total += segs[j].data_len;
+    }
+    
+    // schedule operation
+    i->job_operation_len = total;
+    i->job_operation_segs = segs;
+    i->job_operation_num_segs = num_segs;
+    BPending_Set(&i->job_operation);
+    
+    // set state
+    i->state = SPI_STATE_OPERATION_PENDING;
+}
+
+int StreamPassInterface_HasSendv (StreamPassInterface *i)
+{
+    DebugObject_Access(&i->d_obj);
+    
+    return !!i->handler_operation_v;
+}
+
 #endif
@@ -37,7 +37,12 @@ void _StreamRecvInterface_job_operation (StreamRecvInterface *i)
     // set state
     i->state = SRI_STATE_BUSY;
     
-    // call handler
+    // call handler; if the provider can't receive into two buffers,
+    // only the first one is used
+    if (i->job_operation_len2 > 0 && i->handler_operation2) {
+        i->handler_operation2(i->user_provider, i->job_operation_data, i->job_operation_len, i->job_operation_data2, i->job_operation_len2);
+        return;
+    }
     i->handler_operation(i->user_provider, i->job_operation_data, i->job_operation_len);
     return;
 }
@@ -34,6 +34,12 @@
  * {@link StreamPassInterface} if names and its external semantics are disregarded.
  * If you modify this file, you should probably modify {@link StreamPassInterface}
  * too.
+ * 
+ * A provider may additionally support receiving into two buffers at once
+ * (see {@link StreamRecvInterface_EnableRecv2}), which lets ring buffer users
+ * fill both free segments with one read. If it doesn't, {@link StreamRecvInterface_Receiver_Recv2}
+ * falls back to receiving into the first buffer only. Either way, the amount
+ * reported by Done fills the first buffer before continuing into the second.
  */
 
 #ifndef BADVPN_FLOW_STREAMRECVINTERFACE_H
@@ -53,11 +59,14 @@
 
 typedef void (*StreamRecvInterface_handler_recv) (void *user, uint8_t *data, int data_len);
 
+typedef void (*StreamRecvInterface_handler_recv2) (void *user, uint8_t *data, int data_len, uint8_t *data2, int data2_len);
+
 typedef void (*StreamRecvInterface_handler_done) (void *user, int data_len);
 
 typedef struct {
     // provider data
     StreamRecvInterface_handler_recv handler_operation;
+    StreamRecvInterface_handler_recv2 handler_operation2;
     void *user_provider;
     
     // user data
@@ -68,6 +77,8 @@ typedef struct {
     BPending job_operation;
     uint8_t *job_operation_data;
     int job_operation_len;
+    uint8_t *job_operation_data2;
+    int job_operation_len2;
     
     // done job
     BPending job_done;
@@ -83,12 +94,16 @@ static void StreamRecvInterface_Init (StreamRecvInterface *i, StreamRecvInterfac
 
 static void StreamRecvInterface_Free (StreamRecvInterface *i);
 
+static void StreamRecvInterface_EnableRecv2 (StreamRecvInterface *i, StreamRecvInterface_handler_recv2 handler_operation2);
+
 static void StreamRecvInterface_Done (StreamRecvInterface *i, int data_len);
 
 static void StreamRecvInterface_Receiver_Init (StreamRecvInterface *i, StreamRecvInterface_handler_done handler_done, void *user);
 
 static void StreamRecvInterface_Receiver_Recv (StreamRecvInterface *i, uint8_t *data, int data_len);
 
+static void StreamRecvInterface_Receiver_Recv2 (StreamRecvInterface *i, uint8_t *data, int data_len, uint8_t *data2, int data2_len);
+
 void _StreamRecvInterface_job_operation (StreamRecvInterface *i);
 void _StreamRecvInterface_job_done (StreamRecvInterface *i);
 
@@ -96,6 +111,7 @@ void StreamRecvInterface_Init (StreamRecvInterface *i, StreamRecvInterface_handl
 {
     // init arguments
     i->handler_operation = handler_operation;
+    i->handler_operation2 = NULL;
     i->user_provider = user;
     
     // set no user
@@ -120,11 +136,20 @@ void StreamRecvInterface_Free (StreamRecvInterface *i)
     BPending_Free(&i->job_operation);
 }
 
+void StreamRecvInterface_EnableRecv2 (StreamRecvInterface *i, StreamRecvInterface_handler_recv2 handler_operation2)
+{
+    ASSERT(!i->handler_operation2)
+    ASSERT(i->state == SRI_STATE_NONE)
+    ASSERT(handler_operation2)
+    
+    i->handler_operation2 = handler_operation2;
+}
+
 void StreamRecvInterface_Done (StreamRecvInterface *i, int data_len)
 {
     ASSERT(i->state == SRI_STATE_BUSY)
     ASSERT(data_len > 0)
-    ASSERT(data_len <= i->job_operation_len)
+    ASSERT(data_len <= i->job_operation_len + (i->handler_operation2 ? i->job_operation_len2 : 0))
     DebugObject_Access(&i->d_obj);
     
     // schedule done
@@ -156,6 +181,28 @@ void StreamRecvInterface_Receiver_Recv (StreamRecvInterface *i, uint8_t *data, i
     // schedule operation
     i->job_operation_data = data;
     i->job_operation_len = data_len;
+    i->job_operation_len2 = 0;
+    BPending_Set(&i->job_operation);
+    
+    // set state
+    i->state = SRI_STATE_OPERATION_PENDING;
+}
+
+void StreamRecvInterface_Receiver_Recv2 (StreamRecvInterface *i, uint8_t *data, int data_len, uint8_t *data2, int data2_len)
+{
+    ASSERT(data_len > 0)
+    ASSERT(data)
+    ASSERT(data2_len >= 0)
+    ASSERT(data2_len == 0 || data2)
+    ASSERT(i->state == SRI_STATE_NONE)
+    ASSERT(i->handler_done)
+    DebugObject_Access(&i->d_obj);
+    
+    // schedule operation
+    i->job_operation_data = data;
+    i->job_operation_len = data_len;
+    i->job_operation_data2 = data2;
+    i->job_operation_len2 = data2_len;
     BPending_Set(&i->job_operation);
     
     // set state
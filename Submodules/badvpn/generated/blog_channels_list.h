@@ -143,3 +143,7 @@
 {"BThreadSignal", 4},
 {"BLockReactor", 4},
 {"ncd_load_module", 4},
+{"BIoUring", 4},
+{"ClientShards", 4},
+{"BLog", 4},
+{"BMetricsServer", 4},
@@ -59,12 +59,20 @@
 #define LWIP_IPV6_AUTOCONFIG 0
 
 #define MEMP_NUM_TCP_PCB_LISTEN 16
-#define MEMP_NUM_TCP_PCB 1024
+#define MEMP_NUM_TCP_PCB 65535
 #define TCP_MSS 1460
 #define TCP_SND_BUF 16384
 #define TCP_SND_QUEUELEN (4 * (TCP_SND_BUF)/(TCP_MSS))
 
+// look up pcbs for incoming segments by hashing the 4-tuple
+// (see src/core/tcp_hash.c) rather than walking the pcb lists
+#define LWIP_TCP_PCB_HASH 1
+
 #define MEM_LIBC_MALLOC 1
 #define MEMP_MEM_MALLOC 1
 
+// tun2socks passes packets read from the device as custom pbufs
+// (see tun2socks/PbufPool.h), regardless of IP_FRAG
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
+
 #endif
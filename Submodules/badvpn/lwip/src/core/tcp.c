@@ -135,6 +135,11 @@ tcp_init(void)
 #if LWIP_RANDOMIZE_INITIAL_LOCAL_PORTS && defined(LWIP_RAND)
   tcp_port = TCP_ENSURE_LOCAL_PORT_RANGE(LWIP_RAND());
 #endif /* LWIP_RANDOMIZE_INITIAL_LOCAL_PORTS && defined(LWIP_RAND) */
+#if LWIP_TCP_PCB_HASH
+  if (!tcp_pcb_hash_init()) {
+    LWIP_PLATFORM_ASSERT("tcp_init: failed to allocate pcb hash table");
+  }
+#endif /* LWIP_TCP_PCB_HASH */
 }
 
 /**
@@ -1024,6 +1029,9 @@ tcp_slowtmr_start:
         LWIP_ASSERT("tcp_slowtmr: first pcb == tcp_active_pcbs", tcp_active_pcbs == pcb);
         tcp_active_pcbs = pcb->next;
       }
+#if LWIP_TCP_PCB_HASH
+      tcp_pcb_hash_remove(pcb);
+#endif /* LWIP_TCP_PCB_HASH */
 
       if (pcb_reset) {
         tcp_rst(pcb->snd_nxt, pcb->rcv_nxt, &pcb->local_ip, &pcb->remote_ip,
@@ -1092,6 +1100,9 @@ tcp_slowtmr_start:
         LWIP_ASSERT("tcp_slowtmr: first pcb == tcp_tw_pcbs", tcp_tw_pcbs == pcb);
         tcp_tw_pcbs = pcb->next;
       }
+#if LWIP_TCP_PCB_HASH
+      tcp_pcb_hash_remove(pcb);
+#endif /* LWIP_TCP_PCB_HASH */
       pcb2 = pcb;
       pcb = pcb->next;
       memp_free(MEMP_TCP_PCB, pcb2);
@@ -0,0 +1,221 @@
+/**
+ * @file
+ * Hash table of active and TIME-WAIT TCP pcbs keyed by the connection
+ * 4-tuple, used by tcp_input() to demultiplex incoming segments.
+ *
+ * Only pcbs on tcp_active_pcbs and tcp_tw_pcbs are indexed. The lists
+ * themselves are kept as they are since the timers still walk them; the
+ * hash is maintained from TCP_REG/TCP_RMV and tcp_slowtmr().
+ */
+
+/*
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ * This file is part of the lwIP TCP/IP stack.
+ *
+ */
+
+#include "lwip/opt.h"
+
+#if LWIP_TCP && LWIP_TCP_PCB_HASH /* don't build if not configured for use in lwipopts.h */
+
+#include "lwip/def.h"
+#include "lwip/tcp.h"
+#include "lwip/tcp_impl.h"
+#include "lwip/debug.h"
+
+#include <structure/CHash.h>
+
+/** Number of buckets the table starts with. It is doubled whenever
+    the number of indexed pcbs exceeds the number of buckets. */
+#define TCP_PCB_HASH_INITIAL_BUCKETS 256
+
+struct tcp_pcb_hash_key {
+  u8_t isipv6;
+  ipX_addr_t *local_ip;
+  ipX_addr_t *remote_ip;
+  u16_t local_port;
+  u16_t remote_port;
+};
+
+static u32_t tcp_pcb_hash_compute(u8_t isipv6, ipX_addr_t *local_ip, u16_t local_port,
+                                  ipX_addr_t *remote_ip, u16_t remote_port);
+static int tcp_pcb_hash_key_matches(const struct tcp_pcb_hash_key *key, struct tcp_pcb *pcb);
+static int tcp_pcb_hash_entries_equal(struct tcp_pcb *pcb1, struct tcp_pcb *pcb2);
+
+#include "tcp_hash_chash.h"
+#include <structure/CHash_decl.h>
+
+#include "tcp_hash_chash.h"
+#include <structure/CHash_impl.h>
+
+static TcpPcbHash tcp_pcb_hash;
+static u32_t tcp_pcb_hash_count;
+
+static u32_t
+tcp_pcb_hash_mix(u32_t h, u32_t word)
+{
+  h ^= word;
+  h *= 0x9e3779b1UL;
+  return h ^ (h >> 16);
+}
+
+static u32_t
+tcp_pcb_hash_compute(u8_t isipv6, ipX_addr_t *local_ip, u16_t local_port,
+                     ipX_addr_t *remote_ip, u16_t remote_port)
+{
+  u32_t h = ((u32_t)local_port << 16) | remote_port;
+#if LWIP_IPV6
+  if (isipv6) {
+    int i;
+    for (i = 0; i < 4; i++) {
+      h = tcp_pcb_hash_mix(h, ipX_2_ip6(local_ip)->addr[i]);
+      h = tcp_pcb_hash_mix(h, ipX_2_ip6(remote_ip)->addr[i]);
+    }
+    return tcp_pcb_hash_mix(h, 1);
+  }
+#else /* LWIP_IPV6 */
+  LWIP_UNUSED_ARG(isipv6);
+#endif /* LWIP_IPV6 */
+  h = tcp_pcb_hash_mix(h, ip4_addr_get_u32(ipX_2_ip(local_ip)));
+  h = tcp_pcb_hash_mix(h, ip4_addr_get_u32(ipX_2_ip(remote_ip)));
+  return tcp_pcb_hash_mix(h, 0);
+}
+
+static int
+tcp_pcb_hash_key_matches(const struct tcp_pcb_hash_key *key, struct tcp_pcb *pcb)
+{
+  return pcb->remote_port == key->remote_port &&
+         pcb->local_port == key->local_port &&
+         PCB_ISIPV6(pcb) == key->isipv6 &&
+         ipX_addr_cmp(key->isipv6, &pcb->remote_ip, key->remote_ip) &&
+         ipX_addr_cmp(key->isipv6, &pcb->local_ip, key->local_ip);
+}
+
+static int
+tcp_pcb_hash_entries_equal(struct tcp_pcb *pcb1, struct tcp_pcb *pcb2)
+{
+  struct tcp_pcb_hash_key key;
+  key.isipv6 = PCB_ISIPV6(pcb1);
+  key.local_ip = &pcb1->local_ip;
+  key.remote_ip = &pcb1->remote_ip;
+  key.local_port = pcb1->local_port;
+  key.remote_port = pcb1->remote_port;
+  return tcp_pcb_hash_key_matches(&key, pcb2);
+}
+
+/**
+ * Allocates the initial bucket array. Called from tcp_init().
+ *
+ * @return 1 on success, 0 if out of memory
+ */
+int
+tcp_pcb_hash_init(void)
+{
+  tcp_pcb_hash_count = 0;
+  return TcpPcbHash_Init(&tcp_pcb_hash, TCP_PCB_HASH_INITIAL_BUCKETS);
+}
+
+/**
+ * Indexes a pcb which is being put on tcp_active_pcbs or tcp_tw_pcbs.
+ * Its addresses and ports must not change while it is indexed.
+ *
+ * @param pcb the pcb to index
+ */
+void
+tcp_pcb_hash_insert(struct tcp_pcb *pcb)
+{
+  TcpPcbHashRef ref = {pcb, pcb};
+
+  pcb->hash_value = tcp_pcb_hash_compute(PCB_ISIPV6(pcb), &pcb->local_ip, pcb->local_port,
+                                         &pcb->remote_ip, pcb->remote_port);
+  TcpPcbHash_InsertMulti(&tcp_pcb_hash, 0, ref);
+  tcp_pcb_hash_count++;
+
+  /* Keep the load factor at or below one. If growing fails we just keep
+     the longer chains; lookups stay correct. */
+  if (tcp_pcb_hash_count > tcp_pcb_hash.num_buckets) {
+    if (!TcpPcbHash_MultiplyBuckets(&tcp_pcb_hash, 0, 1)) {
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_pcb_hash_insert: failed to grow table\n"));
+    }
+  }
+}
+
+/**
+ * Removes a pcb which is being taken off tcp_active_pcbs or tcp_tw_pcbs
+ * from the index.
+ *
+ * @param pcb the pcb to remove
+ */
+void
+tcp_pcb_hash_remove(struct tcp_pcb *pcb)
+{
+  TcpPcbHashRef ref = {pcb, pcb};
+
+  LWIP_ASSERT("tcp_pcb_hash_remove: table not empty", tcp_pcb_hash_count > 0);
+
+  TcpPcbHash_Remove(&tcp_pcb_hash, 0, ref);
+  tcp_pcb_hash_count--;
+}
+
+/**
+ * Finds the active or TIME-WAIT pcb for a 4-tuple. If both an active and
+ * a TIME-WAIT pcb match (possible with SO_REUSE), the active one is
+ * returned, as the list walk this replaces would have done.
+ *
+ * @return the matching pcb, or NULL if there is none
+ */
+struct tcp_pcb *
+tcp_pcb_hash_lookup(u8_t isipv6, ipX_addr_t *local_ip, u16_t local_port,
+                    ipX_addr_t *remote_ip, u16_t remote_port)
+{
+  struct tcp_pcb_hash_key key;
+  struct tcp_pcb *pcb;
+  u32_t hash;
+  struct tcp_pcb *found = NULL;
+
+  key.isipv6 = isipv6;
+  key.local_ip = local_ip;
+  key.remote_ip = remote_ip;
+  key.local_port = local_port;
+  key.remote_port = remote_port;
+  hash = tcp_pcb_hash_compute(isipv6, local_ip, local_port, remote_ip, remote_port);
+
+  /* Equal entries are not necessarily adjacent after the table has grown,
+     so walk the whole bucket rather than using GetNextEqual. */
+  for (pcb = tcp_pcb_hash.buckets[hash % tcp_pcb_hash.num_buckets]; pcb != NULL; pcb = pcb->hash_next) {
+    if (pcb->hash_value != hash || !tcp_pcb_hash_key_matches(&key, pcb)) {
+      continue;
+    }
+    if (pcb->state != TIME_WAIT) {
+      return pcb;
+    }
+    if (found == NULL) {
+      found = pcb;
+    }
+  }
+
+  return found;
+}
+
+#endif /* LWIP_TCP && LWIP_TCP_PCB_HASH */
@@ -0,0 +1,13 @@
+#define CHASH_PARAM_NAME TcpPcbHash
+#define CHASH_PARAM_ENTRY struct tcp_pcb
+#define CHASH_PARAM_LINK struct tcp_pcb *
+#define CHASH_PARAM_KEY const struct tcp_pcb_hash_key *
+#define CHASH_PARAM_ARG int
+#define CHASH_PARAM_NULL ((struct tcp_pcb *)NULL)
+#define CHASH_PARAM_DEREF(arg, link) (link)
+#define CHASH_PARAM_ENTRYHASH(arg, entry) ((size_t)(entry).ptr->hash_value)
+#define CHASH_PARAM_KEYHASH(arg, key) ((size_t)tcp_pcb_hash_compute((key)->isipv6, (key)->local_ip, (key)->local_port, (key)->remote_ip, (key)->remote_port))
+#define CHASH_PARAM_ENTRYHASH_IS_CHEAP 1
+#define CHASH_PARAM_COMPARE_ENTRIES(arg, entry1, entry2) tcp_pcb_hash_entries_equal((entry1).ptr, (entry2).ptr)
+#define CHASH_PARAM_COMPARE_KEY_ENTRY(arg, key1, entry2) tcp_pcb_hash_key_matches((key1), (entry2).ptr)
+#define CHASH_PARAM_ENTRY_NEXT hash_next
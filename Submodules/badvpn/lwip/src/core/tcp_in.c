@@ -171,7 +171,16 @@ tcp_input(struct pbuf *p, struct netif *inp)
      for an active connection. */
   prev = NULL;
 
-  
+#if LWIP_TCP_PCB_HASH
+  pcb = tcp_pcb_hash_lookup(ip_current_is_v6(), ipX_current_dest_addr(), tcphdr->dest,
+                            ipX_current_src_addr(), tcphdr->src);
+  if (pcb != NULL && pcb->state == TIME_WAIT) {
+    LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for TIME_WAITing connection.\n"));
+    tcp_timewait_input(pcb);
+    pbuf_free(p);
+    return;
+  }
+#else /* LWIP_TCP_PCB_HASH */
   for(pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
     LWIP_ASSERT("tcp_input: active pcb->state != CLOSED", pcb->state != CLOSED);
     LWIP_ASSERT("tcp_input: active pcb->state != TIME-WAIT", pcb->state != TIME_WAIT);
@@ -195,8 +204,10 @@ tcp_input(struct pbuf *p, struct netif *inp)
     }
     prev = pcb;
   }
+#endif /* LWIP_TCP_PCB_HASH */
 
   if (pcb == NULL) {
+#if !LWIP_TCP_PCB_HASH
     /* If it did not go to an active connection, we check the connections
        in the TIME-WAIT state. */
     for(pcb = tcp_tw_pcbs; pcb != NULL; pcb = pcb->next) {
@@ -215,6 +226,7 @@ tcp_input(struct pbuf *p, struct netif *inp)
         return;
       }
     }
+#endif /* !LWIP_TCP_PCB_HASH */
 
     /* Finally, if we still did not get a match, we check all PCBs that
        are LISTENing for incoming connections. */
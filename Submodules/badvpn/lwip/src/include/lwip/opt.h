@@ -1060,6 +1060,15 @@
 #define LWIP_TCP_TIMESTAMPS             0
 #endif
 
+/**
+ * LWIP_TCP_PCB_HASH==1: index active and TIME-WAIT pcbs in a hash table
+ * keyed by the connection 4-tuple, so that tcp_input() finds the pcb for
+ * an incoming segment in constant time instead of walking the pcb lists.
+ */
+#ifndef LWIP_TCP_PCB_HASH
+#define LWIP_TCP_PCB_HASH               0
+#endif
+
 /**
  * TCP_WND_UPDATE_THRESHOLD: difference in window to trigger an
  * explicit window update
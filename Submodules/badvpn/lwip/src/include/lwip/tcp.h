@@ -177,6 +177,13 @@ struct tcp_pcb {
 
   /* ports are in host byte order */
   u16_t remote_port;
+
+#if LWIP_TCP_PCB_HASH
+  /* 4-tuple hash table link and the precomputed hash,
+     valid while the pcb is on tcp_active_pcbs or tcp_tw_pcbs */
+  struct tcp_pcb *hash_next;
+  u32_t hash_value;
+#endif /* LWIP_TCP_PCB_HASH */
   
   u8_t flags;
 #define TF_ACK_DELAY   ((u8_t)0x01U)   /* Delayed ACK. */
@@ -329,6 +329,26 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
    3) All PCBs in the tcp_listen_pcbs list is in LISTEN state.
    4) All PCBs in the tcp_tw_pcbs list is in TIME-WAIT state.
 */
+/* With LWIP_TCP_PCB_HASH, pcbs on the active and TIME-WAIT lists are also
+   indexed by their 4-tuple. TCP_REG and TCP_RMV keep the index in sync. */
+#if LWIP_TCP_PCB_HASH
+#define TCP_HASH_REG(pcbs, npcb)                   \
+  do {                                             \
+    if ((pcbs) == &tcp_active_pcbs || (pcbs) == &tcp_tw_pcbs) { \
+      tcp_pcb_hash_insert(npcb);                   \
+    }                                              \
+  } while (0)
+#define TCP_HASH_RMV(pcbs, npcb)                   \
+  do {                                             \
+    if ((pcbs) == &tcp_active_pcbs || (pcbs) == &tcp_tw_pcbs) { \
+      tcp_pcb_hash_remove(npcb);                   \
+    }                                              \
+  } while (0)
+#else /* LWIP_TCP_PCB_HASH */
+#define TCP_HASH_REG(pcbs, npcb)
+#define TCP_HASH_RMV(pcbs, npcb)
+#endif /* LWIP_TCP_PCB_HASH */
+
 /* Define two macros, TCP_REG and TCP_RMV that registers a TCP PCB
    with a PCB list or removes a PCB from a list, respectively. */
 #ifndef TCP_DEBUG_PCB_LISTS
@@ -346,6 +366,7 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
                             (npcb)->next = *(pcbs); \
                             LWIP_ASSERT("TCP_REG: npcb->next != npcb", (npcb)->next != (npcb)); \
                             *(pcbs) = (npcb); \
+                            TCP_HASH_REG(pcbs, npcb); \
                             LWIP_ASSERT("TCP_RMV: tcp_pcbs sane", tcp_pcbs_sane()); \
               tcp_timer_needed(); \
                             } while(0)
@@ -361,6 +382,7 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
                                } \
                             } \
                             (npcb)->next = NULL; \
+                            TCP_HASH_RMV(pcbs, npcb); \
                             LWIP_ASSERT("TCP_RMV: tcp_pcbs sane", tcp_pcbs_sane()); \
                             LWIP_DEBUGF(TCP_DEBUG, ("TCP_RMV: removed %p from %p\n", (npcb), *(pcbs))); \
                             } while(0)
@@ -371,6 +393,7 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
   do {                                             \
     (npcb)->next = *pcbs;                          \
     *(pcbs) = (npcb);                              \
+    TCP_HASH_REG(pcbs, npcb);                      \
     tcp_timer_needed();                            \
   } while (0)
 
@@ -390,6 +413,7 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
       }                                            \
     }                                              \
     (npcb)->next = NULL;                           \
+    TCP_HASH_RMV(pcbs, npcb);                      \
   } while(0)
 
 #endif /* LWIP_DEBUG */
@@ -418,6 +442,14 @@ struct tcp_pcb *tcp_pcb_copy(struct tcp_pcb *pcb);
 void tcp_pcb_purge(struct tcp_pcb *pcb);
 void tcp_pcb_remove(struct tcp_pcb **pcblist, struct tcp_pcb *pcb);
 
+#if LWIP_TCP_PCB_HASH
+int tcp_pcb_hash_init(void);
+void tcp_pcb_hash_insert(struct tcp_pcb *pcb);
+void tcp_pcb_hash_remove(struct tcp_pcb *pcb);
+struct tcp_pcb *tcp_pcb_hash_lookup(u8_t isipv6, ipX_addr_t *local_ip, u16_t local_port,
+                                    ipX_addr_t *remote_ip, u16_t remote_port);
+#endif /* LWIP_TCP_PCB_HASH */
+
 void tcp_segs_free(struct tcp_seg *seg);
 void tcp_seg_free(struct tcp_seg *seg);
 struct tcp_seg *tcp_seg_copy(struct tcp_seg *seg);
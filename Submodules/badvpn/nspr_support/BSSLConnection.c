@@ -29,11 +29,18 @@
 
 #include <prerror.h>
 #include <ssl.h>
+#include <sslproto.h>
 
 #include <string.h>
 #include <stdlib.h>
 
+#ifdef BADVPN_LINUX
+#include <sslexp.h>
+#include <linux/tls.h>
+#endif
+
 #include <misc/print_macros.h>
+#include <misc/minmax.h>
 #include <base/BLog.h>
 
 #include "BSSLConnection.h"
@@ -45,10 +52,29 @@
 #define THREADWORK_STATE_READ 2
 #define THREADWORK_STATE_WRITE 3
 
+#define KTLS_STATE_NONE 0
+#define KTLS_STATE_HANDSHAKE 1
+#define KTLS_STATE_DRAIN 2
+#define KTLS_STATE_ON 3
+
+#if defined(BADVPN_LINUX) && defined(SSL_SecretCallback) && defined(TLS_1_3_VERSION)
+#define KTLS_SUPPORTED 1
+#endif
+
 static void backend_threadwork_start (struct BSSLConnection_backend *b, int op);
 static int backend_threadwork_do_io (struct BSSLConnection_backend *b);
+static int backend_recv_amount (struct BSSLConnection_backend *b, int amount);
+static void backend_ktls_free_secrets (struct BSSLConnection_backend *b);
 static void connection_init_job_handler (BSSLConnection *o);
 static void connection_init_up (BSSLConnection *o);
+static void connection_handshake_done (BSSLConnection *o);
+static void connection_handshake_finish (BSSLConnection *o);
+static int connection_ktls_init (BSSLConnection *o);
+static int connection_ktls_check (BSSLConnection *o);
+static int connection_ktls_enable (BSSLConnection *o, int rx);
+static void connection_ktls_stop (BSSLConnection *o, int state);
+static void connection_ktls_try_switch (BSSLConnection *o);
+static void connection_ktls_try_io (BSSLConnection *o);
 static void connection_try_io (BSSLConnection *o);
 static void connection_threadwork_func_work (void *user);
 static void connection_threadwork_handler_done (void *user);
@@ -77,6 +103,9 @@ static PRStatus method_close (PRFileDesc *fd)
     ASSERT(!b->con)
     ASSERT(b->threadwork_state == THREADWORK_STATE_NONE)
     
+    // free kernel TLS secrets if we didn't get to use them
+    backend_ktls_free_secrets(b);
+    
     // free mutexes
     if ((b->flags & BSSLCONNECTION_FLAG_THREADWORK_HANDSHAKE) || (b->flags & BSSLCONNECTION_FLAG_THREADWORK_IO)) {
         BMutex_Free(&b->recv_buf_mutex);
@@ -105,6 +134,7 @@ static PRInt32 method_read (PRFileDesc *fd, void *buf, PRInt32 amount)
     if (b->recv_busy || b->recv_pos == b->recv_len) {
         if (b->threadwork_state != THREADWORK_STATE_NONE) {
             b->threadwork_want_recv = 1;
+            b->threadwork_recv_amount = amount;
             BMutex_Unlock(&b->recv_buf_mutex);
         } else {
             // start receiving if not already
@@ -113,7 +143,7 @@ static PRInt32 method_read (PRFileDesc *fd, void *buf, PRInt32 amount)
                 b->recv_busy = 1;
                 
                 // receive into buffer
-                StreamRecvInterface_Receiver_Recv(b->recv_if, b->recv_buf, BSSLCONNECTION_BUF_SIZE);
+                StreamRecvInterface_Receiver_Recv(b->recv_if, b->recv_buf, backend_recv_amount(b, amount));
             }
         }
         PR_SetError(PR_WOULD_BLOCK_ERROR, 0);
@@ -143,14 +173,22 @@ static PRInt32 method_write (PRFileDesc *fd, const void *buf, PRInt32 amount)
     struct BSSLConnection_backend *b = (struct BSSLConnection_backend *)fd->secret;
     ASSERT(amount > 0)
     
+    // once the kernel produces the records, anything NSS would send
+    // (e.g. a closure alert) would have the wrong sequence number
+    if (b->ktls_tx) {
+        PR_SetError(PR_INVALID_STATE_ERROR, 0);
+        return -1;
+    }
+    
     if (b->threadwork_state != THREADWORK_STATE_NONE) {
         BMutex_Lock(&b->send_buf_mutex);
     }
     
     ASSERT(!b->send_busy || b->send_pos < b->send_len)
     
-    // if there is data in buffer, refuse send
-    if (b->send_pos < b->send_len) {
+    // if buffer is full, refuse send
+    if (b->send_len == BSSLCONNECTION_BUF_SIZE) {
+        b->send_refused = 1;
         if (b->threadwork_state != THREADWORK_STATE_NONE) {
             b->threadwork_want_send = 1;
             BMutex_Unlock(&b->send_buf_mutex);
@@ -159,19 +197,19 @@ static PRInt32 method_write (PRFileDesc *fd, const void *buf, PRInt32 amount)
         return -1;
     }
     
-    // limit amount to buffer size
-    if (amount > BSSLCONNECTION_BUF_SIZE) {
-        amount = BSSLCONNECTION_BUF_SIZE;
+    // limit amount to free space in buffer, remembering if we didn't take everything
+    b->send_refused = (amount > BSSLCONNECTION_BUF_SIZE - b->send_len);
+    if (b->send_refused) {
+        amount = BSSLCONNECTION_BUF_SIZE - b->send_len;
     }
     
-    // init buffer
-    memcpy(b->send_buf, buf, amount);
-    b->send_pos = 0;
-    b->send_len = amount;
+    // append to buffer
+    memcpy(b->send_buf + b->send_len, buf, amount);
+    b->send_len += amount;
     
     if (b->threadwork_state != THREADWORK_STATE_NONE) {
         BMutex_Unlock(&b->send_buf_mutex);
-    } else {
+    } else if (!b->send_busy) {
         // start sending
         b->send_busy = 1;
         StreamPassInterface_Sender_Send(b->send_if, b->send_buf + b->send_pos, b->send_len - b->send_pos);
@@ -322,6 +360,24 @@ static PRIOMethods methods = {
 static void backend_send_if_handler_done (struct BSSLConnection_backend *b, int data_len)
 {
     ASSERT(b->send_busy)
+    
+    // with kernel TLS, we were sending the user's data directly
+    if (b->ktls_tx) {
+        b->send_busy = 0;
+        
+        if (b->con && !b->con->have_error) {
+            ASSERT(b->con->send_len > 0)
+            ASSERT(data_len <= b->con->send_len)
+            
+            // set no send data
+            b->con->send_len = -1;
+            
+            // done
+            StreamPassInterface_Done(&b->con->send_if, data_len);
+        }
+        return;
+    }
+    
     ASSERT(b->send_len > 0)
     ASSERT(b->send_pos < b->send_len)
     ASSERT(data_len > 0)
@@ -346,6 +402,10 @@ static void backend_send_if_handler_done (struct BSSLConnection_backend *b, int
     // set send not busy
     b->send_busy = 0;
     
+    // all sent, start filling buffer from the beginning
+    b->send_pos = 0;
+    b->send_len = 0;
+    
     if (b->threadwork_state != THREADWORK_STATE_NONE) {
         BMutex_Unlock(&b->send_buf_mutex);
     }
@@ -361,6 +421,24 @@ static void backend_recv_if_handler_done (struct BSSLConnection_backend *b, int
 {
     ASSERT(b->recv_busy)
     ASSERT(data_len > 0)
+    
+    // with kernel TLS, we were receiving into the user's buffer directly
+    if (b->ktls_rx) {
+        b->recv_busy = 0;
+        
+        if (b->con && !b->con->have_error) {
+            ASSERT(b->con->recv_avail > 0)
+            ASSERT(data_len <= b->con->recv_avail)
+            
+            // set no recv data
+            b->con->recv_avail = -1;
+            
+            // done
+            StreamRecvInterface_Done(&b->con->recv_if, data_len);
+        }
+        return;
+    }
+    
     ASSERT(data_len <= BSSLCONNECTION_BUF_SIZE)
     
     if (b->threadwork_state != THREADWORK_STATE_NONE) {
@@ -405,7 +483,7 @@ static int backend_threadwork_do_io (struct BSSLConnection_backend *b)
     
     if (b->threadwork_want_recv && b->recv_pos == b->recv_len && !b->recv_busy) {
         b->recv_busy = 1;
-        StreamRecvInterface_Receiver_Recv(b->recv_if, b->recv_buf, BSSLCONNECTION_BUF_SIZE);
+        StreamRecvInterface_Receiver_Recv(b->recv_if, b->recv_buf, backend_recv_amount(b, b->threadwork_recv_amount));
     }
     
     if (b->send_pos < b->send_len && !b->send_busy) {
@@ -416,6 +494,33 @@ static int backend_threadwork_do_io (struct BSSLConnection_backend *b)
     return io_ready;
 }
 
+static int backend_recv_amount (struct BSSLConnection_backend *b, int amount)
+{
+    ASSERT(amount > 0)
+    
+    // Before switching to kernel TLS, we must not take from the socket anything
+    // past the end of the handshake, which the kernel has to decrypt instead.
+    // NSS reads exactly the record it's waiting for, so just receive that much.
+    if (b->recv_exact) {
+        return bmin_int(amount, BSSLCONNECTION_BUF_SIZE);
+    }
+    
+    return BSSLCONNECTION_BUF_SIZE;
+}
+
+static void backend_ktls_free_secrets (struct BSSLConnection_backend *b)
+{
+    if (b->ktls_read_secret) {
+        PK11_FreeSymKey(b->ktls_read_secret);
+        b->ktls_read_secret = NULL;
+    }
+    
+    if (b->ktls_write_secret) {
+        PK11_FreeSymKey(b->ktls_write_secret);
+        b->ktls_write_secret = NULL;
+    }
+}
+
 static void connection_report_error (BSSLConnection *o)
 {
     ASSERT(!o->have_error)
@@ -461,16 +566,360 @@ static void connection_init_up (BSSLConnection *o)
     o->up = 1;
 }
 
+static void connection_handshake_done (BSSLConnection *o)
+{
+    ASSERT(!o->have_error)
+    ASSERT(o->ktls_state == KTLS_STATE_NONE || o->ktls_state == KTLS_STATE_HANDSHAKE)
+    
+    if (o->ktls_state == KTLS_STATE_HANDSHAKE) {
+        if (connection_ktls_check(o)) {
+            // wait for the handshake to be sent, then switch
+            o->ktls_state = KTLS_STATE_DRAIN;
+            connection_ktls_try_switch(o);
+            return;
+        }
+        
+        // continue in NSS
+        connection_ktls_stop(o, KTLS_STATE_NONE);
+    }
+    
+    connection_handshake_finish(o);
+    return;
+}
+
+static void connection_handshake_finish (BSSLConnection *o)
+{
+    ASSERT(!o->have_error)
+    ASSERT(o->ktls_state == KTLS_STATE_NONE || o->ktls_state == KTLS_STATE_ON)
+    
+    // if the user was already allowed to do I/O, continue it
+    if (o->up) {
+        connection_try_io(o);
+        return;
+    }
+    
+    // init up
+    connection_init_up(o);
+    
+    // report up
+    o->handler(o->user, BSSLCONNECTION_EVENT_UP);
+    return;
+}
+
+#ifdef KTLS_SUPPORTED
+
+static void connection_ktls_secret_callback (PRFileDesc *fd, PRUint16 epoch, SSLSecretDirection dir, PK11SymKey *secret, void *arg)
+{
+    struct BSSLConnection_backend *b = (struct BSSLConnection_backend *)arg;
+    
+    // we only need the secrets the application data starts with
+    if (epoch != 3) {
+        return;
+    }
+    
+    PK11SymKey **dest = (dir == ssl_secret_read ? &b->ktls_read_secret : &b->ktls_write_secret);
+    if (*dest) {
+        return;
+    }
+    
+    *dest = PK11_ReferenceSymKey(secret);
+}
+
+static int connection_ktls_derive (BSSLConnection *o, PK11SymKey *secret, const char *label, CK_MECHANISM_TYPE mech, uint8_t *out, int out_len)
+{
+    PK11SymKey *key;
+    if (SSL_HkdfExpandLabelWithMech(o->ktls_version, o->ktls_cipher_suite, secret, NULL, 0, label, strlen(label), mech, out_len, &key) != SECSuccess) {
+        BLog(BLOG_ERROR, "SSL_HkdfExpandLabelWithMech failed (%"PRIi32")", PR_GetError());
+        goto fail0;
+    }
+    
+    if (PK11_ExtractKeyValue(key) != SECSuccess) {
+        BLog(BLOG_ERROR, "PK11_ExtractKeyValue failed (%"PRIi32")", PR_GetError());
+        goto fail1;
+    }
+    
+    SECItem *data = PK11_GetKeyData(key);
+    if (!data || data->len != out_len) {
+        BLog(BLOG_ERROR, "PK11_GetKeyData failed");
+        goto fail1;
+    }
+    
+    memcpy(out, data->data, out_len);
+    
+    PK11_FreeSymKey(key);
+    return 1;
+    
+fail1:
+    PK11_FreeSymKey(key);
+fail0:
+    return 0;
+}
+
+#endif
+
+static int connection_ktls_init (BSSLConnection *o)
+{
+#ifdef KTLS_SUPPORTED
+    // have NSS tell us the traffic secrets
+    if (SSL_SecretCallback(o->prfd, connection_ktls_secret_callback, o->backend) != SECSuccess) {
+        BLog(BLOG_ERROR, "SSL_SecretCallback failed (%"PRIi32")", PR_GetError());
+        return 0;
+    }
+    
+    // A server would send session tickets right after the handshake, and the kernel
+    // would then start with the wrong sequence number. We don't resume sessions anyway.
+    if (SSL_OptionSet(o->prfd, SSL_NO_CACHE, PR_TRUE) != SECSuccess ||
+        SSL_OptionSet(o->prfd, SSL_ENABLE_SESSION_TICKETS, PR_FALSE) != SECSuccess
+    ) {
+        BLog(BLOG_ERROR, "SSL_OptionSet failed (%"PRIi32")", PR_GetError());
+        SSL_SecretCallback(o->prfd, NULL, NULL);
+        return 0;
+    }
+    
+    // don't receive past the handshake
+    o->backend->recv_exact = 1;
+    
+    return 1;
+#else
+    BLog(BLOG_ERROR, "kernel TLS is not supported in this build");
+    return 0;
+#endif
+}
+
+static int connection_ktls_check (BSSLConnection *o)
+{
+    struct BSSLConnection_backend *b = o->backend;
+    ASSERT(b->threadwork_state == THREADWORK_STATE_NONE)
+    
+    SSLChannelInfo info;
+    if (SSL_GetChannelInfo(o->prfd, &info, sizeof(info)) != SECSuccess) {
+        BLog(BLOG_ERROR, "SSL_GetChannelInfo failed (%"PRIi32")", PR_GetError());
+        return 0;
+    }
+    
+    // The keys we give to the kernel are derived as in TLS 1.3, and we rely on
+    // no application data having been exchanged so that the sequence numbers are zero.
+    if (info.protocolVersion != SSL_LIBRARY_VERSION_TLS_1_3) {
+        BLog(BLOG_INFO, "not using kernel TLS: TLS 1.3 not negotiated");
+        return 0;
+    }
+    
+    switch (info.cipherSuite) {
+        case TLS_AES_128_GCM_SHA256:
+        case TLS_AES_256_GCM_SHA384:
+        case TLS_CHACHA20_POLY1305_SHA256:
+            break;
+        default:
+            BLog(BLOG_INFO, "not using kernel TLS: unsupported cipher suite %"PRIu16, info.cipherSuite);
+            return 0;
+    }
+    
+    if (!b->ktls_read_secret || !b->ktls_write_secret) {
+        BLog(BLOG_ERROR, "not using kernel TLS: traffic secrets not known");
+        return 0;
+    }
+    
+    // NSS must have nothing left to send, and nothing received which it hasn't
+    // processed, or which it has processed but not returned yet
+    if (b->send_refused) {
+        BLog(BLOG_INFO, "not using kernel TLS: handshake data still buffered");
+        return 0;
+    }
+    if (b->recv_busy || b->recv_pos < b->recv_len || SSL_DataPending(o->prfd) > 0) {
+        BLog(BLOG_INFO, "not using kernel TLS: data received after handshake");
+        return 0;
+    }
+    
+    o->ktls_version = info.protocolVersion;
+    o->ktls_cipher_suite = info.cipherSuite;
+    
+    return 1;
+}
+
+static int connection_ktls_enable (BSSLConnection *o, int rx)
+{
+    ASSERT(rx == 0 || rx == 1)
+    ASSERT(o->backend->bcon)
+    
+#ifdef KTLS_SUPPORTED
+    PK11SymKey *secret = (rx ? o->backend->ktls_read_secret : o->backend->ktls_write_secret);
+    ASSERT(secret)
+    
+    CK_MECHANISM_TYPE mech;
+    int key_len;
+    switch (o->ktls_cipher_suite) {
+        case TLS_AES_128_GCM_SHA256:
+            mech = CKM_AES_GCM;
+            key_len = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+            break;
+        case TLS_AES_256_GCM_SHA384:
+            mech = CKM_AES_GCM;
+            key_len = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+            break;
+        case TLS_CHACHA20_POLY1305_SHA256:
+            mech = CKM_CHACHA20_POLY1305;
+            key_len = TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
+            break;
+        default:
+            ASSERT(0);
+            return 0;
+    }
+    
+    // derive record key and IV from the traffic secret (RFC 8446, 7.3);
+    // the IV is not a cipher key, so it's derived as a generic secret
+    uint8_t key[32];
+    uint8_t iv[12];
+    if (!connection_ktls_derive(o, secret, "key", mech, key, key_len) ||
+        !connection_ktls_derive(o, secret, "iv", CKM_HKDF_DERIVE, iv, sizeof(iv))
+    ) {
+        return 0;
+    }
+    
+    // build kernel parameters; the record sequence number is zero
+    union {
+        struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+        struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+        struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+    } ci;
+    int ci_len;
+    memset(&ci, 0, sizeof(ci));
+    
+    switch (o->ktls_cipher_suite) {
+        case TLS_AES_128_GCM_SHA256:
+            ci.aes_gcm_128.info.version = TLS_1_3_VERSION;
+            ci.aes_gcm_128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+            memcpy(ci.aes_gcm_128.key, key, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+            memcpy(ci.aes_gcm_128.salt, iv, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+            memcpy(ci.aes_gcm_128.iv, iv + TLS_CIPHER_AES_GCM_128_SALT_SIZE, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+            ci_len = sizeof(ci.aes_gcm_128);
+            break;
+        case TLS_AES_256_GCM_SHA384:
+            ci.aes_gcm_256.info.version = TLS_1_3_VERSION;
+            ci.aes_gcm_256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+            memcpy(ci.aes_gcm_256.key, key, TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+            memcpy(ci.aes_gcm_256.salt, iv, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+            memcpy(ci.aes_gcm_256.iv, iv + TLS_CIPHER_AES_GCM_256_SALT_SIZE, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+            ci_len = sizeof(ci.aes_gcm_256);
+            break;
+        default:
+            ci.chacha20_poly1305.info.version = TLS_1_3_VERSION;
+            ci.chacha20_poly1305.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+            memcpy(ci.chacha20_poly1305.key, key, TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+            memcpy(ci.chacha20_poly1305.iv, iv, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+            ci_len = sizeof(ci.chacha20_poly1305);
+            break;
+    }
+    
+    int res = BConnection_EnableKTLS(o->backend->bcon, rx, &ci, ci_len);
+    
+    // don't leave keys lying around
+    memset(key, 0, sizeof(key));
+    memset(iv, 0, sizeof(iv));
+    memset(&ci, 0, sizeof(ci));
+    
+    return res;
+#else
+    return 0;
+#endif
+}
+
+static void connection_ktls_stop (BSSLConnection *o, int state)
+{
+    ASSERT(state == KTLS_STATE_NONE || state == KTLS_STATE_ON)
+    
+    // receive normally again
+    o->backend->recv_exact = 0;
+    
+    // secrets are no longer needed
+    backend_ktls_free_secrets(o->backend);
+    
+    // set state
+    o->ktls_state = state;
+}
+
+static void connection_ktls_try_switch (BSSLConnection *o)
+{
+    struct BSSLConnection_backend *b = o->backend;
+    ASSERT(!o->have_error)
+    ASSERT(o->ktls_state == KTLS_STATE_DRAIN)
+    ASSERT(b->threadwork_state == THREADWORK_STATE_NONE)
+    
+    // wait until the end of the handshake has been sent
+    if (b->send_pos < b->send_len) {
+        ASSERT(b->send_busy)
+        return;
+    }
+    
+    // Both directions must be offloaded. If only sending was, NSS would still
+    // process post-handshake messages, and could not send what they require.
+    // Receiving is offloaded first since older kernels only support sending;
+    // if it fails, nothing was offloaded and NSS continues.
+    if (!connection_ktls_enable(o, 1)) {
+        BLog(BLOG_WARNING, "failed to offload receiving to kernel TLS, using NSS");
+        connection_ktls_stop(o, KTLS_STATE_NONE);
+        connection_handshake_finish(o);
+        return;
+    }
+    b->ktls_rx = 1;
+    
+    // offload sending; NSS can no longer take over now
+    if (!connection_ktls_enable(o, 0)) {
+        BLog(BLOG_ERROR, "failed to offload sending to kernel TLS");
+        connection_ktls_stop(o, KTLS_STATE_ON);
+        connection_report_error(o);
+        return;
+    }
+    b->ktls_tx = 1;
+    
+    BLog(BLOG_INFO, "using kernel TLS");
+    
+    connection_ktls_stop(o, KTLS_STATE_ON);
+    connection_handshake_finish(o);
+    return;
+}
+
+static void connection_ktls_try_io (BSSLConnection *o)
+{
+    struct BSSLConnection_backend *b = o->backend;
+    ASSERT(!o->have_error)
+    ASSERT(o->up)
+    ASSERT(o->ktls_state == KTLS_STATE_ON)
+    ASSERT(b->ktls_tx)
+    ASSERT(b->ktls_rx)
+    
+    // pass send data to the connection
+    if (o->send_len > 0 && !b->send_busy) {
+        b->send_busy = 1;
+        StreamPassInterface_Sender_Send(b->send_if, (uint8_t *)o->send_data, o->send_len);
+    }
+    
+    // receive from the connection into the user's buffer
+    if (o->recv_avail > 0 && !b->recv_busy) {
+        b->recv_busy = 1;
+        StreamRecvInterface_Receiver_Recv(b->recv_if, o->recv_data, o->recv_avail);
+    }
+}
+
 static void connection_try_io (BSSLConnection *o)
 {
     DebugObject_Access(&o->d_obj);
     ASSERT(!o->have_error)
     
-    if (!o->up) {
+    if (o->ktls_state == KTLS_STATE_DRAIN) {
+        connection_ktls_try_switch(o);
+        return;
+    }
+    
+    if (!o->up || o->ktls_state == KTLS_STATE_HANDSHAKE) {
         connection_try_handshake(o);
         return;
     }
     
+    if (o->ktls_state == KTLS_STATE_ON) {
+        connection_ktls_try_io(o);
+        return;
+    }
+    
     if (o->send_len > 0) {
         if (o->recv_avail > 0) {
             BPending_Set(&o->recv_job);
@@ -528,7 +977,7 @@ static void connection_threadwork_handler_done (void *user)
     
     switch (op) {
         case THREADWORK_STATE_HANDSHAKE: {
-            ASSERT(!o->up)
+            ASSERT(!o->up || o->ktls_state == KTLS_STATE_HANDSHAKE)
             ASSERT((b->flags & BSSLCONNECTION_FLAG_THREADWORK_HANDSHAKE))
             
             if (b->threadwork_result_sec == SECFailure) {
@@ -544,11 +993,8 @@ static void connection_threadwork_handler_done (void *user)
                 return;
             }
             
-            // init up
-            connection_init_up(o);
-            
-            // report up
-            o->handler(o->user, BSSLCONNECTION_EVENT_UP);
+            // handshake done
+            connection_handshake_done(o);
             return;
         } break;
         
@@ -657,7 +1103,7 @@ static void connection_recv_job_handler (BSSLConnection *o)
 static void connection_try_handshake (BSSLConnection *o)
 {
     ASSERT(!o->have_error)
-    ASSERT(!o->up)
+    ASSERT(!o->up || o->ktls_state == KTLS_STATE_HANDSHAKE)
     
     // continue in threadwork if requested
     if ((o->backend->flags & BSSLCONNECTION_FLAG_THREADWORK_HANDSHAKE)) {
@@ -679,11 +1125,8 @@ static void connection_try_handshake (BSSLConnection *o)
         return;
     }
     
-    // init up
-    connection_init_up(o);
-    
-    // report up
-    o->handler(o->user, BSSLCONNECTION_EVENT_UP);
+    // handshake done
+    connection_handshake_done(o);
     return;
 }
 
@@ -691,6 +1134,7 @@ static void connection_try_send (BSSLConnection *o)
 {
     ASSERT(!o->have_error)
     ASSERT(o->up)
+    ASSERT(o->ktls_state == KTLS_STATE_NONE)
     ASSERT(o->send_len > 0)
     
     // continue in threadwork if requested
@@ -727,6 +1171,7 @@ static void connection_try_recv (BSSLConnection *o)
 {
     ASSERT(!o->have_error)
     ASSERT(o->up)
+    ASSERT(o->ktls_state == KTLS_STATE_NONE)
     ASSERT(o->recv_avail > 0)
     
     // unset recv job
@@ -790,6 +1235,12 @@ static void connection_send_if_handler_send (BSSLConnection *o, uint8_t *data, i
     o->send_data = data;
     o->send_len = data_len;
     
+    // finish handshake or use kernel TLS
+    if (o->ktls_state != KTLS_STATE_NONE) {
+        connection_try_io(o);
+        return;
+    }
+    
     // start sending
     connection_try_send(o);
 }
@@ -816,6 +1267,12 @@ static void connection_recv_if_handler_recv (BSSLConnection *o, uint8_t *data, i
     o->recv_data = data;
     o->recv_avail = data_len;
     
+    // finish handshake or use kernel TLS
+    if (o->ktls_state != KTLS_STATE_NONE) {
+        connection_try_io(o);
+        return;
+    }
+    
     // start receiving
     connection_try_recv(o);
 }
@@ -834,10 +1291,11 @@ int BSSLConnection_GlobalInit (void)
     return 1;
 }
 
-int BSSLConnection_MakeBackend (PRFileDesc *prfd, StreamPassInterface *send_if, StreamRecvInterface *recv_if, BThreadWorkDispatcher *twd, int flags)
+static int make_backend (PRFileDesc *prfd, StreamPassInterface *send_if, StreamRecvInterface *recv_if, BConnection *bcon, BThreadWorkDispatcher *twd, int flags)
 {
     ASSERT(bprconnection_initialized)
-    ASSERT(!(flags & ~(BSSLCONNECTION_FLAG_THREADWORK_HANDSHAKE | BSSLCONNECTION_FLAG_THREADWORK_IO)))
+    ASSERT(!(flags & ~(BSSLCONNECTION_FLAG_THREADWORK_HANDSHAKE | BSSLCONNECTION_FLAG_THREADWORK_IO | BSSLCONNECTION_FLAG_KTLS)))
+    ASSERT(!(flags & BSSLCONNECTION_FLAG_KTLS) || bcon)
     ASSERT(!(flags & BSSLCONNECTION_FLAG_THREADWORK_HANDSHAKE) || twd)
     ASSERT(!(flags & BSSLCONNECTION_FLAG_THREADWORK_IO) || twd)
     
@@ -872,6 +1330,7 @@ int BSSLConnection_MakeBackend (PRFileDesc *prfd, StreamPassInterface *send_if,
     // init arguments
     b->send_if = send_if;
     b->recv_if = recv_if;
+    b->bcon = bcon;
     b->twd = twd;
     b->flags = flags;
     
@@ -886,11 +1345,19 @@ int BSSLConnection_MakeBackend (PRFileDesc *prfd, StreamPassInterface *send_if,
     b->send_busy = 0;
     b->send_len = 0;
     b->send_pos = 0;
+    b->send_refused = 0;
     
     // init recv buffer
     b->recv_busy = 0;
     b->recv_pos = 0;
     b->recv_len = 0;
+    b->recv_exact = 0;
+    
+    // set no kernel TLS
+    b->ktls_read_secret = NULL;
+    b->ktls_write_secret = NULL;
+    b->ktls_tx = 0;
+    b->ktls_rx = 0;
     
     // set threadwork state
     b->threadwork_state = THREADWORK_STATE_NONE;
@@ -913,6 +1380,21 @@ fail0:
     return 0;
 }
 
+int BSSLConnection_MakeBackend (PRFileDesc *prfd, StreamPassInterface *send_if, StreamRecvInterface *recv_if, BThreadWorkDispatcher *twd, int flags)
+{
+    // kernel TLS needs the socket
+    flags &= ~BSSLCONNECTION_FLAG_KTLS;
+    
+    return make_backend(prfd, send_if, recv_if, NULL, twd, flags);
+}
+
+int BSSLConnection_MakeConnectionBackend (PRFileDesc *prfd, BConnection *con, BThreadWorkDispatcher *twd, int flags)
+{
+    ASSERT(con)
+    
+    return make_backend(prfd, BConnection_SendAsync_GetIf(con), BConnection_RecvAsync_GetIf(con), con, twd, flags);
+}
+
 void BSSLConnection_Init (BSSLConnection *o, PRFileDesc *prfd, int force_handshake, BPendingGroup *pg, void *user,
                           BSSLConnection_handler handler)
 {
@@ -936,6 +1418,16 @@ void BSSLConnection_Init (BSSLConnection *o, PRFileDesc *prfd, int force_handsha
     // set have no error
     o->have_error = 0;
     
+    // prepare for switching to kernel TLS after the handshake
+    o->ktls_state = KTLS_STATE_NONE;
+    if ((o->backend->flags & BSSLCONNECTION_FLAG_KTLS)) {
+        if (connection_ktls_init(o)) {
+            o->ktls_state = KTLS_STATE_HANDSHAKE;
+        } else {
+            BLog(BLOG_WARNING, "cannot use kernel TLS, using NSS");
+        }
+    }
+    
     // init init job
     BPending_Init(&o->init_job, o->pg, (BPending_handler)connection_init_job_handler, o);
     
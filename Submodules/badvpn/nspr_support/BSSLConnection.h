@@ -32,6 +32,7 @@
 
 #include <prio.h>
 #include <ssl.h>
+#include <pk11pub.h>
 
 #include <misc/debug.h>
 #include <misc/debugerror.h>
@@ -40,6 +41,7 @@
 #include <base/BMutex.h>
 #include <flow/StreamPassInterface.h>
 #include <flow/StreamRecvInterface.h>
+#include <system/BConnection.h>
 #include <threadwork/BThreadWork.h>
 
 #define BSSLCONNECTION_EVENT_UP 1
@@ -49,6 +51,9 @@
 
 #define BSSLCONNECTION_FLAG_THREADWORK_HANDSHAKE (1 << 0)
 #define BSSLCONNECTION_FLAG_THREADWORK_IO (1 << 1)
+// after a TLS 1.3 handshake, let the kernel encrypt and decrypt records (Linux only,
+// needs BSSLConnection_MakeConnectionBackend); falls back to NSS if not possible
+#define BSSLCONNECTION_FLAG_KTLS (1 << 2)
 
 typedef void (*BSSLConnection_handler) (void *user, int event);
 
@@ -62,6 +67,9 @@ typedef struct {
     struct BSSLConnection_backend *backend;
     int have_error;
     int up;
+    int ktls_state;
+    PRUint16 ktls_version;
+    PRUint16 ktls_cipher_suite;
     BPending init_job;
     StreamPassInterface send_if;
     StreamRecvInterface recv_if;
@@ -81,6 +89,7 @@ typedef struct {
 struct BSSLConnection_backend {
     StreamPassInterface *send_if;
     StreamRecvInterface *recv_if;
+    BConnection *bcon;
     BThreadWorkDispatcher *twd;
     int flags;
     BSSLConnection *con;
@@ -88,13 +97,20 @@ struct BSSLConnection_backend {
     int send_busy;
     int send_pos;
     int send_len;
+    int send_refused;
     uint8_t recv_buf[BSSLCONNECTION_BUF_SIZE];
     int recv_busy;
     int recv_pos;
     int recv_len;
+    int recv_exact;
+    PK11SymKey *ktls_read_secret;
+    PK11SymKey *ktls_write_secret;
+    int ktls_tx;
+    int ktls_rx;
     int threadwork_state;
     int threadwork_want_recv;
     int threadwork_want_send;
+    int threadwork_recv_amount;
     BThreadWork threadwork;
     SECStatus threadwork_result_sec;
     PRInt32 threadwork_result_pr;
@@ -105,6 +121,7 @@ struct BSSLConnection_backend {
 
 int BSSLConnection_GlobalInit (void) WARN_UNUSED;
 int BSSLConnection_MakeBackend (PRFileDesc *prfd, StreamPassInterface *send_if, StreamRecvInterface *recv_if, BThreadWorkDispatcher *twd, int flags) WARN_UNUSED;
+int BSSLConnection_MakeConnectionBackend (PRFileDesc *prfd, BConnection *con, BThreadWorkDispatcher *twd, int flags) WARN_UNUSED;
 
 void BSSLConnection_Init (BSSLConnection *o, PRFileDesc *prfd, int force_handshake, BPendingGroup *pg, void *user,
                           BSSLConnection_handler handler);
@@ -44,7 +44,53 @@
 
 #include <generated/blog_channel_BPredicate.h>
 
-static int eval_predicate_node (BPredicate *p, struct predicate_node *root);
+// Instructions of a compiled predicate. The predicate is evaluated on a
+// stack of boolean values; function calls pop their boolean arguments and
+// push the result, and AND/OR short-circuit by jumping over the second
+// operand, leaving the value of the first operand on the stack.
+#define INSN_CONST 1
+#define INSN_NOT 2
+#define INSN_JUMP_IF_FALSE 3
+#define INSN_JUMP_IF_TRUE 4
+#define INSN_CALL 5
+#define INSN_ERROR 6
+
+struct predicate_insn {
+    int type;
+    union {
+        int val;
+        int target;
+        struct {
+            BPredicateFunction *func;
+            struct arguments_node *args;
+            int num_bool_args;
+        } call;
+        const char *error;
+    };
+};
+
+struct predicate_code {
+    struct predicate_insn *insns;
+    int num_insns;
+    int *stack;
+    int stack_size;
+};
+
+struct compiler {
+    BPredicate *p;
+    struct predicate_insn *insns;
+    struct predicate_insn scratch;
+    int num_insns;
+    int depth;
+    int max_depth;
+};
+
+static struct predicate_insn * emit (struct compiler *c, int type, int depth_change);
+static void emit_error (struct compiler *c, int start_depth, const char *error);
+static void compile_function (struct compiler *c, struct predicate_node *root);
+static void compile_node (struct compiler *c, struct predicate_node *root);
+static int compile (BPredicate *p);
+static void free_code (BPredicate *p);
 
 void yyerror (YYLTYPE *yylloc, yyscan_t scanner, struct predicate_node **result, char *str)
 {
@@ -56,44 +102,69 @@ static int string_comparator (void *user, char *s1, char *s2)
     return B_COMPARE(cmp, 0);
 }
 
-static int eval_function (BPredicate *p, struct predicate_node *root)
+struct predicate_insn * emit (struct compiler *c, int type, int depth_change)
+{
+    // when only counting instructions, write to a scratch instruction
+    struct predicate_insn *insn = (c->insns ? &c->insns[c->num_insns] : &c->scratch);
+    insn->type = type;
+    
+    c->num_insns++;
+    c->depth += depth_change;
+    if (c->depth > c->max_depth) {
+        c->max_depth = c->depth;
+    }
+    
+    return insn;
+}
+
+void emit_error (struct compiler *c, int start_depth, const char *error)
+{
+    // Count the error as the one result the call would have pushed, dropping any
+    // arguments compiled before it. Evaluation stops at the error, but it may be
+    // jumped over, and the code after it must be counted from the right depth.
+    emit(c, INSN_ERROR, start_depth + 1 - c->depth)->error = error;
+}
+
+void compile_function (struct compiler *c, struct predicate_node *root)
 {
     ASSERT(root->type == NODE_FUNCTION)
     
+    // Errors in the call are found here, but are reported only when evaluation
+    // reaches them, after the arguments preceding the error have been evaluated.
+    
+    int start_depth = c->depth;
+    
     // lookup function by name
     ASSERT(root->function.name)
     BAVLNode *tree_node;
-    if (!(tree_node = BAVL_LookupExact(&p->functions_tree, root->function.name))) {
-        BLog(BLOG_WARNING, "unknown function");
-        return 0;
+    if (!(tree_node = BAVL_LookupExact(&c->p->functions_tree, root->function.name))) {
+        emit_error(c, start_depth, "unknown function");
+        return;
     }
     BPredicateFunction *func = UPPER_OBJECT(tree_node, BPredicateFunction, tree_node);
     
-    // evaluate arguments
+    // compile arguments
     struct arguments_node *arg = root->function.args;
-    void *args[PREDICATE_MAX_ARGS];
+    int num_bool_args = 0;
     for (int i = 0; i < func->num_args; i++) {
         if (!arg) {
-            BLog(BLOG_WARNING, "not enough arguments");
-            return 0;
+            emit_error(c, start_depth, "not enough arguments");
+            return;
         }
         switch (func->args[i]) {
             case PREDICATE_TYPE_BOOL:
                 if (arg->arg.type != ARGUMENT_PREDICATE) {
-                    BLog(BLOG_WARNING, "expecting predicate argument");
-                    return 0;
-                }
-                if (!eval_predicate_node(p, arg->arg.predicate)) {
-                    return 0;
+                    emit_error(c, start_depth, "expecting predicate argument");
+                    return;
                 }
-                args[i] = &arg->arg.predicate->eval_value;
+                compile_node(c, arg->arg.predicate);
+                num_bool_args++;
                 break;
             case PREDICATE_TYPE_STRING:
                 if (arg->arg.type != ARGUMENT_STRING) {
-                    BLog(BLOG_WARNING, "expecting string argument");
-                    return 0;
+                    emit_error(c, start_depth, "expecting string argument");
+                    return;
                 }
-                args[i] = arg->arg.string;
                 break;
             default:
                 ASSERT(0);
@@ -102,83 +173,120 @@ static int eval_function (BPredicate *p, struct predicate_node *root)
     }
     
     if (arg) {
-        BLog(BLOG_WARNING, "too many arguments");
-        return 0;
-    }
-    
-    // call callback
-    #ifndef NDEBUG
-    p->in_function = 1;
-    #endif
-    int res = func->callback(func->user, args);
-    #ifndef NDEBUG
-    p->in_function = 0;
-    #endif
-    if (res != 0 && res != 1) {
-        BLog(BLOG_WARNING, "callback returned non-boolean");
-        return 0;
+        emit_error(c, start_depth, "too many arguments");
+        return;
     }
     
-    root->eval_value = res;
-    return 1;
+    // call, popping the boolean arguments and pushing the result
+    struct predicate_insn *insn = emit(c, INSN_CALL, 1 - num_bool_args);
+    insn->call.func = func;
+    insn->call.args = root->function.args;
+    insn->call.num_bool_args = num_bool_args;
 }
 
-int eval_predicate_node (BPredicate *p, struct predicate_node *root)
+void compile_node (struct compiler *c, struct predicate_node *root)
 {
     ASSERT(root)
     
     switch (root->type) {
-        case NODE_CONSTANT:
-            root->eval_value = root->constant.val;
-            return 1;
-        case NODE_NEG:
-            if (!eval_predicate_node(p, root->neg.op)) {
-                return 0;
-            }
-            root->eval_value = !root->neg.op->eval_value;
-            return 1;
+        case NODE_CONSTANT: {
+            emit(c, INSN_CONST, 1)->val = root->constant.val;
+        } break;
+        case NODE_NEG: {
+            compile_node(c, root->neg.op);
+            emit(c, INSN_NOT, 0);
+        } break;
         case NODE_CONJUNCT:
-            if (!eval_predicate_node(p, root->conjunct.op1)) {
-                return 0;
-            }
-            if (!root->conjunct.op1->eval_value) {
-                root->eval_value = 0;
-                return 1;
-            }
-            if (!eval_predicate_node(p, root->conjunct.op2)) {
-                return 0;
-            }
-            if (!root->conjunct.op2->eval_value) {
-                root->eval_value = 0;
-                return 1;
-            }
-            root->eval_value = 1;
-            return 1;
-        case NODE_DISJUNCT:
-            if (!eval_predicate_node(p, root->disjunct.op1)) {
-                return 0;
-            }
-            if (root->disjunct.op1->eval_value) {
-                root->eval_value = 1;
-                return 1;
-            }
-            if (!eval_predicate_node(p, root->disjunct.op2)) {
-                return 0;
-            }
-            if (root->disjunct.op2->eval_value) {
-                root->eval_value = 1;
-                return 1;
-            }
-            root->eval_value = 0;
-            return 1;
-        case NODE_FUNCTION:
-            return eval_function(p, root);
+        case NODE_DISJUNCT: {
+            struct predicate_node *op1 = (root->type == NODE_CONJUNCT ? root->conjunct.op1 : root->disjunct.op1);
+            struct predicate_node *op2 = (root->type == NODE_CONJUNCT ? root->conjunct.op2 : root->disjunct.op2);
+            
+            compile_node(c, op1);
+            
+            // jump over the second operand if the first decides the result,
+            // otherwise pop the first operand
+            struct predicate_insn *jump = emit(c, (root->type == NODE_CONJUNCT ? INSN_JUMP_IF_FALSE : INSN_JUMP_IF_TRUE), -1);
+            
+            compile_node(c, op2);
+            
+            jump->target = c->num_insns;
+        } break;
+        case NODE_FUNCTION: {
+            compile_function(c, root);
+        } break;
         default:
-            ASSERT(0)
-            return 0;
+            ASSERT(0);
     }
 }
 
+int compile (BPredicate *p)
+{
+    ASSERT(!p->code)
+    
+    struct compiler c;
+    c.p = p;
+    
+    // count instructions and stack depth
+    c.insns = NULL;
+    c.num_insns = 0;
+    c.depth = 0;
+    c.max_depth = 0;
+    compile_node(&c, (struct predicate_node *)p->root);
+    
+    // allocate code structure
+    struct predicate_code *code = (struct predicate_code *)malloc(sizeof(*code));
+    if (!code) {
+        BLog(BLOG_ERROR, "malloc failed");
+        goto fail0;
+    }
+    
+    // allocate instructions
+    if (!(code->insns = (struct predicate_insn *)BAllocArray(c.num_insns, sizeof(code->insns[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail1;
+    }
+    
+    // allocate stack
+    if (!(code->stack = (int *)BAllocArray(c.max_depth, sizeof(code->stack[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail2;
+    }
+    code->stack_size = c.max_depth;
+    
+    // generate instructions
+    c.insns = code->insns;
+    c.num_insns = 0;
+    c.depth = 0;
+    compile_node(&c, (struct predicate_node *)p->root);
+    code->num_insns = c.num_insns;
+    
+    p->code = code;
+    
+    return 1;
+    
+fail2:
+    BFree(code->insns);
+fail1:
+    free(code);
+fail0:
+    return 0;
+}
+
+void free_code (BPredicate *p)
+{
+    struct predicate_code *code = (struct predicate_code *)p->code;
+    
+    if (!code) {
+        return;
+    }
+    
+    BFree(code->stack);
+    BFree(code->insns);
+    free(code);
+    
+    p->code = NULL;
+}
+
 int BPredicate_Init (BPredicate *p, char *str)
 {
     // initialize input buffer object
@@ -210,6 +318,9 @@ int BPredicate_Init (BPredicate *p, char *str)
     // init functions tree
     BAVL_Init(&p->functions_tree, OFFSET_DIFF(BPredicateFunction, name, tree_node), (BAVL_comparator)string_comparator, NULL);
     
+    // not compiled yet
+    p->code = NULL;
+    
     // init debuggind
     #ifndef NDEBUG
     p->in_function = 0;
@@ -229,6 +340,9 @@ void BPredicate_Free (BPredicate *p)
     // free debug object
     DebugObject_Free(&p->d_obj);
     
+    // free compiled code
+    free_code(p);
+    
     // free tree
     free_predicate_node((struct predicate_node *)p->root);
 }
@@ -237,11 +351,99 @@ int BPredicate_Eval (BPredicate *p)
 {
     ASSERT(!p->in_function)
     
-    if (!eval_predicate_node(p, (struct predicate_node *)p->root)) {
+    // compile if not compiled for the current set of functions
+    if (!p->code && !compile(p)) {
         return -1;
     }
     
-    return ((struct predicate_node *)p->root)->eval_value;
+    struct predicate_code *code = (struct predicate_code *)p->code;
+    int *stack = code->stack;
+    int sp = 0;
+    
+    int pc = 0;
+    while (pc < code->num_insns) {
+        struct predicate_insn *insn = &code->insns[pc++];
+        
+        switch (insn->type) {
+            case INSN_CONST: {
+                ASSERT(sp < code->stack_size)
+                stack[sp++] = insn->val;
+            } break;
+            
+            case INSN_NOT: {
+                ASSERT(sp > 0)
+                stack[sp - 1] = !stack[sp - 1];
+            } break;
+            
+            case INSN_JUMP_IF_FALSE: {
+                ASSERT(sp > 0)
+                if (!stack[sp - 1]) {
+                    pc = insn->target;
+                } else {
+                    sp--;
+                }
+            } break;
+            
+            case INSN_JUMP_IF_TRUE: {
+                ASSERT(sp > 0)
+                if (stack[sp - 1]) {
+                    pc = insn->target;
+                } else {
+                    sp--;
+                }
+            } break;
+            
+            case INSN_CALL: {
+                BPredicateFunction *func = insn->call.func;
+                ASSERT(sp >= insn->call.num_bool_args)
+                
+                // pop boolean arguments; they stay in place until the callback returns
+                sp -= insn->call.num_bool_args;
+                int *bool_arg = &stack[sp];
+                
+                // build arguments
+                struct arguments_node *arg = insn->call.args;
+                void *args[PREDICATE_MAX_ARGS];
+                for (int i = 0; i < func->num_args; i++) {
+                    ASSERT(arg)
+                    if (func->args[i] == PREDICATE_TYPE_BOOL) {
+                        args[i] = bool_arg++;
+                    } else {
+                        args[i] = arg->arg.string;
+                    }
+                    arg = arg->next;
+                }
+                
+                // call callback
+                #ifndef NDEBUG
+                p->in_function = 1;
+                #endif
+                int res = func->callback(func->user, args);
+                #ifndef NDEBUG
+                p->in_function = 0;
+                #endif
+                if (res != 0 && res != 1) {
+                    BLog(BLOG_WARNING, "callback returned non-boolean");
+                    return -1;
+                }
+                
+                ASSERT(sp < code->stack_size)
+                stack[sp++] = res;
+            } break;
+            
+            case INSN_ERROR: {
+                BLog(BLOG_WARNING, "%s", insn->error);
+                return -1;
+            } break;
+            
+            default:
+                ASSERT(0);
+        }
+    }
+    
+    ASSERT(sp == 1)
+    
+    return stack[0];
 }
 
 void BPredicateFunction_Init (BPredicateFunction *o, BPredicate *p, char *name, int *args, int num_args, BPredicate_callback callback, void *user)
@@ -266,6 +468,9 @@ void BPredicateFunction_Init (BPredicateFunction *o, BPredicate *p, char *name,
     // add to tree
     ASSERT_EXECUTE(BAVL_Insert(&p->functions_tree, &o->tree_node, NULL))
     
+    // set of functions changed, recompile on next evaluation
+    free_code(p);
+    
     // init debug object
     DebugObject_Init(&o->d_obj);
 }
@@ -281,4 +486,7 @@ void BPredicateFunction_Free (BPredicateFunction *o)
     
     // remove from tree
     BAVL_Remove(&p->functions_tree, &o->tree_node);
+    
+    // set of functions changed, recompile on next evaluation
+    free_code(p);
 }
@@ -72,6 +72,11 @@
  *     Then the handler function is called. If it returns anything other
  *     than 1 and 0, the function evaluates to error. Otherwise it evaluates
  *     to what the handler function returned.
+ * 
+ * The expression is compiled into a flat sequence of instructions, with
+ * function names already resolved, on the first evaluation after the set
+ * of custom functions changes. Repeated evaluations therefore don't walk
+ * the expression tree or look up functions.
  */
 
 #ifndef BADVPN_PREDICATE_BPREDICATE_H
@@ -107,6 +112,7 @@ typedef struct {
     DebugObject d_obj;
     void *root;
     BAVL functions_tree;
+    void *code;
     #ifndef NDEBUG
     int in_function;
     #endif
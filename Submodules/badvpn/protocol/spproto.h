@@ -31,7 +31,8 @@
  * Protocol for securing datagram communication.
  * 
  * Security features implemented:
- *   - Encryption. Encrypts packets with a block cipher.
+ *   - Encryption. Encrypts packets with a block cipher, or with
+ *     an AEAD cipher.
  *     Protects against a third party from seeing the data
  *     being transmitted.
  *   - Hashes. Adds a hash of the packet into the packet.
@@ -47,11 +48,22 @@
  *   - if hashes are used, the hash,
  *   - payload data.
  * 
- * If encryption is used:
+ * If encryption with a block cipher is used:
  *   - the plaintext is padded by appending a 0x01 byte and as many 0x00
  *     bytes as needed to align to block size,
  *   - the padded plaintext is encrypted, and
  *   - the initialization vector (IV) is prepended.
+ * 
+ * If encryption with an AEAD cipher is used, hashes must not be used, since
+ * the cipher authenticates the packet itself. The encoded packet is then:
+ *   - the nonce,
+ *   - the encrypted plaintext, without padding,
+ *   - the authentication tag.
+ * 
+ * The nonce is a salt followed by a 64-bit big-endian packet counter, which
+ * the sender starts at zero for every key. The salt is random for every key,
+ * except that its top bit differs between the two peers sharing the key, so
+ * nonces never repeat under a key.
  */
 
 #ifndef BADVPN_PROTOCOL_SPPROTO_H
@@ -112,6 +124,12 @@ struct spproto_security_params {
 
 #define SPPROTO_HAVE_ENCRYPTION(_params) ((_params).encryption_mode != SPPROTO_ENCRYPTION_MODE_NONE)
 
+#define SPPROTO_HAVE_AEAD(_params) (SPPROTO_HAVE_ENCRYPTION(_params) && BEncryption_cipher_is_aead((_params).encryption_mode))
+#define SPPROTO_AEAD_NONCE_LEN(_params) BEncryption_cipher_nonce_size((_params).encryption_mode)
+#define SPPROTO_AEAD_TAG_LEN(_params) BEncryption_cipher_tag_size((_params).encryption_mode)
+#define SPPROTO_AEAD_NONCE_COUNTER_LEN 8
+#define SPPROTO_AEAD_NONCE_SALT_LEN(_params) (SPPROTO_AEAD_NONCE_LEN(_params) - SPPROTO_AEAD_NONCE_COUNTER_LEN)
+
 #define SPPROTO_HAVE_OTP(_params) ((_params).otp_mode != SPPROTO_OTP_MODE_NONE)
 
 B_START_PACKED
@@ -137,6 +155,8 @@ static void spproto_assert_security_params (struct spproto_security_params param
     ASSERT(params.hash_mode == SPPROTO_HASH_MODE_NONE || BHash_type_valid(params.hash_mode))
     ASSERT(params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE || BEncryption_cipher_valid(params.encryption_mode))
     ASSERT(params.otp_mode == SPPROTO_OTP_MODE_NONE || BEncryption_cipher_valid(params.otp_mode))
+    ASSERT(params.otp_mode == SPPROTO_OTP_MODE_NONE || !BEncryption_cipher_is_aead(params.otp_mode))
+    ASSERT(!SPPROTO_HAVE_AEAD(params) || !SPPROTO_HAVE_HASH(params))
     ASSERT(params.otp_mode == SPPROTO_OTP_MODE_NONE || params.otp_num > 0)
 }
 
@@ -156,6 +176,8 @@ static int spproto_payload_mtu_for_carrier_mtu (struct spproto_security_params p
     
     if (params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE) {
         return (carrier_mtu - SPPROTO_HEADER_LEN(params));
+    } else if (SPPROTO_HAVE_AEAD(params)) {
+        return (carrier_mtu - SPPROTO_AEAD_NONCE_LEN(params) - SPPROTO_HEADER_LEN(params) - SPPROTO_AEAD_TAG_LEN(params));
     } else {
         int block_size = BEncryption_cipher_block_size(params.encryption_mode);
         return (balign_down(carrier_mtu, block_size) - block_size - SPPROTO_HEADER_LEN(params) - 1);
@@ -181,6 +203,14 @@ static int spproto_carrier_mtu_for_payload_mtu (struct spproto_security_params p
         }
         
         return (SPPROTO_HEADER_LEN(params) + payload_mtu);
+    } else if (SPPROTO_HAVE_AEAD(params)) {
+        int overhead = SPPROTO_AEAD_NONCE_LEN(params) + SPPROTO_HEADER_LEN(params) + SPPROTO_AEAD_TAG_LEN(params);
+        
+        if (payload_mtu > INT_MAX - overhead) {
+            return -1;
+        }
+        
+        return (overhead + payload_mtu);
     } else {
         int block_size = BEncryption_cipher_block_size(params.encryption_mode);
         
@@ -31,19 +31,183 @@
 
 #include <security/BEncryption.h>
 
+#ifdef BENCRYPTION_HAVE_AESNI
+#include <wmmintrin.h>
+#endif
+
 #include <generated/blog_channel_BEncryption.h>
 
+#ifndef EVP_CTRL_AEAD_GET_TAG
+#define EVP_CTRL_AEAD_GET_TAG EVP_CTRL_GCM_GET_TAG
+#define EVP_CTRL_AEAD_SET_TAG EVP_CTRL_GCM_SET_TAG
+#endif
+
+static const EVP_CIPHER * aead_evp_cipher (int cipher)
+{
+    switch (cipher) {
+        case BENCRYPTION_CIPHER_AES_GCM:
+            return EVP_aes_128_gcm();
+        #ifdef BENCRYPTION_HAVE_CHACHA20_POLY1305
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            return EVP_chacha20_poly1305();
+        #endif
+        default:
+            ASSERT(0)
+            return NULL;
+    }
+}
+
+#ifdef BENCRYPTION_HAVE_AESNI
+
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+#define AESNI_EXPAND_ROUND(_k, _rcon) aesni_expand_round((_k), _mm_aeskeygenassist_si128((_k), (_rcon)))
+
+AESNI_TARGET static __m128i aesni_expand_round (__m128i key, __m128i assist)
+{
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+AESNI_TARGET static void aesni_expand_key (const uint8_t *key, uint8_t *enc_keys, uint8_t *dec_keys)
+{
+    __m128i k[11];
+    
+    k[0] = _mm_loadu_si128((const __m128i *)key);
+    k[1] = AESNI_EXPAND_ROUND(k[0], 0x01);
+    k[2] = AESNI_EXPAND_ROUND(k[1], 0x02);
+    k[3] = AESNI_EXPAND_ROUND(k[2], 0x04);
+    k[4] = AESNI_EXPAND_ROUND(k[3], 0x08);
+    k[5] = AESNI_EXPAND_ROUND(k[4], 0x10);
+    k[6] = AESNI_EXPAND_ROUND(k[5], 0x20);
+    k[7] = AESNI_EXPAND_ROUND(k[6], 0x40);
+    k[8] = AESNI_EXPAND_ROUND(k[7], 0x80);
+    k[9] = AESNI_EXPAND_ROUND(k[8], 0x1b);
+    k[10] = AESNI_EXPAND_ROUND(k[9], 0x36);
+    
+    // decryption uses the keys in reverse, with InvMixColumns applied
+    // to the middle ones
+    for (int i = 0; i < 11; i++) {
+        __m128i dk = (i == 0 || i == 10) ? k[10 - i] : _mm_aesimc_si128(k[10 - i]);
+        _mm_storeu_si128((__m128i *)(enc_keys + 16 * i), k[i]);
+        _mm_storeu_si128((__m128i *)(dec_keys + 16 * i), dk);
+    }
+}
+
+// CBC encryption of a buffer is serial, so bursts are encrypted in lanes;
+// each step processes the next block of every buffer which still has one,
+// so that the rounds for different buffers can be executed in parallel.
+AESNI_TARGET static void aesni_cbc_encrypt (const uint8_t *keys, int num, uint8_t **in, uint8_t **out, const int *len, uint8_t **iv)
+{
+    __m128i k[11];
+    for (int i = 0; i < 11; i++) {
+        k[i] = _mm_loadu_si128((const __m128i *)(keys + 16 * i));
+    }
+    
+    __m128i chain[BENCRYPTION_MAX_BURST];
+    int max_len = 0;
+    for (int j = 0; j < num; j++) {
+        chain[j] = _mm_loadu_si128((const __m128i *)iv[j]);
+        if (len[j] > max_len) {
+            max_len = len[j];
+        }
+    }
+    
+    for (int pos = 0; pos < max_len; pos += 16) {
+        int lanes[BENCRYPTION_MAX_BURST];
+        __m128i s[BENCRYPTION_MAX_BURST];
+        int n = 0;
+        
+        for (int j = 0; j < num; j++) {
+            if (pos < len[j]) {
+                __m128i b = _mm_loadu_si128((const __m128i *)(in[j] + pos));
+                s[n] = _mm_xor_si128(_mm_xor_si128(b, chain[j]), k[0]);
+                lanes[n++] = j;
+            }
+        }
+        
+        for (int r = 1; r < 10; r++) {
+            for (int l = 0; l < n; l++) {
+                s[l] = _mm_aesenc_si128(s[l], k[r]);
+            }
+        }
+        
+        for (int l = 0; l < n; l++) {
+            int j = lanes[l];
+            chain[j] = _mm_aesenclast_si128(s[l], k[10]);
+            _mm_storeu_si128((__m128i *)(out[j] + pos), chain[j]);
+        }
+    }
+    
+    for (int j = 0; j < num; j++) {
+        _mm_storeu_si128((__m128i *)iv[j], chain[j]);
+    }
+}
+
+// CBC decryption of a single buffer is already parallel; the blocks are
+// independent, and the CPU overlaps consecutive iterations.
+
+AESNI_TARGET static void aesni_cbc_decrypt (const uint8_t *keys, uint8_t *in, uint8_t *out, int len, uint8_t *iv)
+{
+    __m128i k[11];
+    for (int i = 0; i < 11; i++) {
+        k[i] = _mm_loadu_si128((const __m128i *)(keys + 16 * i));
+    }
+    
+    __m128i chain = _mm_loadu_si128((const __m128i *)iv);
+    
+    for (int pos = 0; pos < len; pos += 16) {
+        // load ciphertext before writing, in case out is the same as in
+        __m128i c = _mm_loadu_si128((const __m128i *)(in + pos));
+        __m128i s = _mm_xor_si128(c, k[0]);
+        
+        for (int r = 1; r < 10; r++) {
+            s = _mm_aesdec_si128(s, k[r]);
+        }
+        
+        s = _mm_xor_si128(_mm_aesdeclast_si128(s, k[10]), chain);
+        chain = c;
+        _mm_storeu_si128((__m128i *)(out + pos), s);
+    }
+    
+    _mm_storeu_si128((__m128i *)iv, chain);
+}
+
+#endif
+
 int BEncryption_cipher_valid (int cipher)
 {
     switch (cipher) {
         case BENCRYPTION_CIPHER_BLOWFISH:
         case BENCRYPTION_CIPHER_AES:
+        case BENCRYPTION_CIPHER_AES_GCM:
+        #ifdef BENCRYPTION_HAVE_CHACHA20_POLY1305
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+        #endif
             return 1;
         default:
             return 0;
     }
 }
 
+int BEncryption_cipher_is_aead (int cipher)
+{
+    switch (cipher) {
+        case BENCRYPTION_CIPHER_BLOWFISH:
+        case BENCRYPTION_CIPHER_AES:
+            return 0;
+        case BENCRYPTION_CIPHER_AES_GCM:
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            return 1;
+        default:
+            ASSERT(0)
+            return 0;
+    }
+}
+
 int BEncryption_cipher_block_size (int cipher)
 {
     switch (cipher) {
@@ -51,6 +215,9 @@ int BEncryption_cipher_block_size (int cipher)
             return BENCRYPTION_CIPHER_BLOWFISH_BLOCK_SIZE;
         case BENCRYPTION_CIPHER_AES:
             return BENCRYPTION_CIPHER_AES_BLOCK_SIZE;
+        case BENCRYPTION_CIPHER_AES_GCM:
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            return 1;
         default:
             ASSERT(0)
             return 0;
@@ -64,13 +231,43 @@ int BEncryption_cipher_key_size (int cipher)
             return BENCRYPTION_CIPHER_BLOWFISH_KEY_SIZE;
         case BENCRYPTION_CIPHER_AES:
             return BENCRYPTION_CIPHER_AES_KEY_SIZE;
+        case BENCRYPTION_CIPHER_AES_GCM:
+            return BENCRYPTION_CIPHER_AES_GCM_KEY_SIZE;
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            return BENCRYPTION_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
         default:
             ASSERT(0)
             return 0;
     }
 }
 
-void BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key)
+int BEncryption_cipher_nonce_size (int cipher)
+{
+    switch (cipher) {
+        case BENCRYPTION_CIPHER_AES_GCM:
+            return BENCRYPTION_CIPHER_AES_GCM_NONCE_SIZE;
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            return BENCRYPTION_CIPHER_CHACHA20_POLY1305_NONCE_SIZE;
+        default:
+            ASSERT(0)
+            return 0;
+    }
+}
+
+int BEncryption_cipher_tag_size (int cipher)
+{
+    switch (cipher) {
+        case BENCRYPTION_CIPHER_AES_GCM:
+            return BENCRYPTION_CIPHER_AES_GCM_TAG_SIZE;
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            return BENCRYPTION_CIPHER_CHACHA20_POLY1305_TAG_SIZE;
+        default:
+            ASSERT(0)
+            return 0;
+    }
+}
+
+int BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key)
 {
     ASSERT(!(mode&~(BENCRYPTION_MODE_ENCRYPT|BENCRYPTION_MODE_DECRYPT)))
     ASSERT((mode&BENCRYPTION_MODE_ENCRYPT) || (mode&BENCRYPTION_MODE_DECRYPT))
@@ -130,6 +327,12 @@ fail1:
             BF_set_key(&enc->blowfish, BENCRYPTION_CIPHER_BLOWFISH_KEY_SIZE, key);
             break;
         case BENCRYPTION_CIPHER_AES:
+            #ifdef BENCRYPTION_HAVE_AESNI
+            if ((enc->aes.use_aesni = !!__builtin_cpu_supports("aes"))) {
+                aesni_expand_key(key, enc->aes.aesni_encrypt, enc->aes.aesni_decrypt);
+                break;
+            }
+            #endif
             if (enc->mode&BENCRYPTION_MODE_ENCRYPT) {
                 res = AES_set_encrypt_key(key, 128, &enc->aes.encrypt);
                 ASSERT_EXECUTE(res >= 0)
@@ -139,6 +342,15 @@ fail1:
                 ASSERT_EXECUTE(res >= 0)
             }
             break;
+        case BENCRYPTION_CIPHER_AES_GCM:
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            if (!(enc->aead = EVP_CIPHER_CTX_new())) {
+                BLog(BLOG_ERROR, "EVP_CIPHER_CTX_new failed");
+                return 0;
+            }
+            // set the key once; only the nonce is set for each operation
+            ASSERT_FORCE(EVP_CipherInit_ex(enc->aead, aead_evp_cipher(enc->cipher), NULL, key, NULL, !!(enc->mode&BENCRYPTION_MODE_ENCRYPT)) == 1)
+            break;
         default:
             ASSERT(0)
             ;
@@ -149,6 +361,8 @@ success:
     #endif
     // init debug object
     DebugObject_Init(&enc->d_obj);
+    
+    return 1;
 }
 
 void BEncryption_Free (BEncryption *enc)
@@ -162,14 +376,20 @@ void BEncryption_Free (BEncryption *enc)
         ASSERT_FORCE(ioctl(enc->cryptodev.cfd, CIOCFSESSION, &enc->cryptodev.ses) == 0)
         ASSERT_FORCE(close(enc->cryptodev.cfd) == 0)
         ASSERT_FORCE(close(enc->cryptodev.fd) == 0)
+        return;
     }
     
     #endif
+    
+    if (BEncryption_cipher_is_aead(enc->cipher)) {
+        EVP_CIPHER_CTX_free(enc->aead);
+    }
 }
 
 void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len, uint8_t *iv)
 {
     ASSERT(enc->mode&BENCRYPTION_MODE_ENCRYPT)
+    ASSERT(!BEncryption_cipher_is_aead(enc->cipher))
     ASSERT(len >= 0)
     ASSERT(len % BEncryption_cipher_block_size(enc->cipher) == 0)
     
@@ -196,6 +416,12 @@ void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
             BF_cbc_encrypt(in, out, len, &enc->blowfish, iv, BF_ENCRYPT);
             break;
         case BENCRYPTION_CIPHER_AES:
+            #ifdef BENCRYPTION_HAVE_AESNI
+            if (enc->aes.use_aesni) {
+                aesni_cbc_encrypt(enc->aes.aesni_encrypt, 1, &in, &out, &len, &iv);
+                break;
+            }
+            #endif
             AES_cbc_encrypt(in, out, len, &enc->aes.encrypt, iv, AES_ENCRYPT);
             break;
         default:
@@ -206,6 +432,7 @@ void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
 void BEncryption_Decrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len, uint8_t *iv)
 {
     ASSERT(enc->mode&BENCRYPTION_MODE_DECRYPT)
+    ASSERT(!BEncryption_cipher_is_aead(enc->cipher))
     ASSERT(len >= 0)
     ASSERT(len % BEncryption_cipher_block_size(enc->cipher) == 0)
     
@@ -232,9 +459,95 @@ void BEncryption_Decrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
             BF_cbc_encrypt(in, out, len, &enc->blowfish, iv, BF_DECRYPT);
             break;
         case BENCRYPTION_CIPHER_AES:
+            #ifdef BENCRYPTION_HAVE_AESNI
+            if (enc->aes.use_aesni) {
+                aesni_cbc_decrypt(enc->aes.aesni_decrypt, in, out, len, iv);
+                break;
+            }
+            #endif
             AES_cbc_encrypt(in, out, len, &enc->aes.decrypt, iv, AES_DECRYPT);
             break;
         default:
             ASSERT(0);
     }
 }
+
+void BEncryption_EncryptBurst (BEncryption *enc, int num, uint8_t **in, uint8_t **out, const int *len, uint8_t **iv)
+{
+    ASSERT(enc->mode&BENCRYPTION_MODE_ENCRYPT)
+    ASSERT(!BEncryption_cipher_is_aead(enc->cipher))
+    ASSERT(num >= 0)
+    ASSERT(num <= BENCRYPTION_MAX_BURST)
+    
+    #ifdef BENCRYPTION_HAVE_AESNI
+    if (enc->cipher == BENCRYPTION_CIPHER_AES && enc->aes.use_aesni) {
+        aesni_cbc_encrypt(enc->aes.aesni_encrypt, num, in, out, len, iv);
+        return;
+    }
+    #endif
+    
+    for (int i = 0; i < num; i++) {
+        BEncryption_Encrypt(enc, in[i], out[i], len[i], iv[i]);
+    }
+}
+
+void BEncryption_DecryptBurst (BEncryption *enc, int num, uint8_t **in, uint8_t **out, const int *len, uint8_t **iv)
+{
+    ASSERT(enc->mode&BENCRYPTION_MODE_DECRYPT)
+    ASSERT(!BEncryption_cipher_is_aead(enc->cipher))
+    ASSERT(num >= 0)
+    ASSERT(num <= BENCRYPTION_MAX_BURST)
+    
+    // decryption of each buffer is parallel by itself, so there's
+    // nothing to gain from interleaving buffers
+    for (int i = 0; i < num; i++) {
+        BEncryption_Decrypt(enc, in[i], out[i], len[i], iv[i]);
+    }
+}
+
+void BEncryption_Seal (BEncryption *enc, const uint8_t *nonce, const uint8_t *in, uint8_t *out, int len, uint8_t *tag)
+{
+    ASSERT(enc->mode&BENCRYPTION_MODE_ENCRYPT)
+    ASSERT(BEncryption_cipher_is_aead(enc->cipher))
+    ASSERT(len >= 0)
+    
+    int out_len;
+    
+    // start with the nonce
+    ASSERT_FORCE(EVP_CipherInit_ex(enc->aead, NULL, NULL, NULL, nonce, 1) == 1)
+    
+    // encrypt
+    if (len > 0) {
+        ASSERT_FORCE(EVP_CipherUpdate(enc->aead, out, &out_len, in, len) == 1)
+        ASSERT(out_len == len)
+    }
+    ASSERT_FORCE(EVP_CipherFinal_ex(enc->aead, out + len, &out_len) == 1)
+    ASSERT(out_len == 0)
+    
+    // get tag
+    ASSERT_FORCE(EVP_CIPHER_CTX_ctrl(enc->aead, EVP_CTRL_AEAD_GET_TAG, BEncryption_cipher_tag_size(enc->cipher), tag) == 1)
+}
+
+int BEncryption_Open (BEncryption *enc, const uint8_t *nonce, const uint8_t *in, uint8_t *out, int len, const uint8_t *tag)
+{
+    ASSERT(enc->mode&BENCRYPTION_MODE_DECRYPT)
+    ASSERT(BEncryption_cipher_is_aead(enc->cipher))
+    ASSERT(len >= 0)
+    
+    int out_len;
+    
+    // start with the nonce
+    ASSERT_FORCE(EVP_CipherInit_ex(enc->aead, NULL, NULL, NULL, nonce, 0) == 1)
+    
+    // decrypt
+    if (len > 0) {
+        ASSERT_FORCE(EVP_CipherUpdate(enc->aead, out, &out_len, in, len) == 1)
+        ASSERT(out_len == len)
+    }
+    
+    // set expected tag; this does not modify the tag
+    ASSERT_FORCE(EVP_CIPHER_CTX_ctrl(enc->aead, EVP_CTRL_AEAD_SET_TAG, BEncryption_cipher_tag_size(enc->cipher), (void *)tag) == 1)
+    
+    // verify
+    return (EVP_CipherFinal_ex(enc->aead, out + len, &out_len) == 1);
+}
@@ -28,7 +28,7 @@
  * 
  * @section DESCRIPTION
  * 
- * Block cipher encryption abstraction.
+ * Block cipher and AEAD encryption abstraction.
  */
 
 #ifndef BADVPN_SECURITY_BENCRYPTION_H
@@ -48,8 +48,10 @@
 #include <unistd.h>
 #endif
 
+#include <openssl/opensslv.h>
 #include <openssl/blowfish.h>
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 
 #include <misc/debug.h>
 #include <base/DebugObject.h>
@@ -58,7 +60,12 @@
 #define BENCRYPTION_MODE_DECRYPT 2
 
 #define BENCRYPTION_MAX_BLOCK_SIZE 16
-#define BENCRYPTION_MAX_KEY_SIZE 16
+#define BENCRYPTION_MAX_KEY_SIZE 32
+#define BENCRYPTION_MAX_NONCE_SIZE 12
+#define BENCRYPTION_MAX_TAG_SIZE 16
+
+// maximum number of buffers in a burst operation
+#define BENCRYPTION_MAX_BURST 8
 
 #define BENCRYPTION_CIPHER_BLOWFISH 1
 #define BENCRYPTION_CIPHER_BLOWFISH_BLOCK_SIZE 8
@@ -68,10 +75,31 @@
 #define BENCRYPTION_CIPHER_AES_BLOCK_SIZE 16
 #define BENCRYPTION_CIPHER_AES_KEY_SIZE 16
 
+// AEAD ciphers; these have a block size of 1 and are used with
+// BEncryption_Seal and BEncryption_Open only
+#define BENCRYPTION_CIPHER_AES_GCM 3
+#define BENCRYPTION_CIPHER_AES_GCM_KEY_SIZE 16
+#define BENCRYPTION_CIPHER_AES_GCM_NONCE_SIZE 12
+#define BENCRYPTION_CIPHER_AES_GCM_TAG_SIZE 16
+
+#define BENCRYPTION_CIPHER_CHACHA20_POLY1305 4
+#define BENCRYPTION_CIPHER_CHACHA20_POLY1305_KEY_SIZE 32
+#define BENCRYPTION_CIPHER_CHACHA20_POLY1305_NONCE_SIZE 12
+#define BENCRYPTION_CIPHER_CHACHA20_POLY1305_TAG_SIZE 16
+
 // NOTE: update the maximums above when adding a cipher!
 
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_CHACHA) && !defined(OPENSSL_NO_POLY1305)
+#define BENCRYPTION_HAVE_CHACHA20_POLY1305
+#endif
+
+// AES uses AES-NI if the CPU has it; this only enables checking for it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(BADVPN_USE_CRYPTODEV)
+#define BENCRYPTION_HAVE_AESNI
+#endif
+
 /**
- * Block cipher encryption abstraction.
+ * Block cipher and AEAD encryption abstraction.
  */
 typedef struct {
     DebugObject d_obj;
@@ -85,7 +113,13 @@ typedef struct {
         struct {
             AES_KEY encrypt;
             AES_KEY decrypt;
+            #ifdef BENCRYPTION_HAVE_AESNI
+            int use_aesni;
+            uint8_t aesni_encrypt[11 * 16];
+            uint8_t aesni_decrypt[11 * 16];
+            #endif
         } aes;
+        EVP_CIPHER_CTX *aead;
         #ifdef BADVPN_USE_CRYPTODEV
         struct {
             int fd;
@@ -99,17 +133,27 @@ typedef struct {
 
 /**
  * Checks if the given cipher number is valid.
+ * AEAD ciphers are only valid if supported by the crypto library.
  * 
  * @param cipher cipher number
  * @return 1 if valid, 0 if not
  */
 int BEncryption_cipher_valid (int cipher);
 
+/**
+ * Checks if a cipher is an AEAD cipher, which encrypts and authenticates
+ * in a single pass.
+ * 
+ * @param cipher cipher number. Must be valid.
+ * @return 1 if AEAD, 0 if block cipher
+ */
+int BEncryption_cipher_is_aead (int cipher);
+
 /**
  * Returns the block size of a cipher.
  * 
  * @param cipher cipher number. Must be valid.
- * @return block size in bytes
+ * @return block size in bytes; 1 for AEAD ciphers
  */
 int BEncryption_cipher_block_size (int cipher);
 
@@ -121,6 +165,22 @@ int BEncryption_cipher_block_size (int cipher);
  */
 int BEncryption_cipher_key_size (int cipher);
 
+/**
+ * Returns the nonce size of an AEAD cipher.
+ * 
+ * @param cipher cipher number. Must be valid and AEAD.
+ * @return nonce size in bytes
+ */
+int BEncryption_cipher_nonce_size (int cipher);
+
+/**
+ * Returns the authentication tag size of an AEAD cipher.
+ * 
+ * @param cipher cipher number. Must be valid and AEAD.
+ * @return tag size in bytes
+ */
+int BEncryption_cipher_tag_size (int cipher);
+
 /**
  * Initializes the object.
  * {@link BSecurity_GlobalInitThreadSafe} must have been done if this object
@@ -132,8 +192,10 @@ int BEncryption_cipher_key_size (int cipher);
  *             and BENCRYPTION_MODE_DECRYPT.
  * @param cipher cipher number. Must be valid.
  * @param key encryption key
+ * @return 1 on success, 0 on failure. Only fails for AEAD ciphers, when
+ *         the cipher context cannot be allocated.
  */
-void BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key);
+int BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key) WARN_UNUSED;
 
 /**
  * Frees the object.
@@ -145,7 +207,7 @@ void BEncryption_Free (BEncryption *enc);
 /**
  * Encrypts data.
  * The object must have been initialized with mode including
- * BENCRYPTION_MODE_ENCRYPT.
+ * BENCRYPTION_MODE_ENCRYPT, and with a block cipher.
  * 
  * @param enc the object
  * @param in data to encrypt
@@ -160,7 +222,7 @@ void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
 /**
  * Decrypts data.
  * The object must have been initialized with mode including
- * BENCRYPTION_MODE_DECRYPT.
+ * BENCRYPTION_MODE_DECRYPT, and with a block cipher.
  * 
  * @param enc the object
  * @param in data to decrypt
@@ -172,4 +234,68 @@ void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
  */
 void BEncryption_Decrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len, uint8_t *iv);
 
+/**
+ * Encrypts several independent buffers, as if by calling {@link BEncryption_Encrypt}
+ * for each of them.
+ * With AES-NI, the buffers are encrypted in parallel, which is much faster than
+ * encrypting them one after another since CBC encryption of a single buffer
+ * can't be parallelized.
+ * 
+ * @param enc the object
+ * @param num number of buffers. Must be >=0 and <=BENCRYPTION_MAX_BURST.
+ * @param in data to encrypt, for each buffer
+ * @param out ciphertext output, for each buffer
+ * @param len number of bytes to encrypt, for each buffer. Each must be >=0 and
+ *            a multiple of block size.
+ * @param iv initialization vector, for each buffer. Updated as in {@link BEncryption_Encrypt}.
+ */
+void BEncryption_EncryptBurst (BEncryption *enc, int num, uint8_t **in, uint8_t **out, const int *len, uint8_t **iv);
+
+/**
+ * Decrypts several independent buffers, as if by calling {@link BEncryption_Decrypt}
+ * for each of them.
+ * Unlike encryption, CBC decryption of a single buffer can be parallelized,
+ * so this is no faster than decrypting the buffers one by one.
+ * 
+ * @param enc the object
+ * @param num number of buffers. Must be >=0 and <=BENCRYPTION_MAX_BURST.
+ * @param in data to decrypt, for each buffer
+ * @param out plaintext output, for each buffer
+ * @param len number of bytes to decrypt, for each buffer. Each must be >=0 and
+ *            a multiple of block size.
+ * @param iv initialization vector, for each buffer. Updated as in {@link BEncryption_Decrypt}.
+ */
+void BEncryption_DecryptBurst (BEncryption *enc, int num, uint8_t **in, uint8_t **out, const int *len, uint8_t **iv);
+
+/**
+ * Encrypts and authenticates data.
+ * The object must have been initialized with mode including
+ * BENCRYPTION_MODE_ENCRYPT, and with an AEAD cipher.
+ * 
+ * @param enc the object
+ * @param nonce nonce, {@link BEncryption_cipher_nonce_size} bytes. Must never be
+ *              repeated for the same key.
+ * @param in data to encrypt
+ * @param out ciphertext output, same length as input. May be the same as in.
+ * @param len number of bytes to encrypt. Must be >=0.
+ * @param tag authentication tag output, {@link BEncryption_cipher_tag_size} bytes
+ */
+void BEncryption_Seal (BEncryption *enc, const uint8_t *nonce, const uint8_t *in, uint8_t *out, int len, uint8_t *tag);
+
+/**
+ * Decrypts and verifies data.
+ * The object must have been initialized with mode including
+ * BENCRYPTION_MODE_DECRYPT, and with an AEAD cipher.
+ * 
+ * @param enc the object
+ * @param nonce nonce the data was encrypted with
+ * @param in data to decrypt
+ * @param out plaintext output, same length as input. May be the same as in.
+ *            Must not be used if verification fails.
+ * @param len number of bytes to decrypt. Must be >=0.
+ * @param tag authentication tag to verify
+ * @return 1 if the tag is correct, 0 if not
+ */
+int BEncryption_Open (BEncryption *enc, const uint8_t *nonce, const uint8_t *in, uint8_t *out, int len, const uint8_t *tag);
+
 #endif
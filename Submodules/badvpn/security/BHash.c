@@ -67,3 +67,47 @@ void BHash_calculate (int type, uint8_t *data, int data_len, uint8_t *out)
             ;
     }
 }
+
+void BHash_calculate_burst (int type, int num, uint8_t **data, const int *data_len, uint8_t **out)
+{
+    ASSERT(num >= 0)
+    ASSERT(num <= BHASH_MAX_BURST)
+    
+    const EVP_MD *md;
+    switch (type) {
+        case BHASH_TYPE_MD5:
+            md = EVP_md5();
+            break;
+        case BHASH_TYPE_SHA1:
+            md = EVP_sha1();
+            break;
+        default:
+            ASSERT(0)
+            return;
+    }
+    
+    EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+    if (!ctx || EVP_DigestInit_ex(ctx, md, NULL) != 1) {
+        goto fallback;
+    }
+    
+    for (int i = 0; i < num; i++) {
+        // reinitialize with the same digest; this doesn't look it up again
+        unsigned int out_len;
+        ASSERT_FORCE(i == 0 || EVP_DigestInit_ex(ctx, NULL, NULL) == 1)
+        ASSERT_FORCE(EVP_DigestUpdate(ctx, data[i], data_len[i]) == 1)
+        ASSERT_FORCE(EVP_DigestFinal_ex(ctx, out[i], &out_len) == 1)
+        ASSERT(out_len == BHash_size(type))
+    }
+    
+    EVP_MD_CTX_destroy(ctx);
+    return;
+    
+fallback:
+    if (ctx) {
+        EVP_MD_CTX_destroy(ctx);
+    }
+    for (int i = 0; i < num; i++) {
+        BHash_calculate(type, data[i], data_len[i], out[i]);
+    }
+}
@@ -38,6 +38,7 @@
 
 #include <openssl/md5.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 
 #include <misc/debug.h>
 
@@ -49,6 +50,9 @@
 
 #define BHASH_MAX_SIZE 20
 
+// maximum number of buffers in a burst operation
+#define BHASH_MAX_BURST 8
+
 /**
  * Checks if the given hash type number is valid.
  * 
@@ -77,4 +81,20 @@ int BHash_size (int type);
  */
 void BHash_calculate (int type, uint8_t *data, int data_len, uint8_t *out);
 
+/**
+ * Calculates hashes of several buffers, as if by calling {@link BHash_calculate}
+ * for each of them.
+ * The digest context is set up once for the whole burst, which is considerably
+ * cheaper than hashing small buffers one by one.
+ * {@link BSecurity_GlobalInitThreadSafe} must have been done if this is
+ * being called from a non-main thread.
+ * 
+ * @param type hash type number. Must be valid.
+ * @param num number of buffers. Must be >=0 and <=BHASH_MAX_BURST.
+ * @param data data to calculate the hash of, for each buffer
+ * @param data_len length of data, for each buffer
+ * @param out where to write the hash, for each buffer. Must not overlap with data.
+ */
+void BHash_calculate_burst (int type, int num, uint8_t **data, const int *data_len, uint8_t **out);
+
 #endif
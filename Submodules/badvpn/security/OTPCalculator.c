@@ -37,6 +37,7 @@ int OTPCalculator_Init (OTPCalculator *calc, int num_otps, int cipher)
 {
     ASSERT(num_otps >= 0)
     ASSERT(BEncryption_cipher_valid(cipher))
+    ASSERT(!BEncryption_cipher_is_aead(cipher))
     
     // init arguments
     calc->num_otps = num_otps;
@@ -88,7 +89,7 @@ otp_t * OTPCalculator_Generate (OTPCalculator *calc, uint8_t *key, uint8_t *iv,
     
     // init encryptor
     BEncryption encryptor;
-    BEncryption_Init(&encryptor, BENCRYPTION_MODE_ENCRYPT, calc->cipher, key);
+    ASSERT_FORCE(BEncryption_Init(&encryptor, BENCRYPTION_MODE_ENCRYPT, calc->cipher, key))
     
     // encrypt zero blocks
     for (size_t i = 0; i < calc->num_blocks; i++) {
@@ -68,7 +68,7 @@ typedef struct {
  * @param calc the object
  * @param num_otps number of OTPs to generate from a seed. Must be >=0.
  * @param cipher encryption cipher for calculating the OTPs. Must be valid
- *               according to {@link BEncryption_cipher_valid}.
+ *               according to {@link BEncryption_cipher_valid}, and not AEAD.
  * @return 1 on success, 0 on failure
  */
 int OTPCalculator_Init (OTPCalculator *calc, int num_otps, int cipher) WARN_UNUSED;
@@ -92,7 +92,7 @@ typedef struct {
  * @param mc the object
  * @param num_otps number of OTPs to generate from a seed. Must be >0.
  * @param cipher encryption cipher for calculating the OTPs. Must be valid
- *               according to {@link BEncryption_cipher_valid}.
+ *               according to {@link BEncryption_cipher_valid}, and not AEAD.
  * @param num_tables number of tables to keep, each for one seed. Must be >0.
  * @param twd thread work dispatcher
  * @return 1 on success, 0 on failure
@@ -76,7 +76,7 @@ typedef struct {
  * @param g the object
  * @param num_otps number of OTPs to generate from a seed. Must be >=0.
  * @param cipher encryption cipher for calculating the OTPs. Must be valid
- *               according to {@link BEncryption_cipher_valid}.
+ *               according to {@link BEncryption_cipher_valid}, and not AEAD.
  * @param twd thread work dispatcher
  * @param handler handler to call when generation of new OTPs is complete,
  *                after {@link OTPGenerator_SetSeed} was called.
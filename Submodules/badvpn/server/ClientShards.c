@@ -0,0 +1,996 @@
+/**
+ * @file ClientShards.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <ssl.h>
+
+#include <misc/offset.h>
+#include <misc/balloc.h>
+#include <misc/balign.h>
+#include <misc/bsize.h>
+#include <misc/maxalign.h>
+#include <base/BLog.h>
+
+#include <server/ClientShards.h>
+
+#include <generated/blog_channel_ClientShards.h>
+
+#define LINK_STATE_NEW 1
+#define LINK_STATE_ACCEPTED 2
+#define LINK_STATE_FREEING 3
+
+#define LINK_SSTATE_ACTIVE 1
+#define LINK_SSTATE_DEAD 2
+
+// shard -> control
+#define MSG_NEW 1
+#define MSG_UP 2
+#define MSG_PACKET 3
+#define MSG_ERROR 4
+#define MSG_SEND_CREDIT 5
+#define MSG_FREED 6
+
+// control -> shard
+#define MSG_SEND 7
+#define MSG_RECV_CREDIT 8
+#define MSG_FREE 9
+
+#define MSG_DATA(msg) ((uint8_t *)((msg) + 1))
+
+static int msg_slot_size (int data_len, size_t *out);
+static struct ClientShards_msg * take_msg (uint8_t *ring, size_t slot_size, int *next, int type, ClientShardsLink *link);
+static int shard_init (struct ClientShards_shard *sh, ClientShards *o, BAddr *listen_addrs, int num_listen_addrs, int num_threads);
+static void shard_free (struct ClientShards_shard *sh);
+static void * shard_thread (void *arg);
+static void shard_listener_handler (struct ClientShards_listener *l);
+static void shard_mailbox_handler (struct ClientShards_shard *sh, BMailboxNode *node);
+static void control_mailbox_handler (ClientShards *o, BMailboxNode *node);
+static void link_logfunc (ClientShardsLink *o);
+static void link_log (ClientShardsLink *o, int level, const char *fmt, ...);
+static void link_post_control (ClientShardsLink *o, struct ClientShards_msg *msg);
+static void link_report_error (ClientShardsLink *o, int event);
+static int link_init_io (ClientShardsLink *o);
+static void link_close (ClientShardsLink *o);
+static void link_free_shard (ClientShardsLink *o);
+static void link_connection_handler (ClientShardsLink *o, int event);
+static void link_sslcon_handler (ClientShardsLink *o, int event);
+static void link_decoder_handler_error (ClientShardsLink *o);
+static void link_input_handler_send (ClientShardsLink *o, uint8_t *data, int data_len);
+static void link_send_finish (ClientShardsLink *o);
+static void link_send_next (ClientShardsLink *o);
+static void link_sender_handler_done (ClientShardsLink *o, int data_len);
+static void link_s_credit_job_handler (ClientShardsLink *o);
+static void link_output_handler_send (ClientShardsLink *o, uint8_t *data, int data_len);
+static void link_credit_job_handler (ClientShardsLink *o);
+
+static int msg_slot_size (int data_len, size_t *out)
+{
+    ASSERT(data_len >= 0)
+    
+    size_t size;
+    if (!bsize_tosize(bsize_add(bsize_fromsize(sizeof(struct ClientShards_msg)), bsize_fromint(data_len)), &size) ||
+        balign_up_overflows(size, BMAX_ALIGN)
+    ) {
+        return 0;
+    }
+    
+    *out = balign_up(size, BMAX_ALIGN);
+    return 1;
+}
+
+static struct ClientShards_msg * take_msg (uint8_t *ring, size_t slot_size, int *next, int type, ClientShardsLink *link)
+{
+    ASSERT(*next >= 0)
+    ASSERT(*next < CLIENTSHARDS_LINK_WINDOW)
+    
+    // The message posted CLIENTSHARDS_LINK_WINDOW messages ago is free: the window
+    // bounds the packets not yet credited back, each credit message credits at
+    // least one of them, and both threads handle their mailbox in order.
+    struct ClientShards_msg *msg = (struct ClientShards_msg *)(ring + *next * slot_size);
+    *next = (*next + 1) % CLIENTSHARDS_LINK_WINDOW;
+    
+    msg->type = type;
+    msg->link = link;
+    msg->value = 0;
+    msg->ptr = NULL;
+    
+    return msg;
+}
+
+static void init_msg (struct ClientShards_msg *msg, int type, ClientShardsLink *link)
+{
+    msg->type = type;
+    msg->link = link;
+    msg->value = 0;
+    msg->ptr = NULL;
+}
+
+int shard_init (struct ClientShards_shard *sh, ClientShards *o, BAddr *listen_addrs, int num_listen_addrs, int num_threads)
+{
+    sh->shards = o;
+    
+    // init reactor
+    if (!BReactor_Init(&sh->reactor)) {
+        BLog(BLOG_ERROR, "BReactor_Init failed");
+        goto fail0;
+    }
+    
+    // init thread work dispatcher, for SSL
+    if (!BThreadWorkDispatcher_Init(&sh->twd, &sh->reactor, num_threads)) {
+        BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init failed");
+        goto fail1;
+    }
+    
+    // init mailbox
+    if (!BMailbox_Init(&sh->mailbox, &sh->reactor, (BMailbox_handler)shard_mailbox_handler, sh)) {
+        BLog(BLOG_ERROR, "BMailbox_Init failed");
+        goto fail2;
+    }
+    
+    // allocate listeners
+    if (!(sh->listeners = (struct ClientShards_listener *)BAllocArray(num_listen_addrs, sizeof(sh->listeners[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail3;
+    }
+    
+    // init listeners
+    for (sh->num_listeners = 0; sh->num_listeners < num_listen_addrs; sh->num_listeners++) {
+        struct ClientShards_listener *l = &sh->listeners[sh->num_listeners];
+        l->shard = sh;
+        if (!BListener_InitReusePort(&l->listener, listen_addrs[sh->num_listeners], &sh->reactor, l, (BListener_handler)shard_listener_handler)) {
+            BLog(BLOG_ERROR, "BListener_InitReusePort failed");
+            goto fail4;
+        }
+    }
+    
+    // init links list
+    LinkedList1_Init(&sh->links_list);
+    
+    return 1;
+    
+fail4:
+    while (sh->num_listeners-- > 0) {
+        BListener_Free(&sh->listeners[sh->num_listeners].listener);
+    }
+    BFree(sh->listeners);
+fail3:
+    BMailbox_Free(&sh->mailbox);
+fail2:
+    BThreadWorkDispatcher_Free(&sh->twd);
+fail1:
+    BReactor_Free(&sh->reactor);
+fail0:
+    return 0;
+}
+
+void shard_free (struct ClientShards_shard *sh)
+{
+    // drop messages left in the mailbox; they are embedded in links
+    while (BMailbox_Get(&sh->mailbox));
+    
+    // free links the control thread has not seen
+    LinkedList1Node *ln;
+    while (ln = LinkedList1_GetFirst(&sh->links_list)) {
+        ClientShardsLink *link = UPPER_OBJECT(ln, ClientShardsLink, s_list_node);
+        link_free_shard(link);
+        free(link);
+    }
+    
+    // free listeners
+    while (sh->num_listeners-- > 0) {
+        BListener_Free(&sh->listeners[sh->num_listeners].listener);
+    }
+    BFree(sh->listeners);
+    
+    // free mailbox
+    BMailbox_Free(&sh->mailbox);
+    
+    // free thread work dispatcher
+    BThreadWorkDispatcher_Free(&sh->twd);
+    
+    // free reactor
+    BReactor_Free(&sh->reactor);
+}
+
+void * shard_thread (void *arg)
+{
+    struct ClientShards_shard *sh = (struct ClientShards_shard *)arg;
+    
+    BReactor_Exec(&sh->reactor);
+    
+    return NULL;
+}
+
+void shard_listener_handler (struct ClientShards_listener *l)
+{
+    struct ClientShards_shard *sh = l->shard;
+    ClientShards *o = sh->shards;
+    
+    // allocate link, together with its packet message rings
+    ClientShardsLink *link = (ClientShardsLink *)malloc(o->link_alloc_size);
+    if (!link) {
+        BLog(BLOG_ERROR, "failed to allocate link");
+        goto fail0;
+    }
+    link->shards = o;
+    link->shard = sh;
+    link->s_recv_slots = (uint8_t *)link + balign_up(sizeof(*link), BMAX_ALIGN);
+    link->s_recv_next = 0;
+    link->s_credit_next = 0;
+    link->send_slots = link->s_recv_slots + CLIENTSHARDS_LINK_WINDOW * o->recv_slot_size;
+    
+    // accept connection
+    if (!BConnection_Init(&link->s_con, BConnection_source_listener(&l->listener, &link->addr), &sh->reactor, link, (BConnection_handler)link_connection_handler)) {
+        BLog(BLOG_ERROR, "BConnection_Init failed");
+        goto fail1;
+    }
+    
+    // limit socket send buffer
+    if (o->socket_sndbuf > 0) {
+        if (!BConnection_SetSendBuffer(&link->s_con, o->socket_sndbuf)) {
+            link_log(link, BLOG_WARNING, "BConnection_SetSendBuffer failed");
+        }
+    }
+    
+    // init connection interfaces
+    BConnection_SendAsync_Init(&link->s_con);
+    BConnection_RecvAsync_Init(&link->s_con);
+    
+    // set state
+    link->s_state = LINK_SSTATE_ACTIVE;
+    link->s_have_io = 0;
+    
+    if (o->model_prfd) {
+        // create bottom NSPR file descriptor
+        if (!BSSLConnection_MakeConnectionBackend(&link->s_bottom_prfd, &link->s_con, &sh->twd, o->ssl_flags)) {
+            link_log(link, BLOG_ERROR, "BSSLConnection_MakeConnectionBackend failed");
+            goto fail2;
+        }
+        
+        // create SSL file descriptor from the bottom NSPR file descriptor
+        if (!(link->s_ssl_prfd = SSL_ImportFD(o->model_prfd, &link->s_bottom_prfd))) {
+            link_log(link, BLOG_ERROR, "SSL_ImportFD failed");
+            ASSERT_FORCE(PR_Close(&link->s_bottom_prfd) == PR_SUCCESS)
+            goto fail2;
+        }
+        
+        // set server mode
+        if (SSL_ResetHandshake(link->s_ssl_prfd, PR_TRUE) != SECSuccess) {
+            link_log(link, BLOG_ERROR, "SSL_ResetHandshake failed");
+            goto fail3;
+        }
+        
+        // set require client certificate
+        if (SSL_OptionSet(link->s_ssl_prfd, SSL_REQUEST_CERTIFICATE, PR_TRUE) != SECSuccess) {
+            link_log(link, BLOG_ERROR, "SSL_OptionSet(SSL_REQUEST_CERTIFICATE) failed");
+            goto fail3;
+        }
+        if (SSL_OptionSet(link->s_ssl_prfd, SSL_REQUIRE_CERTIFICATE, PR_TRUE) != SECSuccess) {
+            link_log(link, BLOG_ERROR, "SSL_OptionSet(SSL_REQUIRE_CERTIFICATE) failed");
+            goto fail3;
+        }
+        
+        // init SSL connection
+        BSSLConnection_Init(&link->s_sslcon, link->s_ssl_prfd, 1, BReactor_PendingGroup(&sh->reactor), link, (BSSLConnection_handler)link_sslcon_handler);
+    } else {
+        // initialize I/O
+        if (!link_init_io(link)) {
+            goto fail2;
+        }
+    }
+    
+    // init credit job
+    link->s_send_credit = 0;
+    BPending_Init(&link->s_credit_job, BReactor_PendingGroup(&sh->reactor), (BPending_handler)link_s_credit_job_handler, link);
+    
+    // insert to shard's list
+    LinkedList1_Append(&sh->links_list, &link->s_list_node);
+    
+    // inform control thread
+    init_msg(&link->new_msg, MSG_NEW, link);
+    link_post_control(link, &link->new_msg);
+    
+    link_log(link, BLOG_INFO, "accepted");
+    
+    return;
+    
+    if (o->model_prfd) {
+fail3:
+        ASSERT_FORCE(PR_Close(link->s_ssl_prfd) == PR_SUCCESS)
+    }
+fail2:
+    BConnection_RecvAsync_Free(&link->s_con);
+    BConnection_SendAsync_Free(&link->s_con);
+    BConnection_Free(&link->s_con);
+fail1:
+    free(link);
+fail0:
+    return;
+}
+
+void shard_mailbox_handler (struct ClientShards_shard *sh, BMailboxNode *node)
+{
+    if (node == &sh->quit_node) {
+        BReactor_Quit(&sh->reactor, 0);
+        return;
+    }
+    
+    struct ClientShards_msg *msg = UPPER_OBJECT(node, struct ClientShards_msg, node);
+    ClientShardsLink *o = msg->link;
+    ASSERT(o->shard == sh)
+    
+    switch (msg->type) {
+        case MSG_SEND: {
+            // drop packets for broken connections
+            if (o->s_state != LINK_SSTATE_ACTIVE || !o->s_have_io) {
+                return;
+            }
+            
+            // queue packet
+            LinkedList1_Append(&o->s_send_queue, &msg->list_node);
+            
+            // start sending if not already
+            if (!o->s_sending) {
+                link_send_next(o);
+            }
+        } break;
+        
+        case MSG_RECV_CREDIT: {
+            if (o->s_have_io) {
+                ASSERT(msg->value > 0)
+                ASSERT(msg->value <= o->s_recv_posted)
+                
+                o->s_recv_posted -= msg->value;
+                
+                // accept the waiting packet if there is room now
+                if (o->s_recv_waiting && o->s_recv_posted < CLIENTSHARDS_LINK_WINDOW) {
+                    o->s_recv_waiting = 0;
+                    PacketPassInterface_Done(&o->s_input);
+                }
+            }
+        } break;
+        
+        case MSG_FREE: {
+            link_log(o, BLOG_INFO, "closing");
+            
+            // free shard side
+            link_free_shard(o);
+            
+            // let control free the memory
+            init_msg(&o->freed_msg, MSG_FREED, o);
+            BMailbox_Thread_Post(&o->shards->mailbox, &o->freed_msg.node);
+        } break;
+        
+        default: ASSERT(0);
+    }
+}
+
+void control_mailbox_handler (ClientShards *o, BMailboxNode *node)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    struct ClientShards_msg *msg = UPPER_OBJECT(node, struct ClientShards_msg, node);
+    ClientShardsLink *link = msg->link;
+    
+    switch (msg->type) {
+        case MSG_NEW: {
+            link->state = LINK_STATE_NEW;
+            
+            // call handler, which accepts or frees the link
+            o->handler_new(o->user, link, link->addr);
+            ASSERT(link->state != LINK_STATE_NEW)
+        } break;
+        
+        case MSG_UP: {
+            if (link->state != LINK_STATE_ACCEPTED) {
+                o->free_cert(msg->ptr);
+                return;
+            }
+            
+            link->handler_up(link->user, msg->ptr);
+        } break;
+        
+        case MSG_PACKET: {
+            if (link->state == LINK_STATE_ACCEPTED) {
+                // credit the packet back to the shard later
+                link->recv_credit++;
+                BPending_Set(&link->credit_job);
+                
+                // call handler
+                link->handler_packet(link->user, MSG_DATA(msg), msg->value);
+            }
+        } break;
+        
+        case MSG_ERROR: {
+            if (link->state != LINK_STATE_ACCEPTED) {
+                return;
+            }
+            
+            link->handler_error(link->user, msg->value);
+        } break;
+        
+        case MSG_SEND_CREDIT: {
+            if (link->state == LINK_STATE_ACCEPTED) {
+                ASSERT(msg->value > 0)
+                ASSERT(msg->value <= link->output_queued)
+                
+                link->output_queued -= msg->value;
+                
+                // accept the waiting packet if there is room now
+                if (link->output_waiting && link->output_queued < CLIENTSHARDS_LINK_WINDOW) {
+                    ASSERT(link->have_output)
+                    link->output_waiting = 0;
+                    PacketPassInterface_Done(&link->output);
+                }
+            }
+        } break;
+        
+        case MSG_FREED: {
+            ASSERT(link->state == LINK_STATE_FREEING)
+            
+            free(link);
+        } break;
+        
+        default: ASSERT(0);
+    }
+}
+
+void link_logfunc (ClientShardsLink *o)
+{
+    char addr[BADDR_MAX_PRINT_LEN];
+    BAddr_Print(&o->addr, addr);
+    
+    BLog_Append("client (%s): ", addr);
+}
+
+void link_log (ClientShardsLink *o, int level, const char *fmt, ...)
+{
+    va_list vl;
+    va_start(vl, fmt);
+    BLog_LogViaFuncVarArg((BLog_logfunc)link_logfunc, o, BLOG_CURRENT_CHANNEL, level, fmt, vl);
+    va_end(vl);
+}
+
+void link_post_control (ClientShardsLink *o, struct ClientShards_msg *msg)
+{
+    BMailbox_Thread_Post(&o->shards->mailbox, &msg->node);
+}
+
+void link_report_error (ClientShardsLink *o, int event)
+{
+    ASSERT(o->s_state == LINK_SSTATE_ACTIVE)
+    
+    // close connection now, as errors require
+    link_close(o);
+    
+    // report to control thread, which will free the link
+    init_msg(&o->error_msg, MSG_ERROR, o);
+    o->error_msg.value = event;
+    link_post_control(o, &o->error_msg);
+}
+
+int link_init_io (ClientShardsLink *o)
+{
+    ASSERT(o->s_state == LINK_SSTATE_ACTIVE)
+    ASSERT(!o->s_have_io)
+    
+    ClientShards *sh = o->shards;
+    BPendingGroup *pg = BReactor_PendingGroup(&o->shard->reactor);
+    
+    StreamPassInterface *send_if = (sh->model_prfd ? BSSLConnection_GetSendIf(&o->s_sslcon) : BConnection_SendAsync_GetIf(&o->s_con));
+    StreamRecvInterface *recv_if = (sh->model_prfd ? BSSLConnection_GetRecvIf(&o->s_sslcon) : BConnection_RecvAsync_GetIf(&o->s_con));
+    
+    // init input interface
+    PacketPassInterface_Init(&o->s_input, sh->recv_mtu, (PacketPassInterface_handler_send)link_input_handler_send, o, pg);
+    
+    // init decoder
+    if (!PacketProtoDecoder_Init(&o->s_decoder, recv_if, &o->s_input, pg, o, (PacketProtoDecoder_handler_error)link_decoder_handler_error)) {
+        link_log(o, BLOG_ERROR, "PacketProtoDecoder_Init failed");
+        goto fail1;
+    }
+    o->s_recv_posted = 0;
+    o->s_recv_waiting = 0;
+    
+    // init sending; queued packets are written directly, as many at once as possible
+    o->s_send_if = send_if;
+    StreamPassInterface_Sender_Init(o->s_send_if, (StreamPassInterface_handler_done)link_sender_handler_done, o);
+    
+    // init send queue
+    LinkedList1_Init(&o->s_send_queue);
+    o->s_send_offset = 0;
+    o->s_sending = 0;
+    
+    o->s_have_io = 1;
+    
+    return 1;
+    
+fail1:
+    PacketPassInterface_Free(&o->s_input);
+    return 0;
+}
+
+void link_close (ClientShardsLink *o)
+{
+    ASSERT(o->s_state == LINK_SSTATE_ACTIVE)
+    
+    ClientShards *sh = o->shards;
+    
+    // free I/O
+    if (o->s_have_io) {
+        // allow freeing queued packets which SSL may still be using
+        if (sh->model_prfd) {
+            BSSLConnection_ReleaseBuffers(&o->s_sslcon);
+        }
+        
+        // drop queued packets; their messages belong to the link
+        LinkedList1_Init(&o->s_send_queue);
+        
+        PacketProtoDecoder_Free(&o->s_decoder);
+        PacketPassInterface_Free(&o->s_input);
+        
+        o->s_have_io = 0;
+    }
+    
+    // free SSL
+    if (sh->model_prfd) {
+        BSSLConnection_Free(&o->s_sslcon);
+        ASSERT_FORCE(PR_Close(o->s_ssl_prfd) == PR_SUCCESS)
+    }
+    
+    // free connection
+    BConnection_RecvAsync_Free(&o->s_con);
+    BConnection_SendAsync_Free(&o->s_con);
+    BConnection_Free(&o->s_con);
+    
+    // set dead
+    o->s_state = LINK_SSTATE_DEAD;
+}
+
+void link_free_shard (ClientShardsLink *o)
+{
+    // close connection if there was no error
+    if (o->s_state == LINK_SSTATE_ACTIVE) {
+        link_close(o);
+    }
+    
+    // free credit job
+    BPending_Free(&o->s_credit_job);
+    
+    // remove from shard's list
+    LinkedList1_Remove(&o->shard->links_list, &o->s_list_node);
+}
+
+void link_connection_handler (ClientShardsLink *o, int event)
+{
+    ASSERT(o->s_state == LINK_SSTATE_ACTIVE)
+    
+    // the control thread logs this
+    link_report_error(o, (event == BCONNECTION_EVENT_RECVCLOSED ? CLIENTSHARDS_EVENT_RECVCLOSED : CLIENTSHARDS_EVENT_ERROR));
+}
+
+void link_sslcon_handler (ClientShardsLink *o, int event)
+{
+    ASSERT(o->shards->model_prfd)
+    ASSERT(o->s_state == LINK_SSTATE_ACTIVE)
+    ASSERT(event == BSSLCONNECTION_EVENT_UP || event == BSSLCONNECTION_EVENT_ERROR)
+    ASSERT(!(event == BSSLCONNECTION_EVENT_UP) || !o->s_have_io)
+    
+    if (event == BSSLCONNECTION_EVENT_ERROR) {
+        link_log(o, BLOG_ERROR, "SSL error");
+        link_report_error(o, CLIENTSHARDS_EVENT_ERROR);
+        return;
+    }
+    
+    // read certificate
+    void *cert = o->shards->read_cert(o->s_ssl_prfd, (BLog_logfunc)link_logfunc, o);
+    if (!cert) {
+        goto fail0;
+    }
+    
+    // initialize I/O
+    if (!link_init_io(o)) {
+        goto fail1;
+    }
+    
+    // pass certificate to control thread
+    init_msg(&o->up_msg, MSG_UP, o);
+    o->up_msg.ptr = cert;
+    link_post_control(o, &o->up_msg);
+    
+    return;
+    
+fail1:
+    o->shards->free_cert(cert);
+fail0:
+    link_report_error(o, CLIENTSHARDS_EVENT_ERROR);
+}
+
+void link_decoder_handler_error (ClientShardsLink *o)
+{
+    ASSERT(o->s_state == LINK_SSTATE_ACTIVE)
+    ASSERT(o->s_have_io)
+    
+    link_log(o, BLOG_ERROR, "decoder error");
+    link_report_error(o, CLIENTSHARDS_EVENT_ERROR);
+}
+
+void link_input_handler_send (ClientShardsLink *o, uint8_t *data, int data_len)
+{
+    ASSERT(o->s_state == LINK_SSTATE_ACTIVE)
+    ASSERT(o->s_have_io)
+    ASSERT(!o->s_recv_waiting)
+    ASSERT(o->s_recv_posted < CLIENTSHARDS_LINK_WINDOW)
+    
+    // copy packet to message
+    struct ClientShards_msg *msg = take_msg(o->s_recv_slots, o->shards->recv_slot_size, &o->s_recv_next, MSG_PACKET, o);
+    msg->value = data_len;
+    memcpy(MSG_DATA(msg), data, data_len);
+    
+    // pass to control thread
+    link_post_control(o, msg);
+    o->s_recv_posted++;
+    
+    // accept the packet, or wait for credit
+    if (o->s_recv_posted < CLIENTSHARDS_LINK_WINDOW) {
+        PacketPassInterface_Done(&o->s_input);
+    } else {
+        o->s_recv_waiting = 1;
+    }
+}
+
+void link_send_finish (ClientShardsLink *o)
+{
+    ASSERT(o->s_have_io)
+    ASSERT(!o->s_sending)
+    
+    // remove packets which have been sent completely
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&o->s_send_queue)) {
+        struct ClientShards_msg *msg = UPPER_OBJECT(node, struct ClientShards_msg, list_node);
+        if (o->s_send_offset < msg->value) {
+            break;
+        }
+        
+        o->s_send_offset -= msg->value;
+        LinkedList1_Remove(&o->s_send_queue, node);
+        
+        // credit control thread later, for all packets sent until then
+        o->s_send_credit++;
+        BPending_Set(&o->s_credit_job);
+    }
+    
+    ASSERT(!LinkedList1_IsEmpty(&o->s_send_queue) || o->s_send_offset == 0)
+}
+
+void link_send_next (ClientShardsLink *o)
+{
+    ASSERT(o->s_have_io)
+    ASSERT(!o->s_sending)
+    ASSERT(!LinkedList1_IsEmpty(&o->s_send_queue))
+    
+    // skip any empty packets
+    link_send_finish(o);
+    
+    // pass the queued packets to the connection at once, starting
+    // where the previous send stopped
+    int num_segs = 0;
+    int offset = o->s_send_offset;
+    for (LinkedList1Node *node = LinkedList1_GetFirst(&o->s_send_queue); node && num_segs < CLIENTSHARDS_LINK_WINDOW; node = LinkedList1Node_Next(node)) {
+        struct ClientShards_msg *msg = UPPER_OBJECT(node, struct ClientShards_msg, list_node);
+        if (msg->value > offset) {
+            o->s_send_segs[num_segs].data = MSG_DATA(msg) + offset;
+            o->s_send_segs[num_segs].data_len = msg->value - offset;
+            num_segs++;
+        }
+        offset = 0;
+    }
+    
+    if (num_segs == 0) {
+        return;
+    }
+    
+    o->s_sending = 1;
+    StreamPassInterface_Sender_Sendv(o->s_send_if, o->s_send_segs, num_segs);
+}
+
+void link_sender_handler_done (ClientShardsLink *o, int data_len)
+{
+    ASSERT(o->s_have_io)
+    ASSERT(o->s_sending)
+    ASSERT(data_len > 0)
+    
+    o->s_sending = 0;
+    o->s_send_offset += data_len;
+    
+    // remove sent packets
+    link_send_finish(o);
+    
+    // send the rest
+    if (!LinkedList1_IsEmpty(&o->s_send_queue)) {
+        link_send_next(o);
+    }
+}
+
+void link_s_credit_job_handler (ClientShardsLink *o)
+{
+    ASSERT(o->s_send_credit > 0)
+    
+    // no use after an error
+    if (o->s_state != LINK_SSTATE_ACTIVE) {
+        return;
+    }
+    
+    struct ClientShards_msg *msg = take_msg((uint8_t *)o->s_credit_msgs, sizeof(o->s_credit_msgs[0]), &o->s_credit_next, MSG_SEND_CREDIT, o);
+    msg->value = o->s_send_credit;
+    o->s_send_credit = 0;
+    
+    link_post_control(o, msg);
+}
+
+void link_output_handler_send (ClientShardsLink *o, uint8_t *data, int data_len)
+{
+    ASSERT(o->state == LINK_STATE_ACCEPTED)
+    ASSERT(o->have_output)
+    ASSERT(!o->output_waiting)
+    ASSERT(o->output_queued < CLIENTSHARDS_LINK_WINDOW)
+    DebugObject_Access(&o->d_obj);
+    
+    // copy packet to message
+    struct ClientShards_msg *msg = take_msg(o->send_slots, o->shards->send_slot_size, &o->send_next, MSG_SEND, o);
+    msg->value = data_len;
+    memcpy(MSG_DATA(msg), data, data_len);
+    
+    // pass to shard
+    BMailbox_Thread_Post(&o->shard->mailbox, &msg->node);
+    o->output_queued++;
+    
+    // accept the packet, or wait for credit
+    if (o->output_queued < CLIENTSHARDS_LINK_WINDOW) {
+        PacketPassInterface_Done(&o->output);
+    } else {
+        o->output_waiting = 1;
+    }
+}
+
+void link_credit_job_handler (ClientShardsLink *o)
+{
+    ASSERT(o->state == LINK_STATE_ACCEPTED)
+    ASSERT(o->recv_credit > 0)
+    DebugObject_Access(&o->d_obj);
+    
+    struct ClientShards_msg *msg = take_msg((uint8_t *)o->credit_msgs, sizeof(o->credit_msgs[0]), &o->credit_next, MSG_RECV_CREDIT, o);
+    msg->value = o->recv_credit;
+    o->recv_credit = 0;
+    
+    BMailbox_Thread_Post(&o->shard->mailbox, &msg->node);
+}
+
+int ClientShards_Init (ClientShards *o, BReactor *reactor, int num_shards, BAddr *listen_addrs, int num_listen_addrs,
+                       int recv_mtu, int send_mtu, int socket_sndbuf, PRFileDesc *model_prfd, int ssl_flags, int num_threads,
+                       ClientShards_read_cert_func read_cert, ClientShards_free_cert_func free_cert,
+                       void *user, ClientShards_handler_new handler_new)
+{
+    ASSERT(num_shards > 0)
+    ASSERT(num_listen_addrs > 0)
+    ASSERT(recv_mtu >= 0)
+    ASSERT(recv_mtu <= PACKETPROTO_MAXPAYLOAD)
+    ASSERT(send_mtu > 0)
+    ASSERT(!model_prfd || read_cert)
+    ASSERT(!model_prfd || free_cert)
+    ASSERT(handler_new)
+    
+    // init arguments
+    o->reactor = reactor;
+    o->recv_mtu = recv_mtu;
+    o->send_mtu = send_mtu;
+    o->socket_sndbuf = socket_sndbuf;
+    o->model_prfd = model_prfd;
+    o->ssl_flags = ssl_flags;
+    o->read_cert = read_cert;
+    o->free_cert = free_cert;
+    o->user = user;
+    o->handler_new = handler_new;
+    
+    // compute the size of a link with its packet message rings
+    bsize_t link_alloc_size = bsize_fromsize(balign_up(sizeof(ClientShardsLink), BMAX_ALIGN));
+    if (!msg_slot_size(o->recv_mtu, &o->recv_slot_size) || !msg_slot_size(o->send_mtu, &o->send_slot_size) ||
+        !bsize_tosize(bsize_add(link_alloc_size, bsize_mul(bsize_fromint(CLIENTSHARDS_LINK_WINDOW), bsize_add(bsize_fromsize(o->recv_slot_size), bsize_fromsize(o->send_slot_size)))), &o->link_alloc_size)
+    ) {
+        BLog(BLOG_ERROR, "link size overflow");
+        goto fail0;
+    }
+    
+    // init control mailbox
+    if (!BMailbox_Init(&o->mailbox, o->reactor, (BMailbox_handler)control_mailbox_handler, o)) {
+        BLog(BLOG_ERROR, "BMailbox_Init failed");
+        goto fail0;
+    }
+    
+    // allocate shards
+    if (!(o->shards = (struct ClientShards_shard *)BAllocArray(num_shards, sizeof(o->shards[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail1;
+    }
+    
+    // init shards
+    for (o->num_shards = 0; o->num_shards < num_shards; o->num_shards++) {
+        if (!shard_init(&o->shards[o->num_shards], o, listen_addrs, num_listen_addrs, num_threads)) {
+            goto fail2;
+        }
+    }
+    
+    // start shard threads
+    int num_started;
+    for (num_started = 0; num_started < o->num_shards; num_started++) {
+        struct ClientShards_shard *sh = &o->shards[num_started];
+        if (pthread_create(&sh->thread, NULL, shard_thread, sh) != 0) {
+            BLog(BLOG_ERROR, "pthread_create failed");
+            goto fail3;
+        }
+    }
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail3:
+    while (num_started-- > 0) {
+        struct ClientShards_shard *sh = &o->shards[num_started];
+        BMailbox_Thread_Post(&sh->mailbox, &sh->quit_node);
+        ASSERT_FORCE(pthread_join(sh->thread, NULL) == 0)
+    }
+fail2:
+    while (o->num_shards-- > 0) {
+        shard_free(&o->shards[o->num_shards]);
+    }
+    BFree(o->shards);
+fail1:
+    BMailbox_Free(&o->mailbox);
+fail0:
+    return 0;
+}
+
+void ClientShards_Free (ClientShards *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // stop shard threads; they process everything posted to them before quitting
+    for (int i = 0; i < o->num_shards; i++) {
+        struct ClientShards_shard *sh = &o->shards[i];
+        BMailbox_Thread_Post(&sh->mailbox, &sh->quit_node);
+    }
+    for (int i = 0; i < o->num_shards; i++) {
+        ASSERT_FORCE(pthread_join(o->shards[i].thread, NULL) == 0)
+    }
+    
+    // free messages left for control thread
+    BMailboxNode *node;
+    while (node = BMailbox_Get(&o->mailbox)) {
+        struct ClientShards_msg *msg = UPPER_OBJECT(node, struct ClientShards_msg, node);
+        switch (msg->type) {
+            case MSG_NEW:
+            case MSG_ERROR:
+            case MSG_PACKET:
+            case MSG_SEND_CREDIT:
+                // embedded in link, which is freed below
+                break;
+            case MSG_UP:
+                o->free_cert(msg->ptr);
+                break;
+            case MSG_FREED:
+                free(msg->link);
+                break;
+            default:
+                ASSERT(0);
+        }
+    }
+    
+    // free shards
+    while (o->num_shards-- > 0) {
+        shard_free(&o->shards[o->num_shards]);
+    }
+    BFree(o->shards);
+    
+    // free control mailbox
+    BMailbox_Free(&o->mailbox);
+}
+
+void ClientShardsLink_Accept (ClientShardsLink *o, void *user, ClientShardsLink_handler_up handler_up,
+                              ClientShardsLink_handler_packet handler_packet, ClientShardsLink_handler_error handler_error)
+{
+    ASSERT(o->state == LINK_STATE_NEW)
+    ASSERT(handler_packet)
+    ASSERT(handler_error)
+    
+    o->state = LINK_STATE_ACCEPTED;
+    o->user = user;
+    o->handler_up = handler_up;
+    o->handler_packet = handler_packet;
+    o->handler_error = handler_error;
+    o->have_output = 0;
+    o->output_queued = 0;
+    o->output_waiting = 0;
+    o->recv_credit = 0;
+    o->send_next = 0;
+    o->credit_next = 0;
+    
+    BPending_Init(&o->credit_job, BReactor_PendingGroup(o->shards->reactor), (BPending_handler)link_credit_job_handler, o);
+    
+    DebugObject_Init(&o->d_obj);
+}
+
+void ClientShardsLink_Free (ClientShardsLink *o)
+{
+    ASSERT(o->state == LINK_STATE_NEW || o->state == LINK_STATE_ACCEPTED)
+    
+    if (o->state == LINK_STATE_ACCEPTED) {
+        ASSERT(!o->have_output)
+        DebugObject_Free(&o->d_obj);
+        
+        BPending_Free(&o->credit_job);
+    }
+    
+    o->state = LINK_STATE_FREEING;
+    
+    // let the shard close the connection; it will send back MSG_FREED
+    init_msg(&o->free_msg, MSG_FREE, o);
+    BMailbox_Thread_Post(&o->shard->mailbox, &o->free_msg.node);
+}
+
+void ClientShardsLink_InitOutput (ClientShardsLink *o)
+{
+    ASSERT(o->state == LINK_STATE_ACCEPTED)
+    ASSERT(!o->have_output)
+    DebugObject_Access(&o->d_obj);
+    
+    PacketPassInterface_Init(&o->output, o->shards->send_mtu, (PacketPassInterface_handler_send)link_output_handler_send, o, BReactor_PendingGroup(o->shards->reactor));
+    o->have_output = 1;
+    o->output_waiting = 0;
+}
+
+void ClientShardsLink_FreeOutput (ClientShardsLink *o)
+{
+    ASSERT(o->state == LINK_STATE_ACCEPTED)
+    ASSERT(o->have_output)
+    DebugObject_Access(&o->d_obj);
+    
+    PacketPassInterface_Free(&o->output);
+    o->have_output = 0;
+    o->output_waiting = 0;
+}
+
+PacketPassInterface * ClientShardsLink_GetOutput (ClientShardsLink *o)
+{
+    ASSERT(o->state == LINK_STATE_ACCEPTED)
+    ASSERT(o->have_output)
+    DebugObject_Access(&o->d_obj);
+    
+    return &o->output;
+}
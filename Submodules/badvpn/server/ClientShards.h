@@ -0,0 +1,320 @@
+/**
+ * @file ClientShards.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BADVPN_SERVER_CLIENTSHARDS_H
+#define BADVPN_SERVER_CLIENTSHARDS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <prio.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+#include <base/BLog.h>
+#include <base/BPending.h>
+#include <structure/LinkedList1.h>
+#include <system/BReactor.h>
+#include <system/BAddr.h>
+#include <system/BConnection.h>
+#include <system/BMailbox.h>
+#include <flow/PacketPassInterface.h>
+#include <flow/PacketProtoDecoder.h>
+#include <flow/StreamPassInterface.h>
+#include <threadwork/BThreadWork.h>
+#include <nspr_support/BSSLConnection.h>
+
+// how many packets of a client may be on their way between the control
+// thread and its shard, in each direction
+#define CLIENTSHARDS_LINK_WINDOW 16
+
+#define CLIENTSHARDS_EVENT_RECVCLOSED 1
+#define CLIENTSHARDS_EVENT_ERROR 2
+
+typedef struct ClientShards_s ClientShards;
+typedef struct ClientShardsLink_s ClientShardsLink;
+
+/**
+ * Handler called when a shard has accepted a client connection.
+ * It must call either {@link ClientShardsLink_Accept} or {@link ClientShardsLink_Free}
+ * on the link before returning.
+ * 
+ * @param user as in {@link ClientShards_Init}
+ * @param link the new link
+ * @param addr address of the client
+ */
+typedef void (*ClientShards_handler_new) (void *user, ClientShardsLink *link, BAddr addr);
+
+/**
+ * Function called in a shard thread when the SSL handshake with a client is complete.
+ * 
+ * @param ssl_prfd SSL file descriptor of the client
+ * @param logfunc log function for logging about the client
+ * @param log_user argument to logfunc
+ * @return information about the client's certificate, passed to the link's
+ *         handler_up, or NULL on failure (the link reports an error)
+ */
+typedef void * (*ClientShards_read_cert_func) (PRFileDesc *ssl_prfd, BLog_logfunc logfunc, void *log_user);
+
+/**
+ * Function which frees what {@link ClientShards_read_cert_func} returned, if it
+ * cannot be passed to a link's handler_up.
+ * 
+ * @param cert as returned by {@link ClientShards_read_cert_func}
+ */
+typedef void (*ClientShards_free_cert_func) (void *cert);
+
+/**
+ * Handler called when the SSL handshake with the client is complete.
+ * Only used when SSL is used.
+ * 
+ * @param user as in {@link ClientShardsLink_Accept}
+ * @param cert as returned by {@link ClientShards_read_cert_func}; owned by the handler
+ */
+typedef void (*ClientShardsLink_handler_up) (void *user, void *cert);
+
+/**
+ * Handler called when a packet has been received from the client.
+ * 
+ * @param user as in {@link ClientShardsLink_Accept}
+ * @param data packet data; only valid until the handler returns
+ * @param data_len packet length
+ */
+typedef void (*ClientShardsLink_handler_packet) (void *user, uint8_t *data, int data_len);
+
+/**
+ * Handler called when the connection to the client is closed or broken.
+ * The link should be freed.
+ * 
+ * @param user as in {@link ClientShardsLink_Accept}
+ * @param event CLIENTSHARDS_EVENT_RECVCLOSED or CLIENTSHARDS_EVENT_ERROR
+ */
+typedef void (*ClientShardsLink_handler_error) (void *user, int event);
+
+struct ClientShards_msg {
+    BMailboxNode node;
+    LinkedList1Node list_node;
+    int type;
+    ClientShardsLink *link;
+    int value;
+    void *ptr;
+};
+
+struct ClientShards_listener {
+    struct ClientShards_shard *shard;
+    BListener listener;
+};
+
+struct ClientShards_shard {
+    ClientShards *shards;
+    BReactor reactor;
+    BThreadWorkDispatcher twd;
+    BMailbox mailbox;
+    BMailboxNode quit_node;
+    struct ClientShards_listener *listeners;
+    int num_listeners;
+    LinkedList1 links_list;
+    pthread_t thread;
+};
+
+/**
+ * Accepts client connections in a number of threads ("shards"), each with its
+ * own reactor, and does all I/O with the clients there: SSL, decoding received
+ * packets from the stream, and sending. The reactor which the object is
+ * initialized with ("control thread") gets the received packets, and gives
+ * packets to send, through a {@link ClientShardsLink} for each client.
+ * 
+ * The threads exchange messages through lock-free {@link BMailbox}'s. At most
+ * {@link CLIENTSHARDS_LINK_WINDOW} packets per client are on their way in each
+ * direction; after that, the sending side waits like it would for a slow socket.
+ * Because of that bound, the messages carrying packets and credits are taken in
+ * turn from rings of CLIENTSHARDS_LINK_WINDOW messages allocated with each link,
+ * and nothing is allocated per packet.
+ */
+struct ClientShards_s {
+    BReactor *reactor;
+    int recv_mtu;
+    int send_mtu;
+    int socket_sndbuf;
+    PRFileDesc *model_prfd;
+    int ssl_flags;
+    ClientShards_read_cert_func read_cert;
+    ClientShards_free_cert_func free_cert;
+    void *user;
+    ClientShards_handler_new handler_new;
+    size_t recv_slot_size;
+    size_t send_slot_size;
+    size_t link_alloc_size;
+    struct ClientShards_shard *shards;
+    int num_shards;
+    BMailbox mailbox;
+    DebugObject d_obj;
+};
+
+struct ClientShardsLink_s {
+    ClientShards *shards;
+    struct ClientShards_shard *shard;
+    BAddr addr;
+    struct ClientShards_msg new_msg;
+    struct ClientShards_msg up_msg;
+    struct ClientShards_msg error_msg;
+    struct ClientShards_msg free_msg;
+    struct ClientShards_msg freed_msg;
+    
+    // control thread
+    int state;
+    void *user;
+    ClientShardsLink_handler_up handler_up;
+    ClientShardsLink_handler_packet handler_packet;
+    ClientShardsLink_handler_error handler_error;
+    int have_output;
+    PacketPassInterface output;
+    int output_queued;
+    int output_waiting;
+    int recv_credit;
+    BPending credit_job;
+    uint8_t *send_slots;
+    int send_next;
+    struct ClientShards_msg credit_msgs[CLIENTSHARDS_LINK_WINDOW];
+    int credit_next;
+    DebugObject d_obj;
+    
+    // shard thread
+    int s_state;
+    BConnection s_con;
+    PRFileDesc s_bottom_prfd;
+    PRFileDesc *s_ssl_prfd;
+    BSSLConnection s_sslcon;
+    int s_have_io;
+    PacketPassInterface s_input;
+    PacketProtoDecoder s_decoder;
+    int s_recv_posted;
+    int s_recv_waiting;
+    StreamPassInterface *s_send_if;
+    LinkedList1 s_send_queue;
+    StreamPassInterface_segment s_send_segs[CLIENTSHARDS_LINK_WINDOW];
+    int s_send_offset;
+    int s_sending;
+    int s_send_credit;
+    BPending s_credit_job;
+    uint8_t *s_recv_slots;
+    int s_recv_next;
+    struct ClientShards_msg s_credit_msgs[CLIENTSHARDS_LINK_WINDOW];
+    int s_credit_next;
+    LinkedList1Node s_list_node;
+};
+
+/**
+ * Initializes the object and starts the shard threads.
+ * {@link BNetwork_GlobalInit} must have been done. If SSL is used, NSS must be
+ * initialized for use from multiple threads, and {@link BSSLConnection_GlobalInit}
+ * must have been done.
+ * 
+ * @param o the object
+ * @param reactor reactor of the control thread
+ * @param num_shards number of shard threads. Must be >0.
+ * @param listen_addrs addresses to listen on; every shard listens on each of them,
+ *                     with SO_REUSEPORT, letting the system spread connections
+ * @param num_listen_addrs number of listen addresses. Must be >0.
+ * @param recv_mtu maximum size of packets received from clients.
+ *                 Must be >=0 and <=PACKETPROTO_MAXPAYLOAD.
+ * @param send_mtu maximum size of packets sent to clients. These are sent as they are,
+ *                 without any framing. Must be >0.
+ * @param socket_sndbuf socket send buffer size for clients, or <=0 to not set it
+ * @param model_prfd model SSL file descriptor with the server configuration, or NULL
+ *                   to not use SSL
+ * @param ssl_flags flags for {@link BSSLConnection_MakeConnectionBackend}
+ * @param num_threads number of threads for each shard's {@link BThreadWorkDispatcher}
+ * @param read_cert function reading the client certificate. Only used with SSL.
+ * @param free_cert function freeing the result of read_cert. Only used with SSL.
+ * @param user argument to handler
+ * @param handler_new handler called in the control thread for new clients
+ * @return 1 on success, 0 on failure
+ */
+int ClientShards_Init (ClientShards *o, BReactor *reactor, int num_shards, BAddr *listen_addrs, int num_listen_addrs,
+                       int recv_mtu, int send_mtu, int socket_sndbuf, PRFileDesc *model_prfd, int ssl_flags, int num_threads,
+                       ClientShards_read_cert_func read_cert, ClientShards_free_cert_func free_cert,
+                       void *user, ClientShards_handler_new handler_new) WARN_UNUSED;
+
+/**
+ * Stops the shard threads and frees the object.
+ * All accepted links must have been freed.
+ * 
+ * @param o the object
+ */
+void ClientShards_Free (ClientShards *o);
+
+/**
+ * Accepts a link, in the handler_new handler.
+ * Without SSL, the link is up right away; with SSL, handler_up will be called
+ * when the handshake is complete. Packets are only received when the link is up.
+ * 
+ * @param o the link
+ * @param user argument to handlers
+ * @param handler_up handler called when the SSL handshake is complete
+ * @param handler_packet handler called for received packets
+ * @param handler_error handler called when the connection is closed or broken
+ */
+void ClientShardsLink_Accept (ClientShardsLink *o, void *user, ClientShardsLink_handler_up handler_up,
+                              ClientShardsLink_handler_packet handler_packet, ClientShardsLink_handler_error handler_error);
+
+/**
+ * Frees the link, either in the handler_new handler or after it was accepted.
+ * The connection is closed in the shard thread later.
+ * The output must not be initialized.
+ * 
+ * @param o the link
+ */
+void ClientShardsLink_Free (ClientShardsLink *o);
+
+/**
+ * Initializes the output for sending packets to the client.
+ * The link must have been accepted and be up.
+ * 
+ * @param o the link
+ */
+void ClientShardsLink_InitOutput (ClientShardsLink *o);
+
+/**
+ * Frees the output. Packets already passed to it may still be sent.
+ * 
+ * @param o the link
+ */
+void ClientShardsLink_FreeOutput (ClientShardsLink *o);
+
+/**
+ * Returns the output for sending packets to the client.
+ * The output must be initialized.
+ * 
+ * @param o the link
+ * @return output interface, with MTU send_mtu
+ */
+PacketPassInterface * ClientShardsLink_GetOutput (ClientShardsLink *o);
+
+#endif
@@ -58,6 +58,7 @@
 #include <predicate/BPredicate.h>
 #include <base/DebugObject.h>
 #include <base/BLog.h>
+#include <base/BMetrics.h>
 #include <system/BSignal.h>
 #include <system/BTime.h>
 #include <system/BNetwork.h>
@@ -67,6 +68,8 @@
 
 #ifndef BADVPN_USE_WINAPI
 #include <base/BLog_syslog.h>
+#include <base/BLog_async.h>
+#include <system/BMetricsServer.h>
 #endif
 
 #include <server/server.h>
@@ -84,12 +87,14 @@ struct {
     #ifndef BADVPN_USE_WINAPI
     char *logger_syslog_facility;
     char *logger_syslog_ident;
+    int logger_async;
     #endif
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
     int threads;
     int use_threads_for_ssl_handshake;
     int use_threads_for_ssl_data;
+    int use_ktls_for_ssl_data;
     int ssl;
     char *nssdb;
     char *server_cert_name;
@@ -99,6 +104,10 @@ struct {
     char *relay_predicate;
     int client_socket_sndbuf;
     int max_clients;
+    int shards;
+    #ifndef BADVPN_USE_WINAPI
+    char *metrics_socket;
+    #endif
 } options;
 
 // listen addresses
@@ -155,6 +164,21 @@ PRFileDesc *model_prfd;
 BListener listeners[MAX_LISTEN_ADDRS];
 int num_listeners;
 
+#ifndef BADVPN_USE_WINAPI
+// shard threads accepting clients and doing their I/O, if using shards
+ClientShards shards;
+#endif
+
+#ifndef BADVPN_USE_WINAPI
+// metrics server, if enabled
+BMetricsServer metrics_server;
+#endif
+
+static BMetric metric_clients = BMETRIC_GAUGE_INIT("badvpn_server_clients", "Connected clients.");
+static BMetric metric_relayed_messages = BMETRIC_COUNTER_INIT("badvpn_server_relayed_messages_total", "Messages relayed between clients.");
+static BMetric metric_relayed_bytes = BMETRIC_COUNTER_INIT("badvpn_server_relayed_bytes_total", "Payload bytes of messages relayed between clients.");
+static BMetric metric_flow_buffer_resets = BMETRIC_COUNTER_INIT("badvpn_server_flow_buffer_resets_total", "Client pairs reset because a message did not fit into the buffer to the destination.");
+
 // number of connected clients
 int clients_num;
 
@@ -187,6 +211,9 @@ static void signal_handler (void *unused);
 // listener handler, accepts new clients
 static void listener_handler (BListener *listener);
 
+// finishes initializing a new client and adds it to the clients list
+static void client_link_in (struct client_data *client);
+
 // frees resources used by a client
 static void client_dealloc (struct client_data *client);
 
@@ -222,6 +249,28 @@ static void client_sslcon_handler (struct client_data *client, int event);
 // decoder handler
 static void client_decoder_handler_error (struct client_data *client);
 
+// reads the certificate of a client after the SSL handshake
+static int read_client_cert (PRFileDesc *ssl_prfd, BLog_logfunc logfunc, void *log_user, char **out_common_name,
+                             uint8_t *out_cert, int *out_cert_len, uint8_t *out_cert_old, int *out_cert_old_len);
+
+#ifndef BADVPN_USE_WINAPI
+
+// shards handler, accepts new clients
+static void shards_handler_new (void *unused, ClientShardsLink *link, BAddr addr);
+
+// reads a client certificate in a shard thread
+static void * shards_read_cert (PRFileDesc *ssl_prfd, BLog_logfunc logfunc, void *log_user);
+
+// frees a certificate read by shards_read_cert
+static void shards_free_cert (void *cert);
+
+// shard link handlers
+static void client_link_handler_up (struct client_data *client, void *cert);
+static void client_link_handler_packet (struct client_data *client, uint8_t *data, int data_len);
+static void client_link_handler_error (struct client_data *client, int event);
+
+#endif
+
 // provides a buffer for sending a control packet to the client
 static int client_start_control_packet (struct client_data *client, void **data, int len);
 
@@ -237,6 +286,9 @@ static int client_send_endclient (struct client_data *client, peerid_t end_id);
 // handler for packets received from the client
 static void client_input_handler_send (struct client_data *client, uint8_t *data, int data_len);
 
+// processes a packet received from the client
+static void client_process_packet (struct client_data *client, uint8_t *data, int data_len);
+
 // processes hello packets from clients
 static void process_packet_hello (struct client_data *client, uint8_t *data, int data_len);
 
@@ -383,6 +435,13 @@ int main (int argc, char *argv[])
         }
     }
     
+    #ifndef BADVPN_USE_WINAPI
+    // pass messages to the logger from a background thread
+    if (options.logger_async && !BLog_StartAsync(BLOG_ASYNC_DEFAULT_BUFFER_SIZE)) {
+        BLog(BLOG_WARNING, "BLog_StartAsync failed, logging synchronously");
+    }
+    #endif
+    
     BLog(BLOG_NOTICE, "initializing "GLOBAL_PRODUCT_NAME" "PROGRAM_NAME" "GLOBAL_VERSION);
     
     if (options.ssl) {
@@ -501,6 +560,14 @@ int main (int argc, char *argv[])
         goto fail4;
     }
     
+    #ifndef BADVPN_USE_WINAPI
+    // init metrics server
+    if (options.metrics_socket && !BMetricsServer_Init(&metrics_server, options.metrics_socket, &ss)) {
+        BLog(BLOG_ERROR, "BMetricsServer_Init failed");
+        goto fail5;
+    }
+    #endif
+    
     // initialize number of clients
     clients_num = 0;
     
@@ -513,14 +580,27 @@ int main (int argc, char *argv[])
     // initialize clients tree
     BAVL_Init(&clients_tree, OFFSET_DIFF(struct client_data, id, tree_node), (BAVL_comparator)peerid_comparator, NULL);
     
-    // initialize listeners
     num_listeners = 0;
-    while (num_listeners < num_listen_addrs) {
-        if (!BListener_Init(&listeners[num_listeners], listen_addrs[num_listeners], &ss, &listeners[num_listeners], (BListener_handler)listener_handler)) {
-            BLog(BLOG_ERROR, "BListener_Init failed");
+    
+    if (options.shards > 0) {
+        #ifndef BADVPN_USE_WINAPI
+        // initialize shards, which listen themselves
+        if (!ClientShards_Init(&shards, &ss, options.shards, listen_addrs, num_listen_addrs, SC_MAX_ENC, PACKETPROTO_ENCLEN(SC_MAX_ENC),
+                               options.client_socket_sndbuf, (options.ssl ? model_prfd : NULL), ssl_flags(), options.threads,
+                               shards_read_cert, shards_free_cert, NULL, shards_handler_new)) {
+            BLog(BLOG_ERROR, "ClientShards_Init failed");
             goto fail10;
         }
-        num_listeners++;
+        #endif
+    } else {
+        // initialize listeners
+        while (num_listeners < num_listen_addrs) {
+            if (!BListener_Init(&listeners[num_listeners], listen_addrs[num_listeners], &ss, &listeners[num_listeners], (BListener_handler)listener_handler)) {
+                BLog(BLOG_ERROR, "BListener_Init failed");
+                goto fail10;
+            }
+            num_listeners++;
+        }
     }
     
     // enter event loop
@@ -562,12 +642,25 @@ int main (int argc, char *argv[])
         // deallocate client
         client_dealloc(client);
     }
+    
+    #ifndef BADVPN_USE_WINAPI
+    // free shards
+    if (options.shards > 0) {
+        ClientShards_Free(&shards);
+    }
+    #endif
 fail10:
     while (num_listeners > 0) {
         num_listeners--;
         BListener_Free(&listeners[num_listeners]);
     }
     
+    #ifndef BADVPN_USE_WINAPI
+    if (options.metrics_socket) {
+        BMetricsServer_Free(&metrics_server);
+    }
+fail5:
+    #endif
     BSignal_Finish();
 fail4:
     BThreadWorkDispatcher_Free(&twd);
@@ -625,18 +718,26 @@ void print_help (const char *name)
         "            [--syslog-facility <string>]\n"
         "            [--syslog-ident <string>]\n"
         "        )\n"
+        "        [--logger-async]\n"
         #endif
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
+        #ifndef BADVPN_USE_WINAPI
+        "        [--metrics-socket <path>]\n"
+        #endif
         "        [--threads <integer>]\n"
         "        [--use-threads-for-ssl-handshake]\n"
         "        [--use-threads-for-ssl-data]\n"
+        "        [--use-ktls-for-ssl-data]\n"
         "        [--listen-addr <addr>] ...\n"
         "        [--ssl --nssdb <string> --server-cert-name <string>]\n"
         "        [--comm-predicate <string>]\n"
         "        [--relay-predicate <string>]\n"
         "        [--client-socket-sndbuf <bytes / 0>]\n"
         "        [--max-clients <number>]\n"
+        #ifndef BADVPN_USE_WINAPI
+        "        [--shards <number>]\n"
+        #endif
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
         name
     );
@@ -655,6 +756,8 @@ int parse_arguments (int argc, char *argv[])
     #ifndef BADVPN_USE_WINAPI
     options.logger_syslog_facility = "daemon";
     options.logger_syslog_ident = argv[0];
+    options.logger_async = 0;
+    options.metrics_socket = NULL;
     #endif
     options.loglevel = -1;
     for (int i = 0; i < BLOG_NUM_CHANNELS; i++) {
@@ -663,6 +766,7 @@ int parse_arguments (int argc, char *argv[])
     options.threads = 0;
     options.use_threads_for_ssl_handshake = 0;
     options.use_threads_for_ssl_data = 0;
+    options.use_ktls_for_ssl_data = 0;
     options.ssl = 0;
     options.nssdb = NULL;
     options.server_cert_name = NULL;
@@ -671,6 +775,7 @@ int parse_arguments (int argc, char *argv[])
     options.relay_predicate = NULL;
     options.client_socket_sndbuf = CLIENT_DEFAULT_SOCKET_SNDBUF;
     options.max_clients = DEFAULT_MAX_CLIENTS;
+    options.shards = 0;
     
     for (int i = 1; i < argc; i++) {
         char *arg = argv[i];
@@ -717,6 +822,17 @@ int parse_arguments (int argc, char *argv[])
             options.logger_syslog_ident = argv[i + 1];
             i++;
         }
+        else if (!strcmp(arg, "--logger-async")) {
+            options.logger_async = 1;
+        }
+        else if (!strcmp(arg, "--metrics-socket")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.metrics_socket = argv[i + 1];
+            i++;
+        }
         #endif
         else if (!strcmp(arg, "--loglevel")) {
             if (1 >= argc - i) {
@@ -761,6 +877,9 @@ int parse_arguments (int argc, char *argv[])
         else if (!strcmp(arg, "--use-threads-for-ssl-data")) {
             options.use_threads_for_ssl_data = 1;
         }
+        else if (!strcmp(arg, "--use-ktls-for-ssl-data")) {
+            options.use_ktls_for_ssl_data = 1;
+        }
         else if (!strcmp(arg, "--ssl")) {
             options.ssl = 1;
         }
@@ -831,6 +950,19 @@ int parse_arguments (int argc, char *argv[])
             }
             i++;
         }
+        #ifndef BADVPN_USE_WINAPI
+        else if (!strcmp(arg, "--shards")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.shards = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        #endif
         else {
             fprintf(stderr, "%s: unknown option\n", arg);
             return 0;
@@ -878,6 +1010,9 @@ int ssl_flags (void)
     if (options.use_threads_for_ssl_data) {
         flags |= BSSLCONNECTION_FLAG_THREADWORK_IO;
     }
+    if (options.use_ktls_for_ssl_data) {
+        flags |= BSSLCONNECTION_FLAG_KTLS;
+    }
     return flags;
 }
 
@@ -930,8 +1065,8 @@ void listener_handler (BListener *listener)
     
     if (options.ssl) {
         // create bottom NSPR file descriptor
-        if (!BSSLConnection_MakeBackend(&client->bottom_prfd, BConnection_SendAsync_GetIf(&client->con), BConnection_RecvAsync_GetIf(&client->con), &twd, ssl_flags())) {
-            client_log(client, BLOG_ERROR, "BSSLConnection_MakeBackend failed");
+        if (!BSSLConnection_MakeConnectionBackend(&client->bottom_prfd, &client->con, &twd, ssl_flags())) {
+            client_log(client, BLOG_ERROR, "BSSLConnection_MakeConnectionBackend failed");
             goto fail2;
         }
         
@@ -967,12 +1102,34 @@ void listener_handler (BListener *listener)
         }
     }
     
+    // add client
+    client_link_in(client);
+    
+    return;
+    
+    if (options.ssl) {
+fail3:
+        ASSERT_FORCE(PR_Close(client->ssl_prfd) == PR_SUCCESS)
+    }
+fail2:
+    BConnection_RecvAsync_Free(&client->con);
+    BConnection_SendAsync_Free(&client->con);
+    BConnection_Free(&client->con);
+fail1:
+    free(client);
+fail0:
+    return;
+}
+
+void client_link_in (struct client_data *client)
+{
     // start disconnect timer
     BTimer_Init(&client->disconnect_timer, CLIENT_NO_DATA_TIME_LIMIT, (BTimer_handler)client_disconnect_timer_handler, client);
     BReactor_SetTimer(&ss, &client->disconnect_timer);
     
     // link in
     clients_num++;
+    BMetric_Add(&metric_clients, 1);
     LinkedList1_Append(&clients, &client->list_node);
     ASSERT_EXECUTE(BAVL_Insert(&clients_tree, &client->tree_node, NULL))
     
@@ -992,21 +1149,6 @@ void listener_handler (BListener *listener)
     client->initstatus = (options.ssl ? INITSTATUS_HANDSHAKE : INITSTATUS_WAITHELLO);
     
     client_log(client, BLOG_INFO, "initialized");
-    
-    return;
-    
-    if (options.ssl) {
-fail3:
-        ASSERT_FORCE(PR_Close(client->ssl_prfd) == PR_SUCCESS)
-    }
-fail2:
-    BConnection_RecvAsync_Free(&client->con);
-    BConnection_SendAsync_Free(&client->con);
-    BConnection_Free(&client->con);
-fail1:
-    free(client);
-fail0:
-    return;
 }
 
 void client_dealloc (struct client_data *client)
@@ -1027,27 +1169,37 @@ void client_dealloc (struct client_data *client)
     BAVL_Remove(&clients_tree, &client->tree_node);
     LinkedList1_Remove(&clients, &client->list_node);
     clients_num--;
+    BMetric_Sub(&metric_clients, 1);
     
     // stop disconnect timer
     BReactor_RemoveTimer(&ss, &client->disconnect_timer);
     
-    // free SSL
-    if (options.ssl) {
-        BSSLConnection_Free(&client->sslcon);
-        ASSERT_FORCE(PR_Close(client->ssl_prfd) == PR_SUCCESS)
-    }
-    
     // free common name
     if (client->common_name) {
         PORT_Free(client->common_name);
     }
     
-    // free connection interfaces
-    BConnection_RecvAsync_Free(&client->con);
-    BConnection_SendAsync_Free(&client->con);
-    
-    // free connection
-    BConnection_Free(&client->con);
+    if (options.shards > 0) {
+        #ifndef BADVPN_USE_WINAPI
+        // free link, unless it was freed in client_remove()
+        if (!client->dying) {
+            ClientShardsLink_Free(client->link);
+        }
+        #endif
+    } else {
+        // free SSL
+        if (options.ssl) {
+            BSSLConnection_Free(&client->sslcon);
+            ASSERT_FORCE(PR_Close(client->ssl_prfd) == PR_SUCCESS)
+        }
+        
+        // free connection interfaces
+        BConnection_RecvAsync_Free(&client->con);
+        BConnection_SendAsync_Free(&client->con);
+        
+        // free connection
+        BConnection_Free(&client->con);
+    }
     
     // free memory
     free(client);
@@ -1066,29 +1218,42 @@ int client_compute_buffer_size (struct client_data *client)
 
 int client_init_io (struct client_data *client)
 {
-    StreamPassInterface *send_if = (options.ssl ? BSSLConnection_GetSendIf(&client->sslcon) : BConnection_SendAsync_GetIf(&client->con));
-    StreamRecvInterface *recv_if = (options.ssl ? BSSLConnection_GetRecvIf(&client->sslcon) : BConnection_RecvAsync_GetIf(&client->con));
-    
-    // init input
+    PacketPassInterface *output;
     
-    // init interface
-    PacketPassInterface_Init(&client->input_interface, SC_MAX_ENC, (PacketPassInterface_handler_send)client_input_handler_send, client, BReactor_PendingGroup(&ss));
-    
-    // init decoder
-    if (!PacketProtoDecoder_Init(&client->input_decoder, recv_if, &client->input_interface, BReactor_PendingGroup(&ss), client,
-        (PacketProtoDecoder_handler_error)client_decoder_handler_error
-    )) {
-        client_log(client, BLOG_ERROR, "PacketProtoDecoder_Init failed");
-        goto fail1;
+    if (options.shards > 0) {
+        #ifndef BADVPN_USE_WINAPI
+        // the shard decodes input and passes it to client_link_handler_packet()
+        
+        // init output to shard
+        ClientShardsLink_InitOutput(client->link);
+        output = ClientShardsLink_GetOutput(client->link);
+        #endif
+    } else {
+        StreamPassInterface *send_if = (options.ssl ? BSSLConnection_GetSendIf(&client->sslcon) : BConnection_SendAsync_GetIf(&client->con));
+        StreamRecvInterface *recv_if = (options.ssl ? BSSLConnection_GetRecvIf(&client->sslcon) : BConnection_RecvAsync_GetIf(&client->con));
+        
+        // init input
+        
+        // init interface
+        PacketPassInterface_Init(&client->input_interface, SC_MAX_ENC, (PacketPassInterface_handler_send)client_input_handler_send, client, BReactor_PendingGroup(&ss));
+        
+        // init decoder
+        if (!PacketProtoDecoder_Init(&client->input_decoder, recv_if, &client->input_interface, BReactor_PendingGroup(&ss), client,
+            (PacketProtoDecoder_handler_error)client_decoder_handler_error
+        )) {
+            client_log(client, BLOG_ERROR, "PacketProtoDecoder_Init failed");
+            goto fail1;
+        }
+        
+        // init sender
+        PacketStreamSender_Init(&client->output_sender, send_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), BReactor_PendingGroup(&ss));
+        output = PacketStreamSender_GetInput(&client->output_sender);
     }
     
     // init output common
     
-    // init sender
-    PacketStreamSender_Init(&client->output_sender, send_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), BReactor_PendingGroup(&ss));
-    
     // init queue
-    PacketPassPriorityQueue_Init(&client->output_priorityqueue, PacketStreamSender_GetInput(&client->output_sender), BReactor_PendingGroup(&ss), 0);
+    PacketPassPriorityQueue_Init(&client->output_priorityqueue, output, BReactor_PendingGroup(&ss), 0);
     
     // init output control flow
     
@@ -1130,6 +1295,12 @@ fail2:
     PacketPassPriorityQueueFlow_Free(&client->output_control_qflow);
     // free output common
     PacketPassPriorityQueue_Free(&client->output_priorityqueue);
+    if (options.shards > 0) {
+        #ifndef BADVPN_USE_WINAPI
+        ClientShardsLink_FreeOutput(client->link);
+        #endif
+        return 0;
+    }
     PacketStreamSender_Free(&client->output_sender);
     // free input
     PacketProtoDecoder_Free(&client->input_decoder);
@@ -1141,7 +1312,7 @@ fail1:
 void client_dealloc_io (struct client_data *client)
 {
     // stop using any buffers before they get freed
-    if (options.ssl) {
+    if (options.ssl && options.shards == 0) {
         BSSLConnection_ReleaseBuffers(&client->sslcon);
     }
     
@@ -1169,11 +1340,19 @@ void client_dealloc_io (struct client_data *client)
     
     // free output common
     PacketPassPriorityQueue_Free(&client->output_priorityqueue);
-    PacketStreamSender_Free(&client->output_sender);
     
-    // free input
-    PacketProtoDecoder_Free(&client->input_decoder);
-    PacketPassInterface_Free(&client->input_interface);
+    if (options.shards > 0) {
+        #ifndef BADVPN_USE_WINAPI
+        // free output to shard
+        ClientShardsLink_FreeOutput(client->link);
+        #endif
+    } else {
+        PacketStreamSender_Free(&client->output_sender);
+        
+        // free input
+        PacketProtoDecoder_Free(&client->input_decoder);
+        PacketPassInterface_Free(&client->input_interface);
+    }
 }
 
 void client_remove (struct client_data *client)
@@ -1190,6 +1369,13 @@ void client_remove (struct client_data *client)
         client_dealloc_io(client);
     }
     
+    #ifndef BADVPN_USE_WINAPI
+    // free link now, so that its handlers are not called any more
+    if (options.shards > 0) {
+        ClientShardsLink_Free(client->link);
+    }
+    #endif
+    
     // remove outgoing knows
     LinkedList1Node *node;
     while (node = LinkedList1_GetFirst(&client->know_out_list)) {
@@ -1292,84 +1478,232 @@ void client_sslcon_handler (struct client_data *client, int event)
         return;
     }
     
+    // read client certificate
+    if (!read_client_cert(client->ssl_prfd, (BLog_logfunc)client_logfunc, client, &client->common_name,
+                          client->cert, &client->cert_len, client->cert_old, &client->cert_old_len)) {
+        goto fail0;
+    }
+    
+    // init I/O chains
+    if (!client_init_io(client)) {
+        goto fail0;
+    }
+    
+    // set client state
+    client->initstatus = INITSTATUS_WAITHELLO;
+    
+    client_log(client, BLOG_INFO, "handshake complete");
+    
+    return;
+    
+    // handle errors
+fail0:
+    client_remove(client);
+}
+
+void client_decoder_handler_error (struct client_data *client)
+{
+    ASSERT(INITSTATUS_HASLINK(client->initstatus))
+    ASSERT(!client->dying)
+    
+    client_log(client, BLOG_ERROR, "decoder error");
+    
+    client_remove(client);
+    return;
+}
+
+int read_client_cert (PRFileDesc *ssl_prfd, BLog_logfunc logfunc, void *log_user, char **out_common_name,
+                      uint8_t *out_cert, int *out_cert_len, uint8_t *out_cert_old, int *out_cert_old_len)
+{
     // get client certificate
-    CERTCertificate *cert = SSL_PeerCertificate(client->ssl_prfd);
+    CERTCertificate *cert = SSL_PeerCertificate(ssl_prfd);
     if (!cert) {
-        client_log(client, BLOG_ERROR, "SSL_PeerCertificate failed");
+        BLog_LogViaFunc(logfunc, log_user, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "SSL_PeerCertificate failed");
         goto fail0;
     }
     
     // remember common name
-    if (!(client->common_name = CERT_GetCommonName(&cert->subject))) {
-        client_log(client, BLOG_NOTICE, "CERT_GetCommonName failed");
+    if (!(*out_common_name = CERT_GetCommonName(&cert->subject))) {
+        BLog_LogViaFunc(logfunc, log_user, BLOG_CURRENT_CHANNEL, BLOG_NOTICE, "CERT_GetCommonName failed");
         goto fail1;
     }
     
     // store certificate
     SECItem der = cert->derCert;
-    if (der.len > sizeof(client->cert)) {
-        client_log(client, BLOG_NOTICE, "client certificate too big");
+    if (der.len > SCID_NEWCLIENT_MAX_CERT_LEN) {
+        BLog_LogViaFunc(logfunc, log_user, BLOG_CURRENT_CHANNEL, BLOG_NOTICE, "client certificate too big");
         goto fail1;
     }
-    memcpy(client->cert, der.data, der.len);
-    client->cert_len = der.len;
+    memcpy(out_cert, der.data, der.len);
+    *out_cert_len = der.len;
     
     PRArenaPool *arena = PORT_NewArena(DER_DEFAULT_CHUNKSIZE);
     if (!arena) {
-        client_log(client, BLOG_ERROR, "PORT_NewArena failed");
+        BLog_LogViaFunc(logfunc, log_user, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "PORT_NewArena failed");
         goto fail1;
     }
     
     // encode certificate
     memset(&der, 0, sizeof(der));
     if (!SEC_ASN1EncodeItem(arena, &der, cert, SEC_ASN1_GET(CERT_CertificateTemplate))) {
-        client_log(client, BLOG_ERROR, "SEC_ASN1EncodeItem failed");
+        BLog_LogViaFunc(logfunc, log_user, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "SEC_ASN1EncodeItem failed");
         goto fail2;
     }
     
     // store re-encoded certificate (for compatibility with old clients)
-    if (der.len > sizeof(client->cert_old)) {
-        client_log(client, BLOG_NOTICE, "client certificate too big");
+    if (der.len > SCID_NEWCLIENT_MAX_CERT_LEN) {
+        BLog_LogViaFunc(logfunc, log_user, BLOG_CURRENT_CHANNEL, BLOG_NOTICE, "client certificate too big");
         goto fail2;
     }
-    memcpy(client->cert_old, der.data, der.len);
-    client->cert_old_len = der.len;
+    memcpy(out_cert_old, der.data, der.len);
+    *out_cert_old_len = der.len;
     
-    // init I/O chains
-    if (!client_init_io(client)) {
-        goto fail2;
-    }
+    PORT_FreeArena(arena, PR_FALSE);
+    CERT_DestroyCertificate(cert);
     
+    return 1;
+    
+fail2:
     PORT_FreeArena(arena, PR_FALSE);
+fail1:
     CERT_DestroyCertificate(cert);
+fail0:
+    return 0;
+}
+
+#ifndef BADVPN_USE_WINAPI
+
+void shards_handler_new (void *unused, ClientShardsLink *link, BAddr addr)
+{
+    if (clients_num == options.max_clients) {
+        BLog(BLOG_WARNING, "too many clients for new client");
+        goto fail0;
+    }
     
-    // set client state
-    client->initstatus = INITSTATUS_WAITHELLO;
+    // allocate the client structure
+    struct client_data *client = (struct client_data *)malloc(sizeof(*client));
+    if (!client) {
+        BLog(BLOG_ERROR, "failed to allocate client");
+        goto fail0;
+    }
     
-    client_log(client, BLOG_INFO, "handshake complete");
+    // set link and address
+    client->link = link;
+    client->addr = addr;
+    
+    // assign ID
+    client->id = new_client_id();
+    
+    // set no common name
+    client->common_name = NULL;
+    
+    // now client_log() works
+    
+    // accept link
+    ClientShardsLink_Accept(client->link, client, (ClientShardsLink_handler_up)client_link_handler_up,
+                            (ClientShardsLink_handler_packet)client_link_handler_packet, (ClientShardsLink_handler_error)client_link_handler_error);
+    
+    if (!options.ssl) {
+        // initialize I/O
+        if (!client_init_io(client)) {
+            goto fail1;
+        }
+    }
+    
+    // add client
+    client_link_in(client);
     
     return;
     
-    // handle errors
-fail2:
-    PORT_FreeArena(arena, PR_FALSE);
 fail1:
-    CERT_DestroyCertificate(cert);
+    free(client);
 fail0:
-    client_remove(client);
+    ClientShardsLink_Free(link);
 }
 
-void client_decoder_handler_error (struct client_data *client)
+void * shards_read_cert (PRFileDesc *ssl_prfd, BLog_logfunc logfunc, void *log_user)
+{
+    struct client_cert *cert = (struct client_cert *)malloc(sizeof(*cert));
+    if (!cert) {
+        BLog_LogViaFunc(logfunc, log_user, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "failed to allocate certificate");
+        return NULL;
+    }
+    
+    cert->common_name = NULL;
+    
+    if (!read_client_cert(ssl_prfd, logfunc, log_user, &cert->common_name, cert->cert, &cert->cert_len, cert->cert_old, &cert->cert_old_len)) {
+        shards_free_cert(cert);
+        return NULL;
+    }
+    
+    return cert;
+}
+
+void shards_free_cert (void *cert)
+{
+    struct client_cert *c = (struct client_cert *)cert;
+    
+    if (c->common_name) {
+        PORT_Free(c->common_name);
+    }
+    
+    free(c);
+}
+
+void client_link_handler_up (struct client_data *client, void *cert)
+{
+    ASSERT(options.ssl)
+    ASSERT(!client->dying)
+    ASSERT(client->initstatus == INITSTATUS_HANDSHAKE)
+    
+    struct client_cert *c = (struct client_cert *)cert;
+    
+    // take certificate
+    client->common_name = c->common_name;
+    memcpy(client->cert, c->cert, c->cert_len);
+    client->cert_len = c->cert_len;
+    memcpy(client->cert_old, c->cert_old, c->cert_old_len);
+    client->cert_old_len = c->cert_old_len;
+    free(c);
+    
+    // init I/O chains
+    if (!client_init_io(client)) {
+        client_remove(client);
+        return;
+    }
+    
+    // set client state
+    client->initstatus = INITSTATUS_WAITHELLO;
+    
+    client_log(client, BLOG_INFO, "handshake complete");
+}
+
+void client_link_handler_packet (struct client_data *client, uint8_t *data, int data_len)
 {
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= SC_MAX_ENC)
     ASSERT(INITSTATUS_HASLINK(client->initstatus))
     ASSERT(!client->dying)
     
-    client_log(client, BLOG_ERROR, "decoder error");
+    client_process_packet(client, data, data_len);
+}
+
+void client_link_handler_error (struct client_data *client, int event)
+{
+    ASSERT(!client->dying)
+    
+    if (event == CLIENTSHARDS_EVENT_RECVCLOSED) {
+        client_log(client, BLOG_INFO, "connection closed");
+    } else {
+        client_log(client, BLOG_INFO, "connection error");
+    }
     
     client_remove(client);
     return;
 }
 
+#endif
+
 int client_start_control_packet (struct client_data *client, void **data, int len)
 {
     ASSERT(len >= 0)
@@ -1492,6 +1826,16 @@ void client_input_handler_send (struct client_data *client, uint8_t *data, int d
     // accept packet
     PacketPassInterface_Done(&client->input_interface);
     
+    client_process_packet(client, data, data_len);
+}
+
+void client_process_packet (struct client_data *client, uint8_t *data, int data_len)
+{
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= SC_MAX_ENC)
+    ASSERT(INITSTATUS_HASLINK(client->initstatus))
+    ASSERT(!client->dying)
+    
     // restart disconnect timer
     BReactor_SetTimer(&ss, &client->disconnect_timer);
     
@@ -1593,6 +1937,11 @@ void process_packet_hello (struct client_data *client, uint8_t *data, int data_l
         flow_to->opposite = flow_from;
         flow_from->opposite = flow_to;
         
+        // determine relay relations; these only depend on the two clients,
+        // so they are kept with the flows until either client goes away
+        flow_to->relay_via_dest = relay_allowed(client, client2);
+        flow_from->relay_via_dest = relay_allowed(client2, client);
+        
         // launch pair
         if (!launch_pair(flow_to)) {
             return;
@@ -1679,6 +2028,7 @@ void process_packet_outmsg (struct client_data *client, uint8_t *data, int data_
     if (!peer_flow_start_packet(flow, &pack, sizeof(omsg) + payload_size)) {
         // out of buffer, reset these two clients
         client_log(client, BLOG_WARNING, "out of buffer; resetting to %d", (int)flow->dest_client->id);
+        BMetric_Add(&metric_flow_buffer_resets, 1);
         peer_flow_start_reset(flow);
         return;
     }
@@ -1686,6 +2036,9 @@ void process_packet_outmsg (struct client_data *client, uint8_t *data, int data_
     memcpy(pack, &omsg, sizeof(omsg));
     memcpy((char *)pack + sizeof(omsg), payload, payload_size);
     peer_flow_end_packet(flow, SCID_INMSG);
+    
+    BMetric_Add(&metric_relayed_messages, 1);
+    BMetric_Add(&metric_relayed_bytes, payload_size);
 }
 
 void process_packet_resetpeer (struct client_data *client, uint8_t *data, int data_len)
@@ -2338,9 +2691,9 @@ int launch_pair (struct peer_flow *flow_to)
         goto fail;
     }
     
-    // determine relay relations
-    int relay_to = relay_allowed(client, client2);
-    int relay_from = relay_allowed(client2, client);
+    // get relay relations
+    int relay_to = flow_to->relay_via_dest;
+    int relay_from = flow_to->opposite->relay_via_dest;
     
     // create know to
     struct peer_know *know_to = create_know(client, client2, relay_to, relay_from);
@@ -41,6 +41,10 @@
 #include <system/BConnection.h>
 #include <nspr_support/BSSLConnection.h>
 
+#ifndef BADVPN_USE_WINAPI
+#include <server/ClientShards.h>
+#endif
+
 // name of the program
 #define PROGRAM_NAME "server"
 
@@ -78,6 +82,15 @@
 struct client_data;
 struct peer_know;
 
+// client certificate information, passed from a shard thread
+struct client_cert {
+    char *common_name;
+    uint8_t cert[SCID_NEWCLIENT_MAX_CERT_LEN];
+    int cert_len;
+    uint8_t cert_old[SCID_NEWCLIENT_MAX_CERT_LEN];
+    int cert_old_len;
+};
+
 struct peer_flow {
     // source client
     struct client_data *src_client;
@@ -101,6 +114,9 @@ struct peer_flow {
     BTimer reset_timer;
     // opposite flow
     struct peer_flow *opposite;
+    // whether src_client may relay through dest_client, evaluated once
+    // when the pair is created and reused when it is relaunched
+    int relay_via_dest;
     // pair data
     struct peer_know *know;
     int accepted;
@@ -119,11 +135,16 @@ struct peer_know {
 };
 
 struct client_data {
-    // socket
+    #ifndef BADVPN_USE_WINAPI
+    // link to the shard doing our I/O, if using shards
+    ClientShardsLink *link;
+    #endif
+    
+    // socket, if not using shards
     BConnection con;
     BAddr addr;
     
-    // SSL connection, if using SSL
+    // SSL connection, if using SSL and not using shards
     PRFileDesc bottom_prfd;
     PRFileDesc *ssl_prfd;
     BSSLConnection sslcon;
@@ -164,12 +185,12 @@ struct client_data {
     int dying;
     BPending dying_job;
     
-    // input
+    // input, if not using shards
     PacketProtoDecoder input_decoder;
     PacketPassInterface input_interface;
     
     // output common
-    PacketStreamSender output_sender;
+    PacketStreamSender output_sender; // if not using shards
     PacketPassPriorityQueue output_priorityqueue;
     
     // output control flow
@@ -93,8 +93,8 @@ void connector_handler (ServerConnection *o, int is_error)
     
     if (o->have_ssl) {
         // create bottom NSPR file descriptor
-        if (!BSSLConnection_MakeBackend(&o->bottom_prfd, send_iface, recv_iface, o->twd, o->ssl_flags)) {
-            BLog(BLOG_ERROR, "BSSLConnection_MakeBackend failed");
+        if (!BSSLConnection_MakeConnectionBackend(&o->bottom_prfd, &o->con, o->twd, o->ssl_flags)) {
+            BLog(BLOG_ERROR, "BSSLConnection_MakeConnectionBackend failed");
             goto fail0a;
         }
         
@@ -218,8 +218,8 @@ typedef struct {
  * @param keepalive_interval keep-alive sending interval. Must be >0.
  * @param buffer_size minimum size of send buffer in number of packets. Must be >0.
  * @param have_ssl whether to use SSL for connecting to the server. Must be 1 or 0.
- * @param ssl_flags flags passed down to {@link BSSLConnection_MakeBackend}. May be used to
- *                  request performing SSL operations in threads.
+ * @param ssl_flags flags passed down to {@link BSSLConnection_MakeConnectionBackend}. May be used to
+ *                  request performing SSL operations in threads, or using kernel TLS.
  * @param client_cert if using SSL, client certificate to use. Must remain valid as
  *                    long as this object is alive.
  * @param client_key if using SSL, prvate ket to use. Must remain valid as
@@ -85,6 +85,22 @@ int BListener_Init (BListener *o, BAddr addr, BReactor *reactor, void *user,
                     BListener_handler handler) WARN_UNUSED;
 
 #ifndef BADVPN_USE_WINAPI
+/**
+ * Like {@link BListener_Init}, but sets the SO_REUSEPORT socket option, so
+ * that several listeners (typically in different threads) can listen on the
+ * same address, and the kernel distributes new connections among them.
+ * Fails if SO_REUSEPORT is not supported.
+ * 
+ * @param o the object
+ * @param addr address to listen on
+ * @param reactor reactor we live in
+ * @param user argument to handler
+ * @param handler handler called when a connection can be accepted
+ * @return 1 on success, 0 on failure
+ */
+int BListener_InitReusePort (BListener *o, BAddr addr, BReactor *reactor, void *user,
+                             BListener_handler handler) WARN_UNUSED;
+
 /**
  * Initializes the object for listening on a Unix socket.
  * {@link BNetwork_GlobalInit} must have been done.
@@ -304,6 +320,32 @@ void BConnection_SetHandlers (BConnection *o, void *user, BConnection_handler ha
  */
 int BConnection_SetSendBuffer (BConnection *o, int buf_size);
 
+#ifndef BADVPN_USE_WINAPI
+/**
+ * Hands TLS record processing for one direction of the connection over to
+ * the kernel (Linux kernel TLS). After sending is offloaded, data passed to the
+ * send interface is sent as TLS records. After receiving is offloaded, the
+ * receive interface returns decrypted application data. Session tickets are
+ * skipped, a close_notify alert is reported like the peer closing the
+ * connection (BCONNECTION_EVENT_RECVCLOSED), and any other handshake message
+ * (e.g. KeyUpdate) or alert is an error.
+ * 
+ * The TLS implementation which performed the handshake must have stopped at a
+ * record boundary in this direction; crypto_info carries its keys and next
+ * record sequence number.
+ * 
+ * @param o the object
+ * @param rx 1 to offload receiving, 0 to offload sending. Sending must not be busy
+ *           when offloading it, and the same goes for receiving. Receiving must
+ *           not have been offloaded already.
+ * @param crypto_info a struct tls12_crypto_info_* from <linux/tls.h>
+ * @param crypto_info_len size of crypto_info in bytes. Must be >0.
+ * @return 1 on success, 0 if kernel TLS is not available or the keys were rejected.
+ *         On failure, the connection continues to work as before.
+ */
+int BConnection_EnableKTLS (BConnection *o, int rx, const void *crypto_info, int crypto_info_len);
+#endif
+
 /**
  * Initializes the send interface for the connection.
  * The send interface must not be initialized.
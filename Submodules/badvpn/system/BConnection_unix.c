@@ -34,9 +34,17 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+
+#ifdef BADVPN_LINUX
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#endif
 
 #include <misc/nonblocking.h>
 #include <misc/strdup.h>
+#include <misc/minmax.h>
 #include <base/BLog.h>
 
 #include "BConnection.h"
@@ -55,6 +63,24 @@
 #define RECV_STATE_INITED_CLOSED 3
 #define RECV_STATE_NOT_INITED_CLOSED 4
 
+// maximum number of buffers passed to one writev()
+#define SEND_MAX_SEGMENTS 64
+
+#ifdef BADVPN_LINUX
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#define KTLS_RECORD_TYPE_ALERT 21
+#define KTLS_RECORD_TYPE_HANDSHAKE 22
+#define KTLS_RECORD_TYPE_APPLICATION_DATA 23
+#define KTLS_ALERT_CLOSE_NOTIFY 0
+#define KTLS_HANDSHAKE_NEW_SESSION_TICKET 4
+#define KTLS_HANDSHAKE_KEY_UPDATE 24
+#endif
+
 struct sys_addr {
     socklen_t len;
     union {
@@ -81,12 +107,18 @@ static void connector_fd_handler (BConnector *o, int events);
 static void connector_job_handler (BConnector *o);
 static void connection_report_error (BConnection *o);
 static void connection_send (BConnection *o);
+#ifdef BADVPN_LINUX
+static int connection_ktls_skip_handshake (BConnection *o, const uint8_t *data, int len);
+static int connection_recv_ktls (BConnection *o);
+#endif
 static void connection_recv (BConnection *o);
 static void connection_fd_handler (BConnection *o, int events);
 static void connection_send_job_handler (BConnection *o);
 static void connection_recv_job_handler (BConnection *o);
 static void connection_send_if_handler_send (BConnection *o, uint8_t *data, int data_len);
+static void connection_send_if_handler_sendv (BConnection *o, const StreamPassInterface_segment *segs, int num_segs);
 static void connection_recv_if_handler_recv (BConnection *o, uint8_t *data, int data_len);
+static void connection_recv_if_handler_recv2 (BConnection *o, uint8_t *data, int data_len, uint8_t *data2, int data2_len);
 
 static int build_unix_address (struct unix_addr *out, const char *socket_path)
 {
@@ -252,7 +284,18 @@ static void connection_send (BConnection *o)
     }
     
     // send
-    int bytes = write(o->fd, o->send.busy_data, o->send.busy_data_len);
+    int bytes;
+    if (o->send.busy_num_segs > 0) {
+        struct iovec iov[SEND_MAX_SEGMENTS];
+        int num_iov = bmin_int(o->send.busy_num_segs, SEND_MAX_SEGMENTS);
+        for (int i = 0; i < num_iov; i++) {
+            iov[i].iov_base = o->send.busy_segs[i].data;
+            iov[i].iov_len = o->send.busy_segs[i].data_len;
+        }
+        bytes = writev(o->fd, iov, num_iov);
+    } else {
+        bytes = write(o->fd, o->send.busy_data, o->send.busy_data_len);
+    }
     if (bytes < 0) {
         if (!o->is_hupd && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             // wait for fd
@@ -276,6 +319,126 @@ static void connection_send (BConnection *o)
     StreamPassInterface_Done(&o->send.iface, bytes);
 }
 
+#ifdef BADVPN_LINUX
+
+static int connection_ktls_skip_handshake (BConnection *o, const uint8_t *data, int len)
+{
+    // handshake messages may span records, and records may be received in parts
+    while (len > 0) {
+        // skip the body of a message
+        if (o->ktls_hs_left > 0) {
+            int amount = bmin_int(len, o->ktls_hs_left);
+            o->ktls_hs_left -= amount;
+            data += amount;
+            len -= amount;
+            continue;
+        }
+        
+        // collect the header of the next message
+        o->ktls_hs_header[o->ktls_hs_header_len++] = *data;
+        data++;
+        len--;
+        if (o->ktls_hs_header_len < sizeof(o->ktls_hs_header)) {
+            continue;
+        }
+        o->ktls_hs_header_len = 0;
+        
+        // Session tickets are of no use to us. Anything else would need a response
+        // from the TLS implementation, or new keys in the kernel (KeyUpdate).
+        uint8_t type = o->ktls_hs_header[0];
+        if (type != KTLS_HANDSHAKE_NEW_SESSION_TICKET) {
+            if (type == KTLS_HANDSHAKE_KEY_UPDATE) {
+                BLog(BLOG_ERROR, "received TLS KeyUpdate, not supported with kernel TLS");
+            } else {
+                BLog(BLOG_ERROR, "received TLS handshake message of type %d", (int)type);
+            }
+            return 0;
+        }
+        
+        BLog(BLOG_DEBUG, "ignoring TLS session ticket");
+        
+        o->ktls_hs_left = ((int)o->ktls_hs_header[1] << 16) | ((int)o->ktls_hs_header[2] << 8) | o->ktls_hs_header[3];
+    }
+    
+    return 1;
+}
+
+static int connection_recv_ktls (BConnection *o)
+{
+    ASSERT(o->ktls_rx)
+    
+    while (1) {
+        struct iovec iov[2];
+        iov[0].iov_base = o->recv.busy_data;
+        iov[0].iov_len = o->recv.busy_data_avail;
+        iov[1].iov_base = o->recv.busy_data2;
+        iov[1].iov_len = o->recv.busy_data2_avail;
+        
+        // the kernel tells us the record type in a control message, and never
+        // returns data from records of different types in the same call
+        union {
+            struct cmsghdr hdr;
+            uint8_t buf[CMSG_SPACE(sizeof(uint8_t))];
+        } control;
+        
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (o->recv.busy_data2_avail > 0 ? 2 : 1);
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        
+        int bytes = recvmsg(o->fd, &msg, 0);
+        if (bytes <= 0) {
+            return bytes;
+        }
+        
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_TLS || cmsg->cmsg_type != TLS_GET_RECORD_TYPE) {
+            return bytes;
+        }
+        
+        uint8_t type = *(uint8_t *)CMSG_DATA(cmsg);
+        
+        if (type == KTLS_RECORD_TYPE_APPLICATION_DATA) {
+            return bytes;
+        }
+        
+        int len1 = bmin_int(bytes, o->recv.busy_data_avail);
+        int len2 = bytes - len1;
+        
+        // post-handshake messages
+        if (type == KTLS_RECORD_TYPE_HANDSHAKE) {
+            if (!connection_ktls_skip_handshake(o, o->recv.busy_data, len1) ||
+                !connection_ktls_skip_handshake(o, o->recv.busy_data2, len2)
+            ) {
+                errno = EPROTO;
+                return -1;
+            }
+            continue;
+        }
+        
+        // alerts consist of a level and a description; close_notify ends the
+        // data like closing the connection would
+        if (type == KTLS_RECORD_TYPE_ALERT && bytes >= 2) {
+            uint8_t description = (len1 >= 2 ? o->recv.busy_data[1] : o->recv.busy_data2[1 - len1]);
+            if (description == KTLS_ALERT_CLOSE_NOTIFY) {
+                BLog(BLOG_INFO, "received TLS close_notify");
+                return 0;
+            }
+            BLog(BLOG_ERROR, "received TLS alert %d", (int)description);
+            errno = EPROTO;
+            return -1;
+        }
+        
+        BLog(BLOG_ERROR, "received TLS record of type %d", (int)type);
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+#endif
+
 static void connection_recv (BConnection *o)
 {
     DebugError_AssertNoError(&o->d_err);
@@ -292,7 +455,22 @@ static void connection_recv (BConnection *o)
     }
     
     // recv
-    int bytes = read(o->fd, o->recv.busy_data, o->recv.busy_data_avail);
+    int bytes;
+#ifdef BADVPN_LINUX
+    if (o->ktls_rx) {
+        bytes = connection_recv_ktls(o);
+    } else
+#endif
+    if (o->recv.busy_data2_avail > 0) {
+        struct iovec iov[2];
+        iov[0].iov_base = o->recv.busy_data;
+        iov[0].iov_len = o->recv.busy_data_avail;
+        iov[1].iov_base = o->recv.busy_data2;
+        iov[1].iov_len = o->recv.busy_data2_avail;
+        bytes = readv(o->fd, iov, 2);
+    } else {
+        bytes = read(o->fd, o->recv.busy_data, o->recv.busy_data_avail);
+    }
     if (bytes < 0) {
         if (!o->is_hupd && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             // wait for fd
@@ -316,7 +494,7 @@ static void connection_recv (BConnection *o)
     }
     
     ASSERT(bytes > 0)
-    ASSERT(bytes <= o->recv.busy_data_avail)
+    ASSERT(bytes <= o->recv.busy_data_avail + o->recv.busy_data2_avail)
     
     // set not busy
     o->recv.state = RECV_STATE_READY;
@@ -405,6 +583,30 @@ static void connection_send_if_handler_send (BConnection *o, uint8_t *data, int
     // remember data
     o->send.busy_data = data;
     o->send.busy_data_len = data_len;
+    o->send.busy_num_segs = 0;
+    
+    // set busy
+    o->send.state = SEND_STATE_BUSY;
+    
+    connection_send(o);
+    return;
+}
+
+static void connection_send_if_handler_sendv (BConnection *o, const StreamPassInterface_segment *segs, int num_segs)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.state == SEND_STATE_READY)
+    ASSERT(num_segs > 0)
+    
+    // remember data
+    int total = 0;
+    for (int i = 0; i < num_segs && i < SEND_MAX_SEGMENTS; i++) {
+        total += segs[i].data_len;
+    }
+    o->send.busy_data_len = total;
+    o->send.busy_segs = segs;
+    o->send.busy_num_segs = num_segs;
     
     // set busy
     o->send.state = SEND_STATE_BUSY;
@@ -423,6 +625,29 @@ static void connection_recv_if_handler_recv (BConnection *o, uint8_t *data, int
     // remember data
     o->recv.busy_data = data;
     o->recv.busy_data_avail = data_avail;
+    o->recv.busy_data2 = NULL;
+    o->recv.busy_data2_avail = 0;
+    
+    // set busy
+    o->recv.state = RECV_STATE_BUSY;
+    
+    connection_recv(o);
+    return;
+}
+
+static void connection_recv_if_handler_recv2 (BConnection *o, uint8_t *data, int data_avail, uint8_t *data2, int data2_avail)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->recv.state == RECV_STATE_READY)
+    ASSERT(data_avail > 0)
+    ASSERT(data2_avail > 0)
+    
+    // remember data
+    o->recv.busy_data = data;
+    o->recv.busy_data_avail = data_avail;
+    o->recv.busy_data2 = data2;
+    o->recv.busy_data2_avail = data2_avail;
     
     // set busy
     o->recv.state = RECV_STATE_BUSY;
@@ -438,8 +663,8 @@ int BConnection_AddressSupported (BAddr addr)
     return (addr.type == BADDR_TYPE_IPV4 || addr.type == BADDR_TYPE_IPV6);
 }
 
-int BListener_Init (BListener *o, BAddr addr, BReactor *reactor, void *user,
-                    BListener_handler handler)
+static int listener_init (BListener *o, BAddr addr, int reuse_port, BReactor *reactor, void *user,
+                          BListener_handler handler)
 {
     ASSERT(handler)
     BNetwork_Assert();
@@ -480,6 +705,19 @@ int BListener_Init (BListener *o, BAddr addr, BReactor *reactor, void *user,
         BLog(BLOG_ERROR, "setsockopt(SO_REUSEADDR) failed");
     }
     
+    // set SO_REUSEPORT
+    if (reuse_port) {
+        #ifdef SO_REUSEPORT
+        if (setsockopt(o->fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+            BLog(BLOG_ERROR, "setsockopt(SO_REUSEPORT) failed");
+            goto fail1;
+        }
+        #else
+        BLog(BLOG_ERROR, "SO_REUSEPORT not supported");
+        goto fail1;
+        #endif
+    }
+    
     // bind
     if (bind(o->fd, &sysaddr.addr.generic, sysaddr.len) < 0) {
         BLog(BLOG_ERROR, "bind failed");
@@ -514,6 +752,18 @@ fail0:
     return 0;
 }
 
+int BListener_Init (BListener *o, BAddr addr, BReactor *reactor, void *user,
+                    BListener_handler handler)
+{
+    return listener_init(o, addr, 0, reactor, user, handler);
+}
+
+int BListener_InitReusePort (BListener *o, BAddr addr, BReactor *reactor, void *user,
+                             BListener_handler handler)
+{
+    return listener_init(o, addr, 1, reactor, user, handler);
+}
+
 int BListener_InitUnix (BListener *o, const char *socket_path, BReactor *reactor, void *user,
                         BListener_handler handler)
 {
@@ -889,6 +1139,10 @@ int BConnection_Init (BConnection *o, struct BConnection_source source, BReactor
     // set not HUPd
     o->is_hupd = 0;
     
+    // set no kernel TLS
+    o->have_ktls_ulp = 0;
+    o->ktls_rx = 0;
+    
     // init BFileDescriptor
     BFileDescriptor_Init(&o->bfd, o->fd, (BFileDescriptor_handler)connection_fd_handler, o);
     if (!BReactor_AddFileDescriptor(o->reactor, &o->bfd)) {
@@ -966,6 +1220,45 @@ int BConnection_SetSendBuffer (BConnection *o, int buf_size)
     return 1;
 }
 
+int BConnection_EnableKTLS (BConnection *o, int rx, const void *crypto_info, int crypto_info_len)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(rx == 0 || rx == 1)
+    ASSERT(rx || o->send.state != SEND_STATE_BUSY)
+    ASSERT(!rx || o->recv.state != RECV_STATE_BUSY)
+    ASSERT(!rx || !o->ktls_rx)
+    ASSERT(crypto_info)
+    ASSERT(crypto_info_len > 0)
+    
+#ifdef BADVPN_LINUX
+    // attach TLS upper layer protocol
+    if (!o->have_ktls_ulp) {
+        if (setsockopt(o->fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+            BLog(BLOG_INFO, "setsockopt(TCP_ULP) failed (%d), kernel TLS not available", errno);
+            return 0;
+        }
+        o->have_ktls_ulp = 1;
+    }
+    
+    // hand over keys
+    if (setsockopt(o->fd, SOL_TLS, (rx ? TLS_RX : TLS_TX), crypto_info, crypto_info_len) < 0) {
+        BLog(BLOG_ERROR, "setsockopt(%s) failed (%d)", (rx ? "TLS_RX" : "TLS_TX"), errno);
+        return 0;
+    }
+    
+    if (rx) {
+        o->ktls_rx = 1;
+        o->ktls_hs_header_len = 0;
+        o->ktls_hs_left = 0;
+    }
+    
+    return 1;
+#else
+    BLog(BLOG_INFO, "kernel TLS not supported on this platform");
+    return 0;
+#endif
+}
+
 void BConnection_SendAsync_Init (BConnection *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -974,6 +1267,7 @@ void BConnection_SendAsync_Init (BConnection *o)
     
     // init interface
     StreamPassInterface_Init(&o->send.iface, (StreamPassInterface_handler_send)connection_send_if_handler_send, o, BReactor_PendingGroup(o->reactor));
+    StreamPassInterface_EnableSendv(&o->send.iface, (StreamPassInterface_handler_sendv)connection_send_if_handler_sendv);
     
     // init job
     BPending_Init(&o->send.job, BReactor_PendingGroup(o->reactor), (BPending_handler)connection_send_job_handler, o);
@@ -1019,6 +1313,7 @@ void BConnection_RecvAsync_Init (BConnection *o)
     
     // init interface
     StreamRecvInterface_Init(&o->recv.iface, (StreamRecvInterface_handler_recv)connection_recv_if_handler_recv, o, BReactor_PendingGroup(o->reactor));
+    StreamRecvInterface_EnableRecv2(&o->recv.iface, (StreamRecvInterface_handler_recv2)connection_recv_if_handler_recv2);
     
     // init job
     BPending_Init(&o->recv.job, BReactor_PendingGroup(o->reactor), (BPending_handler)connection_recv_job_handler, o);
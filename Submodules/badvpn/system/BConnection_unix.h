@@ -64,6 +64,11 @@ struct BConnection_s {
     int fd;
     int close_fd;
     int is_hupd;
+    int have_ktls_ulp;
+    int ktls_rx;
+    uint8_t ktls_hs_header[4];
+    int ktls_hs_header_len;
+    int ktls_hs_left;
     BFileDescriptor bfd;
     int wait_events;
     struct {
@@ -72,6 +77,8 @@ struct BConnection_s {
         BPending job;
         const uint8_t *busy_data;
         int busy_data_len;
+        const StreamPassInterface_segment *busy_segs;
+        int busy_num_segs;
         int state;
     } send;
     struct {
@@ -80,6 +87,8 @@ struct BConnection_s {
         BPending job;
         uint8_t *busy_data;
         int busy_data_avail;
+        uint8_t *busy_data2;
+        int busy_data2_avail;
         int state;
     } recv;
     DebugError d_err;
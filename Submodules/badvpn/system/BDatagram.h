@@ -59,6 +59,17 @@ typedef struct BDatagram_s BDatagram;
  */
 typedef void (*BDatagram_handler) (void *user, int event);
 
+/**
+ * Handler called when a datagram could not be sent because it is larger than the
+ * path MTU known to the system. The datagram has been dropped.
+ * Only called if enabled with {@link BDatagram_EnablePathMTUDiscovery}.
+ * The datagram object must not be freed from this handler.
+ * 
+ * @param user as in {@link BDatagram_Init}
+ * @param data_len length of the dropped datagram
+ */
+typedef void (*BDatagram_handler_too_big) (void *user, int data_len);
+
 /**
  * Checks if the given address family (from {@link BAddr.h}) is supported by {@link BDatagram}
  * and related objects.
@@ -142,6 +153,29 @@ int BDatagram_GetFd (BDatagram *o);
  */
 int BDatagram_SetReuseAddr (BDatagram *o, int reuse);
 
+/**
+ * Enables path MTU discovery for sent datagrams, i.e. sets the don't-fragment flag.
+ * Datagrams larger than the path MTU known to the system are then dropped and
+ * reported to the given handler, instead of failing the send interface.
+ * Only supported on Linux.
+ * 
+ * @param o the object
+ * @param handler_too_big handler called when a datagram is dropped for being too big
+ * @return 1 on success, 0 on failure
+ */
+int BDatagram_EnablePathMTUDiscovery (BDatagram *o, BDatagram_handler_too_big handler_too_big) WARN_UNUSED;
+
+/**
+ * Returns the path MTU the system knows for the current send address. This is the
+ * maximum size of IP packets including the IP header, and only reflects ICMP
+ * feedback for datagrams sent with path MTU discovery enabled.
+ * Only supported on Linux.
+ * 
+ * @param o the object
+ * @return path MTU, or -1 if there are no send addresses or it could not be determined
+ */
+int BDatagram_GetPathMTU (BDatagram *o);
+
 /**
  * Initializes the send interface.
  * The send interface must not be initialized.
@@ -171,6 +205,36 @@ void BDatagram_SendAsync_Free (BDatagram *o);
  */
 PacketPassInterface * BDatagram_SendAsync_GetIf (BDatagram *o);
 
+#ifndef BADVPN_USE_WINAPI
+/**
+ * Initializes the send interface in batch mode.
+ * The send interface must not be initialized.
+ * Available on Unix-like systems only.
+ * 
+ * In batch mode, packets passed to the send interface are copied into a queue
+ * and accepted immediately, as long as there is space. The queue is submitted
+ * with a single sendmmsg() call once the sender stops providing packets, i.e.
+ * from a job which runs after the sender's done handlers. Packets still queued when
+ * the send interface is freed are discarded.
+ * 
+ * If use_gso is nonzero and the system supports UDP segmentation offload,
+ * consecutive queued packets of the same size are passed to the kernel as one
+ * message. If the kernel rejects that, segmentation offload is turned off for
+ * this object and the packets are sent individually.
+ * 
+ * Use {@link BDatagram_SendAsync_Free} and {@link BDatagram_SendAsync_GetIf} as
+ * with {@link BDatagram_SendAsync_Init}.
+ * 
+ * @param o the object
+ * @param mtu maximum transmission unit. Must be >=0.
+ * @param batch_size maximum number of queued packets. Must be >=1 and
+ *                   <=BDATAGRAM_MAX_BATCH_SIZE.
+ * @param use_gso whether to use UDP segmentation offload if available
+ * @return 1 on success, 0 on failure
+ */
+int BDatagram_SendAsync_InitBatch (BDatagram *o, int mtu, int batch_size, int use_gso) WARN_UNUSED;
+#endif
+
 /**
  * Initializes the receive interface.
  * The receive interface must not be initialized.
@@ -200,6 +264,30 @@ void BDatagram_RecvAsync_Free (BDatagram *o);
  */
 PacketRecvInterface * BDatagram_RecvAsync_GetIf (BDatagram *o);
 
+#ifndef BADVPN_USE_WINAPI
+/**
+ * Initializes the receive interface in batch mode.
+ * The receive interface must not be initialized.
+ * Available on Unix-like systems only.
+ * 
+ * In batch mode, datagrams are received into an internal queue with a single
+ * recvmmsg() call, up to batch_size at a time. Receive operations on the interface
+ * are then completed from the queue, copying the datagram, until it is empty.
+ * {@link BDatagram_GetLastReceiveAddrs} refers to the last datagram passed to the
+ * interface.
+ * 
+ * Use {@link BDatagram_RecvAsync_Free} and {@link BDatagram_RecvAsync_GetIf} as
+ * with {@link BDatagram_RecvAsync_Init}.
+ * 
+ * @param o the object
+ * @param mtu maximum transmission unit. Must be >=0.
+ * @param batch_size maximum number of queued datagrams. Must be >=1 and
+ *                   <=BDATAGRAM_MAX_BATCH_SIZE.
+ * @return 1 on success, 0 on failure
+ */
+int BDatagram_RecvAsync_InitBatch (BDatagram *o, int mtu, int batch_size) WARN_UNUSED;
+#endif
+
 #ifdef BADVPN_USE_WINAPI
 #include "BDatagram_win.h"
 #else
@@ -43,15 +43,26 @@
 #ifdef BADVPN_LINUX
 #    include <netpacket/packet.h>
 #    include <net/ethernet.h>
+#    include <netinet/udp.h>
 #endif
 
 #include <misc/nonblocking.h>
+#include <misc/balloc.h>
 #include <base/BLog.h>
 
 #include "BDatagram.h"
 
 #include <generated/blog_channel_BDatagram.h>
 
+#if defined(BADVPN_LINUX) && defined(UDP_SEGMENT)
+#define HAVE_UDP_GSO 1
+#define GSO_CONTROL_SPACE CMSG_SPACE(sizeof(uint16_t))
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_BYTES 65000
+#else
+#define GSO_CONTROL_SPACE 0
+#endif
+
 struct sys_addr {
     socklen_t len;
     union {
@@ -64,13 +75,76 @@ struct sys_addr {
     } addr;
 };
 
+union send_control {
+    char data[CMSG_SPACE(sizeof(struct in6_pktinfo)) + GSO_CONTROL_SPACE];
+    struct cmsghdr align;
+};
+
+union recv_control {
+#ifdef BADVPN_FREEBSD
+    char in[CMSG_SPACE(sizeof(struct in_addr))];
+#else
+    char in[CMSG_SPACE(sizeof(struct in_pktinfo))];
+#endif
+    char in6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    struct cmsghdr align;
+};
+
+#ifdef BADVPN_LINUX
+typedef struct mmsghdr batch_msg;
+#else
+typedef struct {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+} batch_msg;
+#endif
+
+struct BDatagram_send_batch {
+    int batch_size;
+    int gso;
+    uint8_t *buf;
+    int *lens;
+    int start;
+    int count;
+    int start_pos;
+    int end_pos;
+    int full;
+    batch_msg *msgs;
+    int *msg_packets;
+    struct iovec *iovs;
+    union send_control *controls;
+};
+
+struct BDatagram_recv_batch {
+    int batch_size;
+    uint8_t *buf;
+    batch_msg *msgs;
+    struct iovec *iovs;
+    struct sys_addr *addrs;
+    union recv_control *controls;
+    int count;
+    int next;
+};
+
 static int family_socket_to_sys (int family);
 static void addr_socket_to_sys (struct sys_addr *out, BAddr addr);
 static void addr_sys_to_socket (BAddr *out, struct sys_addr addr);
 static void set_pktinfo (int fd, int family);
+static void build_send_control (BDatagram *o, struct msghdr *msg, union send_control *control, int gso_size);
+static void read_recv_control (struct msghdr *msg, BIPAddr *out_local_addr);
+static int batch_sendmsgs (int fd, batch_msg *msgs, int num_msgs);
+static int batch_recvmsgs (int fd, batch_msg *msgs, int num_msgs);
+static int send_wanted (BDatagram *o);
+static void start_recv (BDatagram *o);
 static void report_error (BDatagram *o);
 static void do_send (BDatagram *o);
+static void do_send_batch (BDatagram *o);
 static void do_recv (BDatagram *o);
+static void do_recv_batch (BDatagram *o);
+static void send_batch_queue (BDatagram *o, const uint8_t *data, int data_len);
+static void recv_batch_deliver (BDatagram *o);
+static void free_send_batch (struct BDatagram_send_batch *b);
+static void free_recv_batch (struct BDatagram_recv_batch *b);
 static void fd_handler (BDatagram *o, int events);
 static void send_job_handler (BDatagram *o);
 static void recv_job_handler (BDatagram *o);
@@ -234,6 +308,152 @@ static void set_pktinfo (int fd, int family)
     }
 }
 
+static void build_send_control (BDatagram *o, struct msghdr *msg, union send_control *control, int gso_size)
+{
+    ASSERT(gso_size >= 0)
+    
+    msg->msg_control = control->data;
+    msg->msg_controllen = sizeof(control->data);
+    
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+    
+    size_t controllen = 0;
+    
+    switch (o->send.local_addr.type) {
+        case BADDR_TYPE_IPV4: {
+#ifdef __APPLE__
+            // source address selection is not supported here
+#elif defined(BADVPN_FREEBSD)
+            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_addr)));
+            cmsg->cmsg_level = IPPROTO_IP;
+            cmsg->cmsg_type = IP_SENDSRCADDR;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
+            struct in_addr *addrinfo = (struct in_addr *)CMSG_DATA(cmsg);
+            addrinfo->s_addr = o->send.local_addr.ipv4;
+            controllen += CMSG_SPACE(sizeof(struct in_addr));
+#else
+            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_pktinfo)));
+            cmsg->cmsg_level = IPPROTO_IP;
+            cmsg->cmsg_type = IP_PKTINFO;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+            struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+            pktinfo->ipi_spec_dst.s_addr = o->send.local_addr.ipv4;
+            controllen += CMSG_SPACE(sizeof(struct in_pktinfo));
+#endif
+        } break;
+        
+        case BADDR_TYPE_IPV6: {
+            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in6_pktinfo)));
+            cmsg->cmsg_level = IPPROTO_IPV6;
+            cmsg->cmsg_type = IPV6_PKTINFO;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+            struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
+            memcpy(pktinfo->ipi6_addr.s6_addr, o->send.local_addr.ipv6, 16);
+            controllen += CMSG_SPACE(sizeof(struct in6_pktinfo));
+        } break;
+    }
+    
+#ifdef HAVE_UDP_GSO
+    if (gso_size > 0) {
+        cmsg = (struct cmsghdr *)(control->data + controllen);
+        memset(cmsg, 0, CMSG_SPACE(sizeof(uint16_t)));
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t segment_size = gso_size;
+        memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+        controllen += CMSG_SPACE(sizeof(uint16_t));
+    }
+#else
+    ASSERT(gso_size == 0)
+#endif
+    
+    msg->msg_controllen = controllen;
+    
+    if (msg->msg_controllen == 0) {
+        msg->msg_control = NULL;
+    }
+}
+
+static void read_recv_control (struct msghdr *msg, BIPAddr *out_local_addr)
+{
+    BIPAddr_InitInvalid(out_local_addr);
+    
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+#ifdef BADVPN_FREEBSD
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVDSTADDR) {
+            struct in_addr *addrinfo = (struct in_addr *)CMSG_DATA(cmsg);
+            BIPAddr_InitIPv4(out_local_addr, addrinfo->s_addr);
+        }
+#else
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+            BIPAddr_InitIPv4(out_local_addr, pktinfo->ipi_addr.s_addr);
+        }
+#endif
+        else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+            struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
+            BIPAddr_InitIPv6(out_local_addr, pktinfo->ipi6_addr.s6_addr);
+        }
+    }
+}
+
+static int batch_sendmsgs (int fd, batch_msg *msgs, int num_msgs)
+{
+    ASSERT(num_msgs > 0)
+    
+#ifdef BADVPN_LINUX
+    return sendmmsg(fd, msgs, num_msgs, 0);
+#else
+    for (int i = 0; i < num_msgs; i++) {
+        int bytes = sendmsg(fd, &msgs[i].msg_hdr, 0);
+        if (bytes < 0) {
+            return (i > 0 ? i : -1);
+        }
+        msgs[i].msg_len = bytes;
+    }
+    
+    return num_msgs;
+#endif
+}
+
+static int batch_recvmsgs (int fd, batch_msg *msgs, int num_msgs)
+{
+    ASSERT(num_msgs > 0)
+    
+#ifdef BADVPN_LINUX
+    return recvmmsg(fd, msgs, num_msgs, 0, NULL);
+#else
+    for (int i = 0; i < num_msgs; i++) {
+        int bytes = recvmsg(fd, &msgs[i].msg_hdr, 0);
+        if (bytes < 0) {
+            return (i > 0 ? i : -1);
+        }
+        msgs[i].msg_len = bytes;
+    }
+    
+    return num_msgs;
+#endif
+}
+
+static int send_wanted (BDatagram *o)
+{
+    return (o->send.inited && (o->send.busy || (o->send.batch && o->send.batch->count > 0)));
+}
+
+static void start_recv (BDatagram *o)
+{
+    ASSERT(!o->recv.started)
+    
+    // set recv started
+    o->recv.started = 1;
+    
+    // continue receiving
+    if (o->recv.inited && o->recv.busy) {
+        BPending_Set(&o->recv.job);
+    }
+}
+
 static void report_error (BDatagram *o)
 {
     DebugError_AssertNoError(&o->d_err);
@@ -266,91 +486,18 @@ static void do_send (BDatagram *o)
     iov.iov_base = (uint8_t *)o->send.busy_data;
     iov.iov_len = o->send.busy_data_len;
     
-    union {
-#ifdef BADVPN_FREEBSD
-        char in[CMSG_SPACE(sizeof(struct in_addr))];
-#else
-        char in[CMSG_SPACE(sizeof(struct in_pktinfo))];
-#endif
-        char in6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-    } cdata;
-    
     struct msghdr msg;
     memset(&msg, 0, sizeof(msg));
     msg.msg_name = &sysaddr.addr.generic;
     msg.msg_namelen = sysaddr.len;
     msg.msg_iov = &iov;
     msg.msg_iovlen = 1;
-    msg.msg_control = &cdata;
-    msg.msg_controllen = sizeof(cdata);
     
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-    
-    size_t controllen = 0;
-#ifdef __APPLE__
-    int bytes = -1;
-    switch (o->send.local_addr.type) {
-        case BADDR_TYPE_IPV4: {
-            bytes = sendto(o->fd, iov.iov_base, iov.iov_len, 0, msg.msg_name, msg.msg_namelen);
-        } break;
-
-        case BADDR_TYPE_IPV6: {
-            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in6_pktinfo)));
-            cmsg->cmsg_level = IPPROTO_IPV6;
-            cmsg->cmsg_type = IPV6_PKTINFO;
-            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
-            struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
-            memcpy(pktinfo->ipi6_addr.s6_addr, o->send.local_addr.ipv6, 16);
-            controllen += CMSG_SPACE(sizeof(struct in6_pktinfo));
-            msg.msg_controllen = controllen;
-            if (msg.msg_controllen == 0) {
-                msg.msg_control = NULL;
-            }
-            bytes = sendmsg(o->fd, &msg, 0);
-        } break;
-    }
-#else
-    switch (o->send.local_addr.type) {
-        case BADDR_TYPE_IPV4: {
-#ifdef BADVPN_FREEBSD
-            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_addr)));
-            cmsg->cmsg_level = IPPROTO_IP;
-            cmsg->cmsg_type = IP_SENDSRCADDR;
-            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
-            struct in_addr *addrinfo = (struct in_addr *)CMSG_DATA(cmsg);
-            addrinfo->s_addr = o->send.local_addr.ipv4;
-            controllen += CMSG_SPACE(sizeof(struct in_addr));
-#else
-            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_pktinfo)));
-            cmsg->cmsg_level = IPPROTO_IP;
-            cmsg->cmsg_type = IP_PKTINFO;
-            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
-            struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
-            pktinfo->ipi_spec_dst.s_addr = o->send.local_addr.ipv4;
-            controllen += CMSG_SPACE(sizeof(struct in_pktinfo));
-#endif
-        } break;
-        
-        case BADDR_TYPE_IPV6: {
-            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in6_pktinfo)));
-            cmsg->cmsg_level = IPPROTO_IPV6;
-            cmsg->cmsg_type = IPV6_PKTINFO;
-            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
-            struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
-            memcpy(pktinfo->ipi6_addr.s6_addr, o->send.local_addr.ipv6, 16);
-            controllen += CMSG_SPACE(sizeof(struct in6_pktinfo));
-        } break;
-    }
-    
-    msg.msg_controllen = controllen;
-    
-    if (msg.msg_controllen == 0) {
-        msg.msg_control = NULL;
-    }
+    union send_control control;
+    build_send_control(o, &msg, &control, 0);
     
     // send
     int bytes = sendmsg(o->fd, &msg, 0);
-#endif
     if (bytes < 0) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // wait for fd
@@ -359,6 +506,16 @@ static void do_send (BDatagram *o)
             return;
         }
         
+        if (errno == EMSGSIZE && o->handler_too_big) {
+            // exceeds path MTU, drop datagram
+            int data_len = o->send.busy_data_len;
+            o->send.busy = 0;
+            PacketPassInterface_Done(&o->send.iface);
+            
+            o->handler_too_big(o->user, data_len);
+            return;
+        }
+        
         BLog(BLOG_ERROR, "send failed");
         report_error(o);
         return;
@@ -373,13 +530,7 @@ static void do_send (BDatagram *o)
     
     // if recv wasn't started yet, start it
     if (!o->recv.started) {
-        // set recv started
-        o->recv.started = 1;
-        
-        // continue receiving
-        if (o->recv.inited && o->recv.busy) {
-            BPending_Set(&o->recv.job);
-        }
+        start_recv(o);
     }
     
     // set not busy
@@ -410,14 +561,7 @@ static void do_recv (BDatagram *o)
     iov.iov_base = o->recv.busy_data;
     iov.iov_len = o->recv.mtu;
     
-    union {
-#ifdef BADVPN_FREEBSD
-        char in[CMSG_SPACE(sizeof(struct in_addr))];
-#else
-        char in[CMSG_SPACE(sizeof(struct in_pktinfo))];
-#endif
-        char in6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-    } cdata;
+    union recv_control cdata;
     
     struct msghdr msg;
     memset(&msg, 0, sizeof(msg));
@@ -451,25 +595,254 @@ static void do_recv (BDatagram *o)
     addr_sys_to_socket(&o->recv.remote_addr, sysaddr);
     
     // read returned local address
-    BIPAddr_InitInvalid(&o->recv.local_addr);
-    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-#ifdef BADVPN_FREEBSD
-        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVDSTADDR) {
-            struct in_addr *addrinfo = (struct in_addr *)CMSG_DATA(cmsg);
-            BIPAddr_InitIPv4(&o->recv.local_addr, addrinfo->s_addr);
+    read_recv_control(&msg, &o->recv.local_addr);
+    
+    // set have addresses
+    o->recv.have_addrs = 1;
+    
+    // set not busy
+    o->recv.busy = 0;
+    
+    // done
+    PacketRecvInterface_Done(&o->recv.iface, bytes);
+}
+
+static void do_send_batch (BDatagram *o)
+{
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.inited)
+    ASSERT(o->send.batch)
+    ASSERT(o->send.batch->count > 0)
+    ASSERT(o->send.have_addrs)
+    
+    struct BDatagram_send_batch *b = o->send.batch;
+    
+    // limit
+    if (!BReactorLimit_Increment(&o->send.limit)) {
+        // wait for fd
+        o->wait_events |= BREACTOR_WRITE;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+        return;
+    }
+    
+    // convert destination address
+    struct sys_addr sysaddr;
+    addr_socket_to_sys(&sysaddr, o->send.remote_addr);
+    
+    // build messages, merging runs of equally sized packets if using GSO
+    int num_msgs = 0;
+    int pos = b->start_pos;
+    int i = 0;
+    while (i < b->count) {
+        int len = b->lens[b->start + i];
+        int num_packets = 1;
+        int msg_len = len;
+        
+#ifdef HAVE_UDP_GSO
+        if (b->gso && len > 0) {
+            while (i + num_packets < b->count && num_packets < GSO_MAX_SEGMENTS) {
+                int next_len = b->lens[b->start + i + num_packets];
+                if (next_len > len || next_len == 0 || msg_len + next_len > GSO_MAX_BYTES) {
+                    break;
+                }
+                num_packets++;
+                msg_len += next_len;
+                
+                // a shorter packet can only be the last segment
+                if (next_len < len) {
+                    break;
+                }
+            }
         }
-#else
-        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
-            struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
-            BIPAddr_InitIPv4(&o->recv.local_addr, pktinfo->ipi_addr.s_addr);
+#endif
+        
+        b->iovs[num_msgs].iov_base = b->buf + pos;
+        b->iovs[num_msgs].iov_len = msg_len;
+        
+        struct msghdr *msg = &b->msgs[num_msgs].msg_hdr;
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_name = &sysaddr.addr.generic;
+        msg->msg_namelen = sysaddr.len;
+        msg->msg_iov = &b->iovs[num_msgs];
+        msg->msg_iovlen = 1;
+        build_send_control(o, msg, &b->controls[num_msgs], (num_packets > 1 ? len : 0));
+        
+        b->msg_packets[num_msgs] = num_packets;
+        num_msgs++;
+        pos += msg_len;
+        i += num_packets;
+    }
+    
+    // send
+    int sent_msgs = batch_sendmsgs(o->fd, b->msgs, num_msgs);
+    if (sent_msgs < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // wait for fd
+            o->wait_events |= BREACTOR_WRITE;
+            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+            return;
+        }
+        
+#ifdef HAVE_UDP_GSO
+        if (b->msg_packets[0] > 1 && (errno == EINVAL || errno == EIO)) {
+            BLog(BLOG_INFO, "UDP segmentation offload rejected, disabling");
+            b->gso = 0;
+            BPending_Set(&o->send.job);
+            return;
         }
 #endif
-        else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
-            struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
-            BIPAddr_InitIPv6(&o->recv.local_addr, pktinfo->ipi6_addr.s6_addr);
+        
+        if (errno == EMSGSIZE && o->handler_too_big) {
+            // first message exceeds path MTU, drop it and continue with the rest
+            int data_len = b->lens[b->start];
+            b->start += b->msg_packets[0];
+            b->count -= b->msg_packets[0];
+            b->start_pos += b->iovs[0].iov_len;
+            
+            if (b->count > 0) {
+                BPending_Set(&o->send.job);
+            } else {
+                b->start = 0;
+                b->start_pos = 0;
+                b->end_pos = 0;
+                if (b->full) {
+                    b->full = 0;
+                    PacketPassInterface_Done(&o->send.iface);
+                }
+            }
+            
+            o->handler_too_big(o->user, data_len);
+            return;
+        }
+        
+        BLog(BLOG_ERROR, "send failed");
+        report_error(o);
+        return;
+    }
+    
+    ASSERT(sent_msgs > 0)
+    ASSERT(sent_msgs <= num_msgs)
+    
+    // remove sent packets from queue
+    for (int j = 0; j < sent_msgs; j++) {
+        if (b->msgs[j].msg_len < b->iovs[j].iov_len) {
+            BLog(BLOG_ERROR, "send sent too little");
+        }
+        b->start += b->msg_packets[j];
+        b->count -= b->msg_packets[j];
+        b->start_pos += b->iovs[j].iov_len;
+    }
+    
+    // if recv wasn't started yet, start it
+    if (!o->recv.started) {
+        start_recv(o);
+    }
+    
+    if (b->count > 0) {
+        // wait for fd
+        o->wait_events |= BREACTOR_WRITE;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+        return;
+    }
+    
+    // reset queue
+    b->start = 0;
+    b->start_pos = 0;
+    b->end_pos = 0;
+    
+    // accept the packet that filled the queue
+    if (b->full) {
+        b->full = 0;
+        PacketPassInterface_Done(&o->send.iface);
+    }
+}
+
+static void do_recv_batch (BDatagram *o)
+{
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->recv.inited)
+    ASSERT(o->recv.busy)
+    ASSERT(o->recv.started)
+    ASSERT(o->recv.batch)
+    ASSERT(o->recv.batch->next == o->recv.batch->count)
+    
+    struct BDatagram_recv_batch *b = o->recv.batch;
+    
+    // limit
+    if (!BReactorLimit_Increment(&o->recv.limit)) {
+        // wait for fd
+        o->wait_events |= BREACTOR_READ;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+        return;
+    }
+    
+    // build messages
+    for (int i = 0; i < b->batch_size; i++) {
+        b->iovs[i].iov_base = b->buf + (size_t)i * o->recv.mtu;
+        b->iovs[i].iov_len = o->recv.mtu;
+        
+        struct msghdr *msg = &b->msgs[i].msg_hdr;
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_name = &b->addrs[i].addr.generic;
+        msg->msg_namelen = sizeof(b->addrs[i].addr);
+        msg->msg_iov = &b->iovs[i];
+        msg->msg_iovlen = 1;
+        msg->msg_control = &b->controls[i];
+        msg->msg_controllen = sizeof(b->controls[i]);
+    }
+    
+    // recv
+    int num_msgs = batch_recvmsgs(o->fd, b->msgs, b->batch_size);
+    if (num_msgs < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // wait for fd
+            o->wait_events |= BREACTOR_READ;
+            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+            return;
         }
+        
+        BLog(BLOG_ERROR, "recv failed");
+        report_error(o);
+        return;
     }
     
+    ASSERT(num_msgs > 0)
+    ASSERT(num_msgs <= b->batch_size)
+    
+    // set queue
+    b->count = num_msgs;
+    b->next = 0;
+    
+    // complete receive from queue
+    recv_batch_deliver(o);
+}
+
+static void recv_batch_deliver (BDatagram *o)
+{
+    ASSERT(o->recv.inited)
+    ASSERT(o->recv.busy)
+    ASSERT(o->recv.batch)
+    ASSERT(o->recv.batch->next < o->recv.batch->count)
+    
+    struct BDatagram_recv_batch *b = o->recv.batch;
+    
+    // take next datagram from queue
+    int i = b->next++;
+    struct msghdr *msg = &b->msgs[i].msg_hdr;
+    int bytes = b->msgs[i].msg_len;
+    ASSERT(bytes >= 0)
+    ASSERT(bytes <= o->recv.mtu)
+    
+    // copy datagram
+    memcpy(o->recv.busy_data, b->iovs[i].iov_base, bytes);
+    
+    // read returned address
+    b->addrs[i].len = msg->msg_namelen;
+    addr_sys_to_socket(&o->recv.remote_addr, b->addrs[i]);
+    
+    // read returned local address
+    read_recv_control(msg, &o->recv.local_addr);
+    
     // set have addresses
     o->recv.have_addrs = 1;
     
@@ -480,6 +853,56 @@ static void do_recv (BDatagram *o)
     PacketRecvInterface_Done(&o->recv.iface, bytes);
 }
 
+static void send_batch_queue (BDatagram *o, const uint8_t *data, int data_len)
+{
+    struct BDatagram_send_batch *b = o->send.batch;
+    ASSERT(!b->full)
+    ASSERT(b->start + b->count < b->batch_size)
+    
+    // copy packet to end of queue
+    memcpy(b->buf + b->end_pos, data, data_len);
+    b->lens[b->start + b->count] = data_len;
+    b->count++;
+    b->end_pos += data_len;
+    
+    // submit the queue after the sender has provided all packets it has,
+    // since our job is set before the done job, it runs after it;
+    // if we're waiting for the fd, the queue is submitted when it's writable
+    if (o->send.have_addrs && !(o->wait_events & BREACTOR_WRITE) && !BPending_IsSet(&o->send.job)) {
+        BPending_Set(&o->send.job);
+    }
+    
+    // if the queue is full, accept the packet once some of it has been sent
+    if (b->start + b->count == b->batch_size) {
+        b->full = 1;
+        return;
+    }
+    
+    // accept packet
+    PacketPassInterface_Done(&o->send.iface);
+}
+
+static void free_send_batch (struct BDatagram_send_batch *b)
+{
+    BFree(b->controls);
+    BFree(b->iovs);
+    BFree(b->msg_packets);
+    BFree(b->msgs);
+    BFree(b->lens);
+    BFree(b->buf);
+    BFree(b);
+}
+
+static void free_recv_batch (struct BDatagram_recv_batch *b)
+{
+    BFree(b->controls);
+    BFree(b->addrs);
+    BFree(b->iovs);
+    BFree(b->msgs);
+    BFree(b->buf);
+    BFree(b);
+}
+
 static void fd_handler (BDatagram *o, int events)
 {
     DebugObject_Access(&o->d_obj);
@@ -492,9 +915,8 @@ static void fd_handler (BDatagram *o, int events)
     int have_send = 0;
     int have_recv = 0;
     
-    if ((events & BREACTOR_WRITE) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->send.inited && o->send.busy && o->send.have_addrs)) {
-        ASSERT(o->send.inited)
-        ASSERT(o->send.busy)
+    if ((events & BREACTOR_WRITE) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && send_wanted(o) && o->send.have_addrs)) {
+        ASSERT(send_wanted(o))
         ASSERT(o->send.have_addrs)
         
         have_send = 1;
@@ -513,12 +935,20 @@ static void fd_handler (BDatagram *o, int events)
             BPending_Set(&o->recv.job);
         }
         
-        do_send(o);
+        if (o->send.batch) {
+            do_send_batch(o);
+        } else {
+            do_send(o);
+        }
         return;
     }
     
     if (have_recv) {
-        do_recv(o);
+        if (o->recv.batch) {
+            do_recv_batch(o);
+        } else {
+            do_recv(o);
+        }
         return;
     }
     
@@ -531,10 +961,14 @@ static void send_job_handler (BDatagram *o)
 {
     DebugObject_Access(&o->d_obj);
     DebugError_AssertNoError(&o->d_err);
-    ASSERT(o->send.inited)
-    ASSERT(o->send.busy)
+    ASSERT(send_wanted(o))
     ASSERT(o->send.have_addrs)
     
+    if (o->send.batch) {
+        do_send_batch(o);
+        return;
+    }
+    
     do_send(o);
     return;
 }
@@ -547,6 +981,11 @@ static void recv_job_handler (BDatagram *o)
     ASSERT(o->recv.busy)
     ASSERT(o->recv.started)
     
+    if (o->recv.batch) {
+        do_recv_batch(o);
+        return;
+    }
+    
     do_recv(o);
     return;
 }
@@ -560,6 +999,12 @@ static void send_if_handler_send (BDatagram *o, uint8_t *data, int data_len)
     ASSERT(data_len >= 0)
     ASSERT(data_len <= o->send.mtu)
     
+    // in batch mode, queue packet
+    if (o->send.batch) {
+        send_batch_queue(o, data, data_len);
+        return;
+    }
+    
     // remember data
     o->send.busy_data = data;
     o->send.busy_data_len = data_len;
@@ -594,6 +1039,12 @@ static void recv_if_handler_recv (BDatagram *o, uint8_t *data)
         return;
     }
     
+    // in batch mode, complete from queue if possible
+    if (o->recv.batch && o->recv.batch->next < o->recv.batch->count) {
+        recv_batch_deliver(o);
+        return;
+    }
+    
     // set job
     BPending_Set(&o->recv.job);
 }
@@ -623,6 +1074,13 @@ int BDatagram_Init (BDatagram *o, int family, BReactor *reactor, void *user,
     o->reactor = reactor;
     o->user = user;
     o->handler = handler;
+    o->family = family;
+    
+    // no path MTU discovery
+    o->handler_too_big = NULL;
+    
+    // no path MTU probe socket
+    o->pmtu_fd = -1;
     
     // init fd
     if ((o->fd = socket(family_socket_to_sys(family), SOCK_DGRAM, 0)) < 0) {
@@ -664,6 +1122,10 @@ int BDatagram_Init (BDatagram *o, int family, BReactor *reactor, void *user,
     o->send.inited = 0;
     o->recv.inited = 0;
     
+    // set not batching
+    o->send.batch = NULL;
+    o->recv.batch = NULL;
+    
     DebugError_Init(&o->d_err, BReactor_PendingGroup(o->reactor));
     DebugObject_Init(&o->d_obj);
     return 1;
@@ -690,6 +1152,13 @@ void BDatagram_Free (BDatagram *o)
     // free BFileDescriptor
     BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
     
+    // free path MTU probe socket
+    if (o->pmtu_fd >= 0) {
+        if (close(o->pmtu_fd) < 0) {
+            BLog(BLOG_ERROR, "close failed");
+        }
+    }
+    
     // free fd
     if (close(o->fd) < 0) {
         BLog(BLOG_ERROR, "close failed");
@@ -714,13 +1183,7 @@ int BDatagram_Bind (BDatagram *o, BAddr addr)
     
     // if recv wasn't started yet, start it
     if (!o->recv.started) {
-        // set recv started
-        o->recv.started = 1;
-        
-        // continue receiving
-        if (o->recv.inited && o->recv.busy) {
-            BPending_Set(&o->recv.job);
-        }
+        start_recv(o);
     }
     
     return 1;
@@ -742,7 +1205,7 @@ void BDatagram_SetSendAddrs (BDatagram *o, BAddr remote_addr, BIPAddr local_addr
         o->send.have_addrs = 1;
         
         // start sending
-        if (o->send.inited && o->send.busy) {
+        if (send_wanted(o)) {
             BPending_Set(&o->send.job);
         }
     }
@@ -780,6 +1243,93 @@ int BDatagram_SetReuseAddr (BDatagram *o, int reuse)
     return 1;
 }
 
+int BDatagram_EnablePathMTUDiscovery (BDatagram *o, BDatagram_handler_too_big handler_too_big)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(handler_too_big)
+    
+#ifdef BADVPN_LINUX
+    int res;
+    switch (o->family) {
+        case BADDR_TYPE_IPV4: {
+            int opt = IP_PMTUDISC_DO;
+            res = setsockopt(o->fd, IPPROTO_IP, IP_MTU_DISCOVER, &opt, sizeof(opt));
+        } break;
+        case BADDR_TYPE_IPV6: {
+            int opt = IPV6_PMTUDISC_DO;
+            res = setsockopt(o->fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &opt, sizeof(opt));
+        } break;
+        default:
+            return 0;
+    }
+    
+    if (res < 0) {
+        BLog(BLOG_ERROR, "setsockopt failed");
+        return 0;
+    }
+    
+    o->handler_too_big = handler_too_big;
+    
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+int BDatagram_GetPathMTU (BDatagram *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+#ifdef BADVPN_LINUX
+    if (!o->send.have_addrs) {
+        return -1;
+    }
+    
+    BAddr addr = o->send.remote_addr;
+    if (addr.type != o->family || (addr.type != BADDR_TYPE_IPV4 && addr.type != BADDR_TYPE_IPV6)) {
+        return -1;
+    }
+    
+    // The path MTU can only be queried on a connected socket, so keep a separate
+    // socket connected to the send address. Nothing is sent through it.
+    if (o->pmtu_fd < 0) {
+        if ((o->pmtu_fd = socket(family_socket_to_sys(o->family), SOCK_DGRAM, 0)) < 0) {
+            BLog(BLOG_ERROR, "socket failed");
+            return -1;
+        }
+        o->pmtu_addr = BAddr_MakeNone();
+    }
+    
+    // connect it if the send address changed
+    if (!BAddr_Compare(&o->pmtu_addr, &addr)) {
+        struct sys_addr sysaddr;
+        addr_socket_to_sys(&sysaddr, addr);
+        
+        if (connect(o->pmtu_fd, &sysaddr.addr.generic, sysaddr.len) < 0) {
+            BLog(BLOG_ERROR, "connect failed");
+            o->pmtu_addr = BAddr_MakeNone();
+            return -1;
+        }
+        
+        o->pmtu_addr = addr;
+    }
+    
+    int val;
+    socklen_t val_len = sizeof(val);
+    int res = (o->family == BADDR_TYPE_IPV6 ?
+        getsockopt(o->pmtu_fd, IPPROTO_IPV6, IPV6_MTU, &val, &val_len) :
+        getsockopt(o->pmtu_fd, IPPROTO_IP, IP_MTU, &val, &val_len)
+    );
+    if (res < 0) {
+        return -1;
+    }
+    
+    return val;
+#else
+    return -1;
+#endif
+}
+
 void BDatagram_SendAsync_Init (BDatagram *o, int mtu)
 {
     DebugObject_Access(&o->d_obj);
@@ -799,10 +1349,63 @@ void BDatagram_SendAsync_Init (BDatagram *o, int mtu)
     // set not busy
     o->send.busy = 0;
     
+    // set not batching
+    o->send.batch = NULL;
+    
     // set inited
     o->send.inited = 1;
 }
 
+int BDatagram_SendAsync_InitBatch (BDatagram *o, int mtu, int batch_size, int use_gso)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(!o->send.inited)
+    ASSERT(mtu >= 0)
+    ASSERT(batch_size >= 1)
+    ASSERT(batch_size <= BDATAGRAM_MAX_BATCH_SIZE)
+    
+    // allocate batch state
+    struct BDatagram_send_batch *b = BAlloc(sizeof(*b));
+    if (!b) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        return 0;
+    }
+    b->buf = BAllocArray2(batch_size, mtu, 1);
+    b->lens = BAllocArray(batch_size, sizeof(b->lens[0]));
+    b->msgs = BAllocArray(batch_size, sizeof(b->msgs[0]));
+    b->msg_packets = BAllocArray(batch_size, sizeof(b->msg_packets[0]));
+    b->iovs = BAllocArray(batch_size, sizeof(b->iovs[0]));
+    b->controls = BAllocArray(batch_size, sizeof(b->controls[0]));
+    if (!b->buf || !b->lens || !b->msgs || !b->msg_packets || !b->iovs || !b->controls) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        free_send_batch(b);
+        return 0;
+    }
+    
+    b->batch_size = batch_size;
+#ifdef HAVE_UDP_GSO
+    b->gso = !!use_gso;
+#else
+    b->gso = 0;
+#endif
+    
+    // set queue empty
+    b->start = 0;
+    b->count = 0;
+    b->start_pos = 0;
+    b->end_pos = 0;
+    b->full = 0;
+    
+    // init send interface
+    BDatagram_SendAsync_Init(o, mtu);
+    
+    // set batching
+    o->send.batch = b;
+    
+    return 1;
+}
+
 void BDatagram_SendAsync_Free (BDatagram *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -818,6 +1421,12 @@ void BDatagram_SendAsync_Free (BDatagram *o)
     // free interface
     PacketPassInterface_Free(&o->send.iface);
     
+    // free batch state, dropping queued packets
+    if (o->send.batch) {
+        free_send_batch(o->send.batch);
+        o->send.batch = NULL;
+    }
+    
     // set not inited
     o->send.inited = 0;
 }
@@ -849,10 +1458,54 @@ void BDatagram_RecvAsync_Init (BDatagram *o, int mtu)
     // set not busy
     o->recv.busy = 0;
     
+    // set not batching
+    o->recv.batch = NULL;
+    
     // set inited
     o->recv.inited = 1;
 }
 
+int BDatagram_RecvAsync_InitBatch (BDatagram *o, int mtu, int batch_size)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(!o->recv.inited)
+    ASSERT(mtu >= 0)
+    ASSERT(batch_size >= 1)
+    ASSERT(batch_size <= BDATAGRAM_MAX_BATCH_SIZE)
+    
+    // allocate batch state
+    struct BDatagram_recv_batch *b = BAlloc(sizeof(*b));
+    if (!b) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        return 0;
+    }
+    b->buf = BAllocArray2(batch_size, mtu, 1);
+    b->msgs = BAllocArray(batch_size, sizeof(b->msgs[0]));
+    b->iovs = BAllocArray(batch_size, sizeof(b->iovs[0]));
+    b->addrs = BAllocArray(batch_size, sizeof(b->addrs[0]));
+    b->controls = BAllocArray(batch_size, sizeof(b->controls[0]));
+    if (!b->buf || !b->msgs || !b->iovs || !b->addrs || !b->controls) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        free_recv_batch(b);
+        return 0;
+    }
+    
+    b->batch_size = batch_size;
+    
+    // set queue empty
+    b->count = 0;
+    b->next = 0;
+    
+    // init receive interface
+    BDatagram_RecvAsync_Init(o, mtu);
+    
+    // set batching
+    o->recv.batch = b;
+    
+    return 1;
+}
+
 void BDatagram_RecvAsync_Free (BDatagram *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -868,6 +1521,12 @@ void BDatagram_RecvAsync_Free (BDatagram *o)
     // free interface
     PacketRecvInterface_Free(&o->recv.iface);
     
+    // free batch state, dropping queued datagrams
+    if (o->recv.batch) {
+        free_recv_batch(o->recv.batch);
+        o->recv.batch = NULL;
+    }
+    
     // set not inited
     o->recv.inited = 0;
 }
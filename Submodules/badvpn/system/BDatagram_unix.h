@@ -33,13 +33,22 @@
 #define BDATAGRAM_SEND_LIMIT 2
 #define BDATAGRAM_RECV_LIMIT 2
 
+#define BDATAGRAM_MAX_BATCH_SIZE 256
+
+struct BDatagram_send_batch;
+struct BDatagram_recv_batch;
+
 struct BDatagram_s {
     BReactor *reactor;
     void *user;
     BDatagram_handler handler;
+    BDatagram_handler_too_big handler_too_big;
+    int family;
     int fd;
     BFileDescriptor bfd;
     int wait_events;
+    int pmtu_fd;
+    BAddr pmtu_addr;
     struct {
         BReactorLimit limit;
         int have_addrs;
@@ -52,6 +61,7 @@ struct BDatagram_s {
         int busy;
         const uint8_t *busy_data;
         int busy_data_len;
+        struct BDatagram_send_batch *batch;
     } send;
     struct {
         BReactorLimit limit;
@@ -65,6 +75,7 @@ struct BDatagram_s {
         BPending job;
         int busy;
         uint8_t *busy_data;
+        struct BDatagram_recv_batch *batch;
     } recv;
     DebugError d_err;
     DebugObject d_obj;
@@ -650,6 +650,21 @@ int BDatagram_SetReuseAddr (BDatagram *o, int reuse)
     return 1;
 }
 
+int BDatagram_EnablePathMTUDiscovery (BDatagram *o, BDatagram_handler_too_big handler_too_big)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(handler_too_big)
+    
+    return 0;
+}
+
+int BDatagram_GetPathMTU (BDatagram *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return -1;
+}
+
 void BDatagram_SendAsync_Init (BDatagram *o, int mtu)
 {
     DebugObject_Access(&o->d_obj);
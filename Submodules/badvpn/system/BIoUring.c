@@ -0,0 +1,271 @@
+/**
+ * @file BIoUring.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+
+#include "BIoUring.h"
+
+#include <generated/blog_channel_BIoUring.h>
+
+static int sys_io_uring_setup (unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter (int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int submit (BIoUring *o, unsigned int wait_nr, unsigned int flags, void *arg, size_t argsz)
+{
+    // publish pending entries
+    __atomic_store_n(o->sq_tail, o->sq_local_tail, __ATOMIC_RELEASE);
+    
+    if (wait_nr > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    
+    int res;
+    do {
+        res = sys_io_uring_enter(o->fd, o->num_pending, wait_nr, flags, arg, argsz);
+    } while (res < 0 && errno == EINTR);
+    
+    if (res < 0) {
+        return -errno;
+    }
+    
+    // entries not consumed by the kernel stay in the queue
+    ASSERT(res <= o->num_pending)
+    o->num_pending -= res;
+    o->num_inflight += res;
+    
+    return 0;
+}
+
+int BIoUring_Init (BIoUring *o, unsigned int entries)
+{
+    ASSERT(entries > 0)
+    
+    return BIoUring_Init2(o, entries, 2 * entries);
+}
+
+int BIoUring_Init2 (BIoUring *o, unsigned int entries, unsigned int cq_entries)
+{
+    ASSERT(entries > 0)
+    ASSERT(cq_entries >= entries)
+    
+    // create instance
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+    if ((o->fd = sys_io_uring_setup(entries, &p)) < 0) {
+        BLog(BLOG_ERROR, "io_uring_setup failed (%d)", errno);
+        goto fail0;
+    }
+    
+    // map submission queue ring
+    o->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    o->sq_ring = mmap(NULL, o->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, o->fd, IORING_OFF_SQ_RING);
+    if (o->sq_ring == MAP_FAILED) {
+        BLog(BLOG_ERROR, "mmap failed for submission queue ring");
+        goto fail1;
+    }
+    
+    // map completion queue ring
+    o->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    o->cq_ring = mmap(NULL, o->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, o->fd, IORING_OFF_CQ_RING);
+    if (o->cq_ring == MAP_FAILED) {
+        BLog(BLOG_ERROR, "mmap failed for completion queue ring");
+        goto fail2;
+    }
+    
+    // map submission queue entries
+    o->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    o->sqes = mmap(NULL, o->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, o->fd, IORING_OFF_SQES);
+    if (o->sqes == MAP_FAILED) {
+        BLog(BLOG_ERROR, "mmap failed for submission queue entries");
+        goto fail3;
+    }
+    
+    // remember ring fields
+    o->sq_tail = (unsigned int *)((char *)o->sq_ring + p.sq_off.tail);
+    o->sq_head = (unsigned int *)((char *)o->sq_ring + p.sq_off.head);
+    o->sq_mask = *(unsigned int *)((char *)o->sq_ring + p.sq_off.ring_mask);
+    o->sq_entries = p.sq_entries;
+    o->sq_array = (unsigned int *)((char *)o->sq_ring + p.sq_off.array);
+    o->cq_head = (unsigned int *)((char *)o->cq_ring + p.cq_off.head);
+    o->cq_tail = (unsigned int *)((char *)o->cq_ring + p.cq_off.tail);
+    o->cq_mask = *(unsigned int *)((char *)o->cq_ring + p.cq_off.ring_mask);
+    o->cqes = (struct io_uring_cqe *)((char *)o->cq_ring + p.cq_off.cqes);
+    o->features = p.features;
+    
+    // limit requests in flight so that completions can't overflow
+    o->max_inflight = p.cq_entries;
+    
+    o->sq_local_tail = *o->sq_tail;
+    
+    // set no requests
+    o->num_pending = 0;
+    o->num_inflight = 0;
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail3:
+    ASSERT_FORCE(munmap(o->cq_ring, o->cq_ring_size) == 0)
+fail2:
+    ASSERT_FORCE(munmap(o->sq_ring, o->sq_ring_size) == 0)
+fail1:
+    ASSERT_FORCE(close(o->fd) == 0)
+fail0:
+    return 0;
+}
+
+void BIoUring_Free (BIoUring *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // unmap rings
+    ASSERT_FORCE(munmap(o->sqes, o->sqes_size) == 0)
+    ASSERT_FORCE(munmap(o->cq_ring, o->cq_ring_size) == 0)
+    ASSERT_FORCE(munmap(o->sq_ring, o->sq_ring_size) == 0)
+    
+    // close instance
+    ASSERT_FORCE(close(o->fd) == 0)
+}
+
+int BIoUring_GetFd (BIoUring *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return o->fd;
+}
+
+unsigned int BIoUring_GetFeatures (BIoUring *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return o->features;
+}
+
+unsigned int BIoUring_GetNumInflight (BIoUring *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return o->num_inflight;
+}
+
+struct io_uring_sqe * BIoUring_GetSqe (BIoUring *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    // check space
+    if (o->num_pending == o->sq_entries || o->num_inflight + o->num_pending == o->max_inflight) {
+        return NULL;
+    }
+    
+    // get entry at the tail
+    unsigned int index = o->sq_local_tail & o->sq_mask;
+    struct io_uring_sqe *sqe = &o->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    o->sq_array[index] = index;
+    
+    o->sq_local_tail++;
+    o->num_pending++;
+    
+    return sqe;
+}
+
+int BIoUring_Submit (BIoUring *o, unsigned int wait_nr)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    int res = submit(o, wait_nr, 0, NULL, 0);
+    if (res < 0) {
+        BLog(BLOG_ERROR, "io_uring_enter failed (%d)", -res);
+        return 0;
+    }
+    
+    return 1;
+}
+
+int BIoUring_SubmitWaitTimeout (BIoUring *o, btime_t timeout)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->features & IORING_FEAT_EXT_ARG)
+    ASSERT(timeout >= 0)
+    
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    
+    // running out of time is reported as ETIME
+    int res = submit(o, 1, IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (res < 0 && res != -ETIME) {
+        BLog(BLOG_ERROR, "io_uring_enter failed (%d)", -res);
+        return 0;
+    }
+    
+    return 1;
+}
+
+struct io_uring_cqe * BIoUring_PeekCqe (BIoUring *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    unsigned int head = *o->cq_head;
+    
+    if (head == __atomic_load_n(o->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    
+    return &o->cqes[head & o->cq_mask];
+}
+
+void BIoUring_SeenCqe (BIoUring *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->num_inflight > 0)
+    
+    __atomic_store_n(o->cq_head, *o->cq_head + 1, __ATOMIC_RELEASE);
+    
+    o->num_inflight--;
+}
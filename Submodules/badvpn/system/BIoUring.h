@@ -0,0 +1,182 @@
+/**
+ * @file BIoUring.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Minimal wrapper around a Linux io_uring instance, for submitting batches
+ * of I/O requests with a single system call.
+ */
+
+#ifndef BADVPN_SYSTEM_BIOURING_H
+#define BADVPN_SYSTEM_BIOURING_H
+
+#ifndef BADVPN_USE_IO_URING
+#error BIoUring requires BADVPN_USE_IO_URING
+#endif
+
+#include <stddef.h>
+
+#include <linux/io_uring.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+#include <system/BTime.h>
+
+typedef struct {
+    int fd;
+    unsigned int features;
+    unsigned int num_pending;
+    unsigned int num_inflight;
+    unsigned int max_inflight;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *sq_tail;
+    unsigned int sq_local_tail;
+    unsigned int *sq_head;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    DebugObject d_obj;
+} BIoUring;
+
+/**
+ * Initializes the io_uring instance.
+ * Fails if the kernel does not support io_uring.
+ * 
+ * @param o the object
+ * @param entries number of submission queue entries. Must be >0.
+ *                The completion queue is twice as large.
+ * @return 1 on success, 0 on failure
+ */
+int BIoUring_Init (BIoUring *o, unsigned int entries) WARN_UNUSED;
+
+/**
+ * Initializes the io_uring instance with a completion queue of the given size.
+ * Fails if the kernel does not support io_uring.
+ * 
+ * @param o the object
+ * @param entries number of submission queue entries. Must be >0.
+ * @param cq_entries number of completion queue entries. Must be >=entries.
+ *                   This also limits the number of requests in flight.
+ * @return 1 on success, 0 on failure
+ */
+int BIoUring_Init2 (BIoUring *o, unsigned int entries, unsigned int cq_entries) WARN_UNUSED;
+
+/**
+ * Frees the io_uring instance.
+ * Any requests still being processed by the kernel are canceled, but
+ * the kernel may not be done with their buffers yet when this returns,
+ * so the user must wait for their completions before calling this if
+ * it cares.
+ * 
+ * @param o the object
+ */
+void BIoUring_Free (BIoUring *o);
+
+/**
+ * Returns the file descriptor of the instance, which becomes readable
+ * when there are completions to be collected.
+ * 
+ * @param o the object
+ * @return file descriptor
+ */
+int BIoUring_GetFd (BIoUring *o);
+
+/**
+ * Returns the IORING_FEAT_* flags reported by the kernel.
+ * 
+ * @param o the object
+ * @return feature flags
+ */
+unsigned int BIoUring_GetFeatures (BIoUring *o);
+
+/**
+ * Returns the number of requests which have been submitted and whose
+ * completions have not yet been collected.
+ * 
+ * @param o the object
+ * @return number of requests in flight
+ */
+unsigned int BIoUring_GetNumInflight (BIoUring *o);
+
+/**
+ * Returns a zeroed submission queue entry to be filled in by the user.
+ * The entry is submitted with the next {@link BIoUring_Submit}.
+ * 
+ * @param o the object
+ * @return submission queue entry, or NULL if the submission queue is full
+ */
+struct io_uring_sqe * BIoUring_GetSqe (BIoUring *o);
+
+/**
+ * Submits the entries obtained with {@link BIoUring_GetSqe} to the kernel,
+ * optionally waiting for completions.
+ * 
+ * @param o the object
+ * @param wait_nr minimum number of completions to wait for. Must be >=0.
+ * @return 1 on success, 0 on failure
+ */
+int BIoUring_Submit (BIoUring *o, unsigned int wait_nr) WARN_UNUSED;
+
+/**
+ * Like {@link BIoUring_Submit} with wait_nr=1, but gives up waiting
+ * after the given time. Running out of time is not a failure; use
+ * {@link BIoUring_PeekCqe} to see if there are completions.
+ * Requires the IORING_FEAT_EXT_ARG feature.
+ * 
+ * @param o the object
+ * @param timeout maximum time to wait in milliseconds. Must be >=0.
+ * @return 1 on success, 0 on failure
+ */
+int BIoUring_SubmitWaitTimeout (BIoUring *o, btime_t timeout) WARN_UNUSED;
+
+/**
+ * Returns the oldest completion which has not been collected yet, without
+ * removing it. This does not involve a system call.
+ * 
+ * @param o the object
+ * @return completion queue entry, or NULL if there are none
+ */
+struct io_uring_cqe * BIoUring_PeekCqe (BIoUring *o);
+
+/**
+ * Removes the completion returned by {@link BIoUring_PeekCqe}.
+ * 
+ * @param o the object
+ */
+void BIoUring_SeenCqe (BIoUring *o);
+
+#endif
@@ -0,0 +1,186 @@
+/**
+ * @file BMailbox.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <sched.h>
+
+#include <misc/offset.h>
+
+#include "BMailbox.h"
+
+static void push (BMailbox *o, BMailboxNode *node)
+{
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    
+    // the exchange orders this post against all others; the node becomes
+    // reachable from the previous one right after it
+    BMailboxNode *prev = __atomic_exchange_n(&o->head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+static BMailboxNode * wait_next (BMailbox *o, BMailboxNode *node)
+{
+    BMailboxNode *next;
+    
+    while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+        // nothing was posted after node
+        if (__atomic_load_n(&o->head, __ATOMIC_ACQUIRE) == node) {
+            return NULL;
+        }
+        
+        // something was, and its poster is about to link it
+        sched_yield();
+    }
+    
+    return next;
+}
+
+static BMailboxNode * pop (BMailbox *o)
+{
+    BMailboxNode *tail = o->tail;
+    BMailboxNode *next = wait_next(o, tail);
+    
+    // skip the stub
+    if (tail == &o->stub) {
+        if (!next) {
+            return NULL;
+        }
+        o->tail = next;
+        tail = next;
+        next = wait_next(o, tail);
+    }
+    
+    if (next) {
+        o->tail = next;
+        return tail;
+    }
+    
+    // tail is the last node; put the stub after it so that it can be taken
+    push(o, &o->stub);
+    next = wait_next(o, tail);
+    ASSERT(next)
+    o->tail = next;
+    
+    return tail;
+}
+
+static void receive (BMailbox *o)
+{
+    BMailboxNode *node = pop(o);
+    if (!node) {
+        return;
+    }
+    
+    // there may be more; receive them from a job, which runs after any
+    // jobs the handler sets, like it would for separate events
+    BPending_Set(&o->more_job);
+    
+    o->handler(o->user, node);
+}
+
+static void thread_signal_handler (BThreadSignal *thread_signal)
+{
+    BMailbox *o = UPPER_OBJECT(thread_signal, BMailbox, thread_signal);
+    DebugObject_Access(&o->d_obj);
+    
+    // allow signaling again before receiving, so that a message
+    // posted after we have looked results in another signal
+    __atomic_store_n(&o->signaled, 0, __ATOMIC_SEQ_CST);
+    
+    receive(o);
+}
+
+static void more_job_handler (BMailbox *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    receive(o);
+}
+
+int BMailbox_Init (BMailbox *o, BReactor *reactor, BMailbox_handler handler, void *user)
+{
+    ASSERT(handler)
+    
+    // init arguments
+    o->reactor = reactor;
+    o->handler = handler;
+    o->user = user;
+    
+    // init queue with just the stub
+    o->stub.next = NULL;
+    o->head = &o->stub;
+    o->tail = &o->stub;
+    
+    // not signaled
+    o->signaled = 0;
+    
+    // init thread signal
+    if (!BThreadSignal_Init(&o->thread_signal, o->reactor, thread_signal_handler)) {
+        goto fail0;
+    }
+    
+    // init more job
+    BPending_Init(&o->more_job, BReactor_PendingGroup(o->reactor), (BPending_handler)more_job_handler, o);
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail0:
+    return 0;
+}
+
+void BMailbox_Free (BMailbox *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // free more job
+    BPending_Free(&o->more_job);
+    
+    // free thread signal
+    BThreadSignal_Free(&o->thread_signal);
+}
+
+void BMailbox_Thread_Post (BMailbox *o, BMailboxNode *node)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    push(o, node);
+    
+    // wake up the receiver, unless it was woken up and hasn't looked yet
+    if (!__atomic_exchange_n(&o->signaled, 1, __ATOMIC_SEQ_CST)) {
+        BThreadSignal_Thread_Signal(&o->thread_signal);
+    }
+}
+
+BMailboxNode * BMailbox_Get (BMailbox *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return pop(o);
+}
@@ -0,0 +1,117 @@
+/**
+ * @file BMailbox.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BADVPN_B_MAILBOX_H
+#define BADVPN_B_MAILBOX_H
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+#include <base/BPending.h>
+#include <system/BReactor.h>
+#include <system/BThreadSignal.h>
+
+/**
+ * Message node, embedded in messages posted to a {@link BMailbox}.
+ */
+typedef struct BMailboxNode_s {
+    struct BMailboxNode_s *next;
+} BMailboxNode;
+
+/**
+ * Handler called from the event loop of the mailbox for each message posted to it.
+ * The message is no longer referenced by the mailbox. Jobs set by the handler
+ * run before the next message is received.
+ * 
+ * @param user as in {@link BMailbox_Init}
+ * @param node node of the message
+ */
+typedef void (*BMailbox_handler) (void *user, BMailboxNode *node);
+
+/**
+ * Queue of messages from any number of threads to the event loop of one thread.
+ * 
+ * Posting a message is lock-free: it is an atomic exchange, and a wakeup of the
+ * receiving event loop if it is not already about to process messages.
+ * Messages from one thread are received in the order they were posted. Messages
+ * from different threads are received in the order of their posts' atomic
+ * exchanges, so a message posted as a consequence of receiving another message
+ * is received after anything the sender of that message posted before it.
+ */
+typedef struct {
+    BReactor *reactor;
+    BMailbox_handler handler;
+    void *user;
+    BMailboxNode *head;
+    BMailboxNode *tail;
+    BMailboxNode stub;
+    int signaled;
+    BThreadSignal thread_signal;
+    BPending more_job;
+    DebugObject d_obj;
+} BMailbox;
+
+/**
+ * Initializes the mailbox.
+ * 
+ * @param o the object
+ * @param reactor reactor we live in; messages are received in its thread
+ * @param handler handler called for received messages
+ * @param user argument to handler
+ * @return 1 on success, 0 on failure
+ */
+int BMailbox_Init (BMailbox *o, BReactor *reactor, BMailbox_handler handler, void *user) WARN_UNUSED;
+
+/**
+ * Frees the mailbox.
+ * No thread may be posting messages. Messages which were posted but not yet
+ * received are forgotten; use {@link BMailbox_Get} to get them first if needed.
+ * 
+ * @param o the object
+ */
+void BMailbox_Free (BMailbox *o);
+
+/**
+ * Posts a message to the mailbox. May be called from any thread.
+ * 
+ * @param o the object
+ * @param node node of the message. Must not be in a mailbox.
+ */
+void BMailbox_Thread_Post (BMailbox *o, BMailboxNode *node);
+
+/**
+ * Takes the next message from the mailbox without calling the handler.
+ * Must be called from the thread of the mailbox's reactor, or when no other
+ * thread is receiving from it.
+ * 
+ * @param o the object
+ * @return node of the message, or NULL if there are no messages
+ */
+BMailboxNode * BMailbox_Get (BMailbox *o);
+
+#endif
@@ -0,0 +1,202 @@
+/**
+ * @file BMetricsServer.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+
+#include <misc/offset.h>
+#include <misc/expstring.h>
+#include <base/BLog.h>
+#include <base/BMetrics.h>
+
+#include "BMetricsServer.h"
+
+#include <generated/blog_channel_BMetricsServer.h>
+
+struct client {
+    BMetricsServer *server;
+    BConnection con;
+    ExpString text;
+    size_t sent;
+    LinkedList1Node list_node;
+};
+
+static void listener_handler (BMetricsServer *o);
+static void client_free (struct client *c);
+static void client_send (struct client *c);
+static void client_connection_handler (struct client *c, int event);
+static void client_send_handler_done (struct client *c, int data_len);
+
+static void listener_handler (BMetricsServer *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    if (o->num_clients == BMETRICSSERVER_MAX_CLIENTS) {
+        BLog(BLOG_WARNING, "too many clients");
+        return;
+    }
+    
+    // allocate client
+    struct client *c = malloc(sizeof(*c));
+    if (!c) {
+        BLog(BLOG_ERROR, "malloc failed");
+        goto fail0;
+    }
+    
+    // set server
+    c->server = o;
+    
+    // accept connection
+    if (!BConnection_Init(&c->con, BConnection_source_listener(&o->listener, NULL), o->reactor, c, (BConnection_handler)client_connection_handler)) {
+        BLog(BLOG_ERROR, "BConnection_Init failed");
+        goto fail1;
+    }
+    
+    // init sending
+    BConnection_SendAsync_Init(&c->con);
+    StreamPassInterface_Sender_Init(BConnection_SendAsync_GetIf(&c->con), (StreamPassInterface_handler_done)client_send_handler_done, c);
+    
+    // render metrics
+    if (!ExpString_Init(&c->text)) {
+        BLog(BLOG_ERROR, "ExpString_Init failed");
+        goto fail2;
+    }
+    if (!BMetrics_Print(&c->text)) {
+        BLog(BLOG_ERROR, "BMetrics_Print failed");
+        goto fail3;
+    }
+    
+    // insert to clients list
+    LinkedList1_Append(&o->clients_list, &c->list_node);
+    o->num_clients++;
+    
+    // start sending
+    c->sent = 0;
+    client_send(c);
+    return;
+    
+fail3:
+    ExpString_Free(&c->text);
+fail2:
+    BConnection_SendAsync_Free(&c->con);
+    BConnection_Free(&c->con);
+fail1:
+    free(c);
+fail0:
+    return;
+}
+
+static void client_free (struct client *c)
+{
+    BMetricsServer *o = c->server;
+    
+    // remove from clients list
+    LinkedList1_Remove(&o->clients_list, &c->list_node);
+    o->num_clients--;
+    
+    // free text
+    ExpString_Free(&c->text);
+    
+    // free connection
+    BConnection_SendAsync_Free(&c->con);
+    BConnection_Free(&c->con);
+    
+    free(c);
+}
+
+static void client_send (struct client *c)
+{
+    size_t left = ExpString_Length(&c->text) - c->sent;
+    
+    if (left == 0) {
+        client_free(c);
+        return;
+    }
+    
+    int len = (left > INT_MAX ? INT_MAX : left);
+    StreamPassInterface_Sender_Send(BConnection_SendAsync_GetIf(&c->con), (uint8_t *)ExpString_Get(&c->text) + c->sent, len);
+}
+
+static void client_connection_handler (struct client *c, int event)
+{
+    DebugObject_Access(&c->server->d_obj);
+    
+    if (event == BCONNECTION_EVENT_ERROR) {
+        BLog(BLOG_INFO, "client error");
+    }
+    
+    client_free(c);
+}
+
+static void client_send_handler_done (struct client *c, int data_len)
+{
+    DebugObject_Access(&c->server->d_obj);
+    ASSERT(data_len > 0)
+    ASSERT(data_len <= ExpString_Length(&c->text) - c->sent)
+    
+    c->sent += data_len;
+    
+    client_send(c);
+}
+
+int BMetricsServer_Init (BMetricsServer *o, const char *socket_path, BReactor *reactor)
+{
+    ASSERT(socket_path)
+    
+    // init arguments
+    o->reactor = reactor;
+    
+    // init listener
+    if (!BListener_InitUnix(&o->listener, socket_path, o->reactor, o, (BListener_handler)listener_handler)) {
+        BLog(BLOG_ERROR, "BListener_InitUnix failed");
+        return 0;
+    }
+    
+    // init clients list
+    LinkedList1_Init(&o->clients_list);
+    o->num_clients = 0;
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+}
+
+void BMetricsServer_Free (BMetricsServer *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // free clients
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&o->clients_list)) {
+        struct client *c = UPPER_OBJECT(node, struct client, list_node);
+        client_free(c);
+    }
+    
+    // free listener
+    BListener_Free(&o->listener);
+}
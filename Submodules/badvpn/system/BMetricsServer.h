@@ -0,0 +1,78 @@
+/**
+ * @file BMetricsServer.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * 
+ * @section DESCRIPTION
+ * 
+ * Serves the values of {@link BMetrics} metrics on a Unix socket.
+ */
+
+#ifndef BADVPN_SYSTEM_BMETRICSSERVER_H
+#define BADVPN_SYSTEM_BMETRICSSERVER_H
+
+#include <misc/debug.h>
+#include <structure/LinkedList1.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BConnection.h>
+
+// maximum number of connections being served at once
+#define BMETRICSSERVER_MAX_CLIENTS 16
+
+/**
+ * Listens on a Unix socket, and writes the current values of all metrics in the
+ * Prometheus text exposition format to each accepted connection before closing it,
+ * e.g. for "socat - UNIX-CONNECT:path" or a scraping proxy.
+ */
+typedef struct {
+    BReactor *reactor;
+    BListener listener;
+    LinkedList1 clients_list;
+    int num_clients;
+    DebugObject d_obj;
+} BMetricsServer;
+
+/**
+ * Initializes the server.
+ * {@link BNetwork_GlobalInit} must have been done.
+ * 
+ * @param o the object
+ * @param socket_path path of the Unix socket. An existing file there is removed.
+ * @param reactor reactor we live in
+ * @return 1 on success, 0 on failure
+ */
+int BMetricsServer_Init (BMetricsServer *o, const char *socket_path, BReactor *reactor) WARN_UNUSED;
+
+/**
+ * Frees the server, closing any connections being served.
+ * 
+ * @param o the object
+ */
+void BMetricsServer_Free (BMetricsServer *o);
+
+#endif
@@ -49,6 +49,10 @@
 
 #include <system/BReactor.h>
 
+#ifdef BREACTOR_HAVE_IO_URING
+#include <poll.h>
+#endif
+
 #include <generated/blog_channel_BReactor.h>
 
 #define KEVENT_TAG_FD 1
@@ -77,8 +81,330 @@ static void assert_timer (BSmallTimer *bt)
            bt->state == TIMER_STATE_EXPIRED)
 }
 
+#define WHEEL_LEVEL0_SLOTS (1 << BREACTOR_WHEEL_LEVEL0_BITS)
+#define WHEEL_LEVEL_SLOTS (1 << BREACTOR_WHEEL_LEVEL_BITS)
+#define WHEEL_MAX_DELTA (((uint64_t)1 << (BREACTOR_WHEEL_LEVEL0_BITS + (BREACTOR_WHEEL_NUM_LEVELS - 1) * BREACTOR_WHEEL_LEVEL_BITS)) - 1)
+#define WHEEL_SLOT_OVERDUE BREACTOR_WHEEL_NUM_SLOTS
+
+static int level_shift (int level)
+{
+    ASSERT(level >= 1)
+    ASSERT(level < BREACTOR_WHEEL_NUM_LEVELS)
+    
+    return BREACTOR_WHEEL_LEVEL0_BITS + (level - 1) * BREACTOR_WHEEL_LEVEL_BITS;
+}
+
+static int level_first_slot (int level)
+{
+    ASSERT(level >= 1)
+    ASSERT(level < BREACTOR_WHEEL_NUM_LEVELS)
+    
+    return WHEEL_LEVEL0_SLOTS + (level - 1) * WHEEL_LEVEL_SLOTS;
+}
+
+static int find_first_bit (uint64_t word)
+{
+    ASSERT(word != 0)
+    
+    #ifdef __GNUC__
+    return __builtin_ctzll(word);
+    #else
+    int bit = 0;
+    while (!(word & 1)) {
+        word >>= 1;
+        bit++;
+    }
+    return bit;
+    #endif
+}
+
+// Returns the first nonempty slot in [from, to), where the range must not
+// cross a 64-slot boundary except at its end, or -1.
+static int wheel_find_slot (BReactor__TimerWheel *w, int from, int to)
+{
+    while (from < to) {
+        int bit = from % 64;
+        uint64_t word = w->bitmap[from / 64] & (UINT64_MAX << bit);
+        int end = from - bit + 64;
+        if (to < end) {
+            word &= UINT64_MAX >> (end - to);
+        }
+        if (word) {
+            return from - bit + find_first_bit(word);
+        }
+        from = end;
+    }
+    
+    return -1;
+}
+
+static void wheel_place (BReactor__TimerWheel *w, BSmallTimer *bt)
+{
+    int slot;
+    
+    if (bt->absTime < w->time) {
+        slot = WHEEL_SLOT_OVERDUE;
+        LinkedList1_Append(&w->overdue_list, &bt->u.list_node);
+    } else {
+        uint64_t delta = (uint64_t)bt->absTime - (uint64_t)w->time;
+        uint64_t time = bt->absTime;
+        
+        if (delta < WHEEL_LEVEL0_SLOTS) {
+            slot = time % WHEEL_LEVEL0_SLOTS;
+        } else {
+            // too far away, file it under the furthest time we can
+            if (delta > WHEEL_MAX_DELTA) {
+                delta = WHEEL_MAX_DELTA;
+                time = (uint64_t)w->time + WHEEL_MAX_DELTA;
+            }
+            
+            int level = 1;
+            while (delta >> (level_shift(level) + BREACTOR_WHEEL_LEVEL_BITS)) {
+                level++;
+            }
+            
+            slot = level_first_slot(level) + ((time >> level_shift(level)) % WHEEL_LEVEL_SLOTS);
+        }
+        
+        LinkedList1_Append(&w->slots[slot], &bt->u.list_node);
+        w->bitmap[slot / 64] |= (uint64_t)1 << (slot % 64);
+    }
+    
+    bt->wheel_slot = slot;
+}
+
+static void wheel_cascade (BReactor__TimerWheel *w, int slot)
+{
+    // detach the slot's timers
+    LinkedList1 list = w->slots[slot];
+    LinkedList1_Init(&w->slots[slot]);
+    w->bitmap[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+    
+    // put them into lower levels
+    LinkedList1Node *node = LinkedList1_GetFirst(&list);
+    while (node) {
+        LinkedList1Node *next = LinkedList1Node_Next(node);
+        BSmallTimer *bt = UPPER_OBJECT(node, BSmallTimer, u.list_node);
+        ASSERT(bt->state == TIMER_STATE_RUNNING)
+        ASSERT(bt->absTime >= w->time)
+        wheel_place(w, bt);
+        node = next;
+    }
+}
+
+static void wheel_set_time (BReactor__TimerWheel *w, btime_t time)
+{
+    ASSERT(time >= w->time)
+    
+    w->time = time;
+    
+    // entering a new rotation of the first level; move timers down from
+    // the slots which start here
+    for (int level = 1; level < BREACTOR_WHEEL_NUM_LEVELS; level++) {
+        if (((uint64_t)time & ((1 << level_shift(level)) - 1))) {
+            break;
+        }
+        int index = ((uint64_t)time >> level_shift(level)) % WHEEL_LEVEL_SLOTS;
+        wheel_cascade(w, level_first_slot(level) + index);
+    }
+}
+
+static void wheel_init (BReactor__TimerWheel *w, btime_t now)
+{
+    w->time = now;
+    w->count = 0;
+    memset(w->bitmap, 0, sizeof(w->bitmap));
+    for (int i = 0; i < BREACTOR_WHEEL_NUM_SLOTS; i++) {
+        LinkedList1_Init(&w->slots[i]);
+    }
+    LinkedList1_Init(&w->overdue_list);
+}
+
+static void wheel_insert (BReactor__TimerWheel *w, BSmallTimer *bt)
+{
+    wheel_place(w, bt);
+    w->count++;
+}
+
+static void wheel_remove (BReactor__TimerWheel *w, BSmallTimer *bt)
+{
+    ASSERT(w->count > 0)
+    
+    int slot = bt->wheel_slot;
+    
+    if (slot == WHEEL_SLOT_OVERDUE) {
+        LinkedList1_Remove(&w->overdue_list, &bt->u.list_node);
+    } else {
+        LinkedList1_Remove(&w->slots[slot], &bt->u.list_node);
+        if (LinkedList1_IsEmpty(&w->slots[slot])) {
+            w->bitmap[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+        }
+    }
+    
+    w->count--;
+}
+
+// Returns a time not later than that of the first running timer. It is
+// exact if the timer is in the current rotation of the first level;
+// otherwise it is when the timer's slot will be moved down.
+static btime_t wheel_next_time (BReactor__TimerWheel *w)
+{
+    ASSERT(w->count > 0)
+    ASSERT(LinkedList1_IsEmpty(&w->overdue_list))
+    
+    int index = (uint64_t)w->time % WHEEL_LEVEL0_SLOTS;
+    btime_t base = w->time - index;
+    
+    // first level, current rotation
+    int slot = wheel_find_slot(w, index, WHEEL_LEVEL0_SLOTS);
+    if (slot >= 0) {
+        return base + slot;
+    }
+    
+    btime_t next = INT64_MAX;
+    
+    // first level, next rotation
+    slot = wheel_find_slot(w, 0, index);
+    if (slot >= 0) {
+        next = base + WHEEL_LEVEL0_SLOTS + slot;
+    }
+    
+    // higher levels: the start of the first nonempty slot after the current one
+    for (int level = 1; level < BREACTOR_WHEEL_NUM_LEVELS; level++) {
+        int first = level_first_slot(level);
+        int shift = level_shift(level);
+        int cur = ((uint64_t)w->time >> shift) % WHEEL_LEVEL_SLOTS;
+        
+        slot = wheel_find_slot(w, first + cur + 1, first + WHEEL_LEVEL_SLOTS);
+        if (slot < 0) {
+            slot = wheel_find_slot(w, first, first + cur + 1);
+        }
+        if (slot < 0) {
+            continue;
+        }
+        
+        int dist = (slot - first - cur + WHEEL_LEVEL_SLOTS - 1) % WHEEL_LEVEL_SLOTS + 1;
+        btime_t start = (btime_t)((((uint64_t)w->time >> shift) + dist) << shift);
+        if (start < next) {
+            next = start;
+        }
+    }
+    
+    ASSERT(next != INT64_MAX)
+    ASSERT(next >= w->time)
+    
+    return next;
+}
+
+static int wheel_move_expired (BReactor *bsys, btime_t now)
+{
+    BReactor__TimerWheel *w = &bsys->timers_wheel;
+    int moved = 0;
+    
+    // timers set to expire in the past
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&w->overdue_list)) {
+        BSmallTimer *bt = UPPER_OBJECT(node, BSmallTimer, u.list_node);
+        ASSERT(bt->state == TIMER_STATE_RUNNING)
+        LinkedList1_Remove(&w->overdue_list, &bt->u.list_node);
+        w->count--;
+        LinkedList1_Append(&bsys->timers_expired_list, &bt->u.list_node);
+        bt->state = TIMER_STATE_EXPIRED;
+        moved = 1;
+    }
+    
+    while (w->time <= now) {
+        if (w->count == 0) {
+            wheel_set_time(w, now + 1);
+            break;
+        }
+        
+        int index = (uint64_t)w->time % WHEEL_LEVEL0_SLOTS;
+        int slot = wheel_find_slot(w, index, WHEEL_LEVEL0_SLOTS);
+        
+        if (slot < 0) {
+            // nothing until the next slot moves down; skip there
+            btime_t next = wheel_next_time(w);
+            wheel_set_time(w, (next <= now ? next : now + 1));
+            continue;
+        }
+        
+        btime_t time = w->time - index + slot;
+        if (time > now) {
+            wheel_set_time(w, now + 1);
+            break;
+        }
+        
+        // expire the whole slot
+        while (node = LinkedList1_GetFirst(&w->slots[slot])) {
+            BSmallTimer *bt = UPPER_OBJECT(node, BSmallTimer, u.list_node);
+            ASSERT(bt->state == TIMER_STATE_RUNNING)
+            ASSERT(bt->absTime <= time)
+            LinkedList1_Remove(&w->slots[slot], &bt->u.list_node);
+            w->count--;
+            LinkedList1_Append(&bsys->timers_expired_list, &bt->u.list_node);
+            bt->state = TIMER_STATE_EXPIRED;
+        }
+        w->bitmap[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+        moved = 1;
+        
+        wheel_set_time(w, time + 1);
+    }
+    
+    return moved;
+}
+
+static int timers_want_wheel (void)
+{
+    const char *str = getenv("BADVPN_REACTOR_TIMERS");
+    if (!str) {
+        #ifdef BADVPN_REACTOR_TIMER_WHEEL_DEFAULT
+        return 1;
+        #else
+        return 0;
+        #endif
+    }
+    
+    if (!strcmp(str, "wheel")) {
+        return 1;
+    }
+    
+    if (strcmp(str, "tree")) {
+        BLog(BLOG_WARNING, "unknown BADVPN_REACTOR_TIMERS value %s, using tree", str);
+    }
+    
+    return 0;
+}
+
+static int have_running_timers (BReactor *bsys)
+{
+    if (bsys->timers_use_wheel) {
+        return bsys->timers_wheel.count > 0;
+    }
+    
+    return !BReactor__TimersTree_IsEmpty(&bsys->timers_tree);
+}
+
+static btime_t first_timer_time (BReactor *bsys)
+{
+    ASSERT(have_running_timers(bsys))
+    
+    if (bsys->timers_use_wheel) {
+        return wheel_next_time(&bsys->timers_wheel);
+    }
+    
+    BSmallTimer *first_timer = BReactor__TimersTree_GetFirst(&bsys->timers_tree, 0).link;
+    ASSERT(first_timer->state == TIMER_STATE_RUNNING)
+    
+    return first_timer->absTime;
+}
+
 static int move_expired_timers (BReactor *bsys, btime_t now)
 {
+    if (bsys->timers_use_wheel) {
+        return wheel_move_expired(bsys, now);
+    }
+    
     int moved = 0;
     
     // move timed out timers to the expired list
@@ -106,15 +432,22 @@ static int move_expired_timers (BReactor *bsys, btime_t now)
     return moved;
 }
 
-static void move_first_timers (BReactor *bsys)
+static void move_first_timers (BReactor *bsys, btime_t first_time)
 {
+    if (bsys->timers_use_wheel) {
+        // the wait time may have been just when a slot moves down,
+        // in which case nothing expires
+        wheel_move_expired(bsys, first_time);
+        return;
+    }
+    
     BReactor__TimersTreeRef ref;
     
     // get the time of the first timer
     BSmallTimer *first_timer = (ref = BReactor__TimersTree_GetFirst(&bsys->timers_tree, 0)).link;
     ASSERT(first_timer)
     ASSERT(first_timer->state == TIMER_STATE_RUNNING)
-    btime_t first_time = first_timer->absTime;
+    ASSERT(first_timer->absTime == first_time)
     
     // remove from running timers tree
     BReactor__TimersTree_Remove(&bsys->timers_tree, 0, ref);
@@ -186,6 +519,364 @@ static void set_epoll_fd_pointers (BReactor *bsys)
 
 #endif
 
+#ifdef BREACTOR_HAVE_IO_URING
+
+#define URING_SQ_ENTRIES 1024
+#define URING_CQ_ENTRIES 65536
+#define URING_INITIAL_SLOTS 64
+
+#define URING_SLOT_FREE 0
+#define URING_SLOT_ARMED 1
+#define URING_SLOT_CANCELED 2
+#define URING_SLOT_CANCEL_QUEUED 3
+#define URING_SLOT_CANCEL_QUEUED_DONE 4
+
+static int uring_wanted (void)
+{
+    const char *str = getenv("BADVPN_REACTOR");
+    if (!str) {
+        #ifdef BADVPN_REACTOR_IO_URING_DEFAULT
+        return 1;
+        #else
+        return 0;
+        #endif
+    }
+    
+    if (!strcmp(str, "io_uring")) {
+        return 1;
+    }
+    
+    if (strcmp(str, "epoll")) {
+        BLog(BLOG_WARNING, "unknown BADVPN_REACTOR value %s, using epoll", str);
+    }
+    
+    return 0;
+}
+
+static int uring_init (BReactor *bsys)
+{
+    // init ring
+    if (!BIoUring_Init2(&bsys->uring, URING_SQ_ENTRIES, URING_CQ_ENTRIES)) {
+        BLog(BLOG_ERROR, "BIoUring_Init2 failed");
+        goto fail0;
+    }
+    
+    // we need to wait for completions with a timeout
+    if (!(BIoUring_GetFeatures(&bsys->uring) & IORING_FEAT_EXT_ARG)) {
+        BLog(BLOG_ERROR, "io_uring does not support waiting with a timeout");
+        goto fail1;
+    }
+    
+    // allocate slots
+    bsys->uring_num_slots = URING_INITIAL_SLOTS;
+    if (!(bsys->uring_slots = BAllocArray(bsys->uring_num_slots, sizeof(bsys->uring_slots[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail1;
+    }
+    
+    // put all slots on the free list
+    for (int i = 0; i < bsys->uring_num_slots; i++) {
+        bsys->uring_slots[i].state = URING_SLOT_FREE;
+        bsys->uring_slots[i].next = (i + 1 < bsys->uring_num_slots ? i + 1 : -1);
+    }
+    bsys->uring_free_slot = 0;
+    
+    // init cancel list
+    bsys->uring_cancel_slot = -1;
+    
+    // init arm list
+    LinkedList1_Init(&bsys->uring_arm_list);
+    
+    return 1;
+    
+fail1:
+    BIoUring_Free(&bsys->uring);
+fail0:
+    return 0;
+}
+
+static void uring_free (BReactor *bsys)
+{
+    ASSERT(LinkedList1_IsEmpty(&bsys->uring_arm_list))
+    
+    // free slots
+    BFree(bsys->uring_slots);
+    
+    // free ring, canceling remaining poll requests
+    BIoUring_Free(&bsys->uring);
+}
+
+static int uring_alloc_slot (BReactor *bsys)
+{
+    if (bsys->uring_free_slot < 0) {
+        // double the slots array
+        int old_num = bsys->uring_num_slots;
+        if (old_num > INT_MAX / 2) {
+            return -1;
+        }
+        struct BReactor__uring_slot *new_slots = BReallocArray(bsys->uring_slots, 2 * old_num, sizeof(new_slots[0]));
+        if (!new_slots) {
+            return -1;
+        }
+        bsys->uring_slots = new_slots;
+        bsys->uring_num_slots = 2 * old_num;
+        
+        // put new slots on the free list
+        for (int i = old_num; i < bsys->uring_num_slots; i++) {
+            bsys->uring_slots[i].state = URING_SLOT_FREE;
+            bsys->uring_slots[i].next = (i + 1 < bsys->uring_num_slots ? i + 1 : -1);
+        }
+        bsys->uring_free_slot = old_num;
+    }
+    
+    int slot = bsys->uring_free_slot;
+    ASSERT(bsys->uring_slots[slot].state == URING_SLOT_FREE)
+    bsys->uring_free_slot = bsys->uring_slots[slot].next;
+    
+    return slot;
+}
+
+static void uring_release_slot (BReactor *bsys, int slot)
+{
+    bsys->uring_slots[slot].state = URING_SLOT_FREE;
+    bsys->uring_slots[slot].next = bsys->uring_free_slot;
+    bsys->uring_free_slot = slot;
+}
+
+static struct io_uring_sqe * uring_get_sqe (BReactor *bsys)
+{
+    struct io_uring_sqe *sqe = BIoUring_GetSqe(&bsys->uring);
+    if (!sqe) {
+        // the submission queue may just be full; hand it to the kernel
+        ASSERT_FORCE(BIoUring_Submit(&bsys->uring, 0))
+        sqe = BIoUring_GetSqe(&bsys->uring);
+    }
+    
+    return sqe;
+}
+
+static int uring_queue_remove (BReactor *bsys, int slot)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(bsys);
+    if (!sqe) {
+        return 0;
+    }
+    
+    // the completion of the removal itself is ignored (user_data 0);
+    // the slot is released when the poll request completes
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)slot + 1;
+    sqe->user_data = 0;
+    
+    return 1;
+}
+
+static void uring_cancel (BReactor *bsys, BFileDescriptor *bs)
+{
+    ASSERT(bs->uring_slot >= 0)
+    
+    int slot = bs->uring_slot;
+    struct BReactor__uring_slot *s = &bsys->uring_slots[slot];
+    ASSERT(s->state == URING_SLOT_ARMED)
+    ASSERT(s->bfd == bs)
+    
+    bs->uring_slot = -1;
+    
+    if (uring_queue_remove(bsys, slot)) {
+        s->state = URING_SLOT_CANCELED;
+    } else {
+        // too many requests in flight; retry before the next wait
+        s->state = URING_SLOT_CANCEL_QUEUED;
+        s->next = bsys->uring_cancel_slot;
+        bsys->uring_cancel_slot = slot;
+    }
+}
+
+static void uring_request_arm (BReactor *bsys, BFileDescriptor *bs)
+{
+    if (!bs->uring_on_arm_list) {
+        LinkedList1_Append(&bsys->uring_arm_list, &bs->uring_arm_list_node);
+        bs->uring_on_arm_list = 1;
+    }
+}
+
+static int uring_submit_poll (BReactor *bsys, BFileDescriptor *bs, int events)
+{
+    ASSERT(bs->uring_slot < 0)
+    
+    int slot = uring_alloc_slot(bsys);
+    if (slot < 0) {
+        BLog(BLOG_ERROR, "failed to allocate poll slot");
+        return 0;
+    }
+    
+    struct io_uring_sqe *sqe = uring_get_sqe(bsys);
+    if (!sqe) {
+        uring_release_slot(bsys, slot);
+        return 0;
+    }
+    
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = bs->fd;
+    sqe->poll32_events = events;
+    sqe->user_data = (uint64_t)slot + 1;
+    
+    bsys->uring_slots[slot].state = URING_SLOT_ARMED;
+    bsys->uring_slots[slot].bfd = bs;
+    bs->uring_slot = slot;
+    bs->uring_armed_events = events;
+    
+    return 1;
+}
+
+static void uring_arm (BReactor *bsys)
+{
+    // queue removals which didn't fit before
+    while (bsys->uring_cancel_slot >= 0) {
+        int slot = bsys->uring_cancel_slot;
+        struct BReactor__uring_slot *s = &bsys->uring_slots[slot];
+        ASSERT(s->state == URING_SLOT_CANCEL_QUEUED || s->state == URING_SLOT_CANCEL_QUEUED_DONE)
+        
+        if (s->state == URING_SLOT_CANCEL_QUEUED) {
+            if (!uring_queue_remove(bsys, slot)) {
+                break;
+            }
+            bsys->uring_cancel_slot = s->next;
+            s->state = URING_SLOT_CANCELED;
+        } else {
+            // poll request has completed in the meantime
+            bsys->uring_cancel_slot = s->next;
+            uring_release_slot(bsys, slot);
+        }
+    }
+    
+    // (re)arm poll requests
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&bsys->uring_arm_list)) {
+        BFileDescriptor *bs = UPPER_OBJECT(node, BFileDescriptor, uring_arm_list_node);
+        ASSERT(bs->active)
+        ASSERT(bs->uring_on_arm_list)
+        
+        // calculate poll events; errors and hang-ups are always reported,
+        // just like with epoll
+        int events = 0;
+        if ((bs->waitEvents & BREACTOR_READ)) {
+            events |= POLLIN;
+        }
+        if ((bs->waitEvents & BREACTOR_WRITE)) {
+            events |= POLLOUT;
+        }
+        
+        if (bs->uring_slot >= 0) {
+            // Keep a request which covers all the events we need. If it
+            // completes with events we no longer want, it is rearmed with
+            // the right events then, which is cheaper than canceling now.
+            if (!(events & ~bs->uring_armed_events)) {
+                LinkedList1_Remove(&bsys->uring_arm_list, &bs->uring_arm_list_node);
+                bs->uring_on_arm_list = 0;
+                continue;
+            }
+            uring_cancel(bsys, bs);
+        }
+        
+        if (!uring_submit_poll(bsys, bs, events)) {
+            // leave it and the rest on the list for the next time
+            BLog(BLOG_WARNING, "cannot submit poll request now");
+            break;
+        }
+        
+        LinkedList1_Remove(&bsys->uring_arm_list, &bs->uring_arm_list_node);
+        bs->uring_on_arm_list = 0;
+    }
+}
+
+static void uring_reap (BReactor *bsys)
+{
+    ASSERT(bsys->epoll_results_num == 0)
+    
+    struct io_uring_cqe *cqe;
+    while (bsys->epoll_results_num < BSYSTEM_MAX_RESULTS && (cqe = BIoUring_PeekCqe(&bsys->uring))) {
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        BIoUring_SeenCqe(&bsys->uring);
+        
+        // ignore completions of removals
+        if (user_data == 0) {
+            continue;
+        }
+        
+        ASSERT(user_data <= bsys->uring_num_slots)
+        int slot = user_data - 1;
+        struct BReactor__uring_slot *s = &bsys->uring_slots[slot];
+        
+        switch (s->state) {
+            case URING_SLOT_ARMED: {
+                BFileDescriptor *bfd = s->bfd;
+                ASSERT(bfd->active)
+                ASSERT(bfd->uring_slot == slot)
+                
+                uring_release_slot(bsys, slot);
+                bfd->uring_slot = -1;
+                
+                // poll requests are one-shot; rearm before waiting again
+                uring_request_arm(bsys, bfd);
+                
+                // convert to epoll events so the epoll dispatch code can be used
+                uint32_t events = 0;
+                if (res < 0) {
+                    BLog(BLOG_ERROR, "poll request failed (%d)", -res);
+                    events = EPOLLERR;
+                } else {
+                    if ((res & POLLIN)) {
+                        events |= EPOLLIN;
+                    }
+                    if ((res & POLLOUT)) {
+                        events |= EPOLLOUT;
+                    }
+                    if ((res & (POLLERR|POLLNVAL))) {
+                        events |= EPOLLERR;
+                    }
+                    if ((res & POLLHUP)) {
+                        events |= EPOLLHUP;
+                    }
+                }
+                
+                // drop events from an outdated request; it's been rearmed
+                int wanted = EPOLLERR|EPOLLHUP;
+                if ((bfd->waitEvents & BREACTOR_READ)) {
+                    wanted |= EPOLLIN;
+                }
+                if ((bfd->waitEvents & BREACTOR_WRITE)) {
+                    wanted |= EPOLLOUT;
+                }
+                if (!(events & wanted)) {
+                    continue;
+                }
+                
+                struct epoll_event *event = &bsys->epoll_results[bsys->epoll_results_num];
+                event->events = events;
+                event->data.ptr = bfd;
+                bsys->epoll_results_num++;
+            } break;
+            
+            case URING_SLOT_CANCELED: {
+                uring_release_slot(bsys, slot);
+            } break;
+            
+            case URING_SLOT_CANCEL_QUEUED: {
+                // still on the cancel list, release it from there
+                s->state = URING_SLOT_CANCEL_QUEUED_DONE;
+            } break;
+            
+            default:
+                ASSERT(0)
+        }
+    }
+}
+
+#endif
+
 #ifdef BADVPN_USE_KEVENT
 
 static void set_kevent_fd_pointers (BReactor *bsys)
@@ -210,7 +901,7 @@ static void set_kevent_fd_pointers (BReactor *bsys)
             } break;
             
             default:
-                ASSERT(0);
+                ASSERT(0)
         }
     }
 }
@@ -307,14 +998,11 @@ static void wait_for_events (BReactor *bsys)
     
     // timeout vars
     int have_timeout = 0;
-    btime_t timeout_abs;
+    btime_t timeout_abs = 0; // to remove warning
     btime_t now = 0; // to remove warning
     
     // compute timeout
-    BSmallTimer *first_timer = BReactor__TimersTree_GetFirst(&bsys->timers_tree, 0).link;
-    if (first_timer) {
-        ASSERT(first_timer->state == TIMER_STATE_RUNNING)
-        
+    if (have_running_timers(bsys)) {
         // get current time
         now = btime_gettime();
         
@@ -326,7 +1014,7 @@ static void wait_for_events (BReactor *bsys)
         
         // timeout is first timer, remember absolute time
         have_timeout = 1;
-        timeout_abs = first_timer->absTime;
+        timeout_abs = first_timer_time(bsys);
     }
     
     // wait until the timeout is reached or the file descriptor / handle in ready
@@ -367,7 +1055,7 @@ static void wait_for_events (BReactor *bsys)
                 set_iocp_ready(olap, (res == TRUE), bytes);
             } else {
                 BLog(BLOG_DEBUG, "GetQueuedCompletionStatus timed out");
-                move_first_timers(bsys);
+                move_first_timers(bsys, timeout_abs);
             }
             break;
         }
@@ -376,6 +1064,38 @@ static void wait_for_events (BReactor *bsys)
         
         #ifdef BADVPN_USE_EPOLL
         
+        #ifdef BREACTOR_HAVE_IO_URING
+        if (bsys->uring_enabled) {
+            // submit new and changed poll requests
+            uring_arm(bsys);
+            
+            BLog(BLOG_DEBUG, "Calling io_uring_enter");
+            
+            // don't block if there are completions left over from last time
+            int ok;
+            if (BIoUring_PeekCqe(&bsys->uring)) {
+                ok = BIoUring_Submit(&bsys->uring, 0);
+            } else if (have_timeout) {
+                ok = BIoUring_SubmitWaitTimeout(&bsys->uring, timeout_rel);
+            } else {
+                ok = BIoUring_Submit(&bsys->uring, 1);
+            }
+            ASSERT_FORCE(ok)
+            
+            // collect completions
+            uring_reap(bsys);
+            
+            if (bsys->epoll_results_num > 0) {
+                BLog(BLOG_DEBUG, "io_uring returned %d file descriptors", bsys->epoll_results_num);
+                set_epoll_fd_pointers(bsys);
+                break;
+            }
+            
+            // only timeouts or removals completed; check timers
+            goto try_again;
+        }
+        #endif
+        
         if (have_timeout) {
             if (timeout_rel_trunc > INT_MAX) {
                 timeout_rel_trunc = INT_MAX;
@@ -405,7 +1125,7 @@ static void wait_for_events (BReactor *bsys)
                 set_epoll_fd_pointers(bsys);
             } else {
                 BLog(BLOG_DEBUG, "epoll_wait timed out");
-                move_first_timers(bsys);
+                move_first_timers(bsys, timeout_abs);
             }
             break;
         }
@@ -446,7 +1166,7 @@ static void wait_for_events (BReactor *bsys)
                 set_kevent_fd_pointers(bsys);
             } else {
                 BLog(BLOG_DEBUG, "kevent timed out");
-                move_first_timers(bsys);
+                move_first_timers(bsys, timeout_abs);
             }
             break;
         }
@@ -518,7 +1238,7 @@ static void wait_for_events (BReactor *bsys)
                 set_poll_fd_pointers(bsys);
             } else {
                 BLog(BLOG_DEBUG, "poll timed out");
-                move_first_timers(bsys);
+                move_first_timers(bsys, timeout_abs);
             }
             break;
         }
@@ -532,7 +1252,7 @@ static void wait_for_events (BReactor *bsys)
             // check if we already reached the time we're waiting for
             if (now >= timeout_abs) {
                 BLog(BLOG_DEBUG, "already timed out while trying again");
-                move_first_timers(bsys);
+                move_first_timers(bsys, timeout_abs);
                 break;
             }
         }
@@ -599,7 +1319,9 @@ int BReactor_Init (BReactor *bsys)
     BPendingGroup_Init(&bsys->pending_jobs);
     
     // init timers
+    bsys->timers_use_wheel = timers_want_wheel();
     BReactor__TimersTree_Init(&bsys->timers_tree);
+    wheel_init(&bsys->timers_wheel, btime_gettime());
     LinkedList1_Init(&bsys->timers_expired_list);
     
     // init limits
@@ -623,10 +1345,26 @@ int BReactor_Init (BReactor *bsys)
     
     #ifdef BADVPN_USE_EPOLL
     
-    // create epoll fd
-    if ((bsys->efd = epoll_create(10)) < 0) {
-        BLog(BLOG_ERROR, "epoll_create failed");
-        goto fail0;
+    #ifdef BREACTOR_HAVE_IO_URING
+    // try io_uring if requested
+    bsys->uring_enabled = 0;
+    if (uring_wanted()) {
+        if (uring_init(bsys)) {
+            BLog(BLOG_INFO, "using io_uring");
+            bsys->uring_enabled = 1;
+        } else {
+            BLog(BLOG_WARNING, "io_uring not usable, falling back to epoll");
+        }
+    }
+    
+    if (!bsys->uring_enabled)
+    #endif
+    {
+        // create epoll fd
+        if ((bsys->efd = epoll_create(10)) < 0) {
+            BLog(BLOG_ERROR, "epoll_create failed");
+            goto fail0;
+        }
     }
     
     // init results array
@@ -708,7 +1446,7 @@ void BReactor_Free (BReactor *bsys)
     
     // {pending group has no BPending objects}
     ASSERT(!BPendingGroup_HasJobs(&bsys->pending_jobs))
-    ASSERT(BReactor__TimersTree_IsEmpty(&bsys->timers_tree))
+    ASSERT(!have_running_timers(bsys))
     ASSERT(LinkedList1_IsEmpty(&bsys->timers_expired_list))
     ASSERT(LinkedList1_IsEmpty(&bsys->active_limits_list))
     DebugObject_Free(&bsys->d_obj);
@@ -739,8 +1477,16 @@ void BReactor_Free (BReactor *bsys)
     
     #ifdef BADVPN_USE_EPOLL
     
-    // close epoll fd
-    ASSERT_FORCE(close(bsys->efd) == 0)
+    #ifdef BREACTOR_HAVE_IO_URING
+    if (bsys->uring_enabled) {
+        // free io_uring
+        uring_free(bsys);
+    } else
+    #endif
+    {
+        // close epoll fd
+        ASSERT_FORCE(close(bsys->efd) == 0)
+    }
     
     #endif
     
@@ -1011,10 +1757,14 @@ void BReactor_SetSmallTimer (BReactor *bsys, BSmallTimer *bt, int mode, btime_t
     // set running
     bt->state = TIMER_STATE_RUNNING;
     
-    // insert to running timers tree
-    BReactor__TimersTreeRef ref = {bt, bt};
-    int res = BReactor__TimersTree_Insert(&bsys->timers_tree, 0, ref, NULL);
-    ASSERT_EXECUTE(res)
+    // insert to running timers
+    if (bsys->timers_use_wheel) {
+        wheel_insert(&bsys->timers_wheel, bt);
+    } else {
+        BReactor__TimersTreeRef ref = {bt, bt};
+        int res = BReactor__TimersTree_Insert(&bsys->timers_tree, 0, ref, NULL);
+        ASSERT_EXECUTE(res)
+    }
 }
 
 void BReactor_RemoveSmallTimer (BReactor *bsys, BSmallTimer *bt)
@@ -1028,6 +1778,9 @@ void BReactor_RemoveSmallTimer (BReactor *bsys, BSmallTimer *bt)
     if (bt->state == TIMER_STATE_EXPIRED) {
         // remove from expired list
         LinkedList1_Remove(&bsys->timers_expired_list, &bt->u.list_node);
+    } else if (bsys->timers_use_wheel) {
+        // remove from timer wheel
+        wheel_remove(&bsys->timers_wheel, bt);
     } else {
         // remove from running tree
         BReactor__TimersTreeRef ref = {bt, bt};
@@ -1088,15 +1841,25 @@ int BReactor_AddFileDescriptor (BReactor *bsys, BFileDescriptor *bs)
     
     #ifdef BADVPN_USE_EPOLL
     
-    // add epoll entry
-    struct epoll_event event;
-    memset(&event, 0, sizeof(event));
-    event.events = 0;
-    event.data.ptr = bs;
-    if (epoll_ctl(bsys->efd, EPOLL_CTL_ADD, bs->fd, &event) < 0) {
-        int error = errno;
-        BLog(BLOG_ERROR, "epoll_ctl failed: %d", error);
-        return 0;
+    #ifdef BREACTOR_HAVE_IO_URING
+    if (bsys->uring_enabled) {
+        // poll request will be submitted before waiting
+        bs->uring_slot = -1;
+        bs->uring_on_arm_list = 0;
+        uring_request_arm(bsys, bs);
+    } else
+    #endif
+    {
+        // add epoll entry
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = 0;
+        event.data.ptr = bs;
+        if (epoll_ctl(bsys->efd, EPOLL_CTL_ADD, bs->fd, &event) < 0) {
+            int error = errno;
+            BLog(BLOG_ERROR, "epoll_ctl failed: %d", error);
+            return 0;
+        }
     }
     
     // set epoll returned pointer
@@ -1146,10 +1909,25 @@ void BReactor_RemoveFileDescriptor (BReactor *bsys, BFileDescriptor *bs)
 
     #ifdef BADVPN_USE_EPOLL
     
-    // delete epoll entry
-    struct epoll_event event;
-    memset(&event, 0, sizeof(event));
-    ASSERT_FORCE(epoll_ctl(bsys->efd, EPOLL_CTL_DEL, bs->fd, &event) == 0)
+    #ifdef BREACTOR_HAVE_IO_URING
+    if (bsys->uring_enabled) {
+        // cancel poll request
+        if (bs->uring_slot >= 0) {
+            uring_cancel(bsys, bs);
+        }
+        
+        // remove from arm list
+        if (bs->uring_on_arm_list) {
+            LinkedList1_Remove(&bsys->uring_arm_list, &bs->uring_arm_list_node);
+        }
+    } else
+    #endif
+    {
+        // delete epoll entry
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        ASSERT_FORCE(epoll_ctl(bsys->efd, EPOLL_CTL_DEL, bs->fd, &event) == 0)
+    }
     
     // write through epoll returned pointer
     if (bs->epoll_returned_ptr) {
@@ -1199,22 +1977,30 @@ void BReactor_SetFileDescriptorEvents (BReactor *bsys, BFileDescriptor *bs, int
     
     #ifdef BADVPN_USE_EPOLL
     
-    // calculate epoll events
-    int eevents = 0;
-    if ((events & BREACTOR_READ)) {
-        eevents |= EPOLLIN;
-    }
-    if ((events & BREACTOR_WRITE)) {
-        eevents |= EPOLLOUT;
+    #ifdef BREACTOR_HAVE_IO_URING
+    if (bsys->uring_enabled) {
+        // poll request will be updated before waiting
+        uring_request_arm(bsys, bs);
+    } else
+    #endif
+    {
+        // calculate epoll events
+        int eevents = 0;
+        if ((events & BREACTOR_READ)) {
+            eevents |= EPOLLIN;
+        }
+        if ((events & BREACTOR_WRITE)) {
+            eevents |= EPOLLOUT;
+        }
+        
+        // update epoll entry
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = eevents;
+        event.data.ptr = bs;
+        ASSERT_FORCE(epoll_ctl(bsys->efd, EPOLL_CTL_MOD, bs->fd, &event) == 0)
     }
     
-    // update epoll entry
-    struct epoll_event event;
-    memset(&event, 0, sizeof(event));
-    event.events = eevents;
-    event.data.ptr = bs;
-    ASSERT_FORCE(epoll_ctl(bsys->efd, EPOLL_CTL_MOD, bs->fd, &event) == 0)
-    
     #endif
     
     #ifdef BADVPN_USE_KEVENT
@@ -47,6 +47,11 @@
 #include <sys/epoll.h>
 #endif
 
+#if defined(BADVPN_USE_EPOLL) && defined(BADVPN_USE_IO_URING)
+#define BREACTOR_HAVE_IO_URING
+#include <system/BIoUring.h>
+#endif
+
 #ifdef BADVPN_USE_KEVENT
 #include <sys/types.h>
 #include <sys/event.h>
@@ -116,6 +121,7 @@ typedef struct BSmallTimer_t {
     int8_t tree_balance;
     uint8_t state;
     uint8_t is_small;
+    uint16_t wheel_slot;
 } BSmallTimer;
 
 /**
@@ -201,6 +207,13 @@ typedef struct BFileDescriptor_t {
     struct BFileDescriptor_t **epoll_returned_ptr;
     #endif
     
+    #ifdef BREACTOR_HAVE_IO_URING
+    int uring_slot;
+    int uring_armed_events;
+    int uring_on_arm_list;
+    LinkedList1Node uring_arm_list_node;
+    #endif
+    
     #ifdef BADVPN_USE_KEVENT
     int kevent_tag;
     int **kevent_returned_ptr;
@@ -231,6 +244,31 @@ void BFileDescriptor_Init (BFileDescriptor *bs, int fd, BFileDescriptor_handler
 #define BSYSTEM_MAX_HANDLES 64
 #define BSYSTEM_MAX_POLL_FDS 4096
 
+// Timer wheel: the first level has one slot per millisecond, each further
+// level has slots covering a whole rotation of the level below. Timers more
+// than 2^32 ms away are kept in the last level and are moved again when
+// their slot comes up.
+#define BREACTOR_WHEEL_LEVEL0_BITS 8
+#define BREACTOR_WHEEL_LEVEL_BITS 6
+#define BREACTOR_WHEEL_NUM_LEVELS 5
+#define BREACTOR_WHEEL_NUM_SLOTS ((1 << BREACTOR_WHEEL_LEVEL0_BITS) + (BREACTOR_WHEEL_NUM_LEVELS - 1) * (1 << BREACTOR_WHEEL_LEVEL_BITS))
+
+typedef struct {
+    btime_t time; // timers expiring before this time have been expired
+    size_t count; // number of running timers
+    uint64_t bitmap[BREACTOR_WHEEL_NUM_SLOTS / 64]; // which slots are nonempty
+    LinkedList1 slots[BREACTOR_WHEEL_NUM_SLOTS];
+    LinkedList1 overdue_list; // timers set to expire before time
+} BReactor__TimerWheel;
+
+#ifdef BREACTOR_HAVE_IO_URING
+struct BReactor__uring_slot {
+    int state;
+    int next; // next slot on the free or cancel list
+    BFileDescriptor *bfd;
+};
+#endif
+
 /**
  * Event loop that supports file desciptor (Linux) or HANDLE (Windows) events
  * and timers.
@@ -243,7 +281,9 @@ typedef struct {
     BPendingGroup pending_jobs;
     
     // timers
+    int timers_use_wheel; // if set, running timers are in timers_wheel instead of timers_tree
     BReactor__TimersTree timers_tree;
+    BReactor__TimerWheel timers_wheel;
     LinkedList1 timers_expired_list;
     
     // limits
@@ -262,6 +302,16 @@ typedef struct {
     int epoll_results_pos; // number of events processed so far
     #endif
     
+    #ifdef BREACTOR_HAVE_IO_URING
+    int uring_enabled; // if set, poll requests on the ring are used instead of efd
+    BIoUring uring;
+    struct BReactor__uring_slot *uring_slots; // in-flight poll requests, indexed by user_data - 1
+    int uring_num_slots;
+    int uring_free_slot; // first slot on the free list, or -1
+    int uring_cancel_slot; // first slot whose removal could not be queued yet, or -1
+    LinkedList1 uring_arm_list; // file descriptors whose poll request may need (re)submission
+    #endif
+    
     #ifdef BADVPN_USE_KEVENT
     int kqueue_fd;
     struct kevent kevent_results[BSYSTEM_MAX_RESULTS];
@@ -292,6 +342,17 @@ typedef struct {
  * Initializes the reactor.
  * {@link BLog_Init} must have been done.
  * {@link BTime_Init} must have been done.
+ * 
+ * On Linux with io_uring support compiled in, file descriptors can be
+ * monitored with io_uring poll requests instead of epoll. This is chosen by
+ * the BADVPN_REACTOR environment variable ("io_uring" or "epoll"); if it is
+ * not set, epoll is used, unless built with BADVPN_REACTOR_IO_URING_DEFAULT.
+ * If io_uring can't be used, epoll is used instead.
+ * 
+ * Running timers are kept in a balanced tree, or, if the BADVPN_REACTOR_TIMERS
+ * environment variable is "wheel" (or the program was built with
+ * BADVPN_REACTOR_TIMER_WHEEL_DEFAULT and the variable isn't "tree"), in a
+ * hierarchical timer wheel, which starts and stops timers in constant time.
  *
  * @param bsys the object
  * @return 1 on success, 0 on failure
@@ -4,6 +4,7 @@
 #include <misc/debug.h>
 #include <base/BLog.h>
 #include <base/DebugObject.h>
+#include <system/BTime.h>
 #include <threadwork/BThreadWork.h>
 
 BReactor reactor;
@@ -48,6 +49,8 @@ static void dummy_works (int n)
 int main ()
 {
     BLog_InitStdout();
+    
+    BTime_Init();
     BLog_SetChannelLoglevel(BLOG_CHANNEL_BThreadWork, BLOG_DEBUG);
     
     if (!BReactor_Init(&reactor)) {
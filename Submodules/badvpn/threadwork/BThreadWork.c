@@ -27,6 +27,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+
 #include <stdint.h>
 #include <stddef.h>
 
@@ -34,9 +35,14 @@
     #include <unistd.h>
     #include <errno.h>
     #include <fcntl.h>
+    #include <sched.h>
+    #ifdef BADVPN_LINUX
+        #include <sys/eventfd.h>
+    #endif
 #endif
 
 #include <misc/offset.h>
+#include <misc/balloc.h>
 #include <base/BLog.h>
 
 #include <generated/blog_channel_BThreadWork.h>
@@ -45,66 +51,256 @@
 
 #ifdef BADVPN_THREADWORK_USE_PTHREAD
 
-static void * dispatcher_thread (struct BThreadWorkDispatcher_thread *t)
+#define QUEUE_MASK (BTHREADWORK_QUEUE_SIZE - 1)
+
+static void notify_event_loop (BThreadWorkDispatcher *o);
+
+static int queue_put (struct BThreadWorkDispatcher_thread *t, BThreadWork *w)
 {
-    BThreadWorkDispatcher *o = t->d;
+    // only the event loop thread puts to queues, so the position is ours
+    size_t pos = t->enqueue_pos;
+    struct BThreadWorkDispatcher_cell *cell = &t->cells[pos & QUEUE_MASK];
     
-    ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
+    // the cell is free once a consumer has released it for this round
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos) {
+        return 0;
+    }
+    
+    w->cell = cell;
+    __atomic_store_n(&cell->work, w, __ATOMIC_RELAXED);
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_SEQ_CST);
+    t->enqueue_pos = pos + 1;
+    
+    return 1;
+}
+
+static BThreadWork * queue_take (struct BThreadWorkDispatcher_thread *t)
+{
+    size_t pos = __atomic_load_n(&t->dequeue_pos, __ATOMIC_RELAXED);
     
     while (1) {
-        // exit if requested
-        if (o->cancel) {
-            break;
+        struct BThreadWorkDispatcher_cell *cell = &t->cells[pos & QUEUE_MASK];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        
+        if (dif < 0) {
+            // queue is empty
+            return NULL;
         }
         
-        if (LinkedList1_IsEmpty(&o->pending_list)) {
-            // wait for event
-            ASSERT_FORCE(pthread_cond_wait(&t->new_cond, &o->mutex) == 0)
+        if (dif > 0) {
+            // another consumer took this cell; retry at the new position
+            pos = __atomic_load_n(&t->dequeue_pos, __ATOMIC_RELAXED);
             continue;
         }
         
-        // grab the work
-        BThreadWork *w = UPPER_OBJECT(LinkedList1_GetFirst(&o->pending_list), BThreadWork, list_node);
-        ASSERT(w->state == BTHREADWORK_STATE_PENDING)
-        LinkedList1_Remove(&o->pending_list, &w->list_node);
-        t->running_work = w;
-        w->state = BTHREADWORK_STATE_RUNNING;
+        // claim the cell; on failure, pos is updated
+        if (!__atomic_compare_exchange_n(&t->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        
+        // take the work, unless it was cancelled, and release the cell
+        BThreadWork *w = __atomic_exchange_n(&cell->work, NULL, __ATOMIC_ACQ_REL);
+        __atomic_store_n(&cell->seq, pos + BTHREADWORK_QUEUE_SIZE, __ATOMIC_RELEASE);
+        
+        if (w) {
+            return w;
+        }
+        
+        // the work was cancelled, so nothing will finish for this cell;
+        // tell the event loop there's room for overflowed works
+        __atomic_store_n(&t->d->cells_released, 1, __ATOMIC_SEQ_CST);
+        notify_event_loop(t->d);
+        
+        pos = __atomic_load_n(&t->dequeue_pos, __ATOMIC_RELAXED);
+    }
+}
+
+static BThreadWork * take_work (struct BThreadWorkDispatcher_thread *t)
+{
+    BThreadWorkDispatcher *o = t->d;
+    
+    // threads are being started and stopped while others run
+    int num_threads = __atomic_load_n(&o->num_threads, __ATOMIC_ACQUIRE);
+    
+    // try our own queue first, then steal from the others
+    for (int i = 0; i < num_threads; i++) {
+        BThreadWork *w = queue_take(&o->threads[(t->index + i) % num_threads]);
+        if (w) {
+            return w;
+        }
+    }
+    
+    return NULL;
+}
+
+static void wake_thread (struct BThreadWorkDispatcher_thread *t)
+{
+    if (__atomic_exchange_n(&t->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        ASSERT_FORCE(sem_post(&t->wake_sem) == 0)
+    }
+}
+
+static void notify_event_loop (BThreadWorkDispatcher *o)
+{
+    // only the first thread to finish something since the event loop
+    // last looked needs to wake it up
+    if (__atomic_exchange_n(&o->notify_pending, 1, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    
+    #ifdef BADVPN_LINUX
+    uint64_t v = 1;
+    #else
+    uint8_t v = 0;
+    #endif
+    int res = write(o->notify_fd[1], &v, sizeof(v));
+    if (res < 0) {
+        int error = errno;
+        ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
+    }
+}
+
+static void finish_work (BThreadWorkDispatcher *o, BThreadWork *w)
+{
+    // push to finished stack; the event loop may free the work as soon as
+    // it is there, so don't touch it afterwards
+    BThreadWork *head = __atomic_load_n(&o->finished_stack, __ATOMIC_RELAXED);
+    do {
+        w->finished_next = head;
+    } while (!__atomic_compare_exchange_n(&o->finished_stack, &head, w, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    
+    // wake up BThreadWork_Free if it's waiting for a work to finish
+    if (__atomic_load_n(&o->free_waiting, __ATOMIC_SEQ_CST)) {
+        ASSERT_FORCE(pthread_mutex_lock(&o->free_mutex) == 0)
+        ASSERT_FORCE(pthread_cond_broadcast(&o->free_cond) == 0)
+        ASSERT_FORCE(pthread_mutex_unlock(&o->free_mutex) == 0)
+    }
+    
+    notify_event_loop(o);
+}
+
+static void * dispatcher_thread (struct BThreadWorkDispatcher_thread *t)
+{
+    BThreadWorkDispatcher *o = t->d;
+    
+    while (1) {
+        BThreadWork *w = take_work(t);
+        
+        if (!w) {
+            // announce that we're going to sleep, then look again, so that
+            // a work put after we last looked will wake us up. The fence
+            // keeps the queue loads below from moving before the store.
+            __atomic_store_n(&t->sleeping, 1, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            
+            // exit if requested
+            if (__atomic_load_n(&o->cancel, __ATOMIC_SEQ_CST)) {
+                break;
+            }
+            
+            if (!(w = take_work(t))) {
+                // wait for event
+                while (sem_wait(&t->wake_sem) < 0) {
+                    ASSERT_FORCE(errno == EINTR)
+                }
+                continue;
+            }
+            
+            __atomic_store_n(&t->sleeping, 0, __ATOMIC_SEQ_CST);
+        }
         
         // do the work
-        ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
         w->work_func(w->work_func_user);
-        ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
         
         // release the work
-        t->running_work = NULL;
-        LinkedList1_Append(&o->finished_list, &w->list_node);
-        w->state = BTHREADWORK_STATE_FINISHED;
-        ASSERT_FORCE(sem_post(&w->finished_sem) == 0)
-        
-        // write to pipe
-        uint8_t b = 0;
-        int res = write(o->pipe[1], &b, sizeof(b));
-        if (res < 0) {
-            int error = errno;
-            ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
+        finish_work(o, w);
+    }
+    
+    return NULL;
+}
+
+static void put_work (BThreadWorkDispatcher *o, BThreadWork *w)
+{
+    // spread works over the threads' queues
+    for (int i = 0; i < o->num_threads; i++) {
+        struct BThreadWorkDispatcher_thread *t = &o->threads[o->next_thread];
+        o->next_thread = (o->next_thread + 1) % o->num_threads;
+        
+        if (!queue_put(t, w)) {
+            continue;
         }
+        
+        // wake the owner of the queue, or if it's busy, someone who can steal the work
+        if (__atomic_load_n(&t->sleeping, __ATOMIC_SEQ_CST)) {
+            wake_thread(t);
+        } else {
+            for (int j = 0; j < o->num_threads; j++) {
+                if (__atomic_load_n(&o->threads[j].sleeping, __ATOMIC_SEQ_CST)) {
+                    wake_thread(&o->threads[j]);
+                    break;
+                }
+            }
+        }
+        
+        return;
     }
     
-    ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
+    // all queues are full; keep the work until some finish
+    w->cell = NULL;
+    LinkedList1_Append(&o->overflow_list, &w->list_node);
+}
+
+static void retry_overflow (BThreadWorkDispatcher *o)
+{
+    // queues may have room now for works which didn't fit
+    while (!LinkedList1_IsEmpty(&o->overflow_list)) {
+        BThreadWork *ow = UPPER_OBJECT(LinkedList1_GetFirst(&o->overflow_list), BThreadWork, list_node);
+        LinkedList1_Remove(&o->overflow_list, &ow->list_node);
+        put_work(o, ow);
+        if (!ow->cell) {
+            // still full; put_work appended it, move it back to the front
+            LinkedList1_Remove(&o->overflow_list, &ow->list_node);
+            LinkedList1_Prepend(&o->overflow_list, &ow->list_node);
+            break;
+        }
+    }
+}
+
+static void collect_finished (BThreadWorkDispatcher *o)
+{
+    // grab all finished works
+    BThreadWork *w = __atomic_exchange_n(&o->finished_stack, NULL, __ATOMIC_ACQUIRE);
     
-    return NULL;
+    // the stack is in reverse order of finishing; reverse it
+    BThreadWork *rev = NULL;
+    while (w) {
+        BThreadWork *next = w->finished_next;
+        w->finished_next = rev;
+        rev = w;
+        w = next;
+    }
+    
+    // append to finished list
+    for (w = rev; w; w = w->finished_next) {
+        ASSERT(w->state == BTHREADWORK_STATE_PENDING)
+        w->state = BTHREADWORK_STATE_FINISHED;
+        LinkedList1_Append(&o->finished_list, &w->list_node);
+    }
+    
+    // cells were released if works finished or cancelled ones were skipped
+    int released = __atomic_exchange_n(&o->cells_released, 0, __ATOMIC_ACQ_REL);
+    if (rev || released) {
+        retry_overflow(o);
+    }
 }
 
 static void dispatch_job (BThreadWorkDispatcher *o)
 {
     ASSERT(o->num_threads > 0)
     
-    // lock
-    ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
-    
     // check for finished job
     if (LinkedList1_IsEmpty(&o->finished_list)) {
-        ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
         return;
     }
     
@@ -121,22 +317,23 @@ static void dispatch_job (BThreadWorkDispatcher *o)
     // set state forgotten
     w->state = BTHREADWORK_STATE_FORGOTTEN;
     
-    // unlock
-    ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
-    
     // call handler
     w->handler_done(w->user);
     return;
 }
 
-static void pipe_fd_handler (BThreadWorkDispatcher *o, int events)
+static void notify_fd_handler (BThreadWorkDispatcher *o, int events)
 {
     ASSERT(o->num_threads > 0)
     DebugObject_Access(&o->d_obj);
     
-    // read data from pipe
+    // read notification
+    #ifdef BADVPN_LINUX
+    uint64_t b;
+    #else
     uint8_t b[64];
-    int res = read(o->pipe[0], b, sizeof(b));
+    #endif
+    int res = read(o->notify_fd[0], &b, sizeof(b));
     if (res < 0) {
         int error = errno;
         ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
@@ -144,6 +341,12 @@ static void pipe_fd_handler (BThreadWorkDispatcher *o, int events)
         ASSERT(res > 0)
     }
     
+    // allow threads to notify again; anything they finish from now on
+    // will either be collected below or notified
+    __atomic_store_n(&o->notify_pending, 0, __ATOMIC_SEQ_CST);
+    
+    collect_finished(o);
+    
     dispatch_job(o);
     return;
 }
@@ -153,30 +356,96 @@ static void more_job_handler (BThreadWorkDispatcher *o)
     ASSERT(o->num_threads > 0)
     DebugObject_Access(&o->d_obj);
     
+    retry_overflow(o);
+    
     dispatch_job(o);
     return;
 }
 
+static void wait_finished (BThreadWorkDispatcher *o, BThreadWork *w)
+{
+    ASSERT(w->state == BTHREADWORK_STATE_PENDING)
+    
+    __atomic_store_n(&o->free_waiting, 1, __ATOMIC_SEQ_CST);
+    
+    while (1) {
+        collect_finished(o);
+        if (w->state == BTHREADWORK_STATE_FINISHED) {
+            break;
+        }
+        
+        // wait until a thread finishes something
+        ASSERT_FORCE(pthread_mutex_lock(&o->free_mutex) == 0)
+        if (!__atomic_load_n(&o->finished_stack, __ATOMIC_SEQ_CST)) {
+            ASSERT_FORCE(pthread_cond_wait(&o->free_cond, &o->free_mutex) == 0)
+        }
+        ASSERT_FORCE(pthread_mutex_unlock(&o->free_mutex) == 0)
+    }
+    
+    __atomic_store_n(&o->free_waiting, 0, __ATOMIC_SEQ_CST);
+    
+    // there may be more finished works now
+    if (!LinkedList1_IsEmpty(&o->finished_list)) {
+        BPending_Set(&o->more_job);
+    }
+}
+
 static void stop_threads (BThreadWorkDispatcher *o)
 {
     // set cancelling
-    ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
-    o->cancel = 1;
-    ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
+    __atomic_store_n(&o->cancel, 1, __ATOMIC_SEQ_CST);
     
     while (o->num_threads > 0) {
         struct BThreadWorkDispatcher_thread *t = &o->threads[o->num_threads - 1];
         
         // wake up thread
-        ASSERT_FORCE(pthread_cond_signal(&t->new_cond) == 0)
+        ASSERT_FORCE(sem_post(&t->wake_sem) == 0)
         
         // wait for thread to exit
         ASSERT_FORCE(pthread_join(t->thread, NULL) == 0)
         
-        // free condition variable
-        ASSERT_FORCE(pthread_cond_destroy(&t->new_cond) == 0)
+        // free semaphore
+        ASSERT_FORCE(sem_destroy(&t->wake_sem) == 0)
         
-        o->num_threads--;
+        __atomic_store_n(&o->num_threads, o->num_threads - 1, __ATOMIC_RELEASE);
+    }
+}
+
+static int init_notify_fd (BThreadWorkDispatcher *o)
+{
+    #ifdef BADVPN_LINUX
+    
+    if ((o->notify_fd[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0) {
+        BLog(BLOG_ERROR, "eventfd failed");
+        return 0;
+    }
+    o->notify_fd[1] = o->notify_fd[0];
+    
+    #else
+    
+    if (pipe(o->notify_fd) < 0) {
+        BLog(BLOG_ERROR, "pipe failed");
+        return 0;
+    }
+    
+    // set both ends non-blocking
+    if (fcntl(o->notify_fd[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(o->notify_fd[1], F_SETFL, O_NONBLOCK) < 0) {
+        BLog(BLOG_ERROR, "fcntl failed");
+        ASSERT_FORCE(close(o->notify_fd[0]) == 0)
+        ASSERT_FORCE(close(o->notify_fd[1]) == 0)
+        return 0;
+    }
+    
+    #endif
+    
+    return 1;
+}
+
+static void free_notify_fd (BThreadWorkDispatcher *o)
+{
+    ASSERT_FORCE(close(o->notify_fd[0]) == 0)
+    if (o->notify_fd[1] != o->notify_fd[0]) {
+        ASSERT_FORCE(close(o->notify_fd[1]) == 0)
     }
 }
 
@@ -211,76 +480,88 @@ int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int
     
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
     
+    o->num_threads = 0;
+    
     if (num_threads_hint > 0) {
-        // init pending list
-        LinkedList1_Init(&o->pending_list);
+        // init overflow list
+        LinkedList1_Init(&o->overflow_list);
         
-        // init finished list
+        // init finished list and stack
         LinkedList1_Init(&o->finished_list);
+        o->finished_stack = NULL;
+        o->notify_pending = 0;
+        o->cells_released = 0;
         
-        // init mutex
-        if (pthread_mutex_init(&o->mutex, NULL) != 0) {
+        // init free waiting
+        o->free_waiting = 0;
+        if (pthread_mutex_init(&o->free_mutex, NULL) != 0) {
             BLog(BLOG_ERROR, "pthread_mutex_init failed");
             goto fail0;
         }
-        
-        // init pipe
-        if (pipe(o->pipe) < 0) {
-            BLog(BLOG_ERROR, "pipe failed");
+        if (pthread_cond_init(&o->free_cond, NULL) != 0) {
+            BLog(BLOG_ERROR, "pthread_cond_init failed");
             goto fail1;
         }
         
-        // set read end non-blocking
-        if (fcntl(o->pipe[0], F_SETFL, O_NONBLOCK) < 0) {
-            BLog(BLOG_ERROR, "fcntl failed");
-            goto fail2;
-        }
-        
-        // set write end non-blocking
-        if (fcntl(o->pipe[1], F_SETFL, O_NONBLOCK) < 0) {
-            BLog(BLOG_ERROR, "fcntl failed");
+        // init notification fd
+        if (!init_notify_fd(o)) {
             goto fail2;
         }
         
         // init BFileDescriptor
-        BFileDescriptor_Init(&o->bfd, o->pipe[0], (BFileDescriptor_handler)pipe_fd_handler, o);
+        BFileDescriptor_Init(&o->bfd, o->notify_fd[0], (BFileDescriptor_handler)notify_fd_handler, o);
         if (!BReactor_AddFileDescriptor(o->reactor, &o->bfd)) {
             BLog(BLOG_ERROR, "BReactor_AddFileDescriptor failed");
-            goto fail2;
+            goto fail3;
         }
         BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, BREACTOR_READ);
         
         // init more job
         BPending_Init(&o->more_job, BReactor_PendingGroup(o->reactor), (BPending_handler)more_job_handler, o);
         
+        // allocate threads
+        if (!(o->threads = (struct BThreadWorkDispatcher_thread *)BAllocArray(num_threads_hint, sizeof(o->threads[0])))) {
+            BLog(BLOG_ERROR, "BAllocArray failed");
+            goto fail4;
+        }
+        
         // set not cancelling
         o->cancel = 0;
         
-        // init threads
-        o->num_threads = 0;
+        // init queues; threads steal from all of them, so do this before
+        // starting any thread
         for (int i = 0; i < num_threads_hint; i++) {
             struct BThreadWorkDispatcher_thread *t = &o->threads[i];
-            
-            // set parent pointer
             t->d = o;
+            t->index = i;
+            t->sleeping = 0;
+            t->enqueue_pos = 0;
+            t->dequeue_pos = 0;
+            for (size_t j = 0; j < BTHREADWORK_QUEUE_SIZE; j++) {
+                t->cells[j].seq = j;
+                t->cells[j].work = NULL;
+            }
+        }
+        o->next_thread = 0;
+        
+        // init threads
+        for (int i = 0; i < num_threads_hint; i++) {
+            struct BThreadWorkDispatcher_thread *t = &o->threads[i];
             
-            // set no running work
-            t->running_work = NULL;
-            
-            // init condition variable
-            if (pthread_cond_init(&t->new_cond, NULL) != 0) {
-                BLog(BLOG_ERROR, "pthread_cond_init failed");
-                goto fail3;
+            // init wake semaphore
+            if (sem_init(&t->wake_sem, 0, 0) != 0) {
+                BLog(BLOG_ERROR, "sem_init failed");
+                goto fail5;
             }
             
-            // init thread
+            // init thread; it only looks at num_threads threads
+            __atomic_store_n(&o->num_threads, o->num_threads + 1, __ATOMIC_RELEASE);
             if (pthread_create(&t->thread, NULL, (void * (*) (void *))dispatcher_thread, t) != 0) {
                 BLog(BLOG_ERROR, "pthread_create failed");
-                ASSERT_FORCE(pthread_cond_destroy(&t->new_cond) == 0)
-                goto fail3;
+                __atomic_store_n(&o->num_threads, o->num_threads - 1, __ATOMIC_RELEASE);
+                ASSERT_FORCE(sem_destroy(&t->wake_sem) == 0)
+                goto fail5;
             }
-        
-            o->num_threads++;
         }
     }
     
@@ -291,15 +572,18 @@ int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int
     return 1;
     
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
-fail3:
+fail5:
     stop_threads(o);
+    BFree(o->threads);
+fail4:
     BPending_Free(&o->more_job);
     BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
+fail3:
+    free_notify_fd(o);
 fail2:
-    ASSERT_FORCE(close(o->pipe[0]) == 0)
-    ASSERT_FORCE(close(o->pipe[1]) == 0)
+    ASSERT_FORCE(pthread_cond_destroy(&o->free_cond) == 0)
 fail1:
-    ASSERT_FORCE(pthread_mutex_destroy(&o->mutex) == 0)
+    ASSERT_FORCE(pthread_mutex_destroy(&o->free_mutex) == 0)
 fail0:
     return 0;
     #endif
@@ -309,9 +593,9 @@ void BThreadWorkDispatcher_Free (BThreadWorkDispatcher *o)
 {
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
     if (o->num_threads > 0) {
-        ASSERT(LinkedList1_IsEmpty(&o->pending_list))
-        for (int i = 0; i < o->num_threads; i++) { ASSERT(!o->threads[i].running_work) }
+        ASSERT(LinkedList1_IsEmpty(&o->overflow_list))
         ASSERT(LinkedList1_IsEmpty(&o->finished_list))
+        ASSERT(!o->finished_stack)
     }
     #endif
     DebugObject_Free(&o->d_obj);
@@ -323,18 +607,21 @@ void BThreadWorkDispatcher_Free (BThreadWorkDispatcher *o)
         // stop threads
         stop_threads(o);
         
+        // free threads
+        BFree(o->threads);
+        
         // free more job
         BPending_Free(&o->more_job);
         
         // free BFileDescriptor
         BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
         
-        // free pipe
-        ASSERT_FORCE(close(o->pipe[0]) == 0)
-        ASSERT_FORCE(close(o->pipe[1]) == 0)
+        // free notification fd
+        free_notify_fd(o);
         
-        // free mutex
-        ASSERT_FORCE(pthread_mutex_destroy(&o->mutex) == 0)
+        // free free waiting
+        ASSERT_FORCE(pthread_cond_destroy(&o->free_cond) == 0)
+        ASSERT_FORCE(pthread_mutex_destroy(&o->free_mutex) == 0)
     }
     
     #endif
@@ -349,6 +636,15 @@ int BThreadWorkDispatcher_UsingThreads (BThreadWorkDispatcher *o)
     #endif
 }
 
+int BThreadWorkDispatcher_NumThreads (BThreadWorkDispatcher *o)
+{
+    #ifdef BADVPN_THREADWORK_USE_PTHREAD
+    return o->num_threads;
+    #else
+    return 0;
+    #endif
+}
+
 void BThreadWork_Init (BThreadWork *o, BThreadWorkDispatcher *d, BThreadWork_handler_done handler_done, void *user, BThreadWork_work_func work_func, void *work_func_user)
 {
     DebugObject_Access(&d->d_obj);
@@ -365,19 +661,8 @@ void BThreadWork_Init (BThreadWork *o, BThreadWorkDispatcher *d, BThreadWork_han
         // set state
         o->state = BTHREADWORK_STATE_PENDING;
         
-        // init finished semaphore
-        ASSERT_FORCE(sem_init(&o->finished_sem, 0, 0) == 0)
-        
         // post work
-        ASSERT_FORCE(pthread_mutex_lock(&d->mutex) == 0)
-        LinkedList1_Append(&d->pending_list, &o->list_node);
-        for (int i = 0; i < d->num_threads; i++) {
-            if (!d->threads[i].running_work) {
-                ASSERT_FORCE(pthread_cond_signal(&d->threads[i].new_cond) == 0)
-                break;
-            }
-        }
-        ASSERT_FORCE(pthread_mutex_unlock(&d->mutex) == 0)
+        put_work(d, o);
     } else {
     #endif
         // schedule job
@@ -399,25 +684,34 @@ void BThreadWork_Free (BThreadWork *o)
     
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
     if (d->num_threads > 0) {
-        ASSERT_FORCE(pthread_mutex_lock(&d->mutex) == 0)
-        
         switch (o->state) {
             case BTHREADWORK_STATE_PENDING: {
-                BLog(BLOG_DEBUG, "remove pending work");
+                if (!o->cell) {
+                    BLog(BLOG_DEBUG, "remove overflowed work");
+                    
+                    // remove from overflow list
+                    LinkedList1_Remove(&d->overflow_list, &o->list_node);
+                    break;
+                }
                 
-                // remove from pending list
-                LinkedList1_Remove(&d->pending_list, &o->list_node);
-            } break;
-            
-            case BTHREADWORK_STATE_RUNNING: {
-                BLog(BLOG_DEBUG, "remove running work");
+                // try to take the work back from its queue
+                BThreadWork *expected = o;
+                if (__atomic_compare_exchange_n(&o->cell->work, &expected, NULL, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    BLog(BLOG_DEBUG, "remove pending work");
+                    
+                    // nothing will finish for this work; give overflowed works
+                    // another chance, they will also be retried once a thread
+                    // skips the cell
+                    if (!LinkedList1_IsEmpty(&d->overflow_list)) {
+                        BPending_Set(&d->more_job);
+                    }
+                    break;
+                }
                 
-                // wait for the work to finish running
-                ASSERT_FORCE(pthread_mutex_unlock(&d->mutex) == 0)
-                ASSERT_FORCE(sem_wait(&o->finished_sem) == 0)
-                ASSERT_FORCE(pthread_mutex_lock(&d->mutex) == 0)
+                BLog(BLOG_DEBUG, "remove running work");
                 
-                ASSERT(o->state == BTHREADWORK_STATE_FINISHED)
+                // a thread has it; wait for the work to finish running
+                wait_finished(d, o);
                 
                 // remove from finished list
                 LinkedList1_Remove(&d->finished_list, &o->list_node);
@@ -437,11 +731,6 @@ void BThreadWork_Free (BThreadWork *o)
             default:
                 ASSERT(0);
         }
-        
-        ASSERT_FORCE(pthread_mutex_unlock(&d->mutex) == 0)
-        
-        // free finished semaphore
-        ASSERT_FORCE(sem_destroy(&o->finished_sem) == 0)
     } else {
     #endif
         BPending_Free(&o->job);
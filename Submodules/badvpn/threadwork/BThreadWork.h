@@ -30,6 +30,12 @@
  * 
  * System for performing computations (possibly) in parallel with the event loop
  * in a different thread.
+ * 
+ * With threads, each thread has a bounded lock-free queue which the event loop
+ * thread distributes works to, and threads with nothing in their own queue
+ * steal from the others. Finished works are pushed to a lock-free stack, and
+ * the event loop is woken up through an eventfd (a pipe on non-Linux systems)
+ * only once for all the works finished since it last looked.
  */
 
 #ifndef BADVPN_BTHREADWORK_BTHREADWORK_H
@@ -46,11 +52,13 @@
 #include <system/BReactor.h>
 
 #define BTHREADWORK_STATE_PENDING 1
-#define BTHREADWORK_STATE_RUNNING 2
 #define BTHREADWORK_STATE_FINISHED 3
 #define BTHREADWORK_STATE_FORGOTTEN 4
 
-#define BTHREADWORK_MAX_THREADS 8
+#define BTHREADWORK_MAX_THREADS 32
+
+// size of each thread's queue; must be a power of two
+#define BTHREADWORK_QUEUE_SIZE 256
 
 struct BThreadWork_s;
 struct BThreadWorkDispatcher_s;
@@ -71,26 +79,44 @@ typedef void (*BThreadWork_work_func) (void *user);
 typedef void (*BThreadWork_handler_done) (void *user);
 
 #ifdef BADVPN_THREADWORK_USE_PTHREAD
+struct BThreadWorkDispatcher_cell {
+    size_t seq;
+    struct BThreadWork_s *work;
+};
+
 struct BThreadWorkDispatcher_thread {
     struct BThreadWorkDispatcher_s *d;
-    struct BThreadWork_s *running_work;
-    pthread_cond_t new_cond;
+    int index;
     pthread_t thread;
+    sem_t wake_sem;
+    int sleeping;
+    // keep the producer's and the consumers' positions in different cache lines
+    size_t enqueue_pos;
+    char pad1[64];
+    size_t dequeue_pos;
+    char pad2[64];
+    struct BThreadWorkDispatcher_cell cells[BTHREADWORK_QUEUE_SIZE];
 };
 #endif
 
 typedef struct BThreadWorkDispatcher_s {
     BReactor *reactor;
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
-    LinkedList1 pending_list;
+    LinkedList1 overflow_list;
     LinkedList1 finished_list;
-    pthread_mutex_t mutex;
-    int pipe[2];
+    struct BThreadWork_s *finished_stack;
+    int notify_pending;
+    int cells_released;
+    int free_waiting;
+    pthread_mutex_t free_mutex;
+    pthread_cond_t free_cond;
+    int notify_fd[2];
     BFileDescriptor bfd;
     BPending more_job;
     int cancel;
     int num_threads;
-    struct BThreadWorkDispatcher_thread threads[BTHREADWORK_MAX_THREADS];
+    int next_thread;
+    struct BThreadWorkDispatcher_thread *threads;
     #endif
     DebugObject d_obj;
     DebugCounter d_ctr;
@@ -106,8 +132,9 @@ typedef struct BThreadWork_s {
         #ifdef BADVPN_THREADWORK_USE_PTHREAD
         struct {
             LinkedList1Node list_node;
+            struct BThreadWorkDispatcher_cell *cell;
+            struct BThreadWork_s *finished_next;
             int state;
-            sem_t finished_sem;
         };
         #endif
         struct {
@@ -147,6 +174,14 @@ void BThreadWorkDispatcher_Free (BThreadWorkDispatcher *o);
  */
 int BThreadWorkDispatcher_UsingThreads (BThreadWorkDispatcher *o);
 
+/**
+ * Returns the number of threads computations are done in.
+ * Users may use this to decide how many works to keep in flight.
+ * 
+ * @return number of threads, 0 if computations are done in the event loop
+ */
+int BThreadWorkDispatcher_NumThreads (BThreadWorkDispatcher *o);
+
 /**
  * Initializes the work.
  * 
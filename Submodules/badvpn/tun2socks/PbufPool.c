@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+
+#include <misc/balign.h>
+#include <misc/balloc.h>
+#include <misc/offset.h>
+
+#include <tun2socks/PbufPool.h>
+
+struct PbufPool_buffer {
+    struct pbuf_custom pc;
+    PbufPool *pool;
+    int wrapped;
+    LinkedList1Node list_node;
+};
+
+static size_t data_offset (void)
+{
+    // leave room for lwIP to move the payload back to a link header,
+    // as done when ICMP echo requests are answered in place
+    return balign_up(sizeof(struct PbufPool_buffer) + PBUF_LINK_HLEN, MEM_ALIGNMENT);
+}
+
+static struct PbufPool_buffer * buffer_from_data (uint8_t *data)
+{
+    return (struct PbufPool_buffer *)(data - data_offset());
+}
+
+static void pbuf_free_func (struct pbuf *p)
+{
+    struct PbufPool_buffer *b = UPPER_OBJECT(p, struct PbufPool_buffer, pc.pbuf);
+    PbufPool *o = b->pool;
+    
+    // pool is gone, free the buffer
+    if (!o) {
+        BFree(b);
+        return;
+    }
+    
+    DebugObject_Access(&o->d_obj);
+    
+    // return buffer to pool
+    LinkedList1_Remove(&o->used_list, &b->list_node);
+    LinkedList1_Prepend(&o->free_list, &b->list_node);
+}
+
+int PbufPool_Init (PbufPool *o, int buf_size, int max_buffers)
+{
+    ASSERT(buf_size > 0)
+    ASSERT(buf_size <= UINT16_MAX)
+    ASSERT(max_buffers > 0)
+    
+    // init arguments
+    o->buf_size = buf_size;
+    o->max_buffers = max_buffers;
+    
+    // check allocation size
+    if ((size_t)buf_size > SIZE_MAX - data_offset()) {
+        return 0;
+    }
+    
+    // init counter
+    o->num_buffers = 0;
+    
+    // init lists
+    LinkedList1_Init(&o->free_list);
+    LinkedList1_Init(&o->used_list);
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+}
+
+void PbufPool_Free (PbufPool *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // free idle buffers
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&o->free_list)) {
+        struct PbufPool_buffer *b = UPPER_OBJECT(node, struct PbufPool_buffer, list_node);
+        LinkedList1_Remove(&o->free_list, &b->list_node);
+        BFree(b);
+    }
+    
+    // free buffers still held by the user, and detach buffers held
+    // by lwIP; they are freed when their pbufs are
+    while (node = LinkedList1_GetFirst(&o->used_list)) {
+        struct PbufPool_buffer *b = UPPER_OBJECT(node, struct PbufPool_buffer, list_node);
+        LinkedList1_Remove(&o->used_list, &b->list_node);
+        if (b->wrapped) {
+            b->pool = NULL;
+        } else {
+            BFree(b);
+        }
+    }
+}
+
+uint8_t * PbufPool_Get (PbufPool *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    struct PbufPool_buffer *b;
+    
+    LinkedList1Node *node = LinkedList1_GetFirst(&o->free_list);
+    if (node) {
+        // reuse an idle buffer
+        b = UPPER_OBJECT(node, struct PbufPool_buffer, list_node);
+        LinkedList1_Remove(&o->free_list, &b->list_node);
+    } else {
+        // check limit
+        if (o->num_buffers == o->max_buffers) {
+            return NULL;
+        }
+        
+        // allocate new buffer
+        if (!(b = (struct PbufPool_buffer *)BAlloc(data_offset() + o->buf_size))) {
+            return NULL;
+        }
+        b->pool = o;
+        o->num_buffers++;
+    }
+    
+    // mark buffer used
+    b->wrapped = 0;
+    LinkedList1_Append(&o->used_list, &b->list_node);
+    
+    return (uint8_t *)b + data_offset();
+}
+
+void PbufPool_Release (PbufPool *o, uint8_t *data)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(data)
+    
+    struct PbufPool_buffer *b = buffer_from_data(data);
+    ASSERT(b->pool == o)
+    ASSERT(!b->wrapped)
+    
+    // return buffer to pool
+    LinkedList1_Remove(&o->used_list, &b->list_node);
+    LinkedList1_Prepend(&o->free_list, &b->list_node);
+}
+
+struct pbuf * PbufPool_Wrap (PbufPool *o, uint8_t *data, int len)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(data)
+    ASSERT(len >= 0)
+    ASSERT(len <= o->buf_size)
+    
+    struct PbufPool_buffer *b = buffer_from_data(data);
+    ASSERT(b->pool == o)
+    ASSERT(!b->wrapped)
+    
+    // The pbuf is declared PBUF_POOL so that pbuf_header() lets lwIP use
+    // the headroom between the pbuf and the data, which it would not do
+    // for a PBUF_REF pbuf.
+    b->pc.custom_free_function = pbuf_free_func;
+    struct pbuf *p = pbuf_alloced_custom(PBUF_RAW, len, PBUF_POOL, &b->pc, data, o->buf_size);
+    ASSERT_FORCE(p)
+    
+    b->wrapped = 1;
+    
+    return p;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BADVPN_TUN2SOCKS_PBUFPOOL_H
+#define BADVPN_TUN2SOCKS_PBUFPOOL_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <structure/LinkedList1.h>
+#include <base/DebugObject.h>
+
+#include <lwip/pbuf.h>
+
+/**
+ * Pool of recyclable packet buffers which can be passed to lwIP as
+ * custom pbufs without copying.
+ * 
+ * Each buffer is allocated together with the pbuf that will describe it,
+ * and with enough headroom in front of the data for lwIP to prepend a
+ * link header. When lwIP frees a pbuf made from a buffer, the buffer goes
+ * back to the pool instead of being deallocated. Buffers are allocated
+ * on demand, up to a maximum number.
+ */
+typedef struct {
+    int buf_size;
+    int max_buffers;
+    int num_buffers;
+    LinkedList1 free_list;
+    LinkedList1 used_list;
+    DebugObject d_obj;
+} PbufPool;
+
+/**
+ * Initializes the pool. No buffers are allocated yet.
+ * 
+ * @param o the object
+ * @param buf_size size of the data area of each buffer. Must be >0
+ *                 and <=UINT16_MAX.
+ * @param max_buffers maximum number of buffers to allocate. Must be >0.
+ * @return 1 on success, 0 on failure
+ */
+int PbufPool_Init (PbufPool *o, int buf_size, int max_buffers) WARN_UNUSED;
+
+/**
+ * Frees the pool.
+ * Buffers still referenced by lwIP are detached from the pool and freed
+ * when lwIP frees their pbufs. All other buffers are freed immediately,
+ * including those obtained with {@link PbufPool_Get} and not passed to
+ * {@link PbufPool_Wrap}, which must no longer be in use.
+ * 
+ * @param o the object
+ */
+void PbufPool_Free (PbufPool *o);
+
+/**
+ * Obtains a buffer from the pool.
+ * 
+ * @param o the object
+ * @return pointer to the data area of the buffer, of size buf_size, or NULL
+ *         if the maximum number of buffers is in use or allocation failed
+ */
+uint8_t * PbufPool_Get (PbufPool *o);
+
+/**
+ * Returns a buffer obtained with {@link PbufPool_Get} to the pool, without
+ * passing it to lwIP.
+ * 
+ * @param o the object
+ * @param data data area of the buffer, as returned by {@link PbufPool_Get}
+ */
+void PbufPool_Release (PbufPool *o, uint8_t *data);
+
+/**
+ * Makes a pbuf referencing a buffer obtained with {@link PbufPool_Get}.
+ * The pbuf owns the buffer from now on; the buffer returns to the pool
+ * when the pbuf is freed.
+ * 
+ * @param o the object
+ * @param data data area of the buffer, as returned by {@link PbufPool_Get}
+ * @param len length of the data in the buffer. Must be >=0 and <=buf_size.
+ * @return the pbuf, always non-NULL
+ */
+struct pbuf * PbufPool_Wrap (PbufPool *o, uint8_t *data, int len);
+
+#endif
@@ -32,6 +32,19 @@
 #include <string.h>
 #include <limits.h>
 
+#if defined(BADVPN_LINUX) && !defined(TARGET_LIBTSOCKS)
+#define TUN2SOCKS_TUN_QUEUES
+#endif
+
+#ifdef TUN2SOCKS_TUN_QUEUES
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#endif
+
 #include <misc/version.h>
 #include <misc/loggers_string.h>
 #include <misc/loglevel.h>
@@ -49,11 +62,11 @@
 #include <misc/concat_strings.h>
 #include <structure/LinkedList1.h>
 #include <base/BLog.h>
+#include <base/BMetrics.h>
 #include <system/BReactor.h>
 #include <system/BSignal.h>
 #include <system/BAddr.h>
 #include <system/BNetwork.h>
-#include <flow/SinglePacketBuffer.h>
 #include <socksclient/BSocksClient.h>
 #include <tuntap/BTap.h>
 #include <lwip/init.h>
@@ -61,9 +74,12 @@
 #include <lwip/netif.h>
 #include <lwip/tcp.h>
 #include <tun2socks/SocksUdpGwClient.h>
+#include <tun2socks/PbufPool.h>
 
 #ifndef BADVPN_USE_WINAPI
 #include <base/BLog_syslog.h>
+#include <base/BLog_async.h>
+#include <system/BMetricsServer.h>
 #endif
 
 #include <tun2socks/tun2socks.h>
@@ -95,6 +111,7 @@ struct {
     #ifndef BADVPN_USE_WINAPI
     char *logger_syslog_facility;
     char *logger_syslog_ident;
+    int logger_async;
     #endif
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
@@ -111,6 +128,11 @@ struct {
     int udpgw_max_connections;
     int udpgw_connection_buffer_size;
     int udpgw_transparent_dns;
+    int tun_queues;
+    int tun_batch_size;
+    #ifndef BADVPN_USE_WINAPI
+    char *metrics_socket;
+    #endif
 } options;
 
 // TCP client
@@ -122,18 +144,21 @@ struct tcp_client {
     BAddr remote_addr;
     struct tcp_pcb *pcb;
     int client_closed;
+    int client_eof;
     uint8_t buf[TCP_WND];
+    int buf_start;
     int buf_used;
     char *socks_username;
     BSocksClient socks_client;
+    uint64_t socks_start_time;
     int socks_up;
     int socks_closed;
     StreamPassInterface *socks_send_if;
     StreamRecvInterface *socks_recv_if;
     uint8_t socks_recv_buf[CLIENT_SOCKS_RECV_BUF_SIZE];
+    int socks_recv_buf_start;
     int socks_recv_buf_used;
-    int socks_recv_buf_sent;
-    int socks_recv_waiting;
+    int socks_recv_active;
     int socks_recv_tcp_pending;
 };
 
@@ -168,12 +193,22 @@ int quitting;
 // TUN device
 BTap device;
 
+#ifdef TUN2SOCKS_TUN_QUEUES
+// index of the device queue this process serves (0 in the main process)
+int queue_index;
+
+// PIDs of the queue worker processes (only in the main process)
+pid_t queue_worker_pids[TUN2SOCKS_MAX_TUN_QUEUES];
+int num_queue_workers;
+#endif
+
 // device write buffer
 uint8_t *device_write_buf;
 
 // device reading
-SinglePacketBuffer device_read_buffer;
-PacketPassInterface device_read_interface;
+PbufPool device_read_pool;
+uint8_t *device_read_copy_buf;
+int device_read_num_posted;
 
 // udpgw client
 SocksUdpGwClient udpgw_client;
@@ -201,17 +236,40 @@ LinkedList1 tcp_clients;
 // number of clients
 int num_clients;
 
+#ifndef BADVPN_USE_WINAPI
+// metrics server, if enabled
+BMetricsServer metrics_server;
+#endif
+
+static const uint64_t metric_socks_connect_time_bounds[] = {
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 500000000, 1000000000, 2500000000, 5000000000
+};
+
+static BMetric metric_clients = BMETRIC_GAUGE_INIT("badvpn_tun2socks_clients", "TCP connections being forwarded.");
+static BMetric metric_socks_connect_time = BMETRIC_HISTOGRAM_INIT("badvpn_tun2socks_socks_connect_seconds", "Time from accepting a TCP connection until its SOCKS connection is up.", metric_socks_connect_time_bounds, 1000000000);
+static BMetric metric_socks_connect_failures = BMETRIC_COUNTER_INIT("badvpn_tun2socks_socks_connect_failures_total", "SOCKS connections which failed before they were up.");
+static BMetric metric_device_pbuf_alloc_failures = BMETRIC_COUNTER_INIT("badvpn_tun2socks_device_pbuf_alloc_failures_total", "Packets from the device dropped because no pbuf could be allocated.");
+static BMetric metric_device_input_failures = BMETRIC_COUNTER_INIT("badvpn_tun2socks_device_input_failures_total", "Packets from the device which lwIP failed to accept.");
+
 static void terminate (void);
 static void print_help (const char *name);
 static void print_version (void);
 static int parse_arguments (int argc, char *argv[]);
 static int process_arguments (void);
 static void signal_handler (void *unused);
+#ifndef BADVPN_USE_WINAPI
+static int init_metrics_server (void);
+#endif
+#ifdef TUN2SOCKS_TUN_QUEUES
+static int spawn_queue_workers (void);
+static void reap_queue_workers (void);
+#endif
 static BAddr baddr_from_lwip (int is_ipv6, const ipX_addr_t *ipx_addr, uint16_t port_hostorder);
 static void lwip_init_job_hadler (void *unused);
 static void tcp_timer_handler (void *unused);
 static void device_error_handler (void *unused);
-static void device_read_handler_send (void *unused, uint8_t *data, int data_len);
+static void device_read_post (void);
+static void device_read_handler (void *unused, uint8_t *data, int data_len);
 static int process_device_udp_packet (uint8_t *data, int data_len);
 static err_t netif_init_func (struct netif *netif);
 static err_t netif_output_func (struct netif *netif, struct pbuf *p, ip_addr_t *ipaddr);
@@ -219,7 +277,8 @@ static err_t netif_output_ip6_func (struct netif *netif, struct pbuf *p, ip6_add
 static err_t common_netif_output (struct netif *netif, struct pbuf *p);
 static err_t netif_input_func (struct pbuf *p, struct netif *inp);
 static void client_logfunc (struct tcp_client *client);
-static void client_log (struct tcp_client *client, int level, const char *fmt, ...);
+static void client_log_message (struct tcp_client *client, int level, const char *fmt, ...);
+#define client_log(o, level, ...) BLOG_IF_COMPILED((level), client_log_message((o), (level), __VA_ARGS__))
 static err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err);
 static void client_handle_freed_client (struct tcp_client *client);
 static void client_free_client (struct tcp_client *client);
@@ -310,6 +369,13 @@ int main (int argc, char **argv)
         }
     }
     
+    #ifndef BADVPN_USE_WINAPI
+    // pass messages to the logger from a background thread
+    if (options.logger_async && !BLog_StartAsync(BLOG_ASYNC_DEFAULT_BUFFER_SIZE)) {
+        BLog(BLOG_WARNING, "BLog_StartAsync failed, logging synchronously");
+    }
+    #endif
+    
     BLog(BLOG_NOTICE, "initializing "GLOBAL_PRODUCT_NAME" "PROGRAM_NAME" "GLOBAL_VERSION);
     
     // clear password contents pointer
@@ -327,6 +393,14 @@ int main (int argc, char **argv)
         goto fail1;
     }
     
+#ifdef TUN2SOCKS_TUN_QUEUES
+    // spawn a worker process for each additional device queue
+    if (!spawn_queue_workers()) {
+        BLog(BLOG_ERROR, "failed to spawn queue workers");
+        goto fail1;
+    }
+#endif
+    
     // init time
     BTime_Init();
     
@@ -347,24 +421,51 @@ int main (int argc, char **argv)
     }
 #endif
     
-    // init TUN device
-    if (!BTap_Init(&device, &ss, options.tundev, device_error_handler, NULL, 1)) {
-        BLog(BLOG_ERROR, "BTap_Init failed");
+#ifndef BADVPN_USE_WINAPI
+    // init metrics server
+    if (options.metrics_socket && !init_metrics_server()) {
         goto fail3;
     }
+#endif
+    
+    // init TUN device
+    struct BTap_init_data init_data;
+    init_data.dev_type = BTAP_DEV_TUN;
+    init_data.init_type = BTAP_INIT_STRING;
+    init_data.init.string = options.tundev;
+    init_data.multi_queue = (options.tun_queues > 1);
+    init_data.batch_size = options.tun_batch_size;
+    if (!BTap_Init2(&device, &ss, init_data, device_error_handler, NULL)) {
+        BLog(BLOG_ERROR, "BTap_Init2 failed");
+        goto fail3a;
+    }
     
     // NOTE: the order of the following is important:
     // first device writing must evaluate,
     // then lwip (so it can send packets to the device),
     // then device reading (so it can pass received packets to lwip).
     
-    // init device reading
-    PacketPassInterface_Init(&device_read_interface, BTap_GetMTU(&device), device_read_handler_send, NULL, BReactor_PendingGroup(&ss));
-    if (!SinglePacketBuffer_Init(&device_read_buffer, BTap_GetOutput(&device), &device_read_interface, BReactor_PendingGroup(&ss))) {
-        BLog(BLOG_ERROR, "SinglePacketBuffer_Init failed");
+    // init device reading pool
+    if (BTap_GetMTU(&device) > UINT16_MAX) {
+        BLog(BLOG_ERROR, "device MTU is too large");
+        goto fail4;
+    }
+    if (!PbufPool_Init(&device_read_pool, BTap_GetMTU(&device), options.tun_batch_size + DEVICE_READ_POOL_SIZE)) {
+        BLog(BLOG_ERROR, "PbufPool_Init failed");
         goto fail4;
     }
     
+    // allocate buffer for reading when the pool is exhausted
+    if (!(device_read_copy_buf = (uint8_t *)BAlloc(BTap_GetMTU(&device)))) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        goto fail4b;
+    }
+    
+    // init device reading
+    BTap_EnableBatchRecv(&device, device_read_handler, NULL);
+    device_read_num_posted = 0;
+    device_read_post();
+    
     if (options.udpgw_remote_server_addr) {
         // compute maximum UDP payload size we need to pass through udpgw
         udp_mtu = BTap_GetMTU(&device) - (int)(sizeof(struct ipv4_header) + sizeof(struct udp_header));
@@ -462,10 +563,21 @@ fail5:
         SocksUdpGwClient_Free(&udpgw_client);
     }
 fail4a:
-    SinglePacketBuffer_Free(&device_read_buffer);
+    // the device must be done with the read buffers before they are freed
+    BTap_Free(&device);
+    BFree(device_read_copy_buf);
+    PbufPool_Free(&device_read_pool);
+    goto fail3a;
+fail4b:
+    PbufPool_Free(&device_read_pool);
 fail4:
-    PacketPassInterface_Free(&device_read_interface);
     BTap_Free(&device);
+fail3a:
+#ifndef BADVPN_USE_WINAPI
+    if (options.metrics_socket) {
+        BMetricsServer_Free(&metrics_server);
+    }
+#endif
 fail3:
 #ifndef TARGET_LIBTSOCKS
     BSignal_Finish();
@@ -473,6 +585,9 @@ fail3:
 fail2:
     BReactor_Free(&ss);
 fail1:
+#ifdef TUN2SOCKS_TUN_QUEUES
+    reap_queue_workers();
+#endif
     BFree(password_file_contents);
     BLog(BLOG_NOTICE, "exiting");
     BLog_Free();
@@ -508,10 +623,20 @@ void print_help (const char *name)
         "            [--syslog-facility <string>]\n"
         "            [--syslog-ident <string>]\n"
         "        )\n"
+        "        [--logger-async]\n"
         #endif
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
+        #ifndef BADVPN_USE_WINAPI
+        "        [--metrics-socket <path>]\n"
+        #endif
         "        [--tundev <name>]\n"
+#ifdef TUN2SOCKS_TUN_QUEUES
+        "        [--tun-queues <number>]\n"
+#endif
+#ifndef BADVPN_USE_WINAPI
+        "        [--tun-batch-size <number>]\n"
+#endif
         "        --netif-ipaddr <ipaddr>\n"
         "        --netif-netmask <ipnetmask>\n"
         "        --socks-server-addr <addr>\n"
@@ -551,6 +676,8 @@ int parse_arguments (int argc, char *argv[])
     #ifndef BADVPN_USE_WINAPI
     options.logger_syslog_facility = "daemon";
     options.logger_syslog_ident = argv[0];
+    options.logger_async = 0;
+    options.metrics_socket = NULL;
     #endif
     options.loglevel = -1;
     for (int i = 0; i < BLOG_NUM_CHANNELS; i++) {
@@ -569,6 +696,8 @@ int parse_arguments (int argc, char *argv[])
     options.udpgw_max_connections = DEFAULT_UDPGW_MAX_CONNECTIONS;
     options.udpgw_connection_buffer_size = DEFAULT_UDPGW_CONNECTION_BUFFER_SIZE;
     options.udpgw_transparent_dns = 0;
+    options.tun_queues = 1;
+    options.tun_batch_size = DEFAULT_TUN_BATCH_SIZE;
     
     int i;
     for (i = 1; i < argc; i++) {
@@ -616,6 +745,17 @@ int parse_arguments (int argc, char *argv[])
             options.logger_syslog_ident = argv[i + 1];
             i++;
         }
+        else if (!strcmp(arg, "--logger-async")) {
+            options.logger_async = 1;
+        }
+        else if (!strcmp(arg, "--metrics-socket")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.metrics_socket = argv[i + 1];
+            i++;
+        }
         #endif
         else if (!strcmp(arg, "--loglevel")) {
             if (1 >= argc - i) {
@@ -654,6 +794,32 @@ int parse_arguments (int argc, char *argv[])
             options.tundev = argv[i + 1];
             i++;
         }
+#ifdef TUN2SOCKS_TUN_QUEUES
+        else if (!strcmp(arg, "--tun-queues")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.tun_queues = atoi(argv[i + 1])) <= 0 || options.tun_queues > TUN2SOCKS_MAX_TUN_QUEUES) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+#endif
+#ifndef BADVPN_USE_WINAPI
+        else if (!strcmp(arg, "--tun-batch-size")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.tun_batch_size = atoi(argv[i + 1])) <= 0 || options.tun_batch_size > TUN2SOCKS_MAX_TUN_BATCH_SIZE) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+#endif
         else if (!strcmp(arg, "--netif-ipaddr")) {
             if (1 >= argc - i) {
                 fprintf(stderr, "%s: requires an argument\n", arg);
@@ -794,6 +960,11 @@ int parse_arguments (int argc, char *argv[])
         }
     }
     
+    if (options.tun_queues > 1 && !options.tundev) {
+        fprintf(stderr, "--tun-queues requires --tundev\n");
+        return 0;
+    }
+    
     return 1;
 }
 
@@ -884,6 +1055,101 @@ void signal_handler (void *unused)
     terminate();
 }
 
+#ifndef BADVPN_USE_WINAPI
+
+int init_metrics_server (void)
+{
+    const char *path = options.metrics_socket;
+    char *worker_path = NULL;
+    
+#ifdef TUN2SOCKS_TUN_QUEUES
+    // queue workers have metrics of their own; serve them on the
+    // socket path with the queue number appended
+    if (queue_index > 0) {
+        if (!(worker_path = malloc(strlen(path) + 16))) {
+            BLog(BLOG_ERROR, "malloc failed");
+            return 0;
+        }
+        sprintf(worker_path, "%s.%d", path, queue_index);
+        path = worker_path;
+    }
+#endif
+    
+    int res = BMetricsServer_Init(&metrics_server, path, &ss);
+    if (!res) {
+        BLog(BLOG_ERROR, "BMetricsServer_Init failed");
+    }
+    
+    free(worker_path);
+    return res;
+}
+
+#endif
+
+#ifdef TUN2SOCKS_TUN_QUEUES
+
+int spawn_queue_workers (void)
+{
+    queue_index = 0;
+    num_queue_workers = 0;
+    
+    if (options.tun_queues == 1) {
+        return 1;
+    }
+    
+    // Each queue is served by a separate process with its own reactor, lwIP
+    // instance and SOCKS/udpgw clients; lwIP keeps its state in globals, so
+    // it cannot be instantiated more than once per process. The kernel steers
+    // packets to queues by flow hash, so a connection always stays with one
+    // process.
+    
+    pid_t parent_pid = getpid();
+    
+    // don't let the workers inherit buffered log output
+    fflush(NULL);
+    
+    for (int i = 1; i < options.tun_queues; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            BLog(BLOG_ERROR, "fork failed");
+            reap_queue_workers();
+            return 0;
+        }
+        
+        if (pid == 0) {
+            queue_index = i;
+            num_queue_workers = 0;
+            
+            // exit when the main process goes away
+            if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0 || getppid() != parent_pid) {
+                _exit(1);
+            }
+            
+            BLog(BLOG_NOTICE, "serving device queue %d", queue_index);
+            return 1;
+        }
+        
+        queue_worker_pids[num_queue_workers++] = pid;
+    }
+    
+    return 1;
+}
+
+void reap_queue_workers (void)
+{
+    for (int i = 0; i < num_queue_workers; i++) {
+        kill(queue_worker_pids[i], SIGTERM);
+    }
+    
+    for (int i = 0; i < num_queue_workers; i++) {
+        while (waitpid(queue_worker_pids[i], NULL, 0) < 0 && errno == EINTR);
+    }
+    
+    num_queue_workers = 0;
+}
+
+#endif
+
 BAddr baddr_from_lwip (int is_ipv6, const ipX_addr_t *ipx_addr, uint16_t port_hostorder)
 {
     BAddr addr;
@@ -1020,40 +1286,72 @@ void device_error_handler (void *unused)
     return;
 }
 
-void device_read_handler_send (void *unused, uint8_t *data, int data_len)
+void device_read_post (void)
+{
+    // give the device as many buffers from the pool as it takes
+    while (device_read_num_posted < options.tun_batch_size) {
+        uint8_t *buf = PbufPool_Get(&device_read_pool);
+        if (!buf) {
+            break;
+        }
+        BTap_BatchRecvPost(&device, buf);
+        device_read_num_posted++;
+    }
+    
+    // if the pool is exhausted, read into the copy buffer
+    if (device_read_num_posted == 0) {
+        BTap_BatchRecvPost(&device, device_read_copy_buf);
+        device_read_num_posted++;
+    }
+}
+
+void device_read_handler (void *unused, uint8_t *data, int data_len)
 {
     ASSERT(!quitting)
+    ASSERT(device_read_num_posted > 0)
     ASSERT(data_len >= 0)
+    ASSERT(data_len <= BTap_GetMTU(&device))
     
     BLog(BLOG_DEBUG, "device: received packet");
     
-    // accept packet
-    PacketPassInterface_Done(&device_read_interface);
+    device_read_num_posted--;
+    
+    int is_copy_buf = (data == device_read_copy_buf);
     
-    // process UDP directly
+    // process UDP directly; the packet has been copied, so reuse the buffer
     if (process_device_udp_packet(data, data_len)) {
-        return;
+        if (!is_copy_buf) {
+            PbufPool_Release(&device_read_pool, data);
+        }
+        goto out;
     }
     
-    // obtain pbuf
-    if (data_len > UINT16_MAX) {
-        BLog(BLOG_WARNING, "device read: packet too large");
-        return;
-    }
-    struct pbuf *p = pbuf_alloc(PBUF_RAW, data_len, PBUF_POOL);
-    if (!p) {
-        BLog(BLOG_WARNING, "device read: pbuf_alloc failed");
-        return;
-    }
+    struct pbuf *p;
     
-    // write packet to pbuf
-    ASSERT_FORCE(pbuf_take(p, data, data_len) == ERR_OK)
+    if (is_copy_buf) {
+        // the pool is exhausted, copy the packet to a new pbuf
+        p = pbuf_alloc(PBUF_RAW, data_len, PBUF_POOL);
+        if (!p) {
+            BLog(BLOG_WARNING, "device read: pbuf_alloc failed");
+            BMetric_Add(&metric_device_pbuf_alloc_failures, 1);
+            goto out;
+        }
+        ASSERT_FORCE(pbuf_take(p, data, data_len) == ERR_OK)
+    } else {
+        // pass the buffer itself to lwIP; it returns to the pool
+        // when lwIP frees the pbuf
+        p = PbufPool_Wrap(&device_read_pool, data, data_len);
+    }
     
     // pass pbuf to input
     if (netif.input(p, &netif) != ERR_OK) {
         BLog(BLOG_WARNING, "device read: input failed");
+        BMetric_Add(&metric_device_input_failures, 1);
         pbuf_free(p);
     }
+    
+out:
+    device_read_post();
 }
 
 int process_device_udp_packet (uint8_t *data, int data_len)
@@ -1203,14 +1501,15 @@ err_t netif_output_ip6_func (struct netif *netif, struct pbuf *p, ip6_addr_t *ip
 
 err_t common_netif_output (struct netif *netif, struct pbuf *p)
 {
-    SYNC_DECL
-    
     BLog(BLOG_DEBUG, "device write: send packet");
     
     if (quitting) {
         return ERR_OK;
     }
     
+    // NOTE: sending is not synchronized, so that when batching, packets
+    // sent by lwIP get submitted to the device together after it returns.
+    
     // if there is just one chunk, send it directly, else via buffer
     if (!p->next) {
         if (p->len > BTap_GetMTU(&device)) {
@@ -1218,9 +1517,7 @@ err_t common_netif_output (struct netif *netif, struct pbuf *p)
             goto out;
         }
         
-        SYNC_FROMHERE
         BTap_Send(&device, (uint8_t *)p->payload, p->len);
-        SYNC_COMMIT
     } else {
         int len = 0;
         do {
@@ -1232,9 +1529,7 @@ err_t common_netif_output (struct netif *netif, struct pbuf *p)
             len += p->len;
         } while (p = p->next);
         
-        SYNC_FROMHERE
         BTap_Send(&device, device_write_buf, len);
-        SYNC_COMMIT
     }
     
 out:
@@ -1273,7 +1568,7 @@ void client_logfunc (struct tcp_client *client)
     BLog_Append("%05d (%s %s): ", num_clients, local_addr_s, remote_addr_s);
 }
 
-void client_log (struct tcp_client *client, int level, const char *fmt, ...)
+void client_log_message (struct tcp_client *client, int level, const char *fmt, ...)
 {
     va_list vl;
     va_start(vl, fmt);
@@ -1323,6 +1618,7 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
     }
     
     // init SOCKS
+    client->socks_start_time = BMetrics_Now();
     if (!BSocksClient_Init(&client->socks_client, socks_server_addr, socks_auth_info, socks_num_auth_info,
                            addr, (BSocksClient_handler)client_socks_handler, client, &ss)) {
         BLog(BLOG_ERROR, "listener accept: BSocksClient_Init failed");
@@ -1339,12 +1635,14 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
     // increment counter
     ASSERT(num_clients >= 0)
     num_clients++;
+    BMetric_Add(&metric_clients, 1);
     
     // set pcb
     client->pcb = newpcb;
     
     // set client not closed
     client->client_closed = 0;
+    client->client_eof = 0;
     
     // setup handler argument
     tcp_arg(client->pcb, client);
@@ -1354,6 +1652,7 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
     tcp_recv(client->pcb, client_recv_func);
     
     // setup buffer
+    client->buf_start = 0;
     client->buf_used = 0;
     
     // set SOCKS not up, not closed
@@ -1456,7 +1755,7 @@ void client_free_socks (struct tcp_client *client)
     client->socks_closed = 1;
     
     // if we have data to be sent to the client and we can send it, keep sending
-    if (client->socks_up && (client->socks_recv_buf_used >= 0 || client->socks_recv_tcp_pending > 0) && !client->client_closed) {
+    if (client->socks_up && client->socks_recv_buf_used > 0 && !client->client_closed) {
         client_log(client, BLOG_INFO, "waiting until buffered data is sent to client");
     } else {
         if (!client->client_closed) {
@@ -1507,6 +1806,7 @@ void client_dealloc (struct tcp_client *client)
     // decrement counter
     ASSERT(num_clients > 0)
     num_clients--;
+    BMetric_Sub(&metric_clients, 1);
     
     // remove client entry
     LinkedList1_Remove(&tcp_clients, &client->list_node);
@@ -1539,10 +1839,26 @@ err_t client_recv_func (void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t e
     
     if (!p) {
         client_log(client, BLOG_INFO, "client closed");
+        
+        // lwIP references queued data in socks_recv_buf until it is acknowledged,
+        // so keep the pcb until then (see client_sent_func)
+        if (client->socks_up && client->socks_recv_tcp_pending > 0) {
+            client_log(client, BLOG_INFO, "waiting until queued data is acknowledged by client");
+            
+            // drop data not yet queued, like we would by closing now
+            client->socks_recv_buf_used = client->socks_recv_tcp_pending;
+            
+            // set client EOF
+            client->client_eof = 1;
+            
+            return ERR_OK;
+        }
+        
         client_free_client(client);
         return ERR_ABRT;
     }
     
+    ASSERT(!client->client_eof)
     ASSERT(p->tot_len > 0)
     
     // check if we have enough buffer
@@ -1551,8 +1867,11 @@ err_t client_recv_func (void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t e
         return ERR_MEM;
     }
     
-    // copy data to buffer
-    ASSERT_EXECUTE(pbuf_copy_partial(p, client->buf + client->buf_used, p->tot_len, 0) == p->tot_len)
+    // copy data to buffer, wrapping around its end
+    int write_pos = (client->buf_start + client->buf_used) % sizeof(client->buf);
+    int first_len = bmin_int(p->tot_len, sizeof(client->buf) - write_pos);
+    ASSERT_EXECUTE(pbuf_copy_partial(p, client->buf + write_pos, first_len, 0) == first_len)
+    ASSERT_EXECUTE(pbuf_copy_partial(p, client->buf, p->tot_len - first_len, first_len) == p->tot_len - first_len)
     client->buf_used += p->tot_len;
     
     // if there was nothing in the buffer before, and SOCKS is up, start send data
@@ -1584,6 +1903,10 @@ void client_socks_handler (struct tcp_client *client, int event)
         case BSOCKSCLIENT_EVENT_ERROR: {
             client_log(client, BLOG_INFO, "SOCKS error");
             
+            if (!client->socks_up) {
+                BMetric_Add(&metric_socks_connect_failures, 1);
+            }
+            
             client_free_socks(client);
         } break;
         
@@ -1592,6 +1915,8 @@ void client_socks_handler (struct tcp_client *client, int event)
             
             client_log(client, BLOG_INFO, "SOCKS up");
             
+            BMetric_Observe(&metric_socks_connect_time, BMetrics_Now() - client->socks_start_time);
+            
             // init sending
             client->socks_send_if = BSocksClient_GetSendInterface(&client->socks_client);
             StreamPassInterface_Sender_Init(client->socks_send_if, (StreamPassInterface_handler_done)client_socks_send_handler_done, client);
@@ -1599,7 +1924,9 @@ void client_socks_handler (struct tcp_client *client, int event)
             // init receiving
             client->socks_recv_if = BSocksClient_GetRecvInterface(&client->socks_client);
             StreamRecvInterface_Receiver_Init(client->socks_recv_if, (StreamRecvInterface_handler_done)client_socks_recv_handler_done, client);
-            client->socks_recv_buf_used = -1;
+            client->socks_recv_buf_start = 0;
+            client->socks_recv_buf_used = 0;
+            client->socks_recv_active = 0;
             client->socks_recv_tcp_pending = 0;
             if (!client->client_closed) {
                 tcp_sent(client->pcb, client_sent_func);
@@ -1638,8 +1965,9 @@ void client_send_to_socks (struct tcp_client *client)
     ASSERT(client->socks_up)
     ASSERT(client->buf_used > 0)
     
-    // schedule sending
-    StreamPassInterface_Sender_Send(client->socks_send_if, client->buf, client->buf_used);
+    // schedule sending, up to the end of the buffer
+    int data_len = bmin_int(client->buf_used, sizeof(client->buf) - client->buf_start);
+    StreamPassInterface_Sender_Send(client->socks_send_if, client->buf + client->buf_start, data_len);
 }
 
 void client_socks_send_handler_done (struct tcp_client *client, int data_len)
@@ -1649,9 +1977,10 @@ void client_socks_send_handler_done (struct tcp_client *client, int data_len)
     ASSERT(client->buf_used > 0)
     ASSERT(data_len > 0)
     ASSERT(data_len <= client->buf_used)
+    ASSERT(data_len <= sizeof(client->buf) - client->buf_start)
     
     // remove sent data from buffer
-    memmove(client->buf, client->buf + data_len, client->buf_used - data_len);
+    client->buf_start = (client->buf_start + data_len) % sizeof(client->buf);
     client->buf_used -= data_len;
     
     if (!client->client_closed) {
@@ -1661,7 +1990,7 @@ void client_socks_send_handler_done (struct tcp_client *client, int data_len)
     
     if (client->buf_used > 0) {
         // send any further data
-        StreamPassInterface_Sender_Send(client->socks_send_if, client->buf, client->buf_used);
+        client_send_to_socks(client);
     }
     else if (client->client_closed) {
         // client was closed we've sent everything we had buffered; we're done with it
@@ -1674,38 +2003,46 @@ void client_socks_send_handler_done (struct tcp_client *client, int data_len)
 void client_socks_recv_initiate (struct tcp_client *client)
 {
     ASSERT(!client->client_closed)
+    ASSERT(!client->client_eof)
     ASSERT(!client->socks_closed)
     ASSERT(client->socks_up)
-    ASSERT(client->socks_recv_buf_used == -1)
+    ASSERT(!client->socks_recv_active)
+    ASSERT(client->socks_recv_buf_used < sizeof(client->socks_recv_buf))
+    
+    // receive into the free space after the buffered data, up to the end of the buffer
+    int write_pos = (client->socks_recv_buf_start + client->socks_recv_buf_used) % sizeof(client->socks_recv_buf);
+    int avail = (write_pos < client->socks_recv_buf_start ? client->socks_recv_buf_start : sizeof(client->socks_recv_buf)) - write_pos;
     
-    StreamRecvInterface_Receiver_Recv(client->socks_recv_if, client->socks_recv_buf, sizeof(client->socks_recv_buf));
+    client->socks_recv_active = 1;
+    
+    StreamRecvInterface_Receiver_Recv(client->socks_recv_if, client->socks_recv_buf + write_pos, avail);
 }
 
 void client_socks_recv_handler_done (struct tcp_client *client, int data_len)
 {
     ASSERT(data_len > 0)
-    ASSERT(data_len <= sizeof(client->socks_recv_buf))
+    ASSERT(data_len <= sizeof(client->socks_recv_buf) - client->socks_recv_buf_used)
     ASSERT(!client->socks_closed)
     ASSERT(client->socks_up)
-    ASSERT(client->socks_recv_buf_used == -1)
+    ASSERT(client->socks_recv_active)
+    
+    client->socks_recv_active = 0;
     
     // if client was closed, stop receiving
-    if (client->client_closed) {
+    if (client->client_closed || client->client_eof) {
         return;
     }
     
-    // set amount of data in buffer
-    client->socks_recv_buf_used = data_len;
-    client->socks_recv_buf_sent = 0;
-    client->socks_recv_waiting = 0;
+    // add data to buffer
+    client->socks_recv_buf_used += data_len;
     
     // send to client
     if (client_socks_recv_send_out(client) < 0) {
         return;
     }
     
-    // continue receiving if needed
-    if (client->socks_recv_buf_used == -1) {
+    // continue receiving if there is space
+    if (client->socks_recv_buf_used < sizeof(client->socks_recv_buf)) {
         client_socks_recv_initiate(client);
     }
 }
@@ -1713,21 +2050,24 @@ void client_socks_recv_handler_done (struct tcp_client *client, int data_len)
 int client_socks_recv_send_out (struct tcp_client *client)
 {
     ASSERT(!client->client_closed)
+    ASSERT(!client->client_eof)
     ASSERT(client->socks_up)
-    ASSERT(client->socks_recv_buf_used > 0)
-    ASSERT(client->socks_recv_buf_sent < client->socks_recv_buf_used)
-    ASSERT(!client->socks_recv_waiting)
+    ASSERT(client->socks_recv_tcp_pending < client->socks_recv_buf_used)
     
     // return value -1 means tcp_abort() was done,
     // 0 means it wasn't and the client (pcb) is still up
     
     do {
-        int to_write = bmin_int(client->socks_recv_buf_used - client->socks_recv_buf_sent, tcp_sndbuf(client->pcb));
+        int pos = (client->socks_recv_buf_start + client->socks_recv_tcp_pending) % sizeof(client->socks_recv_buf);
+        int to_write = bmin_int(client->socks_recv_buf_used - client->socks_recv_tcp_pending, sizeof(client->socks_recv_buf) - pos);
+        to_write = bmin_int(to_write, tcp_sndbuf(client->pcb));
         if (to_write == 0) {
             break;
         }
         
-        err_t err = tcp_write(client->pcb, client->socks_recv_buf + client->socks_recv_buf_sent, to_write, TCP_WRITE_FLAG_COPY);
+        // The data is not copied; lwIP references it until it is acknowledged,
+        // and it stays in the buffer until then (see client_sent_func).
+        err_t err = tcp_write(client->pcb, client->socks_recv_buf + pos, to_write, 0);
         if (err != ERR_OK) {
             if (err == ERR_MEM) {
                 break;
@@ -1739,9 +2079,8 @@ int client_socks_recv_send_out (struct tcp_client *client)
             return -1;
         }
         
-        client->socks_recv_buf_sent += to_write;
         client->socks_recv_tcp_pending += to_write;
-    } while (client->socks_recv_buf_sent < client->socks_recv_buf_used);
+    } while (client->socks_recv_tcp_pending < client->socks_recv_buf_used);
     
     // start sending now
     err_t err = tcp_output(client->pcb);
@@ -1753,7 +2092,7 @@ int client_socks_recv_send_out (struct tcp_client *client)
     }
     
     // more data to queue?
-    if (client->socks_recv_buf_sent < client->socks_recv_buf_used) {
+    if (client->socks_recv_tcp_pending < client->socks_recv_buf_used) {
         if (client->socks_recv_tcp_pending == 0) {
             client_log(client, BLOG_ERROR, "can't queue data, but all data was confirmed !?!");
             
@@ -1761,14 +2100,9 @@ int client_socks_recv_send_out (struct tcp_client *client)
             return -1;
         }
         
-        // set waiting, continue in client_sent_func
-        client->socks_recv_waiting = 1;
-        return 0;
+        // continue in client_sent_func
     }
     
-    // everything was queued
-    client->socks_recv_buf_used = -1;
-    
     return 0;
 }
 
@@ -1781,17 +2115,23 @@ err_t client_sent_func (void *arg, struct tcp_pcb *tpcb, u16_t len)
     ASSERT(len > 0)
     ASSERT(len <= client->socks_recv_tcp_pending)
     
-    // decrement pending
+    // acknowledged data is no longer referenced by lwIP, remove it from buffer
     client->socks_recv_tcp_pending -= len;
+    client->socks_recv_buf_start = (client->socks_recv_buf_start + len) % sizeof(client->socks_recv_buf);
+    client->socks_recv_buf_used -= len;
+    
+    // client closed and we were only waiting for queued data to be acknowledged?
+    if (client->client_eof) {
+        if (client->socks_recv_tcp_pending == 0) {
+            client_log(client, BLOG_INFO, "removing after queued data was acknowledged");
+            client_free_client(client);
+            return ERR_ABRT;
+        }
+        return ERR_OK;
+    }
     
     // continue queuing
-    if (client->socks_recv_buf_used > 0) {
-        ASSERT(client->socks_recv_waiting)
-        ASSERT(client->socks_recv_buf_sent < client->socks_recv_buf_used)
-        
-        // set not waiting
-        client->socks_recv_waiting = 0;
-        
+    if (client->socks_recv_tcp_pending < client->socks_recv_buf_used) {
         // possibly send more data
         if (client_socks_recv_send_out(client) < 0) {
             return ERR_ABRT;
@@ -1799,25 +2139,23 @@ err_t client_sent_func (void *arg, struct tcp_pcb *tpcb, u16_t len)
         
         // we just queued some data, so it can't have been confirmed yet
         ASSERT(client->socks_recv_tcp_pending > 0)
-        
-        // continue receiving if needed
-        if (client->socks_recv_buf_used == -1 && !client->socks_closed) {
-            SYNC_DECL
-            SYNC_FROMHERE
-            client_socks_recv_initiate(client);
-            DEAD_ENTER(client->dead_client)
-            SYNC_COMMIT
-            DEAD_LEAVE2(client->dead_client)
-            if (DEAD_KILLED) {
-                return ERR_ABRT;
-            }
+    }
+    
+    // continue receiving if it was stopped for lack of space
+    if (!client->socks_closed && !client->socks_recv_active && client->socks_recv_buf_used < sizeof(client->socks_recv_buf)) {
+        SYNC_DECL
+        SYNC_FROMHERE
+        client_socks_recv_initiate(client);
+        DEAD_ENTER(client->dead_client)
+        SYNC_COMMIT
+        DEAD_LEAVE2(client->dead_client)
+        if (DEAD_KILLED) {
+            return ERR_ABRT;
         }
-        
-        return ERR_OK;
     }
     
     // have we sent everything after SOCKS was closed?
-    if (client->socks_closed && client->socks_recv_tcp_pending == 0) {
+    if (client->socks_closed && client->socks_recv_buf_used == 0) {
         client_log(client, BLOG_INFO, "removing after SOCKS went down");
         client_free_client(client);
         return ERR_ABRT;
@@ -27,8 +27,9 @@
 // name of the program
 #define PROGRAM_NAME "tun2socks"
 
-// size of temporary buffer for passing data from the SOCKS server to TCP for sending
-#define CLIENT_SOCKS_RECV_BUF_SIZE 8192
+// size of buffer for passing data from the SOCKS server to TCP for sending;
+// lwIP references data in it until acknowledged, so it should be at least TCP_SND_BUF
+#define CLIENT_SOCKS_RECV_BUF_SIZE 32768
 
 // maximum number of udpgw connections
 #define DEFAULT_UDPGW_MAX_CONNECTIONS 256
@@ -42,5 +43,15 @@
 // udpgw keepalive sending interval
 #define UDPGW_KEEPALIVE_TIME 10000
 
+// maximum number of device queues (--tun-queues), same as the kernel's limit
+#define TUN2SOCKS_MAX_TUN_QUEUES 256
+
+// maximum number of buffers held by lwIP for passing packets from the device without copying
+#define DEVICE_READ_POOL_SIZE 512
+
+// default and maximum number of packets to read from or write to the device per batch (--tun-batch-size)
+#define DEFAULT_TUN_BATCH_SIZE 1
+#define TUN2SOCKS_MAX_TUN_BATCH_SIZE 256
+
 // option to override the destination addresses to give the SOCKS server
 //#define OVERRIDE_DEST_ADDR "10.111.0.2:2000"
@@ -65,15 +65,27 @@
     #endif
 #endif
 
+#include <misc/balloc.h>
 #include <base/BLog.h>
+#include <base/BMetrics.h>
 
 #include <tuntap/BTap.h>
 
 #include <generated/blog_channel_BTap.h>
 
+static BMetric metric_read_packets = BMETRIC_COUNTER_INIT("badvpn_tap_read_packets_total", "Packets read from the TUN/TAP device.");
+static BMetric metric_read_bytes = BMETRIC_COUNTER_INIT("badvpn_tap_read_bytes_total", "Bytes read from the TUN/TAP device.");
+
+static void count_read (int bytes);
 static void report_error (BTap *o);
 static void output_handler_recv (BTap *o, uint8_t *data);
 
+static void count_read (int bytes)
+{
+    BMetric_Add(&metric_read_packets, 1);
+    BMetric_Add(&metric_read_bytes, bytes);
+}
+
 #ifdef BADVPN_USE_WINAPI
 
 static void recv_olap_handler (BTap *o, int event, DWORD bytes)
@@ -82,6 +94,8 @@ static void recv_olap_handler (BTap *o, int event, DWORD bytes)
     ASSERT(o->output_packet)
     ASSERT(event == BREACTOR_IOCP_EVENT_SUCCEEDED || event == BREACTOR_IOCP_EVENT_FAILED)
     
+    uint8_t *data = o->output_packet;
+    
     // set no output packet
     o->output_packet = NULL;
     
@@ -94,10 +108,33 @@ static void recv_olap_handler (BTap *o, int event, DWORD bytes)
     ASSERT(bytes >= 0)
     ASSERT(bytes <= o->frame_mtu)
     
+    count_read(bytes);
+    
+    // return buffer to batch receiver
+    if (o->batch_recv_handler) {
+        o->batch_recv_handler(o->batch_recv_user, data, bytes);
+        return;
+    }
+    
     // done
     PacketRecvInterface_Done(&o->output, bytes);
 }
 
+static void start_read (BTap *o, uint8_t *data)
+{
+    memset(&o->recv_olap.olap, 0, sizeof(o->recv_olap.olap));
+    
+    // read
+    BOOL res = ReadFile(o->device, data, o->frame_mtu, NULL, &o->recv_olap.olap);
+    if (res == FALSE && GetLastError() != ERROR_IO_PENDING) {
+        BLog(BLOG_ERROR, "ReadFile failed (%u)", GetLastError());
+        report_error(o);
+        return;
+    }
+    
+    o->output_packet = data;
+}
+
 #else
 
 #ifdef __APPLE__
@@ -148,6 +185,490 @@ static int read_tun_header (int fd, void *buf, size_t len)
 
 #endif
 
+static int read_packet (BTap *o, uint8_t *data)
+{
+#ifdef __APPLE__
+    return read_tun_header(o->fd, data, o->frame_mtu);
+#else
+    return read(o->fd, data, o->frame_mtu);
+#endif
+}
+
+static void set_read_events (BTap *o, int enabled)
+{
+    int events = (enabled ? (o->poll_events | BREACTOR_READ) : (o->poll_events & ~BREACTOR_READ));
+    
+    if (events != o->poll_events) {
+        o->poll_events = events;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->poll_events);
+    }
+}
+
+static void batch_read (BTap *o)
+{
+    ASSERT(o->batch_recv_handler)
+    ASSERT(!o->in_batch_read)
+    
+    o->in_batch_read = 1;
+    
+    for (int i = 0; i < o->batch_size; i++) {
+        // stop waiting for the device if we have no buffers
+        if (o->recv_queue_count == 0) {
+            set_read_events(o, 0);
+            goto out;
+        }
+        
+        uint8_t *data = o->recv_queue[o->recv_queue_start];
+        
+        // try reading into the next buffer
+        int bytes = read_packet(o, data);
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // retry when the device is readable
+                set_read_events(o, 1);
+                goto out;
+            }
+            // report fatal error
+            o->in_batch_read = 0;
+            report_error(o);
+            return;
+        }
+        
+        ASSERT_FORCE(bytes <= o->frame_mtu)
+        
+        // remove buffer from queue
+        o->recv_queue_start = (o->recv_queue_start + 1) % o->batch_size;
+        o->recv_queue_count--;
+        
+        count_read(bytes);
+        
+        // return buffer to user, who will likely post another one
+        o->batch_recv_handler(o->batch_recv_user, data, bytes);
+    }
+    
+    // batch is full; continue from a job so that other events get a chance
+    if (o->recv_queue_count > 0) {
+        BPending_Set(&o->recv_job);
+    }
+    
+out:
+    o->in_batch_read = 0;
+}
+
+#ifdef BADVPN_USE_IO_URING
+
+#define URING_OP_RECV 1
+#define URING_OP_SEND 2
+#define URING_OP_CANCEL 3
+
+#define RECV_SLOT_FREE 1
+#define RECV_SLOT_INFLIGHT 2
+#define RECV_SLOT_DONE 3
+
+static uint64_t uring_user_data (int op, int slot)
+{
+    return ((uint64_t)op << 32) | (uint32_t)slot;
+}
+
+static void uring_prep_recv (BTap *o, int slot)
+{
+    struct BTap_recv_slot *s = &o->recv_slots[slot];
+    
+    struct io_uring_sqe *sqe = BIoUring_GetSqe(&o->uring);
+    ASSERT_FORCE(sqe)
+    
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = o->fd;
+    sqe->addr = (uintptr_t)s->data;
+    sqe->len = o->frame_mtu;
+    sqe->user_data = uring_user_data(URING_OP_RECV, slot);
+    
+    s->state = RECV_SLOT_INFLIGHT;
+    
+    BPending_Set(&o->submit_job);
+}
+
+static void uring_harvest (BTap *o)
+{
+    struct io_uring_cqe *cqe;
+    
+    while ((cqe = BIoUring_PeekCqe(&o->uring))) {
+        int op = cqe->user_data >> 32;
+        int slot = (uint32_t)cqe->user_data;
+        int res = cqe->res;
+        
+        BIoUring_SeenCqe(&o->uring);
+        
+        switch (op) {
+            case URING_OP_RECV: {
+                ASSERT(slot >= 0)
+                ASSERT(slot < o->batch_size)
+                ASSERT(o->recv_slots[slot].state == RECV_SLOT_INFLIGHT)
+                
+                // no packet after all, read again
+                if (res == -EAGAIN || res == -EINTR) {
+                    uring_prep_recv(o, slot);
+                    break;
+                }
+                
+                // queue the result for reporting
+                o->recv_slots[slot].state = RECV_SLOT_DONE;
+                o->recv_slots[slot].result = res;
+                o->recv_done[(o->recv_done_start + o->recv_done_count) % o->batch_size] = slot;
+                o->recv_done_count++;
+            } break;
+            
+            case URING_OP_SEND: {
+                ASSERT(slot >= 0)
+                ASSERT(slot < o->batch_size)
+                ASSERT(o->send_inflight > 0)
+                
+                // malformed packets will cause errors, ignore them
+                if (res >= 0 && res != o->send_lens[slot]) {
+                    BLog(BLOG_WARNING, "written %d expected %d", res, o->send_lens[slot]);
+                }
+                
+                // release send buffer
+                o->send_free[o->send_free_count++] = slot;
+                
+                // write packets queued in the meantime once the chain is done
+                if (--o->send_inflight == 0 && o->send_queue_count > 0) {
+                    BPending_Set(&o->submit_job);
+                }
+            } break;
+            
+            default:
+                ASSERT(op == URING_OP_CANCEL)
+        }
+    }
+}
+
+static void uring_prep_sends (BTap *o)
+{
+    // Writes in separate submissions may complete in any order, so only one
+    // chain of writes is in flight at a time. Within the chain, each write
+    // starts when the previous one is done. Hard links keep the chain going
+    // when a malformed packet fails.
+    if (o->send_inflight > 0) {
+        return;
+    }
+    
+    while (o->send_queue_count > 0) {
+        int slot = o->send_queue[o->send_queue_start];
+        o->send_queue_start = (o->send_queue_start + 1) % o->batch_size;
+        o->send_queue_count--;
+        
+        struct io_uring_sqe *sqe = BIoUring_GetSqe(&o->uring);
+        ASSERT_FORCE(sqe)
+        
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags = (o->send_queue_count > 0 ? IOSQE_IO_HARDLINK : 0);
+        sqe->fd = o->fd;
+        sqe->addr = (uintptr_t)(o->send_bufs + (size_t)slot * o->frame_mtu);
+        sqe->len = o->send_lens[slot];
+        sqe->user_data = uring_user_data(URING_OP_SEND, slot);
+        
+        o->send_inflight++;
+    }
+}
+
+static void uring_submit_job_handler (BTap *o)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    
+    uring_prep_sends(o);
+    
+    // submit everything queued since the last submission
+    if (!BIoUring_Submit(&o->uring, 0)) {
+        report_error(o);
+        return;
+    }
+}
+
+static void uring_report (BTap *o)
+{
+    while (o->recv_done_count > 0) {
+        int slot = o->recv_done[o->recv_done_start];
+        struct BTap_recv_slot *s = &o->recv_slots[slot];
+        ASSERT(s->state == RECV_SLOT_DONE)
+        
+        // remove from done queue
+        o->recv_done_start = (o->recv_done_start + 1) % o->batch_size;
+        o->recv_done_count--;
+        
+        // release slot
+        s->state = RECV_SLOT_FREE;
+        o->recv_free[o->recv_free_count++] = slot;
+        
+        if (s->result < 0) {
+            BLog(BLOG_ERROR, "read failed (%d)", -s->result);
+            report_error(o);
+            return;
+        }
+        
+        ASSERT_FORCE(s->result <= o->frame_mtu)
+        
+        count_read(s->result);
+        
+        // return buffer to user
+        o->batch_recv_handler(o->batch_recv_user, s->data, s->result);
+    }
+}
+
+static void uring_fd_handler (BTap *o, int events)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    
+    // Completions are collected here, or when waiting for a send buffer.
+    // Packets are only reported from here or from a job, never from within
+    // the user's own processing (e.g. when sending).
+    uring_harvest(o);
+    
+    uring_report(o);
+}
+
+static int uring_wait_send_buffer (BTap *o)
+{
+    while (o->send_free_count == 0) {
+        // make sure the writes holding the buffers are submitted
+        uring_prep_sends(o);
+        ASSERT(o->send_inflight > 0)
+        
+        if (!BIoUring_Submit(&o->uring, 1)) {
+            return 0;
+        }
+        
+        uring_harvest(o);
+    }
+    
+    // completed receives were collected too, report them from a job since
+    // the ring won't be signalled for them again
+    if (o->recv_done_count > 0) {
+        BPending_Set(&o->recv_job);
+    }
+    
+    return 1;
+}
+
+static void uring_send (BTap *o, uint8_t *data, int data_len)
+{
+    // All send buffers are in use until their completions are collected.
+    // Wait for the device to take the earlier packets rather than writing
+    // this one directly, which could overtake them.
+    if (o->send_free_count == 0 && !uring_wait_send_buffer(o)) {
+        // the submit job will fail too and report the error
+        BPending_Set(&o->submit_job);
+        return;
+    }
+    
+    // copy packet into a send buffer
+    int slot = o->send_free[--o->send_free_count];
+    uint8_t *buf = o->send_bufs + (size_t)slot * o->frame_mtu;
+    memcpy(buf, data, data_len);
+    o->send_lens[slot] = data_len;
+    
+    // queue it behind earlier packets
+    o->send_queue[(o->send_queue_start + o->send_queue_count) % o->batch_size] = slot;
+    o->send_queue_count++;
+    
+    // submit together with other requests
+    BPending_Set(&o->submit_job);
+}
+
+static int init_uring (BTap *o)
+{
+    int n = o->batch_size;
+    
+    // leave room for receives, sends and cancellations of receives
+    if (!BIoUring_Init(&o->uring, 2 * n)) {
+        goto fail0;
+    }
+    
+    // init ring file descriptor object
+    BFileDescriptor_Init(&o->uring_bfd, BIoUring_GetFd(&o->uring), (BFileDescriptor_handler)uring_fd_handler, o);
+    if (!BReactor_AddFileDescriptor(o->reactor, &o->uring_bfd)) {
+        BLog(BLOG_ERROR, "BReactor_AddFileDescriptor failed");
+        goto fail1;
+    }
+    BReactor_SetFileDescriptorEvents(o->reactor, &o->uring_bfd, BREACTOR_READ);
+    
+    // allocate receive slots
+    if (!(o->recv_slots = (struct BTap_recv_slot *)BAllocArray(n, sizeof(o->recv_slots[0])))) {
+        goto fail2;
+    }
+    if (!(o->recv_free = (int *)BAllocArray(n, sizeof(o->recv_free[0])))) {
+        goto fail3;
+    }
+    if (!(o->recv_done = (int *)BAllocArray(n, sizeof(o->recv_done[0])))) {
+        goto fail4;
+    }
+    
+    // allocate send buffers
+    if (!(o->send_bufs = (uint8_t *)BAllocArray(n, o->frame_mtu))) {
+        goto fail5;
+    }
+    if (!(o->send_lens = (int *)BAllocArray(n, sizeof(o->send_lens[0])))) {
+        goto fail6;
+    }
+    if (!(o->send_free = (int *)BAllocArray(n, sizeof(o->send_free[0])))) {
+        goto fail7;
+    }
+    if (!(o->send_queue = (int *)BAllocArray(n, sizeof(o->send_queue[0])))) {
+        goto fail8;
+    }
+    
+    // all slots are free
+    for (int i = 0; i < n; i++) {
+        o->recv_slots[i].state = RECV_SLOT_FREE;
+        o->recv_free[i] = n - 1 - i;
+        o->send_free[i] = n - 1 - i;
+    }
+    o->recv_free_count = n;
+    o->recv_done_start = 0;
+    o->recv_done_count = 0;
+    o->send_free_count = n;
+    o->send_queue_start = 0;
+    o->send_queue_count = 0;
+    o->send_inflight = 0;
+    
+    // init submit job
+    BPending_Init(&o->submit_job, BReactor_PendingGroup(o->reactor), (BPending_handler)uring_submit_job_handler, o);
+    
+    return 1;
+    
+fail8:
+    BFree(o->send_free);
+fail7:
+    BFree(o->send_lens);
+fail6:
+    BFree(o->send_bufs);
+fail5:
+    BFree(o->recv_done);
+fail4:
+    BFree(o->recv_free);
+fail3:
+    BFree(o->recv_slots);
+fail2:
+    BReactor_RemoveFileDescriptor(o->reactor, &o->uring_bfd);
+fail1:
+    BIoUring_Free(&o->uring);
+fail0:
+    return 0;
+}
+
+static void free_uring (BTap *o)
+{
+    // push out queued writes
+    uring_prep_sends(o);
+    if (!BIoUring_Submit(&o->uring, 0)) {
+        BLog(BLOG_ERROR, "failed to submit queued requests");
+    }
+    
+    // cancel receives; the kernel must be done with the user's buffers
+    // before we return
+    for (int i = 0; i < o->batch_size; i++) {
+        if (o->recv_slots[i].state == RECV_SLOT_INFLIGHT) {
+            struct io_uring_sqe *sqe = BIoUring_GetSqe(&o->uring);
+            ASSERT_FORCE(sqe)
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = uring_user_data(URING_OP_RECV, i);
+            sqe->user_data = uring_user_data(URING_OP_CANCEL, i);
+        }
+    }
+    
+    // submit the cancellations and wait for all requests to complete
+    while (BIoUring_GetNumInflight(&o->uring) > 0) {
+        if (!BIoUring_Submit(&o->uring, 1)) {
+            BLog(BLOG_ERROR, "failed to wait for requests");
+            break;
+        }
+        while (BIoUring_PeekCqe(&o->uring)) {
+            BIoUring_SeenCqe(&o->uring);
+        }
+    }
+    
+    // free submit job
+    BPending_Free(&o->submit_job);
+    
+    // free buffers
+    BFree(o->send_queue);
+    BFree(o->send_free);
+    BFree(o->send_lens);
+    BFree(o->send_bufs);
+    BFree(o->recv_done);
+    BFree(o->recv_free);
+    BFree(o->recv_slots);
+    
+    // free ring
+    BReactor_RemoveFileDescriptor(o->reactor, &o->uring_bfd);
+    BIoUring_Free(&o->uring);
+}
+
+#endif
+
+static void recv_job_handler (BTap *o)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->batch_recv_handler)
+    
+#ifdef BADVPN_USE_IO_URING
+    // report receives collected while waiting for a send buffer
+    if (o->use_uring) {
+        uring_report(o);
+        return;
+    }
+#endif
+    
+    batch_read(o);
+}
+
+static int init_batching (BTap *o)
+{
+    // allocate queue of receive buffers
+    if (!(o->recv_queue = (uint8_t **)BAllocArray(o->batch_size, sizeof(o->recv_queue[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail0;
+    }
+    o->recv_queue_start = 0;
+    o->recv_queue_count = 0;
+    o->in_batch_read = 0;
+    
+    // init receive job
+    BPending_Init(&o->recv_job, BReactor_PendingGroup(o->reactor), (BPending_handler)recv_job_handler, o);
+    
+#ifdef BADVPN_USE_IO_URING
+    // use io_uring when batching, if the kernel supports it
+    o->use_uring = 0;
+    if (o->batch_size > 1) {
+        if (init_uring(o)) {
+            o->use_uring = 1;
+        } else {
+            BLog(BLOG_WARNING, "io_uring unavailable, batching without it");
+        }
+    }
+#endif
+    
+    return 1;
+    
+fail0:
+    return 0;
+}
+
+static void free_batching (BTap *o)
+{
+#ifdef BADVPN_USE_IO_URING
+    if (o->use_uring) {
+        free_uring(o);
+    }
+#endif
+    
+    BPending_Free(&o->recv_job);
+    BFree(o->recv_queue);
+}
+
 static void fd_handler (BTap *o, int events)
 {
     DebugObject_Access(&o->d_obj);
@@ -157,15 +678,18 @@ static void fd_handler (BTap *o, int events)
         BLog(BLOG_WARNING, "device fd reports error?");
     }
     
+    if (o->batch_recv_handler) {
+        if (events&BREACTOR_READ) {
+            batch_read(o);
+        }
+        return;
+    }
+    
     if (events&BREACTOR_READ) do {
         ASSERT(o->output_packet)
         
         // try reading into the buffer
-#ifdef __APPLE__
-        int bytes = read_tun_header(o->fd, o->output_packet, o->frame_mtu);
-#else
-        int bytes = read(o->fd, o->output_packet, o->frame_mtu);
-#endif
+        int bytes = read_packet(o, o->output_packet);
         if (bytes < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // retry later
@@ -178,6 +702,8 @@ static void fd_handler (BTap *o, int events)
         
         ASSERT_FORCE(bytes <= o->frame_mtu)
         
+        count_read(bytes);
+        
         // set no output packet
         o->output_packet = NULL;
         
@@ -204,28 +730,16 @@ void output_handler_recv (BTap *o, uint8_t *data)
     ASSERT(data)
     ASSERT(!o->output_packet)
     
-#ifdef BADVPN_USE_WINAPI
+    ASSERT(!o->batch_recv_handler)
     
-    memset(&o->recv_olap.olap, 0, sizeof(o->recv_olap.olap));
-    
-    // read
-    BOOL res = ReadFile(o->device, data, o->frame_mtu, NULL, &o->recv_olap.olap);
-    if (res == FALSE && GetLastError() != ERROR_IO_PENDING) {
-        BLog(BLOG_ERROR, "ReadFile failed (%u)", GetLastError());
-        report_error(o);
-        return;
-    }
+#ifdef BADVPN_USE_WINAPI
     
-    o->output_packet = data;
+    start_read(o, data);
     
 #else
     
     // attempt read
-#ifdef __APPLE__
-    int bytes = read_tun_header(o->fd, data, o->frame_mtu);
-#else
-    int bytes = read(o->fd, data, o->frame_mtu);
-#endif
+    int bytes = read_packet(o, data);
     if (bytes < 0) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // retry later in fd_handler
@@ -243,6 +757,8 @@ void output_handler_recv (BTap *o, uint8_t *data)
     
     ASSERT_FORCE(bytes <= o->frame_mtu)
     
+    count_read(bytes);
+    
     PacketRecvInterface_Done(&o->output, bytes);
     
 #endif
@@ -256,6 +772,8 @@ int BTap_Init (BTap *o, BReactor *reactor, char *devname, BTap_handler_error han
     init_data.dev_type = tun ? BTAP_DEV_TUN : BTAP_DEV_TAP;
     init_data.init_type = BTAP_INIT_STRING;
     init_data.init.string = devname;
+    init_data.multi_queue = 0;
+    init_data.batch_size = 1;
     
     return BTap_Init2(o, reactor, init_data, handler_error, handler_error_user);
 }
@@ -263,15 +781,32 @@ int BTap_Init (BTap *o, BReactor *reactor, char *devname, BTap_handler_error han
 int BTap_Init2 (BTap *o, BReactor *reactor, struct BTap_init_data init_data, BTap_handler_error handler_error, void *handler_error_user)
 {
     ASSERT(init_data.dev_type == BTAP_DEV_TUN || init_data.dev_type == BTAP_DEV_TAP)
+    ASSERT(init_data.multi_queue == 0 || init_data.multi_queue == 1)
+    ASSERT(init_data.batch_size >= 1)
+    ASSERT(init_data.batch_size <= BTAP_MAX_BATCH_SIZE)
+    
+    if (init_data.multi_queue) {
+        #ifdef BADVPN_LINUX
+        if (init_data.init_type != BTAP_INIT_STRING || !init_data.init.string) {
+            BLog(BLOG_ERROR, "multi-queue device requires a device name");
+            return 0;
+        }
+        #else
+        BLog(BLOG_ERROR, "multi-queue devices are only supported on Linux");
+        return 0;
+        #endif
+    }
     
     // init arguments
     o->reactor = reactor;
     o->handler_error = handler_error;
     o->handler_error_user = handler_error_user;
+    o->batch_size = init_data.batch_size;
     
     #ifdef BADVPN_USE_WINAPI
     
     ASSERT(init_data.init_type == BTAP_INIT_STRING)
+    ASSERT(init_data.batch_size == 1)
     
     // parse device specification
     
@@ -417,6 +952,14 @@ fail0:
             } else {
                 ifr.ifr_flags |= IFF_TAP;
             }
+            if (init_data.multi_queue) {
+                #ifdef IFF_MULTI_QUEUE
+                ifr.ifr_flags |= IFF_MULTI_QUEUE;
+                #else
+                BLog(BLOG_ERROR, "multi-queue devices are not supported by the kernel headers");
+                goto fail1;
+                #endif
+            }
             if (init_data.init.string) {
                 snprintf(ifr.ifr_name, IFNAMSIZ, "%s", init_data.init.string);
             }
@@ -573,8 +1116,15 @@ fail0:
     }
     o->poll_events = 0;
     
+    // init batching
+    if (!init_batching(o)) {
+        goto fail2;
+    }
+    
     goto success;
     
+fail2:
+    BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
 fail1:
     if (o->close_fd) {
         ASSERT_FORCE(close(o->fd) == 0)
@@ -591,6 +1141,9 @@ success:
     // set no output packet
     o->output_packet = NULL;
     
+    // no batch receiving until enabled
+    o->batch_recv_handler = NULL;
+    
     DebugError_Init(&o->d_err, BReactor_PendingGroup(o->reactor));
     DebugObject_Init(&o->d_obj);
     return 1;
@@ -626,6 +1179,9 @@ void BTap_Free (BTap *o)
     
 #else
     
+    // free batching
+    free_batching(o);
+    
     // free BFileDescriptor
     BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
     
@@ -685,6 +1241,13 @@ void BTap_Send (BTap *o, uint8_t *data, int data_len)
     
 #else
     
+#ifdef BADVPN_USE_IO_URING
+    if (o->use_uring) {
+        uring_send(o, data, data_len);
+        return;
+    }
+#endif
+    
 #ifdef __APPLE__
     int bytes = write_tun_header(o->fd, data, data_len);
 #else
@@ -708,3 +1271,62 @@ PacketRecvInterface * BTap_GetOutput (BTap *o)
     
     return &o->output;
 }
+
+int BTap_GetBatchSize (BTap *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return o->batch_size;
+}
+
+void BTap_EnableBatchRecv (BTap *o, BTap_handler_batch_recv handler, void *user)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(handler)
+    ASSERT(!o->batch_recv_handler)
+    ASSERT(!o->output_packet)
+    
+    o->batch_recv_handler = handler;
+    o->batch_recv_user = user;
+}
+
+void BTap_BatchRecvPost (BTap *o, uint8_t *data)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->batch_recv_handler)
+    ASSERT(data)
+    
+#ifdef BADVPN_USE_WINAPI
+    
+    ASSERT(!o->output_packet)
+    
+    start_read(o, data);
+    
+#else
+    
+#ifdef BADVPN_USE_IO_URING
+    if (o->use_uring) {
+        ASSERT(o->recv_free_count > 0)
+        
+        // submit a read into a free slot
+        int slot = o->recv_free[--o->recv_free_count];
+        o->recv_slots[slot].data = data;
+        uring_prep_recv(o, slot);
+        return;
+    }
+#endif
+    
+    ASSERT(o->recv_queue_count < o->batch_size)
+    
+    // append buffer to queue
+    o->recv_queue[(o->recv_queue_start + o->recv_queue_count) % o->batch_size] = data;
+    o->recv_queue_count++;
+    
+    // read into it soon, unless we're reading already
+    if (!o->in_batch_read) {
+        BPending_Set(&o->recv_job);
+    }
+    
+#endif
+}
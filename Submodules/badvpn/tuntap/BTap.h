@@ -51,8 +51,15 @@
 #include <system/BReactor.h>
 #include <flow/PacketRecvInterface.h>
 
+#ifdef BADVPN_USE_IO_URING
+#include <system/BIoUring.h>
+#endif
+
 #define BTAP_ETHERNET_HEADER_LENGTH 14
 
+// maximum number of packets handled in one batch (see BTap_init_data.batch_size)
+#define BTAP_MAX_BATCH_SIZE 1024
+
 /**
  * Handler called when an error occurs on the device.
  * The object must be destroyed from the job context of this
@@ -62,6 +69,25 @@
  */
 typedef void (*BTap_handler_error) (void *used);
 
+/**
+ * Handler called when a packet has been received into a buffer given with
+ * {@link BTap_BatchRecvPost}. The buffer is no longer used by the device.
+ * The object must not be freed from within this handler.
+ * 
+ * @param user as in {@link BTap_EnableBatchRecv}
+ * @param data the buffer, as given to {@link BTap_BatchRecvPost}
+ * @param data_len length of the packet. Will be >=0 and <=MTU.
+ */
+typedef void (*BTap_handler_batch_recv) (void *user, uint8_t *data, int data_len);
+
+#ifdef BADVPN_USE_IO_URING
+struct BTap_recv_slot {
+    uint8_t *data;
+    int state;
+    int result;
+};
+#endif
+
 typedef struct {
     BReactor *reactor;
     BTap_handler_error handler_error;
@@ -69,6 +95,9 @@ typedef struct {
     int frame_mtu;
     PacketRecvInterface output;
     uint8_t *output_packet;
+    int batch_size;
+    BTap_handler_batch_recv batch_recv_handler;
+    void *batch_recv_user;
     
 #ifdef BADVPN_USE_WINAPI
     HANDLE device;
@@ -79,6 +108,33 @@ typedef struct {
     int fd;
     BFileDescriptor bfd;
     int poll_events;
+    
+    // batching
+    uint8_t **recv_queue;
+    int recv_queue_start;
+    int recv_queue_count;
+    int in_batch_read;
+    BPending recv_job;
+#ifdef BADVPN_USE_IO_URING
+    int use_uring;
+    BIoUring uring;
+    BFileDescriptor uring_bfd;
+    BPending submit_job;
+    struct BTap_recv_slot *recv_slots;
+    int *recv_free;
+    int recv_free_count;
+    int *recv_done;
+    int recv_done_start;
+    int recv_done_count;
+    uint8_t *send_bufs;
+    int *send_lens;
+    int *send_free;
+    int send_free_count;
+    int *send_queue;
+    int send_queue_start;
+    int send_queue_count;
+    int send_inflight;
+#endif
 #endif
     
     DebugError d_err;
@@ -126,6 +182,8 @@ struct BTap_init_data {
             int mtu;
         } fd;
     } init;
+    int multi_queue;
+    int batch_size;
 };
 
 /**
@@ -153,6 +211,18 @@ struct BTap_init_data {
  *                  and init_data.init.fd.mtu must be set to the largest IP packet or
  *                  Ethernet frame supported, for a TUN or TAP device, respectively.
  *                  File descriptor initialization is not supported on Windows.
+ *                  init_data.multi_queue must be 0 or 1. If it is 1, the device is
+ *                  opened as one queue of a multi-queue TUN/TAP device (IFF_MULTI_QUEUE),
+ *                  so that several BTap objects (possibly in different processes) can
+ *                  attach to the same device and the kernel will distribute packets among
+ *                  them by flow. This requires BTAP_INIT_STRING with a non-NULL device
+ *                  name, and is only supported on Linux.
+ *                  init_data.batch_size is the maximum number of packets to process per
+ *                  device event. Must be >=1 and <=BTAP_MAX_BATCH_SIZE, and must be 1 on
+ *                  Windows. If it is greater than 1, up to that many receive buffers may be
+ *                  given to the device at once (see {@link BTap_EnableBatchRecv}), and on
+ *                  Linux, if io_uring is available, receives and sends are submitted to
+ *                  the kernel in batches with one system call per batch.
  * @param handler_error error handler function
  * @param handler_error_user value passed to error handler
  * @return 1 on success, 0 on failure
@@ -177,6 +247,10 @@ int BTap_GetMTU (BTap *o);
 /**
  * Sends a packet to the device.
  * Any errors will be reported via a job.
+ * When batching with io_uring, the packet is copied and written together
+ * with other packets sent before the next job is dispatched. Packets are
+ * written in the order they were sent. If all send buffers are in use, this
+ * waits for the device to take the packets written earlier.
  * 
  * @param o the object
  * @param data packet to send
@@ -193,4 +267,38 @@ void BTap_Send (BTap *o, uint8_t *data, int data_len);
  */
 PacketRecvInterface * BTap_GetOutput (BTap *o);
 
+/**
+ * Returns the batch size, as given in {@link BTap_Init2}.
+ * 
+ * @param o the object
+ * @return batch size
+ */
+int BTap_GetBatchSize (BTap *o);
+
+/**
+ * Switches receiving to the batched receive interface. Instead of
+ * receiving one packet at a time via {@link BTap_GetOutput}, the user gives
+ * the device up to batch size buffers with {@link BTap_BatchRecvPost}, and
+ * the device returns each of them via the handler as soon as a packet has
+ * been read into it. Packets are reported in the order they were read.
+ * Must be called at most once, and the interface returned by
+ * {@link BTap_GetOutput} must not be used.
+ * 
+ * @param o the object
+ * @param handler handler called when a packet is received
+ * @param user value passed to handler
+ */
+void BTap_EnableBatchRecv (BTap *o, BTap_handler_batch_recv handler, void *user);
+
+/**
+ * Gives the device a buffer to receive a packet into.
+ * {@link BTap_EnableBatchRecv} must have been called, and fewer than batch size
+ * buffers may be held by the device. The buffer must remain valid until it is
+ * returned via the handler or the device is freed.
+ * 
+ * @param o the object
+ * @param data buffer of at least MTU bytes
+ */
+void BTap_BatchRecvPost (BTap *o, uint8_t *data);
+
 #endif
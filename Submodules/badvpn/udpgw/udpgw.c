@@ -44,9 +44,11 @@
 #include <misc/balloc.h>
 #include <misc/compare.h>
 #include <misc/print_macros.h>
+#include <misc/minmax.h>
 #include <structure/LinkedList1.h>
 #include <structure/BAVL.h>
 #include <base/BLog.h>
+#include <base/BMetrics.h>
 #include <system/BReactor.h>
 #include <system/BNetwork.h>
 #include <system/BConnection.h>
@@ -54,12 +56,15 @@
 #include <system/BSignal.h>
 #include <flow/PacketProtoDecoder.h>
 #include <flow/PacketPassFairQueue.h>
-#include <flow/PacketStreamSender.h>
 #include <flow/PacketProtoFlow.h>
 #include <flow/SinglePacketBuffer.h>
 
 #ifndef BADVPN_USE_WINAPI
+#include <pthread.h>
 #include <base/BLog_syslog.h>
+#include <base/BLog_async.h>
+#include <system/BMetricsServer.h>
+#include <system/BThreadSignal.h>
 #include <arpa/nameser.h>
 #include <resolv.h>
 #endif
@@ -73,14 +78,82 @@
 
 #define DNS_UPDATE_TIME 2000
 
+struct worker;
+
+// Usage count of a local UDP port, in the bucket list of ports with the
+// same count.
+struct local_port {
+    int refs;
+    int bucket;
+    int prev;
+    int next;
+};
+
+// Ports with the same usage count. Non-empty buckets are kept in a list
+// in increasing order of counts, so the least used ports are always at the
+// front and counts change in O(1).
+struct local_port_bucket {
+    int refs;
+    int first;
+    int prev;
+    int next;
+};
+
+// Index of a worker's local UDP port range for one address type. Connections
+// to the same remote address (or IP address, with --unique-local-ports) must
+// all be bound to different ports; these are kept in groups.
+struct local_ports {
+    int num_ports;
+    struct local_port *ports;
+    struct local_port_bucket *buckets;
+    int first_bucket;
+    int free_bucket;
+    BAVL groups_tree;
+};
+
+struct local_ports_group {
+    BAddr addr;
+    BAVLNode groups_tree_node;
+    BAVL ports_tree;
+    LinkedList1 cons_list;
+};
+
+struct listener {
+    struct worker *worker;
+    BListener listener;
+};
+
+// Everything a thread serves clients with. Threads share nothing but the
+// configuration, which isn't changed after startup.
+struct worker {
+    int index;
+    BReactor reactor;
+    struct listener listeners[MAX_LISTEN_ADDRS];
+    int num_listeners;
+    LinkedList1 clients_list;
+    int num_clients;
+    int local_udp_port_offset;
+    int local_udp_num_ports;
+    int local_udp_ip6_port_offset;
+    int local_udp_ip6_num_ports;
+    struct local_ports local_ports;
+    struct local_ports local_ip6_ports;
+    BAddr dns_addr;
+    btime_t last_dns_update_time;
+    #ifndef BADVPN_USE_WINAPI
+    BThreadSignal quit_signal;
+    pthread_t thread;
+    #endif
+};
+
 struct client {
+    struct worker *worker;
     BConnection con;
     BAddr addr;
     BTimer disconnect_timer;
     PacketProtoDecoder recv_decoder;
     PacketPassInterface recv_if;
     PacketPassFairQueue send_queue;
-    PacketStreamSender send_sender;
     BAVL connections_tree;
     LinkedList1 connections_list;
     int num_connections;
@@ -95,8 +168,9 @@ struct connection {
     BAddr orig_addr;
     const uint8_t *first_data;
     int first_data_len;
-    btime_t last_use_time;
     int closing;
+    btime_t start_time;
+    uint64_t num_packets;
     BPending first_job;
     BufferWriter *send_if;
     PacketProtoFlow send_ppflow;
@@ -105,6 +179,9 @@ struct connection {
         struct {
             BDatagram udp_dgram;
             int local_port_index;
+            struct local_ports_group *ports_group;
+            BAVLNode ports_group_tree_node;
+            LinkedList1Node ports_group_list_node;
             BufferWriter udp_send_writer;
             PacketBuffer udp_send_buffer;
             SinglePacketBuffer udp_recv_buffer;
@@ -126,6 +203,7 @@ struct {
     #ifndef BADVPN_USE_WINAPI
     char *logger_syslog_facility;
     char *logger_syslog_ident;
+    int logger_async;
     #endif
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
@@ -140,6 +218,12 @@ struct {
     int local_udp_ip6_num_ports;
     char *local_udp_ip6_addr;
     int unique_local_ports;
+    int udp_batch_size;
+    int udp_gso;
+    int threads;
+    #ifndef BADVPN_USE_WINAPI
+    char *metrics_socket;
+    #endif
 } options;
 
 // MTUs
@@ -156,42 +240,68 @@ BAddr local_udp_addr;
 // local UDP/IPv6 port range, if options.local_udp_ip6_num_ports>=0
 BAddr local_udp_ip6_addr;
 
-// DNS forwarding
-BAddr dns_addr;
-btime_t last_dns_update_time;
+// workers; the first one runs in the main thread
+struct worker *workers;
+int num_workers;
 
-// reactor
-BReactor ss;
+#ifndef BADVPN_USE_WINAPI
+// metrics server, if enabled; served by the first worker
+BMetricsServer metrics_server;
+#endif
 
-// listeners
-BListener listeners[MAX_LISTEN_ADDRS];
-int num_listeners;
+static const uint64_t metric_connection_rate_bounds[] = {1, 10, 100, 1000, 10000, 100000};
 
-// clients
-LinkedList1 clients_list;
-int num_clients;
+static BMetric metric_clients = BMETRIC_GAUGE_INIT("badvpn_udpgw_clients", "Connected clients.");
+static BMetric metric_connections = BMETRIC_GAUGE_INIT("badvpn_udpgw_connections", "Open UDP connections.");
+static BMetric metric_connection_rate = BMETRIC_HISTOGRAM_INIT("badvpn_udpgw_connection_packets_per_second", "Packets in both directions per second of a UDP connection's lifetime (taken as at least one second), observed when it is closed.", metric_connection_rate_bounds, 1);
+static BMetric metric_udp_sent_packets = BMETRIC_COUNTER_INIT("badvpn_udpgw_udp_sent_packets_total", "Packets from clients sent to UDP.");
+static BMetric metric_udp_sent_bytes = BMETRIC_COUNTER_INIT("badvpn_udpgw_udp_sent_bytes_total", "Bytes from clients sent to UDP.");
+static BMetric metric_udp_send_drops = BMETRIC_COUNTER_INIT("badvpn_udpgw_udp_send_drops_total", "Packets from clients dropped because a UDP send buffer was full.");
+static BMetric metric_udp_received_packets = BMETRIC_COUNTER_INIT("badvpn_udpgw_udp_received_packets_total", "Packets received from UDP for clients.");
+static BMetric metric_udp_received_bytes = BMETRIC_COUNTER_INIT("badvpn_udpgw_udp_received_bytes_total", "Bytes received from UDP for clients.");
 
 static void print_help (const char *name);
 static void print_version (void);
 static int parse_arguments (int argc, char *argv[]);
 static int process_arguments (void);
+static int worker_init (struct worker *w, int index);
+static void worker_free (struct worker *w);
+#ifndef BADVPN_USE_WINAPI
+static void * worker_thread (void *arg);
+static void worker_quit_signal_handler (BThreadSignal *thread_signal);
+#endif
 static void signal_handler (void *unused);
-static void listener_handler (BListener *listener);
+static void listener_handler (struct listener *l);
 static void client_free (struct client *client);
 static void client_logfunc (struct client *client);
-static void client_log (struct client *client, int level, const char *fmt, ...);
+static void client_log_message (struct client *client, int level, const char *fmt, ...);
+#define client_log(o, level, ...) BLOG_IF_COMPILED((level), client_log_message((o), (level), __VA_ARGS__))
 static void client_disconnect_timer_handler (struct client *client);
 static void client_connection_handler (struct client *client, int event);
 static void client_decoder_handler_error (struct client *client);
 static void client_recv_if_handler_send (struct client *client, uint8_t *data, int data_len);
-static int get_local_num_ports (int addr_type);
-static BAddr get_local_addr (int addr_type);
-static uint8_t * build_port_usage_array_and_find_least_used_connection (BAddr remote_addr, struct connection **out_con);
+static int get_local_num_ports (struct worker *w, int addr_type);
+static BAddr get_local_addr (struct worker *w, int addr_type);
+static void local_ports_link_bucket (struct local_ports *lp, int b, int prev, int next);
+static void local_ports_move_port (struct local_ports *lp, int port, int to_bucket);
+static int local_ports_init (struct local_ports *lp, int num_ports);
+static void local_ports_free (struct local_ports *lp);
+static void local_ports_ref (struct local_ports *lp, int port);
+static void local_ports_unref (struct local_ports *lp, int port);
+static struct local_ports * get_local_ports (struct worker *w, int addr_type);
+static struct local_ports_group * find_local_ports_group (struct local_ports *lp, BAddr remote_addr);
+static struct connection * find_least_used_connection (struct local_ports_group *group);
 static void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr orig_addr, const uint8_t *data, int data_len);
 static void connection_free (struct connection *con);
 static void connection_logfunc (struct connection *con);
-static void connection_log (struct connection *con, int level, const char *fmt, ...);
+static void connection_log_message (struct connection *con, int level, const char *fmt, ...);
+#define connection_log(o, level, ...) BLOG_IF_COMPILED((level), connection_log_message((o), (level), __VA_ARGS__))
+static int connection_init_udp_ifs (struct connection *con);
+static void connection_free_udp_ifs (struct connection *con);
 static void connection_free_udp (struct connection *con);
+static int connection_add_to_local_ports (struct connection *con);
+static void connection_remove_from_local_ports (struct connection *con);
+static void connection_set_used (struct connection *con);
 static void connection_first_job_handler (struct connection *con);
 static void connection_send_to_client (struct connection *con, uint8_t flags, const uint8_t *data, int data_len);
 static int connection_send_to_udp (struct connection *con, const uint8_t *data, int data_len);
@@ -201,7 +311,9 @@ static void connection_dgram_handler_event (struct connection *con, int event);
 static void connection_udp_recv_if_handler_send (struct connection *con, uint8_t *data, int data_len);
 static struct connection * find_connection (struct client *client, uint16_t conid);
 static int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2);
-static void maybe_update_dns (void);
+static int int_comparator (void *unused, int *v1, int *v2);
+static int baddr_comparator (void *unused, BAddr *v1, BAddr *v2);
+static void maybe_update_dns (struct worker *w);
 
 int main (int argc, char **argv)
 {
@@ -257,6 +369,13 @@ int main (int argc, char **argv)
         }
     }
     
+    #ifndef BADVPN_USE_WINAPI
+    // pass messages to the logger from a background thread
+    if (options.logger_async && !BLog_StartAsync(BLOG_ASYNC_DEFAULT_BUFFER_SIZE)) {
+        BLog(BLOG_WARNING, "BLog_StartAsync failed, logging synchronously");
+    }
+    #endif
+    
     BLog(BLOG_NOTICE, "initializing "GLOBAL_PRODUCT_NAME" "PROGRAM_NAME" "GLOBAL_VERSION);
     
     // initialize network
@@ -281,57 +400,75 @@ int main (int argc, char **argv)
     // init time
     BTime_Init();
     
-    // init DNS forwarding
-    BAddr_InitNone(&dns_addr);
-    last_dns_update_time = INT64_MIN;
-    maybe_update_dns();
-    
-    // init reactor
-    if (!BReactor_Init(&ss)) {
-        BLog(BLOG_ERROR, "BReactor_Init failed");
+    // allocate workers
+    num_workers = options.threads;
+    if (!(workers = (struct worker *)BAllocArray(num_workers, sizeof(workers[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
         goto fail1;
     }
     
-    // setup signal handler
-    if (!BSignal_Init(&ss, signal_handler, NULL)) {
+    // init workers
+    int num_inited = 0;
+    while (num_inited < num_workers) {
+        if (!worker_init(&workers[num_inited], num_inited)) {
+            BLog(BLOG_ERROR, "worker_init failed");
+            goto fail2;
+        }
+        num_inited++;
+    }
+    
+    // setup signal handler; do it before starting threads so that they
+    // inherit the blocked signals
+    if (!BSignal_Init(&workers[0].reactor, signal_handler, NULL)) {
         BLog(BLOG_ERROR, "BSignal_Init failed");
         goto fail2;
     }
     
-    // initialize listeners
-    num_listeners = 0;
-    while (num_listeners < num_listen_addrs) {
-        if (!BListener_Init(&listeners[num_listeners], listen_addrs[num_listeners], &ss, &listeners[num_listeners], (BListener_handler)listener_handler)) {
-            BLog(BLOG_ERROR, "Listener_Init failed");
+    // start threads for the other workers
+    int num_started = 1;
+    #ifndef BADVPN_USE_WINAPI
+    while (num_started < num_workers) {
+        if (pthread_create(&workers[num_started].thread, NULL, worker_thread, &workers[num_started]) != 0) {
+            BLog(BLOG_ERROR, "pthread_create failed");
             goto fail3;
         }
-        num_listeners++;
+        num_started++;
     }
     
-    // init clients list
-    LinkedList1_Init(&clients_list);
-    num_clients = 0;
+    // init metrics server
+    if (options.metrics_socket && !BMetricsServer_Init(&metrics_server, options.metrics_socket, &workers[0].reactor)) {
+        BLog(BLOG_ERROR, "BMetricsServer_Init failed");
+        goto fail3;
+    }
+    #endif
     
     // enter event loop
     BLog(BLOG_NOTICE, "entering event loop");
-    BReactor_Exec(&ss);
+    BReactor_Exec(&workers[0].reactor);
     
-    // free clients
-    while (!LinkedList1_IsEmpty(&clients_list)) {
-        struct client *client = UPPER_OBJECT(LinkedList1_GetFirst(&clients_list), struct client, clients_list_node);
-        client_free(client);
+    #ifndef BADVPN_USE_WINAPI
+    // free metrics server
+    if (options.metrics_socket) {
+        BMetricsServer_Free(&metrics_server);
     }
 fail3:
-    // free listeners
-    while (num_listeners > 0) {
-        num_listeners--;
-        BListener_Free(&listeners[num_listeners]);
+    // stop and wait for other workers
+    while (num_started > 1) {
+        num_started--;
+        ASSERT_FORCE(BThreadSignal_Thread_Signal(&workers[num_started].quit_signal))
+        ASSERT_FORCE(pthread_join(workers[num_started].thread, NULL) == 0)
     }
+    #endif
+    
     // finish signal handling
     BSignal_Finish();
 fail2:
-    // free reactor
-    BReactor_Free(&ss);
+    // free workers
+    while (num_inited > 0) {
+        num_inited--;
+        worker_free(&workers[num_inited]);
+    }
+    BFree(workers);
 fail1:
     // free logger
     BLog(BLOG_NOTICE, "exiting");
@@ -356,9 +493,13 @@ void print_help (const char *name)
         "            [--syslog-facility <string>]\n"
         "            [--syslog-ident <string>]\n"
         "        )\n"
+        "        [--logger-async]\n"
         #endif
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
+        #ifndef BADVPN_USE_WINAPI
+        "        [--metrics-socket <path>]\n"
+        #endif
         "        [--listen-addr <addr>] ...\n"
         "        [--udp-mtu <bytes>]\n"
         "        [--max-clients <number>]\n"
@@ -367,6 +508,11 @@ void print_help (const char *name)
         "        [--local-udp-addrs <addr> <num_ports>]\n"
         "        [--local-udp-ip6-addrs <addr> <num_ports>]\n"
         "        [--unique-local-ports]\n"
+        #ifndef BADVPN_USE_WINAPI
+        "        [--udp-batch-size <number>]\n"
+        "        [--udp-gso]\n"
+        "        [--threads <number>]\n"
+        #endif
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
         name
     );
@@ -389,6 +535,8 @@ int parse_arguments (int argc, char *argv[])
     #ifndef BADVPN_USE_WINAPI
     options.logger_syslog_facility = "daemon";
     options.logger_syslog_ident = argv[0];
+    options.logger_async = 0;
+    options.metrics_socket = NULL;
     #endif
     options.loglevel = -1;
     for (int i = 0; i < BLOG_NUM_CHANNELS; i++) {
@@ -402,6 +550,9 @@ int parse_arguments (int argc, char *argv[])
     options.local_udp_num_ports = -1;
     options.local_udp_ip6_num_ports = -1;
     options.unique_local_ports = 0;
+    options.udp_batch_size = DEFAULT_UDP_BATCH_SIZE;
+    options.udp_gso = 0;
+    options.threads = 1;
     
     int i;
     for (i = 1; i < argc; i++) {
@@ -449,6 +600,17 @@ int parse_arguments (int argc, char *argv[])
             options.logger_syslog_ident = argv[i + 1];
             i++;
         }
+        else if (!strcmp(arg, "--logger-async")) {
+            options.logger_async = 1;
+        }
+        else if (!strcmp(arg, "--metrics-socket")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.metrics_socket = argv[i + 1];
+            i++;
+        }
         #endif
         else if (!strcmp(arg, "--loglevel")) {
             if (1 >= argc - i) {
@@ -563,6 +725,33 @@ int parse_arguments (int argc, char *argv[])
         else if (!strcmp(arg, "--unique-local-ports")) {
             options.unique_local_ports = 1;
         }
+        #ifndef BADVPN_USE_WINAPI
+        else if (!strcmp(arg, "--udp-batch-size")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.udp_batch_size = atoi(argv[i + 1])) <= 0 || options.udp_batch_size > BDATAGRAM_MAX_BATCH_SIZE) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--udp-gso")) {
+            options.udp_gso = 1;
+        }
+        else if (!strcmp(arg, "--threads")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.threads = atoi(argv[i + 1])) <= 0 || options.threads > MAX_THREADS) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        #endif
         else {
             fprintf(stderr, "unknown option: %s\n", arg);
             return 0;
@@ -615,17 +804,159 @@ int process_arguments (void)
     return 1;
 }
 
+int worker_init (struct worker *w, int index)
+{
+    w->index = index;
+    
+    // init reactor
+    if (!BReactor_Init(&w->reactor)) {
+        BLog(BLOG_ERROR, "BReactor_Init failed");
+        goto fail0;
+    }
+    
+    // init listeners; with more workers, each has its own socket
+    w->num_listeners = 0;
+    while (w->num_listeners < num_listen_addrs) {
+        struct listener *l = &w->listeners[w->num_listeners];
+        l->worker = w;
+        int res;
+        #ifndef BADVPN_USE_WINAPI
+        if (num_workers > 1) {
+            res = BListener_InitReusePort(&l->listener, listen_addrs[w->num_listeners], &w->reactor, l, (BListener_handler)listener_handler);
+        } else
+        #endif
+        {
+            res = BListener_Init(&l->listener, listen_addrs[w->num_listeners], &w->reactor, l, (BListener_handler)listener_handler);
+        }
+        if (!res) {
+            BLog(BLOG_ERROR, "Listener_Init failed");
+            goto fail1;
+        }
+        w->num_listeners++;
+    }
+    
+    #ifndef BADVPN_USE_WINAPI
+    // init quit signal, used by the main thread to stop this worker
+    if (index > 0 && !BThreadSignal_Init(&w->quit_signal, &w->reactor, worker_quit_signal_handler)) {
+        BLog(BLOG_ERROR, "BThreadSignal_Init failed");
+        goto fail1;
+    }
+    #endif
+    
+    // init clients list
+    LinkedList1_Init(&w->clients_list);
+    w->num_clients = 0;
+    
+    // split local UDP port ranges, so that workers don't bind the same ports
+    w->local_udp_port_offset = (int)((int64_t)options.local_udp_num_ports * index / num_workers);
+    w->local_udp_num_ports = (int)((int64_t)options.local_udp_num_ports * (index + 1) / num_workers) - w->local_udp_port_offset;
+    w->local_udp_ip6_port_offset = (int)((int64_t)options.local_udp_ip6_num_ports * index / num_workers);
+    w->local_udp_ip6_num_ports = (int)((int64_t)options.local_udp_ip6_num_ports * (index + 1) / num_workers) - w->local_udp_ip6_port_offset;
+    
+    // init local port indexes
+    if (options.local_udp_num_ports >= 0 && !local_ports_init(&w->local_ports, w->local_udp_num_ports)) {
+        BLog(BLOG_ERROR, "local_ports_init failed");
+        goto fail2;
+    }
+    if (options.local_udp_ip6_num_ports >= 0 && !local_ports_init(&w->local_ip6_ports, w->local_udp_ip6_num_ports)) {
+        BLog(BLOG_ERROR, "local_ports_init failed");
+        goto fail3;
+    }
+    
+    // init DNS forwarding
+    BAddr_InitNone(&w->dns_addr);
+    w->last_dns_update_time = INT64_MIN;
+    maybe_update_dns(w);
+    
+    return 1;
+    
+fail3:
+    if (options.local_udp_num_ports >= 0) {
+        local_ports_free(&w->local_ports);
+    }
+fail2:
+    #ifndef BADVPN_USE_WINAPI
+    if (index > 0) {
+        BThreadSignal_Free(&w->quit_signal);
+    }
+    #endif
+fail1:
+    while (w->num_listeners > 0) {
+        w->num_listeners--;
+        BListener_Free(&w->listeners[w->num_listeners].listener);
+    }
+    BReactor_Free(&w->reactor);
+fail0:
+    return 0;
+}
+
+void worker_free (struct worker *w)
+{
+    // free clients
+    while (!LinkedList1_IsEmpty(&w->clients_list)) {
+        struct client *client = UPPER_OBJECT(LinkedList1_GetFirst(&w->clients_list), struct client, clients_list_node);
+        client_free(client);
+    }
+    
+    // free local port indexes
+    if (options.local_udp_ip6_num_ports >= 0) {
+        local_ports_free(&w->local_ip6_ports);
+    }
+    if (options.local_udp_num_ports >= 0) {
+        local_ports_free(&w->local_ports);
+    }
+    
+    #ifndef BADVPN_USE_WINAPI
+    // free quit signal
+    if (w->index > 0) {
+        BThreadSignal_Free(&w->quit_signal);
+    }
+    #endif
+    
+    // free listeners
+    while (w->num_listeners > 0) {
+        w->num_listeners--;
+        BListener_Free(&w->listeners[w->num_listeners].listener);
+    }
+    
+    // free reactor
+    BReactor_Free(&w->reactor);
+}
+
+#ifndef BADVPN_USE_WINAPI
+
+void * worker_thread (void *arg)
+{
+    struct worker *w = arg;
+    
+    BReactor_Exec(&w->reactor);
+    
+    return NULL;
+}
+
+void worker_quit_signal_handler (BThreadSignal *thread_signal)
+{
+    struct worker *w = UPPER_OBJECT(thread_signal, struct worker, quit_signal);
+    
+    // exit event loop
+    BReactor_Quit(&w->reactor, 1);
+}
+
+#endif
+
 void signal_handler (void *unused)
 {
     BLog(BLOG_NOTICE, "termination requested");
     
-    // exit event loop
-    BReactor_Quit(&ss, 1);
+    // exit event loop; the other workers are stopped after that
+    BReactor_Quit(&workers[0].reactor, 1);
 }
 
-void listener_handler (BListener *listener)
+void listener_handler (struct listener *l)
 {
-    if (num_clients == options.max_clients) {
+    struct worker *w = l->worker;
+    
+    if (w->num_clients == options.max_clients) {
         BLog(BLOG_ERROR, "maximum number of clients reached");
         goto fail0;
     }
@@ -637,8 +968,10 @@ void listener_handler (BListener *listener)
         goto fail0;
     }
     
+    client->worker = w;
+    
     // accept client
-    if (!BConnection_Init(&client->con, BConnection_source_listener(listener, &client->addr), &ss, client, (BConnection_handler)client_connection_handler)) {
+    if (!BConnection_Init(&client->con, BConnection_source_listener(&l->listener, &client->addr), &w->reactor, client, (BConnection_handler)client_connection_handler)) {
         BLog(BLOG_ERROR, "BConnection_Init failed");
         goto fail1;
     }
@@ -656,25 +989,22 @@ void listener_handler (BListener *listener)
     
     // init disconnect timer
     BTimer_Init(&client->disconnect_timer, CLIENT_DISCONNECT_TIMEOUT, (BTimer_handler)client_disconnect_timer_handler, client);
-    BReactor_SetTimer(&ss, &client->disconnect_timer);
+    BReactor_SetTimer(&client->worker->reactor, &client->disconnect_timer);
     
     // init recv interface
-    PacketPassInterface_Init(&client->recv_if, udpgw_mtu, (PacketPassInterface_handler_send)client_recv_if_handler_send, client, BReactor_PendingGroup(&ss));
+    PacketPassInterface_Init(&client->recv_if, udpgw_mtu, (PacketPassInterface_handler_send)client_recv_if_handler_send, client, BReactor_PendingGroup(&client->worker->reactor));
     
     // init recv decoder
-    if (!PacketProtoDecoder_Init(&client->recv_decoder, BConnection_RecvAsync_GetIf(&client->con), &client->recv_if, BReactor_PendingGroup(&ss), client,
+    if (!PacketProtoDecoder_InitRing(&client->recv_decoder, BConnection_RecvAsync_GetIf(&client->con), &client->recv_if, BReactor_PendingGroup(&client->worker->reactor), CLIENT_RECV_BUFFER_SIZE, client,
         (PacketProtoDecoder_handler_error)client_decoder_handler_error
     )) {
-        BLog(BLOG_ERROR, "PacketProtoDecoder_Init failed");
+        BLog(BLOG_ERROR, "PacketProtoDecoder_InitRing failed");
         goto fail2;
     }
     
-    // init send sender
-    PacketStreamSender_Init(&client->send_sender, BConnection_SendAsync_GetIf(&client->con), pp_mtu, BReactor_PendingGroup(&ss));
-    
-    // init send queue
-    if (!PacketPassFairQueue_Init(&client->send_queue, PacketStreamSender_GetInput(&client->send_sender), BReactor_PendingGroup(&ss), 0, 1)) {
-        BLog(BLOG_ERROR, "PacketPassFairQueue_Init failed");
+    // init send queue, writing packets of many connections to the client at once
+    if (!PacketPassFairQueue_InitGather(&client->send_queue, BConnection_SendAsync_GetIf(&client->con), pp_mtu, CLIENT_SEND_GATHER_PACKETS, BReactor_PendingGroup(&client->worker->reactor), 1)) {
+        BLog(BLOG_ERROR, "PacketPassFairQueue_InitGather failed");
         goto fail3;
     }
     
@@ -691,19 +1021,19 @@ void listener_handler (BListener *listener)
     LinkedList1_Init(&client->closing_connections_list);
     
     // insert to clients list
-    LinkedList1_Append(&clients_list, &client->clients_list_node);
-    num_clients++;
+    LinkedList1_Append(&w->clients_list, &client->clients_list_node);
+    w->num_clients++;
+    BMetric_Add(&metric_clients, 1);
     
     client_log(client, BLOG_INFO, "connected");
     
     return;
     
 fail3:
-    PacketStreamSender_Free(&client->send_sender);
     PacketProtoDecoder_Free(&client->recv_decoder);
 fail2:
     PacketPassInterface_Free(&client->recv_if);
-    BReactor_RemoveTimer(&ss, &client->disconnect_timer);
+    BReactor_RemoveTimer(&client->worker->reactor, &client->disconnect_timer);
     BConnection_RecvAsync_Free(&client->con);
     BConnection_SendAsync_Free(&client->con);
     BConnection_Free(&client->con);
@@ -731,15 +1061,13 @@ void client_free (struct client *client)
     }
     
     // remove from clients list
-    LinkedList1_Remove(&clients_list, &client->clients_list_node);
-    num_clients--;
+    LinkedList1_Remove(&client->worker->clients_list, &client->clients_list_node);
+    client->worker->num_clients--;
+    BMetric_Sub(&metric_clients, 1);
     
     // free send queue
     PacketPassFairQueue_Free(&client->send_queue);
     
-    // free send sender
-    PacketStreamSender_Free(&client->send_sender);
-    
     // free recv decoder
     PacketProtoDecoder_Free(&client->recv_decoder);
     
@@ -747,7 +1075,7 @@ void client_free (struct client *client)
     PacketPassInterface_Free(&client->recv_if);
     
     // free disconnect timer
-    BReactor_RemoveTimer(&ss, &client->disconnect_timer);
+    BReactor_RemoveTimer(&client->worker->reactor, &client->disconnect_timer);
     
     // free connection interfaces
     BConnection_RecvAsync_Free(&client->con);
@@ -768,7 +1096,7 @@ void client_logfunc (struct client *client)
     BLog_Append("client (%s): ", addr);
 }
 
-void client_log (struct client *client, int level, const char *fmt, ...)
+void client_log_message (struct client *client, int level, const char *fmt, ...)
 {
     va_list vl;
     va_start(vl, fmt);
@@ -825,7 +1153,7 @@ void client_recv_if_handler_send (struct client *client, uint8_t *data, int data
     uint16_t conid = ltoh16(header.conid);
     
     // reset disconnect timer
-    BReactor_SetTimer(&ss, &client->disconnect_timer);
+    BReactor_SetTimer(&client->worker->reactor, &client->disconnect_timer);
     
     // if this is keepalive, ignore any payload
     if ((flags & UDPGW_CLIENT_FLAG_KEEPALIVE)) {
@@ -886,12 +1214,12 @@ void client_recv_if_handler_send (struct client *client, uint8_t *data, int data
         // if this is DNS, replace actual address, but keep still remember the orig_addr
         BAddr addr = orig_addr;
         if ((flags & UDPGW_CLIENT_FLAG_DNS)) {
-            maybe_update_dns();
-            if (dns_addr.type == BADDR_TYPE_NONE) {
+            maybe_update_dns(client->worker);
+            if (client->worker->dns_addr.type == BADDR_TYPE_NONE) {
                 client_log(client, BLOG_WARNING, "received DNS packet, but no DNS server available");
             } else {
                 client_log(client, BLOG_DEBUG, "received DNS");
-                addr = dns_addr;
+                addr = client->worker->dns_addr;
             }
         }
         
@@ -903,84 +1231,234 @@ void client_recv_if_handler_send (struct client *client, uint8_t *data, int data
     }
 }
 
-int get_local_num_ports (int addr_type)
+int get_local_num_ports (struct worker *w, int addr_type)
 {
     switch (addr_type) {
-        case BADDR_TYPE_IPV4: return options.local_udp_num_ports;
-        case BADDR_TYPE_IPV6: return options.local_udp_ip6_num_ports;
+        case BADDR_TYPE_IPV4: return (options.local_udp_num_ports >= 0 ? w->local_udp_num_ports : -1);
+        case BADDR_TYPE_IPV6: return (options.local_udp_ip6_num_ports >= 0 ? w->local_udp_ip6_num_ports : -1);
         default: ASSERT(0); return 0;
     }
 }
 
-BAddr get_local_addr (int addr_type)
+BAddr get_local_addr (struct worker *w, int addr_type)
 {
-    ASSERT(get_local_num_ports(addr_type) >= 0)
+    ASSERT(get_local_num_ports(w, addr_type) >= 0)
+    
+    BAddr addr;
+    int offset;
     
     switch (addr_type) {
-        case BADDR_TYPE_IPV4: return local_udp_addr;
-        case BADDR_TYPE_IPV6: return local_udp_ip6_addr;
+        case BADDR_TYPE_IPV4: addr = local_udp_addr; offset = w->local_udp_port_offset; break;
+        case BADDR_TYPE_IPV6: addr = local_udp_ip6_addr; offset = w->local_udp_ip6_port_offset; break;
         default: ASSERT(0); return BAddr_MakeNone();
     }
+    
+    // start of this worker's part of the port range
+    BAddr_SetPort(&addr, hton16(ntoh16(BAddr_GetPort(&addr)) + (uint16_t)offset));
+    
+    return addr;
 }
 
-uint8_t * build_port_usage_array_and_find_least_used_connection (BAddr remote_addr, struct connection **out_con)
+void local_ports_link_bucket (struct local_ports *lp, int b, int prev, int next)
 {
-    ASSERT(remote_addr.type == BADDR_TYPE_IPV4 || remote_addr.type == BADDR_TYPE_IPV6)
-    ASSERT(get_local_num_ports(remote_addr.type) >= 0)
+    lp->buckets[b].prev = prev;
+    lp->buckets[b].next = next;
     
-    int local_num_ports = get_local_num_ports(remote_addr.type);
+    if (prev >= 0) {
+        lp->buckets[prev].next = b;
+    } else {
+        lp->first_bucket = b;
+    }
+    if (next >= 0) {
+        lp->buckets[next].prev = b;
+    }
+}
+
+void local_ports_move_port (struct local_ports *lp, int port, int to_bucket)
+{
+    struct local_port *p = &lp->ports[port];
+    struct local_port_bucket *from = &lp->buckets[p->bucket];
+    struct local_port_bucket *to = &lp->buckets[to_bucket];
     
-    // allocate port usage array
-    uint8_t *port_usage = (uint8_t *)BAllocSize(bsize_fromint(local_num_ports));
-    if (!port_usage) {
-        return NULL;
+    // remove from current bucket
+    if (p->prev >= 0) {
+        lp->ports[p->prev].next = p->next;
+    } else {
+        from->first = p->next;
+    }
+    if (p->next >= 0) {
+        lp->ports[p->next].prev = p->prev;
+    }
+    
+    // release current bucket if it's now empty
+    if (from->first < 0) {
+        if (from->prev >= 0) {
+            lp->buckets[from->prev].next = from->next;
+        } else {
+            lp->first_bucket = from->next;
+        }
+        if (from->next >= 0) {
+            lp->buckets[from->next].prev = from->prev;
+        }
+        from->next = lp->free_bucket;
+        lp->free_bucket = p->bucket;
+    }
+    
+    // insert to new bucket
+    p->refs = to->refs;
+    p->bucket = to_bucket;
+    p->prev = -1;
+    p->next = to->first;
+    if (to->first >= 0) {
+        lp->ports[to->first].prev = port;
+    }
+    to->first = port;
+}
+
+int local_ports_init (struct local_ports *lp, int num_ports)
+{
+    ASSERT(num_ports >= 0)
+    
+    lp->num_ports = num_ports;
+    
+    // allocate ports
+    if (!(lp->ports = (struct local_port *)BAllocArray(num_ports, sizeof(lp->ports[0])))) {
+        goto fail0;
+    }
+    
+    // allocate buckets; there can be at most one per port, plus one while
+    // a port is being moved
+    if (!(lp->buckets = (struct local_port_bucket *)BAllocArray((size_t)num_ports + 1, sizeof(lp->buckets[0])))) {
+        goto fail1;
+    }
+    
+    // put all buckets except the first to the free list
+    lp->free_bucket = -1;
+    for (int b = num_ports; b > 0; b--) {
+        lp->buckets[b].next = lp->free_bucket;
+        lp->free_bucket = b;
+    }
+    
+    // all ports start unused in the first bucket
+    lp->first_bucket = -1;
+    lp->buckets[0].refs = 0;
+    lp->buckets[0].first = -1;
+    local_ports_link_bucket(lp, 0, -1, -1);
+    for (int i = num_ports - 1; i >= 0; i--) {
+        lp->ports[i].refs = 0;
+        lp->ports[i].bucket = 0;
+        lp->ports[i].prev = -1;
+        lp->ports[i].next = lp->buckets[0].first;
+        if (lp->buckets[0].first >= 0) {
+            lp->ports[lp->buckets[0].first].prev = i;
+        }
+        lp->buckets[0].first = i;
+    }
+    
+    // init groups tree
+    BAVL_Init(&lp->groups_tree, OFFSET_DIFF(struct local_ports_group, addr, groups_tree_node), (BAVL_comparator)baddr_comparator, NULL);
+    
+    return 1;
+    
+fail1:
+    BFree(lp->ports);
+fail0:
+    return 0;
+}
+
+void local_ports_free (struct local_ports *lp)
+{
+    ASSERT(BAVL_IsEmpty(&lp->groups_tree))
+    
+    BFree(lp->buckets);
+    BFree(lp->ports);
+}
+
+void local_ports_ref (struct local_ports *lp, int port)
+{
+    ASSERT(port >= 0)
+    ASSERT(port < lp->num_ports)
+    
+    int b = lp->ports[port].bucket;
+    int next = lp->buckets[b].next;
+    
+    // find or make the bucket for the incremented count
+    if (next < 0 || lp->buckets[next].refs != lp->buckets[b].refs + 1) {
+        int nb = lp->free_bucket;
+        ASSERT(nb >= 0)
+        lp->free_bucket = lp->buckets[nb].next;
+        lp->buckets[nb].refs = lp->buckets[b].refs + 1;
+        lp->buckets[nb].first = -1;
+        local_ports_link_bucket(lp, nb, b, next);
+        next = nb;
     }
     
-    // zero array
-    memset(port_usage, 0, local_num_ports);
+    local_ports_move_port(lp, port, next);
+}
+
+void local_ports_unref (struct local_ports *lp, int port)
+{
+    ASSERT(port >= 0)
+    ASSERT(port < lp->num_ports)
+    ASSERT(lp->ports[port].refs > 0)
+    
+    int b = lp->ports[port].bucket;
+    int prev = lp->buckets[b].prev;
+    
+    // find or make the bucket for the decremented count
+    if (prev < 0 || lp->buckets[prev].refs != lp->buckets[b].refs - 1) {
+        int nb = lp->free_bucket;
+        ASSERT(nb >= 0)
+        lp->free_bucket = lp->buckets[nb].next;
+        lp->buckets[nb].refs = lp->buckets[b].refs - 1;
+        lp->buckets[nb].first = -1;
+        local_ports_link_bucket(lp, nb, prev, b);
+        prev = nb;
+    }
     
-    struct connection *least_con = NULL;
+    local_ports_move_port(lp, port, prev);
+}
+
+struct local_ports * get_local_ports (struct worker *w, int addr_type)
+{
+    switch (addr_type) {
+        case BADDR_TYPE_IPV4: return (options.local_udp_num_ports >= 0 ? &w->local_ports : NULL);
+        case BADDR_TYPE_IPV6: return (options.local_udp_ip6_num_ports >= 0 ? &w->local_ip6_ports : NULL);
+        default: ASSERT(0); return NULL;
+    }
+}
+
+struct local_ports_group * find_local_ports_group (struct local_ports *lp, BAddr remote_addr)
+{
+    ASSERT(remote_addr.type == BADDR_TYPE_IPV4 || remote_addr.type == BADDR_TYPE_IPV6)
+    
+    // with unique local ports, all connections to the same IP address are in a group
+    if (options.unique_local_ports) {
+        BAddr_SetPort(&remote_addr, 0);
+    }
+    
+    BAVLNode *tree_node = BAVL_LookupExact(&lp->groups_tree, &remote_addr);
+    if (!tree_node) {
+        return NULL;
+    }
     
-    // flag inappropriate ports (those with the same remote address)
-    for (LinkedList1Node *ln = LinkedList1_GetFirst(&clients_list); ln; ln = LinkedList1Node_Next(ln)) {
-        struct client *client = UPPER_OBJECT(ln, struct client, clients_list_node);
+    return UPPER_OBJECT(tree_node, struct local_ports_group, groups_tree_node);
+}
+
+struct connection * find_least_used_connection (struct local_ports_group *group)
+{
+    // connections are ordered by last use; skip those with data in flight
+    for (LinkedList1Node *ln = LinkedList1_GetFirst(&group->cons_list); ln; ln = LinkedList1Node_Next(ln)) {
+        struct connection *con = UPPER_OBJECT(ln, struct connection, ports_group_list_node);
+        ASSERT(con->ports_group == group)
+        ASSERT(!con->closing)
         
-        for (LinkedList1Node *ln2 = LinkedList1_GetFirst(&client->connections_list); ln2; ln2 = LinkedList1Node_Next(ln2)) {
-            struct connection *con = UPPER_OBJECT(ln2, struct connection, connections_list_node);
-            ASSERT(con->client == client)
-            ASSERT(!con->closing)
-            
-            if (con->addr.type != remote_addr.type || con->local_port_index < 0) {
-                continue;
-            }
-            ASSERT(con->local_port_index < local_num_ports)
-            
-            if (options.unique_local_ports) {
-                BIPAddr ip1;
-                BIPAddr ip2;
-                BAddr_GetIPAddr(&con->addr, &ip1);
-                BAddr_GetIPAddr(&remote_addr, &ip2);
-                if (!BIPAddr_Compare(&ip1, &ip2)) {
-                    continue;
-                }
-            } else {
-                if (!BAddr_Compare(&con->addr, &remote_addr)) {
-                    continue;
-                }
-            }
-            
-            port_usage[con->local_port_index] = 1;
-            
-            if (!PacketPassFairQueueFlow_IsBusy(&con->send_qflow)) {
-                if (!least_con || con->last_use_time < least_con->last_use_time) {
-                    least_con = con;
-                }
-            }
+        if (!PacketPassFairQueueFlow_IsBusy(&con->send_qflow)) {
+            return con;
         }
     }
     
-    *out_con = least_con;
-    return port_usage;
+    return NULL;
 }
 
 void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr orig_addr, const uint8_t *data, int data_len)
@@ -1008,44 +1486,42 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     con->first_data = data;
     con->first_data_len = data_len;
     
-    // set last use time
-    con->last_use_time = btime_gettime();
-    
     // set not closing
     con->closing = 0;
     
+    // init statistics
+    con->start_time = btime_gettime();
+    con->num_packets = 0;
+    
     // init first job
-    BPending_Init(&con->first_job, BReactor_PendingGroup(&ss), (BPending_handler)connection_first_job_handler, con);
+    BPending_Init(&con->first_job, BReactor_PendingGroup(&client->worker->reactor), (BPending_handler)connection_first_job_handler, con);
     BPending_Set(&con->first_job);
     
     // init send queue flow
     PacketPassFairQueueFlow_Init(&con->send_qflow, &client->send_queue);
     
-    // init send PacketProtoFlow
-    if (!PacketProtoFlow_Init(&con->send_ppflow, udpgw_mtu, CONNECTION_CLIENT_BUFFER_SIZE, PacketPassFairQueueFlow_GetInput(&con->send_qflow), BReactor_PendingGroup(&ss))) {
+    // init send PacketProtoFlow, with space for a whole batch of received datagrams
+    int client_buffer_size = bmax_int(CONNECTION_CLIENT_BUFFER_SIZE, options.udp_batch_size);
+    if (!PacketProtoFlow_Init(&con->send_ppflow, udpgw_mtu, client_buffer_size, PacketPassFairQueueFlow_GetInput(&con->send_qflow), BReactor_PendingGroup(&client->worker->reactor))) {
         client_log(client, BLOG_ERROR, "PacketProtoFlow_Init failed");
         goto fail1;
     }
     con->send_if = PacketProtoFlow_GetInput(&con->send_ppflow);
     
     // init UDP dgram
-    if (!BDatagram_Init(&con->udp_dgram, addr.type, &ss, con, (BDatagram_handler)connection_dgram_handler_event)) {
+    if (!BDatagram_Init(&con->udp_dgram, addr.type, &client->worker->reactor, con, (BDatagram_handler)connection_dgram_handler_event)) {
         client_log(client, BLOG_ERROR, "BDatagram_Init failed");
         goto fail2;
     }
     
     con->local_port_index = -1;
+    con->ports_group = NULL;
     
-    int local_num_ports = get_local_num_ports(addr.type);
+    struct local_ports *lp = get_local_ports(client->worker, addr.type);
     
-    if (local_num_ports >= 0) {
-        // build port usage array, find least used connection
-        struct connection *least_con;
-        uint8_t *port_usage = build_port_usage_array_and_find_least_used_connection(addr, &least_con);
-        if (!port_usage) {
-            client_log(client, BLOG_ERROR, "build_port_usage_array failed");
-            goto failed;
-        }
+    if (lp) {
+        // find connections with the same remote address, whose ports we can't use
+        struct local_ports_group *group = find_local_ports_group(lp, addr);
         
         // set SO_REUSEADDR
         if (!BDatagram_SetReuseAddr(&con->udp_dgram, 1)) {
@@ -1054,39 +1530,42 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
         }
         
         // get starting local address
-        BAddr local_addr = get_local_addr(addr.type);
+        BAddr local_addr = get_local_addr(client->worker, addr.type);
         
-        // try different ports
-        for (int i = 0; i < local_num_ports; i++) {
-            // skip inappropriate ports
-            if (port_usage[i]) {
-                continue;
-            }
-            
-            BAddr bind_addr = local_addr;
-            BAddr_SetPort(&bind_addr, hton16(ntoh16(BAddr_GetPort(&bind_addr)) + (uint16_t)i));
-            if (BDatagram_Bind(&con->udp_dgram, bind_addr)) {
-                // remember which port we're using
-                con->local_port_index = i;
-                goto cont;
+        // try different ports, least used first
+        for (int b = lp->first_bucket; b >= 0; b = lp->buckets[b].next) {
+            for (int i = lp->buckets[b].first; i >= 0; i = lp->ports[i].next) {
+                // skip inappropriate ports
+                if (group && BAVL_LookupExact(&group->ports_tree, &i)) {
+                    continue;
+                }
+                
+                BAddr bind_addr = local_addr;
+                BAddr_SetPort(&bind_addr, hton16(ntoh16(BAddr_GetPort(&bind_addr)) + (uint16_t)i));
+                if (BDatagram_Bind(&con->udp_dgram, bind_addr)) {
+                    // remember which port we're using
+                    con->local_port_index = i;
+                    goto cont;
+                }
             }
         }
         
         // try closing an unused connection with the same remote addr
+        struct connection *least_con = (group ? find_least_used_connection(group) : NULL);
         if (!least_con) {
             goto failed;
         }
         
         ASSERT(least_con->addr.type == addr.type)
         ASSERT(least_con->local_port_index >= 0)
-        ASSERT(least_con->local_port_index < local_num_ports)
+        ASSERT(least_con->local_port_index < lp->num_ports)
         ASSERT(!PacketPassFairQueueFlow_IsBusy(&least_con->send_qflow))
         
         int i = least_con->local_port_index;
         
         BLog(BLOG_INFO, "closing connection for its remote address");
         
-        // close the offending connection
+        // close the offending connection; this may free the group
         connection_close(least_con);
         
         // try binding to its port
@@ -1101,7 +1580,6 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     failed:
         client_log(client, BLOG_WARNING, "failed to bind to any local address; proceeding regardless");
     cont:;
-        BFree(port_usage);
     }
     
     // set UDP dgram send address
@@ -1110,27 +1588,35 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     BDatagram_SetSendAddrs(&con->udp_dgram, addr, ipaddr);
     
     // init UDP dgram interfaces
-    BDatagram_SendAsync_Init(&con->udp_dgram, options.udp_mtu);
-    BDatagram_RecvAsync_Init(&con->udp_dgram, options.udp_mtu);
+    if (!connection_init_udp_ifs(con)) {
+        client_log(client, BLOG_ERROR, "connection_init_udp_ifs failed");
+        goto fail3;
+    }
     
     // init UDP writer
-    BufferWriter_Init(&con->udp_send_writer, options.udp_mtu, BReactor_PendingGroup(&ss));
+    BufferWriter_Init(&con->udp_send_writer, options.udp_mtu, BReactor_PendingGroup(&client->worker->reactor));
     
     // init UDP buffer
-    if (!PacketBuffer_Init(&con->udp_send_buffer, BufferWriter_GetOutput(&con->udp_send_writer), BDatagram_SendAsync_GetIf(&con->udp_dgram), CONNECTION_UDP_BUFFER_SIZE, BReactor_PendingGroup(&ss))) {
+    if (!PacketBuffer_Init(&con->udp_send_buffer, BufferWriter_GetOutput(&con->udp_send_writer), BDatagram_SendAsync_GetIf(&con->udp_dgram), CONNECTION_UDP_BUFFER_SIZE, BReactor_PendingGroup(&client->worker->reactor))) {
         client_log(client, BLOG_ERROR, "PacketBuffer_Init failed");
         goto fail4;
     }
     
     // init UDP recv interface
-    PacketPassInterface_Init(&con->udp_recv_if, options.udp_mtu, (PacketPassInterface_handler_send)connection_udp_recv_if_handler_send, con, BReactor_PendingGroup(&ss));
+    PacketPassInterface_Init(&con->udp_recv_if, options.udp_mtu, (PacketPassInterface_handler_send)connection_udp_recv_if_handler_send, con, BReactor_PendingGroup(&client->worker->reactor));
     
     // init UDP recv buffer
-    if (!SinglePacketBuffer_Init(&con->udp_recv_buffer, BDatagram_RecvAsync_GetIf(&con->udp_dgram), &con->udp_recv_if, BReactor_PendingGroup(&ss))) {
+    if (!SinglePacketBuffer_Init(&con->udp_recv_buffer, BDatagram_RecvAsync_GetIf(&con->udp_dgram), &con->udp_recv_if, BReactor_PendingGroup(&client->worker->reactor))) {
         client_log(client, BLOG_ERROR, "SinglePacketBuffer_Init failed");
         goto fail5;
     }
     
+    // insert to local port index
+    if (con->local_port_index >= 0 && !connection_add_to_local_ports(con)) {
+        client_log(client, BLOG_ERROR, "connection_add_to_local_ports failed");
+        goto fail6;
+    }
+    
     // insert to client's connections tree
     ASSERT_EXECUTE(BAVL_Insert(&client->connections_tree, &con->connections_tree_node, NULL))
     
@@ -1139,18 +1625,21 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     
     // increment number of connections
     client->num_connections++;
+    BMetric_Add(&metric_connections, 1);
     
     connection_log(con, BLOG_DEBUG, "initialized");
     
     return;
     
+fail6:
+    SinglePacketBuffer_Free(&con->udp_recv_buffer);
 fail5:
     PacketPassInterface_Free(&con->udp_recv_if);
     PacketBuffer_Free(&con->udp_send_buffer);
 fail4:
     BufferWriter_Free(&con->udp_send_writer);
-    BDatagram_RecvAsync_Free(&con->udp_dgram);
-    BDatagram_SendAsync_Free(&con->udp_dgram);
+    connection_free_udp_ifs(con);
+fail3:
     BDatagram_Free(&con->udp_dgram);
 fail2:
     PacketProtoFlow_Free(&con->send_ppflow);
@@ -1173,6 +1662,7 @@ void connection_free (struct connection *con)
     } else {
         // decrement number of connections
         client->num_connections--;
+        BMetric_Sub(&metric_connections, 1);
         
         // remove from client's connections list
         LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
@@ -1193,6 +1683,10 @@ void connection_free (struct connection *con)
     // free first job
     BPending_Free(&con->first_job);
     
+    // observe packet rate
+    btime_t lifetime = bmax_int64(btime_gettime() - con->start_time, 1000);
+    BMetric_Observe(&metric_connection_rate, con->num_packets * 1000 / lifetime);
+    
     // free structure
     free(con);
 }
@@ -1208,7 +1702,7 @@ void connection_logfunc (struct connection *con)
     }
 }
 
-void connection_log (struct connection *con, int level, const char *fmt, ...)
+void connection_log_message (struct connection *con, int level, const char *fmt, ...)
 {
     va_list vl;
     va_start(vl, fmt);
@@ -1216,8 +1710,42 @@ void connection_log (struct connection *con, int level, const char *fmt, ...)
     va_end(vl);
 }
 
+int connection_init_udp_ifs (struct connection *con)
+{
+    #ifndef BADVPN_USE_WINAPI
+    if (options.udp_batch_size > 1) {
+        // init batched send interface
+        if (!BDatagram_SendAsync_InitBatch(&con->udp_dgram, options.udp_mtu, options.udp_batch_size, options.udp_gso)) {
+            return 0;
+        }
+        
+        // init batched receive interface
+        if (!BDatagram_RecvAsync_InitBatch(&con->udp_dgram, options.udp_mtu, options.udp_batch_size)) {
+            BDatagram_SendAsync_Free(&con->udp_dgram);
+            return 0;
+        }
+        
+        return 1;
+    }
+    #endif
+    
+    BDatagram_SendAsync_Init(&con->udp_dgram, options.udp_mtu);
+    BDatagram_RecvAsync_Init(&con->udp_dgram, options.udp_mtu);
+    
+    return 1;
+}
+
+void connection_free_udp_ifs (struct connection *con)
+{
+    BDatagram_RecvAsync_Free(&con->udp_dgram);
+    BDatagram_SendAsync_Free(&con->udp_dgram);
+}
+
 void connection_free_udp (struct connection *con)
 {
+    // remove from local port index
+    connection_remove_from_local_ports(con);
+    
     // free UDP receive buffer
     SinglePacketBuffer_Free(&con->udp_recv_buffer);
     
@@ -1231,13 +1759,87 @@ void connection_free_udp (struct connection *con)
     BufferWriter_Free(&con->udp_send_writer);
     
     // free UDP dgram interfaces
-    BDatagram_RecvAsync_Free(&con->udp_dgram);
-    BDatagram_SendAsync_Free(&con->udp_dgram);
+    connection_free_udp_ifs(con);
     
     // free UDP dgram
     BDatagram_Free(&con->udp_dgram);
 }
 
+int connection_add_to_local_ports (struct connection *con)
+{
+    struct worker *w = con->client->worker;
+    struct local_ports *lp = get_local_ports(w, con->addr.type);
+    ASSERT(lp)
+    ASSERT(con->local_port_index >= 0)
+    ASSERT(con->local_port_index < lp->num_ports)
+    
+    // find group, or create one if this is the first connection to the address
+    struct local_ports_group *group = find_local_ports_group(lp, con->addr);
+    if (!group) {
+        if (!(group = (struct local_ports_group *)malloc(sizeof(*group)))) {
+            return 0;
+        }
+        group->addr = con->addr;
+        if (options.unique_local_ports) {
+            BAddr_SetPort(&group->addr, 0);
+        }
+        BAVL_Init(&group->ports_tree, OFFSET_DIFF(struct connection, local_port_index, ports_group_tree_node), (BAVL_comparator)int_comparator, NULL);
+        LinkedList1_Init(&group->cons_list);
+        ASSERT_EXECUTE(BAVL_Insert(&lp->groups_tree, &group->groups_tree_node, NULL))
+    }
+    
+    // insert to group; the port must not be used by another connection in it
+    ASSERT_EXECUTE(BAVL_Insert(&group->ports_tree, &con->ports_group_tree_node, NULL))
+    LinkedList1_Append(&group->cons_list, &con->ports_group_list_node);
+    con->ports_group = group;
+    
+    // count port usage
+    local_ports_ref(lp, con->local_port_index);
+    
+    return 1;
+}
+
+void connection_remove_from_local_ports (struct connection *con)
+{
+    struct local_ports_group *group = con->ports_group;
+    if (!group) {
+        return;
+    }
+    
+    struct local_ports *lp = get_local_ports(con->client->worker, con->addr.type);
+    ASSERT(lp)
+    
+    // uncount port usage
+    local_ports_unref(lp, con->local_port_index);
+    
+    // remove from group
+    BAVL_Remove(&group->ports_tree, &con->ports_group_tree_node);
+    LinkedList1_Remove(&group->cons_list, &con->ports_group_list_node);
+    con->ports_group = NULL;
+    
+    // free group if it's empty
+    if (LinkedList1_IsEmpty(&group->cons_list)) {
+        BAVL_Remove(&lp->groups_tree, &group->groups_tree_node);
+        free(group);
+    }
+}
+
+void connection_set_used (struct connection *con)
+{
+    struct client *client = con->client;
+    ASSERT(!con->closing)
+    
+    // move connection to front
+    LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
+    LinkedList1_Append(&client->connections_list, &con->connections_list_node);
+    
+    // same in the group, so that it's the last to be closed for its port
+    if (con->ports_group) {
+        LinkedList1_Remove(&con->ports_group->cons_list, &con->ports_group_list_node);
+        LinkedList1_Append(&con->ports_group->cons_list, &con->ports_group_list_node);
+    }
+}
+
 void connection_first_job_handler (struct connection *con)
 {
     ASSERT(!con->closing)
@@ -1305,24 +1907,20 @@ void connection_send_to_client (struct connection *con, uint8_t flags, const uin
 
 int connection_send_to_udp (struct connection *con, const uint8_t *data, int data_len)
 {
-    struct client *client = con->client;
     ASSERT(!con->closing)
     ASSERT(data_len >= 0)
     ASSERT(data_len <= options.udp_mtu)
     
     connection_log(con, BLOG_DEBUG, "from client %d bytes", data_len);
     
-    // set last use time
-    con->last_use_time = btime_gettime();
-    
-    // move connection to front
-    LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
-    LinkedList1_Append(&client->connections_list, &con->connections_list_node);
+    // move connection to front of the lists it's in
+    connection_set_used(con);
     
     // get buffer location
     uint8_t *out;
     if (!BufferWriter_StartPacket(&con->udp_send_writer, &out)) {
         connection_log(con, BLOG_ERROR, "out of UDP buffer");
+        BMetric_Add(&metric_udp_send_drops, 1);
         return 0;
     }
     
@@ -1332,6 +1930,10 @@ int connection_send_to_udp (struct connection *con, const uint8_t *data, int dat
     // submit written message
     BufferWriter_EndPacket(&con->udp_send_writer, data_len);
     
+    con->num_packets++;
+    BMetric_Add(&metric_udp_sent_packets, 1);
+    BMetric_Add(&metric_udp_sent_bytes, data_len);
+    
     return 1;
 }
 
@@ -1350,6 +1952,7 @@ void connection_close (struct connection *con)
     
     // decrement number of connections
     client->num_connections--;
+    BMetric_Sub(&metric_connections, 1);
     
     // remove from client's connections list
     LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
@@ -1396,19 +1999,18 @@ void connection_dgram_handler_event (struct connection *con, int event)
 
 void connection_udp_recv_if_handler_send (struct connection *con, uint8_t *data, int data_len)
 {
-    struct client *client = con->client;
     ASSERT(!con->closing)
     ASSERT(data_len >= 0)
     ASSERT(data_len <= options.udp_mtu)
     
     connection_log(con, BLOG_DEBUG, "from UDP %d bytes", data_len);
     
-    // set last use time
-    con->last_use_time = btime_gettime();
+    con->num_packets++;
+    BMetric_Add(&metric_udp_received_packets, 1);
+    BMetric_Add(&metric_udp_received_bytes, data_len);
     
-    // move connection to front
-    LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
-    LinkedList1_Append(&client->connections_list, &con->connections_list_node);
+    // move connection to front of the lists it's in
+    connection_set_used(con);
     
     // accept packet
     PacketPassInterface_Done(&con->udp_recv_if);
@@ -1435,14 +2037,24 @@ int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2)
     return B_COMPARE(*v1, *v2);
 }
 
-void maybe_update_dns (void)
+int int_comparator (void *unused, int *v1, int *v2)
+{
+    return B_COMPARE(*v1, *v2);
+}
+
+int baddr_comparator (void *unused, BAddr *v1, BAddr *v2)
+{
+    return BAddr_CompareOrder(v1, v2);
+}
+
+void maybe_update_dns (struct worker *w)
 {
 #ifndef BADVPN_USE_WINAPI
     btime_t now = btime_gettime();
-    if (now < btime_add(last_dns_update_time, DNS_UPDATE_TIME)) {
+    if (now < btime_add(w->last_dns_update_time, DNS_UPDATE_TIME)) {
         return;
     }
-    last_dns_update_time = now;
+    w->last_dns_update_time = now;
     BLog(BLOG_DEBUG, "update dns");
     
     if (res_init() != 0) {
@@ -1458,16 +2070,16 @@ void maybe_update_dns (void)
     BAddr addr;
     BAddr_InitIPv4(&addr, _res.nsaddr_list[0].sin_addr.s_addr, hton16(53));
     
-    if (!BAddr_Compare(&addr, &dns_addr)) {
+    if (!BAddr_Compare(&addr, &w->dns_addr)) {
         char str[BADDR_MAX_PRINT_LEN];
         BAddr_Print(&addr, str);
         BLog(BLOG_INFO, "using DNS server %s", str);
     }
     
-    dns_addr = addr;
+    w->dns_addr = addr;
     return;
     
 fail:
-    BAddr_InitNone(&dns_addr);
+    BAddr_InitNone(&w->dns_addr);
 #endif
 }
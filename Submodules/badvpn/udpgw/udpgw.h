@@ -36,10 +36,21 @@
 // connection buffer size for sending to client, in packets
 #define CONNECTION_CLIENT_BUFFER_SIZE 1
 
+// maximum number of packets (of different connections) sent to a client
+// with one write
+#define CLIENT_SEND_GATHER_PACKETS 64
+
 // connection buffer size for sending to UDP, in packets
 #define CONNECTION_UDP_BUFFER_SIZE 1
 
-// maximum number of clients
+// number of datagrams sent and received by one system call on a UDP socket,
+// 1 to not batch
+#define DEFAULT_UDP_BATCH_SIZE 1
+
+// maximum number of threads serving clients
+#define MAX_THREADS 256
+
+// maximum number of clients (per thread)
 #define DEFAULT_MAX_CLIENTS 3
 
 // maximum connections for client
@@ -50,3 +61,7 @@
 
 // SO_SNDBFUF socket option for clients, 0 to not set
 #define CLIENT_DEFAULT_SOCKET_SEND_BUFFER 1048576
+
+// size of the circular buffer for decoding packets from a client; it is
+// raised to hold at least one packet of maximum size
+#define CLIENT_RECV_BUFFER_SIZE 131072
@@ -38,6 +38,10 @@
 
 #include <generated/blog_channel_UdpGwClient.h>
 
+// size of the circular buffer for decoding packets from the server; it is
+// raised to hold at least one packet of maximum size
+#define RECV_BUFFER_SIZE 65536
+
 static int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2);
 static int conaddr_comparator (void *unused, struct UdpGwClient_conaddr *v1, struct UdpGwClient_conaddr *v2);
 static void free_server (UdpGwClient *o);
@@ -563,8 +567,8 @@ int UdpGwClient_ConnectServer (UdpGwClient *o, StreamPassInterface *send_if, Str
     PacketPassInterface_Init(&o->recv_if, o->udpgw_mtu, (PacketPassInterface_handler_send)recv_interface_handler_send, o, BReactor_PendingGroup(o->reactor));
     
     // init receive decoder
-    if (!PacketProtoDecoder_Init(&o->recv_decoder, recv_if, &o->recv_if, BReactor_PendingGroup(o->reactor), o, (PacketProtoDecoder_handler_error)decoder_handler_error)) {
-        BLog(BLOG_ERROR, "PacketProtoDecoder_Init failed");
+    if (!PacketProtoDecoder_InitRing(&o->recv_decoder, recv_if, &o->recv_if, BReactor_PendingGroup(o->reactor), RECV_BUFFER_SIZE, o, (PacketProtoDecoder_handler_error)decoder_handler_error)) {
+        BLog(BLOG_ERROR, "PacketProtoDecoder_InitRing failed");
         goto fail1;
     }
     